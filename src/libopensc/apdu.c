@@ -24,9 +24,16 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
+#include "probes.h"
 
 /*********************************************************************/
 /*   low level APDU handling functions                               */
@@ -172,7 +179,11 @@ static int sc_apdu2bytes(sc_context_t *ctx, const sc_apdu_t *apdu,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len, int is_out)
 {
 	size_t blen = len * 5 + 128;
-	char   *buf = malloc(blen);
+	char   *buf;
+
+	if (!SC_LOG_ENABLED(ctx, level))
+		return;
+	buf = malloc(blen);
 	if (buf == NULL)
 		return;
 
@@ -203,14 +214,36 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	if (nbuf == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	/* encode the APDU in the buffer */
-	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS)
+	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS) {
+		free(nbuf);
 		return SC_ERROR_INTERNAL;
+	}
 	*buf = nbuf;
 	*len = nlen;
 
 	return SC_SUCCESS;
 }
 
+int sc_apdu_get_octets_buf(sc_context_t *ctx, const sc_apdu_t *apdu, u8 *buf,
+	size_t buflen, size_t *len, unsigned int proto)
+{
+	size_t	nlen;
+
+	if (apdu == NULL || buf == NULL || len == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	if (nlen > buflen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (sc_apdu2bytes(ctx, apdu, proto, buf, nlen) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	*len = nlen;
+
+	return SC_SUCCESS;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -228,7 +261,8 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	if (len <= apdu->resplen)
 		apdu->resplen = len;
 
-	if (apdu->resplen != 0)
+	/* nothing to copy if the reader received in place */
+	if (apdu->resplen != 0 && apdu->resp != buf)
 		memcpy(apdu->resp, buf, apdu->resplen);
 
 	return SC_SUCCESS;
@@ -371,25 +405,433 @@ sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/*********************************************************************/
+/*   APDU statistics                                                 */
+/*********************************************************************/
+
+#if defined(__GNUC__)
+#define STATS_ADD(var, val)	__sync_fetch_and_add(&(var), (val))
+#else
+#define STATS_ADD(var, val)	((var) += (val))
+#endif
+
+unsigned long long _sc_monotonic_usec(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+
+	if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&now))
+		return (unsigned long long) GetTickCount() * 1000;
+	return (unsigned long long) now.QuadPart * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+#ifndef _WIN32
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+#endif
+}
+
+static int
+sc_latency_bucket(unsigned long long usec)
+{
+	int bucket;
+
+	for (bucket = 0; bucket < SC_LATENCY_BUCKETS - 1; bucket++)
+		if (usec < SC_LATENCY_BUCKET_LIMIT(bucket))
+			break;
+	return bucket;
+}
+
+static void
+sc_account_apdu(struct sc_reader *reader, const struct sc_apdu *apdu,
+		unsigned long long usec, int rv)
+{
+	struct sc_reader_stats *stats = reader->stats;
+	struct sc_ins_stats *ins = &stats->ins[apdu->ins & 0xFF];
+	unsigned long max;
+	int bucket = sc_latency_bucket(usec);
+
+	STATS_ADD(stats->apdus, 1);
+	STATS_ADD(stats->total_usec, usec);
+	STATS_ADD(stats->histogram[bucket], 1);
+	STATS_ADD(ins->count, 1);
+	STATS_ADD(ins->total_usec, usec);
+	/* a lost update of the maximum only loses a sample */
+	max = ins->max_usec;
+	if (usec > max)
+		ins->max_usec = (unsigned long) usec;
+
+	if (rv != SC_SUCCESS) {
+		STATS_ADD(stats->errors, 1);
+		return;
+	}
+	STATS_ADD(stats->bytes_sent, sc_apdu_get_length(apdu, reader->active_protocol));
+	STATS_ADD(stats->bytes_received, apdu->resplen + 2);
+}
+
+unsigned long long
+sc_lock_stats_begin(void)
+{
+	return _sc_monotonic_usec();
+}
+
+unsigned long long
+sc_lock_stats_wait(struct sc_lock_stats *stats, unsigned long long start)
+{
+	unsigned long long now = _sc_monotonic_usec();
+	unsigned long long usec = now - start;
+
+	STATS_ADD(stats->acquired, 1);
+	STATS_ADD(stats->wait_usec, usec);
+	STATS_ADD(stats->wait_histogram[sc_latency_bucket(usec)], 1);
+	if (usec >= SC_LOCK_CONTENDED_USEC)
+		STATS_ADD(stats->contended, 1);
+	if (usec > stats->max_wait_usec)
+		stats->max_wait_usec = (unsigned long) usec;
+	return now;
+}
+
+void
+sc_lock_stats_release(struct sc_lock_stats *stats, unsigned long long acquired)
+{
+	unsigned long long usec = _sc_monotonic_usec() - acquired;
+
+	STATS_ADD(stats->hold_usec, usec);
+	STATS_ADD(stats->hold_histogram[sc_latency_bucket(usec)], 1);
+	if (usec > stats->max_hold_usec)
+		stats->max_hold_usec = (unsigned long) usec;
+}
+
+/*********************************************************************/
+/*   APDU trace                                                      */
+/*********************************************************************/
+
+#if defined(__GNUC__)
+#define TRACE_NEXT(var)		__sync_fetch_and_add(&(var), 1)
+#define TRACE_BARRIER()		__sync_synchronize()
+#else
+#define TRACE_NEXT(var)		((var)++)
+#define TRACE_BARRIER()
+#endif
+
+struct sc_apdu_trace_record {
+	/* 0 while the record is being written, else its number + 1 */
+	unsigned long seq;
+	unsigned long sec, usec;
+	const struct sc_reader *reader;
+	u8 direction, flags, stored;
+	unsigned short sw, len;
+	u8 data[SC_APDU_TRACE_DATA_LEN];
+};
+
+/* Writers claim a record by incrementing head and never wait for each
+ * other; a reader of the buffer skips records that change under it */
+struct sc_apdu_trace {
+	unsigned long size;
+	unsigned long head;
+	struct sc_apdu_trace_record *records;
+};
+
+int _sc_apdu_trace_init(struct sc_context *ctx, unsigned int size)
+{
+	struct sc_apdu_trace *trace;
+
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	trace->records = calloc(size, sizeof(*trace->records));
+	if (trace->records == NULL) {
+		free(trace);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	trace->size = size;
+	ctx->apdu_trace = trace;
+	return SC_SUCCESS;
+}
+
+void _sc_apdu_trace_free(struct sc_context *ctx)
+{
+	if (ctx->apdu_trace == NULL)
+		return;
+	sc_mem_clear(ctx->apdu_trace->records,
+			ctx->apdu_trace->size * sizeof(*ctx->apdu_trace->records));
+	free(ctx->apdu_trace->records);
+	free(ctx->apdu_trace);
+	ctx->apdu_trace = NULL;
+}
+
+/* PINs, and what the card decrypts or authenticates with, stay out */
+static int sc_apdu_trace_redact(u8 ins)
+{
+	switch (ins) {
+	case 0x20:	/* VERIFY */
+	case 0x21:
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x2A:	/* PERFORM SECURITY OPERATION */
+	case 0x86:	/* GENERAL AUTHENTICATE */
+	case 0x87:
+	case 0x88:	/* INTERNAL AUTHENTICATE */
+	case 0xC0:	/* GET RESPONSE, may carry the result of the above */
+		return 1;
+	}
+	return 0;
+}
+
+static void
+sc_apdu_trace_add(struct sc_apdu_trace *trace, const struct sc_reader *reader,
+		int direction, const u8 *hdr, size_t hdrlen, const u8 *data, size_t datalen,
+		unsigned short sw, int flags)
+{
+	unsigned long idx = TRACE_NEXT(trace->head);
+	struct sc_apdu_trace_record *rec = &trace->records[idx % trace->size];
+	size_t len = hdrlen + datalen, stored;
+#ifdef _WIN32
+	FILETIME ft;
+	unsigned long long t;
+#else
+	struct timeval tv;
+#endif
+
+	rec->seq = 0;
+	TRACE_BARRIER();
+
+#ifdef _WIN32
+	GetSystemTimeAsFileTime(&ft);
+	t = (((unsigned long long) ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10
+		- 11644473600000000ULL;
+	rec->sec = (unsigned long) (t / 1000000);
+	rec->usec = (unsigned long) (t % 1000000);
+#else
+	gettimeofday(&tv, NULL);
+	rec->sec = tv.tv_sec;
+	rec->usec = tv.tv_usec;
+#endif
+	rec->reader = reader;
+	rec->direction = direction;
+	rec->sw = sw;
+	rec->len = len > 0xFFFF ? 0xFFFF : len;
+
+	if (flags & SC_APDU_TRACE_FLAG_REDACTED)
+		datalen = 0;
+	if (hdrlen > 0)
+		memcpy(rec->data, hdr, hdrlen);
+	stored = hdrlen;
+	if (datalen > SC_APDU_TRACE_DATA_LEN - hdrlen) {
+		datalen = SC_APDU_TRACE_DATA_LEN - hdrlen;
+		flags |= SC_APDU_TRACE_FLAG_TRUNCATED;
+	}
+	if (datalen > 0)
+		memcpy(rec->data + stored, data, datalen);
+	rec->stored = stored + datalen;
+	rec->flags = flags;
+
+	TRACE_BARRIER();
+	rec->seq = idx + 1;
+}
+
+int sc_apdu_trace_dump(sc_context_t *ctx, const char *filename)
+{
+	struct sc_apdu_trace *trace;
+	struct sc_apdu_trace_record *copy = NULL;
+	unsigned long head, first, i, count = 0;
+	unsigned int r, rcount;
+	u8 buf[24];
+	FILE *f;
+	int rv = SC_SUCCESS;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	trace = ctx->apdu_trace;
+	if (filename == NULL)
+		filename = ctx->apdu_trace_file;
+	if (trace == NULL || filename == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	/* take a consistent copy first, writers keep going meanwhile */
+	head = trace->head;
+	first = head > trace->size ? head - trace->size : 0;
+	copy = malloc((head - first) * sizeof(*copy) + 1);
+	if (copy == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = first; i < head; i++) {
+		struct sc_apdu_trace_record *rec = &trace->records[i % trace->size];
+
+		if (rec->seq != i + 1)
+			continue;
+		TRACE_BARRIER();
+		memcpy(&copy[count], rec, sizeof(*rec));
+		TRACE_BARRIER();
+		if (rec->seq == i + 1 && copy[count].seq == i + 1)
+			count++;
+	}
+
+	f = fopen(filename, "wb");
+	if (f == NULL) {
+		sc_log(ctx, "cannot open APDU trace file '%s'", filename);
+		free(copy);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	rcount = sc_ctx_get_reader_count(ctx);
+	memcpy(buf, SC_APDU_TRACE_MAGIC, 8);
+	ulong2bebytes(buf + 8, SC_APDU_TRACE_VERSION);
+	ulong2bebytes(buf + 12, rcount);
+	if (fwrite(buf, 1, 16, f) != 16)
+		rv = SC_ERROR_INTERNAL;
+	for (r = 0; rv == SC_SUCCESS && r < rcount; r++) {
+		const char *name = sc_ctx_get_reader(ctx, r)->name;
+		size_t len = strlen(name);
+
+		ushort2bebytes(buf, (unsigned short) len);
+		if (fwrite(buf, 1, 2, f) != 2 || fwrite(name, 1, len, f) != len)
+			rv = SC_ERROR_INTERNAL;
+	}
+
+	ulong2bebytes(buf, count);
+	if (rv == SC_SUCCESS && fwrite(buf, 1, 4, f) != 4)
+		rv = SC_ERROR_INTERNAL;
+	for (i = 0; rv == SC_SUCCESS && i < count; i++) {
+		struct sc_apdu_trace_record *rec = &copy[i];
+
+		for (r = 0; r < rcount; r++)
+			if (sc_ctx_get_reader(ctx, r) == rec->reader)
+				break;
+		ulong2bebytes(buf, rec->sec);
+		ulong2bebytes(buf + 4, rec->usec);
+		ulong2bebytes(buf + 8, rec->seq - 1);
+		buf[12] = r < rcount && r < 0xFF ? r : 0xFF;
+		buf[13] = rec->direction;
+		buf[14] = rec->flags;
+		buf[15] = rec->stored;
+		ushort2bebytes(buf + 16, rec->sw);
+		ushort2bebytes(buf + 18, rec->len);
+		if (fwrite(buf, 1, 20, f) != 20
+				|| fwrite(rec->data, 1, rec->stored, f) != rec->stored)
+			rv = SC_ERROR_INTERNAL;
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	if (fclose(f) != 0 && rv == SC_SUCCESS)
+		rv = SC_ERROR_INTERNAL;
+	sc_mem_clear(copy, count * sizeof(*copy));
+	free(copy);
+	return rv;
+}
+
+int
+_sc_reader_transmit(struct sc_reader *reader, struct sc_apdu *apdu)
+{
+	struct sc_apdu_trace *trace = reader->ctx->apdu_trace;
+	unsigned long long start, usec;
+	int rv, redact = 0;
+
+	if (trace != NULL || reader->ctx->apdu_record != NULL)
+		redact = sc_apdu_trace_redact(apdu->ins) ? SC_APDU_TRACE_FLAG_REDACTED : 0;
+	if (trace != NULL) {
+		u8 hdr[4];
+
+		hdr[0] = apdu->cla;
+		hdr[1] = apdu->ins;
+		hdr[2] = apdu->p1;
+		hdr[3] = apdu->p2;
+		sc_apdu_trace_add(trace, reader, SC_APDU_TRACE_COMMAND, hdr, sizeof(hdr),
+				apdu->data, apdu->datalen, 0, redact);
+	}
+
+	start = _sc_monotonic_usec();
+	rv = reader->ops->transmit(reader, apdu);
+	usec = _sc_monotonic_usec() - start;
+	sc_account_apdu(reader, apdu, usec, rv);
+	if (rv == SC_SUCCESS && reader->ctx->apdu_record != NULL) {
+		/* what a GET RESPONSE returns is part of the previous answer */
+		if (apdu->ins != 0xC0)
+			reader->record_redacted = redact != 0;
+		_sc_apdu_record(reader, apdu, reader->record_redacted, usec);
+	}
+
+	if (trace != NULL) {
+		if (rv == SC_SUCCESS)
+			sc_apdu_trace_add(trace, reader, SC_APDU_TRACE_RESPONSE, NULL, 0,
+					apdu->resp, apdu->resplen,
+					(apdu->sw1 << 8) | apdu->sw2, redact);
+		else
+			sc_apdu_trace_add(trace, reader, SC_APDU_TRACE_RESPONSE, NULL, 0,
+					NULL, 0, 0, SC_APDU_TRACE_FLAG_ERROR);
+		if (rv != SC_SUCCESS && reader->ctx->apdu_trace_file != NULL)
+			sc_apdu_trace_dump(reader->ctx, NULL);
+	}
+
+	return rv;
+}
+
+
+/** Codes the logical channel into a class byte (ISO 7816-4, 5.1.1).
+ *  Class bytes that are neither first nor further interindustry
+ *  (e.g. 0x20-0x3F, 0xA0-0xBF or 0xFF) are returned unchanged.
+ */
+static u8
+sc_cla_set_channel(u8 cla, int channel)
+{
+	int sm, chaining = cla & 0x10, proprietary = cla & 0x80;
+
+	if (cla == 0xFF)
+		return cla;
+	if (cla & 0x40)
+		/* further interindustry: b6 is SM, b4-b1 channel - 4 */
+		sm = cla & 0x20 ? 0x08 : 0;
+	else if (!(cla & 0x20))
+		/* first interindustry: b4-b3 SM, b2-b1 channel */
+		sm = cla & 0x0C;
+	else
+		return cla;
+
+	if (channel < 4)
+		return proprietary | chaining | sm | channel;
+	return proprietary | 0x40 | (sm ? 0x20 : 0) | chaining | (channel - 4);
+}
+
+
 static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
+	u8 cla = apdu->cla;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 	if (card->reader->ops->transmit == NULL)
 		LOG_TEST_RET(card->ctx, SC_ERROR_NOT_SUPPORTED, "cannot transmit APDU");
 
+	if (card->logical_channel != 0)
+		apdu->cla = sc_cla_set_channel(apdu->cla, card->logical_channel);
+
 	sc_log(ctx, "CLA:%X, INS:%X, P1:%X, P2:%X, data(%i) %p",
 			apdu->cla, apdu->ins, apdu->p1, apdu->p2, apdu->datalen, apdu->data);
+	card->cache.apdu_count++;
 #ifdef ENABLE_SM
-	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
-		return sc_sm_single_transmit(card, apdu);
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT) {
+		/* the wrapped APDU gets other buffers */
+		apdu->flags &= ~SC_APDU_FLAGS_RESP_SLACK;
+		rv = sc_sm_single_transmit(card, apdu);
+		apdu->cla = cla;
+		return rv;
+	}
 #endif
 
 	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, apdu);
+	rv = _sc_reader_transmit(card->reader, apdu);
+	/* the caller may send the APDU again, e.g. with another Le */
+	apdu->cla = cla;
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -463,18 +905,21 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 	minlen = le;
 
 	do {
-		unsigned char resp[256];
+		unsigned char resp[256], *dst;
 		size_t resp_len = le;
 
 		/* call GET RESPONSE to get more date from the card;
-		 * note: GET RESPONSE returns the left amount of data (== SW2) */
-		memset(resp, 0, sizeof(resp));
-		rv = card->ops->get_response(card, &resp_len, resp);
+		 * note: GET RESPONSE returns the left amount of data (== SW2).
+		 * The data is appended in place unless it may not fit. */
+		dst = buflen >= le ? buf : resp;
+		if (dst == resp)
+			memset(resp, 0, sizeof(resp));
+		rv = card->ops->get_response(card, &resp_len, dst);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
 			if (resp_len)   {
-				sc_log(ctx, "SM response data %s", sc_dump_hex(resp, resp_len));
-				sc_sm_update_apdu_response(card, resp, resp_len, rv, apdu);
+				sc_log(ctx, "SM response data %s", sc_dump_hex(dst, resp_len));
+				sc_sm_update_apdu_response(card, dst, resp_len, rv, apdu);
 			}
 #endif
 			LOG_TEST_RET(ctx, rv, "GET RESPONSE error");
@@ -485,7 +930,8 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		if (buflen < le)
 			le = buflen;
 
-		memcpy(buf, resp, le);
+		if (dst == resp)
+			memcpy(buf, resp, le);
 		buf    += le;
 		buflen -= le;
 
@@ -511,23 +957,21 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 }
 
 
-/** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
+/** Handles the status words of an already transmitted APDU, i.e. re-transmits
+ *  it with the right Le or calls GET RESPONSE to get the remaining data.
  *  @param  card  sc_card_t object for the smartcard
- *  @param  apdu  APDU to be sent
+ *  @param  apdu  APDU that has been sent
+ *  @param  olen  size of the response buffer before the APDU was sent
  *  @return SC_SUCCESS on success and an error value otherwise
  */
 static int
-sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
+sc_transmit_complete(sc_card_t *card, sc_apdu_t *apdu, size_t olen)
 {
 	struct sc_context *ctx  = card->ctx;
-	size_t       olen  = apdu->resplen;
-	int          r;
+	int          r = SC_SUCCESS;
 
 	LOG_FUNC_CALLED(ctx);
 
-	r = sc_single_transmit(card, apdu);
-	LOG_TEST_RET(ctx, r, "transmit APDU failed");
-
 	/* ok, the APDU was successfully transmitted. Now we have two special cases:
 	 * 1. the card returned 0x6Cxx: in this case APDU will be re-trasmitted with Le set to SW2
 	 * (possible only if response buffer size is larger than new Le = SW2)
@@ -549,6 +993,32 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
+ *  @param  card  sc_card_t object for the smartcard
+ *  @param  apdu  APDU to be sent
+ *  @return SC_SUCCESS on success and an error value otherwise
+ */
+static int
+sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
+{
+	struct sc_context *ctx  = card->ctx;
+	size_t       olen  = apdu->resplen;
+	int          r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	SC_PROBE5(transmit__start, card, apdu->ins, apdu->p1, apdu->p2, apdu->lc);
+	r = sc_single_transmit(card, apdu);
+	if (r != SC_SUCCESS)
+		SC_PROBE4(transmit__done, card, apdu->ins, r, 0);
+	LOG_TEST_RET(ctx, r, "transmit APDU failed");
+
+	r = sc_transmit_complete(card, apdu, olen);
+	SC_PROBE4(transmit__done, card, apdu->ins, r, apdu->sw1 << 8 | apdu->sw2);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 {
 	int r = SC_SUCCESS;
@@ -566,6 +1036,11 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	if (r != SC_SUCCESS)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
+	/* the held back updates go first */
+	r = sc_flush_writes(card);
+	if (r != SC_SUCCESS)
+		return r;
+
 	r = sc_lock(card);	/* acquire card lock*/
 	if (r != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to acquire lock");
@@ -643,6 +1118,84 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+int sc_transmit_apdus(sc_card_t *card, sc_apdu_t *apdus, size_t count)
+{
+	struct sc_context *ctx;
+	size_t i, olen[SC_MAX_APDU_BATCH];
+	int r = SC_SUCCESS, batch = 0;
+
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = card->ctx;
+
+	LOG_FUNC_CALLED(ctx);
+
+	for (i = 0; i < count; i++) {
+		sc_detect_apdu_cse(card, &apdus[i]);
+		if (sc_check_apdu(card, &apdus[i]) != SC_SUCCESS)
+			LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "inconsistent APDU in batch");
+	}
+
+	/* the reader driver only gets plain APDUs: command chaining and
+	 * secure messaging need the per-APDU path */
+	if (card->reader->ops->transmit_batch != NULL && count > 1 && count <= SC_MAX_APDU_BATCH) {
+		batch = 1;
+		for (i = 0; i < count; i++)
+			if (apdus[i].flags & SC_APDU_FLAGS_CHAINING)
+				batch = 0;
+#ifdef ENABLE_SM
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
+			batch = 0;
+#endif
+		if (card->logical_channel != 0)
+			batch = 0;
+	}
+
+	r = sc_flush_writes(card);
+	LOG_TEST_RET(ctx, r, "held back update failed");
+
+	r = sc_lock(card);
+	LOG_TEST_RET(ctx, r, "unable to acquire lock");
+
+	if (batch) {
+		unsigned long long start;
+
+		for (i = 0; i < count; i++)
+			olen[i] = apdus[i].resplen;
+
+		sc_log(ctx, "sending batch of %i APDUs", count);
+		card->cache.apdu_count += count;
+		start = _sc_monotonic_usec();
+		r = card->reader->ops->transmit_batch(card->reader, apdus, count);
+		if (r < 0) {
+			sc_log(ctx, "batch transmit failed: %s", sc_strerror(r));
+		} else {
+			/* the driver may stop early, e.g. on a transport error;
+			 * the remaining APDUs are then sent one by one */
+			size_t sent = (size_t)r > count ? count : (size_t)r;
+			unsigned long long usec = _sc_monotonic_usec() - start;
+
+			/* the exchanges of a batch are not timed one by one */
+			for (i = 0; i < sent; i++)
+				sc_account_apdu(card->reader, &apdus[i], usec / sent, SC_SUCCESS);
+
+			for (i = 0, r = SC_SUCCESS; i < sent && r == SC_SUCCESS; i++)
+				r = sc_transmit_complete(card, &apdus[i], olen[i]);
+			for (; i < count && r == SC_SUCCESS; i++)
+				r = sc_transmit_apdu(card, &apdus[i]);
+		}
+	} else {
+		for (i = 0; i < count && r == SC_SUCCESS; i++)
+			r = sc_transmit_apdu(card, &apdus[i]);
+	}
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(ctx, "sc_unlock failed");
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 int
 sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
 {
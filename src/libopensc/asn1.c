@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
@@ -34,9 +35,34 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		       int choice, int depth);
 static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 		       u8 **ptr, size_t *size, int depth);
+static int asn1_encode_sized(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		       const unsigned int *tag, u8 **ptr, size_t *size, int depth);
 static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 		const u8 * data, size_t datalen, u8 ** out, size_t * outlen);
 
+/* What the encoder and decoder allocate changes owner at once: only the
+ * allocation rate is accounted, see sc_mem_get_stats() */
+static void *asn1_malloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p != NULL) {
+		sc_mem_account_alloc(SC_MEM_ASN1, size);
+		sc_mem_account_free(SC_MEM_ASN1, size);
+	}
+	return p;
+}
+
+/* tag (up to 3 bytes) and length (up to 1 + sizeof(size_t) bytes) */
+#define ASN1_MAX_HEADER_LEN	16
+
+/* Encodings of the entries of a structure, before they are joined */
+struct asn1_piece {
+	u8 *data;
+	size_t len;
+};
+#define ASN1_LOCAL_PIECES	16
+
 static const char *tag2str(unsigned int tag)
 {
 	static const char *tags[] = {
@@ -135,6 +161,18 @@ void sc_copy_asn1_entry(const struct sc_asn1_entry *src,
 	dest->name = NULL;
 }
 
+void sc_asn1_template_init(const struct sc_asn1_template *tpl, void *frame)
+{
+	u8 *base = frame;
+	size_t i;
+
+	for (i = 0; i < tpl->tables_count; i++)
+		memcpy(base + tpl->tables[i].offset, tpl->tables[i].src,
+				tpl->tables[i].size);
+	for (i = 0; i < tpl->links_count; i++)
+		*(void **)(base + tpl->links[i].slot) = base + tpl->links[i].target;
+}
+
 static void sc_asn1_print_octet_string(const u8 * buf, size_t buflen)
 {
 	size_t i;
@@ -487,7 +525,7 @@ static int encode_bit_string(const u8 * inbuf, size_t bits_left, u8 **outbuf,
 	int skipped = 0;
 
 	bytes = (bits_left + 7)/8 + 1;
-	*outbuf = out = malloc(bytes);
+	*outbuf = out = asn1_malloc(bytes);
 	if (out == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	*outlen = bytes;
@@ -594,7 +632,7 @@ static int asn1_encode_integer(int in, u8 ** obj, size_t * objsize)
 		skip_sign = 0;
 		skip_zero= 1;
 	}
-	*obj = p = malloc(sizeof(in)+1);
+	*obj = p = asn1_malloc(sizeof(in)+1);
 	if (*obj == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	do {
@@ -721,7 +759,7 @@ sc_asn1_encode_object_id(u8 **buf, size_t *buflen, const struct sc_object_id *id
 	*buflen = p - temp;
 
 	if (buf)   {
-		*buf = malloc(*buflen);
+		*buf = asn1_malloc(*buflen);
 		if (!*buf)
 			return SC_ERROR_OUT_OF_MEMORY;
 		memcpy(*buf, temp, *buflen);
@@ -768,11 +806,12 @@ int sc_asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	return asn1_write_element(ctx, tag, data, datalen, out, outlen);
 }
 
-static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
-	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+/* Writes the tag and length of an element with datalen content bytes */
+static int asn1_write_header(sc_context_t *ctx, unsigned int tag, size_t datalen,
+	u8 *out, size_t *outlen)
 {
 	unsigned char t;
-	unsigned char *buf, *p;
+	unsigned char *p;
 	int c = 0;
 	unsigned short_tag;
 	unsigned char tag_char[3] = {0, 0, 0};
@@ -819,12 +858,7 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 			c++;
 	}
 
-	*outlen = tag_len + 1 + c + datalen;
-	buf = malloc(*outlen);
-	if (buf == NULL)
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
-
-	*out = p = buf;
+	p = out;
 	*p++ = t;
 	for (ii=1;ii<tag_len;ii++)
 		*p++ = tag_char[tag_len - ii - 1];
@@ -837,11 +871,35 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	else   {
 		*p++ = datalen & 0x7F;
 	}
-	memcpy(p, data, datalen);
+	*outlen = p - out;
 
 	return SC_SUCCESS;
 }
 
+static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
+	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+{
+	u8 header[ASN1_MAX_HEADER_LEN], *buf;
+	size_t header_len;
+	int r;
+
+	r = asn1_write_header(ctx, tag, datalen, header, &header_len);
+	if (r != SC_SUCCESS)
+		return r;
+
+	buf = asn1_malloc(header_len + datalen);
+	if (buf == NULL)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(buf, header, header_len);
+	if (datalen)
+		memcpy(buf + header_len, data, datalen);
+
+	*out = buf;
+	*outlen = header_len + datalen;
+	return SC_SUCCESS;
+}
+
+
 static const struct sc_asn1_entry c_asn1_path_ext[3] = {
 	{ "aid",  SC_ASN1_OCTET_STRING, SC_ASN1_APP | 0x0F, 0, NULL, NULL },
 	{ "path", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
@@ -1016,9 +1074,19 @@ static int asn1_encode_se_info(sc_context_t *ctx,
 		struct sc_pkcs15_sec_env_info **se, size_t se_num,
 		unsigned char **buf, size_t *bufsize, int depth)
 {
-	unsigned char *ptr = NULL, *out = NULL, *p;
-	size_t ptrlen = 0, outlen = 0, idx;
-	int ret;
+	struct asn1_piece *pieces;
+	unsigned char *out = NULL, *p;
+	size_t outlen = 0, idx;
+	int ret = SC_SUCCESS;
+
+	if (se_num == 0) {
+		*buf = NULL;
+		*bufsize = 0;
+		return SC_SUCCESS;
+	}
+	pieces = calloc(se_num, sizeof(*pieces));
+	if (pieces == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
 
 	for (idx=0; idx < se_num; idx++)   {
 		struct sc_asn1_entry asn1_se[2];
@@ -1034,29 +1102,33 @@ static int asn1_encode_se_info(sc_context_t *ctx,
 			sc_format_asn1_entry(asn1_se_info + 2, &se[idx]->aid.value, &se[idx]->aid.len, 1);
 		sc_format_asn1_entry(asn1_se + 0, asn1_se_info, NULL, 1);
 
-		ret = sc_asn1_encode(ctx, asn1_se, &ptr, &ptrlen);
+		ret = sc_asn1_encode(ctx, asn1_se, &pieces[idx].data, &pieces[idx].len);
 		if (ret != SC_SUCCESS)
 			goto err;
+		outlen += pieces[idx].len;
+	}
 
-		p = (unsigned char *) realloc(out, outlen + ptrlen);
-		if (!p)   {
+	/* all the environments are encoded: copy them in one go */
+	if (outlen) {
+		out = asn1_malloc(outlen);
+		if (!out)   {
 			ret = SC_ERROR_OUT_OF_MEMORY;
 			goto err;
 		}
-		out = p;
-		memcpy(out + outlen, ptr, ptrlen);
-		outlen += ptrlen;
-		free(ptr);
-		ptr = NULL;
-		ptrlen = 0;
+		for (p = out, idx = 0; idx < se_num; idx++)   {
+			if (!pieces[idx].len)
+				continue;
+			memcpy(p, pieces[idx].data, pieces[idx].len);
+			p += pieces[idx].len;
+		}
 	}
 
 	*buf = out;
 	*bufsize = outlen;
-	ret = SC_SUCCESS;
 err:
-	if (ret != SC_SUCCESS && out != NULL)
-		free(out);
+	for (idx = 0; idx < se_num; idx++)
+		free(pieces[idx].data);
+	free(pieces);
 	return ret;
 }
 
@@ -1107,11 +1179,16 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 	struct sc_pkcs15_object *p15_obj = obj->p15_obj;
 	struct sc_asn1_entry asn1_c_attr[6], asn1_p15_obj[5];
 	struct sc_asn1_entry asn1_ac_rules[SC_PKCS15_MAX_ACCESS_RULES + 1], asn1_ac_rule[SC_PKCS15_MAX_ACCESS_RULES][3];
+	struct sc_pkcs15_accessrule access_rules[SC_PKCS15_MAX_ACCESS_RULES];
 	size_t flags_len = sizeof(p15_obj->flags);
 	size_t label_len = sizeof(p15_obj->label);
-	size_t access_mode_len = sizeof(p15_obj->access_rules[0].access_mode);
+	size_t access_mode_len = sizeof(access_rules[0].access_mode);
 	int r, ii;
 
+	/* most objects have no access rules: keep them out of the object
+	 * unless present */
+	memset(access_rules, 0, sizeof(access_rules));
+
 	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)
 		sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule[ii]);
 	sc_copy_asn1_entry(c_asn1_access_control_rules, asn1_ac_rules);
@@ -1125,8 +1202,8 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 	sc_format_asn1_entry(asn1_c_attr + 3, &p15_obj->user_consent, NULL, 0);
 
 	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)   {
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 0, &p15_obj->access_rules[ii].access_mode, &access_mode_len, 0);
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 1, &p15_obj->access_rules[ii].auth_id, NULL, 0);
+		sc_format_asn1_entry(asn1_ac_rule[ii] + 0, &access_rules[ii].access_mode, &access_mode_len, 0);
+		sc_format_asn1_entry(asn1_ac_rule[ii] + 1, &access_rules[ii].auth_id, NULL, 0);
 		sc_format_asn1_entry(asn1_ac_rules + ii, asn1_ac_rule[ii], NULL, 0);
 	}
 	sc_format_asn1_entry(asn1_c_attr + 4, asn1_ac_rules, NULL, 0);
@@ -1137,6 +1214,11 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 	sc_format_asn1_entry(asn1_p15_obj + 3, obj->asn1_type_attr, NULL, 0);
 
 	r = asn1_decode(ctx, asn1_p15_obj, in, len, NULL, NULL, 0, depth + 1);
+	if (r == 0 && (asn1_c_attr[4].flags & SC_ASN1_PRESENT)) {
+		if (sc_pkcs15_object_access_rules(p15_obj) == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		memcpy(p15_obj->access_rules, access_rules, sizeof(access_rules));
+	}
 	return r;
 }
 
@@ -1151,8 +1233,9 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 	size_t access_mode_len;
 	int r, ii;
 
-	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encode p15 obj(type:0x%X,access_mode:0x%X)", p15_obj.type, p15_obj.access_rules[0].access_mode);
-	if (p15_obj.access_rules[0].access_mode)   {
+	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encode p15 obj(type:0x%X,access_mode:0x%X)", p15_obj.type,
+			p15_obj.access_rules ? p15_obj.access_rules[0].access_mode : 0);
+	if (p15_obj.access_rules && p15_obj.access_rules[0].access_mode)   {
 		for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)   {
 			sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule[ii]);
 			if (p15_obj.access_rules[ii].auth_id.len == 0)   {
@@ -1176,8 +1259,8 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 	if (p15_obj.user_consent)
 		sc_format_asn1_entry(asn1_c_attr + 3, (void *) &p15_obj.user_consent, NULL, 1);
 
-	if (p15_obj.access_rules[0].access_mode)   {
-		for (ii=0; p15_obj.access_rules[ii].access_mode; ii++)   {
+	if (p15_obj.access_rules && p15_obj.access_rules[0].access_mode)   {
+		for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES && p15_obj.access_rules[ii].access_mode; ii++)   {
 			access_mode_len = sizeof(p15_obj.access_rules[ii].access_mode);
 			sc_format_asn1_entry(asn1_ac_rule[ii] + 0, (void *) &p15_obj.access_rules[ii].access_mode, &access_mode_len, 1);
 			sc_format_asn1_entry(asn1_ac_rule[ii] + 1, (void *) &p15_obj.access_rules[ii].auth_id, NULL, 1);
@@ -1245,7 +1328,7 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 			}
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
-				*buf = malloc(objlen-1);
+				*buf = asn1_malloc(objlen-1);
 				if (*buf == NULL) {
 					r = SC_ERROR_OUT_OF_MEMORY;
 					break;
@@ -1276,10 +1359,16 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 				obj++;
 			}
 
+			if ((entry->flags & SC_ASN1_ALLOC) && (entry->flags & SC_ASN1_BORROW)) {
+				*(const u8 **) parm = obj;
+				*len = objlen;
+				break;
+			}
+
 			/* Allocate buffer if needed */
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
-				*buf = malloc(objlen);
+				*buf = asn1_malloc(objlen);
 				if (*buf == NULL) {
 					r = SC_ERROR_OUT_OF_MEMORY;
 					break;
@@ -1299,7 +1388,7 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 			assert(len != NULL);
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
-				*buf = malloc(objlen);
+				*buf = asn1_malloc(objlen);
 				if (*buf == NULL) {
 					r = SC_ERROR_OUT_OF_MEMORY;
 					break;
@@ -1323,7 +1412,7 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 			assert(len != NULL);
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
-				*buf = malloc(objlen+1);
+				*buf = asn1_malloc(objlen+1);
 				if (*buf == NULL) {
 					r = SC_ERROR_OUT_OF_MEMORY;
 					break;
@@ -1531,15 +1620,22 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		r = asn1_encode(ctx, (const struct sc_asn1_entry *) parm, &buf,
-				&buflen, depth + 1);
+		/* the entries are written right behind the tag and length */
+		r = asn1_encode_sized(ctx, (const struct sc_asn1_entry *) parm, &entry->tag,
+				&buf, &buflen, depth + 1);
+		if (r == 0 && buflen) {
+			*obj = buf;
+			*objlen = buflen;
+			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*slength of encoded item=%u\n", depth, depth, "", *objlen);
+			return 0;
+		}
 		break;
 	case SC_ASN1_NULL:
 		buf = NULL;
 		buflen = 0;
 		break;
 	case SC_ASN1_BOOLEAN:
-		buf = malloc(1);
+		buf = asn1_malloc(1);
 		if (buf == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			break;
@@ -1567,7 +1663,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	case SC_ASN1_OCTET_STRING:
 	case SC_ASN1_UTF8STRING:
 		assert(len != NULL);
-		buf = malloc(*len + 1);
+		buf = asn1_malloc(*len + 1);
 		if (buf == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			break;
@@ -1584,7 +1680,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		break;
 	case SC_ASN1_GENERALIZEDTIME:
 		assert(len != NULL);
-		buf = malloc(*len);
+		buf = asn1_malloc(*len);
 		if (buf == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			break;
@@ -1602,7 +1698,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		{
 			const struct sc_pkcs15_id *id = (const struct sc_pkcs15_id *) parm;
 
-			buf = malloc(id->len);
+			buf = asn1_malloc(id->len);
 			if (buf == NULL) {
 				r = SC_ERROR_OUT_OF_MEMORY;
 				break;
@@ -1679,43 +1775,73 @@ no_object:
 	return r;
 }
 
-static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
-		      u8 **ptr, size_t *size, int depth)
+/*
+ * Encodes the entries one after the other, then copies them to a buffer
+ * allocated once at the size of the whole. With a tag, the buffer starts
+ * with the tag and length of the element the entries make up.
+ */
+static int asn1_encode_sized(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		const unsigned int *tag, u8 **ptr, size_t *size, int depth)
 {
-	int r, idx = 0;
-	u8 *obj = NULL, *buf = NULL, *tmp;
-	size_t total = 0, objsize;
+	struct asn1_piece local[ASN1_LOCAL_PIECES], *pieces = local;
+	u8 header[ASN1_MAX_HEADER_LEN], *buf = NULL, *p;
+	size_t count, idx, header_len = 0, total = 0;
+	int r = 0;
 
-	for (idx = 0; asn1[idx].name != NULL; idx++) {
-		r = asn1_encode_entry(ctx, &asn1[idx], &obj, &objsize, depth);
-		if (r) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
-			return r;
-		}
-		/* in case of an empty (optional) element continue with
-		 * the next asn1 element */
-		if (!objsize)
-			continue;
-		tmp = (u8 *) realloc(buf, total + objsize);
-		if (!tmp) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
+	for (count = 0; asn1[count].name != NULL; count++)
+		;
+	if (count > ASN1_LOCAL_PIECES) {
+		pieces = calloc(count, sizeof(*pieces));
+		if (pieces == NULL)
 			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	for (idx = 0; idx < count; idx++) {
+		pieces[idx].data = NULL;
+		pieces[idx].len = 0;
+	}
+
+	for (idx = 0; idx < count; idx++) {
+		r = asn1_encode_entry(ctx, &asn1[idx], &pieces[idx].data, &pieces[idx].len, depth);
+		if (r)
+			goto out;
+		total += pieces[idx].len;
+	}
+	/* an empty element is left to the caller, depending on its flags */
+	if (tag != NULL && total) {
+		r = asn1_write_header(ctx, *tag, total, header, &header_len);
+		if (r)
+			goto out;
+	}
+
+	if (header_len + total) {
+		buf = asn1_malloc(header_len + total);
+		if (buf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		memcpy(buf, header, header_len);
+		p = buf + header_len;
+		for (idx = 0; idx < count; idx++) {
+			if (!pieces[idx].len)
+				continue;
+			memcpy(p, pieces[idx].data, pieces[idx].len);
+			p += pieces[idx].len;
 		}
-		buf = tmp;
-		memcpy(buf + total, obj, objsize);
-		free(obj);
-		obj = NULL;
-		total += objsize;
 	}
 	*ptr = buf;
-	*size = total;
-	return 0;
+	*size = header_len + total;
+out:
+	for (idx = 0; idx < count; idx++)
+		free(pieces[idx].data);
+	if (pieces != local)
+		free(pieces);
+	return r;
+}
+
+static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		      u8 **ptr, size_t *size, int depth)
+{
+	return asn1_encode_sized(ctx, asn1, NULL, ptr, size, depth);
 }
 
 int sc_asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
@@ -1743,7 +1869,7 @@ sc_der_copy(sc_pkcs15_der_t *dst, const sc_pkcs15_der_t *src)
 {
 	memset(dst, 0, sizeof(*dst));
 	if (src->len) {
-		dst->value = malloc(src->len);
+		dst->value = asn1_malloc(src->len);
 		if (!dst->value)
 			return SC_ERROR_OUT_OF_MEMORY;
 		dst->len = src->len;
@@ -1752,6 +1878,50 @@ sc_der_copy(sc_pkcs15_der_t *dst, const sc_pkcs15_der_t *src)
 	return SC_SUCCESS;
 }
 
+int
+sc_pkcs15_blob_new(const u8 *data, size_t len, struct sc_pkcs15_blob **out)
+{
+	struct sc_pkcs15_blob *blob;
+
+	if (out == NULL || (data == NULL && len))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	blob = asn1_malloc(offsetof(struct sc_pkcs15_blob, data) + (len ? len : 1));
+	if (blob == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	blob->refs = 1;
+	blob->len = len;
+	if (len)
+		memcpy(blob->data, data, len);
+	*out = blob;
+	return SC_SUCCESS;
+}
+
+/* The users of a blob are serialized by the card lock of their card */
+struct sc_pkcs15_blob *
+sc_pkcs15_blob_hold(struct sc_pkcs15_blob *blob)
+{
+	if (blob != NULL)
+		blob->refs++;
+	return blob;
+}
+
+void
+sc_pkcs15_blob_release(struct sc_pkcs15_blob *blob)
+{
+	if (blob == NULL || --blob->refs > 0)
+		return;
+	free(blob);
+}
+
+int
+sc_pkcs15_blob_contains(const struct sc_pkcs15_blob *blob, const u8 *p, size_t len)
+{
+	if (blob == NULL || p == NULL)
+		return 0;
+	return p >= blob->data && len <= blob->len
+		&& (size_t) (p - blob->data) <= blob->len - len;
+}
+
 int
 sc_encode_oid (struct sc_context *ctx, struct sc_object_id *id,
 		unsigned char **out, size_t *size)
@@ -25,6 +25,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include "libopensc/opensc.h"
 #include "libopensc/pkcs15.h"
 
@@ -53,11 +55,53 @@ struct sc_asn1_pkcs15_algorithm_info {
 };
 
 
+/*
+ * Precompiled templates.
+ *
+ * A decoder that needs many entry tables can keep their working copies,
+ * together with the variables they decode into, in one 'frame' structure
+ * and describe them once with static tables: which c_asn1_* template is
+ * copied to which frame offset, and which pointer in the frame (entry
+ * parm/arg, sc_asn1_pkcs15_object member) points to which other frame
+ * member.  sc_asn1_template_init() then instantiates the whole set in one
+ * pass instead of a sc_copy_asn1_entry()/sc_format_asn1_entry() sequence.
+ */
+struct sc_asn1_template_table {
+	const struct sc_asn1_entry *src;
+	size_t size;
+	size_t offset;
+};
+
+struct sc_asn1_template_link {
+	size_t slot;
+	size_t target;
+};
+
+struct sc_asn1_template {
+	const struct sc_asn1_template_table *tables;
+	size_t tables_count;
+	const struct sc_asn1_template_link *links;
+	size_t links_count;
+};
+
+#define SC_ASN1_TEMPLATE_TABLE(frame, member, src) \
+	{ (src), sizeof(src), offsetof(frame, member) }
+#define SC_ASN1_TEMPLATE_LINK(frame, slot, target) \
+	{ offsetof(frame, slot), offsetof(frame, target) }
+#define SC_ASN1_TEMPLATE_PARM(frame, entry, target) \
+	SC_ASN1_TEMPLATE_LINK(frame, entry.parm, target)
+#define SC_ASN1_TEMPLATE_ARG(frame, entry, target) \
+	SC_ASN1_TEMPLATE_LINK(frame, entry.arg, target)
+#define SC_ASN1_TEMPLATE(tables, links) \
+	{ (tables), sizeof(tables) / sizeof((tables)[0]), \
+	  (links), sizeof(links) / sizeof((links)[0]) }
+
 /* Utility functions */
 void sc_format_asn1_entry(struct sc_asn1_entry *entry, void *parm, void *arg,
 			  int set_present);
 void sc_copy_asn1_entry(const struct sc_asn1_entry *src,
 			struct sc_asn1_entry *dest);
+void sc_asn1_template_init(const struct sc_asn1_template *tpl, void *frame);
 			
 /* DER tag and length parsing */
 int sc_asn1_decode(struct sc_context *ctx, struct sc_asn1_entry *asn1,
@@ -132,6 +176,9 @@ int sc_asn1_write_element(sc_context_t *ctx, unsigned int tag,
 #define SC_ASN1_ALLOC			0x00000004
 #define SC_ASN1_UNSIGNED		0x00000008
 #define SC_ASN1_EMPTY_ALLOWED           0x00000010
+/* With SC_ASN1_ALLOC, an octet string points into the decoded buffer
+ * instead of being copied; the caller keeps the buffer alive */
+#define SC_ASN1_BORROW			0x00000020
 
 #define SC_ASN1_BOOLEAN                 1
 #define SC_ASN1_INTEGER                 2
@@ -96,64 +96,127 @@ static int from_base64(const char *in, unsigned int *out, int *skip)
 	return c * 6 / 8;
 }
 
-int sc_base64_encode(const u8 *in, size_t len, u8 *out, size_t outlen, size_t linelength)
+/* Number of characters sc_base64_encode() writes for 'len' bytes,
+ * without the terminating zero. 'linelength' is a multiple of 4. */
+static size_t base64_encoded_len(size_t len, size_t linelength)
 {
-	unsigned int chars = 0;
-	size_t i, c;
+	size_t chars = (len + 2) / 3 * 4;
+
+	if (linelength > 0)
+		chars += (chars + linelength - 1) / linelength;
+	return chars;
+}
+
+/* Encodes 'len' bytes to 'out', which must be large enough. Unless
+ * 'final' is set, 'len' is a multiple of 3 and '*chars' carries the
+ * position in the current line over to the next call. */
+static size_t base64_encode_block(const u8 *in, size_t len, u8 *out,
+		size_t linelength, size_t *chars, int final)
+{
+	u8 *p = out;
+	unsigned int i;
 
-	linelength -= linelength & 0x03;
 	while (len >= 3) {
-		i = in[2] + (in[1] << 8) + (in[0] << 16);
+		i = in[2] | (in[1] << 8) | (in[0] << 16);
 		in += 3;
 		len -= 3;
-		if (outlen < 4)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-		to_base64(i, out, 0);
-		out += 4;
-		outlen -= 4;
-		chars += 4;
-		if (chars >= linelength && linelength > 0) {
-			if (outlen < 1)
-				return SC_ERROR_BUFFER_TOO_SMALL;
-			*out = '\n';
-			out++;
-			outlen--;
-			chars = 0;
+		p[0] = base64_table[i >> 18];
+		p[1] = base64_table[(i >> 12) & 0x3f];
+		p[2] = base64_table[(i >> 6) & 0x3f];
+		p[3] = base64_table[i & 0x3f];
+		p += 4;
+		*chars += 4;
+		if (*chars >= linelength && linelength > 0) {
+			*p++ = '\n';
+			*chars = 0;
 		}
 	}
-	i = c = 0;
-	while (c < len)
-		i |= *in++ << ((2 - c++) << 3);
+	if (!final)
+		return p - out;
+
 	if (len) {
-		if (outlen < 4)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-		to_base64(i, out, 3-len);
-		out += 4;
-		outlen -= 4;
-		chars += 4;
-	}
-	if (chars && linelength > 0) {
-		if (outlen < 1)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-		*out = '\n';
-		out++;
-		outlen--;
+		i = in[0] << 16;
+		if (len > 1)
+			i |= in[1] << 8;
+		to_base64(i, p, 3 - len);
+		p += 4;
+		*chars += 4;
 	}
-	if (outlen < 1)
+	if (*chars && linelength > 0)
+		*p++ = '\n';
+	return p - out;
+}
+
+int sc_base64_encode(const u8 *in, size_t len, u8 *out, size_t outlen, size_t linelength)
+{
+	size_t chars = 0;
+
+	linelength -= linelength & 0x03;
+	if (outlen < base64_encoded_len(len, linelength) + 1)
 		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	out += base64_encode_block(in, len, out, linelength, &chars, 1);
 	*out = 0;
 
 	return 0;
 }
 
+int sc_base64_encode_file(FILE *outf, const u8 *in, size_t len, size_t linelength)
+{
+	/* 768 input bytes give 1024 characters and at most 256 line breaks */
+	u8 buf[1024 + 256 + 8];
+	size_t chars = 0, n, block;
+
+	linelength -= linelength & 0x03;
+	do {
+		block = len > 768 ? 768 : len;
+		n = base64_encode_block(in, block, buf, linelength, &chars, block == len);
+		if (n && fwrite(buf, 1, n, outf) != n)
+			return SC_ERROR_INTERNAL;
+		in += block;
+		len -= block;
+	} while (len);
+
+	return 0;
+}
+
 int sc_base64_decode(const char *in, u8 *out, size_t outlen)
 {
 	int len = 0, r, skip;
 	unsigned int i;
 
-	while ((r = from_base64(in, &i, &skip)) > 0) {
+	for (;;) {
 		int finished = 0, s = 16;
 
+		/* Common case: four data characters, no line break or padding.
+		 * The terminating zero is not a data character, so the checks
+		 * never look past it. */
+		if (outlen >= 3) {
+			const u8 *p = (const u8 *) in;
+			unsigned int b0, b1, b2, b3;
+
+			if (p[0] < 0x80 && (b0 = bin_table[p[0]]) < 0x40
+					&& p[1] < 0x80 && (b1 = bin_table[p[1]]) < 0x40
+					&& p[2] < 0x80 && (b2 = bin_table[p[2]]) < 0x40
+					&& p[3] < 0x80 && (b3 = bin_table[p[3]]) < 0x40) {
+				i = (b0 << 18) | (b1 << 12) | (b2 << 6) | b3;
+				out[0] = i >> 16;
+				out[1] = i >> 8;
+				out[2] = i;
+				out += 3;
+				outlen -= 3;
+				len += 3;
+				in += 4;
+				if (*in == 0)
+					return len;
+				continue;
+			}
+		}
+
+		r = from_base64(in, &i, &skip);
+		if (r <= 0)
+			break;
+
 		if (r < 3)
 			finished = 1;
 		while (r--) {
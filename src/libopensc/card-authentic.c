@@ -2245,13 +2245,7 @@ authentic_sm_free_wrapped_apdu(struct sc_card *card, struct sc_apdu *plain, stru
 		plain->sw2 = (*sm_apdu)->sw2;
 	}
 
-	if ((*sm_apdu)->data)
-		free((unsigned char *) (*sm_apdu)->data);
-	if ((*sm_apdu)->resp)
-		free((unsigned char *) (*sm_apdu)->resp);
-
-	free(*sm_apdu);
-	*sm_apdu = NULL;
+	sc_sm_release_scratch_apdu(card, sm_apdu);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -2290,25 +2284,24 @@ authentic_sm_get_wrapped_apdu(struct sc_card *card, struct sc_apdu *plain, struc
 	if (!card->sm_ctx.module.ops.get_apdus)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
-        apdu = calloc(1, sizeof(struct sc_apdu));
-        if (!apdu)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy((void *)apdu, (void *)plain, sizeof(struct sc_apdu));
+	rv = sc_sm_get_scratch_apdu(card, plain->datalen + 24, plain->resplen + 32, &apdu);
+	LOG_TEST_RET(ctx, rv, "SM: cannot get APDU buffers");
+	{
+		unsigned char *data = (unsigned char *) apdu->data, *resp = apdu->resp;
 
-        apdu->data = calloc (1, plain->datalen + 24);
-        if (!apdu->data)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		memcpy((void *)apdu, (void *)plain, sizeof(struct sc_apdu));
+		apdu->data = data;
+		apdu->resp = resp;
+	}
 	if (plain->data && plain->datalen)
 		memcpy((unsigned char *) apdu->data, plain->data, plain->datalen);
 
-        apdu->resp = calloc (1, plain->resplen + 32);
-        if (!apdu->resp)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-
 	card->sm_ctx.info.cmd = SM_CMD_APDU_TRANSMIT;
 	card->sm_ctx.info.cmd_data = (void *)apdu;
 
 	rv = card->sm_ctx.module.ops.get_apdus(ctx, &card->sm_ctx.info, NULL, 0, NULL);
+	if (rv < 0)
+		sc_sm_release_scratch_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, rv, "SM: GET_APDUS failed");
 
 	*sm_apdu = apdu;
@@ -30,6 +30,9 @@
 #include "asn1.h"
 #include "cardctl.h"
 
+/* largest key handled, CardOS 5 */
+#define CARDOS_MAX_RSA_BITS	4096
+
 static const struct sc_card_operations *iso_ops = NULL;
 
 static struct sc_card_operations cardos_ops;
@@ -200,6 +203,14 @@ static int cardos_init(sc_card_t *card)
 		_sc_card_add_rsa_alg(card, 2048, flags, 0);
 	}
 
+	if (card->type == SC_CARD_TYPE_CARDOS_V5_0) {
+		unsigned int size;
+
+		/* CardOS 5 handles keys up to 4096 bit */
+		for (size = 2304; size <= CARDOS_MAX_RSA_BITS; size += 256)
+			_sc_card_add_rsa_alg(card, size, flags, 0);
+	}
+
 	return 0;
 }
 
@@ -264,18 +275,16 @@ static const struct sc_card_error cardos_errors[] = {
 { 0x9850, SC_SUCCESS,		"over/underflow useing in/decrease"}
 };
 
+static struct sc_sw_map cardos_sw_map;
+
 static int cardos_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 {
-	const int err_count = sizeof(cardos_errors)/sizeof(cardos_errors[0]);
-	int i;
-			        
-	for (i = 0; i < err_count; i++) {
-		if (cardos_errors[i].SWs == ((sw1 << 8) | sw2)) {
-			if ( cardos_errors[i].errorstr ) 
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n",
-				 	cardos_errors[i].errorstr);
-			return cardos_errors[i].errorno;
-		}
+	const struct sc_card_error *err = sc_sw_map_find(&cardos_sw_map, sw1, sw2);
+
+	if (err != NULL) {
+		if (err->errorstr)
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n", err->errorstr);
+		return err->errorno;
 	}
 
         sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Unknown SWs; SW1=%02X, SW2=%02X\n", sw1, sw2);
@@ -814,6 +823,14 @@ do_compute_signature(sc_card_t *card, const u8 *data, size_t datalen,
 	apdu.resp    = out;
 	apdu.le      = outlen;
 	apdu.resplen = outlen;
+	/* extended APDUs carry the input in one go, else chain it, and
+	 * GET RESPONSE fetches what exceeds the short Le */
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT)) {
+		if (datalen > 255)
+			apdu.flags |= SC_APDU_FLAGS_CHAINING;
+		if (apdu.le > 256)
+			apdu.le = 256;
+	}
 
 	apdu.data    = data;
 	apdu.lc      = datalen;
@@ -832,7 +849,7 @@ cardos_compute_signature(sc_card_t *card, const u8 *data, size_t datalen,
 			 u8 *out, size_t outlen)
 {
 	int    r;
-	u8     buf[SC_MAX_APDU_BUFFER_SIZE];
+	u8     buf[CARDOS_MAX_RSA_BITS / 8];
 	size_t buf_len = sizeof(buf), tmp_len = buf_len;
 	sc_context_t *ctx;
 	int do_rsa_pure_sig = 0;
@@ -843,7 +860,7 @@ cardos_compute_signature(sc_card_t *card, const u8 *data, size_t datalen,
 	ctx = card->ctx;
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 
-	if (datalen > SC_MAX_APDU_BUFFER_SIZE)
+	if (datalen > sizeof(buf))
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	if (outlen < datalen)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
@@ -1251,6 +1268,8 @@ static struct sc_card_driver * sc_get_driver(void)
 	if (iso_ops == NULL)
 		iso_ops = sc_get_iso7816_driver()->ops;
 	cardos_ops = *iso_ops;
+	sc_sw_map_init(&cardos_sw_map, cardos_errors,
+			sizeof(cardos_errors)/sizeof(cardos_errors[0]));
 	cardos_ops.match_card = cardos_match_card;
 	cardos_ops.init = cardos_init;
 	cardos_ops.select_file = cardos_select_file;
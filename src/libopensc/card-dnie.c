@@ -33,7 +33,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "opensc.h"
 #include "cardctl.h"
@@ -57,19 +62,23 @@ extern int dnie_read_file(
 /* default user consent program (if required) */
 #define USER_CONSENT_CMD "/usr/bin/pinentry"
 
+/* largest file kept in the cache directory */
+#define DNIE_CERT_CACHE_MAX_LEN 0x10000
+
 /**
  * SW internal apdu response table.
  *
  * Override APDU response error codes from iso7816.c to allow 
  * handling of SM specific error
  */
-static struct sc_card_error dnie_errors[] = {
+static const struct sc_card_error dnie_errors[] = {
 	{0x6688, SC_ERROR_SM, "Cryptographic checksum invalid"},
 	{0x6987, SC_ERROR_SM, "Expected SM Data Object missing"},
 	{0x6988, SC_ERROR_SM, "SM Data Object incorrect"},
-	{0, 0, NULL}
 };
 
+static struct sc_sw_map dnie_sw_map;
+
 /* 
  * DNIe ATR info from DGP web page
  *
@@ -473,6 +482,168 @@ static void dnie_clear_cache(dnie_private_data_t * data)
 	data->cachelen = 0;
 }
 
+/**
+ * Tell whether public files may be kept in the cache directory.
+ *
+ * @param card pointer to card info data
+ * @return value of "cert_cache" in the dnie card_driver block; default false
+ */
+static int dnie_get_cert_cache_conf(sc_card_t * card)
+{
+	sc_context_t *ctx = card->ctx;
+	scconf_block **blocks;
+	int i, enabled = 0;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+					    "card_driver", "dnie");
+		if (!blocks)
+			continue;
+		if (blocks[0])
+			enabled = scconf_get_bool(blocks[0], "cert_cache", enabled);
+		free(blocks);
+	}
+	return enabled;
+}
+
+/**
+ * Compose the cache file name of the currently selected EF.
+ *
+ * Files are named after the card serial number and the EF path, so
+ * that each card gets its own set.
+ *
+ * @param card pointer to card info data
+ * @param name where to store the file name
+ * @param namelen size of name buffer
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int dnie_cert_cache_name(sc_card_t * card, char *name, size_t namelen)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+	sc_serial_number_t serial;
+	char dir[PATH_MAX];
+	char serial_hex[SC_MAX_SERIALNR * 2 + 1];
+	char path_hex[SC_MAX_PATH_SIZE * 2 + 1];
+	int res;
+
+	if (!priv->cert_cache || priv->cache_path.len == 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	res = dnie_get_serialnr(card, &serial);
+	if (res != SC_SUCCESS)
+		return res;
+	sc_bin_to_hex(serial.value, serial.len, serial_hex, sizeof(serial_hex), 0);
+	sc_bin_to_hex(priv->cache_path.value, priv->cache_path.len,
+		      path_hex, sizeof(path_hex), 0);
+	res = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (res != SC_SUCCESS)
+		return res;
+	res = snprintf(name, namelen, "%s/dnie_%s_%s", dir, serial_hex, path_hex);
+	if (res < 0 || (size_t)res >= namelen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/**
+ * Fill read_binary() cache from the cache directory.
+ *
+ * The file holds "DNIC", the EF size from its FCI (4 bytes, big endian)
+ * and the decompressed contents. The stored size must match the FCI
+ * of the EF just selected.
+ *
+ * @param card pointer to card info data
+ * @return SC_SUCCESS if cache was filled; else error code
+ */
+static int dnie_cert_cache_load(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+	char name[PATH_MAX];
+	u8 head[8];
+	u8 *data = NULL;
+	long len;
+	FILE *f;
+
+	if (dnie_cert_cache_name(card, name, sizeof(name)) != SC_SUCCESS)
+		return SC_ERROR_FILE_NOT_FOUND;
+	f = fopen(name, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fread(head, 1, sizeof(head), f) != sizeof(head)
+	    || memcmp(head, "DNIC", 4) != 0
+	    || bebytes2ulong(head + 4) != priv->cache_fsize
+	    || fseek(f, 0, SEEK_END) != 0
+	    || (len = ftell(f) - (long)sizeof(head)) <= 0
+	    || len > DNIE_CERT_CACHE_MAX_LEN
+	    || fseek(f, sizeof(head), SEEK_SET) != 0)
+		goto stale;
+	data = malloc(len);
+	if (data == NULL || fread(data, 1, len, f) != (size_t)len)
+		goto stale;
+	fclose(f);
+	priv->cache = data;
+	priv->cachelen = len;
+	sc_log(card->ctx, "read '%ld' bytes from '%s'", len, name);
+	return SC_SUCCESS;
+
+ stale:
+	sc_log(card->ctx, "ignoring stale cache file '%s'", name);
+	free(data);
+	fclose(f);
+	unlink(name);
+	return SC_ERROR_FILE_NOT_FOUND;
+}
+
+/**
+ * Store read_binary() cache into the cache directory.
+ *
+ * Only data read without secure messaging is stored: it is readable
+ * by anyone holding the card, so keeping it on disk discloses nothing.
+ *
+ * @param card pointer to card info data
+ */
+static void dnie_cert_cache_save(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+	char name[PATH_MAX], tmpname[PATH_MAX];
+	u8 head[8];
+	int res = 0;
+	FILE *f;
+
+	if (priv->cache == NULL || priv->cachelen == 0
+	    || priv->cachelen > DNIE_CERT_CACHE_MAX_LEN
+	    || priv->cwa_provider->status.session.state == CWA_SM_ACTIVE)
+		return;
+	if (dnie_cert_cache_name(card, name, sizeof(name)) != SC_SUCCESS)
+		return;
+	if (snprintf(tmpname, sizeof(tmpname), "%s.%lu", name,
+		     (unsigned long)getpid()) >= (int)sizeof(tmpname))
+		return;
+
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return;
+	memcpy(head, "DNIC", 4);
+	ulong2bebytes(head + 4, priv->cache_fsize);
+	if (fwrite(head, 1, sizeof(head), f) != sizeof(head)
+	    || fwrite(priv->cache, 1, priv->cachelen, f) != priv->cachelen)
+		res = -1;
+	if (fclose(f) != 0)
+		res = -1;
+	if (res == 0) {
+#ifdef _WIN32
+		unlink(name);
+#endif
+		if (rename(tmpname, name) == 0)
+			return;
+	}
+	sc_log(card->ctx, "cannot store file cache into '%s'", name);
+	unlink(tmpname);
+}
+
 static inline void init_flags(struct sc_card *card)
 {
 	unsigned long algoflags;
@@ -571,6 +742,8 @@ static int dnie_init(struct sc_card *card)
 #endif
 
 	GET_DNIE_PRIV_DATA(card)->cwa_provider = provider;
+	GET_DNIE_PRIV_DATA(card)->cert_cache = dnie_get_cert_cache_conf(card);
+	provider->cache_chains = GET_DNIE_PRIV_DATA(card)->cert_cache;
 
 	LOG_FUNC_RETURN(card->ctx, res);
 }
@@ -719,6 +892,10 @@ static int dnie_fill_cache(sc_card_t * card)
 	/* mark cache empty */
 	dnie_clear_cache(GET_DNIE_PRIV_DATA(card));
 
+	/* public files already read by a former connection */
+	if (dnie_cert_cache_load(card) == SC_SUCCESS)
+		LOG_FUNC_RETURN(ctx, GET_DNIE_PRIV_DATA(card)->cachelen);
+
 	/* initialize apdu */
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, 0x00, 0x00);
 
@@ -781,6 +958,7 @@ static int dnie_fill_cache(sc_card_t * card)
 	/* ok: as final step, set correct cache data into dnie_priv structures */
 	GET_DNIE_PRIV_DATA(card)->cache = pt;
 	GET_DNIE_PRIV_DATA(card)->cachelen = len;
+	dnie_cert_cache_save(card);
 	sc_log(ctx, "fill_cache() done. length '%d' bytes", len);
 	LOG_FUNC_RETURN(ctx,len);
 }
@@ -959,6 +1137,8 @@ static int dnie_select_file(struct sc_card *card,
 
 	memcpy(path, in_path->value, in_path->len);
 	pathlen = in_path->len;
+	/* selected EF is unknown until the card tells otherwise */
+	GET_DNIE_PRIV_DATA(card)->cache_path.len = 0;
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xA4, 0, 0);
 
@@ -1099,6 +1279,15 @@ static int dnie_select_file(struct sc_card *card,
 	*file_out = file;
         /* if file is a DF, store it into DF cache */
 	if (file->type==SC_FILE_TYPE_DF) dnie_cache_path(card,file);
+	/* else remember where the EF lives, to name its cache file */
+	else if (in_path->type == SC_PATH_TYPE_FILE_ID && card->cache.valid
+		 && card->cache.current_path.len + 2 <= SC_MAX_PATH_SIZE) {
+		sc_path_t *cpath = &GET_DNIE_PRIV_DATA(card)->cache_path;
+		*cpath = card->cache.current_path;
+		memcpy(cpath->value + cpath->len, in_path->value, 2);
+		cpath->len += 2;
+		GET_DNIE_PRIV_DATA(card)->cache_fsize = file->size;
+	}
 	/* as last step clear data cache and return */
 	dnie_clear_cache(GET_DNIE_PRIV_DATA(card));
 	LOG_FUNC_RETURN(ctx, res);
@@ -1608,17 +1797,16 @@ static int dnie_check_sw(struct sc_card *card,
 			 unsigned int sw1, unsigned int sw2)
 {
 	int res = SC_SUCCESS;
-	int n = 0;
+	const struct sc_card_error *err;
 	if (!card || !card->ctx)
 		return SC_ERROR_INVALID_ARGUMENTS;
 	LOG_FUNC_CALLED(card->ctx);
 
 	/* check specific dnie errors */
-	for (n = 0; dnie_errors[n].SWs != 0; n++) {
-		if (dnie_errors[n].SWs == ((sw1 << 8) | sw2)) {
-			sc_log(card->ctx, "%s", dnie_errors[n].errorstr);
-			return dnie_errors[n].errorno;
-		}
+	err = sc_sw_map_find(&dnie_sw_map, sw1, sw2);
+	if (err != NULL) {
+		sc_log(card->ctx, "%s", err->errorstr);
+		return err->errorno;
 	}
 
 	/* arriving here means check for supported iso error codes */
@@ -2114,6 +2302,8 @@ static sc_card_driver_t *get_dnie_driver(void)
 	if (iso_ops == NULL)
 		iso_ops = iso_drv->ops;
 	dnie_ops = *iso_drv->ops;
+	sc_sw_map_init(&dnie_sw_map, dnie_errors,
+			sizeof(dnie_errors)/sizeof(dnie_errors[0]));
 
 	/* fill card specific function pointers */
 	/* NULL means that function is not supported neither by DNIe nor iso7816.c */
@@ -826,12 +826,7 @@ epass2003_sm_free_wrapped_apdu(struct sc_card *card,
 	if (plain)
 		rv = epass2003_sm_unwrap_apdu(card, *sm_apdu, plain);
 
-	if ((*sm_apdu)->data)
-		free((unsigned char *) (*sm_apdu)->data);
-	if ((*sm_apdu)->resp)
-		free((*sm_apdu)->resp);
-	free(*sm_apdu);
-	*sm_apdu = NULL;
+	sc_sm_release_scratch_apdu(card, sm_apdu);
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -851,15 +846,8 @@ epass2003_sm_get_wrapped_apdu(struct sc_card *card,
 
 	*sm_apdu = NULL;
 	//construct new SM apdu from original apdu
-	apdu = calloc(1, sizeof(struct sc_apdu));
-	if (!apdu)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	apdu->data = calloc (1, SC_MAX_EXT_APDU_BUFFER_SIZE);
-	if (!apdu->data)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	apdu->resp = calloc (1, SC_MAX_EXT_APDU_BUFFER_SIZE);
-	if (!apdu->resp)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	rv = sc_sm_get_scratch_apdu(card, SC_MAX_EXT_APDU_BUFFER_SIZE, SC_MAX_EXT_APDU_BUFFER_SIZE, &apdu);
+	LOG_TEST_RET(ctx, rv, "cannot get SM APDU buffers");
 	apdu->datalen = SC_MAX_EXT_APDU_BUFFER_SIZE;
 	apdu->resplen = SC_MAX_EXT_APDU_BUFFER_SIZE;
 
@@ -116,6 +116,7 @@ static int iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *
 static int iasecc_pin_is_verified(struct sc_card *card, struct sc_pin_cmd_data *pin_cmd, int *tries_left);
 static int iasecc_get_free_reference(struct sc_card *card, struct iasecc_ctl_get_free_reference *ctl_data);
 static int iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update);
+static void iasecc_sdo_cache_clear(struct sc_card *card);
 
 #ifdef ENABLE_SM
 static int _iasecc_sm_read_binary(struct sc_card *card, unsigned int offs, unsigned char *buf, size_t count);
@@ -1325,6 +1326,8 @@ iasecc_finish(struct sc_card *card)
 
 	LOG_FUNC_CALLED(ctx);
 
+	iasecc_sdo_cache_clear(card);
+
 	while (se_info)   {
 		if (se_info->df)
 			sc_file_free(se_info->df);
@@ -1895,6 +1898,7 @@ iasecc_pin_verify(struct sc_card *card, unsigned type, unsigned reference,
 	sc_log(ctx, "Verify PIN(type:%X,ref:%i,data(len:%i,%p)", type, reference, data_len, data);
 
 	if (type == SC_AC_AUT)   {
+		iasecc_sdo_cache_clear(card);
 		rv =  iasecc_sm_external_authentication(card, reference, tries_left);
 		LOG_FUNC_RETURN(ctx, rv);
 	}
@@ -2347,6 +2351,7 @@ iasecc_pin_reset(struct sc_card *card, struct sc_pin_cmd_data *data, int *tries_
 		}
 
 		if (scb & IASECC_SCB_METHOD_EXT_AUTH)   {
+			iasecc_sdo_cache_clear(card);
 			rv =  iasecc_sm_external_authentication(card, reference, tries_left);
 			LOG_TEST_RET(ctx, rv, "iasecc_pin_reset() external authentication error");
 		}
@@ -2517,6 +2522,7 @@ iasecc_sdo_create(struct sc_card *card, struct iasecc_sdo *sdo)
 	int rv = SC_ERROR_NOT_SUPPORTED, data_len;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 	if (sdo->magic != SC_CARDCTL_IASECC_SDO_MAGIC)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO data");
 
@@ -2582,6 +2588,7 @@ iasecc_sdo_delete(struct sc_card *card, struct iasecc_sdo *sdo)
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 	if (sdo->magic != SC_CARDCTL_IASECC_SDO_MAGIC)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO data");
 
@@ -2616,6 +2623,8 @@ iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update)
 	if (update->magic != SC_CARDCTL_IASECC_SDO_MAGIC_PUT_DATA)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO update data");
 
+	iasecc_sdo_cache_clear(card);
+
 	for(ii=0; update->fields[ii].tag && ii < IASECC_SDO_TAGS_UPDATE_MAX; ii++)   {
 		unsigned char *encoded = NULL;
 		int encoded_len;
@@ -2784,14 +2793,99 @@ iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo
 }
 
 
+/*
+ * Parsed key SDOs of the current DF. CHV and SE objects are not kept:
+ * their DOCP carries the tries counters, which change on every verification.
+ */
+struct iasecc_sdo_cache {
+	struct iasecc_sdo sdo;
+	struct sc_path df_path;		/* empty if no DF was known */
+	struct iasecc_sdo_cache *next;
+};
+
+
+static void
+iasecc_sdo_cache_clear(struct sc_card *card)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *sc, *next;
+
+	if (!prv)
+		return;
+	for (sc = prv->sdo_cache; sc; sc = next)   {
+		next = sc->next;
+		iasecc_sdo_free_fields(card, &sc->sdo);
+		free(sc);
+	}
+	prv->sdo_cache = NULL;
+	prv->sdo_cache_generation = card->card_generation;
+}
+
+
+static struct iasecc_sdo_cache *
+iasecc_sdo_cache_find(struct sc_card *card, struct iasecc_sdo *sdo)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct sc_path df_path;
+	struct iasecc_sdo_cache *sc;
+
+	/* the card was reset since the SDOs were read */
+	if (prv->sdo_cache_generation != card->card_generation)
+		iasecc_sdo_cache_clear(card);
+
+	memset(&df_path, 0, sizeof(df_path));
+	if (card->cache.valid && card->cache.current_df)
+		df_path = card->cache.current_df->path;
+
+	for (sc = prv->sdo_cache; sc; sc = sc->next)
+		if (sc->sdo.sdo_class == sdo->sdo_class && sc->sdo.sdo_ref == sdo->sdo_ref
+				&& sc_compare_path(&sc->df_path, &df_path))
+			return sc;
+	return NULL;
+}
+
+
+static void
+iasecc_sdo_cache_add(struct sc_card *card, struct iasecc_sdo *sdo)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *sc;
+
+	if (sdo->sdo_class != IASECC_SDO_CLASS_RSA_PRIVATE && sdo->sdo_class != IASECC_SDO_CLASS_RSA_PUBLIC)
+		return;
+
+	sc = calloc(1, sizeof(struct iasecc_sdo_cache));
+	if (!sc)
+		return;
+	if (iasecc_sdo_copy(card, sdo, &sc->sdo))   {
+		iasecc_sdo_free_fields(card, &sc->sdo);
+		free(sc);
+		return;
+	}
+	if (card->cache.valid && card->cache.current_df)
+		sc->df_path = card->cache.current_df->path;
+
+	sc->next = prv->sdo_cache;
+	prv->sdo_cache = sc;
+}
+
+
 static int
 iasecc_sdo_get_data(struct sc_card *card, struct iasecc_sdo *sdo)
 {
 	struct sc_context *ctx = card->ctx;
+	struct iasecc_sdo_cache *sc;
 	int rv, sdo_tag;
 
 	LOG_FUNC_CALLED(ctx);
 
+	sc = iasecc_sdo_cache_find(card, sdo);
+	if (sc)   {
+		sc_log(ctx, "SDO %02X:%02X found in cache", sdo->sdo_class, sdo->sdo_ref);
+		rv = iasecc_sdo_copy(card, &sc->sdo, sdo);
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
 	sdo_tag = iasecc_sdo_tag_from_class(sdo->sdo_class);
 
 	rv = iasecc_sdo_get_tagged_data(card, sdo_tag, sdo);
@@ -2802,6 +2896,8 @@ iasecc_sdo_get_data(struct sc_card *card, struct iasecc_sdo *sdo)
 	rv = iasecc_sdo_get_tagged_data(card, IASECC_DOCP_TAG, sdo);
 	LOG_TEST_RET(ctx, rv, "cannot parse ECC DOCP data");
 
+	iasecc_sdo_cache_add(card, sdo);
+
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
@@ -2817,6 +2913,7 @@ iasecc_sdo_generate(struct sc_card *card, struct iasecc_sdo *sdo)
 
 	LOG_FUNC_CALLED(ctx);
 
+	iasecc_sdo_cache_clear(card);
 	if (sdo->sdo_class != IASECC_SDO_CLASS_RSA_PRIVATE)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "For a moment, only RSA_PRIVATE class can be accepted for the SDO generation");
 
@@ -2957,6 +3054,7 @@ iasecc_decipher(struct sc_card *card,
 		unsigned char *out, size_t out_len)
 {
 	struct sc_context *ctx = card->ctx;
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
 	struct sc_apdu apdu;
 	unsigned char sbuf[0x200];
 	unsigned char resp[SC_MAX_APDU_BUFFER_SIZE];
@@ -2973,8 +3071,19 @@ iasecc_decipher(struct sc_card *card,
 	memcpy(sbuf + offs, in, in_len);
 	offs += in_len;
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0x2A, 0x80, 0x86);
-	apdu.flags |= SC_APDU_FLAGS_CHAINING;
+	if (prv->op_method == SC_AC_SCB && (prv->op_ref & IASECC_SCB_METHOD_SM))   {
+		rv = iasecc_sm_decipher(card, prv->op_ref & IASECC_SCB_METHOD_MASK_REF, sbuf, offs, out, out_len);
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
+	/* one extended APDU rather than a chain, when the card takes it */
+	if ((card->caps & SC_CARD_CAP_APDU_EXT) && sc_get_max_send_size(card) >= offs)   {
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0x2A, 0x80, 0x86);
+	}
+	else   {
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0x2A, 0x80, 0x86);
+		apdu.flags |= SC_APDU_FLAGS_CHAINING;
+	}
 	apdu.data = sbuf;
 	apdu.datalen = offs;
 	apdu.lc = offs;
@@ -3155,8 +3264,10 @@ iasecc_compute_signature_dst(struct sc_card *card,
 	offs += qsign_data.last_block_size;
 
 	sc_log(ctx, "iasecc_compute_signature_dst() offs %i; OP(meth:%X,ref:%X)", offs, prv->op_method, prv->op_ref);
-	if (prv->op_method == SC_AC_SCB && (prv->op_ref & IASECC_SCB_METHOD_SM))
-		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Not yet");
+	if (prv->op_method == SC_AC_SCB && (prv->op_ref & IASECC_SCB_METHOD_SM))   {
+		rv = iasecc_sm_compute_signature_dst(card, prv->op_ref & IASECC_SCB_METHOD_MASK_REF, sbuf, offs, out, out_len);
+		LOG_FUNC_RETURN(ctx, rv);
+	}
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x2A, 0x90, 0xA0);
 	apdu.data = sbuf;
@@ -142,18 +142,16 @@ static const struct sc_card_error incrypto34_errors[] = {
 { 0x9850, SC_SUCCESS,		"over/underflow useing in/decrease"}
 };
 
+static struct sc_sw_map incrypto34_sw_map;
+
 static int incrypto34_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 {
-	const int err_count = sizeof(incrypto34_errors)/sizeof(incrypto34_errors[0]);
-	int i;
+	const struct sc_card_error *err = sc_sw_map_find(&incrypto34_sw_map, sw1, sw2);
 
-	for (i = 0; i < err_count; i++) {
-		if (incrypto34_errors[i].SWs == ((sw1 << 8) | sw2)) {
-			if ( incrypto34_errors[i].errorstr )
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n",
-				 	incrypto34_errors[i].errorstr);
-			return incrypto34_errors[i].errorno;
-		}
+	if (err != NULL) {
+		if (err->errorstr)
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n", err->errorstr);
+		return err->errorno;
 	}
 
         sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Unknown SWs; SW1=%02X, SW2=%02X\n", sw1, sw2);
@@ -862,6 +860,8 @@ static struct sc_card_driver * sc_get_driver(void)
 	if (iso_ops == NULL)
 		iso_ops = sc_get_iso7816_driver()->ops;
 	incrypto34_ops = *iso_ops;
+	sc_sw_map_init(&incrypto34_sw_map, incrypto34_errors,
+			sizeof(incrypto34_errors)/sizeof(incrypto34_errors[0]));
 	incrypto34_ops.match_card = incrypto34_match_card;
 	incrypto34_ops.init = incrypto34_init;
 	incrypto34_ops.select_file = incrypto34_select_file;
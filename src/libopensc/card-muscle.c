@@ -57,6 +57,7 @@ typedef struct muscle_private {
 	unsigned short verifiedPins;
 	mscfs_t *fs;
 	int rsa_key_ref;
+	unsigned int fs_generation; /* card generation the object list was read in */
 	
 } muscle_private_t;
 
@@ -357,6 +358,17 @@ static void muscle_load_dir_acls(sc_file_t* file, mscfs_file_t *file_data)
 }
 
 /* Required type = -1 for don't care, 1 for EF, 0 for DF */
+/* The object list stays valid for as long as the card was not reset */
+static void muscle_check_cache(sc_card_t *card)
+{
+	muscle_private_t* priv = MUSCLE_DATA(card);
+
+	if (priv->fs->cache.array && priv->fs_generation != card->card_generation)
+		mscfs_clear_cache(priv->fs);
+	priv->fs_generation = card->card_generation;
+	mscfs_check_cache(priv->fs);
+}
+
 static int select_item(sc_card_t *card, const sc_path_t *path_in, sc_file_t ** file_out, int requiredType)
 {
 	mscfs_t *fs = MUSCLE_FS(card);
@@ -366,7 +378,7 @@ static int select_item(sc_card_t *card, const sc_path_t *path_in, sc_file_t ** f
 	int objectIndex;
 	u8* oid;
 	
-	mscfs_check_cache(fs);
+	muscle_check_cache(card);
 	r = mscfs_loadFileInfo(fs, path_in->value, path_in->len, &file_data, &objectIndex);
 	if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
 	
@@ -502,7 +514,7 @@ static int muscle_list_files(sc_card_t *card, u8 *buf, size_t bufLen)
 	int x;
 	int count = 0;
 
-	mscfs_check_cache(priv->fs);
+	muscle_check_cache(card);
 	
 	for(x = 0; x < fs->cache.size; x++) {
 		u8* oid= fs->cache.array[x].objectId.id;
@@ -110,14 +110,20 @@ enum _card_state {
 	CARD_STATE_ACTIVATED      = 0x05
 };
 
+/* flags of a blob */
+#define BLOB_READ	0x01	/* contents known, data may be empty or status an error */
+#define BLOB_ENUMERATED	0x02	/* children created from the contents */
+
 struct blob {
 	struct blob *	next;	/* pointer to next sibling */
 	struct blob *	parent;	/* pointer to parent */
+	struct blob *	index_next;	/* next blob in the same bucket of the tag index */
 	struct do_info *info;
 
 	sc_file_t *	file;
 	unsigned int	id;
 	int		status;
+	unsigned int	flags;
 
 	unsigned char *	data;
 	unsigned int	len;
@@ -264,10 +270,15 @@ static struct do_info		pgp2_objects[] = {	/* OpenPGP card spec 2.0 */
  * We should notice this when building fake file system later. */
 #define DO_CERT		0x7f21
 
+/* all blobs, hashed by tag; blobs are only freed by pgp_finish() */
+#define BLOB_INDEX_SIZE		32
+#define BLOB_INDEX_HASH(id)	(((id) ^ ((id) >> 8)) % BLOB_INDEX_SIZE)
+
 #define DRVDATA(card)        ((struct pgp_priv_data *) ((card)->drv_data))
 struct pgp_priv_data {
 	struct blob *		mf;
 	struct blob *		current;	/* currently selected file */
+	struct blob *		blob_index[BLOB_INDEX_SIZE];
 
 	enum _version		bcd_version;
 	struct do_info		*pgp_objects;
@@ -523,6 +534,7 @@ pgp_set_blob(struct blob *blob, const u8 *data, size_t len)
 	blob->data = NULL;
 	blob->len    = 0;
 	blob->status = 0;
+	blob->flags |= BLOB_READ;
 
 	if (len > 0) {
 		void *tmp = calloc(len, 1);
@@ -663,12 +675,42 @@ pgp_new_blob(sc_card_t *card, struct blob *parent, unsigned int file_id,
 				break;
 			}
 		}
+
+		blob->index_next = priv->blob_index[BLOB_INDEX_HASH(file_id)];
+		priv->blob_index[BLOB_INDEX_HASH(file_id)] = blob;
 	}
 
 	return blob;
 }
 
 
+/* internal: look up a blob in the tag index.
+ * With a parent, the child of that parent with the ID is returned.
+ * Without one, the blob is returned only if no other blob has the ID. */
+static struct blob *
+pgp_index_blob(struct pgp_priv_data *priv, struct blob *parent, unsigned int id)
+{
+	struct blob *blob, *found = NULL;
+
+	for (blob = priv->blob_index[BLOB_INDEX_HASH(id)]; blob; blob = blob->index_next) {
+		if (blob->id != id)
+			continue;
+		if (parent != NULL) {
+			if (blob->parent == parent)
+				return blob;
+		}
+		else if (found != NULL) {
+			return NULL;
+		}
+		else {
+			found = blob;
+		}
+	}
+
+	return found;
+}
+
+
 /* internal: free a blob including its content */
 static void
 pgp_free_blob(struct blob *blob)
@@ -719,7 +761,7 @@ pgp_read_blob(sc_card_t *card, struct blob *blob)
 {
 	if (blob->data != NULL)
 		return SC_SUCCESS;
-	if (blob->info == NULL)
+	if (blob->info == NULL || blob->flags & BLOB_READ)
 		return blob->status;
 
 	if (blob->info->get_fn) {	/* readable, top-level DO */
@@ -730,6 +772,10 @@ pgp_read_blob(sc_card_t *card, struct blob *blob)
 
 		if (r < 0) {	/* an error occurred */
 			blob->status = r;
+			/* remember empty key slots and absent DOs, but retry
+			 * e.g. after a PIN was verified */
+			if (r == SC_ERROR_DATA_OBJECT_NOT_FOUND || r == SC_ERROR_FILE_NOT_FOUND)
+				blob->flags |= BLOB_READ;
 			return r;
 		}
 
@@ -751,7 +797,7 @@ pgp_enumerate_blob(sc_card_t *card, struct blob *blob)
 	const u8	*in;
 	int		r;
 
-	if (blob->files != NULL)
+	if (blob->files != NULL || blob->flags & BLOB_ENUMERATED)
 		return SC_SUCCESS;
 
 	if ((r = pgp_read_blob(card, blob)) < 0)
@@ -787,6 +833,7 @@ pgp_enumerate_blob(sc_card_t *card, struct blob *blob)
 		in = data + len;
 	}
 
+	blob->flags |= BLOB_ENUMERATED;
 	return SC_SUCCESS;
 }
 
@@ -802,12 +849,11 @@ pgp_get_blob(sc_card_t *card, struct blob *blob, unsigned int id,
 	if ((r = pgp_enumerate_blob(card, blob)) < 0)
 		return r;
 
-	for (child = blob->files; child; child = child->next) {
-		if (child->id == id) {
-			(void) pgp_read_blob(card, child);
-			*ret = child;
-			return SC_SUCCESS;
-		}
+	child = pgp_index_blob(DRVDATA(card), blob, id);
+	if (child != NULL) {
+		(void) pgp_read_blob(card, child);
+		*ret = child;
+		return SC_SUCCESS;
 	}
 
 	return SC_ERROR_FILE_NOT_FOUND;
@@ -851,6 +897,12 @@ pgp_find_blob(sc_card_t *card, unsigned int tag)
 	if (priv->current->id == tag) {
 		return priv->current;
 	}
+	/* A blob already created for a tag that is unique on the card */
+	blob = pgp_index_blob(priv, NULL, tag);
+	if (blob != NULL) {
+		(void) pgp_read_blob(card, blob);
+		return blob;
+	}
 	/* Look for the blob representing the DO */
 	r = pgp_seek_blob(card, priv->mf, tag, &blob);
 	if (r < 0) {
@@ -1648,6 +1700,13 @@ pgp_update_pubkey_blob(sc_card_t *card, u8* modulus, size_t modulus_len,
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
 
+	/* the key slot may have been remembered as empty */
+	pk_blob = pgp_index_blob(priv, priv->mf, blob_id & 0xFFFE);
+	if (pk_blob != NULL && pk_blob->data == NULL) {
+		pk_blob->flags &= ~BLOB_READ;
+		pk_blob->status = 0;
+	}
+
 	sc_log(card->ctx, "Get the blob %X.", blob_id);
 	r = pgp_get_blob(card, priv->mf, blob_id, &pk_blob);
 	LOG_TEST_RET(card->ctx, r, "Cannot get the blob.");
@@ -1759,7 +1818,7 @@ static int pgp_update_card_algorithms(sc_card_t *card, sc_cardctl_openpgp_keygen
 	algo = card->algorithms + (id - 1);
 	/* Update new key length attribute */
 	algo->key_length = key_info->modulus_len;
-	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	LOG_FUNC_RETURN(card->ctx, _sc_card_index_algorithms(card));
 }
 
 /**
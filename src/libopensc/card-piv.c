@@ -25,6 +25,7 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -118,9 +119,12 @@ enum {
  * If the file lilsted in the history object offCardCertURL was found,
  * its certs will be read into the cache and PIV_OBJ_CACHE_VALID set
  * and PIV_OBJ_CACHE_NOT_PRESENT unset.
+ * PIV_OBJ_CACHE_FROM_CARD means the data was read from the card
+ * (or from the object cache file) and may be kept in the object cache file.
  */
 
 #define PIV_OBJ_CACHE_VALID			1
+#define PIV_OBJ_CACHE_FROM_CARD		2
 #define PIV_OBJ_CACHE_NOT_PRESENT	8
 
 typedef struct piv_obj_cache {
@@ -149,6 +153,9 @@ typedef struct piv_private_data {
 	int keysWithOffCardCerts;
 	char * offCardCertURL;
 	int pin_preference; /* set from Discovery object */
+	int object_cache; /* keep objects in the cache directory between connections */
+	int object_cache_dirty; /* objects were read from the card */
+	char object_cache_file[PATH_MAX]; /* named after the FASC-N and GUID of the CHUID */
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
@@ -182,11 +189,14 @@ static struct piv_aid piv_aids[] = {
  * Flags in the piv_object:
  * PIV_OBJECT_NOT_PRESENT: the presents of the object is
  * indicated by the History object.
+ * PIV_OBJECT_NEEDS_PIN: the object can only be read after
+ * PIN verification and is never written to the object cache file.
  */
 
 #define PIV_OBJECT_TYPE_CERT		1
 #define PIV_OBJECT_TYPE_PUBKEY		2
 #define PIV_OBJECT_NOT_PRESENT		4
+#define PIV_OBJECT_NEEDS_PIN		8
 
 struct piv_object {
 	int enumtag;
@@ -207,11 +217,11 @@ static const struct piv_object piv_objects[] = {
 	{ PIV_OBJ_X509_PIV_AUTH, "X.509 Certificate for PIV Authentication",
 			"2.16.840.1.101.3.7.2.1.1", 3, "\x5F\xC1\x05", "\x01\x01", PIV_OBJECT_TYPE_CERT} ,
 	{ PIV_OBJ_CHF, "Card Holder Fingerprints",
-			"2.16.840.1.101.3.7.2.96.16", 3, "\x5F\xC1\x03", "\x60\x10", 0},
+			"2.16.840.1.101.3.7.2.96.16", 3, "\x5F\xC1\x03", "\x60\x10", PIV_OBJECT_NEEDS_PIN},
 	{ PIV_OBJ_PI, "Printed Information",
-			"2.16.840.1.101.3.7.2.48.1", 3, "\x5F\xC1\x09", "\x30\x01", 0},
+			"2.16.840.1.101.3.7.2.48.1", 3, "\x5F\xC1\x09", "\x30\x01", PIV_OBJECT_NEEDS_PIN},
 	{ PIV_OBJ_CHFI, "Cardholder Facial Images",
-			"2.16.840.1.101.3.7.2.96.48", 3, "\x5F\xC1\x08", "\x60\x30", 0},
+			"2.16.840.1.101.3.7.2.96.48", 3, "\x5F\xC1\x08", "\x60\x30", PIV_OBJECT_NEEDS_PIN},
 	{ PIV_OBJ_X509_DS, "X.509 Certificate for Digital Signature",
 			"2.16.840.1.101.3.7.2.1.0", 3, "\x5F\xC1\x0A", "\x01\x00", PIV_OBJECT_TYPE_CERT},
 	{ PIV_OBJ_X509_KM, "X.509 Certificate for Key Management",
@@ -288,7 +298,7 @@ static const struct piv_object piv_objects[] = {
 			PIV_OBJECT_NOT_PRESENT|PIV_OBJECT_TYPE_CERT},
 
 	{ PIV_OBJ_IRIS_IMAGE, "Cardholder Iris Images",
-			"2.16.840.1.101.3.7.2.16.21", 3, "\x5F\xC1\x21", "\x10\x15", 0},
+			"2.16.840.1.101.3.7.2.16.21", 3, "\x5F\xC1\x21", "\x10\x15", PIV_OBJECT_NEEDS_PIN},
 
 /* following not standard , to be used by piv-tool only for testing */
 	{ PIV_OBJ_9B03, "3DES-ECB ADM",
@@ -979,7 +989,8 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 	rbuflen = 1;
 	r = piv_get_data(card, enumtag, &rbuf, &rbuflen);
 	if (r > 0) {
-		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_FROM_CARD;
+		priv->object_cache_dirty = 1;
 		priv->obj_cache[enumtag].obj_len = r;
 		priv->obj_cache[enumtag].obj_data = rbuf;
 		*buf = rbuf;
@@ -994,7 +1005,8 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 
 	} else if (r == 0 || r == SC_ERROR_FILE_NOT_FOUND) {
 		r = SC_ERROR_FILE_NOT_FOUND;
-		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_FROM_CARD;
+		priv->object_cache_dirty = 1;
 		priv->obj_cache[enumtag].obj_len = 0;
 	} else if ( r < 0) {
 		goto err;
@@ -1006,6 +1018,212 @@ err:
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
+/*
+ * The object cache file keeps the objects read with GET DATA between
+ * connections and processes. It is named after the FASC-N and GUID of
+ * the CHUID and starts with the complete CHUID: on connect only the CHUID
+ * is read from the card, and if it differs (the card was reissued) the
+ * file is ignored and rewritten.
+ * File: "PIVC" version CHUID-len(4) CHUID { enumtag len(4) data }...
+ * A record with zero length means the object is not on the card.
+ * Objects which need the PIN, the CHUID itself and the piv-tool test
+ * objects are never written.
+ */
+#define PIV_OBJECT_CACHE_VERSION	1
+#define PIV_OBJECT_CACHE_MAX_LEN	0x10000
+
+static int piv_object_cache_wanted(int enumtag)
+{
+	return enumtag != PIV_OBJ_CHUI && enumtag < PIV_OBJ_9B03
+		&& !(piv_objects[enumtag].flags & PIV_OBJECT_NEEDS_PIN);
+}
+
+static int piv_object_cache_read_len(FILE *f, size_t *len)
+{
+	u8 b[4];
+
+	if (fread(b, 1, sizeof(b), f) != sizeof(b))
+		return -1;
+	*len = (size_t)b[0] << 24 | (size_t)b[1] << 16 | (size_t)b[2] << 8 | b[3];
+	return 0;
+}
+
+static int piv_object_cache_write_len(FILE *f, size_t len)
+{
+	u8 b[4];
+
+	b[0] = (len >> 24) & 0xff;
+	b[1] = (len >> 16) & 0xff;
+	b[2] = (len >> 8) & 0xff;
+	b[3] = len & 0xff;
+	return fwrite(b, 1, sizeof(b), f) == sizeof(b) ? 0 : -1;
+}
+
+static int piv_object_cache_name(sc_card_t *card, const u8 *chui, size_t chuilen)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char dir[PATH_MAX];
+	char fascn_hex[25 * 2 + 1] = "", guid_hex[16 * 2 + 1] = "";
+	const u8 *body, *fascn, *guid;
+	size_t bodylen, fascnlen = 0, guidlen = 0;
+	int r;
+
+	body = sc_asn1_find_tag(card->ctx, chui, chuilen, 0x53, &bodylen);
+	if (body == NULL || bodylen == 0)
+		return SC_ERROR_INVALID_DATA;
+	fascn = sc_asn1_find_tag(card->ctx, body, bodylen, 0x30, &fascnlen);
+	guid = sc_asn1_find_tag(card->ctx, body, bodylen, 0x34, &guidlen);
+	if (fascn && fascnlen == 25)
+		sc_bin_to_hex(fascn, fascnlen, fascn_hex, sizeof(fascn_hex), 0);
+	if (guid && guidlen == 16)
+		sc_bin_to_hex(guid, guidlen, guid_hex, sizeof(guid_hex), 0);
+	if (fascn_hex[0] == '\0' && guid_hex[0] == '\0')
+		return SC_ERROR_INVALID_DATA;
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(priv->object_cache_file, sizeof(priv->object_cache_file),
+			"%s/piv_%s_%s", dir, fascn_hex, guid_hex);
+	if (r < 0 || (size_t)r >= sizeof(priv->object_cache_file)) {
+		priv->object_cache_file[0] = '\0';
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	}
+	return SC_SUCCESS;
+}
+
+static void piv_object_cache_load(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	u8 *chui = NULL, *data, *cached = NULL;
+	size_t chuilen = 0, len;
+	u8 magic[5];
+	int enumtag, loaded = 0;
+	FILE *f;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	/* the one GET DATA needed to validate the file */
+	if (piv_get_cached_data(card, PIV_OBJ_CHUI, &chui, &chuilen) <= 0
+			|| piv_object_cache_name(card, chui, chuilen) != SC_SUCCESS) {
+		priv->object_cache = 0;
+		return;
+	}
+	f = fopen(priv->object_cache_file, "rb");
+	if (f == NULL)
+		return;
+
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+			|| memcmp(magic, "PIVC", 4) != 0
+			|| magic[4] != PIV_OBJECT_CACHE_VERSION
+			|| piv_object_cache_read_len(f, &len) != 0
+			|| len != chuilen)
+		goto stale;
+	cached = malloc(len);
+	if (cached == NULL || fread(cached, 1, len, f) != len
+			|| memcmp(cached, chui, len) != 0)
+		goto stale;
+
+	while ((enumtag = fgetc(f)) != EOF) {
+		if (enumtag >= PIV_OBJ_LAST_ENUM || !piv_object_cache_wanted(enumtag)
+				|| piv_object_cache_read_len(f, &len) != 0
+				|| len > PIV_OBJECT_CACHE_MAX_LEN)
+			break;
+		data = NULL;
+		if (len > 0) {
+			data = malloc(len);
+			if (data == NULL || fread(data, 1, len, f) != len) {
+				free(data);
+				break;
+			}
+		}
+		if (priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID) {
+			free(data);
+			continue;
+		}
+		priv->obj_cache[enumtag].obj_data = data;
+		priv->obj_cache[enumtag].obj_len = len;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_FROM_CARD;
+		loaded++;
+	}
+	sc_log(card->ctx, "%d objects from '%s'", loaded, priv->object_cache_file);
+	free(cached);
+	fclose(f);
+	return;
+
+stale:
+	sc_log(card->ctx, "'%s' does not match the CHUID", priv->object_cache_file);
+	/* rewrite it with what this connection reads */
+	priv->object_cache_dirty = 1;
+	free(cached);
+	fclose(f);
+}
+
+static void piv_object_cache_save(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	piv_obj_cache_t *chui = &priv->obj_cache[PIV_OBJ_CHUI];
+	char tmpname[PATH_MAX];
+	int i, r = 0;
+	FILE *f;
+
+	if (!priv->object_cache || !priv->object_cache_dirty
+			|| priv->object_cache_file[0] == '\0' || chui->obj_len == 0)
+		return;
+	if (snprintf(tmpname, sizeof(tmpname), "%s.%lu", priv->object_cache_file,
+				(unsigned long)getpid()) >= (int)sizeof(tmpname))
+		return;
+
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return;
+
+	if (fwrite("PIVC", 1, 4, f) != 4 || fputc(PIV_OBJECT_CACHE_VERSION, f) == EOF
+			|| piv_object_cache_write_len(f, chui->obj_len) != 0
+			|| fwrite(chui->obj_data, 1, chui->obj_len, f) != chui->obj_len)
+		r = -1;
+	for (i = 0; r == 0 && i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		piv_obj_cache_t *obj = &priv->obj_cache[i];
+
+		if (!piv_object_cache_wanted(i)
+				|| (obj->flags & (PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_FROM_CARD))
+					!= (PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_FROM_CARD)
+				|| obj->obj_len > PIV_OBJECT_CACHE_MAX_LEN)
+			continue;
+		if (fputc(i, f) == EOF || piv_object_cache_write_len(f, obj->obj_len) != 0
+				|| fwrite(obj->obj_data, 1, obj->obj_len, f) != obj->obj_len)
+			r = -1;
+	}
+	if (fclose(f) != 0)
+		r = -1;
+	if (r == 0) {
+#ifdef _WIN32
+		unlink(priv->object_cache_file);
+#endif
+		if (rename(tmpname, priv->object_cache_file) == 0)
+			return;
+	}
+	sc_log(card->ctx, "cannot store PIV objects in '%s'", priv->object_cache_file);
+	unlink(tmpname);
+}
+
+/* Objects are about to change on the card, forget the file */
+static void piv_object_cache_drop(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+
+	if (!priv->object_cache)
+		return;
+	if (priv->object_cache_file[0] != '\0')
+		unlink(priv->object_cache_file);
+	priv->object_cache = 0;
+}
+
 static int piv_cache_internal_data(sc_card_t *card, int enumtag)
 {
 	piv_private_data_t * priv = PIV_DATA(card);
@@ -1192,6 +1410,8 @@ static int piv_put_data(sc_card_t *card, int tag,
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	piv_object_cache_drop(card);
+
 	tag_len = piv_objects[tag].tag_len;
 	sbuflen = put_tag_and_len(0x5c, tag_len, NULL) + buf_len;
 	if (!(sbuf = malloc(sbuflen)))
@@ -2088,6 +2308,49 @@ static int piv_get_pin_preference(sc_card_t *card, int *ptr)
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
 }
 
+/*
+ * Read all certificate containers which may be on the card, as told by
+ * the Discovery and History objects, back to back under one card lock.
+ * The certificates are extracted (and decompressed) only after the lock
+ * is released, so other applications are not kept waiting for zlib.
+ * Called by pkcs15-piv.c before it asks for the certificates one by one.
+ */
+static int piv_prefetch_certs(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	u8 *rbuf;
+	size_t rbuflen;
+	int i, r, fetched = 0;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+	for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		if (!(piv_objects[i].flags & PIV_OBJECT_TYPE_CERT)
+				|| priv->obj_cache[i].flags & (PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_NOT_PRESENT))
+			continue;
+		r = piv_get_cached_data(card, i, &rbuf, &rbuflen);
+		if (r == SC_ERROR_CARD_REMOVED || r == SC_ERROR_CARD_RESET)
+			break;
+		if (r > 0)
+			fetched++;
+	}
+	sc_unlock(card);
+	if (r == SC_ERROR_CARD_REMOVED || r == SC_ERROR_CARD_RESET)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+
+	for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		if (piv_objects[i].flags & PIV_OBJECT_TYPE_CERT
+				&& priv->obj_cache[i].flags & PIV_OBJ_CACHE_VALID
+				&& priv->obj_cache[i].obj_len > 0)
+			piv_cache_internal_data(card, i);
+	}
+	sc_log(card->ctx, "prefetched %d certificate containers", fetched);
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
+}
+
 static int piv_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 {
 	piv_private_data_t * priv = PIV_DATA(card);
@@ -2126,6 +2389,9 @@ static int piv_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 		case SC_CARDCTL_PIV_OBJECT_PRESENT:
 			return piv_is_object_present(card, ptr);
 			break;
+		case SC_CARDCTL_PIV_PREFETCH:
+			return piv_prefetch_certs(card);
+			break;
 	}
 
 	LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
@@ -2757,10 +3023,17 @@ static int piv_process_history(sc_card_t *card)
 			*cp++ = 0x00;
 			put_tag_and_len(0xFE, 0, &cp);
 
+			if (priv->obj_cache[enumtag].obj_data)
+				free(priv->obj_cache[enumtag].obj_data);
+			if (priv->obj_cache[enumtag].internal_obj_data) {
+				free(priv->obj_cache[enumtag].internal_obj_data);
+				priv->obj_cache[enumtag].internal_obj_data = NULL;
+				priv->obj_cache[enumtag].internal_obj_len = 0;
+			}
 			priv->obj_cache[enumtag].obj_data = certobj;
 			priv->obj_cache[enumtag].obj_len = certobjlen;
 			priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
-			priv->obj_cache[enumtag].flags &= ~PIV_OBJ_CACHE_NOT_PRESENT;
+			priv->obj_cache[enumtag].flags &= ~(PIV_OBJ_CACHE_NOT_PRESENT | PIV_OBJ_CACHE_FROM_CARD);
 
 			r = piv_cache_internal_data(card, enumtag);
 			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "got internal r=%d\n",r);
@@ -2791,6 +3064,7 @@ static int piv_finish(sc_card_t *card)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	if (priv) {
+		piv_object_cache_save(card);
 		if (priv->aid_file)
 			sc_file_free(priv->aid_file);
 		if (priv->w_buf)
@@ -2828,6 +3102,25 @@ static int piv_match_card(sc_card_t *card)
 }
 
 
+static int piv_get_object_cache_conf(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	scconf_block **blocks;
+	int i, enabled = 0;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", "piv");
+		if (!blocks)
+			continue;
+		if (blocks[0])
+			enabled = scconf_get_bool(blocks[0], "object_cache", enabled);
+		free(blocks);
+	}
+	return enabled;
+}
+
+
 static int piv_init(sc_card_t *card)
 {
 	int r, i;
@@ -2883,6 +3176,10 @@ static int piv_init(sc_card_t *card)
 
 	card->caps |= SC_CARD_CAP_RNG;
 
+	priv->object_cache = piv_get_object_cache_conf(card);
+	if (priv->object_cache)
+		piv_object_cache_load(card);
+
 	/*
 	 * 800-73-3 cards may have a history object and/or a discovery object
 	 * We want to process them now as this has information on what
@@ -189,17 +189,17 @@ static const struct sc_card_error rutoken_errors[] = {
 	{ 0x9000, SC_SUCCESS,                  NULL}
 };
 
+static struct sc_sw_map rutoken_sw_map;
+
 static int rutoken_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 {
-	size_t i;
+	const struct sc_card_error *err = sc_sw_map_find(&rutoken_sw_map, sw1, sw2);
 
-	for (i = 0; i < sizeof(rutoken_errors)/sizeof(rutoken_errors[0]); ++i) {
-		if (rutoken_errors[i].SWs == ((sw1 << 8) | sw2)) {
-			if ( rutoken_errors[i].errorstr )
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n", rutoken_errors[i].errorstr);
-			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "sw1 = %x, sw2 = %x", sw1, sw2);
-			return rutoken_errors[i].errorno;
-		}
+	if (err != NULL) {
+		if (err->errorstr)
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n", err->errorstr);
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "sw1 = %x, sw2 = %x", sw1, sw2);
+		return err->errorno;
 	}
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Unknown SWs; SW1=%02X, SW2=%02X\n", sw1, sw2);
 	return SC_ERROR_CARD_CMD_FAILED;
@@ -1251,6 +1251,8 @@ static struct sc_card_driver* get_rutoken_driver(void)
 	if (iso_ops == NULL)
 		iso_ops = sc_get_iso7816_driver()->ops;
 	rutoken_ops = *iso_ops;
+	sc_sw_map_init(&rutoken_sw_map, rutoken_errors,
+			sizeof(rutoken_errors)/sizeof(rutoken_errors[0]));
 
 	rutoken_ops.match_card = rutoken_match_card;
 	rutoken_ops.init = rutoken_init;
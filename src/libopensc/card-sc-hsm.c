@@ -148,11 +148,15 @@ static int sc_hsm_pin_info(sc_card_t *card, struct sc_pin_cmd_data *data,
 
 	r =  sc_check_sw(card, apdu.sw1, apdu.sw2);
 
-	if (r == SC_ERROR_PIN_CODE_INCORRECT) {
+	if (r == SC_SUCCESS) {
+		data->pin1.logged_in = SC_PIN_STATE_LOGGED_IN;
+	} else if (r == SC_ERROR_PIN_CODE_INCORRECT) {
 		data->pin1.tries_left = apdu.sw2 & 0xF;
+		data->pin1.logged_in = SC_PIN_STATE_LOGGED_OUT;
 		r = SC_SUCCESS;
 	} else if (r == SC_ERROR_AUTH_METHOD_BLOCKED) {
 		data->pin1.tries_left = 0;
+		data->pin1.logged_in = SC_PIN_STATE_LOGGED_OUT;
 		r = SC_SUCCESS;
 	}
 	LOG_TEST_RET(card->ctx, r, "Check SW error");
@@ -234,7 +238,6 @@ static int sc_hsm_read_binary(sc_card_t *card,
 {
 	sc_context_t *ctx = card->ctx;
 	sc_apdu_t apdu;
-	u8 recvbuf[SC_MAX_APDU_BUFFER_SIZE];
 	u8 cmdbuff[4];
 	int r;
 
@@ -248,14 +251,16 @@ static int sc_hsm_read_binary(sc_card_t *card,
 	cmdbuff[2] = (idx >> 8) & 0xFF;
 	cmdbuff[3] = idx & 0xFF;
 
-	assert(count <= (card->max_recv_size > 0 ? card->max_recv_size : 256));
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xB1, 0x00, 0x00);
+	/* extended Le unless ENUMERATE OBJECTS found the reader can't do it,
+	 * so an EF is usually read with a single command */
+	assert(count <= sc_get_max_recv_size(card));
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0xB1, 0x00, 0x00);
 	apdu.data = cmdbuff;
 	apdu.datalen = 4;
 	apdu.lc = 4;
 	apdu.le = count;
 	apdu.resplen = count;
-	apdu.resp = recvbuf;
+	apdu.resp = buf;
 
 	r = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, r, "APDU transmit failed");
@@ -265,8 +270,6 @@ static int sc_hsm_read_binary(sc_card_t *card,
 		LOG_TEST_RET(ctx, r, "Check SW error");
 	}
 
-	memcpy(buf, recvbuf, apdu.resplen);
-
 	LOG_FUNC_RETURN(ctx, apdu.resplen);
 }
 
@@ -364,6 +367,7 @@ static int sc_hsm_list_files(sc_card_t *card, u8 * buf, size_t buflen)
 		sc_log(card->ctx, "No extended length support ? Trying fall-back to short APDUs, probably breaking support for RSA 2048 operations");
 		priv->noExtLength = 1;
 		card->max_send_size = 248;		// 255 - 7 because of TLV in odd ins UPDATE BINARY
+		card->max_recv_size = 256;
 		return sc_hsm_list_files(card, buf, buflen);
 	}
 	LOG_TEST_RET(card->ctx, r, "ENUMERATE OBJECTS APDU transmit failed");
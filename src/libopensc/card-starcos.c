@@ -1223,10 +1223,11 @@ static int starcos_compute_signature(sc_card_t *card,
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, sc_check_sw(card, apdu.sw1, apdu.sw2));
 }
 
+static struct sc_sw_map starcos_sw_map;
+
 static int starcos_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 {
-	const int err_count = sizeof(starcos_errors)/sizeof(starcos_errors[0]);
-	int i;
+	const struct sc_card_error *err;
 
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 		"sw1 = 0x%02x, sw2 = 0x%02x\n", sw1, sw2);
@@ -1241,12 +1242,12 @@ static int starcos_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 	}
   
 	/* check starcos error messages */
-	for (i = 0; i < err_count; i++)
-		if (starcos_errors[i].SWs == ((sw1 << 8) | sw2))
-		{
-			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n", starcos_errors[i].errorstr);
-			return starcos_errors[i].errorno;
-		}
+	err = sc_sw_map_find(&starcos_sw_map, sw1, sw2);
+	if (err != NULL)
+	{
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%s\n", err->errorstr);
+		return err->errorno;
+	}
   
 	/* iso error */
 	return iso_ops->check_sw(card, sw1, sw2);
@@ -1348,6 +1349,8 @@ static struct sc_card_driver * sc_get_driver(void)
 		iso_ops = iso_drv->ops;
   
 	starcos_ops = *iso_drv->ops;
+	sc_sw_map_init(&starcos_sw_map, starcos_errors,
+			sizeof(starcos_errors)/sizeof(starcos_errors[0]));
 	starcos_ops.match_card = starcos_match_card;
 	starcos_ops.init   = starcos_init;
 	starcos_ops.finish = starcos_finish;
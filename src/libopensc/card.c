@@ -26,9 +26,13 @@
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "internal.h"
 #include "asn1.h"
+#include "cardctl.h"
+#include "probes.h"
 
 /*
 #define INVALIDATE_CARD_CACHE_IN_UNLOCK
@@ -39,16 +43,81 @@ static int sc_card_sm_load(sc_card_t *card, const char *path, const char *module
 static int sc_card_sm_unload(sc_card_t *card);
 static int sc_card_sm_check(sc_card_t *card);
 #endif
+static void sc_load_tuned_sizes(sc_card_t *card);
+static void sc_save_tuned_sizes(sc_card_t *card);
+static void sc_drop_writes(sc_card_t *card);
 
 int sc_check_sw(sc_card_t *card, unsigned int sw1, unsigned int sw2)
 {
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
+	/* the common case is the same for every driver */
+	if (sw1 == 0x90 && sw2 == 0x00)
+		return SC_SUCCESS;
 	if (card->ops->check_sw == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 	return card->ops->check_sw(card, sw1, sw2);
 }
 
+/* Called again whenever the driver is loaded, maybe from several
+ * contexts at once: the map is only ever written with the same values,
+ * and is not cleared. */
+void sc_sw_map_init(struct sc_sw_map *map, const struct sc_card_error *errors, size_t count)
+{
+	unsigned char rows[256];
+	size_t i, nrows = 0;
+	int linear = count > 255;
+
+	if (map->errors == errors)
+		return;
+	memset(rows, 0, sizeof(rows));
+	for (i = 0; i < count && !linear; i++) {
+		unsigned int sw1 = (errors[i].SWs >> 8) & 0xFF;
+
+		if (rows[sw1] == 0) {
+			if (nrows == SC_SW_MAP_ROWS)
+				linear = 1;
+			else
+				rows[sw1] = ++nrows;
+		}
+	}
+	if (!linear) {
+		for (i = count; i > 0; i--) {
+			/* backwards, so that the first entry wins */
+			const struct sc_card_error *err = &errors[i - 1];
+
+			map->cells[rows[(err->SWs >> 8) & 0xFF] - 1][err->SWs & 0xFF] = i;
+		}
+		memcpy(map->rows, rows, sizeof(rows));
+	}
+	map->linear = linear;
+	map->count = count;
+	map->errors = errors;
+}
+
+const struct sc_card_error *sc_sw_map_find(const struct sc_sw_map *map,
+	unsigned int sw1, unsigned int sw2)
+{
+	unsigned int row, cell;
+	size_t i;
+
+	if (map->errors == NULL)
+		return NULL;
+	if (map->linear) {
+		for (i = 0; i < map->count; i++)
+			if (map->errors[i].SWs == ((sw1 << 8) | sw2))
+				return &map->errors[i];
+		return NULL;
+	}
+	if (sw1 > 0xFF || sw2 > 0xFF)
+		return NULL;
+	row = map->rows[sw1];
+	if (row == 0)
+		return NULL;
+	cell = map->cells[row - 1][sw2];
+	return cell ? &map->errors[cell - 1] : NULL;
+}
+
 void sc_format_apdu(sc_card_t *card, sc_apdu_t *apdu,
 		    int cse, int ins, int p1, int p2)
 {
@@ -97,12 +166,15 @@ static void sc_card_free(sc_card_t *card)
 	if (card->ef_dir != NULL)
 		sc_file_free(card->ef_dir);
 	free(card->ops);
+#ifdef ENABLE_SM
+	sc_sm_free_scratch(card);
+#endif
 	if (card->algorithms != NULL)
 		free(card->algorithms);
-	if (card->cache.current_ef)
-		sc_file_free(card->cache.current_ef);
-	if (card->cache.current_df)
-		sc_file_free(card->cache.current_df);
+	if (card->algorithm_index != NULL)
+		free(card->algorithm_index);
+	sc_drop_writes(card);
+	sc_invalidate_cache(card);
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
 		if (r != SC_SUCCESS)
@@ -112,37 +184,336 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/*
+ * ATR index: the exact ATRs of the card_atr blocks are hashed so that the
+ * configured ATRs are matched with one lookup. Drivers whose ATR map has
+ * masked (or otherwise not hashable) entries are still scanned linearly.
+ * The index also remembers which built-in driver accepted an ATR, so that
+ * the next card with this ATR does not go through the probing of all the
+ * drivers before it.
+ */
+#define SC_ATR_INDEX_SIZE	64
+
+struct sc_atr_index_entry {
+	u8 atr[SC_MAX_ATR_SIZE];
+	size_t atr_len;
+	struct sc_card_driver *driver;
+	int order;		/* position of the driver in ctx->card_drivers */
+	int idx;		/* entry in driver->atr_map, -1 if learned */
+	struct sc_atr_index_entry *next;
+};
+
+struct sc_atr_index {
+	struct sc_atr_index_entry *buckets[SC_ATR_INDEX_SIZE];
+	/* set for drivers with ATR map entries that are not in the index */
+	int scan[SC_MAX_CARD_DRIVERS];
+};
+
+static unsigned int atr_index_hash(const u8 *atr, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *atr++) * 16777619U;
+	return h % SC_ATR_INDEX_SIZE;
+}
+
+static int atr_index_add(struct sc_atr_index *index, const u8 *atr, size_t atr_len,
+		struct sc_card_driver *driver, int order, int idx)
+{
+	struct sc_atr_index_entry *entry;
+	unsigned int h;
+
+	if (atr_len > SC_MAX_ATR_SIZE)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	entry = calloc(1, sizeof(struct sc_atr_index_entry));
+	if (entry == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(entry->atr, atr, atr_len);
+	entry->atr_len = atr_len;
+	entry->driver = driver;
+	entry->order = order;
+	entry->idx = idx;
+
+	h = atr_index_hash(atr, atr_len);
+	entry->next = index->buckets[h];
+	index->buckets[h] = entry;
+	return SC_SUCCESS;
+}
+
+void _sc_free_atr_index(sc_context_t *ctx)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	unsigned int i;
+
+	if (index == NULL)
+		return;
+	for (i = 0; i < SC_ATR_INDEX_SIZE; i++) {
+		while (index->buckets[i] != NULL) {
+			struct sc_atr_index_entry *entry = index->buckets[i];
+
+			index->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(index);
+	ctx->atr_index = NULL;
+}
+
+int _sc_build_atr_index(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+	int i, j, r;
+
+	_sc_free_atr_index(ctx);
+	index = calloc(1, sizeof(struct sc_atr_index));
+	if (index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *driver = ctx->card_drivers[i];
+
+		if (driver->atr_map == NULL || !strcmp(driver->short_name, "default"))
+			continue;
+		for (j = 0; driver->atr_map[j].atr != NULL; j++) {
+			const char *tatr = driver->atr_map[j].atr;
+			u8 bin[SC_MAX_ATR_SIZE];
+			size_t bin_len = sizeof(bin);
+
+			/* only the 'xx:xx:..' notation compares equal to the hex
+			 * string of the card ATR, leave anything else to the scan */
+			if (driver->atr_map[j].atrmask != NULL
+					|| sc_hex_to_bin(tatr, bin, &bin_len) != SC_SUCCESS
+					|| bin_len == 0 || strlen(tatr) != 3 * bin_len - 1) {
+				index->scan[i] = 1;
+				continue;
+			}
+			r = atr_index_add(index, bin, bin_len, driver, i, j);
+			if (r != SC_SUCCESS) {
+				ctx->atr_index = index;
+				_sc_free_atr_index(ctx);
+				return r;
+			}
+		}
+	}
+	ctx->atr_index = index;
+	return SC_SUCCESS;
+}
+
+/* Match the card ATR against the configured ATRs of all drivers,
+ * with the same result as trying every driver's ATR map in order. */
+static struct sc_card_driver *atr_index_match(sc_card_t *card, int *idx_out)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_atr_index *index = ctx->atr_index;
+	struct sc_atr_index_entry *entry, *best = NULL;
+	int i, last;
+
+	entry = index->buckets[atr_index_hash(card->atr.value, card->atr.len)];
+	for (; entry != NULL; entry = entry->next) {
+		if (entry->idx < 0 || entry->atr_len != card->atr.len
+				|| memcmp(entry->atr, card->atr.value, entry->atr_len))
+			continue;
+		if (best == NULL || entry->order < best->order
+				|| (entry->order == best->order && entry->idx < best->idx))
+			best = entry;
+	}
+
+	/* a driver before (or the same as) the indexed one may still match
+	 * with a masked ATR */
+	last = best ? best->order : SC_MAX_CARD_DRIVERS - 1;
+	for (i = 0; i <= last && ctx->card_drivers[i] != NULL; i++) {
+		if (!index->scan[i])
+			continue;
+		*idx_out = _sc_match_atr(card, ctx->card_drivers[i]->atr_map, NULL);
+		if (*idx_out >= 0)
+			return ctx->card_drivers[i];
+	}
+
+	if (best == NULL)
+		return NULL;
+	*idx_out = best->idx;
+	return best->driver;
+}
+
+static struct sc_card_driver *atr_index_learned(sc_context_t *ctx, const struct sc_atr *atr)
+{
+	struct sc_atr_index_entry *entry;
+	struct sc_card_driver *driver = NULL;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	entry = ctx->atr_index->buckets[atr_index_hash(atr->value, atr->len)];
+	for (; entry != NULL; entry = entry->next) {
+		if (entry->idx < 0 && entry->atr_len == atr->len
+				&& !memcmp(entry->atr, atr->value, atr->len)) {
+			driver = entry->driver;
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return driver;
+}
+
+static void atr_index_learn(sc_context_t *ctx, const struct sc_atr *atr, struct sc_card_driver *driver)
+{
+	if (atr_index_learned(ctx, atr) == driver)
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (atr_index_add(ctx->atr_index, atr->value, atr->len, driver, -1, -1) != SC_SUCCESS)
+		sc_log(ctx, "unable to remember driver for ATR");
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+/* Returns 1 if the driver accepts and initialized the card, 0 if it does not
+ * handle the card and an error code otherwise */
+static int connect_card_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	struct sc_context *ctx = card->ctx;
+	const struct sc_card_operations *ops = drv->ops;
+	unsigned long long start;
+	int r;
+
+	sc_log(ctx, "trying driver '%s'", drv->short_name);
+	if (sc_ctx_load_card_driver(ctx, drv) != SC_SUCCESS)
+		return 0;
+	ops = drv->ops;
+	if (ops == NULL || ops->match_card == NULL)   {
+		return 0;
+	}
+	else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
+		sc_log(ctx , "ignore 'default' card driver");
+		return 0;
+	}
+
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	start = sc_startup_trace_begin(ctx);
+	r = ops->match_card(card);
+	sc_startup_trace_end(ctx, start, "card", "%s match_card", drv->short_name);
+	if (r != 1)
+		return 0;
+	sc_log(ctx, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	start = sc_startup_trace_begin(ctx);
+	r = ops->init(card);
+	sc_startup_trace_end(ctx, start, "card", "%s init", drv->short_name);
+	if (r) {
+		sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
+/* Serializes connecting and disconnecting the cards of shared contexts,
+ * the users of one context do not share a lock otherwise */
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+static pthread_mutex_t shared_cards_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define shared_cards_lock()	pthread_mutex_lock(&shared_cards_mutex)
+#define shared_cards_unlock()	pthread_mutex_unlock(&shared_cards_mutex)
+#elif defined(_WIN32)
+static volatile LONG shared_cards_mutex = 0;
+#define shared_cards_lock()	while (InterlockedExchange(&shared_cards_mutex, 1)) Sleep(0)
+#define shared_cards_unlock()	InterlockedExchange(&shared_cards_mutex, 0)
+#else
+#define shared_cards_lock()
+#define shared_cards_unlock()
+#endif
+
+static int connect_card(sc_reader_t *reader, sc_card_t **card_out);
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
-	struct sc_card_driver *driver;
-	int i, r = 0, idx, connected = 0;
+	int r;
 
 	if (card_out == NULL || reader == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
 	ctx = reader->ctx;
+	if (ctx->shared_refs == 0)
+		return connect_card(reader, card_out);
+
+	/* The users of a shared context get the same card object, the
+	 * reader has a single connection to the card */
+	shared_cards_lock();
+	card = reader->shared_card;
+	if (card != NULL && card->card_generation == reader->card_generation) {
+		card->shared_refs++;
+		shared_cards_unlock();
+		sc_log(ctx, "card in reader '%s' already connected, %u users",
+			reader->name, card->shared_refs);
+		*card_out = card;
+		return SC_SUCCESS;
+	}
+	if (card != NULL) {
+		/* The card was exchanged or reset, the users of the old
+		 * object notice the generation change on their own */
+		sc_log(ctx, "replacing the stale connection to reader '%s'", reader->name);
+		reader->shared_card = NULL;
+		if (reader->ops->disconnect)
+			reader->ops->disconnect(reader);
+	}
+	r = connect_card(reader, &card);
+	if (r == SC_SUCCESS) {
+		card->shared_refs = 1;
+		reader->shared_card = card;
+		*card_out = card;
+	}
+	shared_cards_unlock();
+	return r;
+}
+
+static int connect_card(sc_reader_t *reader, sc_card_t **card_out)
+{
+	sc_card_t *card;
+	sc_context_t *ctx = reader->ctx;
+	struct sc_card_driver *driver;
+	scconf_block *conf_block;
+	unsigned long long start, step;
+	int i, r = 0, idx, connected = 0;
+
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 	if (reader->ops->connect == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
+	start = sc_startup_trace_begin(ctx);
 	card = sc_card_new(ctx);
 	if (card == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	step = sc_startup_trace_begin(ctx);
 	r = reader->ops->connect(reader);
+	sc_startup_trace_end(ctx, step, "reader", "connect %s", reader->name);
 	if (r)
 		goto err;
 
 	connected = 1;
 	card->reader = reader;
 	card->ctx = ctx;
+	card->card_generation = reader->card_generation;
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
 
 	_sc_parse_atr(reader);
 
 	/* See if the ATR matches any ATR specified in the config file */
-	if ((driver = ctx->forced_driver) == NULL) {
+	if ((driver = ctx->forced_driver) == NULL && ctx->atr_index != NULL) {
+		sc_log(ctx, "matching configured ATRs");
+		driver = atr_index_match(card, &idx);
+		if (driver != NULL) {
+			struct sc_atr_table *src = &driver->atr_map[idx];
+
+			sc_log(ctx, "matched driver '%s'", driver->name);
+			card->name = src->name;
+			card->type = src->type;
+			card->flags = src->flags;
+		}
+	}
+	else if (driver == NULL) {
 		sc_log(ctx, "matching configured ATRs");
 		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
 			driver = ctx->card_drivers[i];
@@ -171,10 +542,18 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	if (driver != NULL) {
 		/* Forced driver, or matched via ATR mapping from
 		 * config file */
+		r = sc_ctx_load_card_driver(ctx, driver);
+		if (r != SC_SUCCESS || driver->ops == NULL) {
+			sc_log(ctx, "driver '%s' is not available", driver->short_name);
+			r = SC_ERROR_INVALID_CARD;
+			goto err;
+		}
 		card->driver = driver;
 		memcpy(card->ops, card->driver->ops, sizeof(struct sc_card_operations));
 		if (card->ops->init != NULL) {
+			step = sc_startup_trace_begin(ctx);
 			r = card->ops->init(card);
+			sc_startup_trace_end(ctx, step, "card", "%s init", card->driver->short_name);
 			if (r) {
 				sc_log(ctx, "driver '%s' init() failed: %s", card->driver->name, sc_strerror(r));
 				goto err;
@@ -182,37 +561,31 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		}
 	}
 	else {
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
-
-			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
-				continue;
-			}
-			else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
-				sc_log(ctx , "ignore 'default' card driver");
-				continue;
-			}
+		struct sc_card_driver *learned = NULL;
+
+		/* first try the driver that took this ATR last time */
+		if (ctx->atr_index != NULL)
+			learned = atr_index_learned(ctx, &card->atr);
+		if (learned != NULL) {
+			sc_log(ctx, "ATR was handled by '%s' before", learned->short_name);
+			r = connect_card_driver(card, learned);
+			if (r < 0)
+				goto err;
+		}
 
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
-				continue;
-			sc_log(ctx, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
+		if (card->driver == NULL) {
+			sc_log(ctx, "matching built-in ATRs");
+			for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+				if (ctx->card_drivers[i] == learned)
 					continue;
-				}
-				goto err;
+				r = connect_card_driver(card, ctx->card_drivers[i]);
+				if (r < 0)
+					goto err;
+				if (r == 1)
+					break;
 			}
-			break;
+			if (card->driver != NULL && ctx->atr_index != NULL)
+				atr_index_learn(ctx, &card->atr, card->driver);
 		}
 	}
 	if (card->driver == NULL) {
@@ -224,6 +597,15 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		card->name = card->driver->name;
 	*card_out = card;
 
+	/* drivers may opt in to the SELECT cache, the configuration overrides */
+	conf_block = sc_get_conf_block(ctx, "card_driver", card->driver->short_name, 1);
+	if (conf_block) {
+		if (scconf_get_bool(conf_block, "select_cache", card->caps & SC_CARD_CAP_SELECT_CACHE))
+			card->caps |= SC_CARD_CAP_SELECT_CACHE;
+		else
+			card->caps &= ~SC_CARD_CAP_SELECT_CACHE;
+	}
+
         /*  Override card limitations with reader limitations.
          *  Note that zero means no limitations at all.
 	 */
@@ -235,6 +617,12 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
            ((reader->driver->max_send_size != 0) && (reader->driver->max_send_size < card->max_send_size)))
                 card->max_send_size = reader->driver->max_send_size;
 
+	if (ctx->adaptive_apdu_size)
+		sc_load_tuned_sizes(card);
+
+	if (ctx->shared_card_generations)
+		sc_shared_generation_attach(card);
+
 	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
 		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
 
@@ -247,6 +635,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 #endif
 
+	sc_startup_trace_end(ctx, start, "card", "sc_connect_card %s", reader->name);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 err:
 	if (connected)
@@ -259,6 +648,7 @@ err:
 int sc_disconnect_card(sc_card_t *card)
 {
 	sc_context_t *ctx;
+	int shared, detached = 0;
 
 	if (!card)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -266,14 +656,30 @@ int sc_disconnect_card(sc_card_t *card)
 	ctx = card->ctx;
 	LOG_FUNC_CALLED(ctx);
 
+	shared = card->shared_refs > 0;
+	if (shared) {
+		shared_cards_lock();
+		if (--card->shared_refs > 0) {
+			shared_cards_unlock();
+			sc_log(ctx, "card still used by %u callers", card->shared_refs);
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* A newer connection may have taken over the reader */
+		detached = card->reader->shared_card != card;
+		if (!detached)
+			card->reader->shared_card = NULL;
+	}
+
 	assert(card->lock_count == 0);
+	if (card->tuned_sizes_changed)
+		sc_save_tuned_sizes(card);
 	if (card->ops->finish) {
 		int r = card->ops->finish(card);
 		if (r)
 			sc_log(ctx, "card driver finish() failed: %s", sc_strerror(r));
 	}
 
-	if (card->reader->ops->disconnect) {
+	if (!detached && card->reader->ops->disconnect) {
 		int r = card->reader->ops->disconnect(card->reader);
 		if (r)
 			sc_log(ctx, "disconnect() failed: %s", sc_strerror(r));
@@ -285,6 +691,8 @@ int sc_disconnect_card(sc_card_t *card)
 #endif
 
 	sc_card_free(card);
+	if (shared)
+		shared_cards_unlock();
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -297,14 +705,20 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 	if (card->reader->ops->reset == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 
+	/* the held back updates are for the EF selected before the reset */
+	r = sc_flush_writes(card);
+	if (r != SC_SUCCESS)
+		return r;
+
 	r = sc_mutex_lock(card->ctx, card->mutex);
 	if (r != SC_SUCCESS)
 		return r;
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
-	/* invalidate cache */
-	memset(&card->cache, 0, sizeof(card->cache));
-	card->cache.valid = 0;
+	sc_invalidate_cache(card);
+	/* a reset closes all logical channels */
+	card->logical_channels = 0;
+	card->logical_channel = 0;
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -315,51 +729,291 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 	return r;
 }
 
+/* A listing returned by the card for the DF at path */
+struct sc_file_list {
+	struct sc_path path;
+	u8 *data;
+	size_t len;
+	struct sc_file_list *next;
+};
+
+#define SC_MAX_FILE_LISTS	16
+
+static void sc_drop_file_lists(sc_card_t *card)
+{
+	struct sc_file_list *list = card->cache.file_lists, *next;
+
+	for (; list != NULL; list = next) {
+		next = list->next;
+		sc_mem_account_free(SC_MEM_CACHE, sizeof(*list) + list->len);
+		free(list->data);
+		free(list);
+	}
+	card->cache.file_lists = NULL;
+}
+
+static void sc_drop_fcis(sc_card_t *card)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_MAX_CACHED_FCIS; i++) {
+		if (card->cache.fcis[i] != NULL)
+			sc_file_free(card->cache.fcis[i]);
+		card->cache.fcis[i] = NULL;
+	}
+	card->cache.fci_next = 0;
+}
+
+void sc_drop_read_ahead(sc_card_t *card)
+{
+	if (card->cache.read_ahead != NULL) {
+		sc_mem_account_free(SC_MEM_CACHE, card->cache.read_ahead_len);
+		free(card->cache.read_ahead);
+	}
+	card->cache.read_ahead = NULL;
+	card->cache.read_ahead_idx = 0;
+	card->cache.read_ahead_len = 0;
+}
+
+#ifndef INVALIDATE_CARD_CACHE_IN_UNLOCK
+/* Forget the current DF and EF, the FCIs and file lists stay */
+static void sc_drop_selection(sc_card_t *card)
+{
+	struct sc_card_cache *cache = &card->cache;
+
+	sc_drop_read_ahead(card);
+	if (cache->current_ef)
+		sc_file_free(cache->current_ef);
+	if (cache->current_df)
+		sc_file_free(cache->current_df);
+	cache->current_ef = NULL;
+	cache->current_df = NULL;
+	cache->current_ef_size = 0;
+	memset(&cache->current_path, 0, sizeof(cache->current_path));
+	memset(&cache->list_path, 0, sizeof(cache->list_path));
+}
+#endif
+
+void sc_invalidate_cache(sc_card_t *card)
+{
+	sc_drop_read_ahead(card);
+	sc_drop_file_lists(card);
+	sc_drop_fcis(card);
+	if (card->cache.current_ef)
+		sc_file_free(card->cache.current_ef);
+	if (card->cache.current_df)
+		sc_file_free(card->cache.current_df);
+	memset(&card->cache, 0, sizeof(card->cache));
+	card->cache.valid = 0;
+}
+
+int sc_open_logical_channel(sc_card_t *card, int *channel)
+{
+	sc_apdu_t apdu;
+	u8 rbuf[1];
+	int r, current;
+
+	if (card == NULL || channel == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* MANAGE CHANNEL OPEN, the card assigns the channel number */
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0x70, 0x00, 0x00);
+	apdu.cla = 0x00;
+	apdu.le = 1;
+	apdu.resp = rbuf;
+	apdu.resplen = sizeof(rbuf);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	current = card->logical_channel;
+	card->logical_channel = 0;
+	r = sc_transmit_apdu(card, &apdu);
+	card->logical_channel = current;
+	if (r == SC_SUCCESS)
+		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	if (r == SC_SUCCESS && (apdu.resplen != 1 || rbuf[0] == 0
+			|| rbuf[0] >= SC_MAX_LOGICAL_CHANNELS))
+		r = SC_ERROR_CARD_CMD_FAILED;
+	if (r == SC_SUCCESS) {
+		card->logical_channels |= 1UL << rbuf[0];
+		*channel = rbuf[0];
+		sc_log(card->ctx, "opened logical channel %d", *channel);
+	}
+	sc_unlock(card);
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+int sc_close_logical_channel(sc_card_t *card, int channel)
+{
+	sc_apdu_t apdu;
+	int r, current;
+
+	if (card == NULL || channel <= 0 || channel >= SC_MAX_LOGICAL_CHANNELS)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (!(card->logical_channels & (1UL << channel)))
+		LOG_TEST_RET(card->ctx, SC_ERROR_INVALID_ARGUMENTS, "logical channel is not open");
+
+	/* MANAGE CHANNEL CLOSE, sent on the basic channel */
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_1, 0x70, 0x80, channel);
+	apdu.cla = 0x00;
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	/* the held back updates are for the EF of the current channel */
+	r = sc_flush_writes(card);
+	if (r != SC_SUCCESS) {
+		sc_unlock(card);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+	current = card->logical_channel;
+	card->logical_channel = 0;
+	r = sc_transmit_apdu(card, &apdu);
+	if (r == SC_SUCCESS)
+		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	/* the channel is unusable from here on, even if the card refused */
+	card->logical_channels &= ~(1UL << channel);
+	if (current != channel)
+		card->logical_channel = current;
+	else
+		sc_invalidate_cache(card);
+	sc_unlock(card);
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+int sc_set_logical_channel(sc_card_t *card, int channel)
+{
+	int r;
+
+	if (card == NULL || channel < 0 || channel >= SC_MAX_LOGICAL_CHANNELS)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	/* the held back updates are for the EF of the current channel */
+	if (channel != card->logical_channel) {
+		r = sc_flush_writes(card);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+
+	r = sc_mutex_lock(card->ctx, card->mutex);
+	if (r != SC_SUCCESS)
+		return r;
+	if (channel != 0 && !(card->logical_channels & (1UL << channel))) {
+		r = SC_ERROR_INVALID_ARGUMENTS;
+	} else {
+		r = card->logical_channel;
+		if (channel != card->logical_channel) {
+			card->logical_channel = channel;
+			/* the current DF and EF are per channel */
+			sc_invalidate_cache(card);
+			if (card->lock_count > 0)
+				card->cache.valid = 1;
+		}
+	}
+	sc_mutex_unlock(card->ctx, card->mutex);
+
+	return r;
+}
+
+size_t sc_get_max_recv_size(const sc_card_t *card)
+{
+	if (card->tuned_recv_size > 0)
+		return card->tuned_recv_size;
+	if (card->max_recv_size > 0)
+		return card->max_recv_size;
+	/* extended Le is not available for T=0 */
+	if ((card->caps & SC_CARD_CAP_APDU_EXT) != 0
+			&& card->reader->active_protocol != SC_PROTO_T0)
+		return SC_MAX_EXT_APDU_BUFFER_SIZE - 2;
+	return 256;
+}
+
+size_t sc_get_max_send_size(const sc_card_t *card)
+{
+	if (card->max_send_size > 0)
+		return card->max_send_size;
+	/* extended Lc is not available for T=0 */
+	if ((card->caps & SC_CARD_CAP_APDU_EXT) != 0
+			&& card->reader->active_protocol != SC_PROTO_T0)
+		return SC_MAX_EXT_APDU_BUFFER_SIZE - 3;
+	return 255;
+}
+
 int sc_lock(sc_card_t *card)
 {
 	int r = 0, r2 = 0;
+	unsigned long long start;
 
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* the time to lock__done includes waiting for other threads and processes */
+	SC_PROBE2(lock__start, card, card->lock_count);
+	start = sc_lock_stats_begin();
 	r = sc_mutex_lock(card->ctx, card->mutex);
-	if (r != SC_SUCCESS)
+	if (r != SC_SUCCESS) {
+		SC_PROBE3(lock__done, card, r, card->lock_count);
 		return r;
+	}
 	if (card->lock_count == 0) {
 		if (card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
-				/* invalidate cache */
-				memset(&card->cache, 0, sizeof(card->cache));
-				card->cache.valid = 0;
+				/* same card, but its volatile state is gone */
+				card->card_generation = ++card->reader->card_generation;
+				sc_invalidate_cache(card);
+				card->logical_channels = 0;
+				card->logical_channel = 0;
+#ifdef ENABLE_SM
+				/* the SM session keys are gone with the reset */
+				card->sm_ctx.sm_flags |= SM_FLAGS_REOPEN;
+#endif
 				r = card->reader->ops->lock(card->reader);
 			}
 		}
+		if (r == 0 && sc_shared_generation_changed(card)) {
+			sc_log(card->ctx, "card changed by another process");
+			sc_invalidate_cache(card);
+		}
 		if (r == 0)
 			card->cache.valid = 1;
 	}
-	if (r == 0)
-		card->lock_count++;
+	if (r == 0 && card->lock_count++ == 0)
+		card->lock_acquired = sc_lock_stats_wait(&card->reader->stats->card_lock, start);
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to release lock");
 		r = r != SC_SUCCESS ? r : r2;
 	}
 
+	SC_PROBE3(lock__done, card, r, card->lock_count);
 	return r;
 }
 
 int sc_unlock(sc_card_t *card)
 {
-	int r, r2;
+	int r, r2, rflush;
 
 	if (!card)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* the held back updates are sent while the card is still ours */
+	rflush = SC_SUCCESS;
+	if (card->lock_count == 1) {
+		rflush = sc_flush_writes(card);
+		if (rflush != SC_SUCCESS)
+			sc_log(card->ctx, "held back UPDATE BINARY failed at unlock: %s",
+					sc_strerror(rflush));
+	}
+
 	r = sc_mutex_lock(card->ctx, card->mutex);
 	if (r != SC_SUCCESS)
 		return r;
@@ -367,35 +1021,96 @@ int sc_unlock(sc_card_t *card)
 	assert(card->lock_count >= 1);
 	if (--card->lock_count == 0) {
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
-		/* invalidate cache */
-		memset(&card->cache, 0, sizeof(card->cache));
-		card->cache.valid = 0;
+		sc_invalidate_cache(card);
 		sc_log(card->ctx, "cache invalidated");
+#else
+		/* other applications may change the EF content or the
+		 * current DF once a shared card is released; with a shared
+		 * generation, sc_lock() tells whether the content changed */
+		if ((card->caps & SC_CARD_CAP_SELECT_CACHE)
+				&& !(card->reader->flags & SC_READER_CONNECTED_EXCLUSIVE)) {
+			if (card->shared_generation != NULL)
+				sc_drop_selection(card);
+			else
+				sc_invalidate_cache(card);
+		}
+		else
+			sc_drop_read_ahead(card);
 #endif
+		/* a shared card may get another security environment
+		 * or other files meanwhile */
+		if (!(card->reader->flags & SC_READER_CONNECTED_EXCLUSIVE)) {
+			card->cache.sec_env_valid = 0;
+			if (card->shared_generation == NULL) {
+				sc_drop_file_lists(card);
+				sc_drop_fcis(card);
+			}
+		}
 		/* release reader lock */
 		if (card->reader->ops->unlock != NULL)
 			r = card->reader->ops->unlock(card->reader);
+		sc_lock_stats_release(&card->reader->stats->card_lock, card->lock_acquired);
 	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to release lock");
 		r = (r == SC_SUCCESS) ? r2 : r;
 	}
+	if (rflush != SC_SUCCESS)
+		r = rflush;
 
+	SC_PROBE2(unlock, card, card->lock_count);
 	return r;
 }
 
+/* Listings are kept per DF path as long as the card layer knows which
+ * DF is current, and dropped whenever the card may have changed */
 int sc_list_files(sc_card_t *card, u8 *buf, size_t buflen)
 {
-	int r;
+	struct sc_card_cache *cache = &card->cache;
+	struct sc_file_list *list;
+	int r, count = 0;
 
 	assert(card != NULL);
 	LOG_FUNC_CALLED(card->ctx);
 
 	if (card->ops->list_files == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	if (cache->list_path.len) {
+		for (list = cache->file_lists; list != NULL; list = list->next, count++) {
+			if (!sc_compare_path(&list->path, &cache->list_path))
+				continue;
+			r = (int)MIN(list->len, buflen);
+			memcpy(buf, list->data, r);
+			sc_log(card->ctx, "listing of %s from cache", sc_print_path(&list->path));
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+	}
+
 	r = card->ops->list_files(card, buf, buflen);
 
+	/* a full buffer may have been truncated */
+	if (r >= 0 && (size_t)r < buflen && cache->list_path.len) {
+		if (count >= SC_MAX_FILE_LISTS)
+			sc_drop_file_lists(card);
+		list = calloc(1, sizeof(*list));
+		if (list != NULL) {
+			list->data = malloc(r > 0 ? r : 1);
+			if (list->data != NULL) {
+				memcpy(list->data, buf, r);
+				list->len = r;
+				list->path = cache->list_path;
+				list->next = cache->file_lists;
+				cache->file_lists = list;
+				sc_mem_account_alloc(SC_MEM_CACHE, sizeof(*list) + list->len);
+			}
+			else {
+				free(list);
+			}
+		}
+	}
+
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -420,7 +1135,10 @@ int sc_create_file(sc_card_t *card, sc_file_t *file)
 	if (card->ops->create_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
+	sc_drop_file_lists(card);
+	sc_drop_fcis(card);
 	r = card->ops->create_file(card, file);
+	sc_shared_generation_bump(card);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -438,71 +1156,330 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	sc_log(card->ctx, "called; type=%d, path=%s", path->type, pbuf);
 	if (card->ops->delete_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_drop_file_lists(card);
+	sc_drop_fcis(card);
 	r = card->ops->delete_file(card, path);
+	sc_shared_generation_bump(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
-int sc_read_binary(sc_card_t *card, unsigned int idx,
-		   unsigned char *buf, size_t count, unsigned long flags)
+static size_t sc_get_chunk_send_size(const sc_card_t *card)
 {
-	size_t max_le = card->max_recv_size > 0 ? card->max_recv_size : 256;
+	if (card->tuned_send_size > 0)
+		return card->tuned_send_size;
+	return sc_get_max_send_size(card);
+}
+
+/* With adaptive_apdu_size, a chunk of n bytes that failed in a way
+ * that points at the reader or the card not coping with its length
+ * makes the following chunks half as large. Returns 1 if the chunk
+ * should be sent again. */
+#define SC_MIN_TUNED_SIZE	64
+
+static int sc_backoff_chunk_size(sc_card_t *card, size_t *tuned, size_t n, int r)
+{
+	size_t short_size = tuned == &card->tuned_send_size ? 255 : 256;
+
+	/* Extended lengths are used whenever card and reader claim them;
+	 * if they turn out not to work, use short APDUs from here on */
+	if (!card->ctx->adaptive_apdu_size && n > short_size
+			&& (r == SC_ERROR_WRONG_LENGTH || r == SC_ERROR_TRANSMIT_FAILED)) {
+		*tuned = short_size;
+		sc_log(card->ctx, "%s with %d bytes, using short APDUs now",
+				sc_strerror(r), n);
+		return 1;
+	}
+
+	if (!card->ctx->adaptive_apdu_size || n <= SC_MIN_TUNED_SIZE)
+		return 0;
+	if (r != SC_ERROR_TRANSMIT_FAILED && r != SC_ERROR_CARD_UNRESPONSIVE
+			&& r != SC_ERROR_UNKNOWN_DATA_RECEIVED
+			/* extended lengths the card does not take */
+			&& !(r == SC_ERROR_WRONG_LENGTH && n > 256))
+		return 0;
+
+	*tuned = n / 2 > SC_MIN_TUNED_SIZE ? n / 2 : SC_MIN_TUNED_SIZE;
+	card->tuned_sizes_changed = 1;
+	sc_log(card->ctx, "%s with %d bytes, using %d bytes chunks now",
+			sc_strerror(r), n, *tuned);
+	return 1;
+}
+
+/* The learned sizes are kept in the cache directory, one line per
+ * reader model and ATR: "<ATR> <send size> <recv size> <reader model>" */
+static int sc_tuned_sizes_file(sc_card_t *card, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
 	int r;
 
-	assert(card != NULL && card->ops != NULL && buf != NULL);
-	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
-	if (count == 0)
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/apdu_sizes", dir);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* PC/SC reader names end with the slot and instance numbers, which
+ * are not part of the model */
+static size_t sc_reader_model_len(const char *name)
+{
+	size_t len = strlen(name);
+
+	while (len > 0 && strchr("0123456789 ", name[len - 1]) != NULL)
+		len--;
+	return len > 0 ? len : strlen(name);
+}
+
+static int sc_tuned_sizes_key(sc_card_t *card, char *buf, size_t bufsize)
+{
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	int r;
+
+	r = sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s %.*s", atr,
+			(int)sc_reader_model_len(card->reader->name), card->reader->name);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* Splits a line of the sizes file, returns 1 if it matches key */
+static int sc_parse_tuned_sizes(char *line, const char *key,
+		unsigned long *send_size, unsigned long *recv_size)
+{
+	char atr[80];
+	char cmp[SC_MAX_ATR_SIZE * 2 + 256];
+	int model;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	if (sscanf(line, "%79s %lu %lu %n", atr, send_size, recv_size, &model) != 3)
 		return 0;
+	snprintf(cmp, sizeof(cmp), "%s %s", atr, line + model);
+	return strcmp(cmp, key) == 0;
+}
 
-#ifdef ENABLE_SM
-	if (card->sm_ctx.ops.read_binary)   {
-		r = card->sm_ctx.ops.read_binary(card, idx, buf, count);
-		if (r)
-			LOG_FUNC_RETURN(card->ctx, r);
+static void sc_load_tuned_sizes(sc_card_t *card)
+{
+	char fname[PATH_MAX], key[SC_MAX_ATR_SIZE * 2 + 256], line[SC_MAX_ATR_SIZE * 2 + 300];
+	unsigned long send_size, recv_size;
+	FILE *f;
+
+	if (sc_tuned_sizes_file(card, fname, sizeof(fname)) != SC_SUCCESS
+			|| sc_tuned_sizes_key(card, key, sizeof(key)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (!sc_parse_tuned_sizes(line, key, &send_size, &recv_size))
+			continue;
+		/* the configured limits still apply */
+		if (send_size > 0 && send_size < sc_get_chunk_send_size(card))
+			card->tuned_send_size = send_size;
+		if (recv_size > 0 && recv_size < sc_get_max_recv_size(card))
+			card->tuned_recv_size = recv_size;
+		sc_log(card->ctx, "learned chunk sizes: send %lu, receive %lu",
+				send_size, recv_size);
+		break;
 	}
+	fclose(f);
+}
+
+static void sc_save_tuned_sizes(sc_card_t *card)
+{
+	char fname[PATH_MAX], tmpname[PATH_MAX];
+	char key[SC_MAX_ATR_SIZE * 2 + 256], line[SC_MAX_ATR_SIZE * 2 + 300];
+	char entry[SC_MAX_ATR_SIZE * 2 + 300];
+	unsigned long send_size, recv_size;
+	FILE *in, *out;
+	int r;
+
+	if (sc_tuned_sizes_file(card, fname, sizeof(fname)) != SC_SUCCESS
+			|| sc_tuned_sizes_key(card, key, sizeof(key)) != SC_SUCCESS)
+		return;
+	if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname) >= (int)sizeof(tmpname))
+		return;
+
+	out = fopen(tmpname, "w");
+	if (out == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		out = fopen(tmpname, "w");
+	}
+	if (out == NULL)
+		return;
+
+	/* other reader and card combinations are carried over */
+	r = 0;
+	in = fopen(fname, "r");
+	while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+		memcpy(entry, line, sizeof(entry));
+		if (sc_parse_tuned_sizes(line, key, &send_size, &recv_size))
+			continue;
+		if (fputs(entry, out) == EOF)
+			r = -1;
+	}
+	if (in != NULL)
+		fclose(in);
+
+	send_size = card->tuned_send_size;
+	recv_size = card->tuned_recv_size;
+	if (fprintf(out, "%.*s %lu %lu %s\n", (int)strcspn(key, " "), key,
+			send_size, recv_size, key + strcspn(key, " ") + 1) < 0)
+		r = -1;
+	if (fclose(out) != 0)
+		r = -1;
+	if (r == 0) {
+#ifdef _WIN32
+		unlink(fname);
 #endif
-	if (card->ops->read_binary == NULL)
-		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+		if (rename(tmpname, fname) == 0)
+			return;
+	}
+	sc_log(card->ctx, "cannot store learned chunk sizes in '%s'", fname);
+	unlink(tmpname);
+}
 
-	if (count > max_le) {
-		int bytes_read = 0;
-		unsigned char *p = buf;
+static int sc_read_binary_chunked(sc_card_t *card, unsigned int idx,
+		unsigned char *buf, size_t count, unsigned long flags)
+{
+	size_t max_le = sc_get_max_recv_size(card);
+	int bytes_read = 0;
+	int r;
 
-		r = sc_lock(card);
-		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
-		while (count > 0) {
-			size_t n = count > max_le ? max_le : count;
-			r = sc_read_binary(card, idx, p, n, flags);
-			if (r < 0) {
-				sc_unlock(card);
-				LOG_TEST_RET(card->ctx, r, "sc_read_binary() failed");
-			}
-			p += r;
-			idx += r;
-			bytes_read += r;
-			count -= r;
-			if (r == 0) {
-				sc_unlock(card);
-				LOG_FUNC_RETURN(card->ctx, bytes_read);
-			}
+	if (count <= max_le) {
+		r = card->ops->read_binary(card, idx, buf, count, flags);
+		if (r < 0 && sc_backoff_chunk_size(card, &card->tuned_recv_size, count, r))
+			return sc_read_binary_chunked(card, idx, buf, count, flags);
+		return r;
+	}
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	while (count > 0) {
+		size_t n = count > max_le ? max_le : count;
+		r = card->ops->read_binary(card, idx, buf, n, flags);
+		if (r < 0 && sc_backoff_chunk_size(card, &card->tuned_recv_size, n, r)) {
+			max_le = card->tuned_recv_size;
+			continue;
 		}
-		sc_unlock(card);
-		LOG_FUNC_RETURN(card->ctx, bytes_read);
+		if (r < 0) {
+			sc_unlock(card);
+			LOG_TEST_RET(card->ctx, r, "sc_read_binary() failed");
+		}
+		buf += r;
+		idx += r;
+		bytes_read += r;
+		count -= r;
+		if (r == 0)
+			break;
+	}
+	sc_unlock(card);
+	return bytes_read;
+}
+
+/* Read the remainder of the current EF in as few APDUs as possible and
+ * serve the following reads of this EF out of memory */
+static int sc_read_ahead(sc_card_t *card, unsigned int idx,
+		unsigned char *buf, size_t count, unsigned long flags)
+{
+	struct sc_card_cache *cache = &card->cache;
+	u8 *data;
+	size_t len;
+	int r;
+
+	/* the buffer is only trusted while the card is locked */
+	if (card->lock_count == 0)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if (cache->read_ahead != NULL && idx >= cache->read_ahead_idx
+			&& idx + count <= cache->read_ahead_idx + cache->read_ahead_len) {
+		sc_log(card->ctx, "served %d bytes from read-ahead buffer", count);
+		memcpy(buf, cache->read_ahead + (idx - cache->read_ahead_idx), count);
+		return (int)count;
+	}
+
+	if (cache->current_ef_size <= idx + count || flags != 0)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	sc_drop_read_ahead(card);
+	len = cache->current_ef_size - idx;
+	/* with room for the status words of the last response */
+	data = malloc(len + 2);
+	if (data == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	card->read_buf = data;
+	card->read_buf_end = data + len + 2;
+	r = sc_read_binary_chunked(card, idx, data, len, flags);
+	if (r < (int)count) {
+		free(data);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	cache->read_ahead = data;
+	cache->read_ahead_idx = idx;
+	cache->read_ahead_len = r;
+	sc_mem_account_alloc(SC_MEM_CACHE, r);
+	memcpy(buf, cache->read_ahead, count);
+	return (int)count;
+}
+
+int sc_read_binary(sc_card_t *card, unsigned int idx,
+		   unsigned char *buf, size_t count, unsigned long flags)
+{
+	u8 *read_buf, *read_buf_end;
+	int r;
+
+	assert(card != NULL && card->ops != NULL && buf != NULL);
+	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
+	if (count == 0)
+		return 0;
+
+#ifdef ENABLE_SM
+	if (card->sm_ctx.ops.read_binary)   {
+		r = card->sm_ctx.ops.read_binary(card, idx, buf, count);
+		if (r)
+			LOG_FUNC_RETURN(card->ctx, r);
+	}
+#endif
+	if (card->ops->read_binary == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	/* a driver reading another file from its read_binary gets its own */
+	read_buf = card->read_buf;
+	read_buf_end = card->read_buf_end;
+
+	r = SC_ERROR_NOT_SUPPORTED;
+	if (card->ctx->read_ahead)
+		r = sc_read_ahead(card, idx, buf, count, flags);
+	if (r == SC_ERROR_NOT_SUPPORTED) {
+		card->read_buf = buf;
+		card->read_buf_end = buf + count;
+		r = sc_read_binary_chunked(card, idx, buf, count, flags);
 	}
-	r = card->ops->read_binary(card, idx, buf, count, flags);
+
+	card->read_buf = read_buf;
+	card->read_buf_end = read_buf_end;
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 int sc_write_binary(sc_card_t *card, unsigned int idx,
 		    const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+	size_t max_lc = sc_get_chunk_send_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
 	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
 	if (count == 0)
 		LOG_FUNC_RETURN(card->ctx, 0);
+	sc_drop_read_ahead(card);
+	sc_drop_file_lists(card);
 	if (card->ops->write_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
@@ -533,23 +1510,22 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->write_binary(card, idx, buf, count, flags);
+	sc_shared_generation_bump(card);
+	if (r < 0 && sc_backoff_chunk_size(card, &card->tuned_send_size, count, r))
+		r = sc_write_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
-int sc_update_binary(sc_card_t *card, unsigned int idx,
+static int sc_update_binary_now(sc_card_t *card, unsigned int idx,
 		     const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+	size_t max_lc = sc_get_chunk_send_size(card);
 	int r;
 
-	assert(card != NULL && card->ops != NULL && buf != NULL);
-	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
-	if (count == 0)
-		return 0;
-
 #ifdef ENABLE_SM
 	if (card->sm_ctx.ops.update_binary)   {
 		r = card->sm_ctx.ops.update_binary(card, idx, buf, count);
+		sc_shared_generation_bump(card);
 		if (r)
 			LOG_FUNC_RETURN(card->ctx, r);
 	}
@@ -566,7 +1542,7 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
 		while (count > 0) {
 			size_t n = count > max_lc? max_lc : count;
-			r = sc_update_binary(card, idx, p, n, flags);
+			r = sc_update_binary_now(card, idx, p, n, flags);
 			if (r < 0) {
 				sc_unlock(card);
 				LOG_TEST_RET(card->ctx, r, "sc_update_binary() failed");
@@ -585,6 +1561,142 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->update_binary(card, idx, buf, count, flags);
+	sc_shared_generation_bump(card);
+	if (r < 0 && sc_backoff_chunk_size(card, &card->tuned_send_size, count, r))
+		r = sc_update_binary_now(card, idx, buf, count, flags);
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+
+/* Largest run of held back UPDATE BINARY data */
+#define SC_COALESCE_MAX_LEN	0x4000
+
+static void sc_drop_writes(sc_card_t *card)
+{
+	struct sc_card_cache *cache = &card->cache;
+
+	if (cache->write_buf != NULL) {
+		sc_log(card->ctx, "card released with %d held back bytes, the update is lost",
+				cache->write_len);
+		sc_mem_account_free(SC_MEM_CACHE, cache->write_len);
+		free(cache->write_buf);
+	}
+	cache->write_buf = NULL;
+	cache->write_idx = 0;
+	cache->write_len = 0;
+	cache->write_flags = 0;
+}
+
+int sc_flush_writes(sc_card_t *card)
+{
+	struct sc_card_cache *cache;
+	u8 *buf;
+	unsigned int idx;
+	size_t len;
+	int r;
+
+	if (card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	cache = &card->cache;
+	if (cache->write_buf == NULL)
+		return SC_SUCCESS;
+
+	/* detached first: the APDUs of the update must not flush again */
+	buf = cache->write_buf;
+	idx = cache->write_idx;
+	len = cache->write_len;
+	cache->write_buf = NULL;
+	cache->write_len = 0;
+
+	sc_log(card->ctx, "sending %d held back bytes at index %d", len, idx);
+	r = sc_update_binary_now(card, idx, buf, len, cache->write_flags);
+	sc_mem_account_free(SC_MEM_CACHE, len);
+	free(buf);
+	if (r >= 0 && (size_t)r < len)
+		r = SC_ERROR_CARD_CMD_FAILED;
+	LOG_TEST_RET(card->ctx, r, "held back UPDATE BINARY failed");
+	return SC_SUCCESS;
+}
+
+/* Merges the update into the held back one if they touch, returns 1 if
+ * it is held back, 0 if it is to be sent, or an error of the flush */
+static int sc_coalesce_write(sc_card_t *card, unsigned int idx,
+		const u8 *buf, size_t count, unsigned long flags)
+{
+	struct sc_card_cache *cache = &card->cache;
+	unsigned int start;
+	size_t end, len;
+	u8 *p;
+	int r;
+
+	if (cache->write_buf != NULL) {
+		start = MIN(idx, cache->write_idx);
+		end = MAX(idx + count, cache->write_idx + cache->write_len);
+		if (flags == cache->write_flags && idx <= cache->write_idx + cache->write_len
+				&& idx + count >= cache->write_idx && end - start <= SC_COALESCE_MAX_LEN) {
+			len = end - start;
+			if (len > cache->write_len) {
+				p = realloc(cache->write_buf, len);
+				if (p == NULL)
+					return sc_flush_writes(card);
+				cache->write_buf = p;
+				sc_mem_account_alloc(SC_MEM_CACHE, len - cache->write_len);
+			}
+			if (start < cache->write_idx)
+				memmove(cache->write_buf + (cache->write_idx - start), cache->write_buf, cache->write_len);
+			memcpy(cache->write_buf + (idx - start), buf, count);
+			cache->write_idx = start;
+			cache->write_len = len;
+			return 1;
+		}
+		r = sc_flush_writes(card);
+		if (r < 0)
+			return r;
+	}
+
+	if (count > SC_COALESCE_MAX_LEN)
+		return 0;
+	cache->write_buf = malloc(count);
+	if (cache->write_buf == NULL)
+		return 0;
+	memcpy(cache->write_buf, buf, count);
+	sc_mem_account_alloc(SC_MEM_CACHE, count);
+	cache->write_idx = idx;
+	cache->write_len = count;
+	cache->write_flags = flags;
+	return 1;
+}
+
+int sc_update_binary(sc_card_t *card, unsigned int idx,
+		     const u8 *buf, size_t count, unsigned long flags)
+{
+	int r;
+
+	assert(card != NULL && card->ops != NULL && buf != NULL);
+	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
+	if (count == 0)
+		return 0;
+	sc_drop_read_ahead(card);
+	sc_drop_file_lists(card);
+
+	/* held back only within a lock, with nothing else in between */
+	if (card->ctx->coalesce_writes && card->lock_count > 0 && card->ops->update_binary != NULL
+#ifdef ENABLE_SM
+			&& card->sm_ctx.ops.update_binary == NULL
+#endif
+			) {
+		r = sc_coalesce_write(card, idx, buf, count, flags);
+		LOG_TEST_RET(card->ctx, r, "held back UPDATE BINARY failed");
+		if (r == 1) {
+			sc_log(card->ctx, "update held back, %d bytes at index %d pending",
+					card->cache.write_len, card->cache.write_idx);
+			LOG_FUNC_RETURN(card->ctx, (int)count);
+		}
+	}
+
+	r = sc_flush_writes(card);
+	LOG_TEST_RET(card->ctx, r, "held back UPDATE BINARY failed");
+	r = sc_update_binary_now(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -595,15 +1707,199 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 
 	assert(card != NULL && card->ops != NULL);
 	sc_log(card->ctx, "called; erase %d bytes from offset %d", count, offs);
+	sc_drop_read_ahead(card);
+	sc_drop_file_lists(card);
 
 	if (card->ops->erase_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
 	r = card->ops->erase_binary(card, offs, count, flags);
+	sc_shared_generation_bump(card);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 
+/* Remember the outcome of a SELECT for SC_CARD_CAP_SELECT_CACHE */
+static void sc_select_cache_update(sc_card_t *card, const sc_path_t *path,
+		sc_file_t *file)
+{
+	struct sc_card_cache *cache = &card->cache;
+
+	if (cache->current_ef)
+		sc_file_free(cache->current_ef);
+	cache->current_ef = NULL;
+
+	if (file == NULL || path->len < 2) {
+		/* cannot tell a DF from an EF */
+		if (cache->current_df)
+			sc_file_free(cache->current_df);
+		cache->current_df = NULL;
+		memset(&cache->current_path, 0, sizeof(cache->current_path));
+		return;
+	}
+
+	if (file->type == SC_FILE_TYPE_DF) {
+		if (cache->current_df)
+			sc_file_free(cache->current_df);
+		cache->current_df = sc_file_ref(file);
+		cache->current_path = *path;
+	}
+	else {
+		sc_path_t parent = *path;
+
+		/* selecting an EF makes its parent the current DF */
+		parent.len -= 2;
+		if (!sc_compare_path(&parent, &cache->current_path)) {
+			if (cache->current_df)
+				sc_file_free(cache->current_df);
+			cache->current_df = NULL;
+			cache->current_path = parent;
+		}
+		cache->current_ef = sc_file_ref(file);
+	}
+	cache->current_path.index = 0;
+	cache->current_path.count = -1;
+}
+
+static sc_file_t *sc_find_fci(sc_card_t *card, const sc_path_t *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_MAX_CACHED_FCIS; i++) {
+		sc_file_t *fci = card->cache.fcis[i];
+
+		if (fci != NULL && sc_compare_path(&fci->path, path))
+			return fci;
+	}
+	return NULL;
+}
+
+static void sc_add_fci(sc_card_t *card, sc_file_t *file)
+{
+	struct sc_card_cache *cache = &card->cache;
+	unsigned int i;
+
+	for (i = 0; i < SC_MAX_CACHED_FCIS; i++) {
+		if (cache->fcis[i] != NULL && sc_compare_path(&cache->fcis[i]->path, &file->path)) {
+			sc_file_free(cache->fcis[i]);
+			cache->fcis[i] = sc_file_ref(file);
+			return;
+		}
+	}
+	/* replace the oldest entry */
+	i = cache->fci_next;
+	if (cache->fcis[i] != NULL)
+		sc_file_free(cache->fcis[i]);
+	cache->fcis[i] = sc_file_ref(file);
+	cache->fci_next = (i + 1) % SC_MAX_CACHED_FCIS;
+}
+
+static int sc_select_file_cached(sc_card_t *card, const sc_path_t *in_path,
+		sc_file_t **file)
+{
+	struct sc_card_cache *cache = &card->cache;
+	sc_file_t *cached = NULL, *tfile = NULL, *fci;
+	sc_path_t tpath = *in_path;
+	int r;
+
+	tpath.index = 0;
+	tpath.count = -1;
+	if (cache->current_ef && sc_compare_path(&cache->current_ef->path, &tpath))
+		cached = cache->current_ef;
+	else if (cache->current_path.len && sc_compare_path(&cache->current_path, &tpath)
+			&& (file == NULL || cache->current_df != NULL))
+		cached = cache->current_df;
+
+	if (cached != NULL || (file == NULL && cache->current_path.len
+				&& sc_compare_path(&cache->current_path, &tpath))) {
+		sc_log(card->ctx, "file already selected");
+		if (file)
+			*file = sc_file_ref(cached);
+		return SC_SUCCESS;
+	}
+
+	fci = sc_find_fci(card, &tpath);
+
+	if (cache->current_path.len && cache->current_path.len < tpath.len
+			&& sc_compare_path_prefix(&cache->current_path, &tpath)) {
+		/* select relative to the current DF */
+		memmove(tpath.value, tpath.value + cache->current_path.len,
+				tpath.len - cache->current_path.len);
+		tpath.len -= cache->current_path.len;
+		sc_log(card->ctx, "select relative to the current DF: %s", sc_print_path(&tpath));
+	}
+	else {
+		tpath = *in_path;
+	}
+
+	if (fci != NULL) {
+		/* the FCI is known, no need to have the card send it again */
+		sc_log(card->ctx, "FCI cached");
+		r = card->ops->select_file(card, &tpath, NULL);
+		if (r < 0) {
+			sc_drop_fcis(card);
+			sc_select_cache_update(card, in_path, NULL);
+			return r;
+		}
+		sc_select_cache_update(card, &fci->path, fci);
+		if (file)
+			*file = sc_file_ref(fci);
+		return r;
+	}
+
+	/* request the FCI to know if a DF or an EF has been selected */
+	r = card->ops->select_file(card, &tpath, &tfile);
+	if (r < 0) {
+		sc_select_cache_update(card, in_path, NULL);
+		return r;
+	}
+
+	tpath = *in_path;
+	tpath.index = 0;
+	tpath.count = -1;
+	if (tfile) {
+		tfile->path = tpath;
+		sc_add_fci(card, tfile);
+	}
+	sc_select_cache_update(card, &tpath, tfile);
+
+	if (file)
+		*file = tfile;
+	else if (tfile)
+		sc_file_free(tfile);
+	return r;
+}
+
+/* Track the DF a following LIST FILES lists. Selecting an EF leaves
+ * its parent current; anything the card layer cannot tell apart makes
+ * the current DF unknown. */
+static void sc_list_path_update(sc_card_t *card, const sc_path_t *in_path,
+		const sc_file_t *file)
+{
+	sc_path_t *list_path = &card->cache.list_path;
+	sc_path_t path = *in_path;
+
+	path.index = 0;
+	path.count = -1;
+	if (in_path->type != SC_PATH_TYPE_PATH || in_path->aid.len != 0
+			|| in_path->len < 2) {
+		memset(list_path, 0, sizeof(*list_path));
+	}
+	else if (file != NULL && file->type == SC_FILE_TYPE_DF) {
+		*list_path = path;
+	}
+	else if (file != NULL) {
+		path.len -= 2;
+		if (path.len == 0)
+			memset(list_path, 0, sizeof(*list_path));
+		else
+			*list_path = path;
+	}
+	else if (!sc_compare_path(&path, list_path)) {
+		memset(list_path, 0, sizeof(*list_path));
+	}
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
 	int r;
@@ -636,12 +1932,37 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
-	r = card->ops->select_file(card, in_path, file);
+
+	/* a cached selection sends no APDU that would flush them */
+	r = sc_flush_writes(card);
+	LOG_TEST_RET(card->ctx, r, "held back UPDATE BINARY failed");
+
+	sc_drop_read_ahead(card);
+	card->cache.current_ef_size = 0;
+	if ((card->caps & SC_CARD_CAP_SELECT_CACHE) && card->cache.valid
+			&& card->lock_count > 0 && in_path->type == SC_PATH_TYPE_PATH
+			&& in_path->aid.len == 0 && in_path->len >= 2
+			&& memcmp(in_path->value, "\x3F\x00", 2) == 0) {
+		r = sc_select_file_cached(card, in_path, file);
+	}
+	else {
+		if (card->caps & SC_CARD_CAP_SELECT_CACHE)
+			sc_select_cache_update(card, in_path, NULL);
+		r = card->ops->select_file(card, in_path, file);
+	}
+	if (r < 0)
+		memset(&card->cache.list_path, 0, sizeof(card->cache.list_path));
+	else
+		sc_list_path_update(card, in_path, file ? *file : NULL);
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
 
 	/* Remember file path */
-	if (file && *file)
+	if (file && *file) {
 		(*file)->path = *in_path;
+		if ((*file)->type == SC_FILE_TYPE_WORKING_EF
+				&& (*file)->ef_structure == SC_FILE_EF_TRANSPARENT)
+			card->cache.current_ef_size = (*file)->size;
+	}
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -668,6 +1989,7 @@ int sc_put_data(sc_card_t *card, unsigned int tag, const u8 *buf, size_t len)
 	if (card->ops->put_data == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->put_data(card, tag, buf, len);
+	sc_shared_generation_bump(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -701,6 +2023,169 @@ int sc_read_record(sc_card_t *card, unsigned int rec_nr, u8 *buf,
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/* Appends a record to the buffer of sc_read_records() */
+static int sc_pack_record(u8 *buf, size_t buflen, size_t *used, const u8 *rec, size_t len)
+{
+	if (len > 0xFFFF || buflen - *used < 2 + len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	buf[(*used)++] = (len >> 8) & 0xFF;
+	buf[(*used)++] = len & 0xFF;
+	memcpy(buf + *used, rec, len);
+	*used += len;
+	return SC_SUCCESS;
+}
+
+/* READ RECORD with P2 "up to the last": the records come one after the
+ * other, each a TLV object */
+static int sc_read_records_at_once(sc_card_t *card, unsigned int rec_nr, unsigned int count,
+		u8 *buf, size_t *buflen, unsigned long flags)
+{
+	u8 *resp;
+	const u8 *p, *q;
+	size_t left, taglen, rec_size, used = 0, resplen = sc_get_max_recv_size(card);
+	unsigned int cla, tag, n = 0;
+	int r;
+
+	resp = malloc(resplen);
+	if (resp == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_read_record(card, rec_nr, resp, resplen,
+			(flags & SC_RECORD_EF_ID_MASK) | SC_RECORD_BY_REC_NR | SC_RECORD_TO_LAST);
+	if (r < 0 || (size_t)r == resplen) {
+		/* a full response may have left records out */
+		free(resp);
+		return r < 0 ? r : SC_ERROR_NOT_SUPPORTED;
+	}
+	for (p = resp, left = r; left > 0 && (count == 0 || n < count); left -= rec_size, p += rec_size, n++) {
+		q = p;
+		r = sc_asn1_read_tag(&q, left, &cla, &tag, &taglen);
+		if (r != SC_SUCCESS || q == NULL || (size_t)(q - p) + taglen > left) {
+			/* not a TLV object: the record boundaries are unknown */
+			r = SC_ERROR_NOT_SUPPORTED;
+			break;
+		}
+		rec_size = (q - p) + taglen;
+		r = sc_pack_record(buf, *buflen, &used, p, rec_size);
+		if (r != SC_SUCCESS)
+			break;
+	}
+	free(resp);
+	if (r != SC_SUCCESS)
+		return r;
+	*buflen = used;
+	return n;
+}
+
+#define SC_READ_RECORDS_BATCH	8
+
+/* One READ RECORD per record, SC_READ_RECORDS_BATCH APDUs at a time */
+static int sc_read_records_batched(sc_card_t *card, unsigned int rec_nr, unsigned int count,
+		u8 *buf, size_t *buflen, unsigned long flags)
+{
+	sc_apdu_t apdus[SC_READ_RECORDS_BATCH];
+	u8 *resp;
+	size_t used = 0, i, num;
+	unsigned int n = 0, last;
+	int r = SC_SUCCESS, done = 0;
+
+	resp = malloc(SC_READ_RECORDS_BATCH * 256);
+	if (resp == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	last = count ? rec_nr + count - 1 : SC_MAX_RECORD_NR;
+	if (last > SC_MAX_RECORD_NR)
+		last = SC_MAX_RECORD_NR;
+
+	while (!done && rec_nr + n <= last) {
+		num = last - (rec_nr + n) + 1;
+		if (num > SC_READ_RECORDS_BATCH)
+			num = SC_READ_RECORDS_BATCH;
+		for (i = 0; i < num; i++) {
+			sc_format_apdu(card, &apdus[i], SC_APDU_CASE_2, 0xB2, rec_nr + n + i,
+					((flags & SC_RECORD_EF_ID_MASK) << 3) | 0x04);
+			apdus[i].le = 256;
+			apdus[i].resplen = 256;
+			apdus[i].resp = resp + i * 256;
+		}
+		r = sc_transmit_apdus(card, apdus, num);
+		if (r != SC_SUCCESS)
+			break;
+		for (i = 0; i < num; i++, n++) {
+			r = sc_check_sw(card, apdus[i].sw1, apdus[i].sw2);
+			if (r == SC_ERROR_RECORD_NOT_FOUND) {
+				r = SC_SUCCESS;
+				done = 1;
+				break;
+			}
+			if (r == SC_SUCCESS)
+				r = sc_pack_record(buf, *buflen, &used, apdus[i].resp, apdus[i].resplen);
+			if (r != SC_SUCCESS) {
+				done = 1;
+				break;
+			}
+		}
+	}
+	sc_mem_clear(resp, SC_READ_RECORDS_BATCH * 256);
+	free(resp);
+	if (r != SC_SUCCESS)
+		return r;
+	*buflen = used;
+	return n;
+}
+
+int sc_read_records(sc_card_t *card, unsigned int rec_nr, unsigned int count,
+		u8 *buf, size_t *buflen, unsigned long flags)
+{
+	struct sc_card_operations *iso_ops = sc_get_iso7816_driver()->ops;
+	u8 rec[256];
+	size_t used = 0;
+	unsigned int n = 0, last;
+	int r;
+
+	if (card == NULL || buf == NULL || buflen == NULL || rec_nr == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+	if (card->ops->read_record == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
+	if (card->caps & SC_CARD_CAP_READ_RECORDS) {
+		r = sc_read_records_at_once(card, rec_nr, count, buf, buflen, flags);
+		if (r >= 0)
+			goto out;
+		sc_log(card->ctx, "reading the records at once failed, reading them one by one");
+	}
+
+	if (card->ops->read_record == iso_ops->read_record) {
+		r = sc_read_records_batched(card, rec_nr, count, buf, buflen, flags);
+		goto out;
+	}
+
+	last = count ? rec_nr + count - 1 : SC_MAX_RECORD_NR;
+	for (r = SC_SUCCESS; rec_nr + n <= last && rec_nr + n <= SC_MAX_RECORD_NR; n++) {
+		r = sc_read_record(card, rec_nr + n, rec, sizeof(rec),
+				(flags & SC_RECORD_EF_ID_MASK) | SC_RECORD_BY_REC_NR);
+		if (r == SC_ERROR_RECORD_NOT_FOUND) {
+			r = SC_SUCCESS;
+			break;
+		}
+		if (r < 0)
+			break;
+		r = sc_pack_record(buf, *buflen, &used, rec, r);
+		if (r != SC_SUCCESS)
+			break;
+	}
+	sc_mem_clear(rec, sizeof(rec));
+	if (r == SC_SUCCESS) {
+		*buflen = used;
+		r = n;
+	}
+out:
+	sc_unlock(card);
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
 int sc_write_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 		    size_t count, unsigned long flags)
 {
@@ -712,6 +2197,7 @@ int sc_write_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 	if (card->ops->write_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->write_record(card, rec_nr, buf, count, flags);
+	sc_shared_generation_bump(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -726,7 +2212,10 @@ int sc_append_record(sc_card_t *card, const u8 * buf, size_t count,
 
 	if (card->ops->append_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	/* the record count in the FCI changes */
+	sc_drop_fcis(card);
 	r = card->ops->append_record(card, buf, count, flags);
+	sc_shared_generation_bump(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -742,6 +2231,7 @@ int sc_update_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 	if (card->ops->update_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->update_record(card, rec_nr, buf, count, flags);
+	sc_shared_generation_bump(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -756,6 +2246,7 @@ int sc_delete_record(sc_card_t *card, unsigned int rec_nr)
 	if (card->ops->delete_record == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->delete_record(card, rec_nr);
+	sc_shared_generation_bump(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -768,6 +2259,11 @@ sc_card_ctl(sc_card_t *card, unsigned long cmd, void *args)
 	assert(card != NULL);
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* drivers create key files on key generation and the like */
+	if (cmd != SC_CARDCTL_GET_SERIALNR) {
+		sc_drop_file_lists(card);
+		sc_drop_fcis(card);
+	}
 	if (card->ops->card_ctl != NULL)
 		r = card->ops->card_ctl(card, cmd, args);
 
@@ -779,6 +2275,43 @@ sc_card_ctl(sc_card_t *card, unsigned long cmd, void *args)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+static int algorithm_index_cmp(const void *a, const void *b)
+{
+	const sc_algorithm_info_t *x = *(const sc_algorithm_info_t * const *) a;
+	const sc_algorithm_info_t *y = *(const sc_algorithm_info_t * const *) b;
+
+	if (x->algorithm != y->algorithm)
+		return x->algorithm < y->algorithm ? -1 : 1;
+	if (x->key_length != y->key_length)
+		return x->key_length < y->key_length ? -1 : 1;
+	/* equal entries keep the order of the list, the first one wins */
+	return x < y ? -1 : x > y;
+}
+
+int _sc_card_index_algorithms(sc_card_t *card)
+{
+	sc_algorithm_info_t **index = NULL;
+	int i;
+
+	if (card->algorithm_index)
+		free(card->algorithm_index);
+	card->algorithm_index = NULL;
+	card->algorithm_index_count = 0;
+	if (card->algorithm_count == 0)
+		return SC_SUCCESS;
+
+	index = malloc(card->algorithm_count * sizeof(*index));
+	if (!index)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < card->algorithm_count; i++)
+		index[i] = &card->algorithms[i];
+	qsort(index, card->algorithm_count, sizeof(*index), algorithm_index_cmp);
+
+	card->algorithm_index = index;
+	card->algorithm_index_count = card->algorithm_count;
+	return SC_SUCCESS;
+}
+
 int _sc_card_add_algorithm(sc_card_t *card, const sc_algorithm_info_t *info)
 {
 	sc_algorithm_info_t *p;
@@ -790,13 +2323,16 @@ int _sc_card_add_algorithm(sc_card_t *card, const sc_algorithm_info_t *info)
 			free(card->algorithms);
 		card->algorithms = NULL;
 		card->algorithm_count = 0;
+		_sc_card_index_algorithms(card);
 		return SC_ERROR_OUT_OF_MEMORY;
 	}
 	card->algorithms = p;
 	p += card->algorithm_count;
 	card->algorithm_count++;
 	*p = *info;
-	return SC_SUCCESS;
+	/* The list is only built while the card is bound, so the index is
+	 * kept current here and lookups never have to write to the card. */
+	return _sc_card_index_algorithms(card);
 }
 
 int  _sc_card_add_ec_alg(sc_card_t *card, unsigned int key_length,
@@ -816,17 +2352,40 @@ int  _sc_card_add_ec_alg(sc_card_t *card, unsigned int key_length,
 static sc_algorithm_info_t * sc_card_find_alg(sc_card_t *card,
 		unsigned int algorithm, unsigned int key_length)
 {
-	int i;
+	sc_algorithm_info_t **index = card->algorithm_index;
+	int i, lo, hi;
 
-	for (i = 0; i < card->algorithm_count; i++) {
-		sc_algorithm_info_t *info = &card->algorithms[i];
+	/* a driver that changed the list itself gets the linear scan */
+	if (index == NULL || card->algorithm_index_count != card->algorithm_count) {
+		for (i = 0; i < card->algorithm_count; i++) {
+			sc_algorithm_info_t *info = &card->algorithms[i];
 
-		if (info->algorithm != algorithm)
-			continue;
-		if (info->key_length != key_length)
-			continue;
-		return info;
+			if (info->algorithm != algorithm)
+				continue;
+			if (info->key_length != key_length)
+				continue;
+			return info;
+		}
+		return NULL;
+	}
+
+	/* first entry not less than (algorithm, key_length) */
+	lo = 0;
+	hi = card->algorithm_index_count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (index[mid]->algorithm < algorithm
+				|| (index[mid]->algorithm == algorithm
+					&& index[mid]->key_length < key_length))
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	if (lo < card->algorithm_index_count
+			&& index[lo]->algorithm == algorithm
+			&& index[lo]->key_length == key_length)
+		return index[lo];
 	return NULL;
 }
 
@@ -1041,13 +2600,7 @@ scconf_block *sc_get_conf_block(sc_context_t *ctx, const char *name1, const char
 	scconf_block *conf_block = NULL;
 
 	for (i = 0; ctx->conf_blocks[i] != NULL; i++) {
-		scconf_block **blocks;
-
-		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i], name1, name2);
-		if (blocks != NULL) {
-			conf_block = blocks[0];
-			free(blocks);
-		}
+		conf_block = scconf_find_first_block(ctx->conf, ctx->conf_blocks[i], name1, name2);
 		if (conf_block != NULL && priority)
 			break;
 	}
@@ -1082,23 +2635,76 @@ sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_a
 }
 
 #ifdef ENABLE_SM
+/*
+ * SM modules are shared by all cards and contexts of the process:
+ * the library is opened and its handlers resolved once, and closed
+ * when the last card using it is released.
+ */
+struct sm_module_entry {
+	char *name;
+	char *path;
+	void *handle;
+	struct sm_module_operations ops;
+	unsigned int refs;
+	struct sm_module_entry *next;
+};
+
+static struct sm_module_entry *sm_modules = NULL;
+
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+static pthread_mutex_t sm_modules_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define sm_modules_lock()	pthread_mutex_lock(&sm_modules_mutex)
+#define sm_modules_unlock()	pthread_mutex_unlock(&sm_modules_mutex)
+#elif defined(_WIN32)
+static volatile LONG sm_modules_mutex = 0;
+#define sm_modules_lock()	while (InterlockedExchange(&sm_modules_mutex, 1)) Sleep(0)
+#define sm_modules_unlock()	InterlockedExchange(&sm_modules_mutex, 0)
+#else
+#define sm_modules_lock()
+#define sm_modules_unlock()
+#endif
+
+
 static int
 sc_card_sm_unload(struct sc_card *card)
 {
+	struct sm_module_entry *entry, **prev;
+
 	if (card->sm_ctx.module.ops.module_cleanup)
 		card->sm_ctx.module.ops.module_cleanup(card->ctx);
 
-	if (card->sm_ctx.module.handle)
+	if (!card->sm_ctx.module.handle)
+		return 0;
+
+	sm_modules_lock();
+	for (prev = &sm_modules; *prev; prev = &(*prev)->next)
+		if ((*prev)->handle == card->sm_ctx.module.handle)
+			break;
+	entry = *prev;
+	if (entry && --entry->refs == 0)   {
+		*prev = entry->next;
+		sc_dlclose(entry->handle);
+		free(entry->name);
+		free(entry->path);
+		free(entry);
+	}
+	else if (!entry)   {
 		sc_dlclose(card->sm_ctx.module.handle);
+	}
+	sm_modules_unlock();
+
 	card->sm_ctx.module.handle = NULL;
+	memset(&card->sm_ctx.module.ops, 0, sizeof(card->sm_ctx.module.ops));
 	return 0;
 }
 
 
 static int
-sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_module)
+sm_module_open(struct sc_context *ctx, const char *module_path, const char *in_module,
+		struct sm_module_entry *entry)
 {
-	struct sc_context *ctx = NULL;
+	struct sm_module_operations *mod_ops = &entry->ops;
 	int rv = SC_ERROR_INTERNAL;
 	char *module = NULL;
 #ifdef _WIN32
@@ -1111,12 +2717,6 @@ sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_mo
 	const char path_delim = '/';
 #endif
 
-	assert(card != NULL);
-	ctx = card->ctx;
-	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
-	if (!in_module)
-		return sc_card_sm_unload(card);
-
 #ifdef _WIN32
 	if (!module_path) {
 		rc = RegOpenKeyEx( HKEY_CURRENT_USER, "Software\\OpenSC Project\\OpenSC", 0, KEY_QUERY_VALUE, &hKey );
@@ -1155,15 +2755,14 @@ sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_mo
 
 	sc_log(ctx, "try to load SM module '%s'", module);
 	do  {
-		struct sm_module_operations *mod_ops = &card->sm_ctx.module.ops;
 		void *mod_handle;
 
-		card->sm_ctx.module.handle = sc_dlopen(module);
-		if (!card->sm_ctx.module.handle)   {
+		entry->handle = sc_dlopen(module);
+		if (!entry->handle)   {
 			sc_log(ctx, "cannot open dynamic library '%s': %s", module, sc_dlerror());
 			break;
 		}
-		mod_handle = card->sm_ctx.module.handle;
+		mod_handle = entry->handle;
 
 		mod_ops->initialize = sc_dlsym(mod_handle, "initialize");
 		if (!mod_ops->initialize)   {
@@ -1197,12 +2796,72 @@ sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_mo
 		break;
 	} while(0);
 
-	if (rv)
-		sc_card_sm_unload(card);
+	if (rv && entry->handle)   {
+		sc_dlclose(entry->handle);
+		entry->handle = NULL;
+	}
+
+	free(module);
+	return rv;
+}
+
+
+static int
+sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_module)
+{
+	struct sc_context *ctx = NULL;
+	struct sm_module_entry *entry;
+	int rv = SC_SUCCESS;
+
+	assert(card != NULL);
+	ctx = card->ctx;
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	if (!in_module)
+		return sc_card_sm_unload(card);
+
+	sm_modules_lock();
+	for (entry = sm_modules; entry; entry = entry->next)   {
+		if (strcmp(entry->name, in_module))
+			continue;
+		if ((!entry->path && !module_path)
+				|| (entry->path && module_path && !strcmp(entry->path, module_path)))
+			break;
+	}
+
+	if (entry)   {
+		sc_log(ctx, "SM module '%s' already loaded (%u users)", in_module, entry->refs);
+	}
+	else   {
+		entry = calloc(1, sizeof(struct sm_module_entry));
+		if (entry)   {
+			entry->name = strdup(in_module);
+			entry->path = module_path ? strdup(module_path) : NULL;
+		}
+		if (!entry || !entry->name || (module_path && !entry->path))
+			rv = SC_ERROR_OUT_OF_MEMORY;
+		else
+			rv = sm_module_open(ctx, module_path, in_module, entry);
+
+		if (rv == SC_SUCCESS)   {
+			entry->next = sm_modules;
+			sm_modules = entry;
+		}
+		else if (entry)   {
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			entry = NULL;
+		}
+	}
+
+	if (entry)   {
+		entry->refs++;
+		card->sm_ctx.module.handle = entry->handle;
+		card->sm_ctx.module.ops = entry->ops;
+	}
+	sm_modules_unlock();
 
 	card->sm_ctx.sm_mode = SM_MODE_ACL;
-	if (module)
-		free(module);
 
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, rv);
 }
@@ -1277,6 +2936,8 @@ sc_card_sm_check(struct sc_card *card)
 
 		card->sm_ctx.sm_mode = SM_MODE_TRANSMIT;
 		rv = card->sm_ctx.ops.open(card);
+		/* a new secure channel may have reset the current DF */
+		sc_invalidate_cache(card);
 		LOG_TEST_RET(ctx, rv, "Cannot initialize SM");
 	}
 
@@ -209,6 +209,7 @@ enum {
 	SC_CARDCTL_PIV_GENERATE_KEY,
 	SC_CARDCTL_PIV_PIN_PREFERENCE,
 	SC_CARDCTL_PIV_OBJECT_PRESENT,
+	SC_CARDCTL_PIV_PREFETCH,
 
         /*
 	 * AuthentIC v3
@@ -0,0 +1,217 @@
+/*
+ * coherency.c: card generations shared between processes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+
+#include "internal.h"
+
+/*
+ * With 'shared_card_generations', <cachedir>/generations holds a table
+ * of 32 bit counters mapped shared into every process. A card owns the
+ * counter its ATR and serial number (if the driver read it while
+ * connecting) hash to. Each write to the card increments the counter,
+ * so a process tells with a single load whether another one changed
+ * the card since it cached something. Cards sharing a counter only
+ * cost each other needless invalidations.
+ *
+ * The counters of a new table start at a random value, so that a
+ * generation recorded on disk (see the quick bind in pkcs15.c) does
+ * not match again once the table was removed and created anew.
+ */
+#define SC_GENERATION_SLOTS	1024
+#define SC_GENERATION_FILE	"generations"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(__GNUC__)
+#define generation_load(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define generation_bump(p)	__atomic_fetch_add((p), 1, __ATOMIC_ACQ_REL)
+
+/* Writes a complete table next to fname and links it into place, the
+ * processes racing for it all end up with the first one linked */
+static void create_generations(const char *fname)
+{
+	char tmpname[PATH_MAX];
+	unsigned int table[SC_GENERATION_SLOTS], start = 0;
+	size_t i;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, &start, sizeof(start)) != sizeof(start))
+		start = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+	if (fd >= 0)
+		close(fd);
+	for (i = 0; i < SC_GENERATION_SLOTS; i++)
+		table[i] = start;
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname) >= (int)sizeof(tmpname))
+		return;
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		return;
+	if (write(fd, table, sizeof(table)) == sizeof(table) && close(fd) == 0)
+		link(tmpname, fname);
+	else
+		close(fd);
+	unlink(tmpname);
+}
+
+static unsigned int *map_generations(sc_context_t *ctx)
+{
+	char dirname[PATH_MAX], fname[PATH_MAX];
+	size_t size = SC_GENERATION_SLOTS * sizeof(unsigned int);
+	struct stat stbuf;
+	void *table;
+	int fd;
+
+	if (sc_get_cache_dir(ctx, dirname, sizeof(dirname)) != SC_SUCCESS)
+		return NULL;
+	if (snprintf(fname, sizeof(fname), "%s/%s", dirname, SC_GENERATION_FILE) >= (int)sizeof(fname))
+		return NULL;
+	fd = open(fname, O_RDWR);
+	if (fd < 0) {
+		if (sc_make_cache_dir(ctx) == SC_SUCCESS)
+			create_generations(fname);
+		fd = open(fname, O_RDWR);
+	}
+	if (fd < 0) {
+		sc_log(ctx, "cannot open %s", fname);
+		return NULL;
+	}
+	if (fstat(fd, &stbuf) != 0 || (size_t)stbuf.st_size < size) {
+		sc_log(ctx, "%s is not a table of card generations", fname);
+		close(fd);
+		return NULL;
+	}
+	table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED) {
+		sc_log(ctx, "cannot map %s", fname);
+		return NULL;
+	}
+	return table;
+}
+
+static void unmap_generations(unsigned int *table)
+{
+	munmap(table, SC_GENERATION_SLOTS * sizeof(unsigned int));
+}
+#else
+#define generation_load(p)	(*(p))
+#define generation_bump(p)	((*(p))++)
+
+static unsigned int *map_generations(sc_context_t *ctx)
+{
+	sc_log(ctx, "shared card generations are not supported on this platform");
+	return NULL;
+}
+
+static void unmap_generations(unsigned int *table)
+{
+}
+#endif
+
+/* FNV-1a */
+static unsigned int generation_hash(unsigned int h, const u8 *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+void sc_shared_generation_attach(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	unsigned int h;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ctx->shared_generations == NULL && !ctx->shared_generations_failed) {
+		ctx->shared_generations = map_generations(ctx);
+		ctx->shared_generations_failed = ctx->shared_generations == NULL;
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (ctx->shared_generations == NULL)
+		return;
+
+	h = generation_hash(2166136261U, card->atr.value, card->atr.len);
+	h = generation_hash(h, card->serialnr.value, card->serialnr.len);
+	card->shared_generation = &ctx->shared_generations[h % SC_GENERATION_SLOTS];
+	card->shared_generation_seen = generation_load(card->shared_generation);
+}
+
+int sc_shared_generation_changed(sc_card_t *card)
+{
+	unsigned int generation;
+
+	if (card->shared_generation == NULL)
+		return 0;
+	generation = generation_load(card->shared_generation);
+	if (generation == card->shared_generation_seen)
+		return 0;
+	card->shared_generation_seen = generation;
+	return 1;
+}
+
+void sc_shared_generation_bump(sc_card_t *card)
+{
+	unsigned int old;
+
+	if (card->shared_generation == NULL)
+		return;
+	old = generation_bump(card->shared_generation);
+	/* our own caches followed the write; if another process wrote
+	 * meanwhile, the next sc_lock() drops them nonetheless */
+	if (old == card->shared_generation_seen)
+		card->shared_generation_seen = old + 1;
+}
+
+int sc_card_shared_generation(sc_card_t *card, unsigned int *generation)
+{
+	if (card == NULL || generation == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (card->shared_generation == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	*generation = generation_load(card->shared_generation);
+	return SC_SUCCESS;
+}
+
+void _sc_free_shared_generations(sc_context_t *ctx)
+{
+	if (ctx->shared_generations != NULL)
+		unmap_generations(ctx->shared_generations);
+	ctx->shared_generations = NULL;
+	ctx->shared_generations_failed = 0;
+}
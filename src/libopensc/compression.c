@@ -109,62 +109,157 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
-static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
-	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
+struct sc_decompress_stream {
 	z_stream gz;
-	int err;
-	int window_size = 15;
-	const int startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const int blockSize = inLen < 1024 ? 512 : inLen / 2;
-	int bufferSize = startSize;
-	if(gzip)
-		window_size += 0x20;
-	memset(&gz, 0, sizeof(gz));
-	
-	gz.next_in = (u8*)in;
-	gz.avail_in = inLen;
+	int method;
+	int initialized;
+	int finished;
+	u8 *out;
+	size_t out_len;
+	size_t out_size;
+	size_t size_hint;
+};
 
-	err = inflateInit2(&gz, window_size);
-	if(err != Z_OK) return zerr_to_opensc(err);
+int sc_decompress_stream_new(struct sc_decompress_stream **stream, int method, size_t size_hint) {
+	struct sc_decompress_stream *s;
 
-	*outLen = 0;
+	if(!stream)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if(method != COMPRESSION_AUTO && method != COMPRESSION_ZLIB && method != COMPRESSION_GZIP)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	s = calloc(1, sizeof(*s));
+	if(!s)
+		return SC_ERROR_OUT_OF_MEMORY;
+	s->method = method;
+	s->size_hint = size_hint;
+	*stream = s;
+	return SC_SUCCESS;
+}
 
-	while(1) {
-		/* Setup buffer... */
-		int num;
-		u8* buf = realloc(*out, bufferSize);
-		if(!buf) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			return Z_MEM_ERROR;
-		}
-		*out = buf;
-		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
-
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if(err != Z_STREAM_END && err != Z_OK) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			break;
+static int stream_grow(struct sc_decompress_stream *s, size_t in_len) {
+	size_t size;
+	u8 *buf;
+
+	if(s->out_size == 0) {
+		/* the caller's hint is normally exact, one spare byte lets inflate
+		 * report the end of the stream without another round */
+		if(s->size_hint)
+			size = s->size_hint + 1;
+		else
+			size = in_len < 1024 ? 2048 : in_len * 4;
+	} else {
+		size = s->out_size * 2;
+	}
+	buf = realloc(s->out, size);
+	if(!buf)
+		return SC_ERROR_OUT_OF_MEMORY;
+	s->out = buf;
+	s->out_size = size;
+	return SC_SUCCESS;
+}
+
+int sc_decompress_stream_update(struct sc_decompress_stream *s, const u8 *in, size_t inLen) {
+	int err, rc;
+
+	if(!s || (!in && inLen))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if(inLen == 0)
+		return SC_SUCCESS;
+	if(s->finished)
+		/* trailing data after the end of the stream is ignored */
+		return SC_SUCCESS;
+
+	if(!s->initialized) {
+		if(s->method == COMPRESSION_AUTO) {
+			/* the first chunk may be short, but the first byte is enough:
+			 * 0x1f is the gzip magic and never a valid zlib header */
+			s->method = in[0] == 0x1f ? COMPRESSION_GZIP : COMPRESSION_ZLIB;
 		}
-		num = bufferSize - *outLen - gz.avail_out;
-		if(num > 0) {
-			*outLen += num;
-			bufferSize += num + blockSize;
+		err = inflateInit2(&s->gz, s->method == COMPRESSION_GZIP ? 15 + 0x20 : 15);
+		if(err != Z_OK)
+			return zerr_to_opensc(err);
+		s->initialized = 1;
+	}
+
+	s->gz.next_in = (u8*)in;
+	s->gz.avail_in = inLen;
+	while(s->gz.avail_in) {
+		if(s->out_len == s->out_size) {
+			rc = stream_grow(s, inLen);
+			if(rc != SC_SUCCESS)
+				return rc;
 		}
+		s->gz.next_out = s->out + s->out_len;
+		s->gz.avail_out = s->out_size - s->out_len;
+
+		err = inflate(&s->gz, Z_NO_FLUSH);
+		s->out_len = s->out_size - s->gz.avail_out;
 		if(err == Z_STREAM_END) {
-			buf = realloc(buf, *outLen); /* Shrink it down, if it fails, just use old data */
-			if(buf) {
-				*out = buf;
-			}
+			s->finished = 1;
 			break;
 		}
+		/* Z_BUF_ERROR only means no progress was possible with a full output buffer */
+		if(err != Z_OK && !(err == Z_BUF_ERROR && s->gz.avail_out == 0))
+			return zerr_to_opensc(err == Z_BUF_ERROR ? Z_DATA_ERROR : err);
 	}
-	inflateEnd(&gz);
-	return zerr_to_opensc(err);
+	return SC_SUCCESS;
+}
+
+int sc_decompress_stream_final(struct sc_decompress_stream *s, u8 **out, size_t *outLen) {
+	u8 *buf;
+
+	if(!s || !out || !outLen)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if(!s->finished)
+		return SC_ERROR_INVALID_DATA;
+
+	/* give back the slack if the buffer was overestimated */
+	buf = s->out;
+	if(s->out_size - s->out_len > s->out_len / 4) {
+		buf = realloc(s->out, s->out_len ? s->out_len : 1);
+		if(!buf)
+			buf = s->out;
+	}
+	*out = buf;
+	*outLen = s->out_len;
+	s->out = NULL;
+	s->out_len = s->out_size = 0;
+	return SC_SUCCESS;
+}
+
+void sc_decompress_stream_free(struct sc_decompress_stream *s) {
+	if(!s)
+		return;
+	if(s->initialized)
+		inflateEnd(&s->gz);
+	free(s->out);
+	free(s);
+}
+
+static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
+	struct sc_decompress_stream *s = NULL;
+	size_t hint = 0;
+	int rc;
+
+	/* The gzip trailer carries the uncompressed size modulo 2^32. Deflate
+	 * can not expand more than ~1032:1, so a larger value is corrupt and
+	 * not worth allocating for. */
+	if(gzip && inLen >= 18) {
+		const u8 *isize = in + inLen - 4;
+		hint = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((size_t)isize[3] << 24);
+		if(hint / 1032 > inLen)
+			hint = 0;
+	}
+
+	*out = NULL;
+	*outLen = 0;
+	rc = sc_decompress_stream_new(&s, gzip ? COMPRESSION_GZIP : COMPRESSION_ZLIB, hint);
+	if(rc == SC_SUCCESS)
+		rc = sc_decompress_stream_update(s, in, inLen);
+	if(rc == SC_SUCCESS)
+		rc = sc_decompress_stream_final(s, out, outLen);
+	sc_decompress_stream_free(s);
+	return rc;
 }
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
 	if(method == COMPRESSION_AUTO) {
@@ -182,4 +277,47 @@ int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, in
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 }
+
+int sc_compress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
+	uLongf len;
+	int rc;
+
+	*out = NULL;
+	*outLen = 0;
+	if(method != COMPRESSION_ZLIB && method != COMPRESSION_GZIP)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	/* the gzip header and trailer are 18 bytes, zlib's are 6 */
+	len = compressBound(inLen) + 12;
+	*out = malloc(len);
+	if(*out == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if(method == COMPRESSION_GZIP) {
+		z_stream gz;
+
+		memset(&gz, 0, sizeof(gz));
+		gz.next_in = (u8*)in;
+		gz.avail_in = inLen;
+		gz.next_out = *out;
+		gz.avail_out = len;
+		rc = deflateInit2(&gz, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 0x10, 8, Z_DEFAULT_STRATEGY);
+		if(rc == Z_OK) {
+			rc = deflate(&gz, Z_FINISH);
+			len = gz.total_out;
+			deflateEnd(&gz);
+			if(rc == Z_STREAM_END)
+				rc = Z_OK;
+			else if(rc == Z_OK)
+				rc = Z_BUF_ERROR;
+		}
+	} else {
+		rc = compress2(*out, &len, in, inLen, Z_DEFAULT_COMPRESSION);
+	}
+	if(rc != Z_OK) {
+		free(*out);
+		*out = NULL;
+		return zerr_to_opensc(rc);
+	}
+	*outLen = len;
+	return SC_SUCCESS;
+}
 #endif /* ENABLE_ZLIB */
@@ -30,6 +30,19 @@
 
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
+/* COMPRESSION_ZLIB or COMPRESSION_GZIP, the result is malloc'ed */
+int sc_compress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
+
+/* Incremental inflate for data that arrives in pieces, e.g. chunks read
+ * from the card: feed every chunk to sc_decompress_stream_update() and
+ * collect the result with sc_decompress_stream_final(), which hands over
+ * a malloc'ed buffer. 'size_hint' is the expected uncompressed length,
+ * or 0 when unknown. */
+struct sc_decompress_stream;
+int sc_decompress_stream_new(struct sc_decompress_stream **stream, int method, size_t size_hint);
+int sc_decompress_stream_update(struct sc_decompress_stream *stream, const u8 *in, size_t inLen);
+int sc_decompress_stream_final(struct sc_decompress_stream *stream, u8 **out, size_t *outLen);
+void sc_decompress_stream_free(struct sc_decompress_stream *stream);
 
 #endif
 
@@ -27,6 +27,9 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -39,6 +42,9 @@
 int _sc_add_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
 	assert(reader != NULL);
+	reader->stats = calloc(1, sizeof(struct sc_reader_stats));
+	if (reader->stats == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
 	reader->ctx = ctx;
 	list_append(&ctx->readers, reader);
 	return SC_SUCCESS;
@@ -51,63 +57,263 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 			reader->ops->release(reader);
 	if (reader->name)
 		free(reader->name);
+	free(reader->stats);
 	list_delete(&ctx->readers, reader);
 	free(reader);
 	return SC_SUCCESS;
 }
 
+/* Polling interval of _sc_poll_for_event(), in milliseconds: back to the
+ * shortest after each change, doubled up to the longest while idle */
+#define SC_POLL_INTERVAL_MIN	50
+#define SC_POLL_INTERVAL_MAX	400
+
+/* State of a caller of _sc_poll_for_event(), kept in *reader_states */
+struct sc_poll_state {
+	size_t count;
+	sc_reader_t **readers;
+	int *present;
+	unsigned int interval;
+};
+
+static void sc_poll_sleep(unsigned int msec)
+{
+#ifdef _WIN32
+	Sleep(msec);
+#else
+	usleep(msec * 1000);
+#endif
+}
+
+static struct sc_poll_state *sc_poll_state_new(sc_context_t *ctx)
+{
+	struct sc_poll_state *s;
+	size_t i;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->count = sc_ctx_get_reader_count(ctx);
+	s->readers = calloc(s->count + 1, sizeof(*s->readers));
+	s->present = calloc(s->count + 1, sizeof(*s->present));
+	if (s->readers == NULL || s->present == NULL) {
+		free(s->readers);
+		free(s->present);
+		free(s);
+		return NULL;
+	}
+	/* changes since the caller last looked at the readers are events */
+	for (i = 0; i < s->count; i++) {
+		s->readers[i] = sc_ctx_get_reader(ctx, i);
+		s->present[i] = (s->readers[i]->flags & SC_READER_CARD_PRESENT) != 0;
+	}
+	s->interval = SC_POLL_INTERVAL_MIN;
+	return s;
+}
+
+static void sc_poll_state_free(struct sc_poll_state *s)
+{
+	if (s == NULL)
+		return;
+	free(s->readers);
+	free(s->present);
+	free(s);
+}
+
+int _sc_poll_for_event(sc_context_t *ctx, unsigned int event_mask,
+	sc_reader_t **event_reader, unsigned int *event,
+	int timeout, void **reader_states)
+{
+	struct sc_poll_state *s;
+	unsigned long long start, elapsed;
+	size_t i;
+	int r;
+
+	if (!event_reader && !event && reader_states) {
+		sc_poll_state_free((struct sc_poll_state *) *reader_states);
+		*reader_states = NULL;
+		return SC_SUCCESS;
+	}
+
+	if (reader_states != NULL && *reader_states != NULL) {
+		s = (struct sc_poll_state *) *reader_states;
+		if (s->count != sc_ctx_get_reader_count(ctx)) {
+			/* the reader list changed: start over */
+			sc_poll_state_free(s);
+			s = NULL;
+		}
+	} else
+		s = NULL;
+	if (s == NULL) {
+		s = sc_poll_state_new(ctx);
+		if (s == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (reader_states != NULL)
+			*reader_states = s;
+	}
+
+	start = _sc_monotonic_usec();
+	for (;;) {
+		for (i = 0; i < s->count; i++) {
+			unsigned int ev = 0;
+			int present;
+
+			r = sc_detect_card_presence(s->readers[i]);
+			if (r < 0)
+				continue;
+			present = (r & SC_READER_CARD_PRESENT) != 0;
+			if (present != s->present[i])
+				ev = present ? SC_EVENT_CARD_INSERTED : SC_EVENT_CARD_REMOVED;
+			else if (present && (r & SC_READER_CARD_CHANGED))
+				/* replaced between two polls */
+				ev = SC_EVENT_CARD_REMOVED | SC_EVENT_CARD_INSERTED;
+			s->present[i] = present;
+			if (ev == 0)
+				continue;
+			s->interval = SC_POLL_INTERVAL_MIN;
+			if (ev & event_mask) {
+				if (event_reader)
+					*event_reader = s->readers[i];
+				if (event)
+					*event = ev & event_mask;
+				r = SC_SUCCESS;
+				goto out;
+			}
+		}
+
+		elapsed = (_sc_monotonic_usec() - start) / 1000;
+		if (timeout >= 0 && elapsed >= (unsigned long long) timeout) {
+			r = SC_ERROR_EVENT_TIMEOUT;
+			goto out;
+		}
+		if (timeout >= 0 && s->interval > timeout - elapsed)
+			sc_poll_sleep((unsigned int) (timeout - elapsed));
+		else
+			sc_poll_sleep(s->interval);
+		if (s->interval < SC_POLL_INTERVAL_MAX)
+			s->interval *= 2;
+	}
+out:
+	if (reader_states == NULL)
+		sc_poll_state_free(s);
+	return r;
+}
+
 struct _sc_driver_entry {
 	const char *name;
 	void *(*func)(void);
 };
 
+/* configure --enable-drivers defines DISABLE_DRIVER_* for the drivers left out */
 static const struct _sc_driver_entry internal_card_drivers[] = {
+#ifndef DISABLE_DRIVER_CARDOS
 	{ "cardos",	(void *(*)(void)) sc_get_cardos_driver },
+#endif
+#ifndef DISABLE_DRIVER_FLEX
 	{ "flex",	(void *(*)(void)) sc_get_cryptoflex_driver },
+#endif
+#ifndef DISABLE_DRIVER_CYBERFLEX
 	{ "cyberflex",	(void *(*)(void)) sc_get_cyberflex_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#ifndef DISABLE_DRIVER_GPK
 	{ "gpk",	(void *(*)(void)) sc_get_gpk_driver },
 #endif
+#endif
+#ifndef DISABLE_DRIVER_GEMSAFEV1
 	{ "gemsafeV1",	(void *(*)(void)) sc_get_gemsafeV1_driver },
+#endif
+#ifndef DISABLE_DRIVER_MIOCOS
 	{ "miocos",	(void *(*)(void)) sc_get_miocos_driver },
+#endif
+#ifndef DISABLE_DRIVER_MCRD
 	{ "mcrd",	(void *(*)(void)) sc_get_mcrd_driver },
+#endif
+#ifndef DISABLE_DRIVER_ASEPCOS
 	{ "asepcos",	(void *(*)(void)) sc_get_asepcos_driver },
+#endif
+#ifndef DISABLE_DRIVER_STARCOS
 	{ "starcos",	(void *(*)(void)) sc_get_starcos_driver },
+#endif
+#ifndef DISABLE_DRIVER_TCOS
 	{ "tcos",	(void *(*)(void)) sc_get_tcos_driver },
+#endif
+#ifndef DISABLE_DRIVER_OPENPGP
 	{ "openpgp",	(void *(*)(void)) sc_get_openpgp_driver },
+#endif
+#ifndef DISABLE_DRIVER_JCOP
 	{ "jcop",	(void *(*)(void)) sc_get_jcop_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#ifndef DISABLE_DRIVER_OBERTHUR
 	{ "oberthur",	(void *(*)(void)) sc_get_oberthur_driver },
+#endif
+#ifndef DISABLE_DRIVER_AUTHENTIC
 	{ "authentic",	(void *(*)(void)) sc_get_authentic_driver },
+#endif
 	{ "iasecc",	(void *(*)(void)) sc_get_iasecc_driver },
 #endif
+#ifndef DISABLE_DRIVER_BELPIC
 	{ "belpic",	(void *(*)(void)) sc_get_belpic_driver },
+#endif
+#ifndef DISABLE_DRIVER_IAS
 	{ "ias",		(void *(*)(void)) sc_get_ias_driver },
+#endif
+#ifndef DISABLE_DRIVER_INCRYPTO34
 	{ "incrypto34", (void *(*)(void)) sc_get_incrypto34_driver },
+#endif
+#ifndef DISABLE_DRIVER_ACOS5
 	{ "acos5",	(void *(*)(void)) sc_get_acos5_driver },
+#endif
+#ifndef DISABLE_DRIVER_AKIS
 	{ "akis",	(void *(*)(void)) sc_get_akis_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#ifndef DISABLE_DRIVER_ENTERSAFE
 	{ "entersafe",(void *(*)(void)) sc_get_entersafe_driver },
+#endif
 #ifdef ENABLE_SM
+#ifndef DISABLE_DRIVER_EPASS2003
 	{ "epass2003",(void *(*)(void)) sc_get_epass2003_driver },
 #endif
 #endif
+#endif
+#ifndef DISABLE_DRIVER_RUTOKEN
 	{ "rutoken",	(void *(*)(void)) sc_get_rutoken_driver },
+#endif
+#ifndef DISABLE_DRIVER_RUTOKEN_ECP
 	{ "rutoken_ecp",(void *(*)(void)) sc_get_rtecp_driver },
+#endif
+#ifndef DISABLE_DRIVER_WESTCOS
 	{ "westcos",	(void *(*)(void)) sc_get_westcos_driver },
+#endif
+#ifndef DISABLE_DRIVER_MYEID
 	{ "myeid",      (void *(*)(void)) sc_get_myeid_driver },
+#endif
+#ifndef DISABLE_DRIVER_SC_HSM
 	{ "sc-hsm",		(void *(*)(void)) sc_get_sc_hsm_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#ifndef DISABLE_DRIVER_DNIE
 	{ "dnie",       (void *(*)(void)) sc_get_dnie_driver },
 #endif
+#endif
 
 /* Here should be placed drivers that need some APDU transactions to
  * recognise its cards. */
+#ifndef DISABLE_DRIVER_SETCOS
 	{ "setcos",	(void *(*)(void)) sc_get_setcos_driver },
+#endif
 	{ "muscle",	(void *(*)(void)) sc_get_muscle_driver },
+#ifndef DISABLE_DRIVER_ATRUST_ACOS
 	{ "atrust-acos",(void *(*)(void)) sc_get_atrust_acos_driver },
+#endif
+#ifndef DISABLE_DRIVER_PIV
 	{ "PIV-II",	(void *(*)(void)) sc_get_piv_driver },
+#endif
+#ifndef DISABLE_DRIVER_ITACNS
 	{ "itacns",	(void *(*)(void)) sc_get_itacns_driver },
+#endif
 	/* The default driver should be last, as it handles all the
 	 * unrecognized cards. */
 	{ "default",	(void *(*)(void)) sc_get_default_driver },
@@ -118,6 +324,10 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	int apdu_trace_size;
+	int async_debug;
+	char *apdu_record_file;
+	char *startup_trace_file;
 };
 
 
@@ -201,6 +411,9 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	int r = SC_SUCCESS;
+
+	_sc_log_file_lock(ctx);
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -215,9 +428,10 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 	else {
 		ctx->debug_file = fopen(filename, "a");
 		if (ctx->debug_file == NULL)
-			return SC_ERROR_INTERNAL;
+			r = SC_ERROR_INTERNAL;
 	}
-	return SC_SUCCESS;
+	_sc_log_file_unlock(ctx);
+	return r;
 }
 
 
@@ -240,6 +454,9 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	if (debug > ctx->debug)
 		ctx->debug = debug;
 
+	for (list = scconf_find_list(block, "debug_modules"); list != NULL; list = list->next)
+		_sc_log_add_modules(ctx, list->data);
+
 	val = scconf_get_str(block, "debug_file", NULL);
 	if (val)   {
 #ifdef _WIN32
@@ -260,6 +477,39 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	ctx->enable_default_driver = scconf_get_bool (block, "enable_default_driver",
 			ctx->enable_default_driver);
 
+	ctx->read_ahead = scconf_get_bool (block, "read_ahead", ctx->read_ahead);
+	ctx->coalesce_writes = scconf_get_bool (block, "coalesce_writes", ctx->coalesce_writes);
+
+	opts->async_debug = scconf_get_int(block, "async_debug", opts->async_debug);
+
+	opts->apdu_trace_size = scconf_get_int(block, "apdu_trace", opts->apdu_trace_size);
+	val = scconf_get_str(block, "apdu_trace_file", NULL);
+	if (val) {
+		if (ctx->apdu_trace_file)
+			free(ctx->apdu_trace_file);
+		ctx->apdu_trace_file = strdup(val);
+	}
+	val = scconf_get_str(block, "apdu_record_file", NULL);
+	if (val) {
+		if (opts->apdu_record_file)
+			free(opts->apdu_record_file);
+		opts->apdu_record_file = strdup(val);
+	}
+	val = scconf_get_str(block, "startup_trace_file", NULL);
+	if (val) {
+		if (opts->startup_trace_file)
+			free(opts->startup_trace_file);
+		opts->startup_trace_file = strdup(val);
+	}
+
+	ctx->adaptive_apdu_size = scconf_get_bool (block, "adaptive_apdu_size",
+			ctx->adaptive_apdu_size);
+
+	ctx->cache_ef_dir = scconf_get_bool (block, "cache_ef_dir", ctx->cache_ef_dir);
+
+	ctx->shared_card_generations = scconf_get_bool (block, "shared_card_generations",
+			ctx->shared_card_generations);
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -286,14 +536,38 @@ static void load_reader_driver_options(sc_context_t *ctx)
 	struct sc_reader_driver *driver = ctx->reader_driver;
 	scconf_block *conf_block = NULL;
 
-	driver->max_send_size = 0;
-	driver->max_recv_size = 0;
-
 	conf_block = sc_get_conf_block(ctx, "reader_driver", driver->short_name, 1);
 
-	if (conf_block != NULL) {
-		driver->max_send_size = scconf_get_int(conf_block, "max_send_size", driver->max_send_size);
-		driver->max_recv_size = scconf_get_int(conf_block, "max_recv_size", driver->max_recv_size);
+	/* set once, cards may be connected meanwhile, see sc_ctx_reload_config() */
+	driver->max_send_size = scconf_get_int(conf_block, "max_send_size", 0);
+	driver->max_recv_size = scconf_get_int(conf_block, "max_recv_size", 0);
+}
+
+/* Configurations replaced by sc_ctx_reload_config(). Card drivers and
+ * readers may still point into their blocks, so they are only freed
+ * with the context. */
+struct sc_retired_conf {
+	scconf_context *conf;
+	struct sc_log_module *debug_modules;
+	struct sc_retired_conf *next;
+};
+
+/* Finds the "app <app_name>" and "app default" blocks of conf */
+static void find_app_blocks(sc_context_t *ctx, scconf_context *conf, scconf_block *conf_blocks[3])
+{
+	scconf_block **blocks;
+	int count = 0;
+
+	memset(conf_blocks, 0, 3 * sizeof(scconf_block *));
+	blocks = scconf_find_blocks(conf, NULL, "app", ctx->app_name);
+	if (blocks && blocks[0])
+		conf_blocks[count++] = blocks[0];
+	free(blocks);
+	if (strcmp(ctx->app_name, "default") != 0) {
+		blocks = scconf_find_blocks(conf, NULL, "app", "default");
+		if (blocks && blocks[0])
+			conf_blocks[count] = blocks[0];
+		free(blocks);
 	}
 }
 
@@ -401,10 +675,67 @@ static int load_card_driver_options(sc_context_t *ctx,
 	return SC_SUCCESS;
 }
 
+/*
+ * The card drivers are only listed when the context is created:
+ * sc_get_xxx_driver(), or the dlopen() of an external module, and the
+ * driver options are left to sc_ctx_load_card_driver() when the driver
+ * is about to be tried on a card. ctx->card_drivers points to these
+ * entries, the ATRs of card_atr blocks are attached to them.
+ */
+struct _sc_card_driver_entry {
+	struct sc_card_driver drv;	/* must be first */
+	void *(*func)(void);		/* NULL for external modules */
+	char *module;			/* name of an external module */
+	int state;			/* 0 listed, 1 loaded, -1 failed */
+};
+
+int sc_ctx_load_card_driver(sc_context_t *ctx, struct sc_card_driver *driver)
+{
+	struct _sc_card_driver_entry *ent = (struct _sc_card_driver_entry *) driver;
+	struct sc_card_driver *(*func)(void) = NULL;
+	struct sc_card_driver *(**tfunc)(void) = &func;
+	struct sc_card_driver *drv;
+	unsigned long long start;
+	void *dll = NULL;
+	int r = SC_SUCCESS;
+
+	if (ctx == NULL || driver == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ent->state != 0)
+		goto out;
+
+	start = sc_startup_trace_begin(ctx);
+	if (ent->func != NULL)
+		func = (struct sc_card_driver *(*)(void)) ent->func;
+	else
+		*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, ent->module);
+	if (func == NULL || (drv = func()) == NULL) {
+		sc_log(ctx, "Unable to load '%s'.", driver->short_name);
+		if (dll)
+			sc_dlclose(dll);
+		ent->state = -1;
+		goto out;
+	}
+	driver->name = drv->name;
+	driver->ops = drv->ops;
+	driver->dll = dll;
+	load_card_driver_options(ctx, driver);
+	ent->state = 1;
+	sc_startup_trace_end(ctx, start, "card", "load card driver %s", driver->short_name);
+
+out:
+	if (ent->state < 0)
+		r = SC_ERROR_OBJECT_NOT_FOUND;
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return r;
+}
+
 static int load_card_drivers(sc_context_t *ctx,
 			     struct _sc_ctx_options *opts)
 {
-	const struct _sc_driver_entry *ent;
+	struct _sc_card_driver_entry *drv;
 	int drv_count;
 	int i;
 
@@ -412,9 +743,7 @@ static int load_card_drivers(sc_context_t *ctx,
 		;
 
 	for (i = 0; i < opts->ccount; i++) {
-		struct sc_card_driver *(*func)(void) = NULL;
-		struct sc_card_driver *(**tfunc)(void) = &func;
-		void *dll = NULL;
+		const char *name = opts->cdrv[i].name;
 		int  j;
 
 		if (drv_count >= SC_MAX_CARD_DRIVERS - 1)   {
@@ -422,30 +751,28 @@ static int load_card_drivers(sc_context_t *ctx,
 			break;
 		}
 
-		ent = &opts->cdrv[i];
+		drv = calloc(1, sizeof(struct _sc_card_driver_entry));
+		if (drv == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
 		for (j = 0; internal_card_drivers[j].name != NULL; j++)
-			if (strcmp(ent->name, internal_card_drivers[j].name) == 0) {
-				func = (struct sc_card_driver *(*)(void)) internal_card_drivers[j].func;
+			if (strcmp(name, internal_card_drivers[j].name) == 0) {
+				drv->func = internal_card_drivers[j].func;
+				drv->drv.short_name = internal_card_drivers[j].name;
 				break;
 			}
-		/* if not initialized assume external module */
-		if (func == NULL)
-			*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, ent->name);
-		/* if still null, assume driver not found */
-		if (func == NULL) {
-			sc_log(ctx, "Unable to load '%s'.", ent->name);
-			if (dll)
-				sc_dlclose(dll);
-			continue;
+		/* if not an internal driver assume external module */
+		if (drv->func == NULL) {
+			drv->module = strdup(name);
+			if (drv->module == NULL) {
+				free(drv);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			drv->drv.short_name = drv->module;
 		}
+		/* until it is loaded */
+		drv->drv.name = drv->drv.short_name;
 
-		ctx->card_drivers[drv_count] = func();
-		ctx->card_drivers[drv_count]->dll = dll;
-
-		ctx->card_drivers[drv_count]->atr_map = NULL;
-		ctx->card_drivers[drv_count]->natrs = 0;
-
-		load_card_driver_options(ctx, ctx->card_drivers[drv_count]);
+		ctx->card_drivers[drv_count] = &drv->drv;
 
 		/* Ensure that the list is always terminated by NULL */
 		ctx->card_drivers[drv_count + 1] = NULL;
@@ -531,10 +858,10 @@ static int load_card_atrs(sc_context_t *ctx)
 
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
-	int i, r, count = 0;
-	scconf_block **blocks;
+	int i, r;
 	const char *conf_path = NULL;
 	const char *debug = NULL;
+	const char *snapshot = NULL;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	DWORD temp_len;
@@ -546,6 +873,10 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	debug = getenv("OPENSC_DEBUG");
 	if (debug)
 		ctx->debug = atoi(debug);
+	/* set before the configuration file, so it takes precedence */
+	debug = getenv("OPENSC_DEBUG_MODULES");
+	if (debug)
+		_sc_log_add_modules(ctx, debug);
 
 	memset(ctx->conf_blocks, 0, sizeof(ctx->conf_blocks));
 #ifdef _WIN32
@@ -585,7 +916,17 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->conf = scconf_new(conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
+	/* Opt-in: reuse the parse of an earlier process while the
+	 * configuration file is unchanged */
+	snapshot = getenv("OPENSC_CONF_SNAPSHOT");
+	if (snapshot && *snapshot && scconf_read_snapshot(ctx->conf, snapshot) == 1) {
+		sc_log(ctx, "configuration loaded from snapshot %s", snapshot);
+		r = 1;
+	} else {
+		r = scconf_parse(ctx->conf);
+		if (r == 1 && snapshot && *snapshot && scconf_write_snapshot(ctx->conf, snapshot) != 0)
+			sc_log(ctx, "cannot write configuration snapshot %s", snapshot);
+	}
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
 	if (r < 0)
@@ -603,37 +944,180 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 		ctx->conf = NULL;
 		return;
 	}
-	blocks = scconf_find_blocks(ctx->conf, NULL, "app", ctx->app_name);
-	if (blocks[0])
-		ctx->conf_blocks[count++] = blocks[0];
-	free(blocks);
-	if (strcmp(ctx->app_name, "default") != 0) {
-		blocks = scconf_find_blocks(ctx->conf, NULL, "app", "default");
-		if (blocks[0])
-			ctx->conf_blocks[count] = blocks[0];
-		free(blocks);
-	}
-	/* Above we add 2 blocks at most, but conf_blocks has 3 elements,
+	/* At most 2 blocks are found, but conf_blocks has 3 elements,
 	 * so at least one is NULL */
+	find_app_blocks(ctx, ctx->conf, ctx->conf_blocks);
 	for (i = 0; ctx->conf_blocks[i]; i++)
 		load_parameters(ctx, ctx->conf_blocks[i], opts);
 }
 
+/*
+ * The options that can change while cards are connected. Options absent
+ * from the new configuration go back to their defaults. The replaced
+ * module level table goes to retired.
+ */
+static void reload_parameters(sc_context_t *ctx, struct sc_retired_conf *retired)
+{
+	const scconf_list *list;
+	const char *val, **specs;
+	size_t nspecs = 0;
+	int i, level, debug = 0;
+
+	val = getenv("OPENSC_DEBUG");
+	if (val)
+		debug = atoi(val);
+	ctx->paranoid_memory = 0;
+	ctx->enable_default_driver = 0;
+	ctx->read_ahead = 0;
+	ctx->coalesce_writes = 0;
+	ctx->adaptive_apdu_size = 0;
+	ctx->cache_ef_dir = 0;
+	ctx->shared_card_generations = 0;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		scconf_block *block = ctx->conf_blocks[i];
+
+		level = scconf_get_int(block, "debug", debug);
+		if (level > debug)
+			debug = level;
+		val = scconf_get_str(block, "debug_file", NULL);
+		if (val && (ctx->debug_filename == NULL || strcmp(val, ctx->debug_filename) != 0)) {
+			/* other threads write to ctx->debug_file without a lock,
+			 * unless the background writer does it for them */
+			if (_sc_log_owns_file(ctx)) {
+				if (ctx->debug_filename)
+					free(ctx->debug_filename);
+				ctx->debug_filename = NULL;
+				if (scconf_get_bool(block, "reopen_debug_file", 1))
+					ctx->debug_filename = strdup(val);
+				sc_ctx_log_to_file(ctx, val);
+			} else {
+				sc_log(ctx, "debug_file %s is used after a restart, or with async_debug", val);
+			}
+		}
+		for (list = scconf_find_list(block, "debug_modules"); list != NULL; list = list->next)
+			nspecs++;
+		ctx->paranoid_memory = scconf_get_bool(block, "paranoid-memory", ctx->paranoid_memory);
+		ctx->enable_default_driver = scconf_get_bool(block, "enable_default_driver",
+				ctx->enable_default_driver);
+		ctx->read_ahead = scconf_get_bool(block, "read_ahead", ctx->read_ahead);
+		ctx->coalesce_writes = scconf_get_bool(block, "coalesce_writes", ctx->coalesce_writes);
+		ctx->adaptive_apdu_size = scconf_get_bool(block, "adaptive_apdu_size", ctx->adaptive_apdu_size);
+		ctx->cache_ef_dir = scconf_get_bool(block, "cache_ef_dir", ctx->cache_ef_dir);
+		ctx->shared_card_generations = scconf_get_bool(block, "shared_card_generations",
+				ctx->shared_card_generations);
+	}
+	ctx->debug = debug;
+
+	specs = calloc(nspecs ? nspecs : 1, sizeof(char *));
+	if (specs == NULL)
+		return;
+	for (nspecs = 0, i = 0; ctx->conf_blocks[i]; i++)
+		for (list = scconf_find_list(ctx->conf_blocks[i], "debug_modules"); list != NULL; list = list->next)
+			specs[nspecs++] = list->data;
+	if (_sc_log_replace_modules(ctx, specs, nspecs, &retired->debug_modules) != SC_SUCCESS)
+		sc_log(ctx, "debug_modules not reloaded");
+	free(specs);
+}
+
+int sc_ctx_reload_config(sc_context_t *ctx)
+{
+	scconf_context *conf;
+	scconf_block *conf_blocks[3];
+	struct sc_retired_conf *retired;
+	int r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(ctx);
+	if (ctx->conf == NULL || ctx->conf->filename == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "No configuration file to reload");
+
+	conf = scconf_new(ctx->conf->filename);
+	retired = calloc(1, sizeof(struct sc_retired_conf));
+	if (conf == NULL || retired == NULL) {
+		scconf_free(conf);
+		free(retired);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+	r = scconf_parse(conf);
+	if (r < 1) {
+		sc_log(ctx, "scconf_parse failed: %s", conf->errmsg);
+		scconf_free(conf);
+		free(retired);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_DATA);
+	}
+	find_app_blocks(ctx, conf, conf_blocks);
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	retired->conf = ctx->conf;
+	retired->next = ctx->retired_confs;
+	ctx->retired_confs = retired;
+	ctx->conf = conf;
+	memcpy(ctx->conf_blocks, conf_blocks, sizeof(ctx->conf_blocks));
+	reload_parameters(ctx, retired);
+	load_reader_driver_options(ctx);
+	/* the PKCS#15 options are resolved again by the next bind */
+	free(ctx->pkcs15_conf);
+	ctx->pkcs15_conf = NULL;
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	sc_log(ctx, "configuration %s reloaded, debug level %d", conf->filename, ctx->debug);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 int sc_ctx_detect_readers(sc_context_t *ctx)
 {
 	int r = 0;
 	const struct sc_reader_driver *drv = ctx->reader_driver;
+	unsigned long long start = sc_startup_trace_begin(ctx);
 
 	sc_mutex_lock(ctx, ctx->mutex);
 
 	if (drv->ops->detect_readers != NULL)
 		r = drv->ops->detect_readers(ctx);
+	sc_startup_trace_end(ctx, start, "reader", "%s detect_readers", drv->short_name);
 
 	sc_mutex_unlock(ctx, ctx->mutex);
 
 	return r;
 }
 
+int sc_ctx_reinit_after_fork(sc_context_t *ctx)
+{
+	const struct sc_reader_driver *drv;
+	int r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	drv = ctx->reader_driver;
+	if (drv == NULL || drv->ops->forked == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+#ifndef _WIN32
+	/* the other users of a shared context did it already */
+	if (ctx->pid == (unsigned long) getpid()) {
+		sc_mutex_unlock(ctx, ctx->mutex);
+		return SC_SUCCESS;
+	}
+#endif
+	r = drv->ops->forked(ctx);
+	if (r == SC_SUCCESS) {
+		unsigned int i;
+
+		/* the cards connected in the parent are stale now */
+		for (i = 0; i < sc_ctx_get_reader_count(ctx); i++)
+			sc_ctx_get_reader(ctx, i)->card_generation++;
+#ifndef _WIN32
+		ctx->pid = (unsigned long) getpid();
+#endif
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	sc_log(ctx, "%s reader driver after fork(): %s", drv->short_name, sc_strerror(r));
+	return r;
+}
+
 sc_reader_t *sc_ctx_get_reader(sc_context_t *ctx, unsigned int i)
 {
 	return list_get_at(&ctx->readers, i);
@@ -654,6 +1138,28 @@ unsigned int sc_ctx_get_reader_count(sc_context_t *ctx)
 	return list_size(&ctx->readers);
 }
 
+int sc_ctx_get_reader_stats(sc_context_t *ctx, unsigned int i,
+		struct sc_reader_stats *stats, int reset)
+{
+	sc_reader_t *reader;
+
+	if (ctx == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	reader = list_get_at(&ctx->readers, i);
+	if (reader != NULL) {
+		/* the counters are updated without the context lock, a copy
+		 * may mix two exchanges but every field is consistent */
+		memcpy(stats, reader->stats, sizeof(*stats));
+		if (reset)
+			memset(reader->stats, 0, sizeof(*reader->stats));
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	return reader != NULL ? SC_SUCCESS : SC_ERROR_OBJECT_NOT_FOUND;
+}
+
 int sc_establish_context(sc_context_t **ctx_out, const char *app_name)
 {
 	sc_context_param_t ctx_param;
@@ -676,20 +1182,173 @@ int sc_context_repair(sc_context_t **ctx_out)
 	 * card drivers - so rebuild the ATR's
 	 */
 	load_card_atrs(*ctx_out);
+	_sc_build_atr_index(*ctx_out);
 
 	/* TODO: May need to re-open any card driver DLL's */
 
 	return SC_SUCCESS;
 }
 
+/*
+ * Contexts created with SC_CTX_FLAG_SHARED, looked up by application
+ * name. Callers in one process, for example several copies of the
+ * PKCS#11 module, share the readers and card connections of one context.
+ */
+static sc_context_t *shared_contexts = NULL;
+
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+static pthread_mutex_t shared_contexts_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define shared_contexts_lock()		pthread_mutex_lock(&shared_contexts_mutex)
+#define shared_contexts_unlock()	pthread_mutex_unlock(&shared_contexts_mutex)
+
+/* The callers of a shared context come and go, the mutex functions of the
+ * first one may be unloaded while the context lives on. */
+static int shared_mutex_create(void **mutex)
+{
+	pthread_mutex_t *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_mutex_init(m, NULL);
+	*mutex = m;
+	return SC_SUCCESS;
+}
+
+static int shared_mutex_lock(void *mutex)
+{
+	return pthread_mutex_lock((pthread_mutex_t *) mutex) == 0 ? SC_SUCCESS : SC_ERROR_INTERNAL;
+}
+
+static int shared_mutex_unlock(void *mutex)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *) mutex) == 0 ? SC_SUCCESS : SC_ERROR_INTERNAL;
+}
+
+static int shared_mutex_destroy(void *mutex)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) mutex);
+	free(mutex);
+	return SC_SUCCESS;
+}
+
+static sc_thread_context_t shared_thread_ctx = {
+	0, shared_mutex_create, shared_mutex_lock,
+	shared_mutex_unlock, shared_mutex_destroy, NULL
+};
+#elif defined(_WIN32)
+static volatile LONG shared_contexts_mutex = 0;
+#define shared_contexts_lock()		while (InterlockedExchange(&shared_contexts_mutex, 1)) Sleep(0)
+#define shared_contexts_unlock()	InterlockedExchange(&shared_contexts_mutex, 0)
+
+/* As above, the mutex functions must outlive the DLL of the first caller */
+static int shared_mutex_create(void **mutex)
+{
+	CRITICAL_SECTION *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	InitializeCriticalSection(m);
+	*mutex = m;
+	return SC_SUCCESS;
+}
+
+static int shared_mutex_lock(void *mutex)
+{
+	EnterCriticalSection((CRITICAL_SECTION *) mutex);
+	return SC_SUCCESS;
+}
+
+static int shared_mutex_unlock(void *mutex)
+{
+	LeaveCriticalSection((CRITICAL_SECTION *) mutex);
+	return SC_SUCCESS;
+}
+
+static int shared_mutex_destroy(void *mutex)
+{
+	DeleteCriticalSection((CRITICAL_SECTION *) mutex);
+	free(mutex);
+	return SC_SUCCESS;
+}
+
+static sc_thread_context_t shared_thread_ctx = {
+	0, shared_mutex_create, shared_mutex_lock,
+	shared_mutex_unlock, shared_mutex_destroy, NULL
+};
+#else
+#define shared_contexts_lock()
+#define shared_contexts_unlock()
+#endif
+
+static int context_create(sc_context_t **ctx_out, const sc_context_param_t *parm);
+
 int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
+{
+	const char *app_name;
+	sc_context_t *ctx;
+	int r;
+
+	if (ctx_out == NULL || parm == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (!(parm->flags & SC_CTX_FLAG_SHARED))
+		return context_create(ctx_out, parm);
+
+	app_name = parm->app_name != NULL ? parm->app_name : "default";
+	shared_contexts_lock();
+	for (ctx = shared_contexts; ctx != NULL; ctx = ctx->next_shared)
+		if (strcmp(ctx->app_name, app_name) == 0)
+			break;
+	if (ctx != NULL) {
+		ctx->shared_refs++;
+		sc_log(ctx, "sharing the context of '%s', %u users", app_name, ctx->shared_refs);
+		*ctx_out = ctx;
+		shared_contexts_unlock();
+		return SC_SUCCESS;
+	}
+
+	r = context_create(&ctx, parm);
+	if (r == SC_SUCCESS) {
+		ctx->shared_refs = 1;
+		ctx->next_shared = shared_contexts;
+		shared_contexts = ctx;
+		*ctx_out = ctx;
+	}
+	shared_contexts_unlock();
+	return r;
+}
+
+/* Drops one reference of a shared context, returns 1 if others remain */
+static int context_unshare(sc_context_t *ctx)
+{
+	sc_context_t **prev;
+	int in_use;
+
+	shared_contexts_lock();
+	in_use = --ctx->shared_refs > 0;
+	if (!in_use) {
+		for (prev = &shared_contexts; *prev != NULL; prev = &(*prev)->next_shared)
+			if (*prev == ctx) {
+				*prev = ctx->next_shared;
+				break;
+			}
+	}
+	shared_contexts_unlock();
+	if (in_use)
+		sc_log(ctx, "context still used by %u callers", ctx->shared_refs);
+	return in_use;
+}
+
+static int context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
 	sc_context_t		*ctx;
 	struct _sc_ctx_options	opts;
+	unsigned long long	start, step;
 	int			r;
 
-	if (ctx_out == NULL || parm == NULL)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	/* the startup trace is only known to be enabled after reading the
+	 * configuration, which is timed too */
+	start = _sc_monotonic_usec();
 
 	ctx = calloc(1, sizeof(sc_context_t));
 	if (ctx == NULL)
@@ -707,18 +1366,38 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 
 	set_defaults(ctx, &opts);
+#ifndef _WIN32
+	ctx->pid = (unsigned long) getpid();
+#endif
 	list_init(&ctx->readers);
 	list_attributes_seeker(&ctx->readers, reader_list_seeker);
 	/* set thread context and create mutex object (if specified) */
 	if (parm->thread_ctx != NULL)
 		ctx->thread_ctx = parm->thread_ctx;
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+	if (parm->flags & SC_CTX_FLAG_SHARED)
+		ctx->thread_ctx = &shared_thread_ctx;
+#endif
 	r = sc_mutex_create(ctx, &ctx->mutex);
 	if (r != SC_SUCCESS) {
 		sc_release_context(ctx);
 		return r;
 	}
 
+	step = _sc_monotonic_usec();
 	process_config_file(ctx, &opts);
+	if (getenv("OPENSC_STARTUP_TRACE") != NULL) {
+		free(opts.startup_trace_file);
+		opts.startup_trace_file = strdup(getenv("OPENSC_STARTUP_TRACE"));
+	}
+	if (opts.startup_trace_file) {
+		if (_sc_startup_trace_init(ctx, opts.startup_trace_file) != SC_SUCCESS)
+			sc_log(ctx, "cannot allocate the startup trace");
+		free(opts.startup_trace_file);
+	}
+	sc_startup_trace_end(ctx, step, "context", "process_config_file");
+	if (opts.async_debug > 0 && _sc_log_async_start(ctx, opts.async_debug) != SC_SUCCESS)
+		opts.async_debug = 0;
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -734,16 +1413,58 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* a configured APDU transcript takes the place of the real readers */
+	if (getenv("OPENSC_REPLAY_FILE") != NULL
+			|| sc_get_conf_block(ctx, "reader_driver", "replay", 1) != NULL)
+		ctx->reader_driver = sc_get_replay_driver();
+#ifndef _WIN32
+	/* readers of a card farm server */
+	else if (getenv("OPENSC_NET_READER") != NULL
+			|| sc_get_conf_block(ctx, "reader_driver", "net", 1) != NULL)
+		ctx->reader_driver = sc_get_net_driver();
+#endif
 
+	step = sc_startup_trace_begin(ctx);
 	load_reader_driver_options(ctx);
+	sc_startup_trace_end(ctx, step, "context", "load_reader_driver_options");
+	step = sc_startup_trace_begin(ctx);
 	r = ctx->reader_driver->ops->init(ctx);
+	sc_startup_trace_end(ctx, step, "reader", "%s init", ctx->reader_driver->short_name);
 	if (r != SC_SUCCESS)   {
 		sc_release_context(ctx);
 		return r;
 	}
 
+	step = sc_startup_trace_begin(ctx);
 	load_card_drivers(ctx, &opts);
+	sc_startup_trace_end(ctx, step, "context", "load_card_drivers");
+	step = sc_startup_trace_begin(ctx);
 	load_card_atrs(ctx);
+	sc_startup_trace_end(ctx, step, "context", "load_card_atrs");
+	step = sc_startup_trace_begin(ctx);
+	_sc_build_atr_index(ctx);
+	sc_startup_trace_end(ctx, step, "context", "build ATR index");
+	if (opts.apdu_trace_size > 0 && _sc_apdu_trace_init(ctx, opts.apdu_trace_size) != SC_SUCCESS)
+		sc_log(ctx, "cannot allocate APDU trace of %d records", opts.apdu_trace_size);
+	/* for the timed regression tests; the transcript is redacted and
+	 * private as with the option, but it is announced on stderr since
+	 * any process loading the library may have inherited the variable */
+	if (getenv("OPENSC_APDU_RECORD_FILE") != NULL
+#ifndef _WIN32
+			&& getuid() == geteuid() && getgid() == getegid()
+#endif
+			) {
+		free(opts.apdu_record_file);
+		opts.apdu_record_file = strdup(getenv("OPENSC_APDU_RECORD_FILE"));
+		sc_log(ctx, "OPENSC_APDU_RECORD_FILE: recording APDUs to %s", opts.apdu_record_file);
+		fprintf(stderr, "OpenSC: recording APDUs to %s (OPENSC_APDU_RECORD_FILE)\n",
+				opts.apdu_record_file);
+	}
+	if (opts.apdu_record_file) {
+		if (_sc_apdu_record_open(ctx, opts.apdu_record_file) != SC_SUCCESS)
+			sc_log(ctx, "cannot open APDU record file %s", opts.apdu_record_file);
+		free(opts.apdu_record_file);
+	}
 	if (opts.forced_card_driver) {
 		/* FIXME: check return value? */
 		sc_set_card_driver(ctx, opts.forced_card_driver);
@@ -751,6 +1472,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 	del_drvs(&opts);
 	sc_ctx_detect_readers(ctx);
+	sc_startup_trace_end(ctx, start, "context", "sc_context_create %s", ctx->app_name);
 	*ctx_out = ctx;
 
 	return SC_SUCCESS;
@@ -777,6 +1499,16 @@ int sc_cancel(sc_context_t *ctx)
 }
 
 
+int sc_refresh_readers(sc_context_t *ctx)
+{
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	if (ctx->reader_driver->ops->refresh_readers != NULL)
+		return ctx->reader_driver->ops->refresh_readers(ctx);
+
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+
 int sc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event, int timeout, void **reader_states)
 {
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
@@ -793,6 +1525,8 @@ int sc_release_context(sc_context_t *ctx)
 
 	assert(ctx != NULL);
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	if (ctx->shared_refs > 0 && context_unshare(ctx))
+		return SC_SUCCESS;
 	while (list_size(&ctx->readers)) {
 		sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
 		_sc_delete_reader(ctx, rdr);
@@ -801,13 +1535,25 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
-	for (i = 0; ctx->card_drivers[i]; i++) {
-		struct sc_card_driver *drv = ctx->card_drivers[i];
+	_sc_free_atr_index(ctx);
+	_sc_free_emu_cache(ctx);
+	_sc_free_pkcs15_conf(ctx);
+	_sc_free_shared_generations(ctx);
+	_sc_startup_trace_free(ctx);
+	_sc_apdu_trace_free(ctx);
+	_sc_apdu_record_close(ctx);
+	if (ctx->apdu_trace_file != NULL)
+		free(ctx->apdu_trace_file);
 
-		if (drv->atr_map)
-			_sc_free_atr(ctx, drv);
-		if (drv->dll)
-			sc_dlclose(drv->dll);
+	for (i = 0; ctx->card_drivers[i]; i++) {
+		struct _sc_card_driver_entry *drv = (struct _sc_card_driver_entry *) ctx->card_drivers[i];
+
+		if (drv->drv.atr_map)
+			_sc_free_atr(ctx, &drv->drv);
+		if (drv->drv.dll)
+			sc_dlclose(drv->drv.dll);
+		free(drv->module);
+		free(drv);
 	}
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
@@ -820,10 +1566,20 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	while (ctx->retired_confs != NULL) {
+		struct sc_retired_conf *retired = ctx->retired_confs;
+
+		ctx->retired_confs = retired->next;
+		scconf_free(retired->conf);
+		free(retired->debug_modules);
+		free(retired);
+	}
+	_sc_log_async_stop(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
 		free(ctx->debug_filename);
+	_sc_log_free_modules(ctx);
 	if (ctx->app_name != NULL)
 		free(ctx->app_name);
 	list_destroy(&ctx->readers);
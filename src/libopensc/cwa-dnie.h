@@ -41,6 +41,9 @@
      int rsa_key_ref;    /**< Key id reference being used in sec operation */
      u8 *cache;      /**< Cache buffer for read_binary() operation */
      size_t cachelen;    /**< length of cache buffer */
+     int cert_cache;     /**< keep public files in the cache directory */
+     sc_path_t cache_path; /**< path of the selected EF, empty if unknown */
+     size_t cache_fsize; /**< size of the selected EF as told by its FCI */
      cwa_provider_t *cwa_provider;
 #ifdef ENABLE_DNIE_UI
 	 struct ui_context ui_ctx;
@@ -29,14 +29,17 @@
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "opensc.h"
 #include "cardctl.h"
 #include "internal.h"
 #include <openssl/x509.h>
+#include <openssl/evp.h>
 #include <openssl/des.h>
 #include <openssl/rand.h>
 #include "cwa-dnie.h"
@@ -166,6 +169,87 @@ static void cwa_iso7816_padding(u8 * buf, size_t * buflen)
 		buf[*buflen] = 0x00;
 }
 
+/**
+ * Running state of a CWA-14890 cryptographic checksum.
+ *
+ * The checksum is a retail MAC keyed with kmac over the SSC followed by
+ * the padded message; blocks are absorbed as they arrive so no padded
+ * copy of header, data and trailer has to be built.
+ */
+typedef struct cwa_mac_st {
+	cwa_sm_session_t *session;
+	u8 chain[8];		/* chaining value */
+	u8 block[8];		/* pending, not yet complete block */
+	size_t len;		/* bytes in pending block */
+} cwa_mac_t;
+
+/**
+ * Start a checksum computation with the current SSC.
+ *
+ * @param mac checksum state
+ * @param sm current session data, with already increased SSC
+ */
+static void cwa_mac_init(cwa_mac_t * mac, cwa_sm_session_t * sm)
+{
+	mac->session = sm;
+	memcpy(mac->chain, sm->ssc, 8);
+	mac->len = 0;
+}
+
+/**
+ * Absorb data into a checksum computation.
+ *
+ * @param mac checksum state
+ * @param data data to absorb
+ * @param len data length
+ */
+static void cwa_mac_update(cwa_mac_t * mac, const u8 * data, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = MIN(len, 8 - mac->len);
+		memcpy(mac->block + mac->len, data, n);
+		mac->len += n;
+		data += n;
+		len -= n;
+		if (mac->len == 8) {
+			DES_ecb_encrypt((const_DES_cblock *) mac->chain,
+					(DES_cblock *) mac->chain,
+					&mac->session->kmac_ks[0], DES_ENCRYPT);
+			for (n = 0; n < 8; n++)
+				mac->chain[n] ^= mac->block[n];
+			mac->len = 0;
+		}
+	}
+}
+
+/**
+ * Absorb ISO 7816 padding up to the next block boundary.
+ *
+ * @param mac checksum state
+ */
+static void cwa_mac_pad(cwa_mac_t * mac)
+{
+	static const u8 pad[8] = { 0x80, 0, 0, 0, 0, 0, 0, 0 };
+
+	cwa_mac_update(mac, pad, 8 - mac->len);
+}
+
+/**
+ * Pad the absorbed data and compute the checksum.
+ *
+ * @param mac checksum state
+ * @param out where to store the 8 byte checksum
+ */
+static void cwa_mac_final(cwa_mac_t * mac, u8 * out)
+{
+	cwa_mac_pad(mac);
+	DES_ecb2_encrypt((const_DES_cblock *) mac->chain, (DES_cblock *) out,
+			 &mac->session->kmac_ks[0], &mac->session->kmac_ks[1],
+			 DES_ENCRYPT);
+}
+
 /**
  * compose a BER-TLV data in provided buffer.
  *
@@ -329,6 +413,156 @@ static int cwa_parse_tlv(sc_card_t * card,
 
 /*********************** authentication routines *******************/
 
+/** Number of verified chains kept in the cache file */
+#define CWA_CHAIN_CACHE_MAX 64
+
+/**
+ * Compute the digest that identifies a verified icc certificate chain.
+ *
+ * The digest covers the root CA public key and both certificates, so
+ * that a chain verified against one root is not taken for another.
+ *
+ * @param root_ca_key root CA public key
+ * @param sub_ca_cert icc intermediate CA certificate
+ * @param icc_cert icc certificate
+ * @param digest where to store the 32 bytes SHA-256 digest
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int cwa_chain_digest(EVP_PKEY * root_ca_key, X509 * sub_ca_cert,
+			    X509 * icc_cert, u8 * digest)
+{
+	EVP_MD_CTX *md_ctx = NULL;
+	unsigned char *der[3] = { NULL, NULL, NULL };
+	int len[3];
+	unsigned int mdlen;
+	int res = SC_ERROR_INTERNAL;
+	int i;
+
+	len[0] = i2d_PUBKEY(root_ca_key, &der[0]);
+	len[1] = i2d_X509(sub_ca_cert, &der[1]);
+	len[2] = i2d_X509(icc_cert, &der[2]);
+	md_ctx = EVP_MD_CTX_create();
+	if (!md_ctx || !EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL))
+		goto chain_digest_end;
+	for (i = 0; i < 3; i++)
+		if (len[i] <= 0
+		    || !EVP_DigestUpdate(md_ctx, der[i], len[i]))
+			goto chain_digest_end;
+	if (EVP_DigestFinal_ex(md_ctx, digest, &mdlen) && mdlen == 32)
+		res = SC_SUCCESS;
+
+ chain_digest_end:
+	if (md_ctx)
+		EVP_MD_CTX_destroy(md_ctx);
+	for (i = 0; i < 3; i++)
+		if (der[i])
+			OPENSSL_free(der[i]);
+	return res;
+}
+
+/**
+ * Compose the name of the file keeping verified chains.
+ *
+ * @param card pointer to card info structure
+ * @param name where to store the file name
+ * @param namelen size of name buffer
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int cwa_chain_cache_name(sc_card_t * card, char *name, size_t namelen)
+{
+	char dir[PATH_MAX];
+	int res;
+
+	res = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (res != SC_SUCCESS)
+		return res;
+	res = snprintf(name, namelen, "%s/cwa14890_chains", dir);
+	if (res < 0 || (size_t)res >= namelen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/**
+ * Tell whether an icc certificate chain has already been verified.
+ *
+ * The chain verified last is kept in the provider; with cache_chains
+ * the cache file lists the chains verified by former processes, one
+ * hex encoded digest per line.
+ *
+ * @param card pointer to card info structure
+ * @param provider cwa provider data
+ * @param digest digest of the chain, see cwa_chain_digest()
+ * @param lines where to store the number of lines of the cache file
+ * @return 1 if the chain is known to be valid; else 0
+ */
+static int cwa_chain_known(sc_card_t * card, cwa_provider_t * provider,
+			   const u8 * digest, int *lines)
+{
+	char name[PATH_MAX], hex[2 * 32 + 1], line[2 * 32 + 8];
+	int found = 0;
+	FILE *f;
+
+	*lines = 0;
+	if (provider->status.chain_verified
+	    && !memcmp(provider->status.chain_digest, digest, 32))
+		return 1;
+	if (!provider->cache_chains
+	    || cwa_chain_cache_name(card, name, sizeof(name)) != SC_SUCCESS)
+		return 0;
+	f = fopen(name, "r");
+	if (f == NULL)
+		return 0;
+	sc_bin_to_hex(digest, 32, hex, sizeof(hex), 0);
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		(*lines)++;
+		line[strcspn(line, "\r\n")] = '\0';
+		found = !strcmp(line, hex);
+	}
+	fclose(f);
+	if (found) {
+		memcpy(provider->status.chain_digest, digest, 32);
+		provider->status.chain_verified = 1;
+	}
+	return found;
+}
+
+/**
+ * Remember a verified icc certificate chain.
+ *
+ * @param card pointer to card info structure
+ * @param provider cwa provider data
+ * @param digest digest of the chain, see cwa_chain_digest()
+ * @param lines number of lines of the cache file, as told by cwa_chain_known()
+ */
+static void cwa_chain_remember(sc_card_t * card, cwa_provider_t * provider,
+			       const u8 * digest, int lines)
+{
+	char name[PATH_MAX], hex[2 * 32 + 1];
+	const char *mode;
+	FILE *f;
+
+	memcpy(provider->status.chain_digest, digest, 32);
+	provider->status.chain_verified = 1;
+	if (!provider->cache_chains
+	    || cwa_chain_cache_name(card, name, sizeof(name)) != SC_SUCCESS)
+		return;
+
+	/* start over once the file is full */
+	mode = lines >= CWA_CHAIN_CACHE_MAX ? "w" : "a";
+	f = fopen(name, mode);
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(name, mode);
+	}
+	if (f == NULL)
+		return;
+	sc_bin_to_hex(digest, 32, hex, sizeof(hex), 0);
+	if (fprintf(f, "%s\n", hex) < 0)
+		sc_log(card->ctx, "cannot store verified chain into '%s'", name);
+	fclose(f);
+}
+
 /**
  * Verify certificates provided by card.
  *
@@ -351,6 +585,8 @@ static int cwa_verify_icc_certificates(sc_card_t * card,
 	EVP_PKEY *root_ca_key = NULL;
 	EVP_PKEY *sub_ca_key = NULL;
 	sc_context_t *ctx = NULL;
+	u8 digest[32];
+	int have_digest, lines = 0;
 
 	/* safety check */
 	if (!card || !card->ctx || !provider)
@@ -368,6 +604,15 @@ static int cwa_verify_icc_certificates(sc_card_t * card,
 		goto verify_icc_certificates_end;
 	}
 
+	/* the same chain is presented on every channel establishment */
+	have_digest = cwa_chain_digest(root_ca_key, sub_ca_cert, icc_cert,
+				       digest) == SC_SUCCESS;
+	if (have_digest && cwa_chain_known(card, provider, digest, &lines)) {
+		sc_log(ctx, "icc certificate chain already verified");
+		res = SC_SUCCESS;
+		goto verify_icc_certificates_end;
+	}
+
 	/* verify sub_ca_cert against root_ca_key */
 	res = X509_verify(sub_ca_cert, root_ca_key);
 	if (!res) {
@@ -388,6 +633,8 @@ static int cwa_verify_icc_certificates(sc_card_t * card,
 	}
 
 	/* arriving here means certificate verification success */
+	if (have_digest)
+		cwa_chain_remember(card, provider, digest, lines);
 	res = SC_SUCCESS;
  verify_icc_certificates_end:
 	if (root_ca_key)
@@ -794,6 +1041,16 @@ static int cwa_compute_session_keys(sc_card_t * card, cwa_sm_status_t * sm)
 	SHA1(data, 32 + 4, sha_data);
 	memcpy(sm->session.kmac, sha_data, 16);	/* kmac=16 fsb sha((kifd^kicc)||00000002) */
 
+	/* key schedules are used for every apdu: compute them once */
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kenc[0]),
+			      &sm->session.kenc_ks[0]);
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kenc[8]),
+			      &sm->session.kenc_ks[1]);
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kmac[0]),
+			      &sm->session.kmac_ks[0]);
+	DES_set_key_unchecked((const_DES_cblock *) & (sm->session.kmac[8]),
+			      &sm->session.kmac_ks[1]);
+
 	/* evaluate send sequence counter  (cwa-14890-1 sect 8.9 & 9.6 */
 	memcpy(sm->session.ssc, sm->rndicc + 4, 4);	/* 4 least significant bytes of rndicc */
 	memcpy(sm->session.ssc + 4, sm->rndifd + 4, 4);	/* 4 least significant bytes of rndifd */
@@ -1419,15 +1676,12 @@ int cwa_encode_apdu(sc_card_t * card,
 		    cwa_provider_t * provider, sc_apdu_t * from, sc_apdu_t * to)
 {
 	u8 *apdubuf;		/* to store resulting apdu */
-	size_t apdulen;
-	u8 *ccbuf;		/* where to store data to eval cryptographic checksum CC */
-	size_t cclen = 0;
-	u8 macbuf[8];		/* to store and compute CC */
-	DES_key_schedule k1;
-	DES_key_schedule k2;
+	size_t apdulen = 0;
+	u8 header[4];		/* encoded apdu header */
+	cwa_mac_t mac;		/* to compute CC */
+	u8 macbuf[8];		/* to store CC */
 	char *msg = NULL;
 
-	size_t i, j;		/* for xor loops */
 	int res = SC_SUCCESS;
 	sc_context_t *ctx = NULL;
 	cwa_sm_session_t *sm_session = NULL;
@@ -1475,15 +1729,11 @@ int cwa_encode_apdu(sc_card_t * card,
 	/* trace APDU before encoding process */
 	cwa_trace_apdu(card, from, 0);
 
-	/* reserve enougth space for apdulen+tlv bytes 
-	 * to-be-crypted buffer and result apdu buffer */
+	/* reserve enougth space for apdulen+tlv bytes in result apdu buffer */
 	apdubuf =
 	    calloc(MAX(SC_MAX_APDU_BUFFER_SIZE, 20 + from->datalen),
 		   sizeof(u8));
-	ccbuf =
-	    calloc(MAX(SC_MAX_APDU_BUFFER_SIZE, 20 + from->datalen),
-		   sizeof(u8));
-	if (!apdubuf || !ccbuf)
+	if (!apdubuf)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
 	/* set up data on destination apdu */
@@ -1494,23 +1744,16 @@ int cwa_encode_apdu(sc_card_t * card,
 	to->p2 = from->p2;
 	to->le = from->le;
 	to->lc = 0;		/* to be evaluated */
-	/* fill buffer with header info */
-	*(ccbuf + cclen++) = to->cla;
-	*(ccbuf + cclen++) = to->ins;
-	*(ccbuf + cclen++) = to->p1;
-	*(ccbuf + cclen++) = to->p2;
-	cwa_iso7816_padding(ccbuf, &cclen);	/* pad header (4 bytes pad) */
+	header[0] = to->cla;
+	header[1] = to->ins;
+	header[2] = to->p1;
+	header[3] = to->p2;
 
 	/* if no data, skip data encryption step */
 	if (from->lc != 0) {
 		size_t dlen = from->lc;
 
-		/* prepare keys */
 		DES_cblock iv = { 0, 0, 0, 0, 0, 0, 0, 0 };
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[0]),
-				      &k1);
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[8]),
-				      &k2);
 
 		/* pad message */
 		memcpy(msgbuf, from->data, dlen);
@@ -1519,12 +1762,14 @@ int cwa_encode_apdu(sc_card_t * card,
 		/* start kriptbuff with iso padding indicator */
 		*cryptbuf = 0x01;
 		/* aply TDES + CBC with kenc and iv=(0,..,0) */
-		DES_ede3_cbc_encrypt(msgbuf, cryptbuf + 1, dlen, &k1, &k2, &k1,
-				     &iv, DES_ENCRYPT);
+		DES_ede3_cbc_encrypt(msgbuf, cryptbuf + 1, dlen,
+				     &sm_session->kenc_ks[0],
+				     &sm_session->kenc_ks[1],
+				     &sm_session->kenc_ks[0], &iv, DES_ENCRYPT);
 		/* compose data TLV and add to result buffer */
 		res =
-		    cwa_compose_tlv(card, 0x87, dlen + 1, cryptbuf, &ccbuf,
-				    &cclen);
+		    cwa_compose_tlv(card, 0x87, dlen + 1, cryptbuf, &apdubuf,
+				    &apdulen);
 		if (res != SC_SUCCESS) {
 			msg = "Error in compose tag 8x87 TLV";
 			goto encode_end;
@@ -1535,41 +1780,24 @@ int cwa_encode_apdu(sc_card_t * card,
 	/* TODO: study why original driver checks for le>=256? */
 	if (from->le > 0) {
 		u8 le = 0xff & from->le;
-		res = cwa_compose_tlv(card, 0x97, 1, &le, &ccbuf, &cclen);
+		res = cwa_compose_tlv(card, 0x97, 1, &le, &apdubuf, &apdulen);
 		if (res != SC_SUCCESS) {
 			msg = "Encode APDU compose_tlv(0x97) failed";
 			goto encode_end;
 		}
 	}
-	/* copy current data to apdu buffer (skip header and header padding) */
-	memcpy(apdubuf, ccbuf + 8, cclen - 8);
-	apdulen = cclen - 8;
-	/* pad again ccbuffer to compute CC */
-	cwa_iso7816_padding(ccbuf, &cclen);
-
-	/* sc_log(ctx,"data to compose mac: %s",sc_dump_hex(ccbuf,cclen)); */
 	/* compute MAC Cryptographic Checksum using kmac and increased SSC */
 	res = cwa_increase_ssc(card, sm_session); /* increase send sequence counter */
 	if (res != SC_SUCCESS) {
 		msg = "Error in computing SSC";
 		goto encode_end;
 	}
-	/* set up keys for mac computing */
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[0]),&k1);
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[8]),&k2);
-
-	memcpy(macbuf, sm_session->ssc, 8);	/* start with computed SSC */
-	for (i = 0; i < cclen; i += 8) {	/* divide data in 8 byte blocks */
-		/* compute DES */
-		DES_ecb_encrypt((const_DES_cblock *) macbuf,
-				(DES_cblock *) macbuf, &k1, DES_ENCRYPT);
-		/* XOR with next data and repeat */
-		for (j = 0; j < 8; j++)
-			macbuf[j] ^= ccbuf[i + j];
-	}
-	/* and apply 3DES to result */
-	DES_ecb2_encrypt((const_DES_cblock *) macbuf, (DES_cblock *) macbuf,
-			 &k1, &k2, DES_ENCRYPT);
+	/* checksum covers padded header and the TLVs composed so far */
+	cwa_mac_init(&mac, sm_session);
+	cwa_mac_update(&mac, header, 4);
+	cwa_mac_pad(&mac);
+	cwa_mac_update(&mac, apdubuf, apdulen);
+	cwa_mac_final(&mac, macbuf);
 
 	/* compose and add computed MAC TLV to result buffer */
 	res = cwa_compose_tlv(card, 0x8E, 4, macbuf, &apdubuf, &apdulen);
@@ -1595,6 +1823,8 @@ int cwa_encode_apdu(sc_card_t * card,
 	res = SC_SUCCESS;
 
  encode_end:
+	free(msgbuf);
+	free(cryptbuf);
 	if (msg)
 		sc_log(ctx, msg);
 	LOG_FUNC_RETURN(ctx, res);
@@ -1618,18 +1848,14 @@ int cwa_decode_response(sc_card_t * card,
 			cwa_provider_t * provider,
 			sc_apdu_t * from, sc_apdu_t * to)
 {
-	size_t i, j;
 	cwa_tlv_t tlv_array[4];
 	cwa_tlv_t *p_tlv = &tlv_array[0];	/* to store plain data (Tag 0x81) */
 	cwa_tlv_t *e_tlv = &tlv_array[1];	/* to store pad encoded data (Tag 0x87) */
 	cwa_tlv_t *m_tlv = &tlv_array[2];	/* to store mac CC (Tag 0x8E) */
 	cwa_tlv_t *s_tlv = &tlv_array[3];	/* to store sw1-sw2 status (Tag 0x99) */
-	u8 *ccbuf = NULL;	/* buffer for mac CC calculation */
-	size_t cclen = 0;	/* ccbuf len */
-	u8 macbuf[8];		/* where to calculate mac */
+	cwa_mac_t mac;		/* to compute mac CC */
+	u8 macbuf[8];		/* where to store mac */
 	size_t resplen = 0;	/* respbuf length */
-	DES_key_schedule k1;
-	DES_key_schedule k2;
 	int res = SC_SUCCESS;
 	char *msg = NULL;	/* to store error messages */
 	sc_context_t *ctx = NULL;
@@ -1712,43 +1938,18 @@ int cwa_decode_response(sc_card_t * card,
 		goto response_decode_end;
 	}
 
-	/* compose buffer to evaluate mac */
-
-	/* reserve enought space for data+status+padding */
-	ccbuf =
-	    calloc(e_tlv->buflen + s_tlv->buflen + p_tlv->buflen + 8,
-		   sizeof(u8));
-	if (!ccbuf) {
-		msg = "Cannot allocate space for mac checking";
-		res = SC_ERROR_OUT_OF_MEMORY;
-		goto response_decode_end;
-	}
-	/* copy data into buffer */
-	cclen = 0;
-	if (e_tlv->buf) {	/* encoded data */
-		memcpy(ccbuf, e_tlv->buf, e_tlv->buflen);
-		cclen = e_tlv->buflen;
-	}
-	if (p_tlv->buf) {	/* plain data */
-		memcpy(ccbuf, p_tlv->buf, p_tlv->buflen);
-		cclen += p_tlv->buflen;
-	}
 	if (s_tlv->buf) {	/* response status */
 		if (s_tlv->len != 2) {
 			msg = "Invalid SW TAG length";
 			res = SC_ERROR_INVALID_DATA;
 			goto response_decode_end;
 		}
-		memcpy(ccbuf + cclen, s_tlv->buf, s_tlv->buflen);
-		cclen += s_tlv->buflen;
 		to->sw1 = s_tlv->data[0];
 		to->sw2 = s_tlv->data[1];
 	} else {		/* if no response status tag, use sw1 and sw2 from apdu */
 		to->sw1 = from->sw1;
 		to->sw2 = from->sw2;
 	}
-	/* add iso7816 padding */
-	cwa_iso7816_padding(ccbuf, &cclen);
 
 	/* evaluate mac by mean of kmac and increased SendSequence Counter SSC */
 
@@ -1758,22 +1959,15 @@ int cwa_decode_response(sc_card_t * card,
 		msg = "Error in computing SSC";
 		goto response_decode_end;
 	}
-	/* set up keys for mac computing */
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[0]), &k1);
-	DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kmac[8]), &k2);
-
-	memcpy(macbuf, sm_session->ssc, 8);	/* start with computed SSC */
-	for (i = 0; i < cclen; i += 8) {	/* divide data in 8 byte blocks */
-		/* compute DES */
-		DES_ecb_encrypt((const_DES_cblock *) macbuf,
-				(DES_cblock *) macbuf, &k1, DES_ENCRYPT);
-		/* XOR with data and repeat */
-		for (j = 0; j < 8; j++)
-			macbuf[j] ^= ccbuf[i + j];
-	}
-	/* finally apply 3DES to result */
-	DES_ecb2_encrypt((const_DES_cblock *) macbuf, (DES_cblock *) macbuf,
-			 &k1, &k2, DES_ENCRYPT);
+	/* mac covers data and status TLVs as received, plus padding */
+	cwa_mac_init(&mac, sm_session);
+	if (e_tlv->buf)		/* encoded data */
+		cwa_mac_update(&mac, e_tlv->buf, e_tlv->buflen);
+	if (p_tlv->buf)		/* plain data */
+		cwa_mac_update(&mac, p_tlv->buf, p_tlv->buflen);
+	if (s_tlv->buf)		/* response status */
+		cwa_mac_update(&mac, s_tlv->buf, s_tlv->buflen);
+	cwa_mac_final(&mac, macbuf);
 
 	/* check evaluated mac with provided by apdu response */
 
@@ -1826,15 +2020,12 @@ int cwa_decode_response(sc_card_t * card,
 			res = SC_ERROR_INVALID_DATA;
 			goto response_decode_end;
 		}
-		/* prepare keys to decode */
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[0]),
-				      &k1);
-		DES_set_key_unchecked((const_DES_cblock *) & (sm_session->kenc[8]),
-				      &k2);
 		/* decrypt into response buffer
 		 * by using 3DES CBC by mean of kenc and iv={0,...0} */
 		DES_ede3_cbc_encrypt(&e_tlv->data[1], to->resp, e_tlv->len - 1,
-				     &k1, &k2, &k1, &iv, DES_DECRYPT);
+				     &sm_session->kenc_ks[0],
+				     &sm_session->kenc_ks[1],
+				     &sm_session->kenc_ks[0], &iv, DES_DECRYPT);
 		to->resplen = e_tlv->len - 1;
 		/* remove iso padding from response length */
 		for (; (to->resplen > 0) && *(to->resp + to->resplen - 1) == 0x00; to->resplen--) ;	/* empty loop */
@@ -1865,8 +2056,6 @@ int cwa_decode_response(sc_card_t * card,
 	res = SC_SUCCESS;
 
  response_decode_end:
-	if (ccbuf)
-		free(ccbuf);
 	if (msg) {
 		sc_log(ctx, msg);
 	} else {
@@ -2042,6 +2231,8 @@ static cwa_provider_t default_cwa_provider = {
 	  }
 	 },
 
+	0,			/* cache_chains */
+
     /************ operations related with secure channel creation *********/
 
 	/* pre and post operations */
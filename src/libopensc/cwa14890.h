@@ -78,6 +78,8 @@ typedef struct cwa_sm_session_st {
 	u8 kenc[16];	/** key used for data encoding */
 	u8 kmac[16];	/** key for mac checksum calculation */
 	u8 ssc[8];	/** send sequence counter */
+	DES_key_schedule kenc_ks[2];	/** kenc key schedules, set with the session keys */
+	DES_key_schedule kmac_ks[2];	/** kmac key schedules, set with the session keys */
 } cwa_sm_session_t;
 
 /**
@@ -92,6 +94,8 @@ typedef struct cwa_sm_status_st {
 	u8 rndifd[8];	/** 8 bytes random number generated by application */
 	u8 sig[128];	/** buffer to store & compute signatures (1024 bits) */
 	cwa_sm_session_t session; /** current session data */
+	u8 chain_digest[32];	/** SHA-256 of the last verified icc certificate chain */
+	int chain_verified;	/** chain_digest is valid */
 } cwa_sm_status_t;
 
 /**
@@ -102,6 +106,7 @@ typedef struct cwa_provider_st {
     /************ data related with SM operations *************************/
 
 	cwa_sm_status_t status; /** sm status for this provider */
+	int cache_chains;	/** keep verified icc chains in the cache directory */
 
     /************ operations related with secure channel creation *********/
 
@@ -21,11 +21,18 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
+#include "cardctl.h"
 
 struct app_entry {
 	const u8 *aid;
@@ -129,87 +136,246 @@ parse_dir_record(sc_card_t *card, u8 ** buf, size_t *buflen, int rec_nr)
 }
 
 
+/*
+ * EF(DIR) is handled in the form it is kept in the cache directory: the
+ * contents of a transparent EF(DIR), or each record preceded by its
+ * length in two bytes.
+ */
+#define DIR_MAX_RECORDS		16
+#define DIR_MAX_CACHED		(DIR_MAX_RECORDS * (2 + 256))
+
+/* Cached EF(DIR) of a card, named by the card serial number */
+static int dir_cache_file(sc_card_t *card, char *buf, size_t bufsize)
+{
+	sc_serial_number_t serial;
+	char dir[PATH_MAX], hex[SC_MAX_SERIALNR * 2 + 1];
+	int r;
+
+	if (!card->ctx->cache_ef_dir)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serial);
+	if (r < 0)
+		return r;
+	if (serial.len == 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = sc_bin_to_hex(serial.value, serial.len, hex, sizeof(hex), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/efdir_%s", dir, hex);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* The first line of the cache file, it has to match the card */
+static int dir_cache_header(sc_card_t *card, int ef_structure, char *buf, size_t bufsize)
+{
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	int r;
+
+	r = sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s %s\n", atr,
+			ef_structure == SC_FILE_EF_TRANSPARENT ? "transparent" : "records");
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int dir_cache_read(sc_card_t *card, int *ef_structure, u8 *buf, size_t *len)
+{
+	char fname[PATH_MAX], line[SC_MAX_ATR_SIZE * 2 + 32], expect[SC_MAX_ATR_SIZE * 2 + 32];
+	FILE *f;
+	int r;
+
+	r = dir_cache_file(card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (fgets(line, sizeof(line), f) == NULL)
+		goto out;
+	*ef_structure = SC_FILE_EF_TRANSPARENT;
+	if (dir_cache_header(card, *ef_structure, expect, sizeof(expect)) != SC_SUCCESS
+			|| strcmp(line, expect)) {
+		*ef_structure = SC_FILE_EF_LINEAR_VARIABLE;
+		if (dir_cache_header(card, *ef_structure, expect, sizeof(expect)) != SC_SUCCESS
+				|| strcmp(line, expect))
+			goto out;
+	}
+	*len = fread(buf, 1, DIR_MAX_CACHED, f);
+	if (!ferror(f))
+		r = SC_SUCCESS;
+out:
+	fclose(f);
+	return r;
+}
+
+static void dir_cache_write(sc_card_t *card, int ef_structure, const u8 *buf, size_t len)
+{
+	char fname[PATH_MAX], tmpname[PATH_MAX], header[SC_MAX_ATR_SIZE * 2 + 32];
+	FILE *out;
+	int r = 0;
+
+	if (dir_cache_file(card, fname, sizeof(fname)) != SC_SUCCESS
+			|| dir_cache_header(card, ef_structure, header, sizeof(header)) != SC_SUCCESS)
+		return;
+	if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname) >= (int)sizeof(tmpname))
+		return;
+
+	out = fopen(tmpname, "wb");
+	if (out == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		out = fopen(tmpname, "wb");
+	}
+	if (out == NULL)
+		return;
+	if (fputs(header, out) == EOF || fwrite(buf, 1, len, out) != len)
+		r = -1;
+	if (fclose(out) != 0)
+		r = -1;
+	if (r == 0) {
+#ifdef _WIN32
+		unlink(fname);
+#endif
+		if (rename(tmpname, fname) == 0)
+			return;
+	}
+	sc_log(card->ctx, "cannot store EF(DIR) in '%s'", fname);
+	unlink(tmpname);
+}
+
+static void dir_cache_drop(sc_card_t *card)
+{
+	char fname[PATH_MAX];
+
+	if (dir_cache_file(card, fname, sizeof(fname)) == SC_SUCCESS)
+		unlink(fname);
+}
+
+static int parse_dir(sc_card_t *card, int ef_structure, u8 *buf, size_t len)
+{
+	u8 *p = buf;
+	size_t rec_size;
+	int rec_nr;
+
+	if (ef_structure == SC_FILE_EF_TRANSPARENT) {
+		while (len > 0) {
+			if (card->app_count == SC_MAX_CARD_APPS) {
+				sc_log(card->ctx, "Too many applications on card");
+				break;
+			}
+			if (parse_dir_record(card, &p, &len, -1))
+				break;
+		}
+		return SC_SUCCESS;
+	}
+
+	for (rec_nr = 1; len >= 2; rec_nr++) {
+		rec_size = (p[0] << 8) | p[1];
+		if (rec_size > len - 2)
+			return SC_ERROR_INVALID_DATA;
+		p += 2;
+		len -= 2 + rec_size;
+		if (card->app_count == SC_MAX_CARD_APPS) {
+			sc_log(card->ctx, "Too many applications on card");
+			break;
+		}
+		parse_dir_record(card, &p, &rec_size, rec_nr);
+		p += rec_size;
+	}
+	return SC_SUCCESS;
+}
+
 int sc_enum_apps(sc_card_t *card)
 {
 	struct sc_context *ctx = card->ctx;
 	sc_path_t path;
 	int ef_structure;
 	size_t file_size, jj;
+	u8 *buf = NULL;
 	int r, ii, idx;
 
 	LOG_FUNC_CALLED(ctx);
 	if (card->app_count < 0)
 		card->app_count = 0;
 
-	sc_format_path("3F002F00", &path);
 	if (card->ef_dir != NULL) {
 		sc_file_free(card->ef_dir);
 		card->ef_dir = NULL;
 	}
+
+	buf = malloc(DIR_MAX_CACHED);
+	if (buf == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	/* same card as last time: no need to read it again */
+	if (dir_cache_read(card, &ef_structure, buf, &file_size) == SC_SUCCESS) {
+		sc_log(ctx, "EF(DIR) from the cache");
+		r = parse_dir(card, ef_structure, buf, file_size);
+		goto done;
+	}
+
+	sc_format_path("3F002F00", &path);
 	r = sc_select_file(card, &path, &card->ef_dir);
+	if (r < 0)
+		free(buf);
 	LOG_TEST_RET(ctx, r, "Cannot select EF.DIR file");
 
 	if (card->ef_dir->type != SC_FILE_TYPE_WORKING_EF) {
 		sc_file_free(card->ef_dir);
 		card->ef_dir = NULL;
+		free(buf);
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_CARD, "EF(DIR) is not a working EF.");
 	}
 
 	ef_structure = card->ef_dir->ef_structure;
 	if (ef_structure == SC_FILE_EF_TRANSPARENT) {
-		u8 *buf = NULL, *p;
-		size_t bufsize;
-
 		file_size = card->ef_dir->size;
-		if (file_size == 0)
+		if (file_size == 0) {
+			free(buf);
 			LOG_FUNC_RETURN(ctx, 0);
+		}
+		if (file_size > DIR_MAX_CACHED) {
+			u8 *tmp = realloc(buf, file_size);
 
-		buf = malloc(file_size);
-		if (buf == NULL)
-			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-		p = buf;
+			if (tmp == NULL) {
+				free(buf);
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			}
+			buf = tmp;
+		}
 		r = sc_read_binary(card, 0, buf, file_size, 0);
 		if (r < 0) {
 			free(buf);
 			LOG_TEST_RET(ctx, r, "sc_read_binary() failed");
 		}
-		bufsize = r;
-		while (bufsize > 0) {
-			if (card->app_count == SC_MAX_CARD_APPS) {
-				sc_log(ctx, "Too many applications on card");
-				break;
-			}
-			r = parse_dir_record(card, &p, &bufsize, -1);
-			if (r)
-				break;
-		}
-		if (buf)
-			free(buf);
-
+		file_size = r;
 	}
 	else {	/* record structure */
-		unsigned char buf[256], *p;
-		unsigned int rec_nr;
-		size_t rec_size;
-
-		/* Arbitrary set '16' as maximal number of records to check out:
+		/* Arbitrary set '15' as maximal number of records to check out:
 		 * to avoid endless loop because of some uncomplete cards/drivers */
-		for (rec_nr = 1; rec_nr < 16; rec_nr++) {
-			r = sc_read_record(card, rec_nr, buf, sizeof(buf), SC_RECORD_BY_REC_NR);
-			if (r == SC_ERROR_RECORD_NOT_FOUND)
-				break;
-			LOG_TEST_RET(ctx, r, "read_record() failed");
-
-			if (card->app_count == SC_MAX_CARD_APPS) {
-				sc_log(ctx, "Too many applications on card");
-				break;
-			}
-
-			rec_size = r;
-			p = buf;
-			parse_dir_record(card, &p, &rec_size, (int)rec_nr);
+		file_size = DIR_MAX_CACHED;
+		r = sc_read_records(card, 1, DIR_MAX_RECORDS - 1, buf, &file_size, 0);
+		if (r < 0) {
+			free(buf);
+			LOG_FUNC_RETURN(ctx, r);
 		}
 	}
+	if (file_size <= DIR_MAX_CACHED)
+		dir_cache_write(card, ef_structure, buf, file_size);
+	r = parse_dir(card, ef_structure, buf, file_size);
+
+done:
+	free(buf);
+	LOG_TEST_RET(ctx, r, "EF(DIR) parsing failed");
 
 	/* Move known PKCS#15 applications to the head of the list */
 	for (ii=0, idx=0; ii<card->app_count; ii++)   {
@@ -377,6 +543,8 @@ int sc_update_dir(sc_card_t *card, sc_app_info_t *app)
 	r = sc_select_file(card, &path, &file);
 	LOG_TEST_RET(card->ctx, r, "unable to select EF(DIR)");
 
+	/* read from the card again the next time */
+	dir_cache_drop(card);
 	if (file->ef_structure == SC_FILE_EF_TRANSPARENT)
 		r = update_transparent(card, file);
 	else if (app == NULL)
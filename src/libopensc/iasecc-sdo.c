@@ -1281,10 +1281,71 @@ iasecc_docp_copy(struct sc_context *ctx, struct iasecc_sdo_docp *in, struct iase
 	rv = iasecc_tlv_copy(ctx, &in->acls_contactless, &out->acls_contactless);
 	LOG_TEST_RET(ctx, rv, "TLV copy error");
 
+	rv = iasecc_tlv_copy(ctx, &in->issuer_data, &out->issuer_data);
+	LOG_TEST_RET(ctx, rv, "TLV copy error");
+
 	out->amb = in->amb;
 	memcpy(out->scbs, in->scbs, sizeof(out->scbs));
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+
+/* Deep copy of a parsed SDO; on error 'out' is left for iasecc_sdo_free_fields() */
+int
+iasecc_sdo_copy(struct sc_card *card, struct iasecc_sdo *in, struct iasecc_sdo *out)
+{
+	struct sc_context *ctx = card->ctx;
+	int rv = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!in || !out)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	memset(out, 0, sizeof(struct iasecc_sdo));
+	out->sdo_class = in->sdo_class;
+	out->sdo_ref = in->sdo_ref;
+	out->usage = in->usage;
+	out->not_on_card = in->not_on_card;
+	out->magic = in->magic;
+
+	rv = iasecc_docp_copy(ctx, &in->docp, &out->docp);
+	LOG_TEST_RET(ctx, rv, "DOCP copy error");
+
+	if (in->sdo_class == IASECC_SDO_CLASS_RSA_PUBLIC)   {
+		rv = iasecc_tlv_copy(ctx, &in->data.pub_key.n, &out->data.pub_key.n);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.pub_key.e, &out->data.pub_key.e);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.pub_key.compulsory, &out->data.pub_key.compulsory);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.pub_key.chr, &out->data.pub_key.chr);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.pub_key.cha, &out->data.pub_key.cha);
+	}
+	else if (in->sdo_class == IASECC_SDO_CLASS_RSA_PRIVATE)   {
+		rv = iasecc_tlv_copy(ctx, &in->data.prv_key.p, &out->data.prv_key.p);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.prv_key.q, &out->data.prv_key.q);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.prv_key.iqmp, &out->data.prv_key.iqmp);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.prv_key.dmp1, &out->data.prv_key.dmp1);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.prv_key.dmq1, &out->data.prv_key.dmq1);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.prv_key.compulsory, &out->data.prv_key.compulsory);
+	}
+	else if (in->sdo_class == IASECC_SDO_CLASS_CHV)   {
+		rv = iasecc_tlv_copy(ctx, &in->data.chv.size_max, &out->data.chv.size_max);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.chv.size_min, &out->data.chv.size_min);
+		if (!rv)
+			rv = iasecc_tlv_copy(ctx, &in->data.chv.value, &out->data.chv.value);
+	}
+	LOG_TEST_RET(ctx, rv, "SDO data copy error");
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 #endif /* ENABLE_OPENSSL */
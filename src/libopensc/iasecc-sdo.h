@@ -297,6 +297,15 @@ struct iasecc_sm_cmd_update_binary {
 	size_t offs, count;
 };
 
+/* PSO under SM: 'data' is sent in chunks of 'max_data' bytes, chained
+ * when needed, 'resp_len' is the length of the expected plain answer */
+struct iasecc_sm_cmd_pso {
+	const unsigned char *data;
+	size_t data_len;
+	size_t max_data;
+	size_t resp_len;
+};
+
 struct iasecc_sm_cmd_create_file {
 	const unsigned char *data;
 	size_t size;
@@ -319,6 +328,7 @@ int iasecc_se_get_crt_by_usage(struct sc_card *, struct iasecc_se_info *,
 int iasecc_sdo_encode_rsa_update(struct sc_context *, struct iasecc_sdo *, struct sc_pkcs15_prkey_rsa *, struct iasecc_sdo_update *);
 int iasecc_sdo_parse_card_answer(struct sc_context *, unsigned char *, size_t, struct iasecc_sm_card_answer *);
 int iasecc_docp_copy(struct sc_context *, struct iasecc_sdo_docp *, struct iasecc_sdo_docp *);
+int iasecc_sdo_copy(struct sc_card *, struct iasecc_sdo *, struct iasecc_sdo *);
 int iasecc_se_get_info(struct sc_card *card, struct iasecc_se_info *se);
 
 int iasecc_sm_external_authentication(struct sc_card *card, unsigned skey_ref, int *tries_left);
@@ -331,4 +341,8 @@ int iasecc_sm_delete_file(struct sc_card *card, unsigned se_num, unsigned int fi
 int iasecc_sm_rsa_generate(struct sc_card *card, unsigned se_num, struct iasecc_sdo *sdo);
 int iasecc_sm_rsa_update(struct sc_card *card, unsigned se_num, struct iasecc_sdo_rsa_update *udata);
 int iasecc_sm_sdo_update(struct sc_card *card, unsigned se_num, struct iasecc_sdo_update *update);
+int iasecc_sm_decipher(struct sc_card *card, unsigned se_num, const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t out_len);
+int iasecc_sm_compute_signature_dst(struct sc_card *card, unsigned se_num, const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t out_len);
 #endif
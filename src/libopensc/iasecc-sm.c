@@ -708,3 +708,100 @@ iasecc_sm_delete_file(struct sc_card *card, unsigned se_num, unsigned int file_i
 }
 
 
+
+
+#ifdef ENABLE_SM
+/* Plain data one secured command may carry. The card announces in EF.ATR
+ * the size of the commands it takes under SM: when extended length APDUs
+ * are supported and this size allows it, a private key operation is
+ * secured as one command rather than as a chain of SM_MAX_DATA_SIZE ones.
+ * Securing adds at most 40 bytes: header, padding, DOs and MAC. */
+static size_t
+iasecc_sm_max_data(struct sc_card *card)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	size_t max = prv->max_sizes.send_sc;
+
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT) || max < SM_MAX_DATA_SIZE + 40)
+		return SM_MAX_DATA_SIZE;
+	max -= 40;
+	return max > SM_MAX_EXT_DATA_SIZE ? SM_MAX_EXT_DATA_SIZE : max;
+}
+
+
+static int
+iasecc_sm_pso(struct sc_card *card, unsigned se_num, unsigned cmd,
+		const unsigned char *in, size_t in_len, size_t resp_len,
+		unsigned char *out, size_t out_len)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sm_info *sm_info = &card->sm_ctx.info;
+	struct sc_remote_data rdata;
+	struct iasecc_sm_cmd_pso cmd_data;
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+	rv = iasecc_sm_initialize(card, se_num, cmd);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_pso() SM INITIALIZE failed");
+
+	cmd_data.data = in;
+	cmd_data.data_len = in_len;
+	cmd_data.max_data = iasecc_sm_max_data(card);
+	cmd_data.resp_len = resp_len;
+	sm_info->cmd_data = &cmd_data;
+	sc_log(ctx, "SM PSO: data %i, secured in chunks of %i", in_len, cmd_data.max_data);
+
+	sc_remote_data_init(&rdata);
+	rv = iasecc_sm_cmd(card, &rdata);
+	if (rv < 0)
+		rdata.free(&rdata);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_pso() SM 'PSO' failed");
+
+	rv = sm_release (card, &rdata, out, out_len);
+	rdata.free(&rdata);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_pso() SM release failed");
+
+	LOG_FUNC_RETURN(ctx, rv);
+}
+#endif
+
+
+int
+iasecc_sm_decipher(struct sc_card *card, unsigned se_num, const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t out_len)
+{
+	struct sc_context *ctx = card->ctx;
+#ifdef ENABLE_SM
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+	sc_log(ctx, "SM decipher: SE#:%X, data:%i", se_num, in_len);
+
+	rv = iasecc_sm_pso(card, se_num, SM_CMD_PSO_DECIPHER, in, in_len, 0x100, out, out_len);
+	LOG_FUNC_RETURN(ctx, rv);
+#else
+	LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "built without support of Secure-Messaging");
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+
+int
+iasecc_sm_compute_signature_dst(struct sc_card *card, unsigned se_num, const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t out_len)
+{
+	struct sc_context *ctx = card->ctx;
+#ifdef ENABLE_SM
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+	sc_log(ctx, "SM compute signature: SE#:%X, data:%i, key size %i", se_num, in_len, prv->key_size);
+
+	rv = iasecc_sm_pso(card, se_num, SM_CMD_PSO_DST, in, in_len, prv->key_size, out, out_len);
+	LOG_FUNC_RETURN(ctx, rv);
+#else
+	LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "built without support of Secure-Messaging");
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
@@ -133,5 +133,9 @@ struct iasecc_private_data {
 	unsigned op_method, op_ref;
 
 	struct iasecc_se_info *se_info;
+
+	/* parsed RSA key SDOs, dropped by PUT DATA, SM authentication and card reset */
+	struct iasecc_sdo_cache *sdo_cache;
+	unsigned sdo_cache_generation;
 };
 #endif
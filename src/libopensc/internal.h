@@ -75,11 +75,55 @@ struct sc_atr_table {
 /* Internal use only */
 int _sc_add_reader(struct sc_context *ctx, struct sc_reader *reader);
 int _sc_delete_reader(struct sc_context *ctx, struct sc_reader *reader);
+/* wait_for_event() for reader drivers that cannot wait for card events:
+ * polls the readers, more often right after a change */
+int _sc_poll_for_event(struct sc_context *ctx, unsigned int event_mask,
+	struct sc_reader **event_reader, unsigned int *event,
+	int timeout, void **reader_states);
 int _sc_parse_atr(struct sc_reader *reader);
+/* Debug log written by a background thread, see log.c */
+int _sc_log_async_start(struct sc_context *ctx, unsigned int size);
+void _sc_log_async_stop(struct sc_context *ctx);
+/* keep the background writer off ctx->debug_file while it is replaced */
+void _sc_log_file_lock(struct sc_context *ctx);
+void _sc_log_file_unlock(struct sc_context *ctx);
+int _sc_log_owns_file(struct sc_context *ctx);
+/* per module debug levels from a "name:level, ..." list, see log.c */
+int _sc_log_add_modules(struct sc_context *ctx, const char *spec);
+int _sc_log_replace_modules(struct sc_context *ctx, const char **specs, size_t n,
+		struct sc_log_module **old);
+void _sc_log_free_modules(struct sc_context *ctx);
+/* APDU trace ring buffer of the context, see sc_apdu_trace_dump() */
+int _sc_apdu_trace_init(struct sc_context *ctx, unsigned int size);
+void _sc_apdu_trace_free(struct sc_context *ctx);
+/* Startup trace of the context, see sc_startup_trace_write() */
+int _sc_startup_trace_init(struct sc_context *ctx, const char *filename);
+void _sc_startup_trace_free(struct sc_context *ctx);
+/* Monotonic clock in microseconds */
+unsigned long long _sc_monotonic_usec(void);
+/* Sends an APDU to the reader driver and accounts it in reader->stats */
+int _sc_reader_transmit(struct sc_reader *reader, struct sc_apdu *apdu);
+/* APDU transcript written for the replay reader driver */
+int _sc_apdu_record_open(struct sc_context *ctx, const char *filename);
+void _sc_apdu_record_close(struct sc_context *ctx);
+void _sc_apdu_record(struct sc_reader *reader, const struct sc_apdu *apdu,
+		int redact, unsigned long usec);
 
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+int _sc_build_atr_index(struct sc_context *ctx);
+void _sc_free_atr_index(struct sc_context *ctx);
+void _sc_free_emu_cache(struct sc_context *ctx);
+void _sc_free_pkcs15_conf(struct sc_context *ctx);
+void _sc_free_shared_generations(struct sc_context *ctx);
+
+/* Card generations shared between processes, see coherency.c.
+ * sc_shared_generation_changed() returns 1 once for each change made
+ * by another process, writers call sc_shared_generation_bump(). */
+void sc_shared_generation_attach(struct sc_card *card);
+int sc_shared_generation_changed(struct sc_card *card);
+void sc_shared_generation_bump(struct sc_card *card);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -118,6 +162,8 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
 int _sc_match_atr(struct sc_card *card, struct sc_atr_table *table, int *type_out);
 
 int _sc_card_add_algorithm(struct sc_card *card, const struct sc_algorithm_info *info);
+/* rebuild the lookup index after changing card->algorithms in place */
+int _sc_card_index_algorithms(struct sc_card *card);
 int _sc_card_add_rsa_alg(struct sc_card *card, unsigned int key_length,
 			 unsigned long flags, unsigned long exponent);
 int _sc_card_add_ec_alg(struct sc_card *card, unsigned int key_length,
@@ -131,6 +177,20 @@ int sc_pkcs1_strip_01_padding(struct sc_context *ctx, const u8 *in_dat, size_t i
 		u8 *out_dat, size_t *out_len);
 int sc_pkcs1_strip_02_padding(struct sc_context *ctx, const u8 *data, size_t len,
 		u8 *out_dat, size_t *out_len);
+/**
+ * Removes EME-OAEP padding (empty label) from a raw RSA decryption.
+ * @param  ctx      IN  sc_context_t object
+ * @param  flags    IN  hash and MGF1 flags, SHA-1 if none
+ * @param  data     IN  decrypted block, leading zero bytes may be missing
+ * @param  len      IN  length of the decrypted block
+ * @param  modlen   IN  length of the modulus in bytes
+ * @param  out_dat  OUT the message, NULL to only check the padding
+ * @param  out_len  IN/OUT size of out_dat / length of the message
+ * @return length of the message or an error code
+ */
+int sc_pkcs1_strip_oaep_padding(struct sc_context *ctx, unsigned long flags,
+		const u8 *data, size_t len, size_t modlen,
+		u8 *out_dat, size_t *out_len);
 int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 		const u8 *in_dat, size_t in_len, u8 *out_dat, size_t *out_len);
 
@@ -221,6 +281,19 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
  */
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	size_t *len, unsigned int proto);
+/**
+ * Encodes a APDU as an octet string into a buffer of the caller
+ * @param  ctx     sc_context_t object (used for logging)
+ * @param  apdu    sc_apdu_t object with the APDU to encode
+ * @param  buf     the output buffer
+ * @param  buflen  size of the output buffer
+ * @param  len     length of the encoded APDU
+ * @param  proto   protocol to be used
+ * @return SC_SUCCESS on success, SC_ERROR_BUFFER_TOO_SMALL if the APDU
+ *         does not fit and an error code otherwise
+ */
+int sc_apdu_get_octets_buf(sc_context_t *ctx, const sc_apdu_t *apdu, u8 *buf,
+	size_t buflen, size_t *len, unsigned int proto);
 /**
  * Sets the status bytes and return data in the APDU
  * @param  ctx     sc_context_t object
@@ -242,10 +315,42 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len,
 	int is_outgoing);
 
+/* The status words of a card driver's error table, looked up by SW1 and
+ * SW2 instead of searching the table. A driver fills its map once, where
+ * it fills its card operations, and looks up in check_sw; status words
+ * not in the map go on to the ISO 7816 ones, iso_ops->check_sw. */
+#define SC_SW_MAP_ROWS	16
+struct sc_sw_map {
+	const struct sc_card_error *errors;
+	size_t count;
+	int linear;				/* too large to map: search */
+	unsigned char rows[256];		/* by SW1: row + 1, 0 if none */
+	unsigned char cells[SC_SW_MAP_ROWS][256];	/* by SW2: entry + 1 */
+};
+
+/**
+ * Fills a status word map from an error table. The first entry of a
+ * status word is used, as when searching the table.
+ * @param  map     map to fill, a static variable of the driver
+ * @param  errors  error table
+ * @param  count   number of entries of the table
+ */
+void sc_sw_map_init(struct sc_sw_map *map, const struct sc_card_error *errors, size_t count);
+/**
+ * Looks up a status word
+ * @return the table entry, or NULL if not in the table
+ */
+const struct sc_card_error *sc_sw_map_find(const struct sc_sw_map *map,
+	unsigned int sw1, unsigned int sw2);
+
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
+extern struct sc_reader_driver *sc_get_replay_driver(void);
+#ifndef _WIN32
+extern struct sc_reader_driver *sc_get_net_driver(void);
+#endif
 
 #ifdef __cplusplus
 }
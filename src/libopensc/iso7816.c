@@ -29,25 +29,35 @@
 #include "asn1.h"
 #include "iso7816.h"
 
-static const struct sc_card_error iso7816_errors[] = {
-	{ 0x6200, SC_ERROR_CARD_CMD_FAILED,	"Warning: no information given, non-volatile memory is unchanged" },
+/* The status words are looked up directly, by SW1 and SW2: iso7816_errors_xx00
+ * has the 6X00 status words by X, iso7816_errors_xx8x those of 6X80 to 6X8F.
+ * Empty entries (no errorstr) are unknown status words. */
+static const struct sc_card_error iso7816_errors_6280[] = {
+	{ 0x6280, 0, NULL },
 	{ 0x6281, SC_ERROR_CORRUPTED_DATA,	"Part of returned data may be corrupted" },
 	{ 0x6282, SC_ERROR_FILE_END_REACHED,	"End of file/record reached before reading Le bytes" },
 	{ 0x6283, SC_ERROR_CARD_CMD_FAILED,	"Selected file invalidated" },
 	{ 0x6284, SC_ERROR_CARD_CMD_FAILED,	"FCI not formatted according to ISO 7816-4" },
+};
 
-	{ 0x6300, SC_ERROR_CARD_CMD_FAILED,	"Warning: no information given, non-volatile memory has changed" },
+static const struct sc_card_error iso7816_errors_6380[] = {
+	{ 0x6380, 0, NULL },
 	{ 0x6381, SC_ERROR_CARD_CMD_FAILED,	"Warning: file filled up by last write" },
+};
 
+static const struct sc_card_error iso7816_errors_6580[] = {
+	{ 0x6580, 0, NULL },
 	{ 0x6581, SC_ERROR_MEMORY_FAILURE,	"Memory failure" },
+};
 
-	{ 0x6700, SC_ERROR_WRONG_LENGTH,	"Wrong length" },
-
-	{ 0x6800, SC_ERROR_NO_CARD_SUPPORT,	"Functions in CLA not supported" },
+static const struct sc_card_error iso7816_errors_6880[] = {
+	{ 0x6880, 0, NULL },
 	{ 0x6881, SC_ERROR_NO_CARD_SUPPORT,	"Logical channel not supported" },
 	{ 0x6882, SC_ERROR_NO_CARD_SUPPORT,	"Secure messaging not supported" },
+};
 
-	{ 0x6900, SC_ERROR_NOT_ALLOWED,		"Command not allowed" },
+static const struct sc_card_error iso7816_errors_6980[] = {
+	{ 0x6980, 0, NULL },
 	{ 0x6981, SC_ERROR_CARD_CMD_FAILED,	"Command incompatible with file structure" },
 	{ 0x6982, SC_ERROR_SECURITY_STATUS_NOT_SATISFIED, "Security status not satisfied" },
 	{ 0x6983, SC_ERROR_AUTH_METHOD_BLOCKED,	"Authentication method blocked" },
@@ -56,8 +66,9 @@ static const struct sc_card_error iso7816_errors[] = {
 	{ 0x6986, SC_ERROR_NOT_ALLOWED,		"Command not allowed (no current EF)" },
 	{ 0x6987, SC_ERROR_INCORRECT_PARAMETERS,"Expected SM data objects missing" },
 	{ 0x6988, SC_ERROR_INCORRECT_PARAMETERS,"SM data objects incorrect" },
+};
 
-	{ 0x6A00, SC_ERROR_INCORRECT_PARAMETERS,"Wrong parameter(s) P1-P2" },
+static const struct sc_card_error iso7816_errors_6A80[] = {
 	{ 0x6A80, SC_ERROR_INCORRECT_PARAMETERS,"Incorrect parameters in the data field" },
 	{ 0x6A81, SC_ERROR_NO_CARD_SUPPORT,	"Function not supported" },
 	{ 0x6A82, SC_ERROR_FILE_NOT_FOUND,	"File not found" },
@@ -68,23 +79,51 @@ static const struct sc_card_error iso7816_errors[] = {
 	{ 0x6A87, SC_ERROR_INCORRECT_PARAMETERS,"Lc inconsistent with P1-P2" },
 	{ 0x6A88, SC_ERROR_DATA_OBJECT_NOT_FOUND,"Referenced data not found" },
 	{ 0x6A89, SC_ERROR_FILE_ALREADY_EXISTS,  "File already exists"},
-	{ 0x6A8A, SC_ERROR_FILE_ALREADY_EXISTS,  "DF name already exists"},	
+	{ 0x6A8A, SC_ERROR_FILE_ALREADY_EXISTS,  "DF name already exists"},
+};
 
+static const struct sc_card_error iso7816_errors_xx00[16] = {
+	{ 0x6000, 0, NULL },
+	{ 0x6100, 0, NULL },
+	{ 0x6200, SC_ERROR_CARD_CMD_FAILED,	"Warning: no information given, non-volatile memory is unchanged" },
+	{ 0x6300, SC_ERROR_CARD_CMD_FAILED,	"Warning: no information given, non-volatile memory has changed" },
+	{ 0x6400, 0, NULL },
+	{ 0x6500, 0, NULL },
+	{ 0x6600, 0, NULL },
+	{ 0x6700, SC_ERROR_WRONG_LENGTH,	"Wrong length" },
+	{ 0x6800, SC_ERROR_NO_CARD_SUPPORT,	"Functions in CLA not supported" },
+	{ 0x6900, SC_ERROR_NOT_ALLOWED,		"Command not allowed" },
+	{ 0x6A00, SC_ERROR_INCORRECT_PARAMETERS,"Wrong parameter(s) P1-P2" },
 	{ 0x6B00, SC_ERROR_INCORRECT_PARAMETERS,"Wrong parameter(s) P1-P2" },
+	{ 0x6C00, 0, NULL },
 	{ 0x6D00, SC_ERROR_INS_NOT_SUPPORTED,	"Instruction code not supported or invalid" },
 	{ 0x6E00, SC_ERROR_CLASS_NOT_SUPPORTED,	"Class not supported" },
 	{ 0x6F00, SC_ERROR_CARD_CMD_FAILED,	"No precise diagnosis" },
+};
 
-
-
+#define ISO7816_ERRORS(table)	{ table, sizeof(table)/sizeof(table[0]) }
+
+static const struct {
+	const struct sc_card_error *errors;
+	size_t count;
+} iso7816_errors_xx8x[16] = {
+	{ NULL, 0 }, { NULL, 0 },
+	ISO7816_ERRORS(iso7816_errors_6280),
+	ISO7816_ERRORS(iso7816_errors_6380),
+	{ NULL, 0 },
+	ISO7816_ERRORS(iso7816_errors_6580),
+	{ NULL, 0 }, { NULL, 0 },
+	ISO7816_ERRORS(iso7816_errors_6880),
+	ISO7816_ERRORS(iso7816_errors_6980),
+	ISO7816_ERRORS(iso7816_errors_6A80),
+	{ NULL, 0 }, { NULL, 0 }, { NULL, 0 }, { NULL, 0 }, { NULL, 0 },
 };
 
 
 static int
 iso7816_check_sw(struct sc_card *card, unsigned int sw1, unsigned int sw2)
 {
-	const int err_count = sizeof(iso7816_errors)/sizeof(iso7816_errors[0]);
-	int i;
+	const struct sc_card_error *err = NULL;
 
 	/* Handle special cases here */
 	if (sw1 == 0x6C) {
@@ -97,11 +136,15 @@ iso7816_check_sw(struct sc_card *card, unsigned int sw1, unsigned int sw2)
              sc_log(card->ctx, "Verification failed (remaining tries: %d)", (sw2 & 0x0f));
              return SC_ERROR_PIN_CODE_INCORRECT;
         }
-	for (i = 0; i < err_count; i++)   {
-		if (iso7816_errors[i].SWs == ((sw1 << 8) | sw2)) {
-			sc_log(card->ctx, "%s", iso7816_errors[i].errorstr);
-			return iso7816_errors[i].errorno;
-		}
+	if ((sw1 & 0xF0) == 0x60) {
+		if (sw2 == 0x00)
+			err = &iso7816_errors_xx00[sw1 & 0x0F];
+		else if ((sw2 & 0xF0) == 0x80 && (sw2 & 0x0F) < iso7816_errors_xx8x[sw1 & 0x0F].count)
+			err = &iso7816_errors_xx8x[sw1 & 0x0F].errors[sw2 & 0x0F];
+	}
+	if (err != NULL && err->errorstr != NULL) {
+		sc_log(card->ctx, "%s", err->errorstr);
+		return err->errorno;
 	}
 
 	sc_log(card->ctx, "Unknown SWs; SW1=%02X, SW2=%02X", sw1, sw2);
@@ -121,11 +164,13 @@ iso7816_read_binary(struct sc_card *card, unsigned int idx, u8 *buf, size_t coun
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	assert(count <= (card->max_recv_size > 0 ? card->max_recv_size : 256));
+	assert(count <= sc_get_max_recv_size(card));
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.le = count;
 	apdu.resplen = count;
 	apdu.resp = buf;
+	if (buf >= card->read_buf && buf + count + 2 <= card->read_buf_end)
+		apdu.flags |= SC_APDU_FLAGS_RESP_SLACK;
 
 	r = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, r, "APDU transmit failed");
@@ -160,7 +205,7 @@ iso7816_read_record(struct sc_card *card,
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB2, rec_nr, 0);
 	apdu.p2 = (flags & SC_RECORD_EF_ID_MASK) << 3;
 	if (flags & SC_RECORD_BY_REC_NR)
-		apdu.p2 |= 0x04;
+		apdu.p2 |= (flags & SC_RECORD_TO_LAST) ? 0x05 : 0x04;
 
 	apdu.le = count;
 	apdu.resplen = count;
@@ -255,7 +300,7 @@ iso7816_write_binary(struct sc_card *card,
 	struct sc_apdu apdu;
 	int r;
 
-	assert(count <= (card->max_send_size > 0 ? card->max_send_size : 255));
+	assert(count <= sc_get_max_send_size(card));
 
 	if (idx > 0x7fff) {
 		sc_log(card->ctx, "invalid EF offset: 0x%X > 0x7FFF", idx);
@@ -284,7 +329,7 @@ iso7816_update_binary(struct sc_card *card,
 	struct sc_apdu apdu;
 	int r;
 
-	assert(count <= (card->max_send_size > 0 ? card->max_send_size : 255));
+	assert(count <= sc_get_max_send_size(card));
 
 	if (idx > 0x7fff) {
 		sc_log(card->ctx, "invalid EF offset: 0x%X > 0x7FFF", idx);
@@ -960,6 +1005,11 @@ iso7816_build_pin_apdu(struct sc_card *card, struct sc_apdu *apdu,
 			p1 |= 0x01;
 		}
 		break;
+	case SC_PIN_CMD_GET_INFO:
+		/* VERIFY without data only reports the verification state */
+		ins = 0x20;
+		sc_format_apdu(card, apdu, SC_APDU_CASE_1, ins, p1, data->pin_reference);
+		return 0;
 	default:
 		return SC_ERROR_NOT_SUPPORTED;
 	}
@@ -974,6 +1024,34 @@ iso7816_build_pin_apdu(struct sc_card *card, struct sc_apdu *apdu,
 }
 
 
+/* Interpret the answer to a VERIFY without data: 9000 when the PIN is
+ * verified, 63Cx with the remaining tries or 6983 when it is not */
+static int
+iso7816_pin_info(struct sc_card *card, struct sc_apdu *apdu,
+		struct sc_pin_cmd_data *data, int *tries_left)
+{
+	if (apdu->sw1 == 0x90 && apdu->sw2 == 0x00) {
+		data->pin1.logged_in = SC_PIN_STATE_LOGGED_IN;
+		return SC_SUCCESS;
+	}
+	if (apdu->sw1 == 0x63) {
+		if ((apdu->sw2 & 0xF0) == 0xC0)
+			data->pin1.tries_left = apdu->sw2 & 0x0F;
+	}
+	else if (apdu->sw1 == 0x69 && apdu->sw2 == 0x83) {
+		data->pin1.tries_left = 0;
+	}
+	else {
+		return sc_check_sw(card, apdu->sw1, apdu->sw2);
+	}
+
+	data->pin1.logged_in = SC_PIN_STATE_LOGGED_OUT;
+	if (tries_left)
+		*tries_left = data->pin1.tries_left;
+	return SC_SUCCESS;
+}
+
+
 static int
 iso7816_pin_cmd(struct sc_card *card, struct sc_pin_cmd_data *data, int *tries_left)
 {
@@ -983,6 +1061,10 @@ iso7816_pin_cmd(struct sc_card *card, struct sc_pin_cmd_data *data, int *tries_l
 
 	if (tries_left)
 		*tries_left = -1;
+	if (data->cmd == SC_PIN_CMD_GET_INFO) {
+		data->pin1.tries_left = -1;
+		data->pin1.logged_in = SC_PIN_STATE_UNKNOWN;
+	}
 
 	/* See if we've been called from another card driver, which is
 	 * passing an APDU to us (this allows to write card drivers
@@ -1027,6 +1109,8 @@ iso7816_pin_cmd(struct sc_card *card, struct sc_pin_cmd_data *data, int *tries_l
 		data->apdu = NULL;
 
 	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
+	if (data->cmd == SC_PIN_CMD_GET_INFO)
+		return iso7816_pin_info(card, apdu, data, tries_left);
 	if (apdu->sw1 == 0x63) {
 		if ((apdu->sw2 & 0xF0) == 0xC0 && tries_left != NULL)
 			*tries_left = apdu->sw2 & 0x0F;
@@ -44,6 +44,344 @@
 
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+/*
+ * Asynchronous debug log: the logging threads format their message
+ * and queue a copy, a background thread writes the queued messages in
+ * batches. When the queue is full, messages are dropped and counted
+ * rather than making the caller wait for the disk.
+ */
+struct sc_log_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* held while writing to ctx->debug_file */
+	pthread_mutex_t file_mutex;
+	pthread_t thread;
+	pid_t pid;
+	int stop;
+
+	char **records;
+	unsigned int size, head, count;
+	unsigned long dropped;
+};
+
+static void *sc_log_writer(void *arg)
+{
+	sc_context_t *ctx = (sc_context_t *) arg;
+	struct sc_log_queue *q = ctx->log_queue;
+	char **batch;
+	unsigned int i, n;
+	unsigned long dropped;
+
+	batch = malloc(q->size * sizeof(char *));
+	if (batch == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&q->mutex);
+	for (;;) {
+		while (q->count == 0 && q->dropped == 0 && !q->stop)
+			pthread_cond_wait(&q->cond, &q->mutex);
+		if (q->count == 0 && q->dropped == 0 && q->stop)
+			break;
+
+		for (n = 0; q->count > 0; n++) {
+			batch[n] = q->records[q->head];
+			q->head = (q->head + 1) % q->size;
+			q->count--;
+		}
+		dropped = q->dropped;
+		q->dropped = 0;
+		pthread_mutex_unlock(&q->mutex);
+
+		pthread_mutex_lock(&q->file_mutex);
+		for (i = 0; i < n; i++) {
+			if (ctx->debug_file != NULL)
+				fputs(batch[i], ctx->debug_file);
+			free(batch[i]);
+		}
+		if (dropped && ctx->debug_file != NULL)
+			fprintf(ctx->debug_file, "[%s] %lu debug messages dropped\n",
+					ctx->app_name, dropped);
+		if (ctx->debug_file != NULL)
+			fflush(ctx->debug_file);
+		pthread_mutex_unlock(&q->file_mutex);
+
+		pthread_mutex_lock(&q->mutex);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	free(batch);
+	return NULL;
+}
+
+int _sc_log_async_start(sc_context_t *ctx, unsigned int size)
+{
+	struct sc_log_queue *q;
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	q->records = calloc(size, sizeof(char *));
+	if (q->records == NULL) {
+		free(q);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	q->size = size;
+	q->pid = getpid();
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_mutex_init(&q->file_mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	ctx->log_queue = q;
+	if (pthread_create(&q->thread, NULL, sc_log_writer, ctx) != 0) {
+		ctx->log_queue = NULL;
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->file_mutex);
+		pthread_mutex_destroy(&q->mutex);
+		free(q->records);
+		free(q);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
+
+/* Writes out what is queued and goes back to synchronous logging */
+void _sc_log_async_stop(sc_context_t *ctx)
+{
+	struct sc_log_queue *q = ctx->log_queue;
+	unsigned int i;
+
+	if (q == NULL)
+		return;
+
+	if (q->pid == getpid()) {
+		pthread_mutex_lock(&q->mutex);
+		q->stop = 1;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->mutex);
+		pthread_join(q->thread, NULL);
+	}
+	ctx->log_queue = NULL;
+
+	/* after a fork() there is no writer, the records just go away */
+	for (i = 0; i < q->count; i++)
+		free(q->records[(q->head + i) % q->size]);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->file_mutex);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->records);
+	free(q);
+}
+
+void _sc_log_file_lock(sc_context_t *ctx)
+{
+	if (ctx->log_queue != NULL && ctx->log_queue->pid == getpid())
+		pthread_mutex_lock(&ctx->log_queue->file_mutex);
+}
+
+void _sc_log_file_unlock(sc_context_t *ctx)
+{
+	if (ctx->log_queue != NULL && ctx->log_queue->pid == getpid())
+		pthread_mutex_unlock(&ctx->log_queue->file_mutex);
+}
+
+/* Whether only the background writer uses ctx->debug_file */
+int _sc_log_owns_file(sc_context_t *ctx)
+{
+	return ctx->log_queue != NULL && ctx->log_queue->pid == getpid();
+}
+
+/* Returns 1 if the message was queued or dropped, 0 to write it here */
+static int sc_log_enqueue(struct sc_log_queue *q, const char *msg, size_t len)
+{
+	char *copy;
+	int newline = len == 0 || msg[len - 1] != '\n';
+
+	/* forked child: the writer thread is gone */
+	if (q->pid != getpid())
+		return 0;
+
+	copy = malloc(len + newline + 1);
+	pthread_mutex_lock(&q->mutex);
+	if (copy == NULL || q->count == q->size) {
+		q->dropped++;
+		pthread_mutex_unlock(&q->mutex);
+		free(copy);
+		return 1;
+	}
+	memcpy(copy, msg, len);
+	if (newline)
+		copy[len++] = '\n';
+	copy[len] = '\0';
+	q->records[(q->head + q->count) % q->size] = copy;
+	q->count++;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	return 1;
+}
+#else
+int _sc_log_async_start(sc_context_t *ctx, unsigned int size)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void _sc_log_async_stop(sc_context_t *ctx)
+{
+}
+
+void _sc_log_file_lock(sc_context_t *ctx)
+{
+}
+
+void _sc_log_file_unlock(sc_context_t *ctx)
+{
+}
+
+int _sc_log_owns_file(sc_context_t *ctx)
+{
+	return 0;
+}
+#endif
+
+/*
+ * Per module debug levels. A module is a source file, named without
+ * directory and extension ("asn1", "reader-pcsc"); a driver name
+ * ("pcsc", "openpgp") stands for its card-<name> and reader-<name> file.
+ */
+#define SC_LOG_MODULE_NAME_LEN	32
+
+struct sc_log_module {
+	char name[SC_LOG_MODULE_NAME_LEN];
+	int level;
+};
+
+static int sc_log_module_match(const struct sc_log_module *m, const char *stem, size_t len)
+{
+	static const char *prefixes[] = { "", "card-", "reader-" };
+	size_t n = strlen(m->name), plen;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+		plen = strlen(prefixes[i]);
+		if (len == plen + n && !strncmp(stem, prefixes[i], plen)
+				&& !strncmp(stem + plen, m->name, n))
+			return 1;
+	}
+	return 0;
+}
+
+int sc_log_module_enabled(sc_context_t *ctx, int level, const char *file)
+{
+	const char *stem, *p, *dot = NULL;
+	int i;
+
+	if (ctx == NULL)
+		return 1;
+	if (file == NULL || ctx->debug_modules == NULL)
+		return ctx->debug >= level;
+
+	for (stem = p = file; *p; p++) {
+		if (*p == '/' || *p == '\\')
+			stem = p + 1;
+		else if (*p == '.')
+			dot = p;
+	}
+	if (dot == NULL || dot < stem)
+		dot = p;
+
+	for (i = 0; i < ctx->debug_module_count; i++)
+		if (sc_log_module_match(&ctx->debug_modules[i], stem, dot - stem))
+			return ctx->debug_modules[i].level >= level;
+	return ctx->debug >= level;
+}
+
+static int sc_log_parse_modules(struct sc_log_module **table, int *count, int *max, const char *spec)
+{
+	struct sc_log_module *modules, m;
+	const char *p = spec, *colon;
+	size_t len;
+	int i;
+
+	while (p && *p) {
+		len = strcspn(p, ", \t");
+		colon = memchr(p, ':', len);
+		if (colon && colon > p && (size_t)(colon - p) < sizeof(m.name)) {
+			memset(&m, 0, sizeof(m));
+			memcpy(m.name, p, colon - p);
+			m.level = atoi(colon + 1);
+			/* the first setting of a module wins */
+			for (i = 0; i < *count; i++)
+				if (!strcmp((*table)[i].name, m.name))
+					break;
+			if (i == *count) {
+				modules = realloc(*table, (*count + 1) * sizeof(m));
+				if (modules == NULL)
+					return SC_ERROR_OUT_OF_MEMORY;
+				modules[(*count)++] = m;
+				*table = modules;
+				if (m.level > *max)
+					*max = m.level;
+			}
+		}
+		p += len;
+		p += strspn(p, ", \t");
+	}
+	return SC_SUCCESS;
+}
+
+int _sc_log_add_modules(sc_context_t *ctx, const char *spec)
+{
+	return sc_log_parse_modules(&ctx->debug_modules, &ctx->debug_module_count,
+			&ctx->debug_modules_max, spec);
+}
+
+/*
+ * Replaces the module levels on a configuration reload, while other
+ * threads may be logging. *old gets the previous table, which the caller
+ * keeps until the context is released. The new table is published before
+ * its count and is never shorter than the old count (the padding has no
+ * name and matches no module), so a lookup meanwhile stays in bounds.
+ */
+int _sc_log_replace_modules(sc_context_t *ctx, const char **specs, size_t n,
+		struct sc_log_module **old)
+{
+	struct sc_log_module *modules = NULL, *p;
+	int count = 0, max = 0, size;
+	size_t i;
+	int r;
+
+	for (i = 0; i < n; i++) {
+		r = sc_log_parse_modules(&modules, &count, &max, specs[i]);
+		if (r != SC_SUCCESS) {
+			free(modules);
+			return r;
+		}
+	}
+	size = count > ctx->debug_module_count ? count : ctx->debug_module_count;
+	if (size > count) {
+		p = realloc(modules, size * sizeof(*p));
+		if (p == NULL) {
+			free(modules);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		memset(p + count, 0, (size - count) * sizeof(*p));
+		modules = p;
+	}
+
+	*old = ctx->debug_modules;
+	ctx->debug_modules = modules;
+	ctx->debug_module_count = count;
+	ctx->debug_modules_max = max;
+	return SC_SUCCESS;
+}
+
+void _sc_log_free_modules(sc_context_t *ctx)
+{
+	free(ctx->debug_modules);
+	ctx->debug_modules = NULL;
+	ctx->debug_module_count = 0;
+	ctx->debug_modules_max = 0;
+}
+
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
 {
 	va_list ap;
@@ -75,7 +413,7 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 
 	assert(ctx != NULL);
 
-	if (ctx->debug < level)
+	if (!sc_log_module_enabled(ctx, level, file))
 		return;
 
 	p = buf;
@@ -124,8 +462,12 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (outf == NULL)
 		return;
 
-	fprintf(outf, "%s", buf);
 	n = strlen(buf);
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (ctx->log_queue != NULL && sc_log_enqueue(ctx->log_queue, buf, n))
+		return;
+#endif
+	fprintf(outf, "%s", buf);
 	if (n == 0 || buf[n-1] != '\n')
 		fprintf(outf, "\n");
 	fflush(outf);
@@ -235,3 +577,158 @@ sc_dump_hex(const u8 * in, size_t count)
 
 	return dump_buf;
 }
+
+/*********************************************************************/
+/*   Startup trace                                                   */
+/*********************************************************************/
+
+#if defined(__GNUC__)
+#define STARTUP_TRACE_NEXT(var)		__sync_fetch_and_add(&(var), 1)
+#define STARTUP_TRACE_BARRIER()		__sync_synchronize()
+#else
+#define STARTUP_TRACE_NEXT(var)		((var)++)
+#define STARTUP_TRACE_BARRIER()
+#endif
+
+#define SC_STARTUP_TRACE_EVENTS		2048
+
+struct sc_startup_trace_event {
+	/* set once the event is complete */
+	int done;
+	unsigned long long ts, dur;
+	unsigned long tid;
+	const char *cat;
+	char name[80];
+};
+
+struct sc_startup_trace {
+	char *filename;
+	unsigned long next;
+	unsigned long dropped;
+	struct sc_startup_trace_event events[SC_STARTUP_TRACE_EVENTS];
+};
+
+int _sc_startup_trace_init(sc_context_t *ctx, const char *filename)
+{
+	struct sc_startup_trace *trace;
+
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	trace->filename = strdup(filename);
+	if (trace->filename == NULL) {
+		free(trace);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	ctx->startup_trace = trace;
+	return SC_SUCCESS;
+}
+
+void _sc_startup_trace_free(sc_context_t *ctx)
+{
+	struct sc_startup_trace *trace = ctx->startup_trace;
+
+	if (trace == NULL)
+		return;
+	sc_startup_trace_write(ctx, NULL);
+	ctx->startup_trace = NULL;
+	free(trace->filename);
+	free(trace);
+}
+
+unsigned long long sc_startup_trace_begin(sc_context_t *ctx)
+{
+	if (ctx == NULL || ctx->startup_trace == NULL)
+		return 0;
+	return _sc_monotonic_usec();
+}
+
+void sc_startup_trace_end(sc_context_t *ctx, unsigned long long start,
+		const char *category, const char *format, ...)
+{
+	struct sc_startup_trace *trace;
+	struct sc_startup_trace_event *ev;
+	unsigned long n;
+	va_list ap;
+
+	if (start == 0 || ctx == NULL || (trace = ctx->startup_trace) == NULL)
+		return;
+	n = STARTUP_TRACE_NEXT(trace->next);
+	if (n >= SC_STARTUP_TRACE_EVENTS) {
+		STARTUP_TRACE_NEXT(trace->dropped);
+		return;
+	}
+	ev = &trace->events[n];
+	ev->ts = start;
+	ev->dur = _sc_monotonic_usec() - start;
+#ifdef _WIN32
+	ev->tid = GetCurrentThreadId();
+#else
+	ev->tid = (unsigned long) pthread_self();
+#endif
+	ev->cat = category;
+	va_start(ap, format);
+	vsnprintf(ev->name, sizeof(ev->name), format, ap);
+	va_end(ap);
+	STARTUP_TRACE_BARRIER();
+	ev->done = 1;
+}
+
+static void sc_startup_trace_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+int sc_startup_trace_write(sc_context_t *ctx, const char *filename)
+{
+	struct sc_startup_trace *trace;
+	unsigned long i, count;
+	FILE *f;
+	int first = 1;
+#ifdef _WIN32
+	unsigned long pid = GetCurrentProcessId();
+#else
+	unsigned long pid = (unsigned long) getpid();
+#endif
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	trace = ctx->startup_trace;
+	if (trace == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (filename == NULL)
+		filename = trace->filename;
+
+	f = fopen(filename, "w");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	count = trace->next < SC_STARTUP_TRACE_EVENTS ? trace->next : SC_STARTUP_TRACE_EVENTS;
+	STARTUP_TRACE_BARRIER();
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i = 0; i < count; i++) {
+		struct sc_startup_trace_event *ev = &trace->events[i];
+
+		if (!ev->done)
+			continue;
+		fprintf(f, "%s{\"name\":", first ? "" : ",\n");
+		sc_startup_trace_string(f, ev->name);
+		fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%lu,\"tid\":%lu}",
+				ev->cat, ev->ts, ev->dur, pid, ev->tid);
+		first = 0;
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"app\":");
+	sc_startup_trace_string(f, ctx->app_name);
+	fprintf(f, ",\"version\":\"%s\",\"dropped\":%lu}}\n", sc_get_version(), trace->dropped);
+	if (fclose(f) != 0)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
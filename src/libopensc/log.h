@@ -44,9 +44,34 @@ enum {
 #define __FUNCTION__ NULL
 #endif
 
+/* The level is checked before the arguments are evaluated, so that
+ * sc_dump_hex(), sc_print_path() and friends cost nothing when the
+ * message would not be written. A NULL ctx still reaches sc_do_log(). */
+/* With per module levels configured (debug_modules), only the levels
+ * some module logs at need the lookup of the calling file */
+#define SC_LOG_ENABLED(ctx, level)	((ctx) == NULL \
+	|| ((ctx)->debug_modules == NULL ? (ctx)->debug >= (level) \
+		: ((ctx)->debug >= (level) || (ctx)->debug_modules_max >= (level)) \
+			&& sc_log_module_enabled((ctx), (level), __FILE__)))
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (SC_LOG_ENABLED((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) do { \
+	if (SC_LOG_ENABLED((ctx), SC_LOG_DEBUG_NORMAL)) \
+		sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#elif defined(_MSC_VER) && (_MSC_VER >= 1400)
+#define sc_debug(ctx, level, ...) do { \
+	if (SC_LOG_ENABLED((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+} while (0)
+#define sc_log(ctx, ...) do { \
+	if (SC_LOG_ENABLED((ctx), SC_LOG_DEBUG_NORMAL)) \
+		sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+} while (0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -55,35 +80,53 @@ enum {
 void sc_do_log(struct sc_context *ctx, int level, const char *file, int line, const char *func, 
 		const char *format, ...);
 void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list args);
+/* level check for a message from the given source file, see SC_LOG_ENABLED */
+int sc_log_module_enabled(struct sc_context *ctx, int level, const char *file);
 void _sc_debug(struct sc_context *ctx, int level, const char *format, ...);
 void _sc_log(struct sc_context *ctx, const char *format, ...);
 
 void sc_hex_dump(struct sc_context *ctx, int level, const u8 * buf, size_t len, char *out, size_t outlen);
 char * sc_dump_hex(const u8 * in, size_t count);
 
+/* configure --disable-function-trace drops the "called" and
+ * "returning with" messages at compile time */
+#ifdef DISABLE_FUNCTION_TRACE
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	(void)(ctx); \
+} while (0)
+
+#define SC_FUNC_RETURN(ctx, level, r) do { \
+	(void)(ctx); \
+	return (r); \
+} while(0)
+#else
+#define SC_FUNC_CALLED(ctx, level) do { \
+	if (SC_LOG_ENABLED((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
-#define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
-	} else { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"returning with: %d\n", _ret); \
+	if (SC_LOG_ENABLED((ctx), (level))) { \
+		if (_ret <= 0) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
+		else \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"returning with: %d\n", _ret); \
 	} \
 	return _ret; \
 } while(0)
+#endif
+#define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 #define LOG_FUNC_RETURN(ctx, r) SC_FUNC_RETURN((ctx), SC_LOG_DEBUG_NORMAL, (r))
 
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED((ctx), (level))) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -0,0 +1,119 @@
+/*
+ * mem.c: memory accounting by subsystem
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ * The counters are per process: the caches, objects and buffers of all
+ * contexts add up. The allocation sites account the sizes they know, so
+ * memory that changes owner (the output of the ASN.1 encoder, say) is
+ * counted once by the subsystem that produced it and is not tracked
+ * further; live and peak then only cover what the subsystem keeps.
+ */
+struct mem_counters {
+	unsigned long live;
+	unsigned long peak;
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long bytes;
+	unsigned long long since;
+};
+
+static struct mem_counters mem_counters[SC_MEM_SUBSYSTEMS];
+
+#if defined(__GNUC__)
+#define mem_add(var, val)	__sync_add_and_fetch(&(var), (val))
+#define mem_sub(var, val)	__sync_sub_and_fetch(&(var), (val))
+
+static void mem_raise_peak(unsigned long *peak, unsigned long live)
+{
+	unsigned long old = *peak;
+
+	while (old < live) {
+		unsigned long seen = __sync_val_compare_and_swap(peak, old, live);
+		if (seen == old)
+			break;
+		old = seen;
+	}
+}
+#else
+#define mem_add(var, val)	((var) += (val))
+#define mem_sub(var, val)	((var) -= (val))
+
+static void mem_raise_peak(unsigned long *peak, unsigned long live)
+{
+	if (*peak < live)
+		*peak = live;
+}
+#endif
+
+void sc_mem_account_alloc(int subsystem, size_t size)
+{
+	struct mem_counters *c;
+
+	if (subsystem < 0 || subsystem >= SC_MEM_SUBSYSTEMS)
+		return;
+	c = &mem_counters[subsystem];
+	if (c->since == 0)
+		c->since = _sc_monotonic_usec();
+	mem_add(c->allocs, 1);
+	mem_add(c->bytes, size);
+	mem_raise_peak(&c->peak, mem_add(c->live, size));
+}
+
+void sc_mem_account_free(int subsystem, size_t size)
+{
+	struct mem_counters *c;
+
+	if (subsystem < 0 || subsystem >= SC_MEM_SUBSYSTEMS)
+		return;
+	c = &mem_counters[subsystem];
+	mem_add(c->frees, 1);
+	mem_sub(c->live, size);
+}
+
+int sc_mem_get_stats(int subsystem, struct sc_mem_stats *stats, int reset)
+{
+	struct mem_counters *c;
+	unsigned long long now = _sc_monotonic_usec();
+
+	if (subsystem < 0 || subsystem >= SC_MEM_SUBSYSTEMS || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	c = &mem_counters[subsystem];
+
+	/* concurrent updates may straddle the copy, the values stay sane */
+	stats->live = c->live;
+	stats->peak = c->peak > stats->live ? c->peak : stats->live;
+	stats->allocs = c->allocs;
+	stats->frees = c->frees;
+	stats->bytes = c->bytes;
+	if (c->since == 0)
+		c->since = now;
+	stats->usec = now - c->since;
+
+	if (reset) {
+		c->allocs = c->frees = c->bytes = 0;
+		c->peak = c->live;
+		c->since = now;
+	}
+	return SC_SUCCESS;
+}
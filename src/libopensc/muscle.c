@@ -68,6 +68,32 @@ int msc_list_objects(sc_card_t* card, u8 next, mscfs_file_t* file) {
 	return 1;
 }
 
+/* Largest object read the reader, the card and the applet all accept */
+static size_t msc_read_unit(sc_card_t *card)
+{
+	size_t unit = sc_get_max_recv_size(card);
+
+	if (unit == 0 || unit > MSC_MAX_OBJECT_UNIT)
+		unit = MSC_MAX_OBJECT_UNIT;
+	return unit;
+}
+
+/* Largest object write, leaving room for the object ID, offset and length */
+static size_t msc_write_unit(sc_card_t *card)
+{
+	size_t unit = card->max_send_size > 0 ? card->max_send_size : 255;
+	if (card->reader->driver->max_send_size > 0
+			&& card->reader->driver->max_send_size < unit)
+		unit = card->reader->driver->max_send_size;
+
+	unit = unit > 9 ? unit - 9 : 1;
+	if (unit > MSC_MAX_OBJECT_UNIT)
+		unit = MSC_MAX_OBJECT_UNIT;
+	if (unit > MSC_MAX_APDU - 9)
+		unit = MSC_MAX_APDU - 9;
+	return unit;
+}
+
 int msc_partial_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength)
 {
 	u8 buffer[9];
@@ -111,7 +137,7 @@ int msc_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size
 {
 	int r;
 	size_t i;
-	size_t max_read_unit = MSC_MAX_READ;
+	size_t max_read_unit = msc_read_unit(card);
 
 	for(i = 0; i < dataLength; i += max_read_unit) {
 		r = msc_partial_read_object(card, objectId, offset + i, data + i, MIN(dataLength - i, max_read_unit));
@@ -124,7 +150,7 @@ int msc_zero_object(sc_card_t *card, msc_id objectId, size_t dataLength)
 {
 	u8 zeroBuffer[MSC_MAX_APDU];
 	size_t i;
-	size_t max_write_unit = MSC_MAX_SEND - 9; /* - 9 for object ID+length */
+	size_t max_write_unit = msc_write_unit(card);
 
 	memset(zeroBuffer, 0, max_write_unit);
 	for(i = 0; i < dataLength; i += max_write_unit) {
@@ -171,7 +197,7 @@ int msc_create_object(sc_card_t *card, msc_id objectId, size_t objectSize, unsig
 	return objectSize;
 }
 
-/* Update up to MSC_MAX_READ - 9 bytes */
+/* Update up to MSC_MAX_OBJECT_UNIT bytes */
 int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, const u8 *data, size_t dataLength)
 {
 	u8 buffer[MSC_MAX_APDU];
@@ -214,7 +240,8 @@ int msc_update_object(sc_card_t *card, msc_id objectId, int offset, const u8 *da
 {
 	int r;
 	size_t i;
-	size_t max_write_unit = MSC_MAX_SEND - 9;
+	size_t max_write_unit = msc_write_unit(card);
+
 	for(i = 0; i < dataLength; i += max_write_unit) {
 		r = msc_partial_update_object(card, objectId, offset + i, data + i, MIN(dataLength - i, max_write_unit));
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Error in partial object update");
@@ -34,6 +34,8 @@
 /* Currently max size handled by muscle driver is 255 ... */
 #define MSC_MAX_READ (card->max_recv_size > 0 ? card->max_recv_size : 255)
 #define MSC_MAX_SEND (card->max_send_size > 0 ? card->max_send_size : 255)
+/* Object read/write commands carry their length in a single byte */
+#define MSC_MAX_OBJECT_UNIT 255
 
 int msc_list_objects(sc_card_t* card, u8 next, mscfs_file_t* file);
 int msc_partial_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength);
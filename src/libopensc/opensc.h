@@ -88,11 +88,17 @@ extern "C" {
 #define SC_ALGORITHM_RSA_RAW		0x00000001
 /* If the card is willing to produce a cryptogram padded with the following
  * methods, set these flags accordingly. */
-#define SC_ALGORITHM_RSA_PADS		0x0000000E
+#define SC_ALGORITHM_RSA_PADS		0x000C000E
 #define SC_ALGORITHM_RSA_PAD_NONE	0x00000000
 #define SC_ALGORITHM_RSA_PAD_PKCS1	0x00000002
 #define SC_ALGORITHM_RSA_PAD_ANSI	0x00000004
 #define SC_ALGORITHM_RSA_PAD_ISO9796	0x00000008
+/* PSS and OAEP take their hash from SC_ALGORITHM_RSA_HASH_* and the MGF1
+ * hash from SC_ALGORITHM_MGF1_* (default: the same hash). The PSS salt is
+ * as long as the hash, the OAEP label is empty. Both are done in software
+ * if the card can do raw RSA. */
+#define SC_ALGORITHM_RSA_PAD_PSS	0x00040000
+#define SC_ALGORITHM_RSA_PAD_OAEP	0x00080000
 
 /* If the card is willing to produce a cryptogram with the following
  * hash values, set these flags accordingly. */
@@ -107,6 +113,13 @@ extern "C" {
 #define SC_ALGORITHM_RSA_HASH_SHA224	0x00001000
 #define SC_ALGORITHM_RSA_HASHES		0x00001FE0
 
+#define SC_ALGORITHM_MGF1_SHA1		0x00100000
+#define SC_ALGORITHM_MGF1_SHA224	0x00200000
+#define SC_ALGORITHM_MGF1_SHA256	0x00400000
+#define SC_ALGORITHM_MGF1_SHA384	0x00800000
+#define SC_ALGORITHM_MGF1_SHA512	0x01000000
+#define SC_ALGORITHM_MGF1S		0x01F00000
+
 #define SC_ALGORITHM_GOSTR3410_RAW		0x00002000
 #define SC_ALGORITHM_GOSTR3410_HASH_NONE	0x00004000
 #define SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411	0x00008000
@@ -242,12 +255,49 @@ struct sc_ef_atr {
 	unsigned status;
 };
 
+#define SC_MAX_CACHED_FCIS	16
+
 struct sc_card_cache {
 	struct sc_path current_path;
 
         struct sc_file *current_ef;
         struct sc_file *current_df;
 
+	/* size of the currently selected EF as learned from its FCI */
+	size_t current_ef_size;
+
+	/* read-ahead buffer of the currently selected EF */
+	u8 *read_ahead;
+	unsigned int read_ahead_idx;
+	size_t read_ahead_len;
+
+	/* UPDATE BINARY data of the current EF not sent yet (coalesce_writes) */
+	u8 *write_buf;
+	unsigned int write_idx;
+	size_t write_len;
+	unsigned long write_flags;
+
+	/* number of APDUs sent to the card */
+	unsigned long apdu_count;
+
+	/* security environment of the last private key operation;
+	 * still current while no other APDU has been sent (pkcs15-sec.c) */
+	struct sc_security_env sec_env;
+	struct sc_path sec_env_path;
+	unsigned long sec_env_apdu_count;
+	unsigned int sec_env_generation;
+	int sec_env_valid;
+
+	/* DF a LIST FILES would refer to, empty if unknown, and the
+	 * listings already received from the card (see sc_list_files()) */
+	struct sc_path list_path;
+	struct sc_file_list *file_lists;
+
+	/* FCIs of recently selected files, by absolute path, shared with
+	 * the callers of sc_select_file() (SC_CARD_CAP_SELECT_CACHE) */
+	struct sc_file *fcis[SC_MAX_CACHED_FCIS];
+	unsigned int fci_next;
+
 	int valid;
 };
 
@@ -272,6 +322,7 @@ struct sc_reader_driver {
 #define SC_READER_CARD_INUSE		0x00000004
 #define SC_READER_CARD_EXCLUSIVE	0x00000008
 #define SC_READER_HAS_WAITING_AREA	0x00000010
+#define SC_READER_CONNECTED_EXCLUSIVE	0x00000020
 
 /* reader capabilities */
 #define SC_READER_CAP_DISPLAY	0x00000001
@@ -281,6 +332,69 @@ struct sc_reader_driver {
 #define SC_READER_CAP_PACE_DESTROY_CHANNEL 0x00000010
 #define SC_READER_CAP_PACE_GENERIC         0x00000020
 
+/* APDU latency histogram: bucket i counts the exchanges that took less
+ * than 2^(i+7) microseconds (128us, 256us, ...), the last bucket the
+ * slower ones */
+#define SC_LATENCY_BUCKETS	16
+#define SC_LATENCY_BUCKET_LIMIT(i)	(1UL << ((i) + 7))
+
+struct sc_ins_stats {
+	unsigned long count;
+	unsigned long long total_usec;
+	unsigned long max_usec;
+};
+
+/* Waits longer than this count as contended, shorter ones are the cost
+ * of taking a free lock */
+#define SC_LOCK_CONTENDED_USEC	1000UL
+
+/* Wait and hold times of a lock, see sc_lock_stats_wait() */
+struct sc_lock_stats {
+	unsigned long acquired;
+	unsigned long contended;
+	unsigned long long wait_usec;
+	unsigned long long hold_usec;
+	unsigned long max_wait_usec;
+	unsigned long max_hold_usec;
+	/* buckets as for the APDU latencies */
+	unsigned long wait_histogram[SC_LATENCY_BUCKETS];
+	unsigned long hold_histogram[SC_LATENCY_BUCKETS];
+};
+
+struct sc_reader_stats {
+	unsigned long apdus;
+	unsigned long errors;
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	unsigned long long total_usec;
+	unsigned long histogram[SC_LATENCY_BUCKETS];
+	/* indexed by the INS byte of the command */
+	struct sc_ins_stats ins[256];
+	/* sc_lock() to the matching sc_unlock() of the cards in the reader */
+	struct sc_lock_stats card_lock;
+	/* reader driver lock, e.g. the PC/SC transaction */
+	struct sc_lock_stats transaction;
+};
+
+/* Subsystems whose memory is accounted, see sc_mem_get_stats() */
+#define SC_MEM_ASN1		0	/* encodings and decoded values */
+#define SC_MEM_PKCS15		1	/* PKCS#15 objects of the bound cards */
+#define SC_MEM_PKCS11_OBJECTS	2	/* PKCS#11 objects of the tokens */
+#define SC_MEM_PKCS11_SESSIONS	3	/* PKCS#11 sessions and their operations */
+#define SC_MEM_READER		4	/* reader driver transfer buffers */
+#define SC_MEM_SM		5	/* secure messaging APDUs and buffers */
+#define SC_MEM_CACHE		6	/* file contents and lists cached in memory */
+#define SC_MEM_SUBSYSTEMS	7
+
+struct sc_mem_stats {
+	unsigned long live;		/* bytes held now */
+	unsigned long peak;		/* most bytes held since the last reset */
+	unsigned long long allocs;	/* allocations since the last reset */
+	unsigned long long frees;
+	unsigned long long bytes;	/* bytes allocated since the last reset */
+	unsigned long long usec;	/* time covered by allocs, frees and bytes */
+};
+
 typedef struct sc_reader {
 	struct sc_context *ctx;
 	const struct sc_reader_driver *driver;
@@ -291,6 +405,20 @@ typedef struct sc_reader {
 	unsigned long flags, capabilities;
 	unsigned int supported_protocols, active_protocol;
 
+	/* incremented whenever the card was inserted, removed, exchanged
+	 * or reset; state read from the card is only current while this
+	 * is unchanged */
+	unsigned int card_generation;
+	/* an APDU overran the transmit_timeout of the reader driver and is
+	 * still stuck, other callers fail with SC_ERROR_CARD_UNRESPONSIVE */
+	int degraded;
+	/* connection shared by the users of a shared context, see sc_connect_card() */
+	struct sc_card *shared_card;
+
+	/* APDU counters and latencies, see sc_ctx_get_reader_stats().
+	 * Allocated by _sc_add_reader(), the per-INS table is large. */
+	struct sc_reader_stats *stats;
+
 	struct sc_atr atr;
 	struct _atr_info {
 		u8 *hist_bytes;
@@ -298,6 +426,10 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	/* the last command written to the APDU transcript was redacted,
+	 * so are the GET RESPONSE commands that follow it */
+	int record_redacted;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -317,6 +449,11 @@ typedef struct sc_reader {
 #define SC_PIN_ENCODING_BCD	1
 #define SC_PIN_ENCODING_GLP	2 /* Global Platform - Card Specification v2.0.1 */
 
+/* Verification state of a PIN, as reported by SC_PIN_CMD_GET_INFO */
+#define SC_PIN_STATE_UNKNOWN	0
+#define SC_PIN_STATE_LOGGED_OUT	1
+#define SC_PIN_STATE_LOGGED_IN	2
+
 struct sc_pin_cmd_pin {
 	const char *prompt;	/* Prompt to display */
 
@@ -333,6 +470,7 @@ struct sc_pin_cmd_pin {
 
 	int max_tries;	/* Used for signaling back from SC_PIN_CMD_GET_INFO */
 	int tries_left;	/* Used for signaling back from SC_PIN_CMD_GET_INFO */
+	int logged_in;	/* Used for signaling back from SC_PIN_CMD_GET_INFO */
 
 	struct sc_acl_entry acls[SC_MAX_SDO_ACLS];
 };
@@ -454,6 +592,16 @@ struct sc_reader_operations {
 	int (*reset)(struct sc_reader *, int);
 	/* Used to pass in PC/SC handles to minidriver */
 	int (*use_reader)(struct sc_context *ctx, void *pcsc_context_handle, void *pcsc_card_handle);
+	/* Optional: send several independent APDUs in one go. Called with
+	 * the card locked; the driver fills in the SW and resplen of each
+	 * APDU and returns the number of APDUs sent or an error code. */
+	int (*transmit_batch)(struct sc_reader *reader, sc_apdu_t *apdus, size_t count);
+	/* Optional: update the card state of all readers at once. The
+	 * next detect_card_presence() of each reader returns that state. */
+	int (*refresh_readers)(struct sc_context *ctx);
+	/* Optional: called in the child after fork(). Forgets the handles
+	 * of the parent without using them and gets new ones. */
+	int (*forked)(struct sc_context *ctx);
 };
 
 /*
@@ -495,6 +643,17 @@ struct sc_reader_operations {
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
 
+/* The card layer keeps track of the current DF and EF, skips SELECTs
+ * of files already selected and turns absolute paths into paths
+ * relative to the current DF. The driver's select_file() has to
+ * handle relative SC_PATH_TYPE_PATH paths as iso7816_select_file()
+ * does, and must not use card->cache itself. */
+#define SC_CARD_CAP_SELECT_CACHE		0x00000100
+
+/* READ RECORD with SC_RECORD_TO_LAST returns all the records from the
+ * given one up to the last, one after the other. */
+#define SC_CARD_CAP_READ_RECORDS		0x00000200
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -503,9 +662,19 @@ typedef struct sc_card {
 
 	int type;			/* Card type, for card driver internal use */
 	unsigned long caps, flags;
+	/* reader->card_generation this card belongs to */
+	unsigned int card_generation;
+	/* number of sc_connect_card() callers of a shared context, 0 otherwise */
+	unsigned int shared_refs;
 	int cla;
 	size_t max_send_size; /* Max Lc supported by the card */
 	size_t max_recv_size; /* Max Le supported by the card */
+	/* chunk sizes learned with adaptive_apdu_size, 0 if not learned */
+	size_t tuned_send_size, tuned_recv_size;
+	int tuned_sizes_changed;
+	/* whole buffer of the running sc_read_binary(), the driver may
+	 * receive into it with SC_APDU_FLAGS_RESP_SLACK where it has room */
+	u8 *read_buf, *read_buf_end;
 
 	struct sc_app_info *app[SC_MAX_CARD_APPS];
 	int app_count;
@@ -515,8 +684,18 @@ typedef struct sc_card {
 
 	struct sc_algorithm_info *algorithms;
 	int algorithm_count;
+	/* algorithms sorted by type and key length, see sc_card_find_alg() */
+	struct sc_algorithm_info **algorithm_index;
+	int algorithm_index_count;
 
 	int lock_count;
+	/* when lock_count went from 0 to 1, for reader->stats->card_lock */
+	unsigned long long lock_acquired;
+
+	/* ISO 7816-4 logical channel the CLA of every APDU is coded for,
+	 * and a bit mask of the channels opened with MANAGE CHANNEL */
+	int logical_channel;
+	unsigned long logical_channels;
 
 	struct sc_card_driver *driver;
 	struct sc_card_operations *ops;
@@ -525,6 +704,10 @@ typedef struct sc_card {
 	int max_pin_len;
 
 	struct sc_card_cache cache;
+	/* counter of the card in ctx->shared_generations, NULL if not
+	 * shared, and its value when the caches were last valid */
+	unsigned int *shared_generation;
+	unsigned int shared_generation_seen;
 
 	struct sc_serial_number serialnr;
 	struct sc_version version;
@@ -694,9 +877,20 @@ typedef struct sc_context {
 	int debug;
 	int paranoid_memory;
 	int enable_default_driver;
+	int read_ahead;
+	int coalesce_writes;
+	int adaptive_apdu_size;
+	int cache_ef_dir;
+	int shared_card_generations;
 
 	FILE *debug_file;
 	char *debug_filename;
+	/* levels of single modules overriding debug, see log.c */
+	struct sc_log_module *debug_modules;
+	int debug_module_count;
+	int debug_modules_max;
+	/* background writer of the debug log, see async_debug */
+	struct sc_log_queue *log_queue;
 	char *preferred_language;
 
 	list_t readers;
@@ -706,10 +900,35 @@ typedef struct sc_context {
 
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
+	struct sc_atr_index *atr_index;
+	/* builtin PKCS#15 emulator that bound each ATR, see pkcs15-syn.c */
+	struct sc_emu_cache *emu_cache;
+	/* options of the "framework pkcs15" block, see sc_pkcs15_bind() */
+	struct sc_pkcs15_conf *pkcs15_conf;
+	/* counters of the cards shared between processes, see coherency.c */
+	unsigned int *shared_generations;
+	int shared_generations_failed;
+
+	/* binary APDU trace, see sc_apdu_trace_dump() */
+	struct sc_apdu_trace *apdu_trace;
+	char *apdu_trace_file;
+	/* transcript for the replay reader driver, see reader-replay.c */
+	struct sc_apdu_recorder *apdu_record;
+	/* durations of the startup phases, see sc_startup_trace_write() */
+	struct sc_startup_trace *startup_trace;
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
 
+	/* number of sc_context_create() callers sharing the context, 0 if
+	 * not created with SC_CTX_FLAG_SHARED */
+	unsigned int shared_refs;
+	struct sc_context *next_shared;
+	/* process the reader connections belong to, see sc_ctx_reinit_after_fork() */
+	unsigned long pid;
+	/* configurations replaced by sc_ctx_reload_config() */
+	struct sc_retired_conf *retired_confs;
+
 	unsigned int magic;
 } sc_context_t;
 
@@ -722,6 +941,17 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *, struct sc_apdu *);
 
+/** Sends several independent APDUs to the card while holding the card
+ *  lock once. If the reader driver supports batched transmission the
+ *  APDUs are handed over in one call, otherwise they are sent one by one.
+ *  The status words of each APDU are left to the caller to check.
+ *  @param  card   struct sc_card object to which the APDUs should be send
+ *  @param  apdus  array of sc_apdu_t objects
+ *  @param  count  number of APDUs in the array
+ *  @return SC_SUCCESS on succcess and an error code otherwise
+ */
+int sc_transmit_apdus(struct sc_card *, struct sc_apdu *, size_t);
+
 void sc_format_apdu(struct sc_card *, struct sc_apdu *, int, int, int, int);
 
 int sc_check_apdu(struct sc_card *, const struct sc_apdu *);
@@ -767,12 +997,18 @@ typedef struct {
 	 *  dependend configuration data). If NULL the name "default"
 	 *  will be used. */
 	const char    *app_name;
-	/** flags, currently unused */
+	/** flags, see SC_CTX_FLAG_* */
 	unsigned long flags;
 	/** mutex functions to use (optional) */
 	sc_thread_context_t *thread_ctx;
 } sc_context_param_t;
 
+/** Share the context with the other callers in the process that pass
+ *  this flag and the same application name. The context and its card
+ *  connections are reference counted, sc_release_context() and
+ *  sc_disconnect_card() only free them when the last user is gone. */
+#define SC_CTX_FLAG_SHARED	0x00000001
+
 /**
  * Repairs an already existing sc_context_t object. This may occur if
  * multithreaded issues mean that another context in the same heap is deleted.
@@ -806,6 +1042,34 @@ int sc_release_context(sc_context_t *ctx);
  */
 int sc_ctx_detect_readers(sc_context_t *ctx);
 
+/**
+ * Makes a context inherited through fork() usable in the child. The
+ * configuration, the card drivers and the readers are kept, the reader
+ * driver replaces the handles of the parent. Cards connected in the
+ * parent must be disconnected by the child, their handles are invalid.
+ * @param  ctx  OpenSC context
+ * @return SC_SUCCESS on success, SC_ERROR_NOT_SUPPORTED if the reader
+ *         driver cannot do this and the context has to be released.
+ */
+int sc_ctx_reinit_after_fork(sc_context_t *ctx);
+
+/**
+ * Reads the configuration file again and applies the options that are
+ * safe to change while cards are connected: the debug level and module
+ * levels, the debug file (only with async_debug, where no other thread
+ * writes to it directly), read_ahead, coalesce_writes,
+ * adaptive_apdu_size, cache_ef_dir, paranoid-memory,
+ * enable_default_driver and the max_send_size / max_recv_size of the
+ * reader driver, which take effect at the next card connect. The
+ * "framework pkcs15" options are resolved again by the next
+ * sc_pkcs15_bind(), see sc_pkcs15_reload_options() for the cards
+ * already bound. Card drivers and readers are kept as they are.
+ * @param  ctx  OpenSC context
+ * @return SC_SUCCESS on success, SC_ERROR_INVALID_DATA if the file
+ *         cannot be parsed, in which case the configuration is unchanged.
+ */
+int sc_ctx_reload_config(sc_context_t *ctx);
+
 /**
  * Returns a pointer to the specified sc_reader_t object
  * @param  ctx  OpenSC context
@@ -851,6 +1115,128 @@ sc_reader_t *sc_ctx_get_reader_by_id(sc_context_t *ctx, unsigned int id);
  */
 unsigned int sc_ctx_get_reader_count(sc_context_t *ctx);
 
+/**
+ * Loads a card driver of ctx->card_drivers: the drivers are only
+ * listed by name when the context is created and are set up when they
+ * are first tried on a card. Until then only short_name is valid and
+ * ops is NULL.
+ * @param  ctx     OpenSC context
+ * @param  driver  an entry of ctx->card_drivers
+ * @return SC_SUCCESS if the driver is usable, an error code otherwise
+ */
+int sc_ctx_load_card_driver(sc_context_t *ctx, struct sc_card_driver *driver);
+
+/**
+ * Copies the APDU counters and latency histograms collected for a reader
+ * since it was added to the context or since the last reset
+ * @param  ctx    OpenSC context
+ * @param  i      number of the reader (starting with 0)
+ * @param  stats  receives the statistics
+ * @param  reset  if not 0, the counters of the reader are cleared
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_ctx_get_reader_stats(sc_context_t *ctx, unsigned int i,
+		struct sc_reader_stats *stats, int reset);
+
+/**
+ * Memory accounting: the allocation sites of the library and of its
+ * users report the memory they take and give back for a subsystem.
+ * @param  subsystem  SC_MEM_*
+ * @param  size       bytes allocated or released
+ */
+void sc_mem_account_alloc(int subsystem, size_t size);
+void sc_mem_account_free(int subsystem, size_t size);
+
+/**
+ * Copies the memory counters of a subsystem. The live bytes are those
+ * accounted since the process started, the other counters those since
+ * the last reset.
+ * @param  subsystem  SC_MEM_*
+ * @param  stats      receives the counters
+ * @param  reset      if not 0, the counters are cleared and the peak
+ *                    starts again from the live bytes
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_mem_get_stats(int subsystem, struct sc_mem_stats *stats, int reset);
+
+/**
+ * Lock contention accounting, for the locks of the library and of its
+ * users. The caller serializes the updates of one sc_lock_stats or
+ * accepts that concurrent ones may get lost.
+ *
+ *   start = sc_lock_stats_begin();
+ *   lock(...);
+ *   acquired = sc_lock_stats_wait(&stats, start);
+ *   ...
+ *   sc_lock_stats_release(&stats, acquired);
+ *   unlock(...);
+ *
+ * @return sc_lock_stats_begin() and sc_lock_stats_wait() return the
+ *         current time, in microseconds from an arbitrary origin
+ */
+unsigned long long sc_lock_stats_begin(void);
+unsigned long long sc_lock_stats_wait(struct sc_lock_stats *stats,
+		unsigned long long start);
+void sc_lock_stats_release(struct sc_lock_stats *stats,
+		unsigned long long acquired);
+
+/* APDU trace dump format, all numbers big endian:
+ *   "OSCAPDUT", u32 version, u32 reader count,
+ *   per reader: u16 name length, name,
+ *   u32 record count, per record (oldest first):
+ *     u32 seconds, u32 microseconds, u32 sequence number,
+ *     u8 reader index (0xFF if unknown), u8 direction, u8 flags,
+ *     u8 stored length, u16 SW (responses), u16 APDU length,
+ *     stored bytes (at most SC_APDU_TRACE_DATA_LEN)
+ * Commands are stored as CLA INS P1 P2 followed by the command data,
+ * responses as the response data without SW. */
+#define SC_APDU_TRACE_MAGIC		"OSCAPDUT"
+#define SC_APDU_TRACE_VERSION		1
+#define SC_APDU_TRACE_DATA_LEN		64
+#define SC_APDU_TRACE_COMMAND		0
+#define SC_APDU_TRACE_RESPONSE		1
+/* the data were left out, e.g. a PIN or a decrypted key */
+#define SC_APDU_TRACE_FLAG_REDACTED	0x01
+/* only the first SC_APDU_TRACE_DATA_LEN bytes were stored */
+#define SC_APDU_TRACE_FLAG_TRUNCATED	0x02
+/* the reader driver failed to transmit */
+#define SC_APDU_TRACE_FLAG_ERROR	0x04
+
+/**
+ * Writes the APDU trace ring buffer (configured with apdu_trace) to a
+ * file in the format above. It is also written to apdu_trace_file
+ * whenever the transmission of an APDU fails.
+ * @param  ctx       OpenSC context
+ * @param  filename  file to write, NULL for apdu_trace_file
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_trace_dump(sc_context_t *ctx, const char *filename);
+
+/**
+ * Startup trace: with startup_trace_file (or the OPENSC_STARTUP_TRACE
+ * environment variable) set, the context records how long the phases
+ * of its creation, each reader and card driver, each card connection
+ * and each PKCS#15 bind step take. Measure a step with
+ *   start = sc_startup_trace_begin(ctx);
+ *   ...
+ *   sc_startup_trace_end(ctx, start, "category", "name %s", arg);
+ * sc_startup_trace_begin() returns 0, and sc_startup_trace_end() does
+ * nothing, when the trace is disabled.
+ */
+unsigned long long sc_startup_trace_begin(sc_context_t *ctx);
+void sc_startup_trace_end(sc_context_t *ctx, unsigned long long start,
+		const char *category, const char *format, ...);
+
+/**
+ * Writes the startup trace as Chrome trace event JSON, which
+ * chrome://tracing and similar viewers load. It is also written to
+ * startup_trace_file when the context is released.
+ * @param  ctx       OpenSC context
+ * @param  filename  file to write, NULL for startup_trace_file
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_startup_trace_write(sc_context_t *ctx, const char *filename);
+
 /**
  * Redirects OpenSC debug log to the specified file
  * @param  ctx existing OpenSC context
@@ -892,6 +1278,16 @@ int sc_disconnect_card(struct sc_card *card);
  */
 int sc_detect_card_presence(sc_reader_t *reader);
 
+/**
+ * Updates the card state of all readers with one call to the reader
+ * driver, so that checking many readers with sc_detect_card_presence()
+ * right after this does not query each reader separately.
+ * NOTE: only PC/SC backend implements this function.
+ * @param ctx pointer to application context
+ * @retval SC_SUCCESS on success
+ */
+int sc_refresh_readers(sc_context_t *ctx);
+
 /**
  * Waits for an event on readers. Note: only the event is detected,
  * there is no update of any card or other info.
@@ -944,6 +1340,60 @@ int sc_lock(struct sc_card *card);
  */
 int sc_unlock(struct sc_card *card);
 
+/* Logical channels 0-3 use the first, 4-19 the further interindustry
+ * class byte coding of ISO 7816-4 */
+#define SC_MAX_LOGICAL_CHANNELS	20
+
+/**
+ * Opens a new logical channel with MANAGE CHANNEL OPEN. The channel is
+ * only used once it was made current with sc_set_logical_channel().
+ * @param  card     The card
+ * @param  channel  receives the number of the channel the card opened
+ * @retval SC_SUCCESS on success
+ */
+int sc_open_logical_channel(struct sc_card *card, int *channel);
+/**
+ * Closes a logical channel opened with sc_open_logical_channel(). If it
+ * is the current channel, the basic channel becomes current again.
+ * @param  card     The card
+ * @param  channel  number of the channel
+ * @retval SC_SUCCESS on success
+ */
+int sc_close_logical_channel(struct sc_card *card, int channel);
+/**
+ * Selects the logical channel the following APDUs are sent on; the CLA
+ * byte of each APDU is recoded for it. The selected files differ per
+ * channel, so switching the channel invalidates the select cache. The
+ * caller should hold sc_lock() for as long as it uses the channel.
+ * @param  card     The card
+ * @param  channel  0 for the basic channel or an open channel
+ * @return the previously current channel or an error code
+ */
+int sc_set_logical_channel(struct sc_card *card, int channel);
+
+/**
+ * Forgets everything cached about the currently selected files.
+ * @param  card  The card
+ */
+void sc_invalidate_cache(struct sc_card *card);
+/**
+ * Discards the read-ahead buffer of the currently selected EF.
+ * @param  card  The card
+ */
+void sc_drop_read_ahead(struct sc_card *card);
+/**
+ * Returns the largest Le the card and the reader can handle, taking
+ * extended length APDUs into account.
+ * @param  card  The card
+ */
+size_t sc_get_max_recv_size(const struct sc_card *card);
+/**
+ * Returns the largest Lc the card and the reader can handle, taking
+ * extended length APDUs into account.
+ * @param  card  The card
+ */
+size_t sc_get_max_send_size(const struct sc_card *card);
+
 
 /********************************************************************/
 /*                ISO 7816-4 related functions                      */
@@ -953,7 +1403,9 @@ int sc_unlock(struct sc_card *card);
  * Does the equivalent of ISO 7816-4 command SELECT FILE.
  * @param  card  struct sc_card object on which to issue the command
  * @param  path  The path, file id or name of the desired file
- * @param  file  If not NULL, will receive a pointer to a new structure
+ * @param  file  If not NULL, will receive a pointer to a new structure.
+ *               With SC_CARD_CAP_SELECT_CACHE the structure may be shared
+ *               with the card's FCI cache: sc_file_dup() it to modify it.
  * @return SC_SUCCESS on success and an error code otherwise
  */
 int sc_select_file(struct sc_card *card, const sc_path_t *path,
@@ -996,10 +1448,22 @@ int sc_write_binary(struct sc_card *card, unsigned int idx, const u8 * buf,
  * @param  buf    buffer with the new data
  * @param  count  number of bytes to update
  * @param  flags  flags for the UPDATE BINARY command (currently not used)
- * @return number of bytes writen or an error code
+ * @return number of bytes writen or an error code. With 'coalesce_writes'
+ *         the data may only be held back when this returns; callers that
+ *         need it on the card call sc_flush_writes() and check its result
  */
 int sc_update_binary(struct sc_card *card, unsigned int idx, const u8 * buf,
 		     size_t count, unsigned long flags);
+/**
+ * Sends the UPDATE BINARY data held back with the 'coalesce_writes'
+ * option. This is done anyway before the next APDU, a change of the
+ * selected file or logical channel, a reset and when the card is
+ * unlocked, but only the return value of this function tells whether
+ * the data reached the card.
+ * @param  card  struct sc_card object on which to issue the command
+ * @return SC_SUCCESS or the error of the held back update
+ */
+int sc_flush_writes(struct sc_card *card);
 
 /**
  * Sets (part of) the content fo an EF to its logical erased state
@@ -1020,6 +1484,9 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx,
 #define SC_RECORD_BY_REC_NR		0x00100UL
 /** use currently selected record */
 #define SC_RECORD_CURRENT		0UL
+/** with SC_RECORD_BY_REC_NR: from the specified record up to the last,
+ * see SC_CARD_CAP_READ_RECORDS */
+#define SC_RECORD_TO_LAST		0x00200UL
 
 /**
  * Reads a record from the current (i.e. selected) file.
@@ -1030,6 +1497,27 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx,
  * @param  flags   flags (may contain a short file id of a file to select)
  * @retval number of bytes read or an error value
  */
+/** number of the last record of a file, see sc_read_records() */
+#define SC_MAX_RECORD_NR		254
+
+/**
+ * Reads several records of the current (i.e. selected) file while
+ * holding the card lock once. With SC_CARD_CAP_READ_RECORDS and records
+ * that are each one TLV object, they are read with one READ RECORD;
+ * otherwise one READ RECORD per record, sent as a batch if the driver
+ * reads records the ISO 7816 way.
+ * @param  card    struct sc_card object on which to issue the command
+ * @param  rec_nr  number of the first record, starting from 1
+ * @param  count   number of records to read, 0 for all up to the last
+ * @param  buf     buffer for the records: each one is preceded by its
+ *                 length in two bytes, most significant first
+ * @param  buflen  size of buf; on return, the number of bytes used
+ * @param  flags   flags (may contain a short file id of a file to select)
+ * @retval number of records read or an error value
+ */
+int sc_read_records(struct sc_card *card, unsigned int rec_nr, unsigned int count,
+		u8 *buf, size_t *buflen, unsigned long flags);
+
 int sc_read_record(struct sc_card *card, unsigned int rec_nr, u8 * buf,
 		   size_t count, unsigned long flags);
 /**
@@ -1122,10 +1610,25 @@ int sc_delete_file(struct sc_card *card, const sc_path_t *path);
 /* Card controls */
 int sc_card_ctl(struct sc_card *card, unsigned long command, void *arg);
 
+/**
+ * Reads the counter of the card that every process with
+ * 'shared_card_generations' increments when writing to the card.
+ * @param  card        struct sc_card object
+ * @param  generation  receives the current value
+ * @return SC_SUCCESS, or SC_ERROR_NOT_SUPPORTED if the card has no
+ *         shared counter
+ */
+int sc_card_shared_generation(struct sc_card *card, unsigned int *generation);
+
 int sc_file_valid(const sc_file_t *file);
 sc_file_t * sc_file_new(void);
 void sc_file_free(sc_file_t *file);
 void sc_file_dup(sc_file_t **dest, const sc_file_t *src);
+/**
+ * Takes another reference to a file; each one is released with
+ * sc_file_free(). The file is shared, not copied.
+ */
+sc_file_t * sc_file_ref(sc_file_t *file);
 
 int sc_file_add_acl_entry(sc_file_t *file, unsigned int operation,
 			  unsigned int method, unsigned long key_ref);
@@ -1256,6 +1759,10 @@ int sc_valid_oid(const struct sc_object_id *oid);
 int sc_base64_encode(const u8 *in, size_t inlen, u8 *out, size_t outlen,
 		     size_t linelength);
 int sc_base64_decode(const char *in, u8 *out, size_t outlen);
+/* Writes the same text as sc_base64_encode() to 'outf', without
+ * buffering the whole result */
+int sc_base64_encode_file(FILE *outf, const u8 *in, size_t inlen,
+		     size_t linelength);
 
 /**
  * Clears a memory buffer (note: when OpenSSL is used this is
@@ -1264,7 +1771,19 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen);
  * @param  len  length of the memory buffer
  */
 void sc_mem_clear(void *ptr, size_t len);
+/**
+ * Allocates zeroed memory that is not swapped out, for PINs and keys.
+ * Small buffers come from a pool of locked slots.
+ * @param  ctx  OpenSC context, may be NULL
+ * @param  len  size of the buffer
+ */
 void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len);
+/**
+ * Wipes and releases memory from sc_mem_alloc_secure().
+ * @param  ptr  pointer to the memory buffer, may be NULL
+ * @param  len  length passed to sc_mem_alloc_secure()
+ */
+void sc_mem_free_secure(void *ptr, size_t len);
 int sc_mem_reverse(unsigned char *buf, size_t len);
 
 int sc_get_cache_dir(sc_context_t *ctx, char *buf, size_t bufsize);
@@ -24,6 +24,11 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#endif
+
 #include "internal.h"
 
 /* TODO doxygen comments */
@@ -228,6 +233,220 @@ int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 	return SC_ERROR_INTERNAL;
 }
 
+#ifdef ENABLE_OPENSSL
+/* PSS and OAEP (PKCS#1 v2.1) */
+
+static const EVP_MD *hash_flag_to_md(unsigned long hash)
+{
+	switch (hash) {
+	case SC_ALGORITHM_RSA_HASH_SHA1:
+	case SC_ALGORITHM_MGF1_SHA1:
+		return EVP_sha1();
+#if OPENSSL_VERSION_NUMBER >= 0x00908000L
+	case SC_ALGORITHM_RSA_HASH_SHA224:
+	case SC_ALGORITHM_MGF1_SHA224:
+		return EVP_sha224();
+	case SC_ALGORITHM_RSA_HASH_SHA256:
+	case SC_ALGORITHM_MGF1_SHA256:
+		return EVP_sha256();
+	case SC_ALGORITHM_RSA_HASH_SHA384:
+	case SC_ALGORITHM_MGF1_SHA384:
+		return EVP_sha384();
+	case SC_ALGORITHM_RSA_HASH_SHA512:
+	case SC_ALGORITHM_MGF1_SHA512:
+		return EVP_sha512();
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/* get the message hash and the MGF1 hash out of the flags */
+static int get_pkcs1_v2_hashes(unsigned long flags, unsigned long def_hash,
+	const EVP_MD **md, const EVP_MD **mgf_md)
+{
+	unsigned long hash = flags & SC_ALGORITHM_RSA_HASHES;
+	unsigned long mgf = flags & SC_ALGORITHM_MGF1S;
+
+	if (hash == 0)
+		hash = def_hash;
+	*md = hash_flag_to_md(hash);
+	*mgf_md = mgf ? hash_flag_to_md(mgf) : *md;
+	if (*md == NULL || *mgf_md == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	return SC_SUCCESS;
+}
+
+/* XOR out with MGF1(seed) */
+static int mgf1_xor(const EVP_MD *md, u8 *out, size_t out_len,
+	const u8 *seed, size_t seed_len)
+{
+	EVP_MD_CTX *md_ctx;
+	u8 c[4], mask[EVP_MAX_MD_SIZE];
+	unsigned int mask_len;
+	unsigned long counter;
+	size_t i, done = 0;
+	int r = SC_SUCCESS;
+
+	md_ctx = EVP_MD_CTX_create();
+	if (md_ctx == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (counter = 0; done < out_len; counter++) {
+		c[0] = (counter >> 24) & 0xFF;
+		c[1] = (counter >> 16) & 0xFF;
+		c[2] = (counter >> 8) & 0xFF;
+		c[3] = counter & 0xFF;
+		if (!EVP_DigestInit_ex(md_ctx, md, NULL)
+				|| !EVP_DigestUpdate(md_ctx, seed, seed_len)
+				|| !EVP_DigestUpdate(md_ctx, c, sizeof(c))
+				|| !EVP_DigestFinal_ex(md_ctx, mask, &mask_len)) {
+			r = SC_ERROR_INTERNAL;
+			break;
+		}
+		for (i = 0; i < mask_len && done < out_len; i++, done++)
+			out[done] ^= mask[i];
+	}
+	EVP_MD_CTX_destroy(md_ctx);
+	sc_mem_clear(mask, sizeof(mask));
+	return r;
+}
+
+/* EMSA-PSS encoding of a message hash, the salt is as long as the hash.
+ * The modulus is assumed to have mod_length * 8 bits. */
+static int sc_pkcs1_add_pss_padding(unsigned long flags, const u8 *in, size_t in_len,
+	u8 *out, size_t *out_len, size_t mod_length)
+{
+	const EVP_MD *md, *mgf_md;
+	u8 mp[8 + 2 * EVP_MAX_MD_SIZE], h[EVP_MAX_MD_SIZE];
+	unsigned int h_len;
+	size_t s_len, db_len;
+	int r;
+
+	r = get_pkcs1_v2_hashes(flags, 0, &md, &mgf_md);
+	if (r != SC_SUCCESS)
+		return r;
+	s_len = EVP_MD_size(md);
+	if (in_len != s_len || mod_length < in_len + s_len + 2)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (*out_len < mod_length)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	/* H = Hash(00 00 00 00 00 00 00 00 || mHash || salt) */
+	memset(mp, 0, 8);
+	memcpy(mp + 8, in, in_len);
+	if (RAND_bytes(mp + 8 + in_len, s_len) != 1)
+		return SC_ERROR_INTERNAL;
+	if (!EVP_Digest(mp, 8 + in_len + s_len, h, &h_len, md, NULL))
+		return SC_ERROR_INTERNAL;
+
+	/* EM = maskedDB || H || 0xbc with DB = PS || 0x01 || salt */
+	db_len = mod_length - h_len - 1;
+	memset(out, 0, db_len - s_len - 1);
+	out[db_len - s_len - 1] = 0x01;
+	memcpy(out + db_len - s_len, mp + 8 + in_len, s_len);
+	memcpy(out + db_len, h, h_len);
+	out[mod_length - 1] = 0xbc;
+	r = mgf1_xor(mgf_md, out, db_len, h, h_len);
+	/* clear the leftmost bit, emBits is one less than the modulus */
+	out[0] &= 0x7F;
+
+	sc_mem_clear(mp, sizeof(mp));
+	*out_len = mod_length;
+	return r;
+}
+
+/* remove EME-OAEP padding with an empty label */
+/* All ones if x, a byte value, is zero, else zero; without branches */
+static unsigned int
+ct_is_zero(unsigned int x)
+{
+	return 0U - ((x - 1U) >> (sizeof(unsigned int) * 8 - 1));
+}
+
+int
+sc_pkcs1_strip_oaep_padding(sc_context_t *ctx, unsigned long flags,
+		const u8 *data, size_t len, size_t mod_length,
+		u8 *out, size_t *out_len)
+{
+	const EVP_MD *md, *mgf_md;
+	u8 *em, lhash[EVP_MAX_MD_SIZE];
+	unsigned int h_len, diff, good, found, zero, one, start;
+	size_t i, n;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (data == NULL || len > mod_length)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
+
+	r = get_pkcs1_v2_hashes(flags, SC_ALGORITHM_RSA_HASH_SHA1, &md, &mgf_md);
+	LOG_TEST_RET(ctx, r, "unsupported OAEP hash");
+	if (!EVP_Digest("", 0, lhash, &h_len, md, NULL))
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
+	if (mod_length < 2 * h_len + 2)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
+
+	/* the card may have dropped leading zero bytes */
+	em = calloc(1, mod_length);
+	if (em == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(em + mod_length - len, data, len);
+
+	/* EM = Y || maskedSeed || maskedDB */
+	r = mgf1_xor(mgf_md, em + 1, h_len, em + 1 + h_len, mod_length - h_len - 1);
+	if (r == SC_SUCCESS)
+		r = mgf1_xor(mgf_md, em + 1 + h_len, mod_length - h_len - 1, em + 1, h_len);
+	if (r != SC_SUCCESS)
+		goto err;
+
+	/* DB = lHash || PS || 0x01 || M. All of it is checked in constant
+	 * time before failing once, so that the timing does not tell which
+	 * part was wrong. */
+	for (diff = em[0], i = 0; i < h_len; i++)
+		diff |= em[1 + h_len + i] ^ lhash[i];
+	good = ct_is_zero(diff);
+	found = 0;
+	start = 0;
+	for (i = 1 + 2 * h_len; i < mod_length; i++) {
+		zero = ct_is_zero(em[i]);
+		one = ct_is_zero(em[i] ^ 0x01);
+		start |= ~found & one & (unsigned int)i;
+		/* up to the first 0x01, PS is zero bytes */
+		good &= found | zero | one;
+		found |= one;
+	}
+	good &= found;
+	if (!good) {
+		r = SC_ERROR_WRONG_PADDING;
+		goto err;
+	}
+	n = start + 1;
+
+	i = mod_length - n;
+	if (out != NULL) {
+		if (*out_len < i) {
+			r = SC_ERROR_INTERNAL;
+			goto err;
+		}
+		memcpy(out, em + n, i);
+		*out_len = i;
+	}
+	r = (int)i;
+
+err:
+	sc_mem_clear(em, mod_length);
+	free(em);
+	LOG_FUNC_RETURN(ctx, r);
+}
+#else
+int
+sc_pkcs1_strip_oaep_padding(sc_context_t *ctx, unsigned long flags,
+		const u8 *data, size_t len, size_t mod_length,
+		u8 *out, size_t *out_len)
+{
+	LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+}
+#endif /* ENABLE_OPENSSL */
+
 /* general PKCS#1 encoding function */
 int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	const u8 *in, size_t in_len, u8 *out, size_t *out_len, size_t mod_len)
@@ -243,6 +462,16 @@ int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	pad_algo  = flags & SC_ALGORITHM_RSA_PADS;
 	sc_log(ctx, "hash algorithm 0x%X, pad algorithm 0x%X", hash_algo, pad_algo);
 
+	if (pad_algo == SC_ALGORITHM_RSA_PAD_PSS) {
+		/* the input is the message hash, no DigestInfo */
+#ifdef ENABLE_OPENSSL
+		rv = sc_pkcs1_add_pss_padding(flags, in, in_len, out, out_len, mod_len);
+#else
+		rv = SC_ERROR_NOT_SUPPORTED;
+#endif
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
 	if (hash_algo != SC_ALGORITHM_RSA_HASH_NONE) {
 		i = sc_pkcs1_add_digest_info_prefix(hash_algo, in, in_len, out, &tmp_len);
 		if (i != SC_SUCCESS) {
@@ -283,6 +512,24 @@ int sc_get_encoding_flags(sc_context_t *ctx,
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
 	sc_log(ctx, "iFlags 0x%X, card capabilities 0x%X", iflags, caps);
+
+	if (iflags & (SC_ALGORITHM_RSA_PAD_PSS | SC_ALGORITHM_RSA_PAD_OAEP)) {
+		unsigned long pad = iflags & (SC_ALGORITHM_RSA_PAD_PSS | SC_ALGORITHM_RSA_PAD_OAEP);
+		unsigned long params = iflags & (SC_ALGORITHM_RSA_HASHES | SC_ALGORITHM_MGF1S);
+
+		if (caps & pad) {
+			*sflags |= pad | params;
+		} else if (caps & SC_ALGORITHM_RSA_RAW) {
+			/* pad on the host, the card does raw RSA */
+			*pflags |= pad | params;
+			*sflags |= SC_ALGORITHM_RSA_RAW;
+		} else {
+			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "PSS/OAEP need raw RSA");
+		}
+		sc_log(ctx, "pad flags 0x%X, secure algorithm flags 0x%X", *pflags, *sflags);
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	for (i = 0; digest_info_prefix[i].algorithm != 0; i++) {
 		if (iflags & digest_info_prefix[i].algorithm) {
 			if (digest_info_prefix[i].algorithm != SC_ALGORITHM_RSA_HASH_NONE &&
@@ -457,13 +457,18 @@ sc_asn1_get_algorithm_info(const struct sc_algorithm_id *id)
 {
 	struct sc_asn1_pkcs15_algorithm_info *aip = NULL;
 
-	for (aip = algorithm_table; aip->id >= 0; aip++)   {
-		if ((int) id->algorithm < 0 && sc_compare_oid(&id->oid, &aip->oid))
-			return aip;
+	/* Once decoded the OID is known by its algorithm ID, so the
+	 * OID itself is compared only for the first lookup */
+	if ((int) id->algorithm >= 0)   {
+		for (aip = algorithm_table; aip->id >= 0; aip++)
+			if (aip->id == (int)id->algorithm)
+				return aip;
+		return NULL;
+	}
 
-		if (aip->id == (int)id->algorithm)
+	for (aip = algorithm_table; aip->id >= 0; aip++)
+		if (sc_compare_oid(&id->oid, &aip->oid))
 			return aip;
-	}
 
 	return NULL;
 }
@@ -26,140 +26,1005 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
+#include "common/compat_strlcpy.h"
 #include "internal.h"
 #include "pkcs15.h"
+#include "compression.h"
+
+/*
+ * All cached files of one token live in a single container file in a
+ * directory of its own, <cachedir>/p15cache/<serial>/<lastUpdate>.p15cache:
+ *
+ *	magic[8]	"OSCP15C\0"
+ *	version[4]	SC_PKCS15_CACHE_VERSION
+ *	count[4]	number of index entries
+ *	count times:
+ *		path_len[2], path[path_len], offset[4], length[4], raw_length[4]
+ *	file data
+ *
+ * All integers are big endian, offsets are relative to the start of the
+ * container. A file whose length differs from its raw_length is stored
+ * zlib compressed. The container is mapped into memory once per bind,
+ * lookups are served from the in-memory index without any further system
+ * calls.
+ *
+ * The modification time of a container is refreshed whenever it is
+ * mapped; when a new container pushes the cache beyond
+ * file_cache_max_size, the containers least recently used are evicted.
+ */
+#define SC_PKCS15_CACHE_MAGIC		"OSCP15C"
+#define SC_PKCS15_CACHE_MAGIC_LEN	8
+#define SC_PKCS15_CACHE_VERSION		2
+#define SC_PKCS15_CACHE_HDR_LEN		(SC_PKCS15_CACHE_MAGIC_LEN + 4 + 4)
+#define SC_PKCS15_CACHE_SUBDIR		"p15cache"
+#define SC_PKCS15_CACHE_SUFFIX		".p15cache"
+
+/*
+ * The quick bind records live in <cachedir>/p15cache/quickbind/<key>,
+ * the key being made of the card serial number and the AID:
+ *
+ *	magic[8]	"OSCQB\0\0\0"
+ *	generation[4]	shared card generation the record was taken at
+ *	twice, for the application DF and EF(TokenInfo):
+ *		type[1], len[1], value[len], aid_len[1], aid[aid_len]
+ *	length[4], EF(TokenInfo)
+ */
+#define SC_PKCS15_QUICK_BIND_MAGIC	"OSCQB"
+#define SC_PKCS15_QUICK_BIND_SUBDIR	"quickbind"
+
+struct sc_pkcs15_cache_entry {
+	const u8 *path;
+	size_t path_len;
+	size_t offset;
+	size_t len;
+	size_t raw_len;
+	/* the file inflated on first use, if stored compressed */
+	u8 *inflated;
+};
+
+struct sc_pkcs15_cache {
+	char fname[PATH_MAX];
+	u8 *data;
+	size_t data_len;
+	int mapped;
+	struct sc_pkcs15_cache_entry *entries;
+	size_t count;
+	/* files served since the last sc_pkcs15_cache_take_stale() */
+	sc_path_t *stale;
+	size_t stale_count;
+	/* shared card generation the cache was last found current at */
+	unsigned int validated_generation;
+	int validated;
+};
+
+static int cache_top_dir(struct sc_context *ctx, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, SC_PKCS15_CACHE_SUBDIR);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int cache_card_dir(struct sc_pkcs15_card *p15card, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	if (p15card->tokeninfo->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = cache_top_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, p15card->tokeninfo->serial_number);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
 
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-        char pathname[SC_MAX_PATH_SIZE*2+1];
+	char *last_update;
 	int  r;
-        const u8 *pathptr;
-        size_t i, pathlen;
 
-	if (path->type != SC_PATH_TYPE_PATH)
-                return SC_ERROR_INVALID_ARGUMENTS;
-	assert(path->len <= SC_MAX_PATH_SIZE);
-	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	r = cache_card_dir(p15card, dir, sizeof(dir));
 	if (r)
 		return r;
-	pathptr = path->value;
-	pathlen = path->len;
-	if (pathlen > 2 && memcmp(pathptr, "\x3F\x00", 2) == 0) {
-                pathptr += 2;
-		pathlen -= 2;
-	}
-	for (i = 0; i < pathlen; i++)
-		sprintf(pathname + 2*i, "%02X", pathptr[i]);
-	if (p15card->tokeninfo->serial_number != NULL) {
-		char *last_update = sc_pkcs15_get_lastupdate(p15card);
-		if (last_update != NULL)
-			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir, p15card->tokeninfo->serial_number,
-					last_update, pathname);
-		else
-			r = snprintf(buf, bufsize, "%s/%s_DATE_%s", dir,
-					p15card->tokeninfo->serial_number, pathname);
-		if (r < 0)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-	} else
+	/* revalidated files are served whatever lastUpdate says */
+	last_update = p15card->opts.revalidate_file_cache ? "ANY" : sc_pkcs15_get_lastupdate(p15card);
+	r = snprintf(buf, bufsize, "%s/%s%s", dir,
+			last_update != NULL ? last_update : "DATE",
+			SC_PKCS15_CACHE_SUFFIX);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int cache_mkdir(const char *dir)
+{
+#ifdef _WIN32
+	if (mkdir(dir) < 0 && errno != EEXIST)
+#else
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+#endif
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
+static int cache_make_card_dir(struct sc_pkcs15_card *p15card)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
+		return r;
+	if ((r = cache_top_dir(p15card->card->ctx, dir, sizeof(dir))) < 0
+			|| (r = cache_mkdir(dir)) < 0)
+		return r;
+	if ((r = cache_card_dir(p15card, dir, sizeof(dir))) < 0)
+		return r;
+	return cache_mkdir(dir);
+}
+
+/* Strip the leading MF from the path, as the old per-file layout did */
+static int cache_path_key(const sc_path_t *path, const u8 **key, size_t *key_len)
+{
+	if (path->type != SC_PATH_TYPE_PATH)
 		return SC_ERROR_INVALID_ARGUMENTS;
-        return SC_SUCCESS;
+	assert(path->len <= SC_MAX_PATH_SIZE);
+	*key = path->value;
+	*key_len = path->len;
+	if (*key_len > 2 && memcmp(*key, "\x3F\x00", 2) == 0) {
+		*key += 2;
+		*key_len -= 2;
+	}
+	return SC_SUCCESS;
 }
 
-int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
-			       const sc_path_t *path,
-			       u8 **buf, size_t *bufsize)
+static size_t cache_get_u32(const u8 *p)
+{
+	return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+}
+
+static void cache_put_u32(u8 *p, size_t v)
 {
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static void cache_unmap(struct sc_pkcs15_cache *cache)
+{
+	size_t i;
+
+	for (i = 0; cache->entries != NULL && i < cache->count; i++) {
+		if (cache->entries[i].inflated != NULL)
+			sc_mem_account_free(SC_MEM_CACHE, cache->entries[i].raw_len);
+		free(cache->entries[i].inflated);
+	}
+	if (cache->data != NULL) {
+#ifdef HAVE_SYS_MMAN_H
+		if (cache->mapped)
+			munmap(cache->data, cache->data_len);
+		else
+#endif
+		{
+			sc_mem_account_free(SC_MEM_CACHE, cache->data_len);
+			free(cache->data);
+		}
+	}
+	if (cache->entries != NULL)
+		free(cache->entries);
+	cache->data = NULL;
+	cache->data_len = 0;
+	cache->mapped = 0;
+	cache->entries = NULL;
+	cache->count = 0;
+	cache->fname[0] = '\0';
+}
+
+static int cache_load_file(struct sc_pkcs15_cache *cache, const char *fname)
+{
+	struct stat stbuf;
+	int fd;
+
+	fd = open(fname, O_RDONLY
+#ifdef O_BINARY
+			| O_BINARY
+#endif
+			);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fd, &stbuf) != 0 || stbuf.st_size < SC_PKCS15_CACHE_HDR_LEN) {
+		close(fd);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cache->data_len = (size_t)stbuf.st_size;
+#ifdef HAVE_SYS_MMAN_H
+	cache->data = mmap(NULL, cache->data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cache->data != MAP_FAILED) {
+		cache->mapped = 1;
+		close(fd);
+		return SC_SUCCESS;
+	}
+#endif
+	cache->data = malloc(cache->data_len);
+	if (cache->data == NULL) {
+		close(fd);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (read(fd, cache->data, cache->data_len) != (ssize_t)cache->data_len) {
+		close(fd);
+		free(cache->data);
+		cache->data = NULL;
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	close(fd);
+	/* mapped containers are left to the page cache */
+	sc_mem_account_alloc(SC_MEM_CACHE, cache->data_len);
+	return SC_SUCCESS;
+}
+
+static int cache_parse_index(struct sc_pkcs15_cache *cache)
+{
+	const u8 *p = cache->data, *end = cache->data + cache->data_len;
+	size_t i, count;
+
+	if (memcmp(p, SC_PKCS15_CACHE_MAGIC, SC_PKCS15_CACHE_MAGIC_LEN) != 0
+			|| cache_get_u32(p + SC_PKCS15_CACHE_MAGIC_LEN) != SC_PKCS15_CACHE_VERSION)
+		return SC_ERROR_FILE_NOT_FOUND;
+	count = cache_get_u32(p + SC_PKCS15_CACHE_MAGIC_LEN + 4);
+	p += SC_PKCS15_CACHE_HDR_LEN;
+	if (count > cache->data_len / 10)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	cache->entries = calloc(count ? count : 1, sizeof(*cache->entries));
+	if (cache->entries == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0; i < count; i++) {
+		struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+
+		if (end - p < 2)
+			return SC_ERROR_FILE_NOT_FOUND;
+		e->path_len = (p[0] << 8) | p[1];
+		p += 2;
+		if ((size_t)(end - p) < e->path_len + 12 || e->path_len > SC_MAX_PATH_SIZE)
+			return SC_ERROR_FILE_NOT_FOUND;
+		e->path = p;
+		p += e->path_len;
+		e->offset = cache_get_u32(p);
+		e->len = cache_get_u32(p + 4);
+		e->raw_len = cache_get_u32(p + 8);
+		p += 12;
+		/* entries parsed so far are released by cache_unmap() */
+		cache->count = i + 1;
+		if (e->offset > cache->data_len || e->len > cache->data_len - e->offset)
+			return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cache->count = count;
+	return SC_SUCCESS;
+}
+
+/* Make sure the container of the current token is mapped */
+static int cache_open(struct sc_pkcs15_card *p15card, struct sc_pkcs15_cache **out)
+{
+	struct sc_pkcs15_cache *cache = p15card->file_cache;
 	char fname[PATH_MAX];
 	int r;
-	FILE *f;
-	size_t count, offset, got;
-	struct stat stbuf;
-	u8 *data = NULL;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (r != 0)
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
 		return r;
-	r = stat(fname, &stbuf);
-	if (r)
+
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct sc_pkcs15_cache));
+		if (cache == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->file_cache = cache;
+	}
+	else if (cache->data != NULL && strcmp(cache->fname, fname) == 0) {
+		*out = cache;
+		return SC_SUCCESS;
+	}
+
+	/* Token changed (serial or lastUpdate) or nothing mapped yet */
+	cache_unmap(cache);
+	r = cache_load_file(cache, fname);
+	if (r == SC_SUCCESS)
+		r = cache_parse_index(cache);
+	if (r != SC_SUCCESS) {
+		cache_unmap(cache);
+		return r;
+	}
+	strlcpy(cache->fname, fname, sizeof(cache->fname));
+#ifndef _WIN32
+	/* the modification time orders the containers for eviction */
+	utime(fname, NULL);
+#endif
+	*out = cache;
+	return SC_SUCCESS;
+}
+
+static struct sc_pkcs15_cache_entry *cache_lookup(struct sc_pkcs15_cache *cache,
+		const u8 *key, size_t key_len)
+{
+	size_t i;
+
+	for (i = 0; i < cache->count; i++) {
+		struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+
+		if (e->path_len == key_len && memcmp(e->path, key, key_len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static int cache_entry_data(struct sc_pkcs15_cache *cache,
+		struct sc_pkcs15_cache_entry *e, const u8 **data)
+{
+	if (e->raw_len == e->len) {
+		*data = cache->data + e->offset;
+		return SC_SUCCESS;
+	}
+#ifdef ENABLE_ZLIB
+	if (e->inflated == NULL) {
+		size_t len = 0;
+		int r;
+
+		r = sc_decompress_alloc(&e->inflated, &len, cache->data + e->offset,
+				e->len, COMPRESSION_ZLIB);
+		if (r == SC_SUCCESS && len != e->raw_len)
+			r = SC_ERROR_FILE_NOT_FOUND;
+		if (r != SC_SUCCESS) {
+			free(e->inflated);
+			e->inflated = NULL;
+			return SC_ERROR_FILE_NOT_FOUND;
+		}
+		sc_mem_account_alloc(SC_MEM_CACHE, e->raw_len);
+	}
+	*data = e->inflated;
+	return SC_SUCCESS;
+#else
+	/* written by a build with zlib */
+	return SC_ERROR_FILE_NOT_FOUND;
+#endif
+}
+
+int sc_pkcs15_map_cached_file(struct sc_pkcs15_card *p15card,
+			      const sc_path_t *path,
+			      const u8 **buf, size_t *bufsize)
+{
+	struct sc_pkcs15_cache *cache = NULL;
+	struct sc_pkcs15_cache_entry *e;
+	const u8 *key, *data;
+	size_t key_len;
+	int r;
+
+	r = cache_path_key(path, &key, &key_len);
+	if (r != SC_SUCCESS)
+		return r;
+	r = cache_open(p15card, &cache);
+	if (r != SC_SUCCESS)
+		return r;
+	e = cache_lookup(cache, key, key_len);
+	if (e == NULL)
 		return SC_ERROR_FILE_NOT_FOUND;
+	r = cache_entry_data(cache, e, &data);
+	if (r != SC_SUCCESS)
+		return r;
+
 	if (path->count < 0) {
-		count = stbuf.st_size;
-		offset = 0;
+		*buf = data;
+		*bufsize = e->raw_len;
 	} else {
-		count = path->count;
-		offset = path->index;
-		if (offset + count > (size_t)stbuf.st_size)
+		if ((size_t)path->index + path->count > e->raw_len)
 			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
+		*buf = data + path->index;
+		*bufsize = path->count;
 	}
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
+			       const sc_path_t *path,
+			       u8 **buf, size_t *bufsize)
+{
+	const u8 *data;
+	size_t count;
+	int r;
+
+	r = sc_pkcs15_map_cached_file(p15card, path, &data, &count);
+	if (r != SC_SUCCESS)
+		return r;
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
 			return SC_ERROR_OUT_OF_MEMORY;
 	} else
 		if (count > *bufsize)
 			return SC_ERROR_BUFFER_TOO_SMALL;
-	f = fopen(fname, "rb");
-	if (f == NULL) {
-		if (data)
-			free(data);
-		return SC_ERROR_FILE_NOT_FOUND;
-	}
-	if (offset)
-		fseek(f, (long)offset, SEEK_SET);
-	if (data)
-		*buf = data;
-	got = fread(*buf, 1, count, f);
-        fclose(f);
-	if (got != count) {
-		if (data)
-			free(data);
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	}
+	memcpy(*buf, data, count);
 	*bufsize = count;
-	if (data)
-		*buf = data;
 	return 0;
 }
 
+static int cache_write_entry(FILE *f, const u8 *key, size_t key_len,
+		size_t offset, size_t len, size_t raw_len)
+{
+	u8 hdr[2], pos[12];
+
+	hdr[0] = (key_len >> 8) & 0xFF;
+	hdr[1] = key_len & 0xFF;
+	cache_put_u32(pos, offset);
+	cache_put_u32(pos + 4, len);
+	cache_put_u32(pos + 8, raw_len);
+	if (fwrite(hdr, 1, 2, f) != 2 || fwrite(key, 1, key_len, f) != key_len
+			|| fwrite(pos, 1, 12, f) != 12)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
+#ifndef _WIN32
+static int cache_has_suffix(const char *name)
+{
+	size_t len = strlen(name), suffix_len = strlen(SC_PKCS15_CACHE_SUFFIX);
+
+	return len > suffix_len && strcmp(name + len - suffix_len, SC_PKCS15_CACHE_SUFFIX) == 0;
+}
+
+struct cache_container {
+	char *fname;
+	size_t size;
+	time_t used;
+};
+
+static int cache_container_cmp(const void *a, const void *b)
+{
+	const struct cache_container *ca = a, *cb = b;
+
+	return ca->used < cb->used ? -1 : ca->used > cb->used;
+}
+
+/* Containers of earlier lastUpdate values of the card are of no use anymore */
+static void cache_drop_outdated(const char *dir, const char *keep)
+{
+	char fname[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (!cache_has_suffix(de->d_name))
+			continue;
+		if (snprintf(fname, sizeof(fname), "%s/%s", dir, de->d_name) >= (int)sizeof(fname))
+			continue;
+		if (strcmp(fname, keep) != 0)
+			unlink(fname);
+	}
+	closedir(d);
+}
+
+/* Removes the least recently used containers, but 'keep', until the cache
+ * fits into 'max_size' bytes */
+static void cache_evict(struct sc_context *ctx, const char *keep, size_t max_size)
+{
+	char top[PATH_MAX], dir[PATH_MAX], fname[PATH_MAX];
+	struct cache_container *list = NULL, *tmp;
+	size_t count = 0, alloc = 0, total = 0, i;
+	struct dirent *de, *ce;
+	struct stat stbuf;
+	DIR *d, *cd;
+	char *sep;
+
+	if (cache_top_dir(ctx, top, sizeof(top)) != SC_SUCCESS
+			|| (d = opendir(top)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.'
+				|| snprintf(dir, sizeof(dir), "%s/%s", top, de->d_name) >= (int)sizeof(dir)
+				|| (cd = opendir(dir)) == NULL)
+			continue;
+		while ((ce = readdir(cd)) != NULL) {
+			if (!cache_has_suffix(ce->d_name)
+					|| snprintf(fname, sizeof(fname), "%s/%s", dir, ce->d_name) >= (int)sizeof(fname)
+					|| stat(fname, &stbuf) != 0 || !S_ISREG(stbuf.st_mode))
+				continue;
+			total += (size_t)stbuf.st_size;
+			if (strcmp(fname, keep) == 0)
+				continue;
+			if (count == alloc) {
+				alloc = alloc ? 2 * alloc : 64;
+				tmp = realloc(list, alloc * sizeof(*list));
+				if (tmp == NULL)
+					break;
+				list = tmp;
+			}
+			list[count].fname = strdup(fname);
+			if (list[count].fname == NULL)
+				break;
+			list[count].size = (size_t)stbuf.st_size;
+			list[count].used = stbuf.st_mtime;
+			count++;
+		}
+		closedir(cd);
+	}
+	closedir(d);
+
+	if (total > max_size) {
+		qsort(list, count, sizeof(*list), cache_container_cmp);
+		for (i = 0; i < count && total > max_size; i++) {
+			if (unlink(list[i].fname) != 0)
+				continue;
+			sc_log(ctx, "evicted cache container '%s'", list[i].fname);
+			total -= list[i].size;
+			/* the card directory goes when it is empty */
+			if ((sep = strrchr(list[i].fname, '/')) != NULL) {
+				*sep = '\0';
+				rmdir(list[i].fname);
+			}
+		}
+	}
+	for (i = 0; i < count; i++)
+		free(list[i].fname);
+	free(list);
+}
+#else
+static void cache_drop_outdated(const char *dir, const char *keep)
+{
+}
+
+static void cache_evict(struct sc_context *ctx, const char *keep, size_t max_size)
+{
+}
+#endif
+
+#ifndef _WIN32
+/*
+ * Serializes the writers of the containers of a card, threads and
+ * processes alike: each one rebuilds the container from the one on disk.
+ * Returns the descriptor holding the lock, or -1.
+ */
+static int cache_lock(const char *dir)
+{
+	char lockname[PATH_MAX];
+	int fd;
+
+	if (snprintf(lockname, sizeof(lockname), "%s/.lock", dir) >= (int)sizeof(lockname))
+		return -1;
+	fd = open(lockname, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return -1;
+	while (flock(fd, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* Closing the descriptor releases the lock */
+static void cache_unlock(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+#else
+static int cache_lock(const char *dir)
+{
+	return -1;
+}
+
+static void cache_unlock(int fd)
+{
+}
+#endif
+
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
 {
-	char fname[PATH_MAX];
-	int r;
-        FILE *f;
-        size_t c;
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cache *cache = NULL;
+	char dir[PATH_MAX], fname[PATH_MAX], tmpname[PATH_MAX];
+	u8 hdr[SC_PKCS15_CACHE_HDR_LEN];
+	u8 *packed = NULL;
+	const u8 *key, *data = buf;
+	size_t key_len, i, count = 0, offset, len = bufsize;
+	FILE *f = NULL;
+	int r, lock_fd;
+#ifndef _WIN32
+	int fd;
+#endif
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (r != 0)
+	r = cache_path_key(path, &key, &key_len);
+	if (r != SC_SUCCESS)
+		return r;
+	r = cache_card_dir(p15card, dir, sizeof(dir));
+	if (r == SC_SUCCESS)
+		r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
 		return r;
+#ifdef _WIN32
+	if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname) >= (int)sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+#else
+	if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname) >= (int)sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+#endif
+
+#ifndef _WIN32
+	lock_fd = cache_lock(dir);
+	/* If the cache directory does not exist, create it and try again */
+	if (lock_fd < 0 && errno == ENOENT) {
+		if ((r = cache_make_card_dir(p15card)) < 0)
+			return r;
+		lock_fd = cache_lock(dir);
+	}
+	if (lock_fd < 0)
+		sc_log(ctx, "cannot lock the cache directory '%s'", dir);
+#else
+	lock_fd = cache_lock(dir);
+#endif
 
-	f = fopen(fname, "wb");
+	/* Existing entries are carried over, except the one being replaced.
+	 * They are read again: another writer may have added some. */
+	if (p15card->file_cache != NULL)
+		cache_unmap(p15card->file_cache);
+	if (cache_open(p15card, &cache) != SC_SUCCESS)
+		cache = NULL;
+
+#ifdef _WIN32
+	f = fopen(tmpname, "wb");
 	/* If the open failed because the cache directory does
 	 * not exist, create it and a re-try the fopen() call.
 	 */
 	if (f == NULL && errno == ENOENT) {
-		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
+		if ((r = cache_make_card_dir(p15card)) < 0)
 			return r;
-		f = fopen(fname, "wb");
+		f = fopen(tmpname, "wb");
 	}
-	if (f == NULL)
+#else
+	fd = mkstemp(tmpname);
+	if (fd >= 0) {
+		f = fdopen(fd, "wb");
+		if (f == NULL) {
+			close(fd);
+			unlink(tmpname);
+		}
+	}
+#endif
+	if (f == NULL) {
+		cache_unlock(lock_fd);
 		return 0;
+	}
+
+#ifdef ENABLE_ZLIB
+	/* stored compressed only when that saves space */
+	if (p15card->opts.compress_file_cache
+			&& sc_compress_alloc(&packed, &len, buf, bufsize, COMPRESSION_ZLIB) == SC_SUCCESS
+			&& len < bufsize)
+		data = packed;
+	else
+		len = bufsize;
+#endif
+
+	offset = SC_PKCS15_CACHE_HDR_LEN + 2 + key_len + 8;
+	if (cache != NULL) {
+		for (i = 0; i < cache->count; i++) {
+			struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+			if (e->path_len == key_len && memcmp(e->path, key, key_len) == 0)
+				continue;
+			count++;
+			offset += 2 + e->path_len + 8;
+		}
+	}
+
+	memcpy(hdr, SC_PKCS15_CACHE_MAGIC, SC_PKCS15_CACHE_MAGIC_LEN);
+	cache_put_u32(hdr + SC_PKCS15_CACHE_MAGIC_LEN, SC_PKCS15_CACHE_VERSION);
+	cache_put_u32(hdr + SC_PKCS15_CACHE_MAGIC_LEN + 4, count + 1);
+	r = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) ? SC_SUCCESS : SC_ERROR_INTERNAL;
+
+	/* index */
+	if (r == SC_SUCCESS)
+		r = cache_write_entry(f, key, key_len, offset, len, bufsize);
+	offset += len;
+	for (i = 0; cache != NULL && r == SC_SUCCESS && i < cache->count; i++) {
+		struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+		if (e->path_len == key_len && memcmp(e->path, key, key_len) == 0)
+			continue;
+		r = cache_write_entry(f, e->path, e->path_len, offset, e->len, e->raw_len);
+		offset += e->len;
+	}
 
-	c = fwrite(buf, 1, bufsize, f);
-        fclose(f);
-	if (c != bufsize) {
-		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "fwrite() wrote only %d bytes", c);
+	/* data, in index order */
+	if (r == SC_SUCCESS && fwrite(data, 1, len, f) != len)
+		r = SC_ERROR_INTERNAL;
+	free(packed);
+	for (i = 0; cache != NULL && r == SC_SUCCESS && i < cache->count; i++) {
+		struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+		if (e->path_len == key_len && memcmp(e->path, key, key_len) == 0)
+			continue;
+		if (fwrite(cache->data + e->offset, 1, e->len, f) != e->len)
+			r = SC_ERROR_INTERNAL;
+	}
+
+	if (fclose(f) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "cannot write cache container '%s'", tmpname);
+		unlink(tmpname);
+		cache_unlock(lock_fd);
+		return r;
+	}
+
+	/* The old mapping stays valid until it is dropped here */
+	if (p15card->file_cache != NULL)
+		cache_unmap(p15card->file_cache);
+#ifdef _WIN32
+	unlink(fname);
+#endif
+	if (rename(tmpname, fname) != 0) {
+		sc_log(ctx, "cannot rename cache container to '%s'", fname);
+		unlink(tmpname);
+		cache_unlock(lock_fd);
+		return SC_ERROR_INTERNAL;
+	}
+
+	/* The cache only grows by new containers, which is when it is trimmed */
+	if (cache == NULL) {
+		cache_drop_outdated(dir, fname);
+		if (p15card->opts.file_cache_max_size > 0)
+			cache_evict(ctx, fname, p15card->opts.file_cache_max_size);
+	}
+	cache_unlock(lock_fd);
+	return 0;
+}
+
+/*
+ * Stale-while-revalidate: with 'file_cache_revalidate' the cached files
+ * are served without asking the card whether they are current. The files
+ * served are remembered, and compared with the card later on by
+ * sc_pkcs15_revalidate_file_cache().
+ */
+void sc_pkcs15_cache_mark_stale(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path)
+{
+	struct sc_pkcs15_cache *cache = p15card->file_cache;
+	sc_path_t *stale;
+	unsigned int generation;
+	size_t i;
+
+	if (!p15card->opts.revalidate_file_cache || cache == NULL)
+		return;
+	/* nobody wrote to the card since the cache was compared with it */
+	if (cache->validated
+			&& sc_card_shared_generation(p15card->card, &generation) == SC_SUCCESS
+			&& generation == cache->validated_generation)
+		return;
+
+	for (i = 0; i < cache->stale_count; i++)
+		if (sc_compare_path(&cache->stale[i], path))
+			return;
+	stale = realloc(cache->stale, (cache->stale_count + 1) * sizeof(sc_path_t));
+	if (stale == NULL)
+		return;
+	cache->stale = stale;
+	/* the whole file is checked, the cache keeps whole files */
+	stale[cache->stale_count] = *path;
+	stale[cache->stale_count].index = 0;
+	stale[cache->stale_count].count = -1;
+	cache->stale_count++;
+}
+
+int sc_pkcs15_cache_take_stale(struct sc_pkcs15_card *p15card,
+			       sc_path_t **paths, size_t *count)
+{
+	struct sc_pkcs15_cache *cache = p15card->file_cache;
+
+	*paths = NULL;
+	*count = 0;
+	if (cache == NULL)
+		return SC_SUCCESS;
+	*paths = cache->stale;
+	*count = cache->stale_count;
+	cache->stale = NULL;
+	cache->stale_count = 0;
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_cache_validated(struct sc_pkcs15_card *p15card,
+			       unsigned int generation)
+{
+	struct sc_pkcs15_cache *cache = p15card->file_cache;
+
+	if (cache == NULL)
+		return;
+	cache->validated_generation = generation;
+	cache->validated = 1;
+}
+
+static int quick_bind_filename(struct sc_context *ctx, const char *key,
+		char *buf, size_t bufsize, int create)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	if (strchr(key, '/') != NULL || key[0] == '.')
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if ((r = cache_top_dir(ctx, dir, sizeof(dir))) < 0)
+		return r;
+	if (create && ((r = sc_make_cache_dir(ctx)) < 0 || (r = cache_mkdir(dir)) < 0))
+		return r;
+	if (strlen(dir) + strlen(SC_PKCS15_QUICK_BIND_SUBDIR) + 1 >= sizeof(dir))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(dir, "/" SC_PKCS15_QUICK_BIND_SUBDIR);
+	if (create && (r = cache_mkdir(dir)) < 0)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, key);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int quick_bind_put_path(FILE *f, const sc_path_t *path)
+{
+	u8 hdr[2];
+
+	hdr[0] = (u8)path->type;
+	hdr[1] = (u8)path->len;
+	if (fwrite(hdr, 1, 2, f) != 2 || fwrite(path->value, 1, path->len, f) != path->len)
+		return SC_ERROR_INTERNAL;
+	hdr[0] = (u8)path->aid.len;
+	if (fwrite(hdr, 1, 1, f) != 1 || fwrite(path->aid.value, 1, path->aid.len, f) != path->aid.len)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
+static int quick_bind_get_path(const u8 **p, const u8 *end, sc_path_t *path)
+{
+	size_t len;
+
+	memset(path, 0, sizeof(*path));
+	if (end - *p < 2 || (len = (*p)[1]) > sizeof(path->value) || (size_t)(end - *p) < 2 + len + 1)
+		return SC_ERROR_FILE_NOT_FOUND;
+	path->type = (*p)[0];
+	path->len = len;
+	memcpy(path->value, *p + 2, len);
+	*p += 2 + len;
+	if ((len = **p) > sizeof(path->aid.value) || (size_t)(end - *p) < 1 + len)
+		return SC_ERROR_FILE_NOT_FOUND;
+	path->aid.len = len;
+	memcpy(path->aid.value, *p + 1, len);
+	*p += 1 + len;
+	path->count = -1;
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_cache_load_quick_bind(struct sc_context *ctx, const char *key,
+				    struct sc_pkcs15_quick_bind *qb)
+{
+	struct sc_pkcs15_cache cache;
+	char fname[PATH_MAX];
+	const u8 *p, *end;
+	size_t len;
+	int r;
+
+	memset(qb, 0, sizeof(*qb));
+	r = quick_bind_filename(ctx, key, fname, sizeof(fname), 0);
+	if (r < 0)
+		return r;
+	memset(&cache, 0, sizeof(cache));
+	r = cache_load_file(&cache, fname);
+	if (r < 0)
+		return r;
+
+	r = SC_ERROR_FILE_NOT_FOUND;
+	p = cache.data;
+	end = cache.data + cache.data_len;
+	if (memcmp(p, SC_PKCS15_QUICK_BIND_MAGIC, sizeof(SC_PKCS15_QUICK_BIND_MAGIC)) != 0)
+		goto out;
+	qb->generation = (unsigned int)cache_get_u32(p + 8);
+	p += 12;
+	if (quick_bind_get_path(&p, end, &qb->app_path) < 0
+			|| quick_bind_get_path(&p, end, &qb->tokeninfo_path) < 0
+			|| end - p < 4)
+		goto out;
+	len = cache_get_u32(p);
+	p += 4;
+	if (len == 0 || (size_t)(end - p) != len)
+		goto out;
+	qb->tokeninfo = malloc(len);
+	if (qb->tokeninfo == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	memcpy(qb->tokeninfo, p, len);
+	qb->tokeninfo_len = len;
+	r = SC_SUCCESS;
+out:
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "unusable quick bind record '%s'", fname);
+	cache_unmap(&cache);
+	return r;
+}
+
+int sc_pkcs15_cache_store_quick_bind(struct sc_context *ctx, const char *key,
+				     const struct sc_pkcs15_quick_bind *qb)
+{
+	char fname[PATH_MAX], tmpname[PATH_MAX];
+	u8 hdr[12];
+	FILE *f;
+	int r;
+
+	r = quick_bind_filename(ctx, key, fname, sizeof(fname), 1);
+	if (r < 0)
+		return r;
+	if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname) >= (int)sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	f = fopen(tmpname, "wb");
+	if (f == NULL)
+		return SC_ERROR_INTERNAL;
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, SC_PKCS15_QUICK_BIND_MAGIC, sizeof(SC_PKCS15_QUICK_BIND_MAGIC));
+	cache_put_u32(hdr + 8, qb->generation);
+	r = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) ? SC_SUCCESS : SC_ERROR_INTERNAL;
+	if (r == SC_SUCCESS)
+		r = quick_bind_put_path(f, &qb->app_path);
+	if (r == SC_SUCCESS)
+		r = quick_bind_put_path(f, &qb->tokeninfo_path);
+	cache_put_u32(hdr, qb->tokeninfo_len);
+	if (r == SC_SUCCESS && (fwrite(hdr, 1, 4, f) != 4
+				|| fwrite(qb->tokeninfo, 1, qb->tokeninfo_len, f) != qb->tokeninfo_len))
+		r = SC_ERROR_INTERNAL;
+	if (fclose(f) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+#ifdef _WIN32
+	if (r == SC_SUCCESS)
 		unlink(fname);
+#endif
+	if (r != SC_SUCCESS || rename(tmpname, fname) != 0) {
+		sc_log(ctx, "cannot write quick bind record '%s'", fname);
+		unlink(tmpname);
 		return SC_ERROR_INTERNAL;
 	}
-        return 0;
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->file_cache == NULL)
+		return;
+	cache_unmap(p15card->file_cache);
+	free(p15card->file_cache->stale);
+	free(p15card->file_cache);
+	p15card->file_cache = NULL;
 }
@@ -28,11 +28,40 @@
 #include <unistd.h>
 #endif
 #include <assert.h>
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
 #include "pkcs15.h"
 
+/* Points *out to the TLV of the decoded value in the certificate buffer,
+ * or to a DER encoded copy if the TLV cannot be found there */
+static int
+cert_field(sc_context_t *ctx, struct sc_pkcs15_cert *cert, struct sc_asn1_entry *asn1_field,
+		u8 *value, size_t value_len, u8 **out, size_t *out_len)
+{
+	const u8 *tlv, *p;
+	unsigned int cla, tag;
+	size_t taglen, hlen;
+
+	for (hlen = 2; hlen <= 2 + sizeof(size_t); hlen++) {
+		if (!sc_pkcs15_blob_contains(cert->der_blob, value - hlen, hlen + value_len))
+			break;
+		tlv = p = value - hlen;
+		if (sc_asn1_read_tag(&p, hlen + value_len, &cla, &tag, &taglen) == SC_SUCCESS
+				&& p == value && taglen == value_len) {
+			*out = (u8 *) tlv;
+			*out_len = hlen + value_len;
+			return SC_SUCCESS;
+		}
+	}
+
+	sc_format_asn1_entry(asn1_field + 0, value, &value_len, 1);
+	return sc_asn1_encode(ctx, asn1_field, out, out_len);
+}
+
 static int
 parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert)
 {
@@ -59,11 +88,11 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	};
 	struct sc_asn1_entry asn1_tbscert[] = {
 		{ "version",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 0 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_version, NULL },
-		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, &serial, &serial_len },
+		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC | SC_ASN1_BORROW, &serial, &serial_len },
 		{ "signature",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &issuer, &issuer_len },
+		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC | SC_ASN1_BORROW, &issuer, &issuer_len },
 		{ "validity",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &subject, &subject_len },
+		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC | SC_ASN1_BORROW, &subject, &subject_len },
 		/* Use a callback to get the algorithm, parameters and pubkey into sc_pkcs15_pubkey */
 		{ "subjectPublicKeyInfo",SC_ASN1_CALLBACK, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, sc_pkcs15_pubkey_from_spki_fields,  &pubkey },
 		{ "extensions",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 3 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_extensions, NULL },
@@ -96,12 +125,13 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	if (obj == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
 
+	/* serial, issuer and subject are borrowed from the copy in the blob */
 	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
+	r = sc_pkcs15_blob_new(buf, data_len, &cert->der_blob);
+	LOG_TEST_RET(ctx, r, "Cannot copy certificate");
+	cert->data.value = cert->der_blob->data;
 	cert->data.len = data_len;
+	obj = cert->der_blob->data + (obj - buf);
 
 	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
 	LOG_TEST_RET(ctx, r, "ASN.1 parsing of certificate failed");
@@ -115,23 +145,17 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	sc_asn1_clear_algorithm_id(&sig_alg);
 
 	if (serial && serial_len)   {
-		sc_format_asn1_entry(asn1_serial_number + 0, serial, &serial_len, 1);
-		r = sc_asn1_encode(ctx, asn1_serial_number, &cert->serial, &cert->serial_len);
-		free(serial);
+		r = cert_field(ctx, cert, asn1_serial_number, serial, serial_len, &cert->serial, &cert->serial_len);
 		LOG_TEST_RET(ctx, r, "ASN.1 encoding of serial failed");
 	}
 
 	if (subject && subject_len)   {
-		sc_format_asn1_entry(asn1_subject + 0, subject, &subject_len, 1);
-		r = sc_asn1_encode(ctx, asn1_subject, &cert->subject, &cert->subject_len);
-		free(subject);
+		r = cert_field(ctx, cert, asn1_subject, subject, subject_len, &cert->subject, &cert->subject_len);
 		LOG_TEST_RET(ctx, r, "ASN.1 encoding of subject");
 	}
 
 	if (issuer && issuer_len)   {
-		sc_format_asn1_entry(asn1_issuer + 0, issuer, &issuer_len, 1);
-		r = sc_asn1_encode(ctx, asn1_issuer, &cert->issuer, &cert->issuer_len);
-		free(issuer);
+		r = cert_field(ctx, cert, asn1_issuer, issuer, issuer_len, &cert->issuer, &cert->issuer_len);
 		LOG_TEST_RET(ctx, r, "ASN.1 encoding of issuer");
 	}
 
@@ -139,6 +163,166 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 }
 
 
+/* Certificates parsed by sc_pkcs15_read_certificate(), remembered by path
+ * and contents for the life of the card binding. A hit still needs the
+ * certificate bytes, so the card is read as before, but ASN.1 parsing is
+ * done once per distinct certificate. */
+#define SC_PKCS15_CERT_CACHE_MAX	32
+
+struct sc_pkcs15_cert_cache_entry {
+	struct sc_path path;
+	unsigned int hash;
+	size_t der_len;
+	struct sc_pkcs15_cert *cert;
+	struct sc_pkcs15_cert_cache_entry *next;
+};
+
+
+static unsigned int
+cert_cache_hash(const u8 *der, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *der++) * 16777619U;
+	return h;
+}
+
+
+static struct sc_pkcs15_cert_cache_entry *
+cert_cache_find(struct sc_pkcs15_card *p15card, const struct sc_path *path,
+		const struct sc_pkcs15_der *der, unsigned int hash)
+{
+	struct sc_pkcs15_cert_cache_entry *entry;
+
+	for (entry = p15card->cert_cache; entry; entry = entry->next) {
+		if (entry->hash != hash || entry->der_len != der->len)
+			continue;
+		if (entry->path.len != path->len || (path->len && !sc_compare_path(&entry->path, path)))
+			continue;
+		/* only the leading certificate TLV is parsed, trailing padding does not matter */
+		if (entry->cert->data.len > der->len
+				|| memcmp(entry->cert->data.value, der->value, entry->cert->data.len))
+			continue;
+		return entry;
+	}
+	return NULL;
+}
+
+
+static int
+cert_cache_count(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_cert_cache_entry *entry;
+	int count = 0;
+
+	for (entry = p15card->cert_cache; entry; entry = entry->next)
+		count++;
+	return count;
+}
+
+
+static int
+cert_dup_blob(u8 **dst, size_t *dst_len, const u8 *src, size_t src_len)
+{
+	*dst = NULL;
+	*dst_len = 0;
+	if (!src || !src_len)
+		return SC_SUCCESS;
+	*dst = malloc(src_len);
+	if (!*dst)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(*dst, src, src_len);
+	*dst_len = src_len;
+	return SC_SUCCESS;
+}
+
+
+/* Parts of the shared DER buffer are not copied */
+static int
+cert_dup_field(struct sc_pkcs15_cert *cert, u8 **dst, size_t *dst_len, u8 *src, size_t src_len)
+{
+	if (sc_pkcs15_blob_contains(cert->der_blob, src, src_len)) {
+		*dst = src;
+		*dst_len = src_len;
+		return SC_SUCCESS;
+	}
+	return cert_dup_blob(dst, dst_len, src, src_len);
+}
+
+
+static int
+cert_dup(struct sc_context *ctx, const struct sc_pkcs15_cert *src, struct sc_pkcs15_cert **out)
+{
+	struct sc_pkcs15_cert *cert;
+	int r;
+
+	cert = calloc(1, sizeof(struct sc_pkcs15_cert));
+	if (cert == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	cert->version = src->version;
+	cert->der_blob = sc_pkcs15_blob_hold(src->der_blob);
+	r = cert_dup_field(cert, &cert->serial, &cert->serial_len, src->serial, src->serial_len);
+	if (!r)
+		r = cert_dup_field(cert, &cert->issuer, &cert->issuer_len, src->issuer, src->issuer_len);
+	if (!r)
+		r = cert_dup_field(cert, &cert->subject, &cert->subject_len, src->subject, src->subject_len);
+	if (!r)
+		r = cert_dup_blob(&cert->crl, &cert->crl_len, src->crl, src->crl_len);
+	if (!r)
+		r = cert_dup_field(cert, &cert->data.value, &cert->data.len, src->data.value, src->data.len);
+	if (!r && src->key)
+		r = sc_pkcs15_dup_pubkey(ctx, src->key, &cert->key);
+	if (r) {
+		sc_pkcs15_free_certificate(cert);
+		return r;
+	}
+
+	*out = cert;
+	return SC_SUCCESS;
+}
+
+
+static void
+cert_cache_add(struct sc_pkcs15_card *p15card, const struct sc_path *path,
+		const struct sc_pkcs15_der *der, unsigned int hash, const struct sc_pkcs15_cert *cert)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cert_cache_entry *entry;
+
+	if (cert_cache_count(p15card) >= SC_PKCS15_CERT_CACHE_MAX)
+		return;
+
+	entry = calloc(1, sizeof(struct sc_pkcs15_cert_cache_entry));
+	if (entry == NULL)
+		return;
+	if (cert_dup(ctx, cert, &entry->cert)) {
+		free(entry);
+		return;
+	}
+	entry->path = *path;
+	entry->hash = hash;
+	entry->der_len = der->len;
+	entry->next = p15card->cert_cache;
+	p15card->cert_cache = entry;
+}
+
+
+void
+sc_pkcs15_cert_cache_release(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_cert_cache_entry *entry, *next;
+
+	for (entry = p15card->cert_cache; entry; entry = next) {
+		next = entry->next;
+		sc_pkcs15_free_certificate(entry->cert);
+		free(entry);
+	}
+	p15card->cert_cache = NULL;
+}
+
+
 int
 sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 		struct sc_pkcs15_der *cert_blob, struct sc_pkcs15_pubkey **out)
@@ -160,6 +344,48 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 }
 
 
+/* The card part of reading a certificate */
+static int
+cert_read_der(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_der *der)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int r;
+
+	if (info->value.len && info->value.value)   {
+		sc_der_copy(der, &info->value);
+		if (der->value == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	else if (info->path.len) {
+		r = sc_pkcs15_read_file(p15card, &info->path, &der->value, &der->len);
+		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+	}
+	else   {
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	}
+	return SC_SUCCESS;
+}
+
+
+/* The host part: needs nothing but the context, so it may run on another thread */
+static int
+cert_parse_der(struct sc_context *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert **cert_out)
+{
+	struct sc_pkcs15_cert *cert;
+
+	cert = calloc(1, sizeof(struct sc_pkcs15_cert));
+	if (cert == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (parse_x509_cert(ctx, der, cert)) {
+		sc_pkcs15_free_certificate(cert);
+		return SC_ERROR_INVALID_ASN1_OBJECT;
+	}
+	*cert_out = cert;
+	return SC_SUCCESS;
+}
+
+
 int
 sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
 		struct sc_pkcs15_cert **cert_out)
@@ -167,37 +393,182 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 	struct sc_context *ctx = NULL;
 	struct sc_pkcs15_cert *cert = NULL;
 	struct sc_pkcs15_der der;
+	struct sc_pkcs15_cert_cache_entry *entry;
+	unsigned int hash;
 	int r;
 
 	assert(p15card != NULL && info != NULL && cert_out != NULL);
 	ctx = p15card->card->ctx;
 	LOG_FUNC_CALLED(ctx);
 
-	if (info->value.len && info->value.value)   {
-		sc_der_copy(&der, &info->value);
-	}
-	else if (info->path.len) {
-		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
-		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+	r = cert_read_der(p15card, info, &der);
+	LOG_TEST_RET(ctx, r, "Cannot get certificate");
+
+	hash = cert_cache_hash(der.value, der.len);
+	entry = cert_cache_find(p15card, &info->path, &der, hash);
+	if (entry && cert_dup(ctx, entry->cert, &cert) == SC_SUCCESS) {
+		sc_log(ctx, "certificate %s already parsed", sc_print_path(&info->path));
+		free(der.value);
+		*cert_out = cert;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 	}
-	else   {
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
+
+	r = cert_parse_der(ctx, &der, &cert);
+	if (r == SC_SUCCESS && entry == NULL)
+		cert_cache_add(p15card, &info->path, &der, hash, cert);
+	free(der.value);
+	LOG_TEST_RET(ctx, r, "Cannot parse certificate");
+
+	*cert_out = cert;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Reading several certificates, the certificates already read are parsed
+ * on a worker thread while the card transmits the next one: the whole
+ * takes about the longer of the card and the host time, not their sum.
+ */
+struct cert_job {
+	struct sc_pkcs15_der der;
+	unsigned int hash;
+	int cached;		/* cert is a copy of a cache entry */
+	int in_cache;		/* the cache has an entry, even if copying it failed */
+	struct sc_pkcs15_cert *cert;
+	int rv;
+};
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+struct cert_pipeline {
+	struct sc_context *ctx;
+	struct cert_job *jobs;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* protected by mutex: the jobs up to 'queued' are read */
+	size_t queued;
+	int done;
+};
+
+static void *
+cert_parse_worker(void *arg)
+{
+	struct cert_pipeline *pl = (struct cert_pipeline *) arg;
+	struct cert_job *job;
+	size_t next = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&pl->mutex);
+		while (next == pl->queued && !pl->done)
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		if (next == pl->queued) {
+			pthread_mutex_unlock(&pl->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&pl->mutex);
+
+		job = &pl->jobs[next++];
+		if (job->rv == SC_SUCCESS && !job->cached)
+			job->rv = cert_parse_der(pl->ctx, &job->der, &job->cert);
 	}
+	return NULL;
+}
+#endif
 
-	cert = malloc(sizeof(struct sc_pkcs15_cert));
-	if (cert == NULL) {
-		free(der.value);
+
+int
+sc_pkcs15_read_certificates(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_cert_info * const *infos, size_t count,
+		struct sc_pkcs15_cert **certs, int *results)
+{
+	struct sc_context *ctx = NULL;
+	struct cert_job *jobs;
+	struct sc_pkcs15_cert_cache_entry *entry;
+	size_t ii;
+	int threaded = 0, r;
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	struct cert_pipeline pl;
+	pthread_t thread;
+#endif
+
+	assert(p15card != NULL && infos != NULL && certs != NULL && results != NULL);
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	jobs = calloc(count ? count : 1, sizeof(struct cert_job));
+	if (jobs == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (count > 1) {
+		pl.ctx = ctx;
+		pl.jobs = jobs;
+		pl.queued = 0;
+		pl.done = 0;
+		pthread_mutex_init(&pl.mutex, NULL);
+		pthread_cond_init(&pl.cond, NULL);
+		if (pthread_create(&thread, NULL, cert_parse_worker, &pl) == 0) {
+			threaded = 1;
+		}
+		else {
+			sc_log(ctx, "Cannot start the certificate parser, parsing in turn");
+			pthread_cond_destroy(&pl.cond);
+			pthread_mutex_destroy(&pl.mutex);
+		}
 	}
-	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(ctx, &der, cert)) {
-		free(der.value);
-		sc_pkcs15_free_certificate(cert);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
+#endif
+
+	/* one lock for all the reads, the reader is not left to other callers in between */
+	r = sc_lock(p15card->card);
+	for (ii = 0; ii < count; ii++) {
+		struct cert_job *job = &jobs[ii];
+
+		job->rv = r < 0 ? r : cert_read_der(p15card, infos[ii], &job->der);
+		if (job->rv == SC_SUCCESS) {
+			job->hash = cert_cache_hash(job->der.value, job->der.len);
+			entry = cert_cache_find(p15card, &infos[ii]->path, &job->der, job->hash);
+			job->in_cache = entry != NULL;
+			if (entry && cert_dup(ctx, entry->cert, &job->cert) == SC_SUCCESS)
+				job->cached = 1;
+		}
+
+		if (!threaded) {
+			if (job->rv == SC_SUCCESS && !job->cached)
+				job->rv = cert_parse_der(ctx, &job->der, &job->cert);
+			continue;
+		}
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+		pthread_mutex_lock(&pl.mutex);
+		pl.queued = ii + 1;
+		pthread_cond_signal(&pl.cond);
+		pthread_mutex_unlock(&pl.mutex);
+#endif
 	}
-	free(der.value);
+	if (r == SC_SUCCESS)
+		sc_unlock(p15card->card);
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (threaded) {
+		pthread_mutex_lock(&pl.mutex);
+		pl.done = 1;
+		pthread_cond_signal(&pl.cond);
+		pthread_mutex_unlock(&pl.mutex);
+		pthread_join(thread, NULL);
+		pthread_cond_destroy(&pl.cond);
+		pthread_mutex_destroy(&pl.mutex);
+	}
+#endif
+
+	for (ii = 0; ii < count; ii++) {
+		struct cert_job *job = &jobs[ii];
+
+		if (job->rv == SC_SUCCESS && !job->in_cache)
+			cert_cache_add(p15card, &infos[ii]->path, &job->der, job->hash, job->cert);
+		free(job->der.value);
+		certs[ii] = job->rv == SC_SUCCESS ? job->cert : NULL;
+		results[ii] = job->rv;
+	}
+	free(jobs);
 
-	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -232,68 +603,100 @@ static const struct sc_asn1_entry c_asn1_cert[] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
+/* Working storage of sc_pkcs15_decode_cdf_entry(), set up by cdf_template */
+struct cdf_decode_frame {
+	struct sc_asn1_entry cred_ident[3], com_cert_attr[4],
+			x509_cert_attr[2], type_cert_attr[2],
+			cert[2], x509_cert_value_choice[3];
+	struct sc_asn1_pkcs15_object cert_obj;
+	struct sc_pkcs15_cert_info info;
+	u8 id_value[128];
+	int id_type;
+	size_t id_value_len;
+};
+
+#define CDF_TABLE(name) \
+	SC_ASN1_TEMPLATE_TABLE(struct cdf_decode_frame, name, c_asn1_##name)
+static const struct sc_asn1_template_table cdf_tables[] = {
+	CDF_TABLE(cred_ident),
+	CDF_TABLE(com_cert_attr),
+	CDF_TABLE(x509_cert_attr),
+	CDF_TABLE(x509_cert_value_choice),
+	CDF_TABLE(type_cert_attr),
+	CDF_TABLE(cert)
+};
+#undef CDF_TABLE
+
+#define CDF_PARM(entry, target) \
+	SC_ASN1_TEMPLATE_PARM(struct cdf_decode_frame, entry, target)
+#define CDF_ARG(entry, target) \
+	SC_ASN1_TEMPLATE_ARG(struct cdf_decode_frame, entry, target)
+static const struct sc_asn1_template_link cdf_links[] = {
+	CDF_PARM(cred_ident[0], id_type),
+	CDF_PARM(cred_ident[1], id_value),
+	CDF_ARG(cred_ident[1], id_value_len),
+	CDF_PARM(com_cert_attr[0], info.id),
+	CDF_PARM(com_cert_attr[1], info.authority),
+	CDF_PARM(com_cert_attr[2], cred_ident),
+	CDF_PARM(x509_cert_attr[0], x509_cert_value_choice),
+	CDF_PARM(x509_cert_value_choice[0], info.path),
+	CDF_PARM(x509_cert_value_choice[1], info.value.value),
+	CDF_ARG(x509_cert_value_choice[1], info.value.len),
+	CDF_PARM(type_cert_attr[0], x509_cert_attr),
+	CDF_PARM(cert[0], cert_obj),
+	SC_ASN1_TEMPLATE_LINK(struct cdf_decode_frame, cert_obj.asn1_class_attr, com_cert_attr),
+	SC_ASN1_TEMPLATE_LINK(struct cdf_decode_frame, cert_obj.asn1_type_attr, type_cert_attr)
+};
+#undef CDF_PARM
+#undef CDF_ARG
+
+static const struct sc_asn1_template cdf_template = SC_ASN1_TEMPLATE(cdf_tables, cdf_links);
+
 
 int
 sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
 		const u8 ** buf, size_t *buflen)
 {
         sc_context_t *ctx = p15card->card->ctx;
-	struct sc_pkcs15_cert_info info;
-	struct sc_asn1_entry	asn1_cred_ident[3], asn1_com_cert_attr[4],
-				asn1_x509_cert_attr[2], asn1_type_cert_attr[2],
-				asn1_cert[2], asn1_x509_cert_value_choice[3];
-	struct sc_asn1_pkcs15_object cert_obj = { obj, asn1_com_cert_attr, NULL,
-					     asn1_type_cert_attr };
-	sc_pkcs15_der_t *der = &info.value;
-	u8 id_value[128];
-	int id_type;
-	size_t id_value_len = sizeof(id_value);
+	struct cdf_decode_frame f;
+	struct sc_pkcs15_cert_info *info = &f.info;
+	sc_pkcs15_der_t *der = &info->value;
 	int r;
 
-	sc_copy_asn1_entry(c_asn1_cred_ident, asn1_cred_ident);
-	sc_copy_asn1_entry(c_asn1_com_cert_attr, asn1_com_cert_attr);
-	sc_copy_asn1_entry(c_asn1_x509_cert_attr, asn1_x509_cert_attr);
-	sc_copy_asn1_entry(c_asn1_x509_cert_value_choice, asn1_x509_cert_value_choice);
-	sc_copy_asn1_entry(c_asn1_type_cert_attr, asn1_type_cert_attr);
-	sc_copy_asn1_entry(c_asn1_cert, asn1_cert);
-
-	sc_format_asn1_entry(asn1_cred_ident + 0, &id_type, NULL, 0);
-	sc_format_asn1_entry(asn1_cred_ident + 1, &id_value, &id_value_len, 0);
-	sc_format_asn1_entry(asn1_com_cert_attr + 0, &info.id, NULL, 0);
-	sc_format_asn1_entry(asn1_com_cert_attr + 1, &info.authority, NULL, 0);
-	sc_format_asn1_entry(asn1_com_cert_attr + 2, asn1_cred_ident, NULL, 0);
-	sc_format_asn1_entry(asn1_x509_cert_attr + 0, asn1_x509_cert_value_choice, NULL, 0);
-	sc_format_asn1_entry(asn1_x509_cert_value_choice + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
-	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
+	sc_asn1_template_init(&cdf_template, &f);
+	f.cert_obj.p15_obj = obj;
+	f.cert_obj.asn1_subclass_attr = NULL;
+	f.id_value_len = sizeof(f.id_value);
+	/* the value points into the DF, see struct sc_pkcs15_df */
+	if (p15card->parsing_df != NULL)
+		f.x509_cert_value_choice[1].flags |= SC_ASN1_BORROW;
 
         /* Fill in defaults */
-        memset(&info, 0, sizeof(info));
-	info.authority = 0;
+        memset(info, 0, sizeof(*info));
+	info->authority = 0;
 
-	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
+	r = sc_asn1_decode(ctx, f.cert, *buf, *buflen, buf, buflen);
 	/* In case of error, trash the cert value (direct coding) */
-	if (r < 0 && der->value)
+	if (r < 0 && der->value && !(f.x509_cert_value_choice[1].flags & SC_ASN1_BORROW))
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "ASN.1 decoding failed");
 
 	if (!p15card->app || !p15card->app->ddo.aid.len)   {
-		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info.path);
+		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info->path);
 		LOG_TEST_RET(ctx, r, "Cannot make absolute path");
 	}
 	else   {
-		info.path.aid = p15card->app->ddo.aid;
+		info->path.aid = p15card->app->ddo.aid;
 	}
-	sc_log(ctx, "Certificate path '%s'", sc_print_path(&info.path));
+	sc_log(ctx, "Certificate path '%s'", sc_print_path(&info->path));
 
 	obj->type = SC_PKCS15_TYPE_CERT_X509;
-	obj->data = malloc(sizeof(info));
+	obj->data = sc_pkcs15_alloc_object_data(obj, sizeof(*info));
 	if (obj->data == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(obj->data, &info, sizeof(info));
+	memcpy(obj->data, info, sizeof(*info));
 
 	return 0;
 }
@@ -344,10 +747,15 @@ sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert)
 
 	if (cert->key)
 		sc_pkcs15_free_pubkey(cert->key);
-	free(cert->subject);
-	free(cert->issuer);
-	free(cert->serial);
-	free(cert->data.value);
+	if (!sc_pkcs15_blob_contains(cert->der_blob, cert->subject, cert->subject_len))
+		free(cert->subject);
+	if (!sc_pkcs15_blob_contains(cert->der_blob, cert->issuer, cert->issuer_len))
+		free(cert->issuer);
+	if (!sc_pkcs15_blob_contains(cert->der_blob, cert->serial, cert->serial_len))
+		free(cert->serial);
+	if (!sc_pkcs15_blob_contains(cert->der_blob, cert->data.value, cert->data.len))
+		free(cert->data.value);
+	sc_pkcs15_blob_release(cert->der_blob);
 	free(cert->crl);
 	free(cert);
 }
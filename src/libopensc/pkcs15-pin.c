@@ -73,84 +73,118 @@ static const struct sc_asn1_entry c_asn1_auth_type_choice[] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
-int sc_pkcs15_decode_aodf_entry(struct sc_pkcs15_card *p15card,
-				struct sc_pkcs15_object *obj,
-				const u8 ** buf, size_t *buflen)
-{
-	sc_context_t *ctx = p15card->card->ctx;
+/* Working storage of sc_pkcs15_decode_aodf_entry(), set up by aodf_template */
+struct aodf_decode_frame {
+	struct sc_asn1_entry com_ao_attr[2];
+	struct sc_asn1_entry pin_attr[10], type_pin_attr[2];
+	struct sc_asn1_entry authkey_attr[3], type_authkey_attr[2];
+	struct sc_asn1_entry auth_type[2];
+	struct sc_asn1_entry auth_type_choice[4];
+	struct sc_asn1_pkcs15_object pin_obj, authkey_obj;
 	struct sc_pkcs15_auth_info info;
-	int r;
-	size_t flags_len = sizeof(info.attrs.pin.flags);
-	size_t derived_len = sizeof(info.attrs.authkey.derived);
-	size_t padchar_len = 1;
-	struct sc_asn1_entry asn1_com_ao_attr[2];
-	struct sc_asn1_entry asn1_pin_attr[10], asn1_type_pin_attr[2];
-	struct sc_asn1_entry asn1_authkey_attr[3], asn1_type_authkey_attr[2];
-	struct sc_asn1_entry asn1_auth_type[2];
-	struct sc_asn1_entry asn1_auth_type_choice[4];
-	struct sc_asn1_pkcs15_object pin_obj = { obj, asn1_com_ao_attr, NULL, asn1_type_pin_attr };
-	struct sc_asn1_pkcs15_object authkey_obj = { obj, asn1_com_ao_attr, NULL, asn1_type_authkey_attr };
-
-	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_ASN1);
-
-	sc_copy_asn1_entry(c_asn1_auth_type, asn1_auth_type);
-	sc_copy_asn1_entry(c_asn1_auth_type_choice, asn1_auth_type_choice);
+	size_t flags_len, derived_len, padchar_len;
+};
 
-	sc_copy_asn1_entry(c_asn1_com_ao_attr, asn1_com_ao_attr);
+#define AODF_TABLE(name) \
+	SC_ASN1_TEMPLATE_TABLE(struct aodf_decode_frame, name, c_asn1_##name)
+static const struct sc_asn1_template_table aodf_tables[] = {
+	AODF_TABLE(auth_type),
+	AODF_TABLE(auth_type_choice),
+	AODF_TABLE(com_ao_attr),
+	AODF_TABLE(type_pin_attr),
+	AODF_TABLE(pin_attr),
+	AODF_TABLE(type_authkey_attr),
+	AODF_TABLE(authkey_attr)
+};
+#undef AODF_TABLE
+
+#define AODF_LINK(slot, target) \
+	SC_ASN1_TEMPLATE_LINK(struct aodf_decode_frame, slot, target)
+#define AODF_PARM(entry, target) \
+	SC_ASN1_TEMPLATE_PARM(struct aodf_decode_frame, entry, target)
+#define AODF_ARG(entry, target) \
+	SC_ASN1_TEMPLATE_ARG(struct aodf_decode_frame, entry, target)
+static const struct sc_asn1_template_link aodf_links[] = {
+	AODF_LINK(pin_obj.asn1_class_attr, com_ao_attr),
+	AODF_LINK(pin_obj.asn1_type_attr, type_pin_attr),
+	AODF_LINK(authkey_obj.asn1_class_attr, com_ao_attr),
+	AODF_LINK(authkey_obj.asn1_type_attr, type_authkey_attr),
+
+	AODF_PARM(auth_type[0], auth_type_choice),
+	AODF_PARM(auth_type_choice[0], pin_obj),		/* 'pin' */
+	AODF_PARM(auth_type_choice[2], authkey_obj),	/* 'authKey' */
 
-	sc_copy_asn1_entry(c_asn1_type_pin_attr, asn1_type_pin_attr);
-	sc_copy_asn1_entry(c_asn1_pin_attr, asn1_pin_attr);
+	/* pinAttributes */
+	AODF_PARM(type_pin_attr[0], pin_attr),
+	AODF_PARM(pin_attr[0], info.attrs.pin.flags),
+	AODF_ARG(pin_attr[0], flags_len),
+	AODF_PARM(pin_attr[1], info.attrs.pin.type),
+	AODF_PARM(pin_attr[2], info.attrs.pin.min_length),
+	AODF_PARM(pin_attr[3], info.attrs.pin.stored_length),
+	AODF_PARM(pin_attr[4], info.attrs.pin.max_length),
+	AODF_PARM(pin_attr[5], info.attrs.pin.reference),
+	AODF_PARM(pin_attr[6], info.attrs.pin.pad_char),
+	AODF_ARG(pin_attr[6], padchar_len),
+	/* We don't support lastPinChange yet. */
+	AODF_PARM(pin_attr[8], info.path),
 
-	sc_copy_asn1_entry(c_asn1_type_authkey_attr, asn1_type_authkey_attr);
-	sc_copy_asn1_entry(c_asn1_authkey_attr, asn1_authkey_attr);
+	/* authKeyAttributes */
+	AODF_PARM(type_authkey_attr[0], authkey_attr),
+	AODF_PARM(authkey_attr[0], info.attrs.authkey.derived),
+	AODF_ARG(authkey_attr[0], derived_len),
+	AODF_PARM(authkey_attr[1], info.attrs.authkey.skey_id),
 
-	sc_format_asn1_entry(asn1_auth_type + 0, asn1_auth_type_choice, NULL, 0);
-	sc_format_asn1_entry(asn1_auth_type_choice + 0, &pin_obj, NULL, 0);	/* 'pin' */
-	sc_format_asn1_entry(asn1_auth_type_choice + 2, &authkey_obj, NULL, 0);	/* 'authKey' */
+	AODF_PARM(com_ao_attr[0], info.auth_id)
+};
+#undef AODF_LINK
+#undef AODF_PARM
+#undef AODF_ARG
 
-	/* pinAttributes */
-	sc_format_asn1_entry(asn1_type_pin_attr + 0, asn1_pin_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 0, &info.attrs.pin.flags, &flags_len, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 1, &info.attrs.pin.type, NULL, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 2, &info.attrs.pin.min_length, NULL, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 3, &info.attrs.pin.stored_length, NULL, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 4, &info.attrs.pin.max_length, NULL, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 5, &info.attrs.pin.reference, NULL, 0);
-	sc_format_asn1_entry(asn1_pin_attr + 6, &info.attrs.pin.pad_char, &padchar_len, 0);
+static const struct sc_asn1_template aodf_template = SC_ASN1_TEMPLATE(aodf_tables, aodf_links);
 
-	/* authKeyAttributes */
-	sc_format_asn1_entry(asn1_type_authkey_attr + 0, asn1_authkey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_authkey_attr + 0, &info.attrs.authkey.derived, &derived_len, 0);
-	sc_format_asn1_entry(asn1_authkey_attr + 1, &info.attrs.authkey.skey_id, NULL, 0);
+int sc_pkcs15_decode_aodf_entry(struct sc_pkcs15_card *p15card,
+				struct sc_pkcs15_object *obj,
+				const u8 ** buf, size_t *buflen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct aodf_decode_frame f;
+	struct sc_pkcs15_auth_info *info = &f.info;
+	int r;
 
-	/* We don't support lastPinChange yet. */
-	sc_format_asn1_entry(asn1_pin_attr + 8, &info.path, NULL, 0);
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_ASN1);
 
-	sc_format_asn1_entry(asn1_com_ao_attr + 0, &info.auth_id, NULL, 0);
+	sc_asn1_template_init(&aodf_template, &f);
+	f.pin_obj.p15_obj = obj;
+	f.pin_obj.asn1_subclass_attr = NULL;
+	f.authkey_obj.p15_obj = obj;
+	f.authkey_obj.asn1_subclass_attr = NULL;
+	f.flags_len = sizeof(info->attrs.pin.flags);
+	f.derived_len = sizeof(info->attrs.authkey.derived);
+	f.padchar_len = 1;
 
 	/* Fill in defaults */
-	memset(&info, 0, sizeof(info));
-	info.tries_left = -1;
+	memset(info, 0, sizeof(*info));
+	info->tries_left = -1;
 
-	r = sc_asn1_decode(ctx, asn1_auth_type, *buf, *buflen, buf, buflen);
+	r = sc_asn1_decode(ctx, f.auth_type, *buf, *buflen, buf, buflen);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "ASN.1 decoding failed");
 
-	if (asn1_auth_type_choice[0].flags & SC_ASN1_PRESENT)   {
+	if (f.auth_type_choice[0].flags & SC_ASN1_PRESENT)   {
 		sc_log(ctx, "AuthType: PIN");
 		obj->type = SC_PKCS15_TYPE_AUTH_PIN;
-		info.auth_type = SC_PKCS15_PIN_AUTH_TYPE_PIN;
-		info.auth_method = SC_AC_CHV;
+		info->auth_type = SC_PKCS15_PIN_AUTH_TYPE_PIN;
+		info->auth_method = SC_AC_CHV;
 
-		if (info.attrs.pin.max_length == 0) {
+		if (info->attrs.pin.max_length == 0) {
 			if (p15card->card->max_pin_len != 0)
-				info.attrs.pin.max_length = p15card->card->max_pin_len;
-			else if (info.attrs.pin.stored_length != 0)
-				info.attrs.pin.max_length = info.attrs.pin.type != SC_PKCS15_PIN_TYPE_BCD ?
-					info.attrs.pin.stored_length : 2 * info.attrs.pin.stored_length;
+				info->attrs.pin.max_length = p15card->card->max_pin_len;
+			else if (info->attrs.pin.stored_length != 0)
+				info->attrs.pin.max_length = info->attrs.pin.type != SC_PKCS15_PIN_TYPE_BCD ?
+					info->attrs.pin.stored_length : 2 * info->attrs.pin.stored_length;
 			else
-				info.attrs.pin.max_length = 8; /* shouldn't happen */
+				info->attrs.pin.max_length = 8; /* shouldn't happen */
 		}
 
 		/* OpenSC 0.11.4 and older encoded "pinReference" as a negative
@@ -158,41 +192,41 @@ int sc_pkcs15_decode_aodf_entry(struct sc_pkcs15_card *p15card,
 		   continue to work.
 		   The same invalid encoding has some models of the proprietary PKCS#15 cards.
 		*/
-		if (info.attrs.pin.reference < 0)
-			info.attrs.pin.reference += 256;
+		if (info->attrs.pin.reference < 0)
+			info->attrs.pin.reference += 256;
 
-		if (info.attrs.pin.flags & SC_PKCS15_PIN_FLAG_LOCAL)   {
+		if (info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_LOCAL)   {
 			/* In OpenSC pkcs#15 framework 'path' is mandatory for the 'Local' PINs.
 			 * If 'path' do not present in PinAttributes, derive it from the PKCS#15 context. */
-			if (!info.path.len)   {
+			if (!info->path.len)   {
 				/* Give priority to AID defined in the application DDO */
 				if (p15card->app && p15card->app->ddo.aid.len)
-					info.path.aid = p15card->app->ddo.aid;
+					info->path.aid = p15card->app->ddo.aid;
 				else if (p15card->file_app->path.len)
-					info.path = p15card->file_app->path;
+					info->path = p15card->file_app->path;
 			}
 		}
-		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "decoded PIN(ref:%X,path:%s)", info.attrs.pin.reference, sc_print_path(&info.path));
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "decoded PIN(ref:%X,path:%s)", info->attrs.pin.reference, sc_print_path(&info->path));
 	}
-	else if (asn1_auth_type_choice[1].flags & SC_ASN1_PRESENT)   {
+	else if (f.auth_type_choice[1].flags & SC_ASN1_PRESENT)   {
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_NOT_SUPPORTED, "BIO authentication object not yet supported");
 	}
-	else if (asn1_auth_type_choice[2].flags & SC_ASN1_PRESENT)   {
+	else if (f.auth_type_choice[2].flags & SC_ASN1_PRESENT)   {
 		sc_log(ctx, "AuthType: AuthKey");
 		obj->type = SC_PKCS15_TYPE_AUTH_AUTHKEY;
-		info.auth_type = SC_PKCS15_PIN_AUTH_TYPE_AUTH_KEY;
-		info.auth_method = SC_AC_AUT;
-		if (!(asn1_authkey_attr[0].flags & SC_ASN1_PRESENT))
-			info.attrs.authkey.derived = 1;
+		info->auth_type = SC_PKCS15_PIN_AUTH_TYPE_AUTH_KEY;
+		info->auth_method = SC_AC_AUT;
+		if (!(f.authkey_attr[0].flags & SC_ASN1_PRESENT))
+			info->attrs.authkey.derived = 1;
 	}
 	else   {
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_NOT_SUPPORTED, "unknown authentication type");
 	}
 
-	obj->data = malloc(sizeof(info));
+	obj->data = sc_pkcs15_alloc_object_data(obj, sizeof(*info));
 	if (obj->data == NULL)
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(obj->data, &info, sizeof(info));
+	memcpy(obj->data, info, sizeof(*info));
 
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_SUCCESS);
 }
@@ -274,15 +308,43 @@ static int _validate_pin(struct sc_pkcs15_card *p15card,
 }
 
 /*
- * Verify a PIN.
- *
- * If the code given to us has zero length, this means we
- * should ask the card reader to obtain the PIN from the
- * reader's PIN pad
+ * Check if the card still holds the verification of a PIN that was
+ * verified with the same code before: the code must match the cached
+ * one, and the card must report the PIN as verified.
+ * Called with the card locked and the PIN path selected.
  */
-int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
+static int
+pin_still_verified(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *pin_obj,
+		struct sc_pin_cmd_data *verify_data)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pin_cmd_data data;
+	int r;
+
+	if (!verify_data->pin1.data || !verify_data->pin1.len
+			|| !pin_obj->content.value
+			|| pin_obj->content.len != (size_t) verify_data->pin1.len
+			|| memcmp(pin_obj->content.value, verify_data->pin1.data, pin_obj->content.len))
+		return 0;
+
+	memset(&data, 0, sizeof(data));
+	data.cmd = SC_PIN_CMD_GET_INFO;
+	data.pin_type = verify_data->pin_type;
+	data.pin_reference = verify_data->pin_reference;
+
+	r = sc_pin_cmd(p15card->card, &data, NULL);
+	if (r != SC_SUCCESS || data.pin1.logged_in != SC_PIN_STATE_LOGGED_IN)
+		return 0;
+
+	sc_log(ctx, "PIN(%s) is still verified", pin_obj->label);
+	return 1;
+}
+
+static int
+pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *pin_obj,
-			 const unsigned char *pincode, size_t pinlen)
+			 const unsigned char *pincode, size_t pinlen,
+			 int check_state)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_pkcs15_auth_info *auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
@@ -362,6 +424,13 @@ int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
 			goto out;
 	}
 
+	/* Do not send the PIN again if the card did not lose its verification */
+	if (check_state && auth_info->auth_type == SC_PKCS15_PIN_AUTH_TYPE_PIN
+			&& pin_still_verified(p15card, pin_obj, &data)) {
+		r = SC_SUCCESS;
+		goto out;
+	}
+
 	r = sc_pin_cmd(card, &data, &auth_info->tries_left);
 	sc_log(ctx, "PIN cmd result %i", r);
 	if (r == SC_SUCCESS)
@@ -371,6 +440,20 @@ out:
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Verify a PIN.
+ *
+ * If the code given to us has zero length, this means we
+ * should ask the card reader to obtain the PIN from the
+ * reader's PIN pad
+ */
+int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_object *pin_obj,
+			 const unsigned char *pincode, size_t pinlen)
+{
+	return pkcs15_verify_pin(p15card, pin_obj, pincode, pinlen, 1);
+}
+
 /*
  * Change a PIN.
  */
@@ -672,8 +755,9 @@ int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs1
 	if (!pin_obj->content.value || !pin_obj->content.len)
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
 
+	/* The card refused the operation, so its state is known to be lost */
 	pin_obj->usage_counter++;
-	r = sc_pkcs15_verify_pin(p15card, pin_obj, pin_obj->content.value, pin_obj->content.len);
+	r = pkcs15_verify_pin(p15card, pin_obj, pin_obj->content.value, pin_obj->content.len, 0);
 	if (r != SC_SUCCESS) {
 		/* Ensure that wrong PIN isn't used again */
 		sc_pkcs15_free_object_content(pin_obj);
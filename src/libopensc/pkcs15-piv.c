@@ -695,6 +695,10 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	 */
 	/* set certs */
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "PIV-II adding certs...");
+	/* read all the containers at once, the loop below then finds them cached */
+	r = (card->ops->card_ctl)(card, SC_CARDCTL_PIV_PREFETCH, NULL);
+	if (r == SC_ERROR_CARD_REMOVED || r == SC_ERROR_CARD_RESET)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 	for (i = 0; i < PIV_NUM_CERTS_AND_KEYS; i++) {
 		struct sc_pkcs15_cert_info cert_info;
 		struct sc_pkcs15_object    cert_obj;
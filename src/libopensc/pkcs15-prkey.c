@@ -159,126 +159,176 @@ static const struct sc_asn1_entry c_asn1_prkey[C_ASN1_PRKEY_SIZE] = {
 };
 
 
+/* Working storage of sc_pkcs15_decode_prkdf_entry(), set up by prkdf_template */
+struct prkdf_decode_frame {
+	struct sc_asn1_entry com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
+	struct sc_asn1_entry com_prkey_attr[C_ASN1_COM_PRKEY_ATTR_SIZE];
+	struct sc_asn1_entry rsakey_attr[C_ASN1_RSAKEY_ATTR_SIZE];
+	struct sc_asn1_entry prk_rsa_attr[C_ASN1_PRK_RSA_ATTR_SIZE];
+	struct sc_asn1_entry dsakey_attr[C_ASN1_DSAKEY_ATTR_SIZE];
+	struct sc_asn1_entry prk_dsa_attr[C_ASN1_PRK_DSA_ATTR_SIZE];
+	struct sc_asn1_entry dsakey_i_p_attr[C_ASN1_DSAKEY_I_P_ATTR_SIZE];
+	struct sc_asn1_entry dsakey_value_attr[C_ASN1_DSAKEY_VALUE_ATTR_SIZE];
+	struct sc_asn1_entry gostr3410key_attr[C_ASN1_GOSTR3410KEY_ATTR_SIZE];
+	struct sc_asn1_entry prk_gostr3410_attr[C_ASN1_PRK_GOSTR3410_ATTR_SIZE];
+	struct sc_asn1_entry ecckey_attr[C_ASN1_ECCKEY_ATTR];
+	struct sc_asn1_entry prk_ecc_attr[C_ASN1_PRK_ECC_ATTR];
+	struct sc_asn1_entry prkey[C_ASN1_PRKEY_SIZE];
+	struct sc_asn1_entry supported_algorithms[C_ASN1_SUPPORTED_ALGORITHMS_SIZE];
+	struct sc_asn1_pkcs15_object rsa_prkey_obj, dsa_prkey_obj,
+			gostr3410_prkey_obj, ecc_prkey_obj;
+	struct sc_pkcs15_prkey_info info;
+	int gostr3410_params[3];
+	size_t usage_len, af_len;
+};
+
+#define PRKDF_TABLE(name) \
+	SC_ASN1_TEMPLATE_TABLE(struct prkdf_decode_frame, name, c_asn1_##name)
+static const struct sc_asn1_template_table prkdf_tables[] = {
+	PRKDF_TABLE(prkey),
+	PRKDF_TABLE(supported_algorithms),
+	PRKDF_TABLE(prk_rsa_attr),
+	PRKDF_TABLE(rsakey_attr),
+	PRKDF_TABLE(prk_dsa_attr),
+	PRKDF_TABLE(dsakey_attr),
+	PRKDF_TABLE(dsakey_value_attr),
+	PRKDF_TABLE(dsakey_i_p_attr),
+	PRKDF_TABLE(prk_gostr3410_attr),
+	PRKDF_TABLE(gostr3410key_attr),
+	PRKDF_TABLE(prk_ecc_attr),
+	PRKDF_TABLE(ecckey_attr),
+	PRKDF_TABLE(com_prkey_attr),
+	PRKDF_TABLE(com_key_attr)
+};
+#undef PRKDF_TABLE
+
+#define PRKDF_LINK(slot, target) \
+	SC_ASN1_TEMPLATE_LINK(struct prkdf_decode_frame, slot, target)
+#define PRKDF_PARM(entry, target) \
+	SC_ASN1_TEMPLATE_PARM(struct prkdf_decode_frame, entry, target)
+#define PRKDF_ARG(entry, target) \
+	SC_ASN1_TEMPLATE_ARG(struct prkdf_decode_frame, entry, target)
+#define PRKDF_OBJECT(obj, type_attr) \
+	PRKDF_LINK(obj.asn1_class_attr, com_key_attr), \
+	PRKDF_LINK(obj.asn1_subclass_attr, com_prkey_attr), \
+	PRKDF_LINK(obj.asn1_type_attr, type_attr)
+static const struct sc_asn1_template_link prkdf_links[] = {
+	PRKDF_OBJECT(rsa_prkey_obj, prk_rsa_attr),
+	PRKDF_OBJECT(dsa_prkey_obj, prk_dsa_attr),
+	PRKDF_OBJECT(gostr3410_prkey_obj, prk_gostr3410_attr),
+	PRKDF_OBJECT(ecc_prkey_obj, prk_ecc_attr),
+
+	PRKDF_PARM(prkey[0], rsa_prkey_obj),
+	PRKDF_PARM(prkey[1], ecc_prkey_obj),
+	PRKDF_PARM(prkey[2], dsa_prkey_obj),
+	PRKDF_PARM(prkey[3], gostr3410_prkey_obj),
+
+	PRKDF_PARM(prk_rsa_attr[0], rsakey_attr),
+	PRKDF_PARM(prk_dsa_attr[0], dsakey_attr),
+	PRKDF_PARM(prk_gostr3410_attr[0], gostr3410key_attr),
+	PRKDF_PARM(prk_ecc_attr[0], ecckey_attr),
+
+	PRKDF_PARM(rsakey_attr[0], info.path),
+	PRKDF_PARM(rsakey_attr[1], info.modulus_length),
+
+	PRKDF_PARM(dsakey_attr[0], dsakey_value_attr),
+	PRKDF_PARM(dsakey_value_attr[0], info.path),
+	PRKDF_PARM(dsakey_value_attr[1], dsakey_i_p_attr),
+	PRKDF_PARM(dsakey_i_p_attr[0], info.path),
+
+	PRKDF_PARM(gostr3410key_attr[0], info.path),
+	PRKDF_PARM(gostr3410key_attr[1], gostr3410_params[0]),
+	PRKDF_PARM(gostr3410key_attr[2], gostr3410_params[1]),
+	PRKDF_PARM(gostr3410key_attr[3], gostr3410_params[2]),
+
+	PRKDF_PARM(ecckey_attr[0], info.path),
+	PRKDF_PARM(ecckey_attr[1], info.field_length),
+
+	PRKDF_PARM(com_key_attr[0], info.id),
+	PRKDF_PARM(com_key_attr[1], info.usage),
+	PRKDF_ARG(com_key_attr[1], usage_len),
+	PRKDF_PARM(com_key_attr[2], info.native),
+	PRKDF_PARM(com_key_attr[3], info.access_flags),
+	PRKDF_ARG(com_key_attr[3], af_len),
+	PRKDF_PARM(com_key_attr[4], info.key_reference),
+	PRKDF_PARM(com_key_attr[5], supported_algorithms),
+
+	PRKDF_PARM(supported_algorithms[0], info.algo_refs[0]),
+	PRKDF_PARM(supported_algorithms[1], info.algo_refs[1]),
+	PRKDF_PARM(supported_algorithms[2], info.algo_refs[2]),
+	PRKDF_PARM(supported_algorithms[3], info.algo_refs[3]),
+	PRKDF_PARM(supported_algorithms[4], info.algo_refs[4]),
+	PRKDF_PARM(supported_algorithms[5], info.algo_refs[5]),
+	PRKDF_PARM(supported_algorithms[6], info.algo_refs[6]),
+	PRKDF_PARM(supported_algorithms[7], info.algo_refs[7]),
+
+	PRKDF_PARM(com_prkey_attr[0], info.subject.value),
+	PRKDF_ARG(com_prkey_attr[0], info.subject.len)
+};
+#undef PRKDF_LINK
+#undef PRKDF_PARM
+#undef PRKDF_ARG
+#undef PRKDF_OBJECT
+
+static const struct sc_asn1_template prkdf_template = SC_ASN1_TEMPLATE(prkdf_tables, prkdf_links);
+
 int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 				 struct sc_pkcs15_object *obj,
 				 const u8 ** buf, size_t *buflen)
 {
 	sc_context_t *ctx = p15card->card->ctx;
-	struct sc_pkcs15_prkey_info info;
-	int r, i, gostr3410_params[3];
+	struct prkdf_decode_frame f;
+	struct sc_pkcs15_prkey_info *info = &f.info;
+	int r, i;
 	struct sc_pkcs15_keyinfo_gostparams *keyinfo_gostparams;
-	size_t usage_len = sizeof(info.usage);
-	size_t af_len = sizeof(info.access_flags);
-	struct sc_asn1_entry asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_com_prkey_attr[C_ASN1_COM_PRKEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_rsakey_attr[C_ASN1_RSAKEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_prk_rsa_attr[C_ASN1_PRK_RSA_ATTR_SIZE];
-	struct sc_asn1_entry asn1_dsakey_attr[C_ASN1_DSAKEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_prk_dsa_attr[C_ASN1_PRK_DSA_ATTR_SIZE];
-	struct sc_asn1_entry asn1_dsakey_i_p_attr[C_ASN1_DSAKEY_I_P_ATTR_SIZE];
-	struct sc_asn1_entry asn1_dsakey_value_attr[C_ASN1_DSAKEY_VALUE_ATTR_SIZE];
-	struct sc_asn1_entry asn1_gostr3410key_attr[C_ASN1_GOSTR3410KEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_prk_gostr3410_attr[C_ASN1_PRK_GOSTR3410_ATTR_SIZE];
-	struct sc_asn1_entry asn1_ecckey_attr[C_ASN1_ECCKEY_ATTR];
-	struct sc_asn1_entry asn1_prk_ecc_attr[C_ASN1_PRK_ECC_ATTR];
-	struct sc_asn1_entry asn1_prkey[C_ASN1_PRKEY_SIZE];
-	struct sc_asn1_entry asn1_supported_algorithms[C_ASN1_SUPPORTED_ALGORITHMS_SIZE];
-	struct sc_asn1_pkcs15_object rsa_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_rsa_attr};
-	struct sc_asn1_pkcs15_object dsa_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_dsa_attr};
-	struct sc_asn1_pkcs15_object gostr3410_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_gostr3410_attr};
-	struct sc_asn1_pkcs15_object ecc_prkey_obj = { obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_ecc_attr };
-
-	sc_copy_asn1_entry(c_asn1_prkey, asn1_prkey);
-	sc_copy_asn1_entry(c_asn1_supported_algorithms, asn1_supported_algorithms);
-
-	sc_copy_asn1_entry(c_asn1_prk_rsa_attr, asn1_prk_rsa_attr);
-	sc_copy_asn1_entry(c_asn1_rsakey_attr, asn1_rsakey_attr);
-	sc_copy_asn1_entry(c_asn1_prk_dsa_attr, asn1_prk_dsa_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_attr, asn1_dsakey_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_value_attr, asn1_dsakey_value_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_i_p_attr, asn1_dsakey_i_p_attr);
-	sc_copy_asn1_entry(c_asn1_prk_gostr3410_attr, asn1_prk_gostr3410_attr);
-	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, asn1_gostr3410key_attr);
-	sc_copy_asn1_entry(c_asn1_prk_ecc_attr, asn1_prk_ecc_attr);
-	sc_copy_asn1_entry(c_asn1_ecckey_attr, asn1_ecckey_attr);
-
-	sc_copy_asn1_entry(c_asn1_com_prkey_attr, asn1_com_prkey_attr);
-	sc_copy_asn1_entry(c_asn1_com_key_attr, asn1_com_key_attr);
-
-	sc_format_asn1_entry(asn1_prkey + 0, &rsa_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 1, &ecc_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 2, &dsa_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 3, &gostr3410_prkey_obj, NULL, 0);
-
-	sc_format_asn1_entry(asn1_prk_rsa_attr + 0, asn1_rsakey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_dsa_attr + 0, asn1_dsakey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_gostr3410_attr + 0, asn1_gostr3410key_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_ecc_attr + 0, asn1_ecckey_attr, NULL, 0);
-
-	sc_format_asn1_entry(asn1_rsakey_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_rsakey_attr + 1, &info.modulus_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_dsakey_attr + 0, asn1_dsakey_value_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_value_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_value_attr + 1, asn1_dsakey_i_p_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_i_p_attr + 0, &info.path, NULL, 0);
-
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 1, &gostr3410_params[0], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 2, &gostr3410_params[1], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 3, &gostr3410_params[2], NULL, 0);
-
-	sc_format_asn1_entry(asn1_ecckey_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_ecckey_attr + 1, &info.field_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_com_key_attr + 0, &info.id, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 1, &info.usage, &usage_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 2, &info.native, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 3, &info.access_flags, &af_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 4, &info.key_reference, NULL, 0);
-
-	for (i=0; i<SC_MAX_SUPPORTED_ALGORITHMS && (asn1_supported_algorithms + i)->name; i++)
-		sc_format_asn1_entry(asn1_supported_algorithms + i, &info.algo_refs[i], NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 5, asn1_supported_algorithms, NULL, 0);
 
-	sc_format_asn1_entry(asn1_com_prkey_attr + 0, &info.subject.value, &info.subject.len, 0);
+	sc_asn1_template_init(&prkdf_template, &f);
+	f.rsa_prkey_obj.p15_obj = obj;
+	f.dsa_prkey_obj.p15_obj = obj;
+	f.gostr3410_prkey_obj.p15_obj = obj;
+	f.ecc_prkey_obj.p15_obj = obj;
+	f.usage_len = sizeof(info->usage);
+	f.af_len = sizeof(info->access_flags);
+	/* the subject points into the DF, see struct sc_pkcs15_df */
+	if (p15card->parsing_df != NULL)
+		f.com_prkey_attr[0].flags |= SC_ASN1_BORROW;
 
 	/* Fill in defaults */
-	memset(&info, 0, sizeof(info));
-	info.key_reference = -1;
-	info.native = 1;
-	memset(gostr3410_params, 0, sizeof(gostr3410_params));
+	memset(info, 0, sizeof(*info));
+	info->key_reference = -1;
+	info->native = 1;
+	memset(f.gostr3410_params, 0, sizeof(f.gostr3410_params));
 
-	r = sc_asn1_decode_choice(ctx, asn1_prkey, *buf, *buflen, buf, buflen);
+	r = sc_asn1_decode_choice(ctx, f.prkey, *buf, *buflen, buf, buflen);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "PrKey DF ASN.1 decoding failed");
-	if (asn1_prkey[0].flags & SC_ASN1_PRESENT) {
+	if (f.prkey[0].flags & SC_ASN1_PRESENT) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_RSA;
 	}
-	else if (asn1_prkey[1].flags & SC_ASN1_PRESENT) {
+	else if (f.prkey[1].flags & SC_ASN1_PRESENT) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_EC;
 	}
-	else if (asn1_prkey[2].flags & SC_ASN1_PRESENT) {
+	else if (f.prkey[2].flags & SC_ASN1_PRESENT) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_DSA;
 		/* If the value was indirect-protected, mark the path */
-		if (asn1_dsakey_i_p_attr[0].flags & SC_ASN1_PRESENT)
-			info.path.type = SC_PATH_TYPE_PATH_PROT;
+		if (f.dsakey_i_p_attr[0].flags & SC_ASN1_PRESENT)
+			info->path.type = SC_PATH_TYPE_PATH_PROT;
 	}
-	else if (asn1_prkey[3].flags & SC_ASN1_PRESENT) {
+	else if (f.prkey[3].flags & SC_ASN1_PRESENT) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_GOSTR3410;
-		assert(info.modulus_length == 0);
-		info.modulus_length = SC_PKCS15_GOSTR3410_KEYSIZE;
-		assert(info.params.len == 0);
-		info.params.len = sizeof(struct sc_pkcs15_keyinfo_gostparams);
-		info.params.data = malloc(info.params.len);
-		if (info.params.data == NULL)
+		assert(info->modulus_length == 0);
+		info->modulus_length = SC_PKCS15_GOSTR3410_KEYSIZE;
+		assert(info->params.len == 0);
+		info->params.len = sizeof(struct sc_pkcs15_keyinfo_gostparams);
+		info->params.data = malloc(info->params.len);
+		if (info->params.data == NULL)
 			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-		assert(sizeof(*keyinfo_gostparams) == info.params.len);
-		keyinfo_gostparams = info.params.data;
-		keyinfo_gostparams->gostr3410 = gostr3410_params[0];
-		keyinfo_gostparams->gostr3411 = gostr3410_params[1];
-		keyinfo_gostparams->gost28147 = gostr3410_params[2];
+		assert(sizeof(*keyinfo_gostparams) == info->params.len);
+		keyinfo_gostparams = info->params.data;
+		keyinfo_gostparams->gostr3410 = f.gostr3410_params[0];
+		keyinfo_gostparams->gostr3411 = f.gostr3410_params[1];
+		keyinfo_gostparams->gost28147 = f.gostr3410_params[2];
 	}
 	else {
 		sc_log(ctx, "Neither RSA or DSA or GOSTR3410 or ECC key in PrKDF entry.");
@@ -286,26 +336,27 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	}
 
 	if (!p15card->app || !p15card->app->ddo.aid.len)   {
-		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info.path);
+		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info->path);
 		if (r < 0) {
-			sc_pkcs15_free_key_params(&info.params);
+			sc_pkcs15_free_key_params(&info->params);
 			return r;
 		}
 	}
 	else   {
-		info.path.aid = p15card->app->ddo.aid;
+		info->path.aid = p15card->app->ddo.aid;
 	}
-	sc_log(ctx, "PrivKey path '%s'", sc_print_path(&info.path));
+	sc_log(ctx, "PrivKey path '%s'", sc_print_path(&info->path));
 
 	/* OpenSC 0.11.4 and older encoded "keyReference" as a negative value.
 	 * Fixed in 0.11.5 we need to add a hack, so old cards continue to work. */
-	if (info.key_reference < -1)
-		info.key_reference += 256;
+	if (info->key_reference < -1)
+		info->key_reference += 256;
 
 	/* Check the auth_id - if not present, try and find it in access rules */
-	if ((obj->flags & SC_PKCS15_CO_FLAG_PRIVATE) && (obj->auth_id.len == 0)) {
+	if ((obj->flags & SC_PKCS15_CO_FLAG_PRIVATE) && (obj->auth_id.len == 0)
+			&& obj->access_rules != NULL) {
 		sc_log(ctx, "Private key %s has no auth ID - checking AccessControlRules",
-				sc_pkcs15_print_id(&info.id));
+				sc_pkcs15_print_id(&info->id));
 
 		/* Search in the access_rules for an appropriate auth ID */
 		for (i = 0; i < SC_PKCS15_MAX_ACCESS_RULES; i++) {
@@ -330,15 +381,15 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 			sc_log(ctx, "Warning: No auth ID found");
 	}
 
-	obj->data = malloc(sizeof(info));
+	obj->data = sc_pkcs15_alloc_object_data(obj, sizeof(*info));
 	if (obj->data == NULL) {
-		sc_pkcs15_free_key_params(&info.params);
+		sc_pkcs15_free_key_params(&info->params);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
-	memcpy(obj->data, &info, sizeof(info));
+	memcpy(obj->data, info, sizeof(*info));
 
-	sc_log(ctx, "Key Subject %s", sc_dump_hex(info.subject.value, info.subject.len));
-	sc_log(ctx, "Key path %s", sc_print_path(&info.path));
+	sc_log(ctx, "Key Subject %s", sc_dump_hex(info->subject.value, info->subject.len));
+	sc_log(ctx, "Key path %s", sc_print_path(&info->path));
 	return 0;
 }
 
@@ -248,6 +248,9 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, asn1_gostr3410key_attr);
 	sc_copy_asn1_entry(c_asn1_com_pubkey_attr, asn1_com_pubkey_attr);
 	sc_copy_asn1_entry(c_asn1_com_key_attr, asn1_com_key_attr);
+	/* the subject points into the DF, see struct sc_pkcs15_df */
+	if (p15card->parsing_df != NULL)
+		asn1_com_pubkey_attr[0].flags |= SC_ASN1_BORROW;
 
 	sc_format_asn1_entry(asn1_com_pubkey_attr + 0, &info.subject.value, &info.subject.len, 0);
 
@@ -344,7 +347,7 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 	if (info.key_reference < -1)
 		info.key_reference += 256;
 
-	obj->data = malloc(sizeof(info));
+	obj->data = sc_pkcs15_alloc_object_data(obj, sizeof(info));
 	if (obj->data == NULL) {
 		sc_pkcs15_free_key_params(&info.params);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
@@ -937,6 +940,10 @@ sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_obj
 		LOG_TEST_RET(ctx, r, "Card specific 'read-public' procedure failed.");
 
 		r = sc_pkcs15_decode_pubkey(ctx, pubkey, data, len);
+		if (r == SC_SUCCESS)
+			/* decoded from the object content next time */
+			sc_pkcs15_allocate_object_content(ctx, (struct sc_pkcs15_object *) obj, data, len);
+		free(data);
 		LOG_TEST_RET(ctx, r, "Decode public key error");
 	}
 	else if (info->path.len)   {
@@ -944,10 +951,16 @@ sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_obj
 		r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
 		LOG_TEST_RET(ctx, r, "Failed to read public key file.");
 
-		if (algorithm == SC_ALGORITHM_EC && *data == (SC_ASN1_TAG_SEQUENCE | SC_ASN1_TAG_CONSTRUCTED))
+		if (algorithm == SC_ALGORITHM_EC && *data == (SC_ASN1_TAG_SEQUENCE | SC_ASN1_TAG_CONSTRUCTED)) {
 			r = sc_pkcs15_pubkey_from_spki_sequence(ctx, data, len, &pubkey);
-		else
+		}
+		else {
 			r = sc_pkcs15_decode_pubkey(ctx, pubkey, data, len);
+			if (r == SC_SUCCESS)
+				/* decoded from the object content next time */
+				sc_pkcs15_allocate_object_content(ctx, (struct sc_pkcs15_object *) obj, data, len);
+		}
+		free(data);
 		LOG_TEST_RET(ctx, r, "Decode public key error");
 	}
 	else {
@@ -1069,6 +1082,8 @@ sc_pkcs15_dup_pubkey(struct sc_context *ctx, struct sc_pkcs15_pubkey *key, struc
 			rv = sc_pkcs15_dup_bignum(&pubkey->u.dsa.g, &key->u.dsa.g);
 		break;
 	case SC_ALGORITHM_GOSTR3410:
+		pubkey->u.gostr3410.params = key->u.gostr3410.params;
+		rv = sc_pkcs15_dup_bignum(&pubkey->u.gostr3410.xy, &key->u.gostr3410.xy);
 		break;
 	case SC_ALGORITHM_EC:
 		pubkey->u.ec.ecpointQ.value = malloc(key->u.ec.ecpointQ.len);
@@ -1087,9 +1102,11 @@ sc_pkcs15_dup_pubkey(struct sc_context *ctx, struct sc_pkcs15_pubkey *key, struc
 		memcpy(pubkey->u.ec.params.der.value, key->u.ec.params.der.value, key->u.ec.params.der.len);
 		pubkey->u.ec.params.der.len = key->u.ec.params.der.len;
 
-		pubkey->u.ec.params.named_curve = strdup(key->u.ec.params.named_curve);
-		if (!pubkey->u.ec.params.named_curve)
-			rv = SC_ERROR_OUT_OF_MEMORY;
+		if (key->u.ec.params.named_curve) {
+			pubkey->u.ec.params.named_curve = strdup(key->u.ec.params.named_curve);
+			if (!pubkey->u.ec.params.named_curve)
+				rv = SC_ERROR_OUT_OF_MEMORY;
+		}
 
 		break;
 	default:
@@ -1385,6 +1402,22 @@ static struct ec_curve_info {
 };
 
 
+/* Compare DER with the encoded form kept in ec_curve_infos, without
+ * formatting and encoding the curve OID for every table entry */
+static int
+ec_curve_der_equal(const char *hex, const unsigned char *der, size_t der_len)
+{
+	unsigned char buf[32];
+	size_t len = sizeof(buf);
+
+	if (strlen(hex) != der_len * 2)
+		return 0;
+	if (sc_hex_to_bin(hex, buf, &len) != SC_SUCCESS)
+		return 0;
+	return len == der_len && !memcmp(buf, der, der_len);
+}
+
+
 int
 sc_pkcs15_fix_ec_parameters(struct sc_context *ctx, struct sc_pkcs15_ec_parameters *ecparams)
 {
@@ -1394,21 +1427,9 @@ sc_pkcs15_fix_ec_parameters(struct sc_context *ctx, struct sc_pkcs15_ec_paramete
 
 	/* In PKCS#11 EC parameters arrives in DER encoded form */
 	if (ecparams->der.value && ecparams->der.len)   {
-		for (ii=0; ec_curve_infos[ii].name; ii++)   {
-			struct sc_object_id id;
-			unsigned char *buf = NULL;
-			size_t len = 0;
-
-			sc_format_oid(&id, ec_curve_infos[ii].oid_str);
-			sc_encode_oid (ctx, &id, &buf, &len);
-
-			if (ecparams->der.len == len && !memcmp(ecparams->der.value, buf, len))   {
-				free(buf);
+		for (ii=0; ec_curve_infos[ii].name; ii++)
+			if (ec_curve_der_equal(ec_curve_infos[ii].oid_encoded, ecparams->der.value, ecparams->der.len))
 				break;
-			}
-
-			free(buf);
-		}
 
 		/* TODO: support of explicit EC parameters form */
 		if (!ec_curve_infos[ii].name)
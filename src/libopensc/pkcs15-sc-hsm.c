@@ -455,28 +455,24 @@ void sc_pkcs15emu_sc_hsm_free_cvc(sc_cvc_t *cvc)
 
 
 
-static int sc_pkcs15emu_sc_hsm_add_pubkey(sc_pkcs15_card_t *p15card, sc_pkcs15_prkey_info_t *key_info, char *label)
+static int sc_pkcs15emu_sc_hsm_add_pubkey(sc_pkcs15_card_t *p15card, sc_pkcs15_prkey_info_t *key_info, char *label,
+		const u8 *efbin, size_t efbinlen)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	sc_card_t *card = p15card->card;
 	sc_pkcs15_pubkey_info_t pubkey_info;
 	sc_pkcs15_object_t pubkey_obj;
 	struct sc_pkcs15_pubkey pubkey;
-	u8 efbin[1024];
 	sc_cvc_t cvc;
-	u8 *cvcpo;
+	const u8 *cvcpo;
 	size_t cvclen;
 	int r;
 
-	/* EF.CERT is selected */
-	r = sc_read_binary(p15card->card, 0, efbin, sizeof(efbin), 0);
-	LOG_TEST_RET(ctx, r, "Could not read CSR from EF");
-
 	cvcpo = efbin;
-	cvclen = r;
+	cvclen = efbinlen;
 
 	memset(&cvc, 0, sizeof(cvc));
-	r = sc_pkcs15emu_sc_hsm_decode_cvc(p15card, (const u8 **)&cvcpo, &cvclen, &cvc);
+	r = sc_pkcs15emu_sc_hsm_decode_cvc(p15card, &cvcpo, &cvclen, &cvc);
 	LOG_TEST_RET(ctx, r, "Could decode certificate signing request");
 
 	memset(&pubkey, 0, sizeof(pubkey));
@@ -510,10 +506,27 @@ static int sc_pkcs15emu_sc_hsm_add_pubkey(sc_pkcs15_card_t *p15card, sc_pkcs15_p
 
 
 
+/*
+ * Check if ENUMERATE OBJECTS listed a file, saves a SELECT that would fail
+ */
+static int sc_pkcs15emu_sc_hsm_listed(const u8 *filelist, int filelistlength, u8 prefix, u8 id)
+{
+	int i;
+
+	for (i = 0; i + 1 < filelistlength; i += 2) {
+		if (filelist[i] == prefix && filelist[i + 1] == id)
+			return 1;
+	}
+	return 0;
+}
+
+
+
 /*
  * Add a key and the key description in PKCS#15 format to the framework
  */
-static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
+static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid,
+		const u8 *filelist, int filelistlength) {
 
 	sc_card_t *card = p15card->card;
 	sc_pkcs15_cert_info_t cert_info;
@@ -524,13 +537,16 @@ static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
 	sc_path_t path;
 	u8 fid[2];
 	u8 efbin[512];
-	u8 *ptr;
-	size_t len;
+	u8 *ptr, *certbin = NULL;
+	size_t len, certlen = 0;
 	int r;
 
 	fid[0] = PRKD_PREFIX;
 	fid[1] = keyid;
 
+	if (!sc_pkcs15emu_sc_hsm_listed(filelist, filelistlength, PRKD_PREFIX, keyid))
+		return SC_SUCCESS;
+
 	/* Try to select a related EF containing the PKCS#15 description of the key */
 	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
 	r = sc_select_file(card, &path, &file);
@@ -573,28 +589,26 @@ static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
 	/* Check if we also have a certificate for the private key */
 	fid[0] = EE_CERTIFICATE_PREFIX;
 
-	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-	r = sc_select_file(card, &path, &file);
-
-	if (r != SC_SUCCESS) {
+	if (!sc_pkcs15emu_sc_hsm_listed(filelist, filelistlength, EE_CERTIFICATE_PREFIX, keyid))
 		return SC_SUCCESS;
-	}
-
-	sc_file_free(file);
 
-	/* Check if the certificate is a X.509 certificate */
-	r = sc_read_binary(p15card->card, 0, efbin, 1, 0);
+	/* Read it completely, it is kept with the certificate object */
+	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, -1);
+	r = sc_pkcs15_read_file(p15card, &path, &certbin, &certlen);
 
-	if (r < 0) {
+	if (r < 0 || certlen == 0) {
+		free(certbin);
 		return SC_SUCCESS;
 	}
 
-	if (efbin[0] == 0x67) {		/* Decode CSR and create public key object */
-		sc_pkcs15emu_sc_hsm_add_pubkey(p15card, key_info, prkd.label);
+	if (certbin[0] == 0x67) {		/* Decode CSR and create public key object */
+		sc_pkcs15emu_sc_hsm_add_pubkey(p15card, key_info, prkd.label, certbin, certlen);
+		free(certbin);
 		return SC_SUCCESS;		/* Ignore any errors */
 	}
 
-	if (efbin[0] != 0x30) {
+	if (certbin[0] != 0x30) {
+		free(certbin);
 		return SC_SUCCESS;
 	}
 
@@ -603,10 +617,13 @@ static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
 
 	cert_info.id = key_info->id;
 	cert_info.path = path;
-	cert_info.path.count = -1;
+	cert_info.value.value = certbin;
+	cert_info.value.len = certlen;
 
 	strlcpy(cert_obj.label, prkd.label, sizeof(cert_obj.label));
 	r = sc_pkcs15emu_add_x509_cert(p15card, &cert_obj, &cert_info);
+	if (r < 0)
+		free(certbin);
 	LOG_TEST_RET(card->ctx, r, "Could not add certificate");
 
 	return SC_SUCCESS;
@@ -888,10 +905,14 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 	filelistlength = sc_list_files(card, filelist, sizeof(filelist));
 	LOG_TEST_RET(card->ctx, filelistlength, "Could not enumerate file and key identifier");
 
+	/* Read all descriptions in one transaction */
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
 	for (i = 0; i < filelistlength; i += 2) {
 		switch(filelist[i]) {
 		case KEY_PREFIX:
-			r = sc_pkcs15emu_sc_hsm_add_prkd(p15card, filelist[i + 1]);
+			r = sc_pkcs15emu_sc_hsm_add_prkd(p15card, filelist[i + 1], filelist, filelistlength);
 			break;
 		case DCOD_PREFIX:
 			r = sc_pkcs15emu_sc_hsm_add_dcod(p15card, filelist[i + 1]);
@@ -903,8 +924,15 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 		if (r != SC_SUCCESS) {
 			sc_log(card->ctx, "Error %d adding elements to framework", r);
 		}
+		if (r == SC_ERROR_CARD_REMOVED || r == SC_ERROR_CARD_RESET)
+			break;
 	}
 
+	sc_unlock(card);
+
+	if (r == SC_ERROR_CARD_REMOVED || r == SC_ERROR_CARD_RESET)
+		LOG_FUNC_RETURN(card->ctx, r);
+
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
 
@@ -31,17 +31,16 @@
 #include "internal.h"
 #include "pkcs15.h"
 
-static int select_key_file(struct sc_pkcs15_card *p15card,
+static int key_file_path(struct sc_pkcs15_card *p15card,
 			   const struct sc_pkcs15_prkey_info *prkey,
-			   sc_security_env_t *senv)
+			   sc_security_env_t *senv, sc_path_t *path)
 {
 	sc_context_t *ctx = p15card->card->ctx;
-	sc_path_t path, file_id;
-	int r;
+	sc_path_t file_id;
 
 	LOG_FUNC_CALLED(ctx);
 
-	memset(&path, 0, sizeof(sc_path_t));
+	memset(path, 0, sizeof(sc_path_t));
 	memset(&file_id, 0, sizeof(sc_path_t));
 
 	/* TODO: Why file_app may be NULL -- at least 3F00 has to be present?
@@ -50,18 +49,18 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 	   in that case we allways assume an absolute path */
 	if (!prkey->path.len && prkey->path.aid.len)   {
 		/* Private key is a SDO allocated in application DF */
-		path = prkey->path;
+		*path = prkey->path;
 	}
 	else if (prkey->path.len == 2 && p15card->file_app != NULL) {
 		/* Path is relative to app. DF */
-		path = p15card->file_app->path;
+		*path = p15card->file_app->path;
 		file_id = prkey->path;
-		sc_append_path(&path, &file_id);
+		sc_append_path(path, &file_id);
 		senv->file_ref = file_id;
 		senv->flags |= SC_SEC_ENV_FILE_REF_PRESENT;
 	}
 	else if (prkey->path.len > 2)   {
-		path = prkey->path;
+		*path = prkey->path;
 		memcpy(file_id.value, prkey->path.value + prkey->path.len - 2, 2);
 		file_id.len = 2;
 		file_id.type = SC_PATH_TYPE_FILE_ID;
@@ -72,12 +71,91 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "invalid private key path");
 	}
 
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+static int select_key_file(struct sc_pkcs15_card *p15card,
+			   const struct sc_pkcs15_prkey_info *prkey,
+			   sc_security_env_t *senv)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	sc_path_t path;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	r = key_file_path(p15card, prkey, senv, &path);
+	LOG_TEST_RET(ctx, r, "invalid private key path");
+
 	r = sc_select_file(p15card->card, &path, NULL);
 	LOG_TEST_RET(ctx, r, "sc_select_file() failed");
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
- 
+
+/*
+ * Select the private key file and set the security environment.
+ * Both are skipped when the card is still in the state left by the
+ * previous operation with the same environment: no APDU was sent since,
+ * and the card was neither reset nor released to other applications.
+ * Without may_reuse the environment is always set again.
+ */
+static int set_key_security_env(struct sc_pkcs15_card *p15card,
+			   const struct sc_pkcs15_prkey_info *prkey,
+			   sc_security_env_t *senv, int may_reuse, int *reused)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct sc_card_cache *cache = &p15card->card->cache;
+	sc_path_t path;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	*reused = 0;
+	memset(&path, 0, sizeof(path));
+	sc_log(ctx, "Private key path '%s'", sc_print_path(&prkey->path));
+	if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
+		r = key_file_path(p15card, prkey, senv, &path);
+		LOG_TEST_RET(ctx, r, "Unable to select private key file");
+	}
+
+	if (may_reuse && cache->valid && cache->sec_env_valid
+			&& cache->sec_env_apdu_count == cache->apdu_count
+			&& cache->sec_env_generation == p15card->card->reader->card_generation
+			&& sc_compare_path(&cache->sec_env_path, &path)
+			&& cache->sec_env_path.aid.len == path.aid.len
+			&& !memcmp(cache->sec_env_path.aid.value, path.aid.value, path.aid.len)
+			&& !memcmp(&cache->sec_env, senv, sizeof(*senv))) {
+		sc_log(ctx, "security environment is still set");
+		*reused = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	if (path.len != 0 || path.aid.len != 0) {
+		r = sc_select_file(p15card->card, &path, NULL);
+		LOG_TEST_RET(ctx, r, "Unable to select private key file");
+	}
+
+	r = sc_set_security_env(p15card->card, senv, 0);
+	LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+
+	memcpy(&cache->sec_env, senv, sizeof(*senv));
+	cache->sec_env_path = path;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+/* The security environment stays usable after a successful operation */
+static void sec_env_done(struct sc_card *card, int r)
+{
+	if (r < 0) {
+		card->cache.sec_env_valid = 0;
+		return;
+	}
+	card->cache.sec_env_valid = 1;
+	card->cache.sec_env_apdu_count = card->cache.apdu_count;
+	card->cache.sec_env_generation = card->reader->card_generation;
+}
+
 int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		       const struct sc_pkcs15_object *obj,
 		       unsigned long flags,
@@ -89,6 +167,7 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 	sc_security_env_t senv;
 	const struct sc_pkcs15_prkey_info *prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
 	unsigned long pad_flags = 0, sec_flags = 0;
+	int reused;
 
 	LOG_FUNC_CALLED(ctx);
 
@@ -145,23 +224,20 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
 
-	if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
-		r = select_key_file(p15card, prkey, &senv);
-		if (r < 0) {
-			sc_unlock(p15card->card);
-			LOG_TEST_RET(ctx, r,"Unable to select private key file");
+	for (;;) {
+		r = set_key_security_env(p15card, prkey, &senv,
+				p15card->opts.use_sec_env_cache, &reused);
+		if (r < 0)
+			break;
+		r = sc_decipher(p15card->card, in, inlen, out, outlen);
+		if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED) {
+			if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
+				r = sc_decipher(p15card->card, in, inlen, out, outlen);
 		}
-	}
-
-	r = sc_set_security_env(p15card->card, &senv, 0);
-	if (r < 0) {
-		sc_unlock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
-	}
-	r = sc_decipher(p15card->card, in, inlen, out, outlen);
-	if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED) {
-		if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
-			r = sc_decipher(p15card->card, in, inlen, out, outlen);
+		sec_env_done(p15card->card, r);
+		if (r >= 0 || !reused)
+			break;
+		sc_log(ctx, "retry with a new security environment");
 	}
 	sc_unlock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_decipher() failed");
@@ -172,6 +248,12 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		r = sc_pkcs1_strip_02_padding(ctx, out, s, out, &s);
 		LOG_TEST_RET(ctx, r, "Invalid PKCS#1 padding");
 	}
+	else if (pad_flags & SC_ALGORITHM_RSA_PAD_OAEP) {
+		size_t s = r;
+		r = sc_pkcs1_strip_oaep_padding(ctx, pad_flags, out, s,
+				(prkey->modulus_length + 7) / 8, out, &s);
+		LOG_TEST_RET(ctx, r, "Invalid OAEP padding");
+	}
 
 	LOG_FUNC_RETURN(ctx, r);
 }
@@ -293,10 +375,10 @@ out:
 #define USAGE_ANY_DECIPHER      (SC_PKCS15_PRKEY_USAGE_DECRYPT|\
                                  SC_PKCS15_PRKEY_USAGE_UNWRAP)
 
-int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
+static int compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *obj,
 				unsigned long flags, const u8 *in, size_t inlen,
-				u8 *out, size_t outlen)
+				u8 *out, size_t outlen, int may_reuse)
 {
 	sc_context_t *ctx = p15card->card->ctx;
 	int r;
@@ -306,6 +388,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	u8 buf[1024], *tmp;
 	size_t modlen;
 	unsigned long pad_flags = 0, sec_flags = 0;
+	int reused;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "security operation flags 0x%X", flags);
@@ -476,29 +559,73 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
 
-	sc_log(ctx, "Private key path '%s'", sc_print_path(&prkey->path));
-	if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
-		r = select_key_file(p15card, prkey, &senv);
-		if (r < 0) {
-			sc_unlock(p15card->card);
-			LOG_TEST_RET(ctx, r,"Unable to select private key file");
-		}
-	}
-
-	r = sc_set_security_env(p15card->card, &senv, 0);
-	if (r < 0) {
-		sc_unlock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+	for (;;) {
+		r = set_key_security_env(p15card, prkey, &senv, may_reuse, &reused);
+		if (r < 0)
+			break;
+		r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
+		if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED)
+			if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
+				r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
+		sec_env_done(p15card->card, r);
+		if (r >= 0 || !reused)
+			break;
+		sc_log(ctx, "retry with a new security environment");
 	}
 
-	r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
-	if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED)
-		if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
-			r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
-
 	sc_mem_clear(buf, sizeof(buf));
 	sc_unlock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_compute_signature() failed");
 
 	LOG_FUNC_RETURN(ctx, r);
 }
+
+int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj,
+				unsigned long flags, const u8 *in, size_t inlen,
+				u8 *out, size_t outlen)
+{
+	return compute_signature(p15card, obj, flags, in, inlen, out, outlen,
+			p15card->opts.use_sec_env_cache);
+}
+
+/*
+ * Sign count inputs with the same key and flags while holding the card
+ * lock. The key file is selected and the security environment set for
+ * the first input only, the following signatures are computed right
+ * away. Signature i is written to out + i * outlen, its length to
+ * siglen[i]. Stops at the first failure.
+ */
+int sc_pkcs15_compute_signatures(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj,
+				unsigned long flags, const u8 * const *in,
+				const size_t *inlen, size_t count,
+				u8 *out, size_t outlen, size_t *siglen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	size_t i;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (count && (in == NULL || inlen == NULL || out == NULL || siglen == NULL))
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+
+	/* Only reuse what this batch has set, unless the cache is enabled */
+	if (!p15card->opts.use_sec_env_cache)
+		p15card->card->cache.sec_env_valid = 0;
+
+	for (i = 0; i < count; i++) {
+		r = compute_signature(p15card, obj, flags, in[i], inlen[i],
+				out + i * outlen, outlen, 1);
+		if (r < 0)
+			break;
+		siglen[i] = r;
+	}
+
+	sc_unlock(p15card->card);
+	LOG_TEST_RET(ctx, r, "batch signature failed");
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
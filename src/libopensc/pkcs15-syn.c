@@ -30,6 +30,7 @@
 #include "internal.h"
 #include "asn1.h"
 #include "pkcs15.h"
+#include "probes.h"
 
 extern int sc_pkcs15emu_westcos_init_ex(sc_pkcs15_card_t *p15card, 
 					sc_pkcs15emu_opt_t *opts);
@@ -70,30 +71,83 @@ extern int sc_pkcs15emu_sc_hsm_init_ex(sc_pkcs15_card_t *,
 extern int sc_pkcs15emu_dnie_init_ex(sc_pkcs15_card_t *,
 					sc_pkcs15emu_opt_t *);
 
+/* The card drivers of the cards an emulator handles, separated by
+ * spaces; NULL if it has to look at any card */
 static struct {
 	const char *		name;
 	int			(*handler)(sc_pkcs15_card_t *, sc_pkcs15emu_opt_t *);
+	const char *		drivers;
 } builtin_emulators[] = {
-	{ "westcos",	sc_pkcs15emu_westcos_init_ex	},
-	{ "openpgp",	sc_pkcs15emu_openpgp_init_ex	},
-	{ "infocamere",	sc_pkcs15emu_infocamere_init_ex	},
-	{ "starcert",	sc_pkcs15emu_starcert_init_ex	},
-	{ "tcos",	sc_pkcs15emu_tcos_init_ex	},
-	{ "esteid",	sc_pkcs15emu_esteid_init_ex	},
-	{ "itacns",	sc_pkcs15emu_itacns_init_ex	},
-	{ "postecert",	sc_pkcs15emu_postecert_init_ex  },
-	{ "PIV-II",     sc_pkcs15emu_piv_init_ex        },
-	{ "gemsafeGPK",	sc_pkcs15emu_gemsafeGPK_init_ex	},
-	{ "gemsafeV1",	sc_pkcs15emu_gemsafeV1_init_ex	},
-	{ "actalis",	sc_pkcs15emu_actalis_init_ex	},
-	{ "atrust-acos",sc_pkcs15emu_atrust_acos_init_ex},
-	{ "tccardos",	sc_pkcs15emu_tccardos_init_ex	},
-	{ "entersafe",  sc_pkcs15emu_entersafe_init_ex  },
-	{ "pteid",	sc_pkcs15emu_pteid_init_ex	},
-	{ "oberthur",   sc_pkcs15emu_oberthur_init_ex	},
-	{ "sc-hsm",   sc_pkcs15emu_sc_hsm_init_ex	},
-	{ "dnie",       sc_pkcs15emu_dnie_init_ex   },
-	{ NULL, NULL }
+#ifndef DISABLE_DRIVER_WESTCOS
+	{ "westcos",	sc_pkcs15emu_westcos_init_ex,	"westcos"	},
+#endif
+#ifndef DISABLE_DRIVER_OPENPGP
+	{ "openpgp",	sc_pkcs15emu_openpgp_init_ex,	"openpgp"	},
+#endif
+#if !defined(DISABLE_DRIVER_STARCOS) || !defined(DISABLE_DRIVER_CARDOS)
+	{ "infocamere",	sc_pkcs15emu_infocamere_init_ex, "starcos cardos" },
+#endif
+#ifndef DISABLE_DRIVER_STARCOS
+	{ "starcert",	sc_pkcs15emu_starcert_init_ex,	"starcos"	},
+#endif
+#ifndef DISABLE_DRIVER_TCOS
+	{ "tcos",	sc_pkcs15emu_tcos_init_ex,	"tcos"		},
+#endif
+#ifndef DISABLE_DRIVER_MCRD
+	{ "esteid",	sc_pkcs15emu_esteid_init_ex,	"mcrd"		},
+#endif
+#if !defined(DISABLE_DRIVER_ITACNS) || !defined(DISABLE_DRIVER_CARDOS)
+	{ "itacns",	sc_pkcs15emu_itacns_init_ex,	"itacns cardos"	},
+#endif
+#ifndef DISABLE_DRIVER_CARDOS
+	{ "postecert",	sc_pkcs15emu_postecert_init_ex, "cardos"	},
+#endif
+#ifndef DISABLE_DRIVER_PIV
+	{ "PIV-II",     sc_pkcs15emu_piv_init_ex,	"piv"		},
+#endif
+#ifndef DISABLE_DRIVER_GPK
+	{ "gemsafeGPK",	sc_pkcs15emu_gemsafeGPK_init_ex, "gpk"		},
+#endif
+#ifndef DISABLE_DRIVER_GEMSAFEV1
+	{ "gemsafeV1",	sc_pkcs15emu_gemsafeV1_init_ex,	"gemsafeV1"	},
+#endif
+#ifndef DISABLE_DRIVER_CARDOS
+	{ "actalis",	sc_pkcs15emu_actalis_init_ex,	"cardos"	},
+#endif
+#ifndef DISABLE_DRIVER_ATRUST_ACOS
+	{ "atrust-acos",sc_pkcs15emu_atrust_acos_init_ex, "atrust-acos"	},
+#endif
+#ifndef DISABLE_DRIVER_CARDOS
+	{ "tccardos",	sc_pkcs15emu_tccardos_init_ex,	"cardos"	},
+#endif
+#ifndef DISABLE_DRIVER_ENTERSAFE
+	{ "entersafe",  sc_pkcs15emu_entersafe_init_ex,	"entersafe"	},
+#endif
+#if !defined(DISABLE_DRIVER_IAS) || !defined(DISABLE_DRIVER_GEMSAFEV1)
+	{ "pteid",	sc_pkcs15emu_pteid_init_ex,	"ias gemsafeV1"	},
+#endif
+#ifndef DISABLE_DRIVER_OBERTHUR
+	{ "oberthur",   sc_pkcs15emu_oberthur_init_ex,	"oberthur"	},
+#endif
+#ifndef DISABLE_DRIVER_SC_HSM
+	{ "sc-hsm",   sc_pkcs15emu_sc_hsm_init_ex,	"sc-hsm"	},
+#endif
+#ifndef DISABLE_DRIVER_DNIE
+	{ "dnie",       sc_pkcs15emu_dnie_init_ex,	"dnie"		},
+#endif
+	{ NULL, NULL, NULL }
+};
+
+#define BUILTIN_EMULATOR_COUNT	(sizeof(builtin_emulators)/sizeof(builtin_emulators[0]) - 1)
+
+/* Builtin emulator that bound an ATR, tried first for that ATR */
+#define SC_EMU_CACHE_SIZE	32
+struct sc_emu_cache {
+	size_t count;
+	struct {
+		struct sc_atr atr;
+		int emulator;
+	} entries[SC_EMU_CACHE_SIZE];
 };
 
 static int parse_emu_block(sc_pkcs15_card_t *, scconf_block *);
@@ -127,12 +181,150 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
+static int try_builtin_emulator(sc_pkcs15_card_t *p15card, int i, sc_pkcs15emu_opt_t *opts)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	unsigned long long start = sc_startup_trace_begin(ctx);
+	int r;
+
+	r = builtin_emulators[i].handler(p15card, opts);
+	sc_startup_trace_end(ctx, start, "pkcs15", "emulator %s", builtin_emulators[i].name);
+	return r;
+}
+
+void _sc_free_emu_cache(sc_context_t *ctx)
+{
+	free(ctx->emu_cache);
+	ctx->emu_cache = NULL;
+}
+
+static int emu_cache_find(sc_card_t *card)
+{
+	struct sc_emu_cache *cache;
+	int i = -1;
+	size_t n;
+
+	sc_mutex_lock(card->ctx, card->ctx->mutex);
+	cache = card->ctx->emu_cache;
+	for (n = 0; cache != NULL && n < cache->count; n++)
+		if (cache->entries[n].atr.len == card->atr.len
+				&& !memcmp(cache->entries[n].atr.value, card->atr.value, card->atr.len)) {
+			i = cache->entries[n].emulator;
+			break;
+		}
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+	return i;
+}
+
+static void emu_cache_add(sc_card_t *card, int i)
+{
+	struct sc_emu_cache *cache;
+	size_t n;
+
+	sc_mutex_lock(card->ctx, card->ctx->mutex);
+	if (card->ctx->emu_cache == NULL)
+		card->ctx->emu_cache = calloc(1, sizeof(struct sc_emu_cache));
+	cache = card->ctx->emu_cache;
+	for (n = 0; cache != NULL && n < cache->count; n++)
+		if (cache->entries[n].atr.len == card->atr.len
+				&& !memcmp(cache->entries[n].atr.value, card->atr.value, card->atr.len))
+			break;
+	/* a full cache keeps the ATRs seen first */
+	if (cache != NULL && n < SC_EMU_CACHE_SIZE) {
+		cache->entries[n].atr = card->atr;
+		cache->entries[n].emulator = i;
+		if (n == cache->count)
+			cache->count++;
+	}
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+}
+
+/* Whether builtin emulator i handles the card, by its card driver */
+static int emulator_handles(int i, sc_card_t *card)
+{
+	const char *p = builtin_emulators[i].drivers;
+	size_t len;
+
+	if (p == NULL || card->driver == NULL)
+		return 1;
+	len = strlen(card->driver->short_name);
+	while (p != NULL) {
+		if (!strncmp(p, card->driver->short_name, len) && (p[len] == ' ' || p[len] == '\0'))
+			return 1;
+		p = strchr(p, ' ');
+		if (p != NULL)
+			p++;
+	}
+	return 0;
+}
+
+/*
+ * Tries the builtin emulators named in list, or all if list is NULL, in
+ * that order: the one that last bound the ATR, those that declare the
+ * card driver, and last those that have to look at any card.
+ */
+static int bind_builtin_emulators(sc_pkcs15_card_t *p15card, const scconf_list *list,
+		sc_pkcs15emu_opt_t *opts)
+{
+	sc_card_t *card = p15card->card;
+	sc_context_t *ctx = card->ctx;
+	/* one more, configure --enable-drivers may leave no emulator */
+	int order[BUILTIN_EMULATOR_COUNT + 1], tried[BUILTIN_EMULATOR_COUNT + 1];
+	int i, n, count = 0, pass, r = SC_ERROR_WRONG_CARD;
+	const scconf_list *item;
+
+	memset(tried, 0, sizeof(tried));
+	if (list == NULL) {
+		for (i = 0; builtin_emulators[i].name; i++)
+			order[count++] = i;
+	}
+	for (item = list; item; item = item->next)
+		for (i = 0; builtin_emulators[i].name; i++)
+			if (!strcmp(builtin_emulators[i].name, item->data) && !tried[i]) {
+				/* tried[] marks the listed ones until the passes */
+				tried[i] = 1;
+				order[count++] = i;
+			}
+	memset(tried, 0, sizeof(tried));
+
+	i = emu_cache_find(card);
+	for (n = 0; i >= 0 && n < count; n++)
+		if (order[n] == i) {
+			sc_log(ctx, "trying %s, which bound this ATR before", builtin_emulators[i].name);
+			tried[i] = 1;
+			r = try_builtin_emulator(p15card, i, opts);
+			if (r == SC_SUCCESS)
+				return r;
+			break;
+		}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (n = 0; n < count; n++) {
+			i = order[n];
+			if (tried[i] || !emulator_handles(i, card))
+				continue;
+			/* the declared ones first */
+			if (pass == 0 && builtin_emulators[i].drivers == NULL)
+				continue;
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
+			tried[i] = 1;
+			r = try_builtin_emulator(p15card, i, opts);
+			if (r == SC_SUCCESS) {
+				emu_cache_add(card, i);
+				return r;
+			}
+		}
+	}
+	return r;
+}
+
 int
 sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 {
 	sc_context_t		*ctx = p15card->card->ctx;
 	scconf_block		*conf_block, **blocks, *blk;
 	sc_pkcs15emu_opt_t	opts;
+	unsigned long long	start;
 	int			i, r = SC_ERROR_WRONG_CARD;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
@@ -144,46 +336,31 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 	if (!conf_block) {
 		/* no conf file found => try bultin drivers  */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no conf file (or section), trying all builtin emulators\n");
-		for (i = 0; builtin_emulators[i].name; i++) {
-			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
-			r = builtin_emulators[i].handler(p15card, &opts);
-			if (r == SC_SUCCESS)
-				/* we got a hit */
-				goto out;
-		}
+		r = bind_builtin_emulators(p15card, NULL, &opts);
+		if (r == SC_SUCCESS)
+			/* we got a hit */
+			goto out;
 	} else {
 		/* we have a conf file => let's use it */
 		int builtin_enabled; 
-		const scconf_list *list, *item;
+		const scconf_list *list;
 
 		builtin_enabled = scconf_get_bool(conf_block, "enable_builtin_emulation", 1);
 		list = scconf_find_list(conf_block, "builtin_emulators"); /* FIXME: rename to enabled_emulators */
 
 		if (builtin_enabled && list) {
-			/* get the list of enabled emulation drivers */
-			for (item = list; item; item = item->next) {
-				/* go through the list of builtin drivers */
-				const char *name = item->data;
-
-				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", name);
-				for (i = 0; builtin_emulators[i].name; i++)
-					if (!strcmp(builtin_emulators[i].name, name)) {
-						r = builtin_emulators[i].handler(p15card, &opts);
-						if (r == SC_SUCCESS)
-							/* we got a hit */
-							goto out;
-					}
-			}
+			/* the list of enabled emulation drivers */
+			r = bind_builtin_emulators(p15card, list, &opts);
+			if (r == SC_SUCCESS)
+				/* we got a hit */
+				goto out;
 		}
 		else if (builtin_enabled) {
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no emulator list in config file, trying all builtin emulators\n");
-			for (i = 0; builtin_emulators[i].name; i++) {
-				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
-				r = builtin_emulators[i].handler(p15card, &opts);
-				if (r == SC_SUCCESS)
-					/* we got a hit */
-					goto out;
-			}
+			r = bind_builtin_emulators(p15card, NULL, &opts);
+			if (r == SC_SUCCESS)
+				/* we got a hit */
+				goto out;
 		}
 
 		/* search for 'emulate foo { ... }' entries in the conf file */
@@ -193,7 +370,9 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 		for (i = 0; blocks && (blk = blocks[i]) != NULL; i++) {
 			const char *name = blk->name->data;
 			sc_log(ctx, "trying %s", name);
+			start = sc_startup_trace_begin(ctx);
 			r = parse_emu_block(p15card, blk);
+			sc_startup_trace_end(ctx, start, "pkcs15", "emulator %s", name);
 			if (r == SC_SUCCESS) {
 				free(blocks);
 				goto out;
@@ -204,6 +383,7 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 	}
 
 	/* Total failure */
+	SC_PROBE3(bind__phase, p15card, "bind-synthetic", SC_ERROR_WRONG_CARD);
 	LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_CARD);
 
 out:	if (r == SC_SUCCESS) {
@@ -214,6 +394,7 @@ out:	if (r == SC_SUCCESS) {
 		sc_log(ctx, "Failed to load card emulator: %s", sc_strerror(r));
 	}
 
+	SC_PROBE3(bind__phase, p15card, "bind-synthetic", r);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -429,6 +610,7 @@ int sc_pkcs15emu_object_add(sc_pkcs15_card_t *p15card, unsigned int type,
 		return SC_ERROR_OUT_OF_MEMORY;
 	memcpy(obj, in_obj, sizeof(*obj));
 	obj->type  = type;
+	obj->mem_size = 0;
 
 	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_AUTH:
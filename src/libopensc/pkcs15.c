@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <stdio.h>
 #include <assert.h>
 #include <ctype.h>
@@ -33,6 +34,7 @@
 #include "pkcs15.h"
 #include "asn1.h"
 #include "common/libscdl.h"
+#include "probes.h"
 
 #ifdef ENABLE_OPENSSL
 #include <openssl/sha.h>
@@ -114,6 +116,60 @@ static const struct sc_asn1_entry c_asn1_tokeninfo[] = {
 static void sc_pkcs15_free_unusedspace(struct sc_pkcs15_card *p15card);
 static void sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card);
 static void sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card);
+static int compare_obj_key(struct sc_pkcs15_object *obj, void *arg);
+static struct sc_pkcs15_object_index *sc_pkcs15_get_object_index(struct sc_pkcs15_card *p15card);
+static unsigned int obj_index_hash(const struct sc_pkcs15_id *id);
+
+/* Card state while DFs are read piece by piece: the card stays locked and
+ * the DF last read selected until the parse or search is over */
+struct df_stream {
+	struct sc_pkcs15_df *selected;
+	int locked;
+};
+
+static int parse_df_entry(struct sc_pkcs15_card *p15card, struct df_stream *s, struct sc_pkcs15_df *df);
+static void df_stream_close(struct sc_pkcs15_card *p15card, struct df_stream *s);
+
+/* Index of obj_list by object ID, so that the find-by-ID lookups done
+ * while binding and logging in do not walk the whole list. Each bucket
+ * keeps its objects in list order, chained through 'id_next'. The
+ * objects of each class are chained the same way through 'class_next',
+ * for sc_pkcs15_first_object() and sc_pkcs15_next_object(). */
+#define SC_PKCS15_OBJ_INDEX_SIZE	256
+#define SC_PKCS15_OBJ_CLASSES		16
+#define OBJ_CLASS(type)			(((type) & SC_PKCS15_TYPE_CLASS_MASK) >> 8)
+
+struct sc_pkcs15_object_index {
+	struct sc_pkcs15_object *tail;		/* last object of obj_list */
+	struct sc_pkcs15_object *buckets[SC_PKCS15_OBJ_INDEX_SIZE];
+	struct sc_pkcs15_object *class_head[SC_PKCS15_OBJ_CLASSES];
+	struct sc_pkcs15_object *class_tail[SC_PKCS15_OBJ_CLASSES];
+};
+
+/*
+ * Region allocator for the objects decoded from the DFs: they and their
+ * 'data' are carved from a few large chunks instead of one heap block
+ * each, and all of it goes away at once when the card is cleared.
+ * Chunks are kept across sc_pkcs15_card_clear(), so a rebind reuses them.
+ */
+#define SC_PKCS15_ARENA_CHUNK_SIZE	16384
+#define SC_PKCS15_ARENA_ALIGN		16
+
+struct sc_pkcs15_arena_chunk {
+	struct sc_pkcs15_arena_chunk *next;
+	size_t size, used;
+	/* chunk data follows, aligned by the arena */
+};
+
+struct sc_pkcs15_arena {
+	struct sc_pkcs15_arena_chunk *head, *cur;
+};
+
+#define ARENA_ROUND(n)	(((n) + SC_PKCS15_ARENA_ALIGN - 1) & ~((size_t) SC_PKCS15_ARENA_ALIGN - 1))
+#define ARENA_CHUNK_DATA(c)	((u8 *) (c) + ARENA_ROUND(sizeof(struct sc_pkcs15_arena_chunk)))
+
+static void sc_pkcs15_arena_reset(struct sc_pkcs15_card *p15card);
+static void sc_pkcs15_arena_free(struct sc_pkcs15_card *p15card);
 
 int sc_pkcs15_parse_tokeninfo(sc_context_t *ctx,
 	sc_pkcs15_tokeninfo_t *ti, const u8 *buf, size_t blen)
@@ -790,8 +846,11 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_arena_free(p15card);
+	sc_pkcs15_cert_cache_release(p15card);
 	sc_pkcs15_free_unusedspace(p15card);
 	p15card->unusedspace_read = 0;
+	sc_pkcs15_cache_release(p15card);
 
 	if (p15card->file_app != NULL)
 		sc_file_free(p15card->file_app);
@@ -824,6 +883,8 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_arena_reset(p15card);
+	sc_pkcs15_cert_cache_release(p15card);
 
 	p15card->df_list = NULL;
 	if (p15card->file_app != NULL) {
@@ -968,23 +1029,251 @@ sc_pkcs15_get_application_by_type(struct sc_card * card, char *app_type)
 }
 
 
+static int
+pkcs15_set_tokeninfo(struct sc_pkcs15_card *p15card, const u8 *buf, size_t len)
+{
+	struct sc_card *card = p15card->card;
+	struct sc_context *ctx = card->ctx;
+	struct sc_pkcs15_tokeninfo tokeninfo;
+	int err;
+
+	memset(&tokeninfo, 0, sizeof(tokeninfo));
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, len);
+	if (err != SC_SUCCESS)   {
+		sc_log(ctx, "cannot parse TokenInfo content: %s", sc_strerror(err));
+		return err;
+	}
+
+	*(p15card->tokeninfo) = tokeninfo;
+
+	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
+		char *serial = calloc(1, card->serialnr.len*2 + 1);
+		size_t ii;
+
+		for(ii=0;ii<card->serialnr.len;ii++)
+			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
+
+		p15card->tokeninfo->serial_number = serial;
+		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+	}
+	return SC_SUCCESS;
+}
+
+
+/* Reads and parses EF(TokenInfo); its content is handed over in *raw
+ * if raw is not NULL */
+static int
+pkcs15_bind_tokeninfo(struct sc_pkcs15_card *p15card, u8 **raw, size_t *raw_len)
+{
+	struct sc_card *card = p15card->card;
+	struct sc_context *ctx = card->ctx;
+	struct sc_path tmppath;
+	unsigned char *buf = NULL;
+	unsigned long long start = sc_startup_trace_begin(ctx);
+	size_t len;
+	int err;
+
+	if (p15card->file_tokeninfo == NULL) {
+		sc_format_path("5032", &tmppath);
+		err = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &tmppath);
+		if (err != SC_SUCCESS)   {
+			sc_log(ctx, "Cannot make absolute path to EF(TokenInfo); error:%i", err);
+			return err;
+		}
+		sc_log(ctx, "absolute path to EF(TokenInfo) %s", sc_print_path(&tmppath));
+	}
+	else {
+		tmppath = p15card->file_tokeninfo->path;
+		sc_file_free(p15card->file_tokeninfo);
+		p15card->file_tokeninfo = NULL;
+	}
+
+	err = sc_select_file(card, &tmppath, &p15card->file_tokeninfo);
+	if (err)   {
+		sc_log(ctx, "cannot select EF(TokenInfo) file: %s", sc_strerror(err));
+		return err;
+	}
+
+	len = p15card->file_tokeninfo->size;
+	if (!len) {
+		sc_log(ctx, "EF(TokenInfo) is empty");
+		return SC_ERROR_PKCS15_APP_NOT_FOUND;
+	}
+	buf = malloc(len);
+	if(buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	err = sc_read_binary(card, 0, buf, len, 0);
+	if (err < 0)   {
+		sc_log(ctx, "read EF(TokenInfo) file error: %s", sc_strerror(err));
+		goto out;
+	}
+	if (err <= 2) {
+		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
+		sc_log(ctx, "Invalid content of EF(TokenInfo): %s", sc_strerror(err));
+		goto out;
+	}
+	len = (size_t)err;
+
+	err = pkcs15_set_tokeninfo(p15card, buf, len);
+	if (err != SC_SUCCESS)
+		goto out;
+	sc_startup_trace_end(ctx, start, "pkcs15", "read EF(TokenInfo)");
+
+	if (raw != NULL) {
+		*raw = buf;
+		*raw_len = len;
+		buf = NULL;
+	}
+out:
+	free(buf);
+	return err;
+}
+
+
+/*
+ * With file caching the EF(TokenInfo) is read from the card first: its
+ * serial number and lastUpdate select the cache container, which also
+ * holds the EF(ODF) once 'pkcs15-tool --learn-card' has stored it. The
+ * application and ODF are then not selected or read any more, and the
+ * DFs come from the same container.
+ */
+static int
+pkcs15_bind_cached_odf(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_path odf_path;
+	unsigned char *buf = NULL;
+	size_t len = 0;
+	int r;
+
+	if (p15card->file_odf != NULL) {
+		odf_path = p15card->file_odf->path;
+	}
+	else {
+		sc_format_path("5031", &odf_path);
+		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &odf_path);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+
+	r = sc_pkcs15_read_cached_file(p15card, &odf_path, &buf, &len);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_pkcs15_cache_mark_stale(p15card, &odf_path);
+	if (len < 2 || parse_odf(buf, len, p15card)) {
+		sc_log(ctx, "Unable to parse cached ODF");
+		sc_pkcs15_remove_dfs(p15card);
+		free(buf);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	free(buf);
+
+	if (p15card->file_odf == NULL) {
+		p15card->file_odf = sc_file_new();
+		if (p15card->file_odf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->file_odf->path = odf_path;
+	}
+	p15card->file_odf->size = len;
+	sc_log(ctx, "EF(ODF) taken from the file cache");
+	return SC_SUCCESS;
+}
+
+
+/*
+ * Quick bind: with 'quick_bind' and shared card generations, the
+ * EF(TokenInfo) a bind read from the card is kept by card serial number
+ * and AID, along with the shared generation of the card. As long as no
+ * process wrote to the card since, the next bind takes EF(TokenInfo)
+ * from there, and EF(ODF) and the DFs from the file cache: it sends no
+ * APDU beyond the enumeration of the applications and the serial number.
+ */
+static int
+pkcs15_quick_bind_key(struct sc_pkcs15_card *p15card, const struct sc_aid *aid,
+		char *key, size_t key_len)
+{
+	struct sc_serial_number serial;
+	size_t len;
+	int r;
+
+	r = sc_card_ctl(p15card->card, SC_CARDCTL_GET_SERIALNR, &serial);
+	if (r < 0)
+		return r;
+	if (serial.len == 0 || 2 * (serial.len + (aid ? aid->len : 0)) + 2 > key_len)
+		return SC_ERROR_NOT_SUPPORTED;
+	sc_bin_to_hex(serial.value, serial.len, key, key_len, 0);
+	len = strlen(key);
+	key[len++] = '-';
+	key[len] = '\0';
+	if (aid != NULL)
+		sc_bin_to_hex(aid->value, aid->len, key + len, key_len - len, 0);
+	return SC_SUCCESS;
+}
+
+
+/* Returns SC_SUCCESS if bound from the record and the file cache, 1 if
+ * only EF(TokenInfo) could be taken from the record */
+static int
+pkcs15_quick_bind(struct sc_pkcs15_card *p15card, const char *key, unsigned int generation)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_quick_bind qb;
+	int r;
+
+	r = sc_pkcs15_cache_load_quick_bind(ctx, key, &qb);
+	if (r < 0)
+		return r;
+	if (qb.generation != generation) {
+		sc_log(ctx, "card written to since the quick bind record was taken");
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	if (!sc_compare_path(&qb.app_path, &p15card->file_app->path)) {
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	if (p15card->file_tokeninfo == NULL && (p15card->file_tokeninfo = sc_file_new()) == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	r = pkcs15_set_tokeninfo(p15card, qb.tokeninfo, qb.tokeninfo_len);
+	if (r < 0)
+		goto out;
+	p15card->file_tokeninfo->path = qb.tokeninfo_path;
+	p15card->file_tokeninfo->size = qb.tokeninfo_len;
+	sc_log(ctx, "EF(TokenInfo) taken from the quick bind record");
+
+	r = pkcs15_bind_cached_odf(p15card) == SC_SUCCESS ? SC_SUCCESS : 1;
+out:
+	free(qb.tokeninfo);
+	return r;
+}
+
+
 static int
 sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 {
 	struct sc_path tmppath;
 	struct sc_card    *card = p15card->card;
 	struct sc_context *ctx  = card->ctx;
-	struct sc_pkcs15_tokeninfo tokeninfo;
 	struct sc_pkcs15_df *df;
 	const struct sc_app_info *info = NULL;
-	unsigned char *buf = NULL;
-	size_t len;
-	int    err, ok = 0;
+	unsigned char *buf = NULL, *tokeninfo = NULL;
+	size_t len, tokeninfo_len = 0;
+	char qb_key[2 * (SC_MAX_SERIALNR + SC_MAX_AID_SIZE) + 2];
+	unsigned int generation = 0;
+	unsigned long long start, bind_start = sc_startup_trace_begin(ctx);
+	int    err, ok = 0, tokeninfo_read = 0;
 
 	LOG_FUNC_CALLED(ctx);
+	qb_key[0] = '\0';
 	/* Enumerate apps now */
 	if (card->app_count < 0) {
+		start = sc_startup_trace_begin(ctx);
 		err = sc_enum_apps(card);
+		sc_startup_trace_end(ctx, start, "pkcs15", "enumerate applications");
+		SC_PROBE3(bind__phase, p15card, "enumerate-apps", err);
 		if (err != SC_SUCCESS)
 			sc_log(ctx, "unable to enumerate apps: %s", sc_strerror(err));
 	}
@@ -1019,6 +1308,31 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 	}
 	sc_log(ctx, "application path '%s'", sc_print_path(&p15card->file_app->path));
 
+	/* the generation is read before the card, a write meanwhile makes
+	 * the record outdated right away */
+	if (p15card->opts.use_file_cache && p15card->opts.quick_bind
+			&& sc_card_shared_generation(card, &generation) == SC_SUCCESS
+			&& pkcs15_quick_bind_key(p15card, aid, qb_key, sizeof(qb_key)) == SC_SUCCESS) {
+		err = pkcs15_quick_bind(p15card, qb_key, generation);
+		if (err == SC_SUCCESS) {
+			/* the record is current, nothing to store */
+			qb_key[0] = '\0';
+			ok = 1;
+			goto end;
+		}
+		if (err == 1)
+			tokeninfo_read = 1;
+	}
+
+	if (p15card->opts.use_file_cache && !tokeninfo_read
+			&& pkcs15_bind_tokeninfo(p15card, &tokeninfo, &tokeninfo_len) == SC_SUCCESS) {
+		tokeninfo_read = 1;
+		if (pkcs15_bind_cached_odf(p15card) == SC_SUCCESS) {
+			ok = 1;
+			goto end;
+		}
+	}
+
 	/* Check if pkcs15 directory exists */
 	err = sc_select_file(card, &p15card->file_app->path, NULL);
 
@@ -1035,6 +1349,7 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		goto end;
 	}
 
+	start = sc_startup_trace_begin(ctx);
 	if (p15card->file_odf == NULL) {
 		/* check if an ODF is present; we don't know yet whether we have a pkcs15 card */
 		sc_format_path("5031", &tmppath);
@@ -1086,83 +1401,151 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 	}
 	free(buf);
 	buf = NULL;
+	sc_startup_trace_end(ctx, start, "pkcs15", "read EF(ODF)");
+	SC_PROBE3(bind__phase, p15card, "read-odf", SC_SUCCESS);
 
 	sc_log(ctx, "The following DFs were found:");
 	for (df = p15card->df_list; df; df = df->next)
 		sc_log(ctx, "  DF type %u, path %s, index %u, count %d", df->type,
 				sc_print_path(&df->path), df->path.index, df->path.count);
 
-	if (p15card->file_tokeninfo == NULL) {
-		sc_format_path("5032", &tmppath);
-		err = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &tmppath);
-		if (err != SC_SUCCESS)   {
-			sc_log(ctx, "Cannot make absolute path to EF(TokenInfo); error:%i", err);
+	if (!tokeninfo_read) {
+		err = pkcs15_bind_tokeninfo(p15card, &tokeninfo, &tokeninfo_len);
+		if (err != SC_SUCCESS)
 			goto end;
-		}
-		sc_log(ctx, "absolute path to EF(TokenInfo) %s", sc_print_path(&tmppath));
-	}
-	else {
-		tmppath = p15card->file_tokeninfo->path;
-		sc_file_free(p15card->file_tokeninfo);
-		p15card->file_tokeninfo = NULL;
 	}
 
-	err = sc_select_file(card, &tmppath, &p15card->file_tokeninfo);
-	if (err)   {
-		sc_log(ctx, "cannot select EF(TokenInfo) file: %s", sc_strerror(err));
-		goto end;
+	ok = 1;
+end:
+	if (ok && qb_key[0] && tokeninfo != NULL) {
+		struct sc_pkcs15_quick_bind qb;
+
+		memset(&qb, 0, sizeof(qb));
+		qb.generation = generation;
+		qb.app_path = p15card->file_app->path;
+		qb.tokeninfo_path = p15card->file_tokeninfo->path;
+		qb.tokeninfo = tokeninfo;
+		qb.tokeninfo_len = tokeninfo_len;
+		if (sc_pkcs15_cache_store_quick_bind(ctx, qb_key, &qb) != SC_SUCCESS)
+			sc_log(ctx, "cannot store the quick bind record");
 	}
-
-	len = p15card->file_tokeninfo->size;
-	if (!len) {
-		sc_log(ctx, "EF(TokenInfo) is empty");
-		goto end;
+	free(tokeninfo);
+	sc_startup_trace_end(ctx, bind_start, "pkcs15", "bind PKCS#15 application");
+	SC_PROBE3(bind__phase, p15card, "bind-internal", ok ? SC_SUCCESS : err);
+	if(buf != NULL)
+		free(buf);
+	if (!ok) {
+		sc_pkcs15_card_clear(p15card);
+		if (err == SC_ERROR_FILE_NOT_FOUND)
+			err = SC_ERROR_WRONG_CARD;
+		LOG_FUNC_RETURN(ctx, err);
 	}
-	buf = malloc(len);
-	if(buf == NULL)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
-	err = sc_read_binary(card, 0, buf, len, 0);
-	if (err < 0)   {
-		sc_log(ctx, "read EF(TokenInfo) file error: %s", sc_strerror(err));
-		goto end;
-	}
-	if (err <= 2) {
-		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
-		sc_log(ctx, "Invalid content of EF(TokenInfo): %s", sc_strerror(err));
-		goto end;
-	}
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
 
-	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
-	if (err != SC_SUCCESS)   {
-		sc_log(ctx, "cannot parse TokenInfo content: %s", sc_strerror(err));
-		goto end;
-	}
 
-	*(p15card->tokeninfo) = tokeninfo;
+/* Options of the "framework pkcs15" block, read once per context */
+struct sc_pkcs15_conf {
+	struct sc_pkcs15_card_opts opts;
+	int enable_emu;
+	int emu_first;
+};
 
-	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
-		char *serial = calloc(1, card->serialnr.len*2 + 1);
-		size_t ii;
 
-		for(ii=0;ii<card->serialnr.len;ii++)
-			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
+void
+_sc_free_pkcs15_conf(struct sc_context *ctx)
+{
+	free(ctx->pkcs15_conf);
+	ctx->pkcs15_conf = NULL;
+}
 
-		p15card->tokeninfo->serial_number = serial;
-		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+
+/* Copies the options to *out, sc_ctx_reload_config() may replace them */
+static int
+pkcs15_get_conf(struct sc_context *ctx, struct sc_pkcs15_conf *out)
+{
+	struct sc_pkcs15_conf *conf;
+	scconf_block *conf_block;
+	int max_size;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	conf = ctx->pkcs15_conf;
+	if (conf != NULL || (conf = calloc(1, sizeof(struct sc_pkcs15_conf))) == NULL) {
+		if (conf != NULL)
+			*out = *conf;
+		sc_mutex_unlock(ctx, ctx->mutex);
+		return conf != NULL ? SC_SUCCESS : SC_ERROR_OUT_OF_MEMORY;
 	}
 
-	ok = 1;
-end:
-	if(buf != NULL)
-		free(buf);
-	if (!ok) {
-		sc_pkcs15_card_clear(p15card);
-		if (err == SC_ERROR_FILE_NOT_FOUND)
-			err = SC_ERROR_WRONG_CARD;
-		LOG_FUNC_RETURN(ctx, err);
+	conf->opts.use_file_cache = 0;
+	conf->opts.file_cache_max_size = 32 * 1024 * 1024;
+	conf->opts.use_pin_cache = 1;
+	conf->opts.pin_cache_counter = 10;
+	conf->opts.pin_cache_ignore_user_consent = 0;
+	conf->opts.use_sec_env_cache = 1;
+
+	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+
+	if (conf_block) {
+		conf->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", conf->opts.use_file_cache);
+		conf->opts.revalidate_file_cache = scconf_get_bool(conf_block, "file_cache_revalidate",
+				conf->opts.revalidate_file_cache);
+		/* in KiB in the configuration */
+		max_size = scconf_get_int(conf_block, "file_cache_max_size",
+				(int)(conf->opts.file_cache_max_size / 1024));
+		conf->opts.file_cache_max_size = max_size > 0 ? (size_t)max_size * 1024 : 0;
+		conf->opts.compress_file_cache = scconf_get_bool(conf_block, "file_cache_compress",
+				conf->opts.compress_file_cache);
+		conf->opts.quick_bind = scconf_get_bool(conf_block, "quick_bind", conf->opts.quick_bind);
+		conf->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", conf->opts.use_pin_cache);
+		conf->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", conf->opts.pin_cache_counter);
+		conf->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
+				conf->opts.pin_cache_ignore_user_consent);
+		conf->opts.use_sec_env_cache = scconf_get_bool(conf_block, "use_sec_env_caching",
+				conf->opts.use_sec_env_cache);
 	}
+	conf->enable_emu = scconf_get_bool(conf_block, "enable_pkcs15_emulation", 1);
+	conf->emu_first = scconf_get_bool(conf_block, "try_emulation_first", 0);
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d revalidate_file_cache=%d file_cache_max_size=%lu compress_file_cache=%d quick_bind=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d use_sec_env_cache=%d",
+	         conf->opts.use_file_cache, conf->opts.revalidate_file_cache,
+		 (unsigned long)conf->opts.file_cache_max_size, conf->opts.compress_file_cache,
+		 conf->opts.quick_bind, conf->opts.use_pin_cache,
+		 conf->opts.pin_cache_counter, conf->opts.pin_cache_ignore_user_consent,
+		 conf->opts.use_sec_env_cache);
+
+	ctx->pkcs15_conf = conf;
+	*out = *conf;
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return SC_SUCCESS;
+}
+
+
+int
+sc_pkcs15_reload_options(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx;
+	struct sc_pkcs15_conf conf;
+	int r;
+
+	if (p15card == NULL || p15card->card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	r = pkcs15_get_conf(ctx, &conf);
+	LOG_TEST_RET(ctx, r, "Cannot read the PKCS#15 options");
+
+	/* use_file_cache stays as bound, the cache is opened by the bind */
+	p15card->opts.revalidate_file_cache = conf.opts.revalidate_file_cache;
+	p15card->opts.file_cache_max_size = conf.opts.file_cache_max_size;
+	p15card->opts.compress_file_cache = conf.opts.compress_file_cache;
+	if (p15card->opts.use_pin_cache && !conf.opts.use_pin_cache)
+		sc_pkcs15_pincache_clear(p15card);
+	p15card->opts.use_pin_cache = conf.opts.use_pin_cache;
+	p15card->opts.pin_cache_counter = conf.opts.pin_cache_counter;
+	p15card->opts.pin_cache_ignore_user_consent = conf.opts.pin_cache_ignore_user_consent;
+	p15card->opts.use_sec_env_cache = conf.opts.use_sec_env_cache;
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
@@ -1174,48 +1557,34 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 {
 	struct sc_pkcs15_card *p15card = NULL;
 	struct sc_context *ctx = card->ctx;
-	scconf_block *conf_block = NULL;
-	int r, emu_first, enable_emu;
+	struct sc_pkcs15_conf conf;
+	unsigned long long start = sc_startup_trace_begin(ctx);
+	int r;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "application(aid:'%s')", aid ? sc_dump_hex(aid->value, aid->len) : "empty");
 
 	assert(p15card_out != NULL);
+	r = pkcs15_get_conf(ctx, &conf);
+	LOG_TEST_RET(ctx, r, "Cannot read the PKCS#15 options");
 	p15card = sc_pkcs15_card_new();
 	if (p15card == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
 	p15card->card = card;
-	p15card->opts.use_file_cache = 0;
-	p15card->opts.use_pin_cache = 1;
-	p15card->opts.pin_cache_counter = 10;
-	p15card->opts.pin_cache_ignore_user_consent = 0;
-
-	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
-
-	if (conf_block) {
-		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
-		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
-		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
-		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
-				p15card->opts.pin_cache_ignore_user_consent);
-	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
-	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache,
-		 p15card->opts.pin_cache_counter, p15card->opts.pin_cache_ignore_user_consent);
+	p15card->opts = conf.opts;
 
 	r = sc_lock(card);
+	SC_PROBE3(bind__phase, p15card, "lock", r);
 	if (r) {
 		sc_log(ctx, "sc_lock() failed: %s", sc_strerror(r));
 		sc_pkcs15_card_free(p15card);
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
-	enable_emu = scconf_get_bool(conf_block, "enable_pkcs15_emulation", 1);
-	if (enable_emu) {
+	if (conf.enable_emu) {
 		sc_log(ctx, "PKCS#15 emulation enabled");
-		emu_first = scconf_get_bool(conf_block, "try_emulation_first", 0);
-		if (emu_first || sc_pkcs15_is_emulation_only(card)) {
+		if (conf.emu_first || sc_pkcs15_is_emulation_only(card)) {
 			r = sc_pkcs15_bind_synthetic(p15card);
 			if (r == SC_SUCCESS)
 				goto done;
@@ -1241,9 +1610,12 @@ done:
 
 	*p15card_out = p15card;
 	sc_unlock(card);
+	sc_startup_trace_end(ctx, start, "pkcs15", "sc_pkcs15_bind %s", card->name);
+	SC_PROBE3(bind__phase, p15card, "done", SC_SUCCESS);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 error:
 	sc_unlock(card);
+	SC_PROBE3(bind__phase, p15card, "done", r);
 	sc_pkcs15_card_free(p15card);
 	LOG_FUNC_RETURN(ctx, r);
 }
@@ -1264,28 +1636,89 @@ sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 
 
 static int
-__sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
-			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
-			sc_pkcs15_object_t **ret, size_t ret_size)
+search_match(struct sc_pkcs15_object *obj, unsigned int class_mask, unsigned int type,
+		int (*func)(sc_pkcs15_object_t *, void *), void *func_arg)
 {
-	struct sc_pkcs15_object *obj = NULL;
-	struct sc_pkcs15_df	*df = NULL;
-	unsigned int	df_mask = 0;
-	size_t		match_count = 0;
+	/* Check object type */
+	if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
+		return 0;
+	if (type != 0
+	 && obj->type != type
+	 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
+		return 0;
 
-	if (type)
-		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
+	/* Potential candidate, apply search function */
+	if (func != NULL && func(obj, func_arg) <= 0)
+		return 0;
+	return 1;
+}
 
-	/* Make sure the class mask we have makes sense */
-	if (class_mask == 0
-	 || (class_mask & ~(SC_PKCS15_SEARCH_CLASS_PRKEY |
-			    SC_PKCS15_SEARCH_CLASS_PUBKEY |
-			    SC_PKCS15_SEARCH_CLASS_SKEY |
-			    SC_PKCS15_SEARCH_CLASS_CERT |
-			    SC_PKCS15_SEARCH_CLASS_DATA |
-			    SC_PKCS15_SEARCH_CLASS_AUTH))) {
-		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+/*
+ * Walks obj_list as if all the DFs in df_mask were enumerated, decoding
+ * their entries only when the walk gets there: the next entry of a
+ * partly parsed DF when leaving its last object, the DFs not started yet
+ * at the end of the list.  Objects come in the same order as with a full
+ * parse, and the walk stops at the ret_size'th match.
+ */
+static size_t
+search_objects_incremental(struct sc_pkcs15_card *p15card, unsigned int df_mask,
+		unsigned int class_mask, unsigned int type,
+		int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
+		sc_pkcs15_object_t **ret, size_t ret_size)
+{
+	struct sc_pkcs15_object *obj = p15card->obj_list;
+	struct sc_pkcs15_df *df = p15card->df_list, *df_obj;
+	struct df_stream s;
+	size_t match_count = 0;
+
+	memset(&s, 0, sizeof(s));
+	for (;;) {
+		if (obj == NULL) {
+			for (; df != NULL; df = df->next)
+				if ((df_mask & (1 << df->type)) && !df->enumerated && df->tail == NULL)
+					break;
+			if (df == NULL)
+				break;
+			/* FIXME dont ignore errors */
+			if (parse_df_entry(p15card, &s, df) <= 0) {
+				df = df->next;
+				continue;
+			}
+			obj = df->tail;
+		}
+
+		if (search_match(obj, class_mask, type, func, func_arg)) {
+			ret[match_count++] = obj;
+			if (match_count >= ret_size)
+				break;
+		}
+
+		if (obj->df != NULL && obj->df->tail == obj && !obj->df->enumerated
+				&& (df_mask & (1 << obj->df->type))) {
+			df_obj = obj->df;
+			parse_df_entry(p15card, &s, df_obj);
+			/* a DF read again goes on with its new objects */
+			if (obj->df == NULL) {
+				obj = df_obj->tail;
+				if (obj == NULL)
+					df = df_obj;
+				continue;
+			}
+		}
+		obj = obj->next;
 	}
+	df_stream_close(p15card, &s);
+
+	return match_count;
+}
+
+
+/* The DFs holding the objects of the classes in class_mask */
+static unsigned int
+search_df_mask(unsigned int class_mask)
+{
+	unsigned int df_mask = 0;
 
 	if (class_mask & SC_PKCS15_SEARCH_CLASS_PRKEY)
 		df_mask |= (1 << SC_PKCS15_PRKDF);
@@ -1299,33 +1732,80 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 		df_mask |= (1 << SC_PKCS15_AODF);
 	if (class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
 		df_mask |= (1 << SC_PKCS15_SKDF);
+	return df_mask;
+}
+
+
+/* Make sure all the DFs in df_mask have been enumerated, so that
+ * p15card->obj_list holds their objects */
+static void
+enumerate_dfs(struct sc_pkcs15_card *p15card, unsigned int df_mask)
+{
+	struct sc_pkcs15_df *df;
 
-	/* Make sure all the DFs we want to search have been
-	 * enumerated. */
 	for (df = p15card->df_list; df != NULL; df = df->next) {
 		if (!(df_mask & (1 << df->type)))   {
 			continue;
 		}
 		if (df->enumerated)
 			continue;
-		/* Enumerate the DF's, so p15card->obj_list is
-		 * populated. */
 		/* FIXME dont ignore errors */
 		sc_pkcs15_parse_df(p15card, df);
 	}
+}
 
-	/* And now loop over all objects */
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
-		/* Check object type */
-		if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
-			continue;
-		if (type != 0
-		 && obj->type != type
-		 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
-			continue;
 
-		/* Potential candidate, apply search function */
-		if (func != NULL && func(obj, func_arg) <= 0)
+static int
+__sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
+			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
+			sc_pkcs15_object_t **ret, size_t ret_size)
+{
+	struct sc_pkcs15_object *obj = NULL;
+	struct sc_pkcs15_df	*df = NULL;
+	struct sc_pkcs15_search_key *sk;
+	struct sc_pkcs15_object_index *index = NULL;
+	unsigned int	df_mask = 0;
+	size_t		match_count = 0;
+
+	if (type)
+		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
+
+	/* Make sure the class mask we have makes sense */
+	if (class_mask == 0
+	 || (class_mask & ~(SC_PKCS15_SEARCH_CLASS_PRKEY |
+			    SC_PKCS15_SEARCH_CLASS_PUBKEY |
+			    SC_PKCS15_SEARCH_CLASS_SKEY |
+			    SC_PKCS15_SEARCH_CLASS_CERT |
+			    SC_PKCS15_SEARCH_CLASS_DATA |
+			    SC_PKCS15_SEARCH_CLASS_AUTH))) {
+		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	}
+
+	df_mask = search_df_mask(class_mask);
+
+	/* A search for the first object(s) with a given key reads and
+	 * decodes the DFs only as far as it has to */
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if ((df_mask & (1 << df->type)) && !df->enumerated)
+			break;
+	if (df != NULL && func != NULL && ret != NULL && ret_size > 0
+			&& p15card->ops.parse_df == NULL)
+		return search_objects_incremental(p15card, df_mask, class_mask, type,
+				func, func_arg, ret, ret_size);
+
+	/* Make sure all the DFs we want to search have been
+	 * enumerated. */
+	enumerate_dfs(p15card, df_mask);
+
+	/* Searches by ID only have to visit the objects of one index bucket */
+	sk = (func == compare_obj_key) ? (struct sc_pkcs15_search_key *) func_arg : NULL;
+	if (sk && sk->id)
+		index = sc_pkcs15_get_object_index(p15card);
+
+	/* And now loop over all objects */
+	obj = index ? index->buckets[obj_index_hash(sk->id)] : p15card->obj_list;
+	for (; obj != NULL; obj = index ? obj->id_next : obj->next) {
+		if (!search_match(obj, class_mask, type, func, func_arg))
 			continue;
 		/* Okay, we have a match. */
 		match_count++;
@@ -1348,6 +1828,46 @@ sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
 }
 
 
+/* Without an index the walk goes along obj_list and skips the others */
+static struct sc_pkcs15_object *
+next_of_type(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj, unsigned int type)
+{
+	unsigned int class_mask = SC_PKCS15_TYPE_TO_CLASS(type);
+	int indexed = p15card->obj_index != NULL;
+
+	for (; obj != NULL; obj = indexed ? obj->class_next : obj->next)
+		if (search_match(obj, class_mask, type, NULL, NULL))
+			break;
+	return obj;
+}
+
+
+struct sc_pkcs15_object *
+sc_pkcs15_first_object(struct sc_pkcs15_card *p15card, unsigned int type)
+{
+	struct sc_pkcs15_object_index *index;
+	unsigned int class_mask = SC_PKCS15_TYPE_TO_CLASS(type);
+
+	if (p15card == NULL || OBJ_CLASS(type) == 0 || OBJ_CLASS(type) >= SC_PKCS15_OBJ_CLASSES)
+		return NULL;
+
+	enumerate_dfs(p15card, search_df_mask(class_mask));
+	index = sc_pkcs15_get_object_index(p15card);
+	return next_of_type(p15card, index ? index->class_head[OBJ_CLASS(type)] : p15card->obj_list, type);
+}
+
+
+struct sc_pkcs15_object *
+sc_pkcs15_next_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
+		unsigned int type)
+{
+	if (p15card == NULL || obj == NULL)
+		return NULL;
+
+	return next_of_type(p15card, p15card->obj_index ? obj->class_next : obj->next, type);
+}
+
+
 static int
 compare_obj_id(struct sc_pkcs15_object *obj, const struct sc_pkcs15_id *id)
 {
@@ -1813,126 +2333,509 @@ sc_pkcs15_find_prkey_by_reference(struct sc_pkcs15_card *p15card, const struct s
 }
 
 
-int
-sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
+static const struct sc_pkcs15_id *
+obj_index_id(struct sc_pkcs15_object *obj)
 {
-	struct sc_pkcs15_object *p = p15card->obj_list;
+	void *data = obj->data;
 
-	if (!obj)
-		return 0;
-	obj->next = obj->prev = NULL;
-	if (p15card->obj_list == NULL) {
-		p15card->obj_list = obj;
-		return 0;
+	if (data == NULL)
+		return NULL;
+
+	/* Same IDs as compared by compare_obj_id() */
+	switch (obj->type) {
+	case SC_PKCS15_TYPE_CERT_X509:
+		return &((struct sc_pkcs15_cert_info *) data)->id;
+	case SC_PKCS15_TYPE_PRKEY_RSA:
+	case SC_PKCS15_TYPE_PRKEY_DSA:
+	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PRKEY_EC:
+		return &((struct sc_pkcs15_prkey_info *) data)->id;
+	case SC_PKCS15_TYPE_PUBKEY_RSA:
+	case SC_PKCS15_TYPE_PUBKEY_DSA:
+	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PUBKEY_EC:
+		return &((struct sc_pkcs15_pubkey_info *) data)->id;
+	case SC_PKCS15_TYPE_SKEY_DES:
+	case SC_PKCS15_TYPE_SKEY_2DES:
+	case SC_PKCS15_TYPE_SKEY_3DES:
+		return &((struct sc_pkcs15_skey_info *) data)->id;
+	case SC_PKCS15_TYPE_AUTH_PIN:
+	case SC_PKCS15_TYPE_AUTH_BIO:
+	case SC_PKCS15_TYPE_AUTH_AUTHKEY:
+		return &((struct sc_pkcs15_auth_info *) data)->auth_id;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return &((struct sc_pkcs15_data_info *) data)->id;
 	}
-	while (p->next != NULL)
-		p = p->next;
-	p->next = obj;
-	obj->prev = p;
+	return NULL;
+}
 
-	return 0;
+
+static unsigned int
+obj_index_hash(const struct sc_pkcs15_id *id)
+{
+	unsigned int hash = 0;
+	size_t ii;
+
+	for (ii = 0; ii < id->len && ii < sizeof(id->value); ii++)
+		hash = hash * 31 + id->value[ii];
+	return hash % SC_PKCS15_OBJ_INDEX_SIZE;
+}
+
+
+static void
+obj_index_insert(struct sc_pkcs15_object_index *index, struct sc_pkcs15_object *obj)
+{
+	const struct sc_pkcs15_id *id = obj_index_id(obj);
+	struct sc_pkcs15_object **pp;
+	unsigned int class = OBJ_CLASS(obj->type);
+
+	obj->id_next = NULL;
+	obj->class_next = NULL;
+	index->tail = obj;
+	if (class < SC_PKCS15_OBJ_CLASSES) {
+		if (index->class_tail[class] != NULL)
+			index->class_tail[class]->class_next = obj;
+		else
+			index->class_head[class] = obj;
+		index->class_tail[class] = obj;
+	}
+	if (id == NULL)
+		return;
+
+	for (pp = &index->buckets[obj_index_hash(id)]; *pp != NULL; pp = &(*pp)->id_next)
+		;
+	*pp = obj;
+}
+
+
+static struct sc_pkcs15_object_index *
+sc_pkcs15_get_object_index(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *obj;
+
+	if (p15card->obj_index != NULL)
+		return p15card->obj_index;
+
+	/* Without an index the lookups fall back to walking the list */
+	p15card->obj_index = calloc(1, sizeof(struct sc_pkcs15_object_index));
+	if (p15card->obj_index == NULL)
+		return NULL;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		obj_index_insert(p15card->obj_index, obj);
+	return p15card->obj_index;
 }
 
 
 void
-sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
+sc_pkcs15_clear_object_index(struct sc_pkcs15_card *p15card)
 {
-	if (!obj)
+	if (p15card == NULL || p15card->obj_index == NULL)
 		return;
-	else if (obj->prev == NULL)
-		p15card->obj_list = obj->next;
-	else
-		obj->prev->next = obj->next;
-	if (obj->next != NULL)
-		obj->next->prev = obj->prev;
+	free(p15card->obj_index);
+	p15card->obj_index = NULL;
+}
+
+
+static void *
+sc_pkcs15_arena_alloc(struct sc_pkcs15_arena *arena, size_t size)
+{
+	struct sc_pkcs15_arena_chunk *chunk, **pp;
+	u8 *ptr;
+
+	size = ARENA_ROUND(size);
+
+	/* Move on to the next chunk that fits, reusing those kept by an
+	 * earlier reset before growing the arena */
+	for (chunk = arena->cur; chunk != NULL && chunk->size - chunk->used < size; ) {
+		chunk = chunk->next;
+		if (chunk != NULL)
+			chunk->used = 0;
+	}
+	if (chunk == NULL) {
+		size_t chunk_size = size > SC_PKCS15_ARENA_CHUNK_SIZE ? size : SC_PKCS15_ARENA_CHUNK_SIZE;
+
+		chunk = malloc(ARENA_ROUND(sizeof(struct sc_pkcs15_arena_chunk)) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		/* put it right after the current one, so that no kept chunk is lost */
+		pp = arena->cur != NULL ? &arena->cur->next : &arena->head;
+		chunk->next = *pp;
+		*pp = chunk;
+	}
+	arena->cur = chunk;
+
+	ptr = ARENA_CHUNK_DATA(chunk) + chunk->used;
+	chunk->used += size;
+	memset(ptr, 0, size);
+	return ptr;
 }
 
 
+/* Forgets everything allocated from the arena, keeping its chunks */
 static void
-sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
+sc_pkcs15_arena_reset(struct sc_pkcs15_card *p15card)
 {
-	struct sc_pkcs15_object *cur = NULL, *next = NULL;
+	struct sc_pkcs15_arena *arena = p15card->arena;
 
-	if (!p15card || !p15card->obj_list)
+	if (arena == NULL || arena->head == NULL)
 		return;
-	for (cur = p15card->obj_list; cur; cur = next)   {
-		next = cur->next;
-		sc_pkcs15_free_object(cur);
+	arena->cur = arena->head;
+	arena->head->used = 0;
+}
+
+
+static void
+sc_pkcs15_arena_free(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_arena_chunk *chunk, *next;
+
+	if (p15card->arena == NULL)
+		return;
+	for (chunk = p15card->arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
 	}
+	free(p15card->arena);
+	p15card->arena = NULL;
+}
 
-	p15card->obj_list = NULL;
+
+void *
+sc_pkcs15_alloc_object_data(struct sc_pkcs15_object *obj, size_t size)
+{
+	if (obj->arena == NULL)
+		return malloc(size);
+	return sc_pkcs15_arena_alloc(obj->arena, size);
 }
 
 
-void
-sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
+struct sc_pkcs15_accessrule *
+sc_pkcs15_object_access_rules(struct sc_pkcs15_object *obj)
 {
-	if (!obj)
-		return;
+	size_t size = SC_PKCS15_MAX_ACCESS_RULES * sizeof(struct sc_pkcs15_accessrule);
+
+	if (obj->access_rules == NULL) {
+		obj->access_rules = sc_pkcs15_alloc_object_data(obj, size);
+		if (obj->access_rules != NULL)
+			memset(obj->access_rules, 0, size);
+	}
+	return obj->access_rules;
+}
+
+
+/* The object with its type specific data and the DER values it holds */
+static size_t
+object_mem_size(const struct sc_pkcs15_object *obj)
+{
+	size_t size = sizeof(*obj) + obj->content.len;
+
+	if (obj->access_rules != NULL)
+		size += SC_PKCS15_MAX_ACCESS_RULES * sizeof(*obj->access_rules);
+	if (obj->data == NULL)
+		return size;
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_PRKEY:
-		sc_pkcs15_free_prkey_info((sc_pkcs15_prkey_info_t *)obj->data);
+		size += sizeof(struct sc_pkcs15_prkey_info)
+			+ ((struct sc_pkcs15_prkey_info *) obj->data)->subject.len;
 		break;
 	case SC_PKCS15_TYPE_PUBKEY:
-		sc_pkcs15_free_pubkey_info((sc_pkcs15_pubkey_info_t *)obj->data);
+		size += sizeof(struct sc_pkcs15_pubkey_info)
+			+ ((struct sc_pkcs15_pubkey_info *) obj->data)->subject.len;
 		break;
 	case SC_PKCS15_TYPE_CERT:
-		sc_pkcs15_free_cert_info((sc_pkcs15_cert_info_t *)obj->data);
+		size += sizeof(struct sc_pkcs15_cert_info)
+			+ ((struct sc_pkcs15_cert_info *) obj->data)->value.len;
 		break;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		sc_pkcs15_free_data_info((sc_pkcs15_data_info_t *)obj->data);
+		size += sizeof(struct sc_pkcs15_data_info)
+			+ ((struct sc_pkcs15_data_info *) obj->data)->data.len;
 		break;
 	case SC_PKCS15_TYPE_AUTH:
-		sc_pkcs15_free_auth_info((sc_pkcs15_auth_info_t *)obj->data);
+		size += sizeof(struct sc_pkcs15_auth_info);
 		break;
-	default:
-		free(obj->data);
 	}
-
-	sc_pkcs15_free_object_content(obj);
-
-	free(obj);
+	return size;
 }
 
 
 int
-sc_pkcs15_add_df(struct sc_pkcs15_card *p15card, unsigned int type, const sc_path_t *path)
+sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
 {
-	struct sc_pkcs15_df *p, *newdf;
+	struct sc_pkcs15_object_index *index;
+	struct sc_pkcs15_object *p;
 
-	newdf = calloc(1, sizeof(struct sc_pkcs15_df));
-	if (newdf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
-	newdf->path = *path;
-	newdf->type = type;
-
-	if (p15card->df_list == NULL) {
-		p15card->df_list = newdf;
+	if (!obj)
 		return 0;
+	if (obj->mem_size == 0) {
+		obj->mem_size = object_mem_size(obj);
+		sc_mem_account_alloc(SC_MEM_PKCS15, obj->mem_size);
 	}
-
-	p = p15card->df_list;
-	while (p->next != NULL)
-		p = p->next;
-	p->next = newdf;
-	newdf->prev = p;
+	obj->next = obj->prev = NULL;
+	index = sc_pkcs15_get_object_index(p15card);
+	if (p15card->obj_list == NULL) {
+		p15card->obj_list = obj;
+	}
+	else {
+		/* The index knows the list tail */
+		p = index ? index->tail : p15card->obj_list;
+		while (p->next != NULL)
+			p = p->next;
+		p->next = obj;
+		obj->prev = p;
+	}
+	if (index != NULL)
+		obj_index_insert(index, obj);
 
 	return 0;
 }
 
 
-static void
-sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card)
+/* The DF entry field that sc_pkcs15_parse_df() may leave pointing into
+ * the DF contents */
+static struct sc_pkcs15_der *
+borrowed_field(struct sc_pkcs15_object *obj)
 {
-	struct sc_pkcs15_df *cur = NULL, *next = NULL;
-
-	if (!p15card || !p15card->df_list)
-		return;
-
-	for (cur = p15card->df_list; cur; cur = next)   {
-		next = cur->next;
-		free(cur);
-	}
+	struct sc_pkcs15_der *der = NULL;
+
+	if (obj->df == NULL || obj->df->data == NULL || obj->data == NULL)
+		return NULL;
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		der = &((struct sc_pkcs15_prkey_info *) obj->data)->subject;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		der = &((struct sc_pkcs15_pubkey_info *) obj->data)->subject;
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		der = &((struct sc_pkcs15_cert_info *) obj->data)->value;
+		break;
+	default:
+		return NULL;
+	}
+	if (der->value < obj->df->data || der->value > obj->df->data + obj->df->data_len)
+		return NULL;
+	return der;
+}
+
+
+/* Gives the object its own copy of what it borrows from its DF, or with
+ * copy == 0 forgets it before the object is freed */
+static void
+unborrow_object(struct sc_pkcs15_object *obj, int copy)
+{
+	struct sc_pkcs15_der *der = borrowed_field(obj);
+	u8 *value = NULL;
+
+	if (der == NULL)
+		return;
+	if (copy && der->len) {
+		value = malloc(der->len);
+		if (value != NULL)
+			memcpy(value, der->value, der->len);
+	}
+	der->value = value;
+	if (value == NULL)
+		der->len = 0;
+}
+
+
+void
+sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object_index *index;
+	const struct sc_pkcs15_id *id;
+	struct sc_pkcs15_object **pp, *prev;
+	unsigned int class;
+
+	if (!obj)
+		return;
+
+	index = p15card->obj_index;
+	if (index != NULL) {
+		if (index->tail == obj)
+			index->tail = obj->prev;
+		class = OBJ_CLASS(obj->type);
+		if (class < SC_PKCS15_OBJ_CLASSES) {
+			prev = NULL;
+			for (pp = &index->class_head[class]; *pp != NULL; pp = &(*pp)->class_next) {
+				if (*pp == obj) {
+					*pp = obj->class_next;
+					if (index->class_tail[class] == obj)
+						index->class_tail[class] = prev;
+					break;
+				}
+				prev = *pp;
+			}
+		}
+		obj->class_next = NULL;
+		id = obj_index_id(obj);
+		if (id != NULL) {
+			for (pp = &index->buckets[obj_index_hash(id)]; *pp != NULL; pp = &(*pp)->id_next) {
+				if (*pp == obj) {
+					*pp = obj->id_next;
+					break;
+				}
+			}
+		}
+		obj->id_next = NULL;
+	}
+
+	if (obj->df != NULL && obj->df->tail == obj)
+		obj->df->tail = (obj->prev != NULL && obj->prev->df == obj->df) ? obj->prev : NULL;
+
+	if (obj->prev == NULL)
+		p15card->obj_list = obj->next;
+	else
+		obj->prev->next = obj->next;
+	if (obj->next != NULL)
+		obj->next->prev = obj->prev;
+
+	/* the object may outlive its DF; one from the arena stays valid
+	 * until the card is cleared or freed */
+	unborrow_object(obj, 1);
+	obj->df = NULL;
+}
+
+
+static void
+sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *cur = NULL, *next = NULL;
+
+	if (!p15card)
+		return;
+	sc_pkcs15_clear_object_index(p15card);
+	if (!p15card->obj_list)
+		return;
+	for (cur = p15card->obj_list; cur; cur = next)   {
+		next = cur->next;
+		sc_pkcs15_free_object(cur);
+	}
+
+	p15card->obj_list = NULL;
+}
+
+
+/* Releases what the 'data' of an arena object owns on the heap, the
+ * counterpart of the sc_pkcs15_free_*_info() functions */
+static void
+release_arena_object_data(struct sc_pkcs15_object *obj)
+{
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		struct sc_pkcs15_prkey_info *info = obj->data;
+
+		free(info->subject.value);
+		free(info->cmap_record.guid);
+		sc_pkcs15_free_key_params(&info->params);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		struct sc_pkcs15_pubkey_info *info = obj->data;
+
+		free(info->subject.value);
+		sc_pkcs15_free_key_params(&info->params);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT:
+		free(((struct sc_pkcs15_cert_info *) obj->data)->value.value);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		struct sc_pkcs15_data_info *info = obj->data;
+
+		if (info->data.len)
+			free(info->data.value);
+		break;
+	}
+	}
+}
+
+
+void
+sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
+{
+	if (!obj)
+		return;
+	if (obj->mem_size != 0)
+		sc_mem_account_free(SC_MEM_PKCS15, obj->mem_size);
+	unborrow_object(obj, 0);
+	if (obj->arena != NULL) {
+		/* the object and its data go with the arena */
+		if (obj->data != NULL)
+			release_arena_object_data(obj);
+		sc_pkcs15_free_object_content(obj);
+		return;
+	}
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		sc_pkcs15_free_prkey_info((sc_pkcs15_prkey_info_t *)obj->data);
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		sc_pkcs15_free_pubkey_info((sc_pkcs15_pubkey_info_t *)obj->data);
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		sc_pkcs15_free_cert_info((sc_pkcs15_cert_info_t *)obj->data);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		sc_pkcs15_free_data_info((sc_pkcs15_data_info_t *)obj->data);
+		break;
+	case SC_PKCS15_TYPE_AUTH:
+		sc_pkcs15_free_auth_info((sc_pkcs15_auth_info_t *)obj->data);
+		break;
+	default:
+		free(obj->data);
+	}
+
+	sc_pkcs15_free_object_content(obj);
+
+	free(obj->access_rules);
+	free(obj);
+}
+
+
+int
+sc_pkcs15_add_df(struct sc_pkcs15_card *p15card, unsigned int type, const sc_path_t *path)
+{
+	struct sc_pkcs15_df *p, *newdf;
+
+	newdf = calloc(1, sizeof(struct sc_pkcs15_df));
+	if (newdf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	newdf->path = *path;
+	newdf->type = type;
+
+	if (p15card->df_list == NULL) {
+		p15card->df_list = newdf;
+		return 0;
+	}
+
+	p = p15card->df_list;
+	while (p->next != NULL)
+		p = p->next;
+	p->next = newdf;
+	newdf->prev = p;
+
+	return 0;
+}
+
+
+static void
+sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_df *cur = NULL, *next = NULL;
+
+	if (!p15card || !p15card->df_list)
+		return;
+
+	for (cur = p15card->df_list; cur; cur = next)   {
+		next = cur->next;
+		free(cur->data);
+		free(cur->written);
+		free(cur);
+	}
 
 	p15card->df_list = NULL;
 }
@@ -1942,14 +2845,19 @@ int
 sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
 		unsigned char **buf_out, size_t *bufsize_out)
 {
-	unsigned char *buf = NULL, *tmp = NULL, *p;
-	size_t bufsize = 0, tmpsize;
+	unsigned char *buf = NULL, **entries = NULL, *p;
+	size_t bufsize = 0, *sizes = NULL, count = 0, ii;
 	const struct sc_pkcs15_object *obj;
 	int (* func)(struct sc_context *, const struct sc_pkcs15_object *nobj,
 		     unsigned char **nbuf, size_t *nbufsize) = NULL;
 	int r;
 
 	assert(p15card != NULL && p15card->magic == SC_PKCS15_CARD_MAGIC);
+	/* a DF that a search read only partly must not lose its other entries */
+	if (df->data != NULL && !df->enumerated) {
+		r = sc_pkcs15_parse_df(p15card, df);
+		LOG_TEST_RET(ctx, r, "Cannot finish parsing the DF");
+	}
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
 		func = sc_pkcs15_encode_prkdf_entry;
@@ -1976,44 +2884,370 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 		*bufsize_out = 0;
 		return 0;
 	}
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+	/* encode the entries first, so that the DF is allocated once */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj->df == df)
+			count++;
+	if (count) {
+		entries = calloc(count, sizeof(*entries));
+		sizes = calloc(count, sizeof(*sizes));
+		if (entries == NULL || sizes == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+	}
+	for (ii = 0, obj = p15card->obj_list; obj != NULL; obj = obj->next) {
 		if (obj->df != df)
 			continue;
-		r = func(ctx, obj, &tmp, &tmpsize);
-		if (r) {
-			free(tmp);
-			free(buf);
-			return r;
+		r = func(ctx, obj, &entries[ii], &sizes[ii]);
+		if (r)
+			goto out;
+		bufsize += sizes[ii++];
+	}
+	if (bufsize) {
+		buf = malloc(bufsize);
+		if (buf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
 		}
-		p = (u8 *) realloc(buf, bufsize + tmpsize);
-		if (!p) {
-			free(tmp);
-			free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
+		for (p = buf, ii = 0; ii < count; ii++) {
+			if (!sizes[ii])
+				continue;
+			memcpy(p, entries[ii], sizes[ii]);
+			p += sizes[ii];
 		}
-		buf = p;
-		memcpy(buf + bufsize, tmp, tmpsize);
-		free(tmp);
-		bufsize += tmpsize;
 	}
 	*buf_out = buf;
 	*bufsize_out = bufsize;
+	r = 0;
+out:
+	if (entries != NULL)
+		for (ii = 0; ii < count; ii++)
+			free(entries[ii]);
+	free(entries);
+	free(sizes);
+	return r;
+}
 
-	return 0;
+
+typedef int (*df_decode_func_t)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		const u8 **nbuf, size_t *nbufsize);
+
+static df_decode_func_t
+df_decode_func(const struct sc_pkcs15_df *df)
+{
+	switch (df->type) {
+	case SC_PKCS15_PRKDF:
+		return sc_pkcs15_decode_prkdf_entry;
+	case SC_PKCS15_PUKDF:
+		return sc_pkcs15_decode_pukdf_entry;
+	case SC_PKCS15_SKDF:
+		return sc_pkcs15_decode_skdf_entry;
+	case SC_PKCS15_CDF:
+	case SC_PKCS15_CDF_TRUSTED:
+	case SC_PKCS15_CDF_USEFUL:
+		return sc_pkcs15_decode_cdf_entry;
+	case SC_PKCS15_DODF:
+		return sc_pkcs15_decode_dodf_entry;
+	case SC_PKCS15_AODF:
+		return sc_pkcs15_decode_aodf_entry;
+	}
+	return NULL;
 }
 
 
-int
-sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+static void
+df_stream_close(struct sc_pkcs15_card *p15card, struct df_stream *s)
+{
+	if (s->locked)
+		sc_unlock(p15card->card);
+	s->locked = 0;
+	s->selected = NULL;
+}
+
+
+static int
+df_stream_select(struct sc_pkcs15_card *p15card, struct df_stream *s,
+		struct sc_pkcs15_df *df, struct sc_file **file)
+{
+	int r;
+
+	if (!s->locked) {
+		r = sc_lock(p15card->card);
+		if (r < 0)
+			return r;
+		s->locked = 1;
+	}
+	s->selected = NULL;
+	r = sc_select_file(p15card->card, &df->path, file);
+	if (r < 0)
+		return r;
+	s->selected = df;
+	return SC_SUCCESS;
+}
+
+
+/* Starts reading a DF. A plain transparent EF is only allocated here and
+ * then read as far as its entries are needed; cached files, parts of
+ * files and record files are read at once as before. */
+static int
+df_stream_open(struct sc_pkcs15_card *p15card, struct df_stream *s, struct sc_pkcs15_df *df)
+{
+	struct sc_file *file = NULL;
+	int r;
+
+	if (!p15card->opts.use_file_cache && df->path.count < 0) {
+		r = df_stream_select(p15card, s, df, &file);
+		if (r < 0)
+			return r;
+		if (file->ef_structure == SC_FILE_EF_TRANSPARENT && file->size > 0) {
+			df->data = malloc(file->size);
+			if (df->data == NULL) {
+				sc_file_free(file);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			df->data_size = file->size;
+			df->data_len = 0;
+			sc_file_free(file);
+			df->card_generation = p15card->card->card_generation;
+			df->shared_generation = 0;
+			sc_card_shared_generation(p15card->card, &df->shared_generation);
+			return SC_SUCCESS;
+		}
+		sc_file_free(file);
+	}
+
+	r = sc_pkcs15_read_file(p15card, &df->path, &df->data, &df->data_len);
+	if (r < 0)
+		return r;
+	df->data_size = df->data_len;
+	return SC_SUCCESS;
+}
+
+
+/* Picks up a DF read only partly under an earlier card lock. If the card
+ * was reset or written by another process meanwhile, the rest of the DF
+ * may not match what was read, so its objects are dropped and the DF is
+ * read again from its start. */
+static int
+df_stream_resume(struct sc_pkcs15_card *p15card, struct df_stream *s, struct sc_pkcs15_df *df)
+{
+	struct sc_pkcs15_object *obj, *next;
+	unsigned int generation = 0;
+	int r;
+
+	if (s->selected != df) {
+		r = df_stream_select(p15card, s, df, NULL);
+		if (r < 0)
+			return r;
+	}
+	sc_card_shared_generation(p15card->card, &generation);
+	if (df->card_generation == p15card->card->card_generation
+			&& df->shared_generation == generation)
+		return SC_SUCCESS;
+
+	sc_log(p15card->card->ctx, "card changed while the DF was read, reading it again");
+	for (obj = p15card->obj_list; obj != NULL; obj = next) {
+		next = obj->next;
+		if (obj->df == df)
+			sc_pkcs15_remove_object(p15card, obj);
+	}
+	free(df->data);
+	df->data = NULL;
+	df->data_len = 0;
+	df->data_size = 0;
+	df->parsed = 0;
+	df->tail = NULL;
+	return SC_SUCCESS;
+}
+
+
+/* Makes at least 'need' bytes of the DF available, if it has that many,
+ * reading whole response APDUs worth at a time */
+static int
+df_stream_fill(struct sc_pkcs15_card *p15card, struct df_stream *s,
+		struct sc_pkcs15_df *df, size_t need)
+{
+	size_t chunk = sc_get_max_recv_size(p15card->card), count;
+	int r;
+
+	if (need > df->data_size)
+		need = df->data_size;
+	if (chunk == 0)
+		chunk = 256;
+	while (df->data_len < need) {
+		if (s->selected != df) {
+			r = df_stream_select(p15card, s, df, NULL);
+			if (r < 0)
+				return r;
+		}
+		count = (need - df->data_len + chunk - 1) / chunk * chunk;
+		if (count > df->data_size - df->data_len)
+			count = df->data_size - df->data_len;
+		r = sc_read_binary(p15card->card, df->data_len, df->data + df->data_len, count, 0);
+		if (r < 0)
+			return r;
+		if (r == 0) {
+			/* the file is shorter than it claimed */
+			df->data_size = df->data_len;
+			break;
+		}
+		df->data_len += r;
+	}
+	return SC_SUCCESS;
+}
+
+
+/* Size of the TLV at 'p' from its tag and length octets, 0 if more than
+ * 'avail' bytes are needed to tell, or (size_t) -1 if it is not valid */
+static size_t
+df_entry_size(const u8 *p, size_t avail)
+{
+	size_t i = 1, n, len;
+
+	if ((p[0] & SC_ASN1_TAG_PRIMITIVE) == SC_ASN1_TAG_PRIMITIVE)
+		while (i < avail && (p[i++] & 0x80))
+			;
+	if (i >= avail)
+		return 0;
+	len = p[i] & 0x7F;
+	if (p[i++] & 0x80) {
+		n = len;
+		if (n > 4)
+			return (size_t) -1;
+		if (i + n > avail)
+			return 0;
+		for (len = 0; n > 0; n--)
+			len = (len << 8) | p[i++];
+	}
+	return i + len;
+}
+
+
+/* Keeps the objects of a DF together in obj_list, even when its parse
+ * was interrupted and other DFs were parsed meanwhile */
+static int
+add_df_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object *tail = df->tail;
+	int r;
+
+	if (tail == NULL || tail->next == NULL) {
+		r = sc_pkcs15_add_object(p15card, obj);
+		if (r < 0)
+			return r;
+	}
+	else {
+		obj->prev = tail;
+		obj->next = tail->next;
+		tail->next->prev = obj;
+		tail->next = obj;
+		/* the index buckets are in list order, so rebuild it when needed */
+		sc_pkcs15_clear_object_index(p15card);
+	}
+	df->tail = obj;
+	return SC_SUCCESS;
+}
+
+
+/* Decodes the next entry of a DF, reading the DF as far as needed.
+ * Returns 1 if it added an object, 0 if the DF is now enumerated, or an
+ * error, which also ends the DF. */
+static int
+parse_df_entry(struct sc_pkcs15_card *p15card, struct df_stream *s, struct sc_pkcs15_df *df)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	unsigned char *buf;
-	const unsigned char *p;
-	size_t bufsize;
+	df_decode_func_t func = df_decode_func(df);
+	struct sc_pkcs15_object *obj;
+	const u8 *p;
+	size_t left, size;
+	int r;
+
+	if (df->enumerated)
+		return 0;
+	if (func == NULL) {
+		sc_log(ctx, "unknown DF type: %d", df->type);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+	if (p15card->arena == NULL) {
+		p15card->arena = calloc(1, sizeof(struct sc_pkcs15_arena));
+		if (p15card->arena == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (df->data != NULL && df->data_len < df->data_size) {
+		r = df_stream_resume(p15card, s, df);
+		LOG_TEST_RET(ctx, r, "pkcs15 DF select failed");
+	}
+	if (df->data == NULL) {
+		/* the decoded objects borrow from the DF contents rather
+		 * than allocating copies, so keep them with the DF */
+		r = df_stream_open(p15card, s, df);
+		/* not enumerated, so that it is tried again later */
+		LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+	}
+
+	/* the tag and length octets first, then the whole entry */
+	r = df_stream_fill(p15card, s, df, df->parsed + 8);
+	if (r < 0) {
+		sc_log(ctx, "%s: DF read failed", sc_strerror(r));
+		goto err;
+	}
+	if (df->parsed >= df->data_len || df->data[df->parsed] == 0x00) {
+		df->enumerated = 1;
+		return 0;
+	}
+	size = df_entry_size(df->data + df->parsed, df->data_len - df->parsed);
+	if (size != 0) {
+		r = df_stream_fill(p15card, s, df, size == (size_t) -1 ? df->data_size : df->parsed + size);
+		if (r < 0) {
+			sc_log(ctx, "%s: DF read failed", sc_strerror(r));
+			goto err;
+		}
+	}
+
+	obj = sc_pkcs15_arena_alloc(p15card->arena, sizeof(struct sc_pkcs15_object));
+	if (obj == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	obj->arena = p15card->arena;
+	p = df->data + df->parsed;
+	left = df->data_len - df->parsed;
+	p15card->parsing_df = df;
+	/* on errors the arena space is simply left unused */
+	r = func(p15card, obj, &p, &left);
+	p15card->parsing_df = NULL;
+	if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
+		df->enumerated = 1;
+		return 0;
+	}
+	if (r < 0) {
+		sc_log(ctx, "%s: Error decoding DF entry", sc_strerror(r));
+		goto err;
+	}
+	df->parsed = p - df->data;
+
+	obj->df = df;
+	r = add_df_object(p15card, df, obj);
+	if (r < 0) {
+		sc_pkcs15_free_object(obj);
+		sc_log(ctx, "%s: Error adding object", sc_strerror(r));
+		goto err;
+	}
+	return 1;
+
+err:
+	df->enumerated = 1;
+	return r;
+}
+
+
+static int
+parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct df_stream s;
 	int r;
-	struct sc_pkcs15_object *obj = NULL;
-	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
-		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
 	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
 
@@ -2025,71 +3259,129 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 	if (df->enumerated)
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
-	switch (df->type) {
-	case SC_PKCS15_PRKDF:
-		func = sc_pkcs15_decode_prkdf_entry;
-		break;
-	case SC_PKCS15_PUKDF:
-		func = sc_pkcs15_decode_pukdf_entry;
-		break;
-	case SC_PKCS15_SKDF:
-		func = sc_pkcs15_decode_skdf_entry;
-		break;
-	case SC_PKCS15_CDF:
-	case SC_PKCS15_CDF_TRUSTED:
-	case SC_PKCS15_CDF_USEFUL:
-		func = sc_pkcs15_decode_cdf_entry;
-		break;
-	case SC_PKCS15_DODF:
-		func = sc_pkcs15_decode_dodf_entry;
-		break;
-	case SC_PKCS15_AODF:
-		func = sc_pkcs15_decode_aodf_entry;
-		break;
+	/* from the start, or from where a search stopped */
+	memset(&s, 0, sizeof(s));
+	do {
+		r = parse_df_entry(p15card, &s, df);
+	} while (r > 0);
+	df_stream_close(p15card, &s);
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+int
+sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned long long start = sc_startup_trace_begin(ctx);
+	int r;
+
+	r = parse_df(p15card, df);
+	sc_startup_trace_end(ctx, start, "pkcs15", "parse DF %s (type %u)",
+			sc_print_path(&df->path), df->type);
+	return r;
+}
+
+
+/*
+ * Passes the objects of a DF to 'func' in list order. The entries not
+ * decoded yet are read and decoded one at a time, each just before it is
+ * passed on, so that the caller sees the first objects before the rest of
+ * the DF is read. A nonzero return of 'func' stops the walk and is
+ * returned; the objects stay in the object list of the card.
+ */
+int
+sc_pkcs15_walk_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		sc_pkcs15_walk_df_func_t func, void *arg)
+{
+	struct sc_context *ctx;
+	struct sc_pkcs15_object *obj;
+	struct df_stream s;
+	int r = 0;
+
+	if (p15card == NULL || p15card->card == NULL || df == NULL || func == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	if (p15card->ops.parse_df && !df->enumerated) {
+		r = p15card->ops.parse_df(p15card, df);
+		LOG_TEST_RET(ctx, r, "DF parse failed");
 	}
-	if (func == NULL) {
-		sc_log(ctx, "unknown DF type: %d", df->type);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	/* the objects decoded by earlier parses or searches */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (obj->df != df)
+			continue;
+		r = func(p15card, obj, arg);
+		if (r)
+			LOG_FUNC_RETURN(ctx, r);
+	}
+
+	memset(&s, 0, sizeof(s));
+	while (!df->enumerated) {
+		r = parse_df_entry(p15card, &s, df);
+		if (r <= 0)
+			break;
+		r = func(p15card, df->tail, arg);
+		if (r)
+			break;
+		/* 'func' may have selected other files */
+		s.selected = NULL;
 	}
-	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
-	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+	df_stream_close(p15card, &s);
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+/*
+ * The UnusedSpace list is kept ordered by the size of the blocks, so that
+ * the first block large enough is also the best fitting one. Adjacent
+ * blocks of the same file and PIN are merged when they are added.
+ */
+static void
+unusedspace_unlink(struct sc_pkcs15_card *p15card, struct sc_pkcs15_unusedspace *unusedspace)
+{
+	if (!unusedspace->prev)
+		p15card->unusedspace_list = unusedspace->next;
+	else
+		unusedspace->prev->next = unusedspace->next;
 
-	p = buf;
-	while (bufsize && *p != 0x00) {
+	if (unusedspace->next)
+		unusedspace->next->prev = unusedspace->prev;
+	unusedspace->next = unusedspace->prev = NULL;
+}
 
-		obj = calloc(1, sizeof(struct sc_pkcs15_object));
-		if (obj == NULL) {
-			r = SC_ERROR_OUT_OF_MEMORY;
-			goto ret;
-		}
-		r = func(p15card, obj, &p, &bufsize);
-		if (r) {
-			free(obj);
-			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
-				r = 0;
-				break;
-			}
-			sc_log(ctx, "%s: Error decoding DF entry", sc_strerror(r));
-			goto ret;
-		}
 
-		obj->df = df;
-		r = sc_pkcs15_add_object(p15card, obj);
-		if (r) {
-			if (obj->data)
-				free(obj->data);
-			free(obj);
-			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
-			goto ret;
-		}
-	};
+static void
+unusedspace_insert(struct sc_pkcs15_card *p15card, struct sc_pkcs15_unusedspace *unusedspace)
+{
+	struct sc_pkcs15_unusedspace *p = p15card->unusedspace_list, *prev = NULL;
 
-	if (r > 0)
-		r = 0;
-ret:
-	df->enumerated = 1;
-	free(buf);
-	LOG_FUNC_RETURN(ctx, r);
+	while (p != NULL && p->path.count <= unusedspace->path.count) {
+		prev = p;
+		p = p->next;
+	}
+	unusedspace->prev = prev;
+	unusedspace->next = p;
+	if (prev)
+		prev->next = unusedspace;
+	else
+		p15card->unusedspace_list = unusedspace;
+	if (p)
+		p->prev = unusedspace;
+}
+
+
+static int
+unusedspace_same_file(const struct sc_pkcs15_unusedspace *a, const struct sc_pkcs15_unusedspace *b)
+{
+	return sc_compare_path(&a->path, &b->path)
+		&& a->path.aid.len == b->path.aid.len
+		&& !memcmp(a->path.aid.value, b->path.aid.value, a->path.aid.len)
+		&& sc_pkcs15_compare_id(&a->auth_id, &b->auth_id);
 }
 
 
@@ -2098,7 +3390,7 @@ sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card, const struct sc_path *
 		const struct sc_pkcs15_id *auth_id)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	struct sc_pkcs15_unusedspace *p = p15card->unusedspace_list, *new_unusedspace;
+	struct sc_pkcs15_unusedspace *p, *next, *new_unusedspace;
 
 	if (path->count == -1) {
 		char pbuf[SC_MAX_PATH_STRING_SIZE];
@@ -2118,14 +3410,19 @@ sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card, const struct sc_path *
 	if (auth_id != NULL)
 		new_unusedspace->auth_id = *auth_id;
 
-	if (p15card->unusedspace_list == NULL) {
-		p15card->unusedspace_list = new_unusedspace;
-		return 0;
+	for (p = p15card->unusedspace_list; p != NULL && new_unusedspace->path.count > 0; p = next) {
+		next = p->next;
+		if (p->path.count <= 0 || !unusedspace_same_file(p, new_unusedspace))
+			continue;
+		if (p->path.index + p->path.count == new_unusedspace->path.index)
+			new_unusedspace->path.index = p->path.index;
+		else if (new_unusedspace->path.index + new_unusedspace->path.count != p->path.index)
+			continue;
+		new_unusedspace->path.count += p->path.count;
+		unusedspace_unlink(p15card, p);
+		free(p);
 	}
-	while (p->next != NULL)
-		p = p->next;
-	p->next = new_unusedspace;
-	new_unusedspace->prev = p;
+	unusedspace_insert(p15card, new_unusedspace);
 
 	return 0;
 }
@@ -2137,15 +3434,76 @@ sc_pkcs15_remove_unusedspace(struct sc_pkcs15_card *p15card, struct sc_pkcs15_un
 	if (!unusedspace)
 		return;
 
-	if (!unusedspace->prev)
-		p15card->unusedspace_list = unusedspace->next;
-	else
-		unusedspace->prev->next = unusedspace->next;
+	unusedspace_unlink(p15card, unusedspace);
+	free(unusedspace);
+}
 
-	if (unusedspace->next)
-		unusedspace->next->prev = unusedspace->prev;
 
-	free(unusedspace);
+/*
+ * Read the UnusedSpace file, unless that was done already
+ */
+int
+sc_pkcs15_read_unusedspace(struct sc_pkcs15_card *p15card)
+{
+	unsigned char *buf = NULL;
+	size_t buflen = 0;
+	int r;
+
+	if (p15card->unusedspace_read || p15card->file_unusedspace == NULL)
+		return SC_SUCCESS;
+
+	r = sc_pkcs15_read_file(p15card, &p15card->file_unusedspace->path, &buf, &buflen);
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15_parse_unusedspace(buf, buflen, p15card);
+	free(buf);
+	if (r < 0 && r != SC_ERROR_FILE_NOT_FOUND)
+		LOG_TEST_RET(p15card->card->ctx, r, "Cannot read UnusedSpace");
+	p15card->unusedspace_read = 1;
+	return SC_SUCCESS;
+}
+
+
+/*
+ * Take 'size' bytes from the smallest free block that has them and is
+ * protected by 'auth_id' (any block if NULL); 'path' is set to them.
+ */
+int
+sc_pkcs15_alloc_unusedspace(struct sc_pkcs15_card *p15card, size_t size,
+		const struct sc_pkcs15_id *auth_id, struct sc_path *path)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_unusedspace *p;
+	int r;
+
+	if (size == 0 || size > INT_MAX || path == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = sc_pkcs15_read_unusedspace(p15card);
+	if (r < 0)
+		return r;
+
+	for (p = p15card->unusedspace_list; p != NULL; p = p->next) {
+		if (p->path.count < (int) size)
+			continue;
+		if (auth_id == NULL || sc_pkcs15_compare_id(&p->auth_id, auth_id))
+			break;
+	}
+	if (p == NULL)
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+
+	*path = p->path;
+	path->count = (int) size;
+
+	unusedspace_unlink(p15card, p);
+	p->path.index += (int) size;
+	p->path.count -= (int) size;
+	if (p->path.count > 0)
+		unusedspace_insert(p15card, p);
+	else
+		free(p);
+
+	sc_log(ctx, "allocated %lu bytes at %s", (unsigned long) size, sc_print_path(path));
+	return SC_SUCCESS;
 }
 
 
@@ -2292,8 +3650,41 @@ sc_pkcs15_parse_unusedspace(const unsigned char *buf, size_t buflen, struct sc_p
 }
 
 
-int
-sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+/*
+ * Concurrent readers of the same file share one read from the card: the
+ * first one registers the read in p15card->read_flights and holds the
+ * mutex of the entry until the data is in, the others wait on that mutex
+ * and take a copy. The list is protected by the card mutex.
+ */
+struct sc_pkcs15_read_flight {
+	struct sc_path path;
+	void *mutex;
+	int done, r;
+	unsigned char *data;
+	size_t len;
+	unsigned int waiters;
+	struct sc_pkcs15_read_flight *next;
+};
+
+static int
+same_file_read(const struct sc_path *a, const struct sc_path *b)
+{
+	return a->type == b->type && a->index == b->index && a->count == b->count
+		&& sc_compare_path(a, b)
+		&& a->aid.len == b->aid.len && !memcmp(a->aid.value, b->aid.value, a->aid.len);
+}
+
+static void
+read_flight_free(struct sc_context *ctx, struct sc_pkcs15_read_flight *flight)
+{
+	if (flight->data)
+		free(flight->data);
+	sc_mutex_destroy(ctx, flight->mutex);
+	free(flight);
+}
+
+static int
+read_file_from_card(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
 		unsigned char **buf, size_t *buflen)
 {
 	struct sc_context *ctx = p15card->card->ctx;
@@ -2302,99 +3693,359 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 	size_t	len = 0, offset = 0;
 	int	r;
 
-	assert(p15card != NULL && in_path != NULL && buf != NULL);
-
-	LOG_FUNC_CALLED(ctx);
-	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
-
-	r = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
-		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+	r = sc_select_file(p15card->card, in_path, &file);
+	if (r)
+		goto fail_unlock;
+
+	/* Handle the case where the ASN.1 Path object specified
+	 * index and length values */
+	if (in_path->count < 0) {
+		if (file->size)
+			len = file->size;
+		else
+			len = 1024;
+		offset = 0;
 	}
-	if (r) {
-		r = sc_lock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_lock() failed");
-		r = sc_select_file(p15card->card, in_path, &file);
-		if (r)
+	else {
+		offset = in_path->index;
+		len = in_path->count;
+		/* Make sure we're within proper bounds */
+		if (offset >= file->size || offset + len > file->size) {
+			r = SC_ERROR_INVALID_ASN1_OBJECT;
 			goto fail_unlock;
-
-		/* Handle the case where the ASN.1 Path object specified
-		 * index and length values */
-		if (in_path->count < 0) {
-			if (file->size)
-				len = file->size;
-			else
-				len = 1024;
-			offset = 0;
 		}
-		else {
-			offset = in_path->index;
-			len = in_path->count;
-			/* Make sure we're within proper bounds */
-			if (offset >= file->size || offset + len > file->size) {
-				r = SC_ERROR_INVALID_ASN1_OBJECT;
+	}
+	data = malloc(len);
+	if (data == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto fail_unlock;
+	}
+
+	if (file->ef_structure == SC_FILE_EF_LINEAR_VARIABLE_TLV) {
+		int i;
+		size_t l, record_len;
+		unsigned char *head = data;
+
+		for (i=1;  ; i++) {
+			l = len - (head - data);
+			if (l > 256) { l = 256; }
+			r = sc_read_record(p15card->card, i, head, l, SC_RECORD_BY_REC_NR);
+			if (r == SC_ERROR_RECORD_NOT_FOUND)
+				break;
+			if (r < 0) {
+				free(data);
 				goto fail_unlock;
 			}
+			if (r < 2)
+				break;
+			record_len = head[1];
+			if (record_len != 0xff) {
+				memmove(head,head+2,r-2);
+				head += (r-2);
+			}
+			else {
+				if (r < 4)
+					break;
+				memmove(head,head+4,r-4);
+				head += (r-4);
+			}
 		}
-		data = malloc(len);
-		if (data == NULL) {
-			r = SC_ERROR_OUT_OF_MEMORY;
+		len = head-data;
+	}
+	else {
+		r = sc_read_binary(p15card->card, offset, data, len, 0);
+		if (r < 0) {
+			free(data);
 			goto fail_unlock;
 		}
+		/* sc_read_binary may return less than requested */
+		len = r;
+	}
+	sc_unlock(p15card->card);
+
+	sc_file_free(file);
+	*buf = data;
+	*buflen = len;
+	return SC_SUCCESS;
+
+fail_unlock:
+	if (file)
+		sc_file_free(file);
+	sc_unlock(p15card->card);
+	return r;
+}
+
+/* wait for the read of another thread, -1 if it brought nothing */
+static int
+read_flight_wait(struct sc_pkcs15_card *p15card, struct sc_pkcs15_read_flight *flight,
+		unsigned char **buf, size_t *buflen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int r = -1;
+
+	sc_mutex_lock(ctx, flight->mutex);
+	sc_mutex_unlock(ctx, flight->mutex);
+
+	sc_mutex_lock(ctx, p15card->card->mutex);
+	if (flight->done && flight->r == SC_SUCCESS) {
+		*buf = malloc(flight->len ? flight->len : 1);
+		if (*buf != NULL) {
+			memcpy(*buf, flight->data, flight->len);
+			*buflen = flight->len;
+			r = SC_SUCCESS;
+		}
+	}
+	if (--flight->waiters == 0 && flight->done)
+		read_flight_free(ctx, flight);
+	sc_mutex_unlock(ctx, p15card->card->mutex);
+	return r;
+}
+
+static int
+read_file_shared(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		unsigned char **buf, size_t *buflen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_read_flight *flight, **pp;
+	int r, owner;
 
-		if (file->ef_structure == SC_FILE_EF_LINEAR_VARIABLE_TLV) {
-			int i;
-			size_t l, record_len;
-			unsigned char *head = data;
+	/* without threads there is nobody to share with */
+	if (ctx->thread_ctx == NULL)
+		return read_file_from_card(p15card, in_path, buf, buflen);
 
-			for (i=1;  ; i++) {
-				l = len - (head - data);
-				if (l > 256) { l = 256; }
-				r = sc_read_record(p15card->card, i, head, l, SC_RECORD_BY_REC_NR);
-				if (r == SC_ERROR_RECORD_NOT_FOUND)
-					break;
-				if (r < 0) {
-					free(data);
-					goto fail_unlock;
-				}
-				if (r < 2)
-					break;
-				record_len = head[1];
-				if (record_len != 0xff) {
-					memmove(head,head+2,r-2);
-					head += (r-2);
-				}
-				else {
-					if (r < 4)
-						break;
-					memmove(head,head+4,r-4);
-					head += (r-4);
-				}
-			}
-			len = head-data;
+	r = sc_mutex_lock(ctx, p15card->card->mutex);
+	if (r != SC_SUCCESS)
+		return r;
+	for (flight = p15card->read_flights; flight; flight = flight->next)
+		if (same_file_read(&flight->path, in_path))
+			break;
+	if (flight != NULL) {
+		flight->waiters++;
+		sc_mutex_unlock(ctx, p15card->card->mutex);
+		sc_log(ctx, "waiting for the read of %s in progress", sc_print_path(in_path));
+		if (read_flight_wait(p15card, flight, buf, buflen) == SC_SUCCESS)
+			return SC_SUCCESS;
+		return read_file_from_card(p15card, in_path, buf, buflen);
+	}
+
+	flight = calloc(1, sizeof(struct sc_pkcs15_read_flight));
+	if (flight == NULL || sc_mutex_create(ctx, &flight->mutex) != SC_SUCCESS
+			|| sc_mutex_lock(ctx, flight->mutex) != SC_SUCCESS) {
+		if (flight != NULL)
+			read_flight_free(ctx, flight);
+		sc_mutex_unlock(ctx, p15card->card->mutex);
+		return read_file_from_card(p15card, in_path, buf, buflen);
+	}
+	flight->path = *in_path;
+	flight->next = p15card->read_flights;
+	p15card->read_flights = flight;
+	sc_mutex_unlock(ctx, p15card->card->mutex);
+
+	r = read_file_from_card(p15card, in_path, buf, buflen);
+
+	sc_mutex_lock(ctx, p15card->card->mutex);
+	for (pp = &p15card->read_flights; *pp; pp = &(*pp)->next)
+		if (*pp == flight) {
+			*pp = flight->next;
+			break;
+		}
+	flight->done = 1;
+	flight->r = r;
+	if (r == SC_SUCCESS && flight->waiters) {
+		flight->data = malloc(*buflen ? *buflen : 1);
+		if (flight->data != NULL) {
+			memcpy(flight->data, *buf, *buflen);
+			flight->len = *buflen;
 		}
 		else {
-			r = sc_read_binary(p15card->card, offset, data, len, 0);
-			if (r < 0) {
-				free(data);
-				goto fail_unlock;
-			}
-			/* sc_read_binary may return less than requested */
-			len = r;
+			flight->r = SC_ERROR_OUT_OF_MEMORY;
 		}
-		sc_unlock(p15card->card);
+	}
+	/* the last waiter frees the entry, if there is one */
+	owner = flight->waiters == 0;
+	sc_mutex_unlock(ctx, p15card->card->mutex);
+	sc_mutex_unlock(ctx, flight->mutex);
+	if (owner)
+		read_flight_free(ctx, flight);
+	return r;
+}
 
-		sc_file_free(file);
+
+int
+sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		unsigned char **buf, size_t *buflen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned char *data = NULL;
+	size_t	len = 0;
+	int	r;
+
+	assert(p15card != NULL && in_path != NULL && buf != NULL);
+
+	LOG_FUNC_CALLED(ctx);
+	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
+
+	r = -1; /* file state: not in cache */
+	if (p15card->opts.use_file_cache) {
+		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
+		if (r == SC_SUCCESS)
+			sc_pkcs15_cache_mark_stale(p15card, in_path);
+	}
+	if (r) {
+		r = read_file_shared(p15card, in_path, &data, &len);
+		SC_PROBE4(read_file, in_path, len, 0, r);
+		LOG_TEST_RET(ctx, r, "cannot read file");
+	}
+	else {
+		SC_PROBE4(read_file, in_path, len, 1, SC_SUCCESS);
 	}
 	*buf = data;
 	*buflen = len;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
 
-fail_unlock:
+
+/*
+ * No card here offers a digest of its files, so each file served from
+ * the cache is read again and compared, the length first. Changed files
+ * replace their cached copy; the caller binds the card again to use them.
+ */
+int
+sc_pkcs15_revalidate_file_cache(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	sc_path_t *paths = NULL;
+	size_t count = 0, i;
+	unsigned int generation = 0;
+	int r, changed = 0, shared;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!p15card->opts.use_file_cache || !p15card->opts.revalidate_file_cache)
+		LOG_FUNC_RETURN(ctx, 0);
+
+	sc_pkcs15_cache_take_stale(p15card, &paths, &count);
+	if (count == 0)
+		LOG_FUNC_RETURN(ctx, 0);
+
+	r = sc_lock(p15card->card);
+	if (r < 0) {
+		free(paths);
+		LOG_TEST_RET(ctx, r, "sc_lock() failed");
+	}
+	/* read before the files, a write meanwhile shows up next time */
+	shared = sc_card_shared_generation(p15card->card, &generation) == SC_SUCCESS;
+	for (i = 0; i < count; i++) {
+		unsigned char *cached = NULL, *fresh = NULL;
+		size_t cached_len = 0, fresh_len = 0;
+
+		/* replaced in the meantime */
+		if (sc_pkcs15_read_cached_file(p15card, &paths[i], &cached, &cached_len) != SC_SUCCESS)
+			continue;
+		r = read_file_shared(p15card, &paths[i], &fresh, &fresh_len);
+		if (r == SC_SUCCESS && (fresh_len != cached_len || memcmp(fresh, cached, fresh_len))) {
+			sc_log(ctx, "cached file %s changed on the card", sc_print_path(&paths[i]));
+			sc_pkcs15_cache_file(p15card, &paths[i], fresh, fresh_len);
+			changed++;
+		}
+		free(cached);
+		free(fresh);
+		if (r != SC_SUCCESS) {
+			/* the files left are checked when they are served again */
+			sc_log(ctx, "cannot revalidate %s: %s", sc_print_path(&paths[i]), sc_strerror(r));
+			break;
+		}
+	}
+	if (shared && i == count)
+		sc_pkcs15_cache_validated(p15card, generation);
+	sc_unlock(p15card->card);
+	free(paths);
+	LOG_FUNC_RETURN(ctx, changed);
+}
+
+
+int
+sc_pkcs15_read_file_stream(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		sc_pkcs15_read_cb_t cb, void *arg)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_card *card = p15card->card;
+	struct sc_file *file = NULL;
+	unsigned char *data = NULL;
+	size_t	len = 0, offset = 0, done = 0;
+	int	r;
+
+	assert(p15card != NULL && in_path != NULL && cb != NULL);
+
+	LOG_FUNC_CALLED(ctx);
+	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
+
+	if (p15card->opts.use_file_cache
+			&& sc_pkcs15_read_cached_file(p15card, in_path, &data, &len) == 0) {
+		sc_pkcs15_cache_mark_stale(p15card, in_path);
+		goto whole;
+	}
+
+	r = sc_lock(card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+	r = sc_select_file(card, in_path, &file);
+	if (r)
+		goto unlock;
+
+	if (file->ef_structure == SC_FILE_EF_LINEAR_VARIABLE_TLV
+			|| (file->size == 0 && in_path->count < 0)) {
+		/* the records, or the EF of unknown size, as a whole */
+		sc_file_free(file);
+		sc_unlock(card);
+		r = sc_pkcs15_read_file(p15card, in_path, &data, &len);
+		LOG_TEST_RET(ctx, r, "cannot read file");
+		goto whole;
+	}
+
+	if (in_path->count < 0) {
+		len = file->size;
+	}
+	else {
+		offset = in_path->index;
+		len = in_path->count;
+		if (offset >= file->size || offset + len > file->size) {
+			r = SC_ERROR_INVALID_ASN1_OBJECT;
+			goto unlock;
+		}
+	}
+
+	data = malloc(SC_PKCS15_STREAM_CHUNK);
+	if (data == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto unlock;
+	}
+	while (done < len) {
+		size_t n = len - done < SC_PKCS15_STREAM_CHUNK ? len - done : SC_PKCS15_STREAM_CHUNK;
+
+		r = sc_read_binary(card, offset + done, data, n, 0);
+		if (r <= 0)
+			break;
+		done += r;
+		r = cb(arg, data, r);
+		if (r < 0)
+			break;
+	}
+	/* the EF may be shorter than its FCI says, as with sc_read_binary() */
+	if (r > 0)
+		r = SC_SUCCESS;
+
+unlock:
+	free(data);
 	if (file)
 		sc_file_free(file);
-	sc_unlock(p15card->card);
+	sc_unlock(card);
 	LOG_FUNC_RETURN(ctx, r);
+
+whole:
+	r = cb(arg, data, len);
+	free(data);
+	LOG_FUNC_RETURN(ctx, r < 0 ? r : SC_SUCCESS);
 }
 
 
@@ -2483,8 +4134,7 @@ sc_pkcs15_make_absolute_path(const struct sc_path *parent, struct sc_path *child
 void sc_pkcs15_free_object_content(struct sc_pkcs15_object *obj)
 {
 	if (obj->content.value && obj->content.len)   {
-		sc_mem_clear(obj->content.value, obj->content.len);
-		free(obj->content.value);
+		sc_mem_free_secure(obj->content.value, obj->content.len);
 	}
 	obj->content.value = NULL;
 	obj->content.len = 0;
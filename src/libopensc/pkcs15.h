@@ -155,6 +155,15 @@ struct sc_pkcs15_der {
 };
 typedef struct sc_pkcs15_der sc_pkcs15_der_t;
 
+/* Reference counted, immutable copy of DER data. Parsed objects keep
+ * pointers into it instead of copies of their parts, see
+ * sc_pkcs15_blob_new(). */
+struct sc_pkcs15_blob {
+	unsigned int	refs;
+	size_t		len;
+	u8		data[1];
+};
+
 struct sc_pkcs15_u8 {
 	u8 *		value;
 	size_t		len;
@@ -295,6 +304,10 @@ struct sc_pkcs15_cert {
 
 	/* DER encoded raw cert */
 	struct sc_pkcs15_der data;
+
+	/* if set, data, serial, issuer and subject point into this buffer,
+	 * which other copies of the certificate share */
+	struct sc_pkcs15_blob *der_blob;
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
 
@@ -543,7 +556,9 @@ struct sc_pkcs15_object {
 	int usage_counter;
 	int user_consent;
 
-	struct sc_pkcs15_accessrule access_rules[SC_PKCS15_MAX_ACCESS_RULES];
+	/* SC_PKCS15_MAX_ACCESS_RULES entries, or NULL if the object has no
+	 * access rules; see sc_pkcs15_object_access_rules() */
+	struct sc_pkcs15_accessrule *access_rules;
 
 	/* Object type specific data */
 	void *data;
@@ -552,8 +567,16 @@ struct sc_pkcs15_object {
 
 	struct sc_pkcs15_df *df; /* can be NULL, if object is 'floating' */
 	struct sc_pkcs15_object *next, *prev; /* used only internally */
+	struct sc_pkcs15_object *id_next; /* next object in the same ID index bucket, used only internally */
+	struct sc_pkcs15_object *class_next; /* next object of the same class, used only internally */
 
 	struct sc_pkcs15_der content;
+
+	/* arena holding this object and its 'data', or NULL if both are on the heap */
+	struct sc_pkcs15_arena *arena;
+
+	/* bytes accounted to SC_MEM_PKCS15 when the object was added to a card */
+	size_t mem_size;
 };
 typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 
@@ -577,6 +600,31 @@ struct sc_pkcs15_df {
 	unsigned int type;
 	int enumerated;
 
+	/* Contents read by sc_pkcs15_parse_df(). The certificate values
+	 * and subject names of its objects point into it; an object
+	 * removed from the card gets its own copy. */
+	u8 *data;
+	size_t data_len;
+
+	/* A search for one object may read and decode the DF only up to
+	 * that object; the next parse or search picks up from there.
+	 * data_len bytes of the data_size allocated have been read, the
+	 * first 'parsed' of them decoded into objects, the last of which
+	 * is 'tail'. */
+	size_t data_size;
+	size_t parsed;
+	struct sc_pkcs15_object *tail;
+	/* card->card_generation and the shared generation of the card
+	 * when the DF was opened, the rest is not read from another card */
+	unsigned int card_generation;
+	unsigned int shared_generation;
+
+	/* The encoding that pkcs15init last wrote to the DF, followed by
+	 * a zero byte or the end of the file; later updates only write
+	 * what changed */
+	u8 *written;
+	size_t written_len;
+
 	struct sc_pkcs15_df *next, *prev;
 };
 typedef struct sc_pkcs15_df sc_pkcs15_df_t;
@@ -649,9 +697,20 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		/* serve cached files regardless of lastUpdate, see
+		 * sc_pkcs15_revalidate_file_cache() */
+		int revalidate_file_cache;
+		/* cap on the cache directory in bytes (0: unlimited), the
+		 * least recently used containers are evicted beyond it */
+		size_t file_cache_max_size;
+		int compress_file_cache;
+		/* bind from the quick bind record while the shared card
+		 * generation stays, see sc_pkcs15_bind() */
+		int quick_bind;
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
+		int use_sec_env_cache;
 	} opts;
 
 	unsigned int magic;
@@ -661,6 +720,12 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_cache *file_cache;	/* mapped file cache container */
+	struct sc_pkcs15_object_index *obj_index;	/* objects of obj_list by ID */
+	struct sc_pkcs15_df *parsing_df;	/* DF whose entries may borrow its data */
+	struct sc_pkcs15_arena *arena;	/* storage of the objects decoded from DFs */
+	struct sc_pkcs15_cert_cache_entry *cert_cache;	/* parsed certificates */
+	struct sc_pkcs15_read_flight *read_flights;	/* reads in progress, see sc_pkcs15_read_file() */
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -691,6 +756,18 @@ int sc_pkcs15_get_objects_cond(struct sc_pkcs15_card *card, unsigned int type,
 int sc_pkcs15_find_object_by_id(struct sc_pkcs15_card *, unsigned int,
 				const sc_pkcs15_id_t *,
 				struct sc_pkcs15_object **);
+/* Iterates over the objects of a type, or of a class with a class type
+ * like SC_PKCS15_TYPE_PRKEY, in the order of sc_pkcs15_get_objects(),
+ * without copying or limiting them:
+ *
+ *   for (obj = sc_pkcs15_first_object(p15card, type); obj != NULL;
+ *		obj = sc_pkcs15_next_object(p15card, obj, type))
+ *
+ * Objects must not be removed during the iteration. */
+struct sc_pkcs15_object *sc_pkcs15_first_object(struct sc_pkcs15_card *card,
+			unsigned int type);
+struct sc_pkcs15_object *sc_pkcs15_next_object(struct sc_pkcs15_card *card,
+			struct sc_pkcs15_object *obj, unsigned int type);
 
 struct sc_pkcs15_card * sc_pkcs15_card_new(void);
 void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card);
@@ -710,6 +787,13 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *prkey_obj,
 				unsigned long alg_flags, const u8 *in,
 				size_t inlen, u8 *out, size_t outlen);
+/* Signs in[0..count-1] under one card lock and one security environment,
+ * signature i goes to out + i * outlen and its length to siglen[i] */
+int sc_pkcs15_compute_signatures(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *prkey_obj,
+				unsigned long alg_flags, const u8 * const *in,
+				const size_t *inlen, size_t count,
+				u8 *out, size_t outlen, size_t *siglen);
 
 int sc_pkcs15_read_pubkey(struct sc_pkcs15_card *,
 		const struct sc_pkcs15_object *, struct sc_pkcs15_pubkey **);
@@ -770,6 +854,12 @@ void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object);
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert);
+/* Reads count certificates, parsing each one while the card sends the
+ * next. certs[i] and results[i] are what sc_pkcs15_read_certificate()
+ * would give for infos[i]. */
+int sc_pkcs15_read_certificates(struct sc_pkcs15_card *card,
+				const struct sc_pkcs15_cert_info * const *infos, size_t count,
+				struct sc_pkcs15_cert **certs, int *results);
 void sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert);
 int sc_pkcs15_find_cert_by_id(struct sc_pkcs15_card *card,
 			      const struct sc_pkcs15_id *id,
@@ -831,6 +921,10 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card,
 			const struct sc_pkcs15_object *obj);
 void sc_pkcs15_pincache_clear(struct sc_pkcs15_card *p15card);
+/* Applies the "framework pkcs15" options of the configuration, as
+ * reloaded by sc_ctx_reload_config(), to a bound card. All options but
+ * use_file_cache change; the PIN cache is cleared if it is disabled. */
+int sc_pkcs15_reload_options(struct sc_pkcs15_card *p15card);
 
 int sc_pkcs15_encode_dir(struct sc_context *ctx,
 			struct sc_pkcs15_card *card,
@@ -866,6 +960,11 @@ int sc_pkcs15_encode_aodf_entry(struct sc_context *ctx,
 
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df);
+typedef int (*sc_pkcs15_walk_df_func_t)(struct sc_pkcs15_card *p15card,
+		struct sc_pkcs15_object *obj, void *arg);
+int sc_pkcs15_walk_df(struct sc_pkcs15_card *p15card,
+		      struct sc_pkcs15_df *df,
+		      sc_pkcs15_walk_df_func_t func, void *arg);
 int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
 		      struct sc_pkcs15_df *df);
 int sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card,
@@ -898,10 +997,15 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj);
 void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 			     struct sc_pkcs15_object *obj);
+/* Has to be called after the ID of an object in obj_list was changed */
+void sc_pkcs15_clear_object_index(struct sc_pkcs15_card *p15card);
 int sc_pkcs15_add_df(struct sc_pkcs15_card *, unsigned int, const sc_path_t *);
 
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
 		     const sc_path_t *path, const sc_pkcs15_id_t *auth_id);
+int sc_pkcs15_read_unusedspace(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_alloc_unusedspace(struct sc_pkcs15_card *p15card, size_t size,
+		     const sc_pkcs15_id_t *auth_id, sc_path_t *path);
 int sc_pkcs15_parse_unusedspace(const u8 * buf, size_t buflen,
 			struct sc_pkcs15_card *card);
 int sc_pkcs15_encode_unusedspace(struct sc_context *ctx,
@@ -923,6 +1027,17 @@ void sc_pkcs15_free_object(struct sc_pkcs15_object *obj);
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 			const struct sc_path *path,
 			u8 **buf, size_t *buflen);
+/* Called with each part of a file, in order; a negative return value
+ * stops the read and is returned by sc_pkcs15_read_file_stream() */
+typedef int (*sc_pkcs15_read_cb_t)(void *arg, const u8 *data, size_t len);
+/* Reads a file like sc_pkcs15_read_file(), but hands it to 'cb' in parts
+ * of at most SC_PKCS15_STREAM_CHUNK bytes as they come from the card. Only
+ * files the card does not give as a whole (cached files, records, EFs of
+ * unknown size) are read into memory first. */
+#define SC_PKCS15_STREAM_CHUNK	4096
+int sc_pkcs15_read_file_stream(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path,
+			sc_pkcs15_read_cb_t cb, void *arg);
 
 /* Caching functions */
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
@@ -931,6 +1046,41 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+/* Returns a pointer into the mapped cache container, valid until the next
+ * sc_pkcs15_cache_file() or the release of the PKCS#15 card */
+int sc_pkcs15_map_cached_file(struct sc_pkcs15_card *p15card,
+			      const struct sc_path *path,
+			      const u8 **buf, size_t *bufsize);
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card);
+/* Remembers a file served from the cache, for sc_pkcs15_revalidate_file_cache() */
+void sc_pkcs15_cache_mark_stale(struct sc_pkcs15_card *p15card,
+				const struct sc_path *path);
+/* Hands over the files remembered so far, to be freed by the caller */
+int sc_pkcs15_cache_take_stale(struct sc_pkcs15_card *p15card,
+			       struct sc_path **paths, size_t *count);
+/* Quick bind: what sc_pkcs15_bind() read from the card before getting
+ * to EF(ODF), stored by card serial number and AID with the shared card
+ * generation it was read at */
+struct sc_pkcs15_quick_bind {
+	unsigned int generation;
+	struct sc_path app_path;
+	struct sc_path tokeninfo_path;
+	u8 *tokeninfo;
+	size_t tokeninfo_len;
+};
+int sc_pkcs15_cache_load_quick_bind(struct sc_context *ctx, const char *key,
+				    struct sc_pkcs15_quick_bind *qb);
+int sc_pkcs15_cache_store_quick_bind(struct sc_context *ctx, const char *key,
+				     const struct sc_pkcs15_quick_bind *qb);
+/* Records that the cache matched the card at the given shared generation,
+ * files served while the generation stays are not remembered */
+void sc_pkcs15_cache_validated(struct sc_pkcs15_card *p15card,
+			       unsigned int generation);
+/* Compares the files served from the cache since the last call with the
+ * card and updates the cache. Returns the number of files that changed. */
+int sc_pkcs15_revalidate_file_cache(struct sc_pkcs15_card *p15card);
+/* Drops the certificates remembered by sc_pkcs15_read_certificate() */
+void sc_pkcs15_cert_cache_release(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -939,6 +1089,12 @@ const char *sc_pkcs15_print_id(const struct sc_pkcs15_id *id);
 void sc_pkcs15_format_id(const char *id_in, struct sc_pkcs15_id *id_out);
 int sc_pkcs15_hex_string_to_id(const char *in, struct sc_pkcs15_id *out);
 int sc_der_copy(struct sc_pkcs15_der *, const struct sc_pkcs15_der *);
+/* The blob starts with one reference, held by the caller */
+int sc_pkcs15_blob_new(const u8 *data, size_t len, struct sc_pkcs15_blob **out);
+struct sc_pkcs15_blob *sc_pkcs15_blob_hold(struct sc_pkcs15_blob *blob);
+void sc_pkcs15_blob_release(struct sc_pkcs15_blob *blob);
+/* Returns 1 if the len bytes at p are part of the blob */
+int sc_pkcs15_blob_contains(const struct sc_pkcs15_blob *blob, const u8 *p, size_t len);
 int sc_pkcs15_get_object_id(const struct sc_pkcs15_object *, struct sc_pkcs15_id *);
 int sc_pkcs15_get_object_guid(struct sc_pkcs15_card *, const struct sc_pkcs15_object *, unsigned,
 		unsigned char *, size_t *);
@@ -955,6 +1111,13 @@ int sc_pkcs15_make_absolute_path(const sc_path_t *parent, sc_path_t *child);
 /* Clean and free object content */
 void sc_pkcs15_free_object_content(struct sc_pkcs15_object *);
 
+/* Allocate the type specific 'data' of an object: from the card's arena
+ * if the object itself lives there, from the heap otherwise */
+void *sc_pkcs15_alloc_object_data(struct sc_pkcs15_object *obj, size_t size);
+/* The access rules of an object, allocated like its 'data' when first
+ * needed; NULL if out of memory */
+struct sc_pkcs15_accessrule *sc_pkcs15_object_access_rules(struct sc_pkcs15_object *obj);
+
 /* Allocate and set object content */
 int sc_pkcs15_allocate_object_content(struct sc_context *, struct sc_pkcs15_object *,
 		const unsigned char *, size_t);
@@ -0,0 +1,61 @@
+/*
+ * probes.h: SystemTap/DTrace static probes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _OPENSC_PROBES_H
+#define _OPENSC_PROBES_H
+
+/*
+ * Static tracepoints of provider "opensc", for SystemTap, DTrace and
+ * eBPF tools attaching to USDT probes. A probe is a NOP until a tracer
+ * attaches to it; without --enable-dtrace the macros expand to nothing.
+ * A double underscore in a probe name reads as a dash to the tracer,
+ * e.g. opensc:transmit-start.
+ *
+ * Probe				Arguments
+ * transmit__start		card, ins, p1, p2, Lc
+ * transmit__done		card, ins, result, SW1SW2
+ * lock__start			card, lock count
+ * lock__done			card, result, lock count
+ * unlock				card, lock count
+ * pcsc__begin_transaction	reader name
+ * pcsc__end_transaction	reader name, result
+ * bind__phase			p15card, phase name, result
+ * read_file			path, length, cache hit, result
+ * pkcs11__entry		function name
+ * pkcs11__return		function name, CK_RV
+ */
+
+#ifdef ENABLE_DTRACE
+#include <sys/sdt.h>
+
+#define SC_PROBE(name)				DTRACE_PROBE(opensc, name)
+#define SC_PROBE1(name, a)			DTRACE_PROBE1(opensc, name, a)
+#define SC_PROBE2(name, a, b)			DTRACE_PROBE2(opensc, name, a, b)
+#define SC_PROBE3(name, a, b, c)		DTRACE_PROBE3(opensc, name, a, b, c)
+#define SC_PROBE4(name, a, b, c, d)		DTRACE_PROBE4(opensc, name, a, b, c, d)
+#define SC_PROBE5(name, a, b, c, d, e)		DTRACE_PROBE5(opensc, name, a, b, c, d, e)
+#else
+#define SC_PROBE(name)				do { } while (0)
+#define SC_PROBE1(name, a)			do { } while (0)
+#define SC_PROBE2(name, a, b)			do { } while (0)
+#define SC_PROBE3(name, a, b, c)		do { } while (0)
+#define SC_PROBE4(name, a, b, c, d)		do { } while (0)
+#define SC_PROBE5(name, a, b, c, d, e)		do { } while (0)
+#endif
+
+#endif
@@ -215,6 +215,57 @@ out:
 	return r;
 }
 
+/*
+ * The APDUs of a batch share the buffers, sized for the largest
+ */
+static int ctapi_transmit_batch(sc_reader_t *reader, sc_apdu_t *apdus, size_t count)
+{
+	size_t       i, ssize, rsize, sbuflen = 0, rbuflen = 0;
+	u8           *sbuf = NULL, *rbuf = NULL;
+	int          r = SC_SUCCESS;
+
+	for (i = 0; i < count; i++) {
+		/* CLA INS P1 P2, extended Lc and Le */
+		if (4 + 3 + apdus[i].datalen + 3 > sbuflen)
+			sbuflen = 4 + 3 + apdus[i].datalen + 3;
+		if (apdus[i].resplen + 2 > rbuflen)
+			rbuflen = apdus[i].resplen + 2;
+	}
+	sbuf = malloc(sbuflen);
+	rbuf = malloc(rbuflen);
+	if (sbuf == NULL || rbuf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		r = sc_apdu_get_octets_buf(reader->ctx, &apdus[i], sbuf, sbuflen,
+				&ssize, SC_PROTO_RAW);
+		if (r != SC_SUCCESS)
+			break;
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+		rsize = apdus[i].resplen + 2;
+		r = ctapi_internal_transmit(reader, sbuf, ssize,
+				rbuf, &rsize, apdus[i].control);
+		sc_mem_clear(sbuf, ssize);
+		if (r < 0) {
+			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
+			break;
+		}
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+		r = sc_apdu_set_resp(reader->ctx, &apdus[i], rbuf, rsize);
+		sc_mem_clear(rbuf, rsize);
+		if (r != SC_SUCCESS)
+			break;
+	}
+	/* the APDUs not sent are left to the caller */
+	if (i > 0)
+		r = (int) i;
+out:
+	free(sbuf);
+	free(rbuf);
+	return r;
+}
+
 static int ctapi_detect_card_presence(sc_reader_t *reader)
 {
 	int r;
@@ -548,6 +599,9 @@ struct sc_reader_driver * sc_get_ctapi_driver(void)
 	ctapi_ops.perform_verify = ctbcs_pin_cmd;
 	ctapi_ops.perform_pace = NULL;
 	ctapi_ops.use_reader = NULL;
+	ctapi_ops.transmit_batch = ctapi_transmit_batch;
+	/* CT-API has no card event notification */
+	ctapi_ops.wait_for_event = _sc_poll_for_event;
 	
 	return &ctapi_drv;
 }
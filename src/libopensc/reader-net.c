@@ -0,0 +1,887 @@
+/*
+ * reader-net.c: Reader driver for readers of a remote card farm
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The driver talks to a card farm server over TCP. Every message is a
+ * frame of
+ *
+ *	type (1 byte) | reader index (1 byte) | length (4 bytes, MSB first) | data
+ *
+ * The server answers each request, in the order received, with a frame
+ * of the request type | 0x80, or with NET_ERROR carrying a NET_E_* code.
+ *
+ *	NET_LIST	->  count, then length and name of each reader
+ *	NET_STATUS	->  NET_ST_* flags, ATR length, ATR
+ *	NET_CONNECT	->  protocol (SC_PROTO_*), ATR length, ATR
+ *	NET_DISCONNECT	->  (empty)
+ *	NET_BEGIN	->  (empty) once the transaction is held for us
+ *	NET_END		->  (empty)
+ *	NET_TRANSMIT	->  response APDU with SW1 SW2; the data is the APDU
+ *	NET_RESET	->  protocol, ATR length, ATR
+ *	NET_WATCH	->  NET_EVENT frames, with the data of a NET_STATUS
+ *			    answer, for each reader now and on every change
+ *
+ * A transaction is held by the server from NET_BEGIN to NET_END or to
+ * the end of the connection. As the server works in order, requests are
+ * pipelined: NET_BEGIN and NET_END are sent without waiting for their
+ * answer, and a batch of APDUs goes out in one write. Card events come
+ * on a second connection, so that waiting for them does not hold up the
+ * requests.
+ *
+ * The protocol has neither encryption nor authentication of the server,
+ * and PINs, decrypted data and signatures cross it in clear. Only a
+ * server on the loopback interface is used, for example the end of an
+ * SSH or TLS tunnel to the card farm, unless allow_remote is set.
+ */
+
+#include "config.h"
+
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "internal.h"
+
+#define NET_LIST	0x01
+#define NET_STATUS	0x02
+#define NET_CONNECT	0x03
+#define NET_DISCONNECT	0x04
+#define NET_BEGIN	0x05
+#define NET_END		0x06
+#define NET_TRANSMIT	0x07
+#define NET_RESET	0x08
+#define NET_WATCH	0x09
+#define NET_EVENT	0x89
+#define NET_ERROR	0xFF
+
+#define NET_REPLY(t)	((t) | 0x80)
+
+/* NET_STATUS flags */
+#define NET_ST_PRESENT	0x01
+#define NET_ST_CHANGED	0x02
+
+/* NET_ERROR codes */
+#define NET_E_NO_CARD		1
+#define NET_E_CARD_REMOVED	2
+#define NET_E_CARD_RESET	3
+#define NET_E_NO_READER		4
+
+#define NET_HEADER_SIZE	6
+#define NET_MAX_DATA	(SC_MAX_EXT_APDU_BUFFER_SIZE + 8)
+
+struct net_global_private_data {
+	char *server;		/* host:port */
+	int allow_remote;	/* servers other than on the loopback interface */
+	int fd;			/* requests, -1 if not connected */
+	int event_fd;		/* NET_WATCH, -1 until waited for events */
+	void *mutex;
+	/* NET_BEGIN and NET_END sent, whose answers were not read yet,
+	 * and the first error among them */
+	unsigned int deferred;
+	int deferred_error;
+	u8 buf[NET_HEADER_SIZE + NET_MAX_DATA];
+};
+
+struct net_private_data {
+	u8 index;
+	/* status from refresh_readers(), for the next detect_card_presence() */
+	int status_valid;
+	u8 status;
+	/* card state last reported by wait_for_event() */
+	int present;
+};
+
+#define GET_GPRIV(ctx)		((struct net_global_private_data *) (ctx)->reader_drv_data)
+#define GET_PRIV(reader)	((struct net_private_data *) (reader)->drv_data)
+
+static struct sc_reader_operations net_ops;
+
+static struct sc_reader_driver net_drv = {
+	"Card farm readers",
+	"net",
+	&net_ops,
+	0, 0, NULL
+};
+
+static int net_is_loopback(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+		return (ntohl(sin->sin_addr.s_addr) >> 24) == 127;
+	}
+	if (sa->sa_family == AF_INET6) {
+		const struct in6_addr *a = &((const struct sockaddr_in6 *) sa)->sin6_addr;
+
+		if (IN6_IS_ADDR_LOOPBACK(a))
+			return 1;
+		return IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127;
+	}
+	return 0;
+}
+
+static int net_open(sc_context_t *ctx, const char *server, int allow_remote)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd = -1, one = 1, r;
+
+	host = strdup(server);
+	if (host == NULL)
+		return -1;
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		sc_log(ctx, "no port in card farm server '%s'", server);
+		free(host);
+		return -1;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	r = getaddrinfo(host, port, &hints, &res);
+	if (r != 0) {
+		sc_log(ctx, "cannot resolve %s: %s", host, gai_strerror(r));
+		free(host);
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if (!allow_remote && !net_is_loopback(ai->ai_addr)) {
+			sc_log(ctx, "card farm server %s is not on the loopback interface, "
+					"see allow_remote", server);
+			continue;
+		}
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		sc_log(ctx, "cannot connect to card farm server %s", server);
+	else
+		/* frames are written whole, do not wait to fill packets */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	free(host);
+	return fd;
+}
+
+static int net_write_all(int fd, const u8 *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return SC_ERROR_TRANSMIT_FAILED;
+		buf += n;
+		len -= n;
+	}
+	return SC_SUCCESS;
+}
+
+static int net_read_all(int fd, u8 *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return SC_ERROR_TRANSMIT_FAILED;
+		buf += n;
+		len -= n;
+	}
+	return SC_SUCCESS;
+}
+
+static size_t net_put_header(u8 *p, unsigned int type, unsigned int index, size_t len)
+{
+	p[0] = type;
+	p[1] = index;
+	p[2] = (len >> 24) & 0xFF;
+	p[3] = (len >> 16) & 0xFF;
+	p[4] = (len >> 8) & 0xFF;
+	p[5] = len & 0xFF;
+	return NET_HEADER_SIZE;
+}
+
+/* Reads a frame, its data to 'data' (at most 'size' bytes) */
+static int net_read_frame(int fd, unsigned int *type, unsigned int *index,
+		u8 *data, size_t size, size_t *len)
+{
+	u8 hdr[NET_HEADER_SIZE];
+	size_t n;
+	int r;
+
+	r = net_read_all(fd, hdr, sizeof(hdr));
+	if (r != SC_SUCCESS)
+		return r;
+	n = ((size_t) hdr[2] << 24) | (hdr[3] << 16) | (hdr[4] << 8) | hdr[5];
+	if (n > size)
+		return SC_ERROR_TRANSMIT_FAILED;
+	r = net_read_all(fd, data, n);
+	if (r != SC_SUCCESS)
+		return r;
+	*type = hdr[0];
+	if (index)
+		*index = hdr[1];
+	*len = n;
+	return SC_SUCCESS;
+}
+
+static int net_error(const u8 *data, size_t len)
+{
+	switch (len > 0 ? data[0] : 0) {
+	case NET_E_NO_CARD:
+		return SC_ERROR_CARD_NOT_PRESENT;
+	case NET_E_CARD_REMOVED:
+		return SC_ERROR_CARD_REMOVED;
+	case NET_E_CARD_RESET:
+		return SC_ERROR_CARD_RESET;
+	case NET_E_NO_READER:
+		return SC_ERROR_READER_DETACHED;
+	}
+	return SC_ERROR_TRANSMIT_FAILED;
+}
+
+/* The connection is out of step with the server after any I/O error */
+static void net_drop(struct net_global_private_data *gpriv)
+{
+	if (gpriv->fd >= 0)
+		close(gpriv->fd);
+	gpriv->fd = -1;
+	gpriv->deferred = 0;
+	gpriv->deferred_error = 0;
+}
+
+/* Reads the answer of the next request sent, after those deferred. Call
+ * with the mutex held. */
+static int net_reply(sc_context_t *ctx, struct net_global_private_data *gpriv,
+		unsigned int type, u8 *data, size_t size, size_t *len)
+{
+	unsigned int rtype;
+	int r;
+
+	while (gpriv->deferred > 0) {
+		r = net_read_frame(gpriv->fd, &rtype, NULL, data, size, len);
+		if (r != SC_SUCCESS) {
+			net_drop(gpriv);
+			return r;
+		}
+		gpriv->deferred--;
+		if (rtype == NET_ERROR && gpriv->deferred_error == 0)
+			gpriv->deferred_error = net_error(data, *len);
+	}
+
+	r = net_read_frame(gpriv->fd, &rtype, NULL, data, size, len);
+	if (r != SC_SUCCESS) {
+		net_drop(gpriv);
+		return r;
+	}
+	if (gpriv->deferred_error) {
+		/* no transaction, the answer may not be the card's */
+		r = gpriv->deferred_error;
+		gpriv->deferred_error = 0;
+		sc_log(ctx, "card farm transaction failed: %s", sc_strerror(r));
+		return r;
+	}
+	if (rtype == NET_ERROR)
+		return net_error(data, *len);
+	if (rtype != NET_REPLY(type)) {
+		sc_log(ctx, "unexpected card farm answer 0x%02X to 0x%02X", rtype, type);
+		net_drop(gpriv);
+		return SC_ERROR_TRANSMIT_FAILED;
+	}
+	return SC_SUCCESS;
+}
+
+static int net_send(struct net_global_private_data *gpriv, unsigned int type,
+		unsigned int index, const u8 *data, size_t len)
+{
+	size_t n = net_put_header(gpriv->buf, type, index, len);
+	int r;
+
+	if (gpriv->fd < 0)
+		return SC_ERROR_READER_DETACHED;
+	if (len > NET_MAX_DATA)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (len)
+		memmove(gpriv->buf + n, data, len);
+	r = net_write_all(gpriv->fd, gpriv->buf, n + len);
+	if (r != SC_SUCCESS)
+		net_drop(gpriv);
+	return r;
+}
+
+/* One request and its answer. The answer data is copied to 'resp' (at
+ * most 'size' bytes) before other readers may use gpriv->buf again. */
+static int net_request(sc_context_t *ctx, unsigned int type, unsigned int index,
+		const u8 *data, size_t len, u8 *resp, size_t size, size_t *rlen)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+	size_t n;
+	int r;
+
+	sc_mutex_lock(ctx, gpriv->mutex);
+	r = net_send(gpriv, type, index, data, len);
+	if (r == SC_SUCCESS)
+		r = net_reply(ctx, gpriv, type, gpriv->buf, sizeof(gpriv->buf), &n);
+	if (r == SC_SUCCESS && n > size)
+		r = SC_ERROR_BUFFER_TOO_SMALL;
+	if (r == SC_SUCCESS && n > 0)
+		memcpy(resp, gpriv->buf, n);
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	if (r == SC_SUCCESS && rlen)
+		*rlen = n;
+	return r;
+}
+
+/* A request whose answer is read with the next one, see net_reply() */
+static int net_request_deferred(sc_context_t *ctx, unsigned int type, unsigned int index)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+	int r;
+
+	sc_mutex_lock(ctx, gpriv->mutex);
+	r = net_send(gpriv, type, index, NULL, 0);
+	if (r == SC_SUCCESS)
+		gpriv->deferred++;
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	return r;
+}
+
+static int net_set_atr(sc_reader_t *reader, const u8 *data, size_t len)
+{
+	if (len < 1 || data[0] > len - 1 || data[0] > SC_MAX_ATR_SIZE)
+		return SC_ERROR_TRANSMIT_FAILED;
+	memcpy(reader->atr.value, data + 1, data[0]);
+	reader->atr.len = data[0];
+	return SC_SUCCESS;
+}
+
+static void net_set_status(sc_reader_t *reader, u8 status)
+{
+	if (status & NET_ST_PRESENT)
+		reader->flags |= SC_READER_CARD_PRESENT;
+	else
+		reader->flags &= ~SC_READER_CARD_PRESENT;
+	if (status & NET_ST_CHANGED)
+		reader->flags |= SC_READER_CARD_CHANGED;
+}
+
+static int net_detect_card_presence(sc_reader_t *reader)
+{
+	struct net_private_data *priv = GET_PRIV(reader);
+	u8 resp[2 + SC_MAX_ATR_SIZE];
+	size_t len;
+	int r;
+
+	if (priv->status_valid) {
+		priv->status_valid = 0;
+		net_set_status(reader, priv->status);
+		return reader->flags;
+	}
+	r = net_request(reader->ctx, NET_STATUS, priv->index, NULL, 0, resp, sizeof(resp), &len);
+	if (r != SC_SUCCESS)
+		return r;
+	if (len < 1)
+		return SC_ERROR_TRANSMIT_FAILED;
+	net_set_status(reader, resp[0]);
+	if ((reader->flags & SC_READER_CARD_PRESENT) && net_set_atr(reader, resp + 1, len - 1) != SC_SUCCESS)
+		reader->atr.len = 0;
+	return reader->flags;
+}
+
+/* The status of all readers with one round trip */
+static int net_refresh_readers(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+	unsigned int i, num = sc_ctx_get_reader_count(ctx), sent = 0;
+	size_t len;
+	u8 *p;
+	int r = SC_SUCCESS;
+
+	if (num == 0)
+		return SC_SUCCESS;
+	sc_mutex_lock(ctx, gpriv->mutex);
+	if (gpriv->fd < 0) {
+		sc_mutex_unlock(ctx, gpriv->mutex);
+		return SC_ERROR_READER_DETACHED;
+	}
+	p = gpriv->buf;
+	for (i = 0; i < num && i < NET_MAX_DATA / NET_HEADER_SIZE; i++)
+		p += net_put_header(p, NET_STATUS, GET_PRIV(sc_ctx_get_reader(ctx, i))->index, 0);
+	r = net_write_all(gpriv->fd, gpriv->buf, p - gpriv->buf);
+	if (r != SC_SUCCESS)
+		net_drop(gpriv);
+	else
+		sent = i;
+	for (i = 0; i < sent; i++) {
+		struct net_private_data *priv = GET_PRIV(sc_ctx_get_reader(ctx, i));
+		int rv = net_reply(ctx, gpriv, NET_STATUS, gpriv->buf, sizeof(gpriv->buf), &len);
+
+		if (rv == SC_SUCCESS && len >= 1) {
+			priv->status = gpriv->buf[0];
+			priv->status_valid = 1;
+		}
+		else if (gpriv->fd < 0) {
+			r = rv;
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	return r;
+}
+
+static int net_detect_readers(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+	size_t len, pos, n;
+	unsigned int i, count;
+	u8 *names;
+	int r;
+
+	if (gpriv == NULL || gpriv->server == NULL)
+		return SC_ERROR_NO_READERS_FOUND;
+	sc_mutex_lock(ctx, gpriv->mutex);
+	if (gpriv->fd < 0)
+		gpriv->fd = net_open(ctx, gpriv->server, gpriv->allow_remote);
+	r = gpriv->fd < 0 ? SC_ERROR_NO_READERS_FOUND : SC_SUCCESS;
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	if (r != SC_SUCCESS)
+		return r;
+	names = malloc(NET_MAX_DATA);
+	if (names == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = net_request(ctx, NET_LIST, 0, NULL, 0, names, NET_MAX_DATA, &len);
+	if (r != SC_SUCCESS) {
+		free(names);
+		return r;
+	}
+
+	count = len ? names[0] : 0;
+	for (i = 0, pos = 1; i < count && pos < len; i++, pos += n) {
+		sc_reader_t *reader;
+		struct net_private_data *priv;
+		char *name;
+		unsigned int j;
+
+		n = names[pos++];
+		if (pos + n > len)
+			break;
+		name = malloc(n + 1);
+		if (name == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		memcpy(name, names + pos, n);
+		name[n] = '\0';
+		for (j = 0; j < sc_ctx_get_reader_count(ctx); j++)
+			if (!strcmp(sc_ctx_get_reader(ctx, j)->name, name))
+				break;
+		if (j < sc_ctx_get_reader_count(ctx)) {
+			/* known already */
+			free(name);
+			continue;
+		}
+
+		reader = calloc(1, sizeof(sc_reader_t));
+		priv = calloc(1, sizeof(struct net_private_data));
+		if (reader == NULL || priv == NULL) {
+			free(reader);
+			free(priv);
+			free(name);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		priv->index = i;
+		reader->drv_data = priv;
+		reader->driver = &net_drv;
+		reader->ops = &net_ops;
+		reader->name = name;
+		reader->supported_protocols = SC_PROTO_T0 | SC_PROTO_T1;
+		r = _sc_add_reader(ctx, reader);
+		if (r != SC_SUCCESS) {
+			free(priv);
+			free(name);
+			free(reader);
+			break;
+		}
+		sc_log(ctx, "card farm reader '%s'", name);
+	}
+	free(names);
+	return r;
+}
+
+static int net_connect(sc_reader_t *reader)
+{
+	u8 resp[2 + SC_MAX_ATR_SIZE];
+	size_t len;
+	int r;
+
+	r = net_request(reader->ctx, NET_CONNECT, GET_PRIV(reader)->index, NULL, 0,
+			resp, sizeof(resp), &len);
+	if (r != SC_SUCCESS)
+		return r;
+	if (len < 1 || net_set_atr(reader, resp + 1, len - 1) != SC_SUCCESS)
+		return SC_ERROR_TRANSMIT_FAILED;
+	reader->active_protocol = resp[0];
+	return _sc_parse_atr(reader) < 0 ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int net_disconnect(sc_reader_t *reader)
+{
+	return net_request(reader->ctx, NET_DISCONNECT, GET_PRIV(reader)->index, NULL, 0, NULL, 0, NULL);
+}
+
+static int net_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	u8 cold = do_cold_reset ? 1 : 0, resp[2 + SC_MAX_ATR_SIZE];
+	size_t len;
+	int r;
+
+	r = net_request(reader->ctx, NET_RESET, GET_PRIV(reader)->index, &cold, 1,
+			resp, sizeof(resp), &len);
+	if (r != SC_SUCCESS)
+		return r;
+	if (len < 1 || net_set_atr(reader, resp + 1, len - 1) != SC_SUCCESS)
+		return SC_ERROR_TRANSMIT_FAILED;
+	reader->active_protocol = resp[0];
+	return _sc_parse_atr(reader) < 0 ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int net_lock(sc_reader_t *reader)
+{
+	return net_request_deferred(reader->ctx, NET_BEGIN, GET_PRIV(reader)->index);
+}
+
+static int net_unlock(sc_reader_t *reader)
+{
+	return net_request_deferred(reader->ctx, NET_END, GET_PRIV(reader)->index);
+}
+
+static int net_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(reader->ctx);
+	sc_context_t *ctx = reader->ctx;
+	size_t len;
+	int r;
+
+	sc_mutex_lock(ctx, gpriv->mutex);
+	if (gpriv->fd < 0) {
+		r = SC_ERROR_READER_DETACHED;
+		goto out;
+	}
+	r = sc_apdu_get_octets_buf(ctx, apdu, gpriv->buf + NET_HEADER_SIZE, NET_MAX_DATA,
+			&len, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(ctx, SC_LOG_DEBUG_NORMAL, gpriv->buf + NET_HEADER_SIZE, len, 1);
+	net_put_header(gpriv->buf, NET_TRANSMIT, GET_PRIV(reader)->index, len);
+	r = net_write_all(gpriv->fd, gpriv->buf, NET_HEADER_SIZE + len);
+	sc_mem_clear(gpriv->buf, NET_HEADER_SIZE + len);
+	if (r != SC_SUCCESS) {
+		net_drop(gpriv);
+		goto out;
+	}
+
+	r = net_reply(ctx, gpriv, NET_TRANSMIT, gpriv->buf, sizeof(gpriv->buf), &len);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(ctx, SC_LOG_DEBUG_NORMAL, gpriv->buf, len, 0);
+	r = sc_apdu_set_resp(ctx, apdu, gpriv->buf, len);
+	sc_mem_clear(gpriv->buf, len);
+out:
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	return r;
+}
+
+/* All APDUs in one write, then their answers */
+static int net_transmit_batch(sc_reader_t *reader, sc_apdu_t *apdus, size_t count)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(reader->ctx);
+	sc_context_t *ctx = reader->ctx;
+	u8 *out, *p;
+	size_t i, len, size = 0;
+	int r = SC_SUCCESS;
+
+	/* header, CLA INS P1 P2, extended Lc and Le */
+	for (i = 0; i < count; i++)
+		size += NET_HEADER_SIZE + 4 + 3 + apdus[i].datalen + 3;
+	out = malloc(size);
+	if (out == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	p = out;
+	for (i = 0; i < count && r == SC_SUCCESS; i++) {
+		r = sc_apdu_get_octets_buf(ctx, &apdus[i], p + NET_HEADER_SIZE,
+				out + size - p - NET_HEADER_SIZE, &len, SC_PROTO_RAW);
+		if (r == SC_SUCCESS) {
+			sc_apdu_log(ctx, SC_LOG_DEBUG_NORMAL, p + NET_HEADER_SIZE, len, 1);
+			p += net_put_header(p, NET_TRANSMIT, GET_PRIV(reader)->index, len) + len;
+		}
+	}
+	if (r != SC_SUCCESS)
+		goto out;
+
+	sc_mutex_lock(ctx, gpriv->mutex);
+	if (gpriv->fd < 0)
+		r = SC_ERROR_READER_DETACHED;
+	else
+		r = net_write_all(gpriv->fd, out, p - out);
+	if (r != SC_SUCCESS) {
+		net_drop(gpriv);
+		sc_mutex_unlock(ctx, gpriv->mutex);
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		r = net_reply(ctx, gpriv, NET_TRANSMIT, gpriv->buf, sizeof(gpriv->buf), &len);
+		if (r == SC_SUCCESS) {
+			sc_apdu_log(ctx, SC_LOG_DEBUG_NORMAL, gpriv->buf, len, 0);
+			r = sc_apdu_set_resp(ctx, &apdus[i], gpriv->buf, len);
+			sc_mem_clear(gpriv->buf, len);
+		}
+		if (r != SC_SUCCESS && gpriv->fd >= 0) {
+			/* keep in step: the other answers still come */
+			size_t j;
+
+			for (j = i + 1; j < count; j++)
+				if (net_reply(ctx, gpriv, NET_TRANSMIT, gpriv->buf, sizeof(gpriv->buf), &len) != SC_SUCCESS
+						&& gpriv->fd < 0)
+					break;
+			break;
+		}
+		if (r != SC_SUCCESS)
+			break;
+	}
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	if (i > 0)
+		r = (int) i;
+out:
+	sc_mem_clear(out, p - out);
+	free(out);
+	return r;
+}
+
+static int net_wait_for_event(sc_context_t *ctx, unsigned int event_mask,
+		sc_reader_t **event_reader, unsigned int *event,
+		int timeout, void **reader_states)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+	u8 hdr[NET_HEADER_SIZE], data[2 + SC_MAX_ATR_SIZE];
+	struct pollfd pfd;
+	unsigned int type, index, i;
+	size_t len;
+	int r;
+
+	if (!event_reader && !event && reader_states) {
+		/* done waiting */
+		if (gpriv->event_fd >= 0)
+			close(gpriv->event_fd);
+		gpriv->event_fd = -1;
+		*reader_states = NULL;
+		return SC_SUCCESS;
+	}
+
+	if (gpriv->event_fd < 0) {
+		gpriv->event_fd = net_open(ctx, gpriv->server, gpriv->allow_remote);
+		if (gpriv->event_fd < 0)
+			return SC_ERROR_READER_DETACHED;
+		net_put_header(hdr, NET_WATCH, 0, 0);
+		if (net_write_all(gpriv->event_fd, hdr, sizeof(hdr)) != SC_SUCCESS) {
+			close(gpriv->event_fd);
+			gpriv->event_fd = -1;
+			return SC_ERROR_READER_DETACHED;
+		}
+		for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+			sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+			GET_PRIV(reader)->present = (reader->flags & SC_READER_CARD_PRESENT) != 0;
+		}
+	}
+
+	for (;;) {
+		pfd.fd = gpriv->event_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		r = poll(&pfd, 1, timeout);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0)
+			return SC_ERROR_EVENT_TIMEOUT;
+
+		r = r < 0 ? SC_ERROR_READER_DETACHED
+			: net_read_frame(gpriv->event_fd, &type, &index, data, sizeof(data), &len);
+		if (r != SC_SUCCESS) {
+			close(gpriv->event_fd);
+			gpriv->event_fd = -1;
+			return SC_ERROR_READER_DETACHED;
+		}
+		if (type != NET_EVENT || len < 1)
+			continue;
+
+		for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+			sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+			struct net_private_data *priv = GET_PRIV(reader);
+			int present = (data[0] & NET_ST_PRESENT) != 0;
+			unsigned int ev;
+
+			if (priv->index != index)
+				continue;
+			if (present == priv->present && !(data[0] & NET_ST_CHANGED))
+				break;
+			ev = present ? SC_EVENT_CARD_INSERTED : SC_EVENT_CARD_REMOVED;
+			if (present && priv->present)
+				/* another card, without the time to see it removed */
+				ev = SC_EVENT_CARD_REMOVED | SC_EVENT_CARD_INSERTED;
+			priv->present = present;
+			net_set_status(reader, data[0]);
+			if (!(ev & event_mask))
+				break;
+			if (event_reader)
+				*event_reader = reader;
+			if (event)
+				*event = ev & event_mask;
+			return SC_SUCCESS;
+		}
+	}
+}
+
+static int net_release(sc_reader_t *reader)
+{
+	free(reader->drv_data);
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+/* The server knows the transactions by connection: the child gets its own */
+static int net_forked(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+
+	if (gpriv == NULL)
+		return SC_ERROR_NO_READERS_FOUND;
+	/* closing only drops the child's reference, the parent keeps them */
+	if (gpriv->fd >= 0)
+		close(gpriv->fd);
+	if (gpriv->event_fd >= 0)
+		close(gpriv->event_fd);
+	gpriv->event_fd = -1;
+	gpriv->deferred = 0;
+	gpriv->deferred_error = 0;
+	/* the parent's threads are gone, start with a fresh mutex */
+	if (gpriv->mutex != NULL)
+		sc_mutex_destroy(ctx, gpriv->mutex);
+	gpriv->mutex = NULL;
+	sc_mutex_create(ctx, &gpriv->mutex);
+	gpriv->fd = gpriv->server ? net_open(ctx, gpriv->server, gpriv->allow_remote) : -1;
+	return gpriv->fd < 0 ? SC_ERROR_NO_READERS_FOUND : SC_SUCCESS;
+}
+
+static int net_finish(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv = GET_GPRIV(ctx);
+
+	if (gpriv == NULL)
+		return SC_SUCCESS;
+	if (gpriv->fd >= 0)
+		close(gpriv->fd);
+	if (gpriv->event_fd >= 0)
+		close(gpriv->event_fd);
+	sc_mutex_destroy(ctx, gpriv->mutex);
+	sc_mem_clear(gpriv->buf, sizeof(gpriv->buf));
+	free(gpriv->server);
+	free(gpriv);
+	ctx->reader_drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int net_init(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv;
+	scconf_block *conf_block;
+	const char *server;
+
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	gpriv->fd = -1;
+	gpriv->event_fd = -1;
+	ctx->reader_drv_data = gpriv;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "net", 1);
+	server = scconf_get_str(conf_block, "server", NULL);
+	if (getenv("OPENSC_NET_READER") != NULL)
+		server = getenv("OPENSC_NET_READER");
+	if (server == NULL) {
+		sc_log(ctx, "no card farm server configured");
+		return SC_SUCCESS;
+	}
+	gpriv->server = strdup(server);
+	if (gpriv->server == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	gpriv->allow_remote = scconf_get_bool(conf_block, "allow_remote", 0);
+	sc_mutex_create(ctx, &gpriv->mutex);
+
+	/* an unreachable server leaves the context without readers */
+	gpriv->fd = net_open(ctx, gpriv->server, gpriv->allow_remote);
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver * sc_get_net_driver(void)
+{
+	net_ops.init = net_init;
+	net_ops.finish = net_finish;
+	net_ops.detect_readers = net_detect_readers;
+	net_ops.transmit = net_transmit;
+	net_ops.detect_card_presence = net_detect_card_presence;
+	net_ops.lock = net_lock;
+	net_ops.unlock = net_unlock;
+	net_ops.release = net_release;
+	net_ops.connect = net_connect;
+	net_ops.disconnect = net_disconnect;
+	net_ops.reset = net_reset;
+	net_ops.perform_verify = NULL;
+	net_ops.perform_pace = NULL;
+	net_ops.use_reader = NULL;
+	net_ops.wait_for_event = net_wait_for_event;
+	net_ops.transmit_batch = net_transmit_batch;
+	net_ops.refresh_readers = net_refresh_readers;
+	net_ops.forked = net_forked;
+
+	return &net_drv;
+}
+
+#endif	/* _WIN32 */
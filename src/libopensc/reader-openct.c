@@ -33,6 +33,7 @@ static int openct_reader_detect_card_presence(sc_reader_t *reader);
 static int openct_reader_connect(sc_reader_t *reader);
 static int openct_reader_disconnect(sc_reader_t *reader);
 static int openct_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu);
+static int openct_reader_transmit_batch(sc_reader_t *reader, sc_apdu_t *apdus, size_t count);
 static int openct_reader_perform_verify(sc_reader_t *reader, struct sc_pin_cmd_data *info);
 static int openct_reader_lock(sc_reader_t *reader);
 static int openct_reader_unlock(sc_reader_t *reader);
@@ -182,7 +183,7 @@ static int openct_reader_detect_card_presence(sc_reader_t *reader)
 	if (status & IFD_CARD_PRESENT) {
 		reader->flags = SC_READER_CARD_PRESENT;
 		if (status & IFD_CARD_STATUS_CHANGED)
-			reader->flags = SC_READER_CARD_PRESENT;
+			reader->flags |= SC_READER_CARD_CHANGED;
 	}
 	return reader->flags;
 }
@@ -314,6 +315,57 @@ out:
 	return r;
 }
 
+/*
+ * The APDUs of a batch share the buffers, sized for the largest
+ */
+static int openct_reader_transmit_batch(sc_reader_t *reader, sc_apdu_t *apdus, size_t count)
+{
+	size_t       i, ssize, rsize, sbuflen = 0, rbuflen = 0;
+	u8           *sbuf = NULL, *rbuf = NULL;
+	int          r = SC_SUCCESS;
+
+	for (i = 0; i < count; i++) {
+		/* CLA INS P1 P2, extended Lc and Le */
+		if (4 + 3 + apdus[i].datalen + 3 > sbuflen)
+			sbuflen = 4 + 3 + apdus[i].datalen + 3;
+		if (apdus[i].resplen + 2 > rbuflen)
+			rbuflen = apdus[i].resplen + 2;
+	}
+	sbuf = malloc(sbuflen);
+	rbuf = malloc(rbuflen);
+	if (sbuf == NULL || rbuf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		r = sc_apdu_get_octets_buf(reader->ctx, &apdus[i], sbuf, sbuflen,
+				&ssize, SC_PROTO_RAW);
+		if (r != SC_SUCCESS)
+			break;
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+		rsize = apdus[i].resplen + 2;
+		r = openct_reader_internal_transmit(reader, sbuf, ssize,
+				rbuf, &rsize, apdus[i].control);
+		sc_mem_clear(sbuf, ssize);
+		if (r < 0) {
+			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
+			break;
+		}
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+		r = sc_apdu_set_resp(reader->ctx, &apdus[i], rbuf, rsize);
+		sc_mem_clear(rbuf, rsize);
+		if (r != SC_SUCCESS)
+			break;
+	}
+	/* the APDUs not sent are left to the caller */
+	if (i > 0)
+		r = (int) i;
+out:
+	free(sbuf);
+	free(rbuf);
+	return r;
+}
+
 static int openct_reader_perform_verify(sc_reader_t *reader, struct sc_pin_cmd_data *info)
 {
 	struct driver_data *data = (struct driver_data *) reader->drv_data;
@@ -452,6 +504,9 @@ struct sc_reader_driver *sc_get_openct_driver(void)
 	openct_ops.lock = openct_reader_lock;
 	openct_ops.unlock = openct_reader_unlock;
 	openct_ops.use_reader = NULL;
+	openct_ops.transmit_batch = openct_reader_transmit_batch;
+	/* OpenCT has no card event notification */
+	openct_ops.wait_for_event = _sc_poll_for_event;
 
 	return &openct_reader_driver;
 }
@@ -32,12 +32,18 @@
 #else
 #include <arpa/inet.h>
 #endif
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#include <sys/time.h>
+#define PCSC_HOLD_TRANSACTIONS
+#endif
 
 #include "common/libscdl.h"
 #include "internal.h"
 #include "internal-winscard.h"
 
 #include "pace.h"
+#include "probes.h"
 
 /* Logging */
 #define PCSC_TRACE(reader, desc, rv) do { sc_log(reader->ctx, "%s:" desc ": 0x%08lx\n", reader->name, rv); } while (0)
@@ -48,15 +54,42 @@
 
 #define GET_PRIV_DATA(r) ((struct pcsc_private_data *) (r)->drv_data)
 
+/* large enough for any extended APDU and for its response */
+#define PCSC_APDU_BUFFER_SIZE	(SC_MAX_EXT_APDU_BUFFER_SIZE + 8)
+
 struct pcsc_global_private_data {
 	SCARDCONTEXT pcsc_ctx;
-	SCARDCONTEXT pcsc_wait_ctx;
+	/* callers blocked in pcsc_wait_for_event(), protected by ctx->mutex */
+	struct pcsc_waiter *waiters;
 	int enable_pinpad;
 	int enable_pace;
 	int connect_exclusive;
+	int keep_connection;
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
+	/* keep a transaction this many ms after the last sc_unlock() */
+	int transaction_hold_time;
+	/* give up on an APDU after this many ms, 0 to wait for ever */
+	int transmit_timeout;
+	/* readers whose card stays connected and powered keep_warm_time ms
+	 * after the last disconnect, NULL if none */
+	const scconf_list *keep_warm_readers;
+	int keep_warm_time;
+#ifdef PCSC_HOLD_TRANSACTIONS
+	/* held transactions, ended by pcsc_hold_main() when they expire */
+	int hold_ready;
+	pthread_mutex_t hold_mutex;
+	pthread_cond_t hold_cond;
+	pthread_t hold_thread;
+	int hold_thread_running;
+	int hold_thread_stop;
+	struct pcsc_private_data *held;
+	/* transmits with a deadline, watched by pcsc_hold_main() */
+	struct pcsc_private_data *watched;
+	/* pooled handles of keep_warm_readers, disconnected on expiry */
+	struct pcsc_private_data *warm;
+#endif
 	const char *provider_library;
 	void *dlhandle;
 	SCardEstablishContext_t SCardEstablishContext;
@@ -74,6 +107,9 @@ struct pcsc_global_private_data {
 	SCardTransmit_t SCardTransmit;
 	SCardListReaders_t SCardListReaders;
 	SCardGetAttrib_t SCardGetAttrib;
+	/* result of the last SCardListReaders(), to skip unchanged scans */
+	char *reader_list;
+	DWORD reader_list_size;
 };
 
 struct pcsc_private_data {
@@ -94,10 +130,71 @@ struct pcsc_private_data {
 
 	DWORD get_tlv_properties;
 
+	/* send and receive buffers of pcsc_transmit(), allocated on first
+	 * use and kept, each PCSC_APDU_BUFFER_SIZE bytes */
+	u8 *apdu_buf;
+
 	int locked;
+	/* when SCardBeginTransaction() returned, for reader->stats->transaction */
+	unsigned long long transaction_start;
+	/* card handle kept open by pcsc_disconnect() for reuse */
+	int pooled;
+	/* the reader is one of keep_warm_readers */
+	int keep_warm;
+	/* reader_state was updated by pcsc_refresh_readers(), the next
+	 * pcsc_detect_card_presence() returns refresh_result without
+	 * asking pcscd again */
+	int refreshed;
+	int refresh_result;
+	/* reader features still to be queried */
+	int features_pending;
+	/* reader missing from the last SCardListReaders() */
+	int removed;
+	/* EstablishPACEChannel request (secret included) and response of the
+	 * channel open for card generation pace_generation */
+	u8 *pace_request, *pace_response;
+	size_t pace_request_len, pace_response_len;
+	unsigned int pace_generation;
+#ifdef PCSC_HOLD_TRANSACTIONS
+	/* the transaction is kept after pcsc_unlock() until held_until */
+	int held;
+	struct timespec held_until;
+	struct pcsc_private_data *hold_next;
+	/* a transmit is running until transmit_deadline; overdue once the
+	 * helper thread gave up on it */
+	sc_reader_t *reader;
+	int watched, overdue;
+	struct timespec transmit_deadline;
+	struct pcsc_private_data *watch_next;
+	/* the pooled handle is closed at warm_until */
+	int warm;
+	struct timespec warm_until;
+	struct pcsc_private_data *warm_next;
+#endif
+};
+
+/*
+ * State of one caller of pcsc_wait_for_event(), returned in *reader_states
+ * so that the reader states survive between waits. Each waiter has its
+ * own PC/SC context: with pcsc-lite a context may only be used by one
+ * thread at a time, and SCardCancel() then wakes every waiter without
+ * disturbing the others.
+ */
+struct pcsc_waiter {
+	SCARDCONTEXT pcsc_ctx;
+	SCARD_READERSTATE *states;
+	unsigned int num_watch;
+	int cancelled;
+	/* list of waiters currently blocked, see pcsc_cancel() */
+	struct pcsc_waiter *next;
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
+static int pcsc_reconnect(sc_reader_t * reader, DWORD action);
+static int pcsc_watch_transmit(sc_reader_t *reader);
+static int pcsc_unwatch_transmit(struct pcsc_private_data *priv);
+static void pcsc_pace_forget(struct pcsc_private_data *priv);
+static void pcsc_pace_close(sc_reader_t *reader);
 
 static DWORD pcsc_reset_action(const char *str)
 {
@@ -178,10 +275,15 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 	DWORD dwSendLength, dwRecvLength;
 	LONG rv;
 	SCARDHANDLE card;
+	int watched = 0;
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 	card = priv->pcsc_card;
 
+	/* another APDU is stuck in the reader, do not queue up behind it */
+	if (reader->degraded)
+		return SC_ERROR_CARD_UNRESPONSIVE;
+
 	sSendPci.dwProtocol = opensc_proto_to_pcsc(reader->active_protocol);
 	sSendPci.cbPciLength = sizeof(sSendPci);
 	sRecvPci.dwProtocol = opensc_proto_to_pcsc(reader->active_protocol);
@@ -191,8 +293,19 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 	dwRecvLength = *recvsize;
 
 	if (!control) {
+		/* only APDUs get a deadline, a PIN pad waits for the user */
+		watched = pcsc_watch_transmit(reader);
 		rv = priv->gpriv->SCardTransmit(card, &sSendPci, sendbuf, dwSendLength,
 				   &sRecvPci, recvbuf, &dwRecvLength);
+		if (watched && pcsc_unwatch_transmit(priv)) {
+			/* whatever the card did meanwhile, start it over */
+			sc_log(reader->ctx, "APDU took longer than transmit_timeout (%d ms), resetting the card",
+					priv->gpriv->transmit_timeout);
+			pcsc_reconnect(reader, SCARD_RESET_CARD);
+			reader->card_generation++;
+			reader->degraded = 0;
+			return SC_ERROR_CARD_UNRESPONSIVE;
+		}
 	} else {
 		if (priv->gpriv->SCardControlOLD != NULL) {
 			rv = priv->gpriv->SCardControlOLD(card, sendbuf, dwSendLength,
@@ -226,6 +339,7 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 	size_t       ssize, rsize, rbuflen = 0;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
@@ -236,13 +350,36 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
+
+	/* the buffers of the reader take any APDU that fits, so that
+	 * transmitting does not allocate in the steady state */
+	if (priv->apdu_buf == NULL) {
+		priv->apdu_buf = malloc(2 * PCSC_APDU_BUFFER_SIZE);
+		if (priv->apdu_buf != NULL)
+			sc_mem_account_alloc(SC_MEM_READER, 2 * PCSC_APDU_BUFFER_SIZE);
+	}
+	/* a big enough response buffer with room for SW1 SW2 is received
+	 * into directly, and sc_apdu_set_resp() has nothing to copy */
+	if ((apdu->flags & SC_APDU_FLAGS_RESP_SLACK) && apdu->resp != NULL && apdu->resplen >= 256)
+		rbuf = apdu->resp;
+	else if (priv->apdu_buf != NULL && rbuflen <= PCSC_APDU_BUFFER_SIZE)
+		rbuf = priv->apdu_buf + PCSC_APDU_BUFFER_SIZE;
+	else if ((rbuf = malloc(rbuflen)) != NULL)
+		sc_mem_account_alloc(SC_MEM_READER, rbuflen);
 	if (rbuf == NULL) {
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto out;
 	}
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	r = SC_ERROR_BUFFER_TOO_SMALL;
+	if (priv->apdu_buf != NULL)
+		r = sc_apdu_get_octets_buf(reader->ctx, apdu, priv->apdu_buf, PCSC_APDU_BUFFER_SIZE,
+				&ssize, reader->active_protocol);
+	if (r == SC_SUCCESS)
+		sbuf = priv->apdu_buf;
+	else if (r == SC_ERROR_BUFFER_TOO_SMALL
+			&& (r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol)) == SC_SUCCESS)
+		sc_mem_account_alloc(SC_MEM_READER, ssize);
 	if (r != SC_SUCCESS)
 		goto out;
 	if (reader->name)
@@ -262,25 +399,26 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 out:
 	if (sbuf != NULL) {
 		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
+		if (sbuf != priv->apdu_buf) {
+			sc_mem_account_free(SC_MEM_READER, ssize);
+			free(sbuf);
+		}
 	}
-	if (rbuf != NULL) {
+	if (rbuf != NULL && rbuf != apdu->resp) {
 		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
+		if (priv->apdu_buf == NULL || rbuf != priv->apdu_buf + PCSC_APDU_BUFFER_SIZE) {
+			sc_mem_account_free(SC_MEM_READER, rbuflen);
+			free(rbuf);
+		}
 	}
 
 	return r;
 }
 
 /* Calls SCardGetStatusChange on the reader to set ATR and associated flags (card present/changed) */
-static int refresh_attributes(sc_reader_t *reader)
+static void prepare_reader_state(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
-	int old_flags = reader->flags;
-	DWORD state, prev_state;
-	LONG rv;
-
-	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s check", reader->name);
 
 	if (priv->reader_state.szReader == NULL) {
 		priv->reader_state.szReader = reader->name;
@@ -289,8 +427,14 @@ static int refresh_attributes(sc_reader_t *reader)
 	} else {
 		priv->reader_state.dwCurrentState = priv->reader_state.dwEventState;
 	}
+}
 
-	rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
+/* Update the reader flags from the result of SCardGetStatusChange() */
+static int update_attributes(sc_reader_t *reader, LONG rv)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	int old_flags = reader->flags;
+	DWORD state, prev_state;
 
 	if (rv != SCARD_S_SUCCESS) {
 		if (rv == (LONG)SCARD_E_TIMEOUT) {
@@ -312,6 +456,8 @@ static int refresh_attributes(sc_reader_t *reader)
 		 * There can be no cards in this reader.
 		 * XXX: We'll hit it again, as no readers are removed currently.
 		 */
+		if (old_flags & SC_READER_CARD_PRESENT)
+			reader->card_generation++;
 		reader->flags &= ~(SC_READER_CARD_PRESENT);
 		return SC_ERROR_READER_DETACHED;
 	}
@@ -337,7 +483,8 @@ static int refresh_attributes(sc_reader_t *reader)
 			reader->flags |= SC_READER_CARD_EXCLUSIVE;
 
 		if (old_flags & SC_READER_CARD_PRESENT) {
-			/* Requires pcsc-lite 1.6.5+ to function properly */
+			/* The upper 16 bits are the event counter of the reader.
+			 * Requires pcsc-lite 1.6.5+ to function properly */
 			if ((state & 0xFFFF0000) != (prev_state & 0xFFFF0000)) {
 				reader->flags |= SC_READER_CARD_CHANGED;
 			} else {
@@ -357,6 +504,8 @@ static int refresh_attributes(sc_reader_t *reader)
 		if (old_flags & SC_READER_CARD_PRESENT)
 			reader->flags |= SC_READER_CARD_CHANGED;
 	}
+	if (reader->flags & SC_READER_CARD_CHANGED)
+		reader->card_generation++;
 	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "card %s%s",
 	         reader->flags & SC_READER_CARD_PRESENT ? "present" : "absent",
 	         reader->flags & SC_READER_CARD_CHANGED ? ", changed": "");
@@ -364,12 +513,95 @@ static int refresh_attributes(sc_reader_t *reader)
 	return SC_SUCCESS;
 }
 
+static int refresh_attributes(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	LONG rv;
+
+	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s check", reader->name);
+
+	priv->refreshed = 0;
+	prepare_reader_state(reader);
+	rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
+	return update_attributes(reader, rv);
+}
+
+/*
+ * Query the state of all readers with a single SCardGetStatusChange()
+ * instead of one call per reader. The result is kept for the next
+ * sc_detect_card_presence() on each reader.
+ */
+static int pcsc_refresh_readers(sc_context_t *ctx)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	SCARD_READERSTATE *states;
+	sc_reader_t **readers;
+	size_t i, count = 0, num = sc_ctx_get_reader_count(ctx);
+	LONG rv;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+
+	if (!gpriv || gpriv->pcsc_ctx == -1)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_NO_READERS_FOUND);
+	if (num == 0)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
+
+	states = calloc(num, sizeof(SCARD_READERSTATE));
+	readers = calloc(num, sizeof(sc_reader_t *));
+	if (!states || !readers) {
+		free(states);
+		free(readers);
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+	}
+
+	for (i = 0; i < num; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (!reader || reader->driver != ctx->reader_driver || !reader->drv_data)
+			continue;
+		prepare_reader_state(reader);
+		states[count] = GET_PRIV_DATA(reader)->reader_state;
+		readers[count++] = reader;
+	}
+
+	if (count == 0)
+		rv = SCARD_E_TIMEOUT;
+	else
+		rv = gpriv->SCardGetStatusChange(gpriv->pcsc_ctx, 0, states, count);
+	if (rv != SCARD_S_SUCCESS && rv != (LONG)SCARD_E_TIMEOUT) {
+		/* Each reader is then queried on its own */
+		PCSC_LOG(ctx, "SCardGetStatusChange(all) failed", rv);
+		free(states);
+		free(readers);
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, pcsc_to_opensc_error(rv));
+	}
+
+	for (i = 0; i < count; i++) {
+		struct pcsc_private_data *priv = GET_PRIV_DATA(readers[i]);
+
+		if (rv == SCARD_S_SUCCESS)
+			priv->reader_state = states[i];
+		priv->refresh_result = update_attributes(readers[i], rv);
+		priv->refreshed = 1;
+	}
+
+	free(states);
+	free(readers);
+	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
+}
+
 static int pcsc_detect_card_presence(sc_reader_t *reader)
 {
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 	int rv;
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
-	rv = refresh_attributes(reader);
+	if (priv->refreshed) {
+		priv->refreshed = 0;
+		rv = priv->refresh_result;
+	} else {
+		rv = refresh_attributes(reader);
+	}
 	if (rv != SC_SUCCESS)
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, rv);
 	SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, reader->flags);
@@ -402,6 +634,360 @@ static int check_forced_protocol(sc_context_t *ctx, struct sc_atr *atr, DWORD *p
 }
 
 
+#ifdef PCSC_HOLD_TRANSACTIONS
+/*
+ * Lazy transaction release: pcsc_unlock() keeps the transaction and the
+ * next pcsc_lock() of this process takes it over without another
+ * SCardBeginTransaction()/SCardEndTransaction() pair. A helper thread
+ * ends transactions that were not taken over within
+ * transaction_hold_time, so other applications wait at most that long.
+ *
+ * The same thread watches the APDUs sent with a transmit_timeout. When
+ * one is overdue, the reader is marked degraded so that the other
+ * callers fail at once instead of waiting for it, and SCardCancel() is
+ * tried on the context. The stuck caller resets the card once
+ * SCardTransmit() returns.
+ */
+static int pcsc_timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Now plus ms milliseconds */
+static void pcsc_timespec_after(struct timespec *ts, int ms)
+{
+	struct timeval tv;
+	long usec;
+
+	gettimeofday(&tv, NULL);
+	usec = tv.tv_usec + (ms % 1000) * 1000L;
+	ts->tv_sec = tv.tv_sec + ms / 1000 + usec / 1000000;
+	ts->tv_nsec = (usec % 1000000) * 1000;
+}
+
+static void *pcsc_hold_main(void *arg)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) arg;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	while (!gpriv->hold_thread_stop) {
+		struct pcsc_private_data **pp, *priv;
+		struct timespec now, *next_expiry = NULL;
+		int cancel = 0;
+
+		pcsc_timespec_after(&now, 0);
+
+		for (pp = &gpriv->held; *pp; ) {
+			priv = *pp;
+
+			if (!pcsc_timespec_before(&now, &priv->held_until)) {
+				*pp = priv->hold_next;
+				priv->held = 0;
+				priv->locked = 0;
+				gpriv->SCardEndTransaction(priv->pcsc_card, gpriv->transaction_end_action);
+				sc_lock_stats_release(&priv->reader->stats->transaction, priv->transaction_start);
+				continue;
+			}
+			if (!next_expiry || pcsc_timespec_before(&priv->held_until, next_expiry))
+				next_expiry = &priv->held_until;
+			pp = &priv->hold_next;
+		}
+
+		for (priv = gpriv->watched; priv; priv = priv->watch_next) {
+			if (priv->overdue)
+				continue;
+			if (!pcsc_timespec_before(&now, &priv->transmit_deadline)) {
+				priv->overdue = 1;
+				priv->reader->degraded = 1;
+				cancel = 1;
+				continue;
+			}
+			if (!next_expiry || pcsc_timespec_before(&priv->transmit_deadline, next_expiry))
+				next_expiry = &priv->transmit_deadline;
+		}
+		if (cancel)
+			gpriv->SCardCancel(gpriv->pcsc_ctx);
+
+		for (pp = &gpriv->warm; *pp; ) {
+			priv = *pp;
+
+			if (!pcsc_timespec_before(&now, &priv->warm_until)) {
+				/* idle for the whole window: let the card power down */
+				*pp = priv->warm_next;
+				priv->warm = 0;
+				priv->pooled = 0;
+				gpriv->SCardDisconnect(priv->pcsc_card, gpriv->disconnect_action);
+				continue;
+			}
+			if (!next_expiry || pcsc_timespec_before(&priv->warm_until, next_expiry))
+				next_expiry = &priv->warm_until;
+			pp = &priv->warm_next;
+		}
+
+		if (next_expiry)
+			pthread_cond_timedwait(&gpriv->hold_cond, &gpriv->hold_mutex, next_expiry);
+		else
+			pthread_cond_wait(&gpriv->hold_cond, &gpriv->hold_mutex);
+	}
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+	return NULL;
+}
+
+/* Start the helper thread, called with hold_mutex held */
+static int pcsc_hold_start(struct pcsc_global_private_data *gpriv)
+{
+	if (!gpriv->hold_thread_running) {
+		if (pthread_create(&gpriv->hold_thread, NULL, pcsc_hold_main, gpriv) != 0)
+			return 0;
+		gpriv->hold_thread_running = 1;
+	}
+	return 1;
+}
+
+/* Keep the transaction of the reader for a while instead of ending it */
+static int pcsc_hold_transaction(struct pcsc_private_data *priv)
+{
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+
+	if (!gpriv->hold_ready || !priv->locked || gpriv->transaction_hold_time <= 0)
+		return 0;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	if (!pcsc_hold_start(gpriv)) {
+		pthread_mutex_unlock(&gpriv->hold_mutex);
+		return 0;
+	}
+
+	pcsc_timespec_after(&priv->held_until, gpriv->transaction_hold_time);
+	if (!priv->held) {
+		priv->held = 1;
+		priv->hold_next = gpriv->held;
+		gpriv->held = priv;
+	}
+	pthread_cond_signal(&gpriv->hold_cond);
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+	return 1;
+}
+
+/* Take a held transaction back from the helper thread. Returns 1 if it
+ * was still held, the transaction is then ours again. */
+static int pcsc_take_transaction(struct pcsc_private_data *priv)
+{
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	struct pcsc_private_data **pp;
+	int held;
+
+	if (!gpriv->hold_ready)
+		return 0;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	held = priv->held;
+	if (held) {
+		for (pp = &gpriv->held; *pp; pp = &(*pp)->hold_next)
+			if (*pp == priv) {
+				*pp = priv->hold_next;
+				break;
+			}
+		priv->held = 0;
+	}
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+	return held;
+}
+
+/* Have the helper thread watch the APDU about to be sent. Returns 1 if
+ * it does, pcsc_unwatch_transmit() must then follow. */
+static int pcsc_watch_transmit(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+
+	if (!gpriv->hold_ready || gpriv->transmit_timeout <= 0)
+		return 0;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	if (!pcsc_hold_start(gpriv)) {
+		pthread_mutex_unlock(&gpriv->hold_mutex);
+		return 0;
+	}
+	pcsc_timespec_after(&priv->transmit_deadline, gpriv->transmit_timeout);
+	priv->reader = reader;
+	priv->overdue = 0;
+	priv->watched = 1;
+	priv->watch_next = gpriv->watched;
+	gpriv->watched = priv;
+	pthread_cond_signal(&gpriv->hold_cond);
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+	return 1;
+}
+
+/* Returns 1 if the APDU was overdue */
+static int pcsc_unwatch_transmit(struct pcsc_private_data *priv)
+{
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	struct pcsc_private_data **pp;
+	int overdue;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	for (pp = &gpriv->watched; *pp; pp = &(*pp)->watch_next)
+		if (*pp == priv) {
+			*pp = priv->watch_next;
+			break;
+		}
+	priv->watched = 0;
+	overdue = priv->overdue;
+	priv->overdue = 0;
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+	return overdue;
+}
+
+/* Keep the pooled handle of a keep_warm_readers reader keep_warm_time
+ * ms. Returns 0 if the helper thread is not available. */
+static int pcsc_keep_warm(struct pcsc_private_data *priv)
+{
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+
+	if (!gpriv->hold_ready || gpriv->keep_warm_time <= 0)
+		return 0;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	if (!pcsc_hold_start(gpriv)) {
+		pthread_mutex_unlock(&gpriv->hold_mutex);
+		return 0;
+	}
+	pcsc_timespec_after(&priv->warm_until, gpriv->keep_warm_time);
+	if (!priv->warm) {
+		priv->warm = 1;
+		priv->warm_next = gpriv->warm;
+		gpriv->warm = priv;
+	}
+	pthread_cond_signal(&gpriv->hold_cond);
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+	return 1;
+}
+
+/* Take a warm handle back from the helper thread, priv->pooled tells
+ * whether it was still open */
+static void pcsc_take_warm(struct pcsc_private_data *priv)
+{
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	struct pcsc_private_data **pp;
+
+	if (!gpriv->hold_ready)
+		return;
+
+	pthread_mutex_lock(&gpriv->hold_mutex);
+	if (priv->warm) {
+		for (pp = &gpriv->warm; *pp; pp = &(*pp)->warm_next)
+			if (*pp == priv) {
+				*pp = priv->warm_next;
+				break;
+			}
+		priv->warm = 0;
+	}
+	pthread_mutex_unlock(&gpriv->hold_mutex);
+}
+
+static void pcsc_hold_finish(struct pcsc_global_private_data *gpriv)
+{
+	if (!gpriv->hold_ready)
+		return;
+
+	if (gpriv->hold_thread_running) {
+		pthread_mutex_lock(&gpriv->hold_mutex);
+		gpriv->hold_thread_stop = 1;
+		pthread_cond_signal(&gpriv->hold_cond);
+		pthread_mutex_unlock(&gpriv->hold_mutex);
+		pthread_join(gpriv->hold_thread, NULL);
+	}
+	pthread_cond_destroy(&gpriv->hold_cond);
+	pthread_mutex_destroy(&gpriv->hold_mutex);
+	gpriv->hold_ready = 0;
+}
+#else
+static int pcsc_hold_transaction(struct pcsc_private_data *priv)
+{
+	return 0;
+}
+
+static int pcsc_take_transaction(struct pcsc_private_data *priv)
+{
+	return 0;
+}
+
+static int pcsc_watch_transmit(sc_reader_t *reader)
+{
+	return 0;
+}
+
+static int pcsc_unwatch_transmit(struct pcsc_private_data *priv)
+{
+	return 0;
+}
+
+static int pcsc_keep_warm(struct pcsc_private_data *priv)
+{
+	return 0;
+}
+
+static void pcsc_take_warm(struct pcsc_private_data *priv)
+{
+}
+
+static void pcsc_hold_finish(struct pcsc_global_private_data *gpriv)
+{
+}
+#endif
+
+/* The card handles, the context and the held transactions of the
+ * parent are not ours: the child must not end, release or use them */
+static int pcsc_forked(sc_context_t *ctx)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	unsigned int i;
+	LONG rv;
+
+	if (gpriv == NULL)
+		return SC_ERROR_NO_READERS_FOUND;
+
+	gpriv->pcsc_ctx = -1;
+	gpriv->waiters = NULL;
+#ifdef PCSC_HOLD_TRANSACTIONS
+	/* the helper thread did not come along, it may have had the mutex */
+	if (gpriv->hold_ready) {
+		pthread_mutex_init(&gpriv->hold_mutex, NULL);
+		pthread_cond_init(&gpriv->hold_cond, NULL);
+	}
+	gpriv->hold_thread_running = 0;
+	gpriv->hold_thread_stop = 0;
+	gpriv->held = NULL;
+	gpriv->watched = NULL;
+	gpriv->warm = NULL;
+#endif
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+		struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+		priv->pcsc_card = 0;
+		priv->locked = 0;
+		priv->pooled = 0;
+		priv->refreshed = 0;
+#ifdef PCSC_HOLD_TRANSACTIONS
+		priv->held = 0;
+		priv->hold_next = NULL;
+		priv->warm = 0;
+		priv->warm_next = NULL;
+#endif
+	}
+
+	rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &gpriv->pcsc_ctx);
+	if (rv != SCARD_S_SUCCESS) {
+		PCSC_LOG(ctx, "SCardEstablishContext failed", rv);
+		gpriv->pcsc_ctx = -1;
+		return pcsc_to_opensc_error(rv);
+	}
+	return SC_SUCCESS;
+}
+
 static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 {
 	DWORD active_proto = opensc_proto_to_pcsc(reader->active_protocol),
@@ -424,6 +1010,7 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 		protocol = tmp;
 
 	/* reconnect always unlocks transaction */
+	pcsc_take_transaction(priv);
 	priv->locked = 0;
 
 	rv = priv->gpriv->SCardReconnect(priv->pcsc_card,
@@ -439,6 +1026,48 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 	return pcsc_to_opensc_error(rv);
 }
 
+/* Try to reattach to the card handle left open by pcsc_disconnect().
+ * The handle is only reused as long as SCardStatus() reports the same
+ * card; a card reset by another application is recovered with
+ * SCardReconnect() without resetting the card again. */
+static int pcsc_reuse_handle(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	DWORD readers_len = 0, cstate, prot, atr_len = SC_MAX_ATR_SIZE;
+	unsigned char atr[SC_MAX_ATR_SIZE];
+	LONG rv;
+	int r;
+
+	priv->pooled = 0;
+	priv->locked = 0;
+
+	rv = priv->gpriv->SCardStatus(priv->pcsc_card, NULL, &readers_len, &cstate, &prot, atr, &atr_len);
+	if (rv == SCARD_S_SUCCESS && atr_len == reader->atr.len
+			&& !memcmp(atr, reader->atr.value, atr_len)) {
+		reader->active_protocol = pcsc_proto_to_opensc(prot);
+	} else if (rv == (LONG)SCARD_W_RESET_CARD) {
+		r = pcsc_reconnect(reader, SCARD_LEAVE_CARD);
+		if (r != SC_SUCCESS)
+			goto drop;
+	} else {
+		PCSC_TRACE(reader, "SCardStatus on pooled handle", rv);
+		goto drop;
+	}
+
+	if (priv->gpriv->connect_exclusive)
+		reader->flags |= SC_READER_CONNECTED_EXCLUSIVE;
+	else
+		reader->flags &= ~SC_READER_CONNECTED_EXCLUSIVE;
+
+	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Reusing card handle, protocol: %s", reader->active_protocol == SC_PROTO_T1 ? "T=1" : "T=0");
+	return SC_SUCCESS;
+
+drop:
+	/* the card is gone or was changed: start over with a new handle */
+	priv->gpriv->SCardDisconnect(priv->pcsc_card, SCARD_LEAVE_CARD);
+	return SC_ERROR_CARD_REMOVED;
+}
+
 static int pcsc_connect(sc_reader_t *reader)
 {
 	DWORD active_proto, tmp, protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
@@ -456,6 +1085,12 @@ static int pcsc_connect(sc_reader_t *reader)
 	if (!(reader->flags & SC_READER_CARD_PRESENT))
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_CARD_NOT_PRESENT);
 
+	pcsc_take_warm(priv);
+	if (priv->pooled) {
+		r = pcsc_reuse_handle(reader);
+		if (r == SC_SUCCESS)
+			SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, r);
+	}
 
 	rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
@@ -494,6 +1129,11 @@ static int pcsc_connect(sc_reader_t *reader)
 	/* After connect reader is not locked yet */
 	priv->locked = 0;
 
+	if (priv->gpriv->connect_exclusive)
+		reader->flags |= SC_READER_CONNECTED_EXCLUSIVE;
+	else
+		reader->flags &= ~SC_READER_CONNECTED_EXCLUSIVE;
+
 	return SC_SUCCESS;
 }
 
@@ -503,7 +1143,23 @@ static int pcsc_disconnect(sc_reader_t * reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
-	priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
+	/* A held transaction ends below, with the rest */
+	pcsc_take_transaction(priv);
+	pcsc_pace_close(reader);
+	if (priv->gpriv->keep_connection || priv->keep_warm) {
+		/* keep the handle warm, the card is left as it is */
+		if (priv->locked) {
+			priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
+			sc_lock_stats_release(&reader->stats->transaction, priv->transaction_start);
+		}
+		priv->locked = 0;
+		priv->pooled = 1;
+		/* with keep_connection the handle stays until the release */
+		if (!priv->gpriv->keep_connection)
+			pcsc_keep_warm(priv);
+	} else {
+		priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
+	}
 	reader->flags = 0;
 	return SC_SUCCESS;
 }
@@ -512,10 +1168,17 @@ static int pcsc_lock(sc_reader_t *reader)
 {
 	LONG rv;
 	int r;
+	unsigned long long start;
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+	/* The transaction of the last pcsc_unlock() is still ours */
+	if (pcsc_take_transaction(priv))
+		return SC_SUCCESS;
+
+	/* waits here for the other processes using the card */
+	start = sc_lock_stats_begin();
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 	switch (rv) {
@@ -539,6 +1202,8 @@ static int pcsc_lock(sc_reader_t *reader)
 			return SC_ERROR_CARD_RESET;
 		case SCARD_S_SUCCESS:
 			priv->locked = 1;
+			priv->transaction_start = sc_lock_stats_wait(&reader->stats->transaction, start);
+			SC_PROBE1(pcsc__begin_transaction, reader->name);
 			return SC_SUCCESS;
 		default:
 			PCSC_TRACE(reader, "SCardBeginTransaction failed", rv);
@@ -553,7 +1218,13 @@ static int pcsc_unlock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+	if (pcsc_hold_transaction(priv))
+		return SC_SUCCESS;
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
+	SC_PROBE2(pcsc__end_transaction, reader->name, rv);
+	if (priv->locked)
+		sc_lock_stats_release(&reader->stats->transaction, priv->transaction_start);
 
 	priv->locked = 0;
 	if (rv != SCARD_S_SUCCESS) {
@@ -567,6 +1238,14 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	pcsc_take_transaction(priv);
+	pcsc_take_warm(priv);
+	pcsc_pace_forget(priv);
+	if (priv->pooled)
+		priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
+	if (priv->apdu_buf != NULL)
+		sc_mem_account_free(SC_MEM_READER, 2 * PCSC_APDU_BUFFER_SIZE);
+	free(priv->apdu_buf);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -591,22 +1270,27 @@ static int pcsc_reset(sc_reader_t *reader, int do_cold_reset)
 
 static int pcsc_cancel(sc_context_t *ctx)
 {
-	LONG rv = SCARD_S_SUCCESS;
+	LONG rv = SCARD_S_SUCCESS, rv2;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
+	struct pcsc_waiter *w;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
-#ifndef _WIN32
-	if (gpriv->pcsc_wait_ctx != -1) {
-		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
-		if (rv == SCARD_S_SUCCESS)
-			 /* Also close and clear the waiting context */
-			 rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
-	}
-#else
-	rv = gpriv->SCardCancel(gpriv->pcsc_ctx);
+	/* Wake up every blocked pcsc_wait_for_event(), each has its own context */
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (w = gpriv->waiters; w; w = w->next) {
+		w->cancelled = 1;
+		rv2 = gpriv->SCardCancel(w->pcsc_ctx);
+		if (rv2 != SCARD_S_SUCCESS)
+			rv = rv2;
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+#ifdef _WIN32
+	rv2 = gpriv->SCardCancel(gpriv->pcsc_ctx);
+	if (rv2 != SCARD_S_SUCCESS)
+		rv = rv2;
 #endif
 	if (rv != SCARD_S_SUCCESS) {
-		PCSC_LOG(ctx, "SCardCancel/SCardReleaseContext failed", rv);
+		PCSC_LOG(ctx, "SCardCancel failed", rv);
 		return pcsc_to_opensc_error(rv);
 	}
 	return SC_SUCCESS;
@@ -636,6 +1320,7 @@ static int pcsc_init(sc_context_t *ctx)
 
 	/* Defaults */
 	gpriv->connect_exclusive = 0;
+	gpriv->keep_connection = 0;
 	gpriv->disconnect_action = SCARD_RESET_CARD;
 	gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 	gpriv->reconnect_action = SCARD_LEAVE_CARD;
@@ -643,12 +1328,13 @@ static int pcsc_init(sc_context_t *ctx)
 	gpriv->enable_pace = 1;
 	gpriv->provider_library = DEFAULT_PCSC_PROVIDER;
 	gpriv->pcsc_ctx = -1;
-	gpriv->pcsc_wait_ctx = -1;
 
 	conf_block = sc_get_conf_block(ctx, "reader_driver", "pcsc", 1);
 	if (conf_block) {
 		gpriv->connect_exclusive =
 		    scconf_get_bool(conf_block, "connect_exclusive", gpriv->connect_exclusive);
+		gpriv->keep_connection =
+		    scconf_get_bool(conf_block, "keep_connection", gpriv->keep_connection);
 		gpriv->disconnect_action =
 		    pcsc_reset_action(scconf_get_str(conf_block, "disconnect_action", "reset"));
 		gpriv->transaction_end_action =
@@ -661,9 +1347,27 @@ static int pcsc_init(sc_context_t *ctx)
 		    scconf_get_bool(conf_block, "enable_pace", gpriv->enable_pace);
 		gpriv->provider_library =
 		    scconf_get_str(conf_block, "provider_library", gpriv->provider_library);
+		gpriv->transaction_hold_time =
+		    scconf_get_int(conf_block, "transaction_hold_time", gpriv->transaction_hold_time);
+		gpriv->transmit_timeout =
+		    scconf_get_int(conf_block, "transmit_timeout", gpriv->transmit_timeout);
+		gpriv->keep_warm_readers = scconf_find_list(conf_block, "keep_warm_readers");
+		gpriv->keep_warm_time =
+		    scconf_get_int(conf_block, "keep_warm_time", gpriv->keep_warm_time);
+	}
+	sc_log(ctx, "PC/SC options: connect_exclusive=%d keep_connection=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d transaction_hold_time=%d transmit_timeout=%d keep_warm_time=%d",
+		gpriv->connect_exclusive, gpriv->keep_connection, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace, gpriv->transaction_hold_time, gpriv->transmit_timeout, gpriv->keep_warm_time);
+
+#ifdef PCSC_HOLD_TRANSACTIONS
+	if ((gpriv->transaction_hold_time > 0 || gpriv->transmit_timeout > 0
+				|| (gpriv->keep_warm_readers && gpriv->keep_warm_time > 0))
+			&& pthread_mutex_init(&gpriv->hold_mutex, NULL) == 0) {
+		if (pthread_cond_init(&gpriv->hold_cond, NULL) == 0)
+			gpriv->hold_ready = 1;
+		else
+			pthread_mutex_destroy(&gpriv->hold_mutex);
 	}
-	sc_log(ctx, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d",
-		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace);
+#endif
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -745,10 +1449,13 @@ static int pcsc_finish(sc_context_t *ctx)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (gpriv) {
+		/* the hold thread ends its transactions in this context */
+		pcsc_hold_finish(gpriv);
 		if (gpriv->pcsc_ctx != -1)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		free(gpriv->reader_list);
 		free(gpriv);
 	}
 
@@ -935,14 +1642,82 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 	}
 }
 
+/*
+ * Query the PIN pad and PACE features of a reader. This is done once per
+ * reader; it is only retried while the card is held exclusively by
+ * another application or after the reader was unplugged.
+ */
+static void probe_reader_features(sc_reader_t *reader)
+{
+	sc_context_t *ctx = reader->ctx;
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	DWORD active_proto;
+	SCARDHANDLE card_handle;
+	LONG rv;
+
+	priv->features_pending = 0;
+	refresh_attributes(reader);
+
+	/* check for pinpad support early, to allow opensc-tool -l display accurate information */
+	if (gpriv->SCardControl == NULL)
+		return;
+	if (priv->reader_state.dwEventState & SCARD_STATE_EXCLUSIVE) {
+		priv->features_pending = 1;
+		return;
+	}
+
+	sc_log(ctx, "Requesting reader features ... ");
+
+	rv = SCARD_E_SHARING_VIOLATION;
+	/* Use DIRECT mode only if there is no card in the reader */
+	if (!(reader->flags & SC_READER_CARD_PRESENT)) {
+#ifndef _WIN32	/* Apple 10.5.7 and pcsc-lite previous to v1.5.5 do not support 0 as protocol identifier */
+		rv = gpriv->SCardConnect(gpriv->pcsc_ctx, reader->name, SCARD_SHARE_DIRECT, SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1, &card_handle, &active_proto);
+#else
+		rv = gpriv->SCardConnect(gpriv->pcsc_ctx, reader->name, SCARD_SHARE_DIRECT, 0, &card_handle, &active_proto);
+#endif
+		PCSC_TRACE(reader, "SCardConnect(DIRECT)", rv);
+	}
+	if (rv == (LONG)SCARD_E_SHARING_VIOLATION) { /* Assume that there is a card in the reader in shared mode if direct communcation failed */
+		rv = gpriv->SCardConnect(gpriv->pcsc_ctx, reader->name, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1, &card_handle, &active_proto);
+		PCSC_TRACE(reader, "SCardConnect(SHARED)", rv);
+	}
+
+	if (rv == SCARD_S_SUCCESS) {
+		detect_reader_features(reader, card_handle);
+		gpriv->SCardDisconnect(card_handle, SCARD_LEAVE_CARD);
+	}
+}
+
+/* Is name one of the strings of the SCardListReaders() multi-string? */
+static int reader_list_contains(const char *list, const char *name)
+{
+	for (; *list != '\x0'; list += strlen(list) + 1)
+		if (!strcmp(list, name))
+			return 1;
+	return 0;
+}
+
+/* Does the reader name contain one of the keep_warm_readers strings? */
+static int pcsc_is_keep_warm(struct pcsc_global_private_data *gpriv, const char *name)
+{
+	const scconf_list *item;
+
+	for (item = gpriv->keep_warm_readers; item != NULL; item = item->next)
+		if (item->data != NULL && strstr(name, item->data) != NULL)
+			return 1;
+	return 0;
+}
+
 static int pcsc_detect_readers(sc_context_t *ctx)
 {
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
-	DWORD active_proto, reader_buf_size = 0;
-	SCARDHANDLE card_handle;
+	DWORD reader_buf_size = 0;
 	LONG rv;
 	char *reader_buf = NULL, *reader_name;
 	const char *mszGroups = NULL;
+	unsigned int i;
 	int ret = SC_ERROR_INTERNAL;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
@@ -1001,25 +1776,51 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		ret = pcsc_to_opensc_error(rv);
 		goto out;
 	}
+
+	if (gpriv->reader_list != NULL && gpriv->reader_list_size == reader_buf_size
+			&& !memcmp(gpriv->reader_list, reader_buf, reader_buf_size)) {
+		/* No reader was added or removed, only finish pending feature queries */
+		sc_log(ctx, "Reader list unchanged");
+		for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+			sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+			struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+			if (priv->features_pending && !priv->removed)
+				probe_reader_features(reader);
+		}
+		ret = SC_SUCCESS;
+		goto out;
+	}
+
+	/* Readers that went away keep their sc_reader_t, mark them so their
+	 * features are queried again when they come back */
+	if (gpriv->reader_list != NULL) {
+		for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+			sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+			struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+			if (!priv->removed && !reader_list_contains(reader_buf, reader->name)) {
+				sc_log(ctx, "pcsc reader '%s' removed", reader->name);
+				priv->removed = 1;
+				priv->features_pending = 1;
+			}
+		}
+	}
+
 	for (reader_name = reader_buf; *reader_name != '\x0'; reader_name += strlen(reader_name) + 1) {
 		sc_reader_t *reader = NULL;
 		struct pcsc_private_data *priv = NULL;
-		unsigned int i;
-		int found = 0;
-
-		for (i=0;i < sc_ctx_get_reader_count(ctx) && !found;i++) {
-			sc_reader_t *reader2 = sc_ctx_get_reader(ctx, i);
-			if (reader2 == NULL) {
-				ret = SC_ERROR_INTERNAL;
-				goto err1;
-			}
-			if (!strcmp(reader2->name, reader_name)) {
-				found = 1;
-			}
-		}
 
-		/* Reader already available, skip */
-		if (found) {
+		/* Reader already available, only probe it again if it came back */
+		reader = sc_ctx_get_reader_by_name(ctx, reader_name);
+		if (reader != NULL) {
+			priv = GET_PRIV_DATA(reader);
+			if (priv->removed) {
+				sc_log(ctx, "pcsc reader '%s' is back", reader_name);
+				priv->removed = 0;
+			}
+			if (priv->features_pending)
+				probe_reader_features(reader);
 			continue;
 		}
 
@@ -1042,41 +1843,15 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 			goto err1;
 		}
 		priv->gpriv = gpriv;
+		priv->keep_warm = pcsc_is_keep_warm(gpriv, reader_name);
+		if (priv->keep_warm)
+			sc_log(ctx, "keeping the card of '%s' warm", reader_name);
 		if (_sc_add_reader(ctx, reader)) {
 			ret = SC_SUCCESS;	/* silent ignore */
 			goto err1;
 		}
 
-		refresh_attributes(reader);
-
-		/* check for pinpad support early, to allow opensc-tool -l display accurate information */
-		if (gpriv->SCardControl != NULL) {
-			if (priv->reader_state.dwEventState & SCARD_STATE_EXCLUSIVE)
-				continue;
-
-			sc_log(ctx, "Requesting reader features ... ");
-
-			rv = SCARD_E_SHARING_VIOLATION;
-			/* Use DIRECT mode only if there is no card in the reader */
-			if (!(reader->flags & SC_READER_CARD_PRESENT)) {
-#ifndef _WIN32	/* Apple 10.5.7 and pcsc-lite previous to v1.5.5 do not support 0 as protocol identifier */
-				rv = gpriv->SCardConnect(gpriv->pcsc_ctx, reader->name, SCARD_SHARE_DIRECT, SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1, &card_handle, &active_proto);
-#else
-				rv = gpriv->SCardConnect(gpriv->pcsc_ctx, reader->name, SCARD_SHARE_DIRECT, 0, &card_handle, &active_proto);
-#endif
-				PCSC_TRACE(reader, "SCardConnect(DIRECT)", rv);
-			}
-			if (rv == (LONG)SCARD_E_SHARING_VIOLATION) { /* Assume that there is a card in the reader in shared mode if direct communcation failed */
-				rv = gpriv->SCardConnect(gpriv->pcsc_ctx, reader->name, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1, &card_handle, &active_proto);
-				PCSC_TRACE(reader, "SCardConnect(SHARED)", rv);
-			}
-
-			if (rv == SCARD_S_SUCCESS) {
-				detect_reader_features(reader, card_handle);
-				gpriv->SCardDisconnect(card_handle, SCARD_LEAVE_CARD);
-			}
-		}
-
+		probe_reader_features(reader);
 		continue;
 
 	err1:
@@ -1091,6 +1866,11 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		goto out;
 	}
 
+	/* Keep the list to diff the next scan against */
+	free(gpriv->reader_list);
+	gpriv->reader_list = reader_buf;
+	gpriv->reader_list_size = reader_buf_size;
+	reader_buf = NULL;
 	ret = SC_SUCCESS;
 
 out:
@@ -1102,68 +1882,122 @@ out:
 }
 
 
+static struct pcsc_waiter *pcsc_waiter_new(sc_context_t *ctx, unsigned int event_mask)
+{
+	struct pcsc_waiter *w;
+	size_t i, num = sc_ctx_get_reader_count(ctx);
+
+	w = calloc(1, sizeof(struct pcsc_waiter));
+	if (!w)
+		return NULL;
+	w->pcsc_ctx = -1;
+	w->states = calloc(num + 2, sizeof(SCARD_READERSTATE));
+	if (!w->states) {
+		free(w);
+		return NULL;
+	}
+
+	/* Find out the current status */
+	sc_log(ctx, "Trying to watch %d readers", num);
+	for (i = 0; i < num; i++) {
+		w->states[i].szReader = sc_ctx_get_reader(ctx, i)->name;
+		w->states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+		w->states[i].dwEventState = SCARD_STATE_UNAWARE;
+	}
+#ifndef __APPLE__ /* OS X 10.6.2 does not support PnP notification */
+	if (event_mask & SC_EVENT_READER_ATTACHED) {
+		w->states[i].szReader = "\\\\?PnP?\\Notification";
+		w->states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+		w->states[i].dwEventState = SCARD_STATE_UNAWARE;
+		i++;
+	}
+#endif
+	w->num_watch = i;
+	return w;
+}
+
+static void pcsc_waiter_free(sc_context_t *ctx, struct pcsc_waiter *w)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
+
+	if (w->pcsc_ctx != -1)
+		gpriv->SCardReleaseContext(w->pcsc_ctx);
+	free(w->states);
+	free(w);
+}
+
+static void pcsc_waiter_start(sc_context_t *ctx, struct pcsc_waiter *w)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	w->cancelled = 0;
+	w->next = gpriv->waiters;
+	gpriv->waiters = w;
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+static void pcsc_waiter_end(sc_context_t *ctx, struct pcsc_waiter *w)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
+	struct pcsc_waiter **pp;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (pp = &gpriv->waiters; *pp; pp = &(*pp)->next)
+		if (*pp == w) {
+			*pp = w->next;
+			break;
+		}
+	w->next = NULL;
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
 /* Wait for an event to occur.
  */
 static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event,
 			       int timeout, void **reader_states)
 {
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
+	struct pcsc_waiter *w;
 	LONG rv;
 	SCARD_READERSTATE *rgReaderStates;
 	size_t i;
 	unsigned int num_watch;
-	int r = SC_ERROR_INTERNAL;
+	int r = SC_ERROR_INTERNAL, started = 0;
 	DWORD dwtimeout;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (!event_reader && !event && reader_states)   {
 		sc_log(ctx, "free allocated reader states");
-		free(*reader_states);
+		if (*reader_states)
+			pcsc_waiter_free(ctx, (struct pcsc_waiter *)(*reader_states));
 		*reader_states = NULL;
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
 	}
 
 	if (reader_states == NULL || *reader_states == NULL) {
-		rgReaderStates = calloc(sc_ctx_get_reader_count(ctx) + 2, sizeof(SCARD_READERSTATE));
-		if (!rgReaderStates)
+		w = pcsc_waiter_new(ctx, event_mask);
+		if (!w)
 			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
-
-		/* Find out the current status */
-		num_watch = sc_ctx_get_reader_count(ctx);
-		sc_log(ctx, "Trying to watch %d readers", num_watch);
-		for (i = 0; i < num_watch; i++) {
-			rgReaderStates[i].szReader = sc_ctx_get_reader(ctx, i)->name;
-			rgReaderStates[i].dwCurrentState = SCARD_STATE_UNAWARE;
-			rgReaderStates[i].dwEventState = SCARD_STATE_UNAWARE;
-		}
-#ifndef __APPLE__ /* OS X 10.6.2 does not support PnP notification */
-		if (event_mask & SC_EVENT_READER_ATTACHED) {
-			rgReaderStates[i].szReader = "\\\\?PnP?\\Notification";
-			rgReaderStates[i].dwCurrentState = SCARD_STATE_UNAWARE;
-			rgReaderStates[i].dwEventState = SCARD_STATE_UNAWARE;
-			num_watch++;
-		}
-#endif
 	}
 	else {
-		rgReaderStates = (SCARD_READERSTATE *)(*reader_states);
-		for (num_watch = 0; rgReaderStates[num_watch].szReader; num_watch++)
-			sc_log(ctx, "re-use reader '%s'", rgReaderStates[num_watch].szReader);
-	}
-#ifndef _WIN32
-	/* Establish a new context, assuming that it is called from a different thread with pcsc-lite */
-	if (gpriv->pcsc_wait_ctx == -1) {
-		rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &gpriv->pcsc_wait_ctx);
+		w = (struct pcsc_waiter *)(*reader_states);
+		for (i = 0; i < w->num_watch; i++)
+			sc_log(ctx, "re-use reader '%s'", w->states[i].szReader);
+	}
+	rgReaderStates = w->states;
+	num_watch = w->num_watch;
+
+	if (w->pcsc_ctx == -1) {
+		rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &w->pcsc_ctx);
 		if (rv != SCARD_S_SUCCESS) {
 			PCSC_LOG(ctx, "SCardEstablishContext(wait) failed", rv);
+			w->pcsc_ctx = -1;
 			r = pcsc_to_opensc_error(rv);
 			goto out;
 		}
 	}
-#else
-	gpriv->pcsc_wait_ctx = gpriv->pcsc_ctx;
-#endif
 	if (!event_reader || !event)
 	{
 		r = SC_ERROR_INTERNAL;
@@ -1177,7 +2011,10 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 		goto out;
 	}
 
-	rv = gpriv->SCardGetStatusChange(gpriv->pcsc_wait_ctx, 0, rgReaderStates, num_watch);
+	pcsc_waiter_start(ctx, w);
+	started = 1;
+
+	rv = gpriv->SCardGetStatusChange(w->pcsc_ctx, 0, rgReaderStates, num_watch);
 	if (rv != SCARD_S_SUCCESS) {
 		if (rv != (LONG)SCARD_E_TIMEOUT) {
 			PCSC_LOG(ctx, "SCardGetStatusChange(1) failed", rv);
@@ -1250,6 +2087,12 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 			goto out;
 		}
 
+		/* sc_cancel() came before we started to block */
+		if (w->cancelled) {
+			r = SC_ERROR_EVENT_TIMEOUT;
+			goto out;
+		}
+
 		/* Set the timeout if caller wants to time out */
 		if (timeout == -1) {
 			dwtimeout = INFINITE;
@@ -1257,7 +2100,7 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 		else
 			dwtimeout = timeout;
 
-		rv = gpriv->SCardGetStatusChange(gpriv->pcsc_wait_ctx, dwtimeout, rgReaderStates, num_watch);
+		rv = gpriv->SCardGetStatusChange(w->pcsc_ctx, dwtimeout, rgReaderStates, num_watch);
 
 		if (rv == (LONG) SCARD_E_CANCELLED) {
 			/* C_Finalize was called, events don't matter */
@@ -1277,12 +2120,21 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 		}
 	}
 out:
+	if (started)
+		pcsc_waiter_end(ctx, w);
+
+	if (r != SC_SUCCESS && r != SC_ERROR_EVENT_TIMEOUT && w->pcsc_ctx != -1) {
+		/* pcscd may have been restarted, use a new context next time */
+		gpriv->SCardReleaseContext(w->pcsc_ctx);
+		w->pcsc_ctx = -1;
+	}
+
 	if (!reader_states)   {
-		free(rgReaderStates);
+		pcsc_waiter_free(ctx, w);
 	}
 	else if (*reader_states == NULL)   {
 		sc_log(ctx, "return allocated 'reader states'");
-		*reader_states = rgReaderStates;
+		*reader_states = w;
 	}
 
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, r);
@@ -1908,6 +2760,40 @@ static int transform_pace_output(u8 *rbuf, size_t rbuflen,
 }
 
 
+/* Drops the remembered PACE channel, the request holds the secret */
+static void pcsc_pace_forget(struct pcsc_private_data *priv)
+{
+	if (priv->pace_request) {
+		sc_mem_clear(priv->pace_request, priv->pace_request_len);
+		free(priv->pace_request);
+	}
+	free(priv->pace_response);
+	priv->pace_request = NULL;
+	priv->pace_response = NULL;
+	priv->pace_request_len = 0;
+	priv->pace_response_len = 0;
+}
+
+/* Tears down the PACE channel of the current card, if there is one */
+static void pcsc_pace_close(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	u8 sbuf[] = {
+		PACE_FUNCTION_DestroyPACEChannel, /* idxFunction */
+		0, 0,                             /* lengthInputData */
+	};
+	u8 rbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	size_t rcount = sizeof rbuf;
+
+	if (priv->pace_request == NULL)
+		return;
+	if (priv->pace_generation == reader->card_generation
+			&& (reader->capabilities & SC_READER_CAP_PACE_DESTROY_CHANNEL))
+		pcsc_internal_transmit(reader, sbuf, sizeof sbuf, rbuf, &rcount,
+				priv->pace_ioctl);
+	pcsc_pace_forget(priv);
+}
+
 static int
 pcsc_perform_pace(struct sc_reader *reader, void *input_pace, void *output_pace)
 {
@@ -1916,6 +2802,7 @@ pcsc_perform_pace(struct sc_reader *reader, void *input_pace, void *output_pace)
 	struct pcsc_private_data *priv;
 	u8 rbuf[SC_MAX_EXT_APDU_BUFFER_SIZE], sbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
 	size_t rcount = sizeof rbuf, scount = sizeof sbuf;
+	int r;
 
     if (!reader || !(reader->capabilities & SC_READER_CAP_PACE_GENERIC))
         return SC_ERROR_INVALID_ARGUMENTS;
@@ -1928,14 +2815,49 @@ pcsc_perform_pace(struct sc_reader *reader, void *input_pace, void *output_pace)
             transform_pace_input(pace_input, sbuf, &scount),
             "Creating EstabishPACEChannel input data");
 
-    LOG_TEST_RET(reader->ctx,
-            pcsc_internal_transmit(reader, sbuf, scount, rbuf, &rcount,
-                priv->pace_ioctl),
-            "Executing EstabishPACEChannel");
+    /* The channel of an identical request to the same card is still open:
+     * the reader keeps it until the card is reset, removed or disconnected,
+     * and each of these bumps card_generation or drops it here. */
+    if (priv->pace_request != NULL) {
+        if (priv->pace_generation == reader->card_generation
+                && priv->pace_request_len == scount
+                && memcmp(priv->pace_request, sbuf, scount) == 0) {
+            sc_mem_clear(sbuf, scount);
+            sc_log(reader->ctx, "Reusing the established PACE channel");
+            return transform_pace_output(priv->pace_response,
+                    priv->pace_response_len, pace_output);
+        }
+        pcsc_pace_forget(priv);
+    }
 
-    LOG_TEST_RET(reader->ctx,
-            transform_pace_output(rbuf, rcount, pace_output),
-            "Parsing EstabishPACEChannel output data");
+    r = pcsc_internal_transmit(reader, sbuf, scount, rbuf, &rcount,
+                priv->pace_ioctl);
+    if (r != SC_SUCCESS) {
+        sc_mem_clear(sbuf, scount);
+        LOG_TEST_RET(reader->ctx, r, "Executing EstabishPACEChannel");
+    }
+
+    r = transform_pace_output(rbuf, rcount, pace_output);
+    if (r != SC_SUCCESS) {
+        sc_mem_clear(sbuf, scount);
+        LOG_TEST_RET(reader->ctx, r, "Parsing EstabishPACEChannel output data");
+    }
+
+    /* only an established channel is worth remembering */
+    if (pace_output->result == 0) {
+        priv->pace_request = malloc(scount);
+        priv->pace_response = malloc(rcount ? rcount : 1);
+        if (priv->pace_request && priv->pace_response) {
+            memcpy(priv->pace_request, sbuf, scount);
+            memcpy(priv->pace_response, rbuf, rcount);
+            priv->pace_request_len = scount;
+            priv->pace_response_len = rcount;
+            priv->pace_generation = reader->card_generation;
+        } else {
+            pcsc_pace_forget(priv);
+        }
+    }
+    sc_mem_clear(sbuf, scount);
 
     return SC_SUCCESS;
 }
@@ -1957,7 +2879,10 @@ struct sc_reader_driver * sc_get_pcsc_driver(void)
 	pcsc_ops.cancel = pcsc_cancel;
 	pcsc_ops.reset = pcsc_reset;
 	pcsc_ops.use_reader = NULL;
+	pcsc_ops.transmit_batch = NULL;
+	pcsc_ops.refresh_readers = pcsc_refresh_readers;
 	pcsc_ops.perform_pace = pcsc_perform_pace;
+	pcsc_ops.forked = pcsc_forked;
 
 	return &pcsc_drv;
 }
@@ -2088,18 +3013,209 @@ static int cardmod_finish(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
-int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcsc_card_handle)
+/* Query the pinpad, display and PACE features of the reader of card_handle */
+static void cardmod_detect_features(sc_context_t *ctx, sc_reader_t *reader, SCARDHANDLE card_handle)
 {
-	SCARDHANDLE card_handle;
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
 	u8 feature_buf[256], rbuf[SC_MAX_APDU_BUFFER_SIZE];
 	PCSC_TLV_STRUCTURE *pcsc_tlv;
-	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
 	LONG rv;
+	DWORD rcount, feature_len, display_ioctl = 0;
+	unsigned int i;
+
+	if (gpriv->SCardControl != NULL)
+	{
+		sc_log(ctx, "Requesting reader features ... ");
+		rv = gpriv->SCardControl(card_handle, CM_IOCTL_GET_FEATURE_REQUEST, NULL, 0, feature_buf, sizeof(feature_buf), &feature_len);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			sc_log(ctx, "SCardControl failed %08x", rv);
+		}
+		else
+		{
+			if ((feature_len % sizeof(PCSC_TLV_STRUCTURE)) != 0)
+			{
+				sc_log(ctx, "Inconsistent TLV from reader!");
+			}
+			else
+			{
+				char *log_disabled = "but it's disabled in configuration file";
+				/* get the number of elements instead of the complete size */
+				feature_len /= sizeof(PCSC_TLV_STRUCTURE);
+
+				pcsc_tlv = (PCSC_TLV_STRUCTURE *)feature_buf;
+				for (i = 0; i < feature_len; i++)
+				{
+					sc_log(ctx, "Reader feature %02x detected", pcsc_tlv[i].tag);
+					if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_DIRECT)
+					{
+						priv->verify_ioctl = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_START)
+					{
+						priv->verify_ioctl_start = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_FINISH)
+					{
+						priv->verify_ioctl_finish = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_DIRECT)
+					{
+						priv->modify_ioctl = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_START)
+					{
+						priv->modify_ioctl_start = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_FINISH)
+					{
+						priv->modify_ioctl_finish = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_IFD_PIN_PROPERTIES)
+					{
+						display_ioctl = ntohl(pcsc_tlv[i].value);
+					}
+					else if (pcsc_tlv[i].tag == FEATURE_EXECUTE_PACE)
+					{
+						priv->pace_ioctl = ntohl(pcsc_tlv[i].value);
+					}
+					else
+					{
+						sc_log(ctx, "Reader feature %02x is not supported", pcsc_tlv[i].tag);
+					}
+				}
+
+				/* Set slot capabilities based on detected IOCTLs */
+				if (priv->verify_ioctl || (priv->verify_ioctl_start && priv->verify_ioctl_finish)) {
+					char *log_text = "Reader supports pinpad PIN verification";
+					if (priv->gpriv->enable_pinpad) {
+						sc_log(ctx, log_text);
+						reader->capabilities |= SC_READER_CAP_PIN_PAD;
+					} else {
+						sc_log(ctx, "%s %s", log_text, log_disabled);
+					}
+				}
+
+				if (priv->modify_ioctl || (priv->modify_ioctl_start && priv->modify_ioctl_finish)) {
+					char *log_text = "Reader supports pinpad PIN modification";
+					if (priv->gpriv->enable_pinpad) {
+						sc_log(ctx, log_text);
+						reader->capabilities |= SC_READER_CAP_PIN_PAD;
+					} else {
+						sc_log(ctx, "%s %s", log_text, log_disabled);
+					}
+				}
+
+				if (display_ioctl)
+				{
+					rcount = sizeof(rbuf);
+					rv = gpriv->SCardControl(card_handle, display_ioctl, NULL, 0, rbuf, sizeof(rbuf), &rcount);
+					if (rv == SCARD_S_SUCCESS)
+					{
+						if (rcount == sizeof(PIN_PROPERTIES_STRUCTURE))
+						{
+							PIN_PROPERTIES_STRUCTURE *caps = (PIN_PROPERTIES_STRUCTURE *)rbuf;
+							if (caps->wLcdLayout > 0)
+							{
+								sc_log(ctx, "Reader has a display: %04X", caps->wLcdLayout);
+								reader->capabilities |= SC_READER_CAP_DISPLAY;
+							}
+							else
+								sc_log(ctx, "Reader does not have a display.");
+						}
+						else
+						{
+							sc_log(ctx, "Returned PIN properties structure has bad length (%d/%d)", rcount, sizeof(PIN_PROPERTIES_STRUCTURE));
+						}
+					}
+				}
+
+				if (priv->pace_ioctl) {
+					char *log_text = "Reader supports PACE";
+					if (priv->gpriv->enable_pace) {
+						sc_log(ctx, log_text);
+						reader->capabilities |= SC_READER_CAP_PACE_GENERIC;
+					} else {
+						sc_log(ctx, "%s %s", log_text, log_disabled);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/* Use card_handle for the reader: detect the protocol in use T0/T1/RAW,
+ * the features of the reader if asked, and the state of the card */
+static void cardmod_bind_handle(sc_context_t *ctx, sc_reader_t *reader,
+		SCARDHANDLE card_handle, int detect_features)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	DWORD readers_len = 0, state, prot, atr_len = SC_MAX_ATR_SIZE;
+	unsigned char atr[SC_MAX_ATR_SIZE];
+	LONG rv;
+
+	rv = priv->gpriv->SCardStatus(card_handle, NULL, &readers_len,
+		&state, &prot, atr, &atr_len);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		sc_log(ctx, "SCardStatus failed %08x", rv);
+		prot = SCARD_PROTOCOL_T0;
+	}
+	sc_log(ctx, "Set protocole to %s", \
+		(prot==SCARD_PROTOCOL_T0)?"T0":((prot==SCARD_PROTOCOL_T1)?"T1":"RAW"));
+	reader->active_protocol = pcsc_proto_to_opensc(prot);
+
+	priv->pcsc_card = card_handle;
+	if (detect_features)
+		cardmod_detect_features(ctx, reader, card_handle);
+
+	refresh_attributes(reader);
+}
+
+/*
+ * The reader object of an earlier call is kept and gets the new handle,
+ * so that the cards connected through it stay valid. Its card_generation
+ * tells whether they still talk to the same card: it changes when the
+ * reader or the card was exchanged in between.
+ */
+static int cardmod_rebind_reader(sc_context_t *ctx, sc_reader_t *reader,
+		SCARDHANDLE card_handle, const char *reader_name)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	int other_reader = strcmp(reader->name, reader_name) != 0;
+
+	if (other_reader) {
+		char *name = strdup(reader_name);
+
+		if (name == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		sc_log(ctx, "reader changed from '%s' to '%s'", reader->name, name);
+		free(reader->name);
+		reader->name = name;
+
+		/* Forget the state and the features of the previous reader */
+		memset(priv, 0, sizeof(*priv));
+		priv->gpriv = gpriv;
+		reader->capabilities = 0;
+		reader->flags = 0;
+		reader->card_generation++;
+	}
+
+	cardmod_bind_handle(ctx, reader, card_handle, other_reader);
+	return SC_SUCCESS;
+}
+
+int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcsc_card_handle)
+{
+	SCARDHANDLE card_handle;
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
 	char reader_name[128];
-	DWORD rcount, feature_len, display_ioctl, reader_name_size = sizeof(reader_name);
+	DWORD reader_name_size = sizeof(reader_name);
 	int ret = SC_ERROR_INTERNAL;
 	HKEY key;
-	unsigned int i;
 	wchar_t b;
 	char *p;
 
@@ -2110,13 +3226,6 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 		goto out;
 	}
 
-	/* if we already had a reader, delete it */
-	if (sc_ctx_get_reader_count(ctx) > 0) {
-		sc_reader_t *oldrdr = list_extract_at(&ctx->readers, 0);
-		if (oldrdr)
-			_sc_delete_reader(ctx, oldrdr);
-	}
-
 	sc_log(ctx, "Probing pcsc readers");
 
 	gpriv->pcsc_ctx = *(SCARDCONTEXT *)pcsc_context_handle;
@@ -2129,8 +3238,6 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 	{
 		sc_reader_t *reader = NULL;
 		struct pcsc_private_data *priv = NULL;
-		DWORD readers_len = 0, state, prot, atr_len = SC_MAX_ATR_SIZE;
-		unsigned char atr[SC_MAX_ATR_SIZE];
 
 		if(1)
 		{
@@ -2139,6 +3246,12 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 			sc_log(ctx, "lecteur name = %s\n%s\n", reader_name,texte);
 		}
 
+		/* if we already had a reader, give it the new handle */
+		if (sc_ctx_get_reader_count(ctx) > 0) {
+			ret = cardmod_rebind_reader(ctx, sc_ctx_get_reader(ctx, 0), card_handle, reader_name);
+			goto out;
+		}
+
 		if ((reader = calloc(1, sizeof(sc_reader_t))) == NULL) {
 			ret = SC_ERROR_OUT_OF_MEMORY;
 			goto err1;
@@ -2157,147 +3270,12 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 		}
 		priv->gpriv = gpriv;
 
-		/* attempt to detect protocol in use T0/T1/RAW */
-		rv = priv->gpriv->SCardStatus(card_handle, NULL, &readers_len,
-			&state, &prot, atr, &atr_len);
-		if (rv != SCARD_S_SUCCESS)
-		{
-			sc_log(ctx, "SCardStatus failed %08x", rv);
-			prot = SCARD_PROTOCOL_T0;
-		}
-		sc_log(ctx, "Set protocole to %s", \
-			(prot==SCARD_PROTOCOL_T0)?"T0":((prot==SCARD_PROTOCOL_T1)?"T1":"RAW"));
-		reader->active_protocol = pcsc_proto_to_opensc(prot);
-
 		if (_sc_add_reader(ctx, reader)) {
 			ret = SC_SUCCESS;	/* silent ignore */
 			goto err1;
 		}
-		priv->pcsc_card = card_handle;
-
-		/* check for pinpad support */
-		if (gpriv->SCardControl != NULL)
-		{
-			sc_log(ctx, "Requesting reader features ... ");
-			rv = gpriv->SCardControl(card_handle, CM_IOCTL_GET_FEATURE_REQUEST, NULL, 0, feature_buf, sizeof(feature_buf), &feature_len);
-			if (rv != SCARD_S_SUCCESS)
-			{
-				sc_log(ctx, "SCardControl failed %08x", rv);
-			}
-			else
-			{
-				if ((feature_len % sizeof(PCSC_TLV_STRUCTURE)) != 0)
-				{
-					sc_log(ctx, "Inconsistent TLV from reader!");
-				}
-				else
-				{
-					char *log_disabled = "but it's disabled in configuration file";
-					/* get the number of elements instead of the complete size */
-					feature_len /= sizeof(PCSC_TLV_STRUCTURE);
-
-					pcsc_tlv = (PCSC_TLV_STRUCTURE *)feature_buf;
-					for (i = 0; i < feature_len; i++)
-					{
-						sc_log(ctx, "Reader feature %02x detected", pcsc_tlv[i].tag);
-						if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_DIRECT)
-						{
-							priv->verify_ioctl = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_START)
-						{
-							priv->verify_ioctl_start = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_FINISH)
-						{
-							priv->verify_ioctl_finish = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_DIRECT)
-						{
-							priv->modify_ioctl = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_START)
-						{
-							priv->modify_ioctl_start = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_FINISH)
-						{
-							priv->modify_ioctl_finish = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_IFD_PIN_PROPERTIES)
-						{
-							display_ioctl = ntohl(pcsc_tlv[i].value);
-						}
-						else if (pcsc_tlv[i].tag == FEATURE_EXECUTE_PACE)
-						{
-							priv->pace_ioctl = ntohl(pcsc_tlv[i].value);
-						}
-						else
-						{
-							sc_log(ctx, "Reader feature %02x is not supported", pcsc_tlv[i].tag);
-						}
-					}
-
-					/* Set slot capabilities based on detected IOCTLs */
-					if (priv->verify_ioctl || (priv->verify_ioctl_start && priv->verify_ioctl_finish)) {
-						char *log_text = "Reader supports pinpad PIN verification";
-						if (priv->gpriv->enable_pinpad) {
-							sc_log(ctx, log_text);
-							reader->capabilities |= SC_READER_CAP_PIN_PAD;
-						} else {
-							sc_log(ctx, "%s %s", log_text, log_disabled);
-						}
-					}
-
-					if (priv->modify_ioctl || (priv->modify_ioctl_start && priv->modify_ioctl_finish)) {
-						char *log_text = "Reader supports pinpad PIN modification";
-						if (priv->gpriv->enable_pinpad) {
-							sc_log(ctx, log_text);
-							reader->capabilities |= SC_READER_CAP_PIN_PAD;
-						} else {
-							sc_log(ctx, "%s %s", log_text, log_disabled);
-						}
-					}
-
-					if (display_ioctl)
-					{
-						rcount = sizeof(rbuf);
-						rv = gpriv->SCardControl(card_handle, display_ioctl, NULL, 0, rbuf, sizeof(rbuf), &rcount);
-						if (rv == SCARD_S_SUCCESS)
-						{
-							if (rcount == sizeof(PIN_PROPERTIES_STRUCTURE))
-							{
-								PIN_PROPERTIES_STRUCTURE *caps = (PIN_PROPERTIES_STRUCTURE *)rbuf;
-								if (caps->wLcdLayout > 0)
-								{
-									sc_log(ctx, "Reader has a display: %04X", caps->wLcdLayout);
-									reader->capabilities |= SC_READER_CAP_DISPLAY;
-								}
-								else
-									sc_log(ctx, "Reader does not have a display.");
-							}
-							else
-							{
-								sc_log(ctx, "Returned PIN properties structure has bad length (%d/%d)", rcount, sizeof(PIN_PROPERTIES_STRUCTURE));
-							}
-						}
-					}
-
-					if (priv->pace_ioctl) {
-						char *log_text = "Reader supports PACE";
-						if (priv->gpriv->enable_pace) {
-							sc_log(ctx, log_text);
-							reader->capabilities |= SC_READER_CAP_PACE_GENERIC;
-						} else {
-							sc_log(ctx, "%s %s", log_text, log_disabled);
-						}
-					}
-				}
-			}
-		}
-
 
-		refresh_attributes(reader);
+		cardmod_bind_handle(ctx, reader, card_handle, 1);
 
 		ret = SC_SUCCESS;
 
@@ -2325,6 +3303,9 @@ static int cardmod_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	if (priv->apdu_buf != NULL)
+		sc_mem_account_free(SC_MEM_READER, 2 * PCSC_APDU_BUFFER_SIZE);
+	free(priv->apdu_buf);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -2349,7 +3330,9 @@ struct sc_reader_driver * sc_get_cardmod_driver(void)
 	cardmod_ops.wait_for_event = NULL;
 	cardmod_ops.reset = NULL;
 	cardmod_ops.use_reader = cardmod_use_reader;
+	cardmod_ops.transmit_batch = NULL;
 	cardmod_ops.perform_pace = NULL;
+	cardmod_ops.forked = NULL;
 
 	return &cardmod_drv;
 }
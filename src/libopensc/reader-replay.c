@@ -0,0 +1,495 @@
+/*
+ * reader-replay.c: Reader driver replaying a recorded APDU transcript
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A transcript is a text file, written with the apdu_record_file option
+ * or by hand:
+ *
+ *	# comment
+ *	atr 3b:f8:13:00:00:81:31:fe:45:4a:43:4f:50:76:32:34:31:b7
+ *	> 00a4040009a00000000101
+ *	< 9000 1250
+ *	> 00200081*
+ *	< 9000
+ *
+ * "> " lines are command APDUs, a trailing '*' matches any remaining
+ * bytes. The "< " line following a command is its response including
+ * SW1 SW2, optionally followed by the latency in microseconds that was
+ * observed on the card. A command is answered with the response of the
+ * next unused matching entry, so repeated commands replay in order.
+ *
+ * The recorder keeps PINs, keys and what the card computes with them out
+ * of the transcript: of VERIFY, PERFORM SECURITY OPERATION and the other
+ * commands listed in apdu.c, and of the GET RESPONSE commands following
+ * them, only the header and the status word are written. Such entries
+ * replay without response data.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#include "internal.h"
+
+#define REPLAY_LINE_SIZE	(2 * (SC_MAX_EXT_APDU_BUFFER_SIZE + 2) + 64)
+
+struct replay_entry {
+	u8 *cmd;
+	size_t cmd_len;
+	int prefix;		/* command ended with '*' */
+	u8 *resp;
+	size_t resp_len;
+	unsigned long usec;
+	int used;
+};
+
+struct replay_global_private_data {
+	char *file;
+	int timing;		/* percent of the recorded latency, 0: none */
+	struct sc_atr atr;
+	struct replay_entry *entries;
+	size_t count;
+	size_t next;
+};
+
+struct sc_apdu_recorder {
+	FILE *file;
+	void *mutex;
+	struct sc_atr atr;
+};
+
+static struct sc_reader_operations replay_ops;
+
+static struct sc_reader_driver replay_drv = {
+	"APDU transcript replay",
+	"replay",
+	&replay_ops,
+	0, 0, NULL
+};
+
+static int replay_hex(const char *hex, u8 **out, size_t *out_len)
+{
+	size_t len = strlen(hex) / 2 + 1;
+	u8 *buf = malloc(len);
+	int r;
+
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_hex_to_bin(hex, buf, &len);
+	if (r != SC_SUCCESS) {
+		free(buf);
+		return r;
+	}
+	*out = buf;
+	*out_len = len;
+	return SC_SUCCESS;
+}
+
+static int replay_load(sc_context_t *ctx, struct replay_global_private_data *gpriv)
+{
+	struct replay_entry *entry = NULL;
+	char *line, *p;
+	FILE *f;
+	int r = SC_SUCCESS, lineno = 0;
+
+	f = fopen(gpriv->file, "r");
+	if (f == NULL) {
+		sc_log(ctx, "cannot open APDU transcript %s", gpriv->file);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	line = malloc(REPLAY_LINE_SIZE);
+	if (line == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	while (r == SC_SUCCESS && fgets(line, REPLAY_LINE_SIZE, f) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (!strncmp(line, "atr ", 4)) {
+			u8 *atr;
+			size_t len;
+
+			if (gpriv->atr.len)
+				continue;
+			r = replay_hex(line + 4, &atr, &len);
+			if (r != SC_SUCCESS)
+				break;
+			if (len == 0 || len > SC_MAX_ATR_SIZE) {
+				r = SC_ERROR_SYNTAX_ERROR;
+			}
+			else {
+				memcpy(gpriv->atr.value, atr, len);
+				gpriv->atr.len = len;
+			}
+			free(atr);
+		}
+		else if (!strncmp(line, "> ", 2)) {
+			struct replay_entry *tmp;
+
+			tmp = realloc(gpriv->entries, (gpriv->count + 1) * sizeof(*tmp));
+			if (tmp == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			gpriv->entries = tmp;
+			entry = &gpriv->entries[gpriv->count];
+			memset(entry, 0, sizeof(*entry));
+			p = line + 2 + strlen(line + 2);
+			if (p > line + 2 && p[-1] == '*') {
+				p[-1] = '\0';
+				entry->prefix = 1;
+			}
+			r = replay_hex(line + 2, &entry->cmd, &entry->cmd_len);
+			if (r == SC_SUCCESS && entry->cmd_len < 4 && !entry->prefix)
+				r = SC_ERROR_SYNTAX_ERROR;
+			if (r == SC_SUCCESS)
+				gpriv->count++;
+			else
+				free(entry->cmd);
+		}
+		else if (!strncmp(line, "< ", 2)) {
+			if (entry == NULL || entry->resp != NULL) {
+				r = SC_ERROR_SYNTAX_ERROR;
+				break;
+			}
+			p = strchr(line + 2, ' ');
+			if (p != NULL) {
+				*p++ = '\0';
+				entry->usec = strtoul(p, NULL, 10);
+			}
+			r = replay_hex(line + 2, &entry->resp, &entry->resp_len);
+			if (r == SC_SUCCESS && entry->resp_len < 2) {
+				free(entry->resp);
+				entry->resp = NULL;
+				r = SC_ERROR_SYNTAX_ERROR;
+			}
+		}
+		else if (line[0] != '#' && line[0] != '\0') {
+			r = SC_ERROR_SYNTAX_ERROR;
+		}
+	}
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "%s:%d: invalid APDU transcript line", gpriv->file, lineno);
+	else if (gpriv->atr.len == 0)
+		sc_log(ctx, "%s: APDU transcript has no ATR", gpriv->file);
+	else
+		sc_log(ctx, "replaying %lu APDUs from %s", (unsigned long) gpriv->count, gpriv->file);
+
+	free(line);
+	fclose(f);
+	return r;
+}
+
+static int replay_match(const struct replay_entry *e, const u8 *cmd, size_t len)
+{
+	if (e->resp == NULL || e->cmd_len > len)
+		return 0;
+	if (!e->prefix && e->cmd_len != len)
+		return 0;
+	return !memcmp(e->cmd, cmd, e->cmd_len);
+}
+
+static struct replay_entry *replay_find(struct replay_global_private_data *gpriv,
+		const u8 *cmd, size_t len)
+{
+	struct replay_entry *any = NULL;
+	size_t i, n;
+
+	for (n = 0; n < gpriv->count; n++) {
+		i = (gpriv->next + n) % gpriv->count;
+		if (!replay_match(&gpriv->entries[i], cmd, len))
+			continue;
+		if (!gpriv->entries[i].used) {
+			gpriv->next = i + 1;
+			return &gpriv->entries[i];
+		}
+		if (any == NULL)
+			any = &gpriv->entries[i];
+	}
+	/* all recorded answers were used: repeat the first one */
+	return any;
+}
+
+static void replay_delay(const struct replay_global_private_data *gpriv,
+		const struct replay_entry *e)
+{
+	unsigned long usec;
+
+	if (gpriv->timing <= 0 || e->usec == 0)
+		return;
+	usec = e->usec / 100 * gpriv->timing + e->usec % 100 * gpriv->timing / 100;
+#ifdef _WIN32
+	Sleep(usec / 1000);
+#else
+	usleep(usec);
+#endif
+}
+
+static int replay_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct replay_global_private_data *gpriv = reader->ctx->reader_drv_data;
+	struct replay_entry *e;
+	u8 *sbuf = NULL;
+	size_t ssize = 0;
+	int r;
+
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	e = replay_find(gpriv, sbuf, ssize);
+	if (e == NULL) {
+		sc_log(reader->ctx, "APDU not found in transcript");
+		r = SC_ERROR_TRANSMIT_FAILED;
+		goto out;
+	}
+	e->used = 1;
+	replay_delay(gpriv, e);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, e->resp, e->resp_len, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, e->resp, e->resp_len);
+out:
+	sc_mem_clear(sbuf, ssize);
+	free(sbuf);
+	return r;
+}
+
+static int replay_detect_card_presence(sc_reader_t *reader)
+{
+	reader->flags |= SC_READER_CARD_PRESENT;
+	return reader->flags;
+}
+
+static int replay_connect(sc_reader_t *reader)
+{
+	struct replay_global_private_data *gpriv = reader->ctx->reader_drv_data;
+
+	reader->atr = gpriv->atr;
+	reader->active_protocol = SC_PROTO_T1;
+	return _sc_parse_atr(reader) < 0 ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int replay_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+/* No handles to replace, the child goes on from where the parent was */
+static int replay_forked(sc_context_t *ctx)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_release(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_finish(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv = ctx->reader_drv_data;
+	size_t i;
+
+	if (gpriv == NULL)
+		return SC_SUCCESS;
+	for (i = 0; i < gpriv->count; i++) {
+		free(gpriv->entries[i].cmd);
+		if (gpriv->entries[i].resp != NULL) {
+			sc_mem_clear(gpriv->entries[i].resp, gpriv->entries[i].resp_len);
+			free(gpriv->entries[i].resp);
+		}
+	}
+	free(gpriv->entries);
+	free(gpriv->file);
+	free(gpriv);
+	ctx->reader_drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int replay_init(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv;
+	scconf_block *conf_block;
+	sc_reader_t *reader;
+	const char *file;
+	int r;
+
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	ctx->reader_drv_data = gpriv;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	file = scconf_get_str(conf_block, "file", NULL);
+	gpriv->timing = scconf_get_int(conf_block, "timing", 0);
+	if (getenv("OPENSC_REPLAY_FILE") != NULL)
+		file = getenv("OPENSC_REPLAY_FILE");
+	if (file == NULL) {
+		sc_log(ctx, "no APDU transcript configured");
+		return SC_SUCCESS;
+	}
+	gpriv->file = strdup(file);
+	if (gpriv->file == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	/* a broken transcript leaves the context without readers */
+	if (replay_load(ctx, gpriv) != SC_SUCCESS || gpriv->atr.len == 0)
+		return SC_SUCCESS;
+
+	reader = calloc(1, sizeof(sc_reader_t));
+	if (reader == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	reader->driver = &replay_drv;
+	reader->ops = &replay_ops;
+	reader->name = strdup("OpenSC APDU replay reader");
+	reader->supported_protocols = SC_PROTO_T1;
+	r = _sc_add_reader(ctx, reader);
+	if (r != SC_SUCCESS) {
+		free(reader->name);
+		free(reader);
+		return r;
+	}
+	replay_detect_card_presence(reader);
+	return SC_SUCCESS;
+}
+
+int _sc_apdu_record_open(sc_context_t *ctx, const char *filename)
+{
+	struct sc_apdu_recorder *rec;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+#ifdef _WIN32
+	rec->file = fopen(filename, "a");
+#else
+	/* readable by the user only, whatever the umask */
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	rec->file = fd >= 0 ? fdopen(fd, "a") : NULL;
+	if (rec->file == NULL && fd >= 0)
+		close(fd);
+#endif
+	if (rec->file == NULL) {
+		free(rec);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	sc_mutex_create(ctx, &rec->mutex);
+	ctx->apdu_record = rec;
+	return SC_SUCCESS;
+}
+
+void _sc_apdu_record_close(sc_context_t *ctx)
+{
+	struct sc_apdu_recorder *rec = ctx->apdu_record;
+
+	if (rec == NULL)
+		return;
+	fclose(rec->file);
+	sc_mutex_destroy(ctx, rec->mutex);
+	free(rec);
+	ctx->apdu_record = NULL;
+}
+
+void _sc_apdu_record(struct sc_reader *reader, const struct sc_apdu *apdu,
+		int redact, unsigned long usec)
+{
+	struct sc_context *ctx = reader->ctx;
+	struct sc_apdu_recorder *rec = ctx->apdu_record;
+	u8 *sbuf = NULL, sw[2];
+	size_t ssize = 0, len, resplen;
+	char *hex;
+
+	if (sc_apdu_get_octets(ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW) != SC_SUCCESS)
+		return;
+	/* keep the header only, the data may be a PIN or a key */
+	len = redact && ssize > 4 ? 4 : ssize;
+	/* and only the status word of the response */
+	resplen = redact ? 0 : apdu->resplen;
+	hex = malloc(2 * (len > resplen ? len : resplen) + 2);
+	if (hex == NULL)
+		goto out;
+
+	sc_mutex_lock(ctx, rec->mutex);
+	if (reader->atr.len != rec->atr.len
+			|| memcmp(reader->atr.value, rec->atr.value, rec->atr.len)) {
+		char atr[3 * SC_MAX_ATR_SIZE + 1];
+
+		sc_bin_to_hex(reader->atr.value, reader->atr.len, atr, sizeof(atr), ':');
+		fprintf(rec->file, "atr %s\n", atr);
+		rec->atr = reader->atr;
+	}
+	sc_bin_to_hex(sbuf, len, hex, 2 * len + 2, 0);
+	fprintf(rec->file, "> %s%s\n", hex, redact ? "*" : "");
+	sc_bin_to_hex(apdu->resp, resplen, hex, 2 * resplen + 2, 0);
+	sw[0] = apdu->sw1;
+	sw[1] = apdu->sw2;
+	fprintf(rec->file, "< %s%02x%02x %lu\n", hex, sw[0], sw[1], usec);
+	fflush(rec->file);
+	sc_mutex_unlock(ctx, rec->mutex);
+
+	free(hex);
+out:
+	sc_mem_clear(sbuf, ssize);
+	free(sbuf);
+}
+
+struct sc_reader_driver * sc_get_replay_driver(void)
+{
+	replay_ops.init = replay_init;
+	replay_ops.finish = replay_finish;
+	replay_ops.detect_readers = NULL;
+	replay_ops.transmit = replay_transmit;
+	replay_ops.detect_card_presence = replay_detect_card_presence;
+	replay_ops.lock = replay_lock;
+	replay_ops.unlock = replay_unlock;
+	replay_ops.release = replay_release;
+	replay_ops.connect = replay_connect;
+	replay_ops.disconnect = replay_disconnect;
+	replay_ops.perform_verify = NULL;
+	replay_ops.perform_pace = NULL;
+	replay_ops.use_reader = NULL;
+	replay_ops.transmit_batch = NULL;
+	replay_ops.forked = replay_forked;
+
+	return &replay_drv;
+}
@@ -520,6 +520,17 @@ sc_file_t * sc_file_new(void)
 		return NULL;
 
 	file->magic = SC_FILE_MAGIC;
+	file->refcount = 1;
+	return file;
+}
+
+sc_file_t * sc_file_ref(sc_file_t *file)
+{
+	assert(sc_file_valid(file));
+	/* not allocated by sc_file_new() */
+	if (file->refcount == 0)
+		file->refcount = 1;
+	file->refcount++;
 	return file;
 }
 
@@ -527,6 +538,10 @@ void sc_file_free(sc_file_t *file)
 {
 	unsigned int i;
 	assert(sc_file_valid(file));
+	if (file->refcount > 1) {
+		file->refcount--;
+		return;
+	}
 	file->magic = 0;
 	for (i = 0; i < SC_MAX_AC_OPS; i++)
 		sc_file_clear_acl_entries(file, i);
@@ -788,11 +803,194 @@ int _sc_parse_atr(sc_reader_t *reader)
 	return 0;
 }
 
+/*
+ * Secure memory pool.
+ *
+ * PINs, session keys and other short-lived secrets are taken from a few
+ * arenas of fixed size slots. Each arena is locked in memory, and kept out
+ * of core dumps where the system allows, once when its first slot is used,
+ * so that allocating and freeing a slot costs no system call. Slots are
+ * claimed and released with atomic operations on a bitmap and are wiped
+ * when they are freed. The arenas live until the process exits.
+ *
+ * The arenas add up to 56 KiB, within the 64 KiB RLIMIT_MEMLOCK that
+ * unprivileged processes commonly get. Requests bigger than the largest
+ * slot, or made while all slots of the fitting classes are in use, fall
+ * back to a heap allocation locked on its own.
+ */
+#if defined(__GNUC__)
+#define SC_SECMEM_POOL
+#define SECMEM_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define SECMEM_CAS_PTR(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#elif defined(_WIN32)
+#define SC_SECMEM_POOL
+#define SECMEM_CAS(p, o, n)	(InterlockedCompareExchange((volatile LONG *)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#define SECMEM_CAS_PTR(p, o, n)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
+#endif
+
+#ifdef SC_SECMEM_POOL
+#define SECMEM_MAX_SLOTS	128
+#define SECMEM_WORD_BITS	32
+
+struct sc_secmem_arena {
+	size_t slot_size;
+	unsigned int nslots;		/* multiple of SECMEM_WORD_BITS */
+	unsigned char * volatile base;	/* NULL until the class is first used */
+	volatile int locked;
+	volatile unsigned int used[SECMEM_MAX_SLOTS / SECMEM_WORD_BITS];
+};
+
+static struct sc_secmem_arena sc_secmem[] = {
+	{   64, 128, NULL, 0, { 0 } },	/* PINs, symmetric and session keys */
+	{  256,  64, NULL, 0, { 0 } },	/* PIN cache entries, short plain texts */
+	{ 1024,  32, NULL, 0, { 0 } },	/* RSA private key components, decrypted data */
+};
+#define SECMEM_CLASSES	(sizeof(sc_secmem) / sizeof(sc_secmem[0]))
+
+static unsigned char *sc_secmem_map(size_t size, int *locked)
+{
+	unsigned char *base;
+
+	*locked = 0;
+#ifdef _WIN32
+	base = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (base == NULL)
+		return NULL;
+	if (VirtualLock(base, size))
+		*locked = 1;
+#else
+	base = NULL;
+#if defined(HAVE_SYS_MMAN_H) && (defined(MAP_ANONYMOUS) || defined(MAP_ANON))
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		base = NULL;
+#endif
+	if (base == NULL)
+		base = calloc(size, 1);
+	if (base == NULL)
+		return NULL;
+#ifdef HAVE_SYS_MMAN_H
+	if (mlock(base, size) >= 0)
+		*locked = 1;
+#ifdef MADV_DONTDUMP
+	madvise(base, size, MADV_DONTDUMP);
+#endif
+#endif
+#endif
+	return base;
+}
+
+static void sc_secmem_unmap(unsigned char *base, size_t size)
+{
+#ifdef _WIN32
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+#ifdef HAVE_SYS_MMAN_H
+	munlock(base, size);
+#endif
+#if defined(HAVE_SYS_MMAN_H) && (defined(MAP_ANONYMOUS) || defined(MAP_ANON))
+	munmap(base, size);
+#else
+	free(base);
+#endif
+#endif
+}
+
+static unsigned char *sc_secmem_arena_base(sc_context_t *ctx, struct sc_secmem_arena *arena)
+{
+	unsigned char *base = arena->base;
+	size_t size = arena->slot_size * arena->nslots;
+	int locked;
+
+	if (base != NULL)
+		return base;
+
+	base = sc_secmem_map(size, &locked);
+	if (base == NULL)
+		return NULL;
+	if (!SECMEM_CAS_PTR(&arena->base, NULL, base)) {
+		/* another thread created the arena meanwhile */
+		sc_secmem_unmap(base, size);
+		return arena->base;
+	}
+	arena->locked = locked;
+	if (!locked && ctx != NULL)
+		sc_log(ctx, "secure memory arena of %lu bytes could not be locked, see RLIMIT_MEMLOCK",
+				(unsigned long) size);
+	return base;
+}
+
+static void *sc_secmem_get_slot(struct sc_secmem_arena *arena, unsigned char *base)
+{
+	unsigned int w, bit, used;
+
+	for (w = 0; w < arena->nslots / SECMEM_WORD_BITS; w++) {
+		do {
+			used = arena->used[w];
+			if (used == 0xFFFFFFFFU)
+				break;
+			for (bit = 0; used & (1U << bit); bit++)
+				;
+		} while (!SECMEM_CAS(&arena->used[w], used, used | (1U << bit)));
+
+		if (used != 0xFFFFFFFFU)
+			return base + (w * SECMEM_WORD_BITS + bit) * arena->slot_size;
+	}
+	return NULL;
+}
+
+static int sc_secmem_put_slot(void *ptr)
+{
+	unsigned char *p = ptr;
+	unsigned int i, idx, w, used;
+
+	for (i = 0; i < SECMEM_CLASSES; i++) {
+		struct sc_secmem_arena *arena = &sc_secmem[i];
+		unsigned char *base = arena->base;
+
+		if (base == NULL || p < base || p >= base + arena->slot_size * arena->nslots)
+			continue;
+
+		idx = (unsigned int)((p - base) / arena->slot_size);
+		sc_mem_clear(base + idx * arena->slot_size, arena->slot_size);
+		w = idx / SECMEM_WORD_BITS;
+		do {
+			used = arena->used[w];
+		} while (!SECMEM_CAS(&arena->used[w], used, used & ~(1U << (idx % SECMEM_WORD_BITS))));
+		return 1;
+	}
+	return 0;
+}
+#endif
+
 void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len)
 {
     void *pointer;
     int locked = 0;
 
+#ifdef SC_SECMEM_POOL
+    unsigned int i;
+
+    for (i = 0; len > 0 && i < SECMEM_CLASSES; i++) {
+        struct sc_secmem_arena *arena = &sc_secmem[i];
+        unsigned char *base;
+
+        if (arena->slot_size < len)
+            continue;
+        base = sc_secmem_arena_base(ctx, arena);
+        if (base == NULL)
+            break;
+        if (!arena->locked && ctx != NULL && ctx->paranoid_memory)
+            break;
+        pointer = sc_secmem_get_slot(arena, base);
+        if (pointer != NULL)
+            return pointer;
+    }
+#endif
+
     pointer = calloc(len, sizeof(unsigned char));
     if (!pointer)
         return NULL;
@@ -802,7 +1000,7 @@ void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len)
     if (mlock(pointer, len) >= 0)
         locked = 1;
 #endif
-    if (!locked) {
+    if (!locked && ctx != NULL) {
         if (ctx->paranoid_memory) {
             sc_do_log (ctx, 0, NULL, 0, NULL, "cannot lock memory, failing allocation because paranoid set");
             free (pointer);
@@ -814,6 +1012,19 @@ void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len)
     return pointer;
 }
 
+void sc_mem_free_secure(void *ptr, size_t len)
+{
+	if (ptr == NULL)
+		return;
+#ifdef SC_SECMEM_POOL
+	if (sc_secmem_put_slot(ptr))
+		return;
+#endif
+	/* not munlock'ed: page locks do not nest and the page may be shared */
+	sc_mem_clear(ptr, len);
+	free(ptr);
+}
+
 void sc_mem_clear(void *ptr, size_t len)
 {
 #ifdef ENABLE_OPENSSL
@@ -854,6 +1065,7 @@ sc_remote_apdu_allocate(struct sc_remote_data *rdata,
 	rapdu = calloc(1, sizeof(struct sc_remote_apdu));
 	if (rapdu == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
+	sc_mem_account_alloc(SC_MEM_SM, sizeof(struct sc_remote_apdu));
 
 	rapdu->apdu.data = &rapdu->sbuf[0];
 	rapdu->apdu.resp = &rapdu->rbuf[0];
@@ -888,6 +1100,7 @@ sc_remote_apdu_free (struct sc_remote_data *rdata)
 	while(rapdu)   {
 		struct sc_remote_apdu *rr = rapdu->next;
 
+		sc_mem_account_free(SC_MEM_SM, sizeof(struct sc_remote_apdu));
 		free(rapdu);
 		rapdu = rr;
 	}
@@ -64,6 +64,8 @@ int sc_set_security_env(sc_card_t *card,
 
 	assert(card != NULL);
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	/* not all drivers send an APDU here, see sc_pkcs15_compute_signature() */
+	card->cache.sec_env_valid = 0;
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->set_security_env(card, env, se_num);
@@ -76,6 +78,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 
 	assert(card != NULL);
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	card->cache.sec_env_valid = 0;
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->restore_security_env(card, se_num);
@@ -201,6 +204,9 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Use of pin pad not supported by card driver");
 		r = SC_ERROR_NOT_SUPPORTED;
 	}
+	/* the PIN status of the card changed for everybody */
+	if (data->cmd != SC_PIN_CMD_GET_INFO && r != SC_ERROR_NOT_SUPPORTED)
+		sc_shared_generation_bump(card);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
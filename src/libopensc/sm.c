@@ -121,8 +121,8 @@ sc_sm_update_apdu_response(struct sc_card *card, unsigned char *resp_data, size_
 	return SC_SUCCESS;
 }
 
-int
-sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
+static int
+sm_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
 	struct sc_apdu *sm_apdu = NULL;
@@ -138,7 +138,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
 		/* SM wrap of this APDU is ignored by card driver.
 		 * Send plain APDU to the reader driver */
-		rv = card->reader->ops->transmit(card->reader, apdu);
+		rv = _sc_reader_transmit(card->reader, apdu);
 		LOG_FUNC_RETURN(ctx, rv);
 	}
 	LOG_TEST_RET(ctx, rv, "get SM APDU error");
@@ -151,7 +151,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	}
 
 	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, sm_apdu);
+	rv = _sc_reader_transmit(card->reader, sm_apdu);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	/* decode SM answer and free temporary SM related data */
@@ -159,6 +159,150 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
+
+
+/* the card does not know the session keys (anymore) */
+static int
+sm_session_lost(int rv, struct sc_apdu *apdu)
+{
+	switch (rv) {
+	case SC_ERROR_SM_NO_SESSION_KEYS:
+	case SC_ERROR_SM_INVALID_SESSION_KEY:
+	case SC_ERROR_SM_NOT_INITIALIZED:
+	case SC_ERROR_SM_INVALID_CHECKSUM:
+		return 1;
+	}
+	/* 6987: expected SM data objects missing, 6988: SM data objects incorrect */
+	return rv >= 0 && apdu->sw1 == 0x69 && (apdu->sw2 == 0x87 || apdu->sw2 == 0x88);
+}
+
+
+static int
+sm_reopen(struct sc_card *card)
+{
+	int rv;
+
+	card->sm_ctx.sm_flags &= ~SM_FLAGS_REOPEN;
+	card->sm_ctx.sm_flags |= SM_FLAGS_OPENING;
+	/* a new secure channel does not keep the security environment */
+	card->cache.sec_env_valid = 0;
+	rv = card->sm_ctx.ops.open(card);
+	card->sm_ctx.sm_flags &= ~SM_FLAGS_OPENING;
+	return rv;
+}
+
+
+/* The SM session established once is used for as long as the card was
+ * not reset; it is only re-opened after a reset or when the card
+ * rejects the secured APDU, which is then sent again in the new session. */
+int
+sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
+{
+	struct sc_context *ctx  = card->ctx;
+	size_t resplen = apdu->resplen;
+	int rv, can_reopen;
+
+	LOG_FUNC_CALLED(ctx);
+	can_reopen = card->sm_ctx.ops.open && !(card->sm_ctx.sm_flags & SM_FLAGS_OPENING);
+
+	if (can_reopen && (card->sm_ctx.sm_flags & SM_FLAGS_REOPEN)) {
+		sc_log(ctx, "card was reset, re-open SM session");
+		rv = sm_reopen(card);
+		LOG_TEST_RET(ctx, rv, "cannot re-open SM session");
+	}
+
+	rv = sm_transmit(card, apdu);
+	if (can_reopen && sm_session_lost(rv, apdu)) {
+		sc_log(ctx, "SM session rejected by card (%i, %02X%02X), re-open", rv, apdu->sw1, apdu->sw2);
+		rv = sm_reopen(card);
+		LOG_TEST_RET(ctx, rv, "cannot re-open SM session");
+
+		apdu->resplen = resplen;
+		rv = sm_transmit(card, apdu);
+	}
+
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+
+/**  get an APDU with data and response buffers for the SM wrapped command;
+ *  the buffers belong to the card and are reused for the following APDUs
+ *  @param  card 'sc_card' smartcard object
+ *  @param  data_len 'size of the data buffer'
+ *  @param  resp_len 'size of the response buffer'
+ *  @param  apdu 'returned APDU, to be released with sc_sm_release_scratch_apdu()'
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int
+sc_sm_get_scratch_apdu(struct sc_card *card, size_t data_len, size_t resp_len,
+		struct sc_apdu **apdu)
+{
+	struct sm_context *sm_ctx = &card->sm_ctx;
+	size_t size = data_len + resp_len;
+	unsigned char *buf;
+
+	if (!apdu)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	*apdu = NULL;
+
+	if (sm_ctx->scratch_busy)   {
+		/* nested SM transmit: use a private copy */
+		struct sc_apdu *tmp = calloc(1, sizeof(struct sc_apdu) + size);
+
+		if (!tmp)
+			return SC_ERROR_OUT_OF_MEMORY;
+		tmp->data = (unsigned char *)(tmp + 1);
+		tmp->resp = (unsigned char *)(tmp + 1) + data_len;
+		*apdu = tmp;
+		return SC_SUCCESS;
+	}
+
+	if (size > sm_ctx->scratch_size)   {
+		buf = calloc(1, size);
+		if (!buf)
+			return SC_ERROR_OUT_OF_MEMORY;
+		sc_sm_free_scratch(card);
+		sm_ctx->scratch = buf;
+		sm_ctx->scratch_size = size;
+		sc_mem_account_alloc(SC_MEM_SM, size);
+	}
+
+	memset(&sm_ctx->scratch_apdu, 0, sizeof(sm_ctx->scratch_apdu));
+	sm_ctx->scratch_apdu.data = sm_ctx->scratch;
+	sm_ctx->scratch_apdu.resp = sm_ctx->scratch + data_len;
+	sm_ctx->scratch_busy = 1;
+
+	*apdu = &sm_ctx->scratch_apdu;
+	return SC_SUCCESS;
+}
+
+
+void
+sc_sm_release_scratch_apdu(struct sc_card *card, struct sc_apdu **apdu)
+{
+	if (!apdu || !*apdu)
+		return;
+	if (*apdu == &card->sm_ctx.scratch_apdu)
+		card->sm_ctx.scratch_busy = 0;
+	else
+		free(*apdu);
+	*apdu = NULL;
+}
+
+
+void
+sc_sm_free_scratch(struct sc_card *card)
+{
+	struct sm_context *sm_ctx = &card->sm_ctx;
+
+	if (sm_ctx->scratch)   {
+		sc_mem_clear(sm_ctx->scratch, sm_ctx->scratch_size);
+		sc_mem_account_free(SC_MEM_SM, sm_ctx->scratch_size);
+		free(sm_ctx->scratch);
+	}
+	sm_ctx->scratch = NULL;
+	sm_ctx->scratch_size = 0;
+}
 #else
 int
 sc_sm_parse_answer(struct sc_card *card, unsigned char *resp_data, size_t resp_len,
@@ -177,4 +321,14 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	return SC_ERROR_NOT_SUPPORTED;
 }
+int
+sc_sm_get_scratch_apdu(struct sc_card *card, size_t data_len, size_t resp_len,
+		struct sc_apdu **apdu)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+void
+sc_sm_release_scratch_apdu(struct sc_card *card, struct sc_apdu **apdu)
+{
+}
 #endif
@@ -49,6 +49,11 @@ extern "C" {
 #define SM_MODE_ACL		0x100
 #define SM_MODE_TRANSMIT	0x200
 
+/* The card was reset or reattached: re-open the SM session before sending the next APDU */
+#define SM_FLAGS_REOPEN		0x01
+/* SM session is being opened, do not try to re-open it */
+#define SM_FLAGS_OPENING	0x02
+
 #define SM_CMD_INITIALIZE		0x10
 #define SM_CMD_MUTUAL_AUTHENTICATION	0x20
 #define SM_CMD_RSA			0x100
@@ -66,6 +71,7 @@ extern "C" {
 #define SM_CMD_PIN_SET_PIN		0x303
 #define SM_CMD_PSO			0x400
 #define SM_CMD_PSO_DST			0x401
+#define SM_CMD_PSO_DECIPHER		0x402
 #define SM_CMD_APDU			0x500
 #define SM_CMD_APDU_TRANSMIT		0x501
 #define SM_CMD_APDU_RAW			0x502
@@ -84,6 +90,8 @@ extern "C" {
 #define SM_RESPONSE_CONTEXT_DATA_TAG	0xA2
 
 #define SM_MAX_DATA_SIZE    0xE0
+/* plain data of one extended length command, fits in sc_remote_apdu once secured */
+#define SM_MAX_EXT_DATA_SIZE	0x1E0
 
 #define SM_SMALL_CHALLENGE_LEN	8
 
@@ -345,6 +353,12 @@ typedef struct sm_context   {
 
 	struct sm_module module;
 
+	/* buffers reused for the wrapped APDUs, see sc_sm_get_scratch_apdu() */
+	struct sc_apdu scratch_apdu;
+	unsigned char *scratch;
+	size_t scratch_size;
+	int scratch_busy;
+
 	unsigned long (*app_lock)(void);
 	void (*app_unlock)(void);
 } sm_context_t;
@@ -352,6 +366,9 @@ typedef struct sm_context   {
 int sc_sm_parse_answer(struct sc_card *, unsigned char *, size_t, struct sm_card_response *);
 int sc_sm_update_apdu_response(struct sc_card *, unsigned char *, size_t, int, struct sc_apdu *);
 int sc_sm_single_transmit(struct sc_card *, struct sc_apdu *);
+int sc_sm_get_scratch_apdu(struct sc_card *, size_t, size_t, struct sc_apdu **);
+void sc_sm_release_scratch_apdu(struct sc_card *, struct sc_apdu **);
+void sc_sm_free_scratch(struct sc_card *);
 
 #ifdef __cplusplus
 }
@@ -33,6 +33,7 @@ typedef unsigned char u8;
 #define SC_MAX_CARD_APPS		8
 #define SC_MAX_APDU_BUFFER_SIZE		261 /* takes account of: CLA INS P1 P2 Lc [255 byte of data] Le */
 #define SC_MAX_EXT_APDU_BUFFER_SIZE	65538
+#define SC_MAX_APDU_BATCH		16
 #define SC_MAX_PIN_SIZE			256 /* OpenPGP card has 254 max */
 #define SC_MAX_ATR_SIZE			33
 #define SC_MAX_AID_SIZE			16
@@ -244,6 +245,7 @@ typedef struct sc_file {
 	unsigned char *encoded_content;	/* file's content encoded to be used in the file creation command */
 	size_t encoded_content_len;	/* size of file's encoded content in bytes */
 
+	unsigned int refcount;	/* see sc_file_ref() */
 	unsigned int magic;
 } sc_file_t;
 
@@ -272,6 +274,9 @@ typedef struct sc_file {
  * returns 0x6Cxx (wrong length)
  */
 #define SC_APDU_FLAGS_NO_RETRY_WL	0x00000004UL
+/* the response buffer has room for two more bytes than resplen, so that
+ * the reader driver can receive the response with SW1 SW2 in place */
+#define SC_APDU_FLAGS_RESP_SLACK	0x00000008UL
 
 #define SC_APDU_ALLOCATE_FLAG		0x01
 #define SC_APDU_ALLOCATE_FLAG_DATA	0x02
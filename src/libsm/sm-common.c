@@ -41,6 +41,7 @@
 #endif
 
 #include <openssl/des.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #include "libopensc/opensc.h"
@@ -79,39 +80,33 @@
 
 
 /*
- * Inspired by or taken from OpenSSL crypto/des/cbc3_enc.c
+ * CBC en/decryption with zero IV and without padding, in one pass over the data.
+ * 'out' has to be at least 'len' bytes long and may be the same as 'in'.
  */
-static void
-DES_3cbc_encrypt(DES_cblock *input, DES_cblock *output, long length,
-		 DES_key_schedule *ks1, DES_key_schedule *ks2, DES_cblock *iv,
-		 int enc)
-	{
-	int off=((int)length-1)/8;
-	long l8=((length+7)/8)*8;
-	DES_cblock icv_out;
-
-	memset(&icv_out, 0, sizeof(icv_out));
-	if (enc == DES_ENCRYPT)   {
-		DES_cbc_encrypt((unsigned char*)input,
-				(unsigned char*)output,length,ks1,iv,enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks2,iv,!enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks1,iv,enc);
-		if ((unsigned)length >= sizeof(DES_cblock))
-			memcpy(icv_out,output[off],sizeof(DES_cblock));
-	}
-	else   {
-		if ((unsigned)length >= sizeof(DES_cblock))
-			memcpy(icv_out,input[off],sizeof(DES_cblock));
-		DES_cbc_encrypt((unsigned char*)input,
-				(unsigned char*)output,l8,ks1,iv,enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks2,iv,!enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,length,ks1,iv,enc);
-	}
-	memcpy(*iv,icv_out,sizeof(DES_cblock));
+static int
+sm_cbc_crypt(const EVP_CIPHER *cipher, const unsigned char *key,
+		const unsigned char *in, size_t len, unsigned char *out, int enc)
+{
+	EVP_CIPHER_CTX *ctx;
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	int outl = 0, tmpl = 0, ok;
+
+	if (len % EVP_CIPHER_block_size(cipher))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memset(iv, 0, sizeof(iv));
+	ok = EVP_CipherInit_ex(ctx, cipher, NULL, key, iv, enc)
+		&& EVP_CIPHER_CTX_set_padding(ctx, 0)
+		&& EVP_CipherUpdate(ctx, out, &outl, in, (int)len)
+		&& EVP_CipherFinal_ex(ctx, out + outl, &tmpl);
+	EVP_CIPHER_CTX_free(ctx);
+
+	if (!ok || (size_t)(outl + tmpl) != len)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
 }
 
 
@@ -227,36 +222,111 @@ DES_cbc_cksum_3des(const unsigned char *in, DES_cblock *output,
 }
 
 
+static void
+sm_des_mac_block(struct sm_des_mac *mac, int last)
+{
+	int ii;
+
+	for (ii = 0; ii < 8; ii++)
+		mac->chain[ii] ^= mac->block[ii];
+
+	if (last || !mac->retail)
+		DES_ecb3_encrypt((const_DES_cblock *)mac->chain, &mac->chain,
+				&mac->ks1, &mac->ks2, &mac->ks1, DES_ENCRYPT);
+	else
+		DES_ecb_encrypt((const_DES_cblock *)mac->chain, &mac->chain,
+				&mac->ks1, DES_ENCRYPT);
+	mac->block_len = 0;
+}
+
+
+void
+sm_des_mac_init(struct sm_des_mac *mac, const unsigned char *key,
+		const_DES_cblock *icv, int retail)
+{
+	DES_set_key_unchecked((const_DES_cblock *)key, &mac->ks1);
+	DES_set_key_unchecked((const_DES_cblock *)(key + 8), &mac->ks2);
+	memcpy(mac->chain, icv, sizeof(DES_cblock));
+	mac->block_len = 0;
+	mac->retail = retail;
+}
+
+
+void
+sm_des_mac_update(struct sm_des_mac *mac, const unsigned char *in, size_t in_len)
+{
+	size_t len;
+
+	while (in_len)   {
+		/* the last block is encrypted differently: keep it until more data arrives */
+		if (mac->block_len == 8)
+			sm_des_mac_block(mac, 0);
+
+		len = 8 - mac->block_len;
+		if (len > in_len)
+			len = in_len;
+		memcpy(mac->block + mac->block_len, in, len);
+		mac->block_len += len;
+		in += len;
+		in_len -= len;
+	}
+}
+
+
+/*
+ * ISO 7816 padding is added when forced or when the absorbed data
+ * is not a non-empty multiple of the block size.
+ */
+void
+sm_des_mac_final(struct sm_des_mac *mac, int force_padding, DES_cblock *out)
+{
+	if (force_padding && mac->block_len == 8)
+		sm_des_mac_block(mac, 0);
+
+	if (mac->block_len < 8)   {
+		mac->block[mac->block_len] = 0x80;
+		memset(mac->block + mac->block_len + 1, 0, 7 - mac->block_len);
+		mac->block_len = 8;
+	}
+	sm_des_mac_block(mac, 1);
+
+	memcpy(out, mac->chain, sizeof(DES_cblock));
+	OPENSSL_cleanse(mac, sizeof(*mac));
+}
+
+
 int
 sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 		unsigned char **out, int *out_len)
 {
-	int ii;
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
-
+	EVP_CIPHER_CTX *ctx;
+	int outl = 0, tmpl = 0, ok;
 
-	if (!out || !out_len)
+	if (!out || !out_len || data_len < 0)
 		return -1;
 
-
 	*out_len = data_len + 7;
 	*out_len -= *out_len % 8;
 
-	*out = malloc(*out_len);
+	*out = calloc(1, *out_len);
 	if (!(*out))
 		return -1;
-
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	for (ii=0; ii<data_len; ii+=8)
-		DES_ecb2_encrypt( (DES_cblock *)(data + ii),
-				(DES_cblock *)(*out + ii), &ks, &ks2, DES_ENCRYPT);
-
+	memcpy(*out, data, data_len);
+
+	/* every block is encrypted on its own: two key triple DES in ECB mode */
+	ctx = EVP_CIPHER_CTX_new();
+	ok = ctx != NULL
+		&& EVP_EncryptInit_ex(ctx, EVP_des_ede_ecb(), NULL, key, NULL)
+		&& EVP_CIPHER_CTX_set_padding(ctx, 0)
+		&& EVP_EncryptUpdate(ctx, *out, &outl, *out, *out_len)
+		&& EVP_EncryptFinal_ex(ctx, *out + outl, &tmpl);
+	EVP_CIPHER_CTX_free(ctx);
+
+	if (!ok) {
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
 	return 0;
 }
 
@@ -266,31 +336,23 @@ sm_decrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 		unsigned char *data, size_t data_len,
 		unsigned char **out, size_t *out_len)
 {
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
-	DES_cblock icv={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-	size_t st;
+	int rv;
 
 	LOG_FUNC_CALLED(ctx);
-	if (!out || !out_len)
+	if (!out || !out_len || (data_len % 8))
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "SM decrypt_des_cbc3: invalid input arguments");
 
-	*out_len = data_len + 7;
-	*out_len -= *out_len % 8;
-
-	*out = malloc(*out_len);
+	*out_len = data_len;
+	*out = malloc(data_len ? data_len : 1);
 	if (!(*out))
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM decrypt_des_cbc3: allocation error");
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((DES_cblock *)(data + st),
-				(DES_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_DECRYPT);
+	rv = sm_cbc_crypt(EVP_des_ede_cbc(), key, data, data_len, *out, 0);
+	if (rv < 0) {
+		free(*out);
+		*out = NULL;
+	}
+	LOG_TEST_RET(ctx, rv, "SM decrypt_des_cbc3: decryption error");
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
@@ -301,11 +363,8 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 		const unsigned char *in, size_t in_len,
 		unsigned char **out, size_t *out_len, int not_force_pad)
 {
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
-	DES_cblock icv={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-	unsigned char *data;
-	size_t data_len, st;
+	size_t data_len;
+	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "SM encrypt_des_cbc3: not_force_pad:%i,in_len:%i", not_force_pad, in_len);
@@ -318,33 +377,27 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	*out = NULL;
 	*out_len = 0;
 
-	data = malloc(in_len + 8);
-	if (data == NULL)
+	/* pad and encrypt in place in the output buffer */
+	*out = malloc(in_len + 8);
+	if (*out == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: allocation error");
 
 	if (in)
-		memcpy(data, in, in_len);
+		memcpy(*out, in, in_len);
 
-	memcpy(data + in_len, "\x80\0\0\0\0\0\0\0", 8);
+	memcpy(*out + in_len, "\x80\0\0\0\0\0\0\0", 8);
 	data_len = in_len + (not_force_pad ? 7 : 8);
 	data_len -= (data_len%8);
-	sc_log(ctx, "SM encrypt_des_cbc3: data to encrypt (len:%i,%s)", data_len, sc_dump_hex(data, data_len));
+	sc_log(ctx, "SM encrypt_des_cbc3: data to encrypt (len:%i,%s)", data_len, sc_dump_hex(*out, data_len));
 
-	*out_len = data_len;
-	*out = malloc(data_len + 8);
-	if (*out == NULL)
-		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: failure");
-
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((DES_cblock *)(data + st), (DES_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_ENCRYPT);
+	rv = sm_cbc_crypt(EVP_des_ede_cbc(), key, *out, data_len, *out, 1);
+	if (rv < 0) {
+		free(*out);
+		*out = NULL;
+	}
+	LOG_TEST_RET(ctx, rv, "SM encrypt_des_cbc3: encryption error");
 
-	free(data);
+	*out_len = data_len;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -357,7 +410,7 @@ sm_incr_ssc(unsigned char *ssc, size_t ssc_len)
 	if (!ssc)
 		return;
 
-	for (ii = ssc_len - 1;ii >= 0; ii++)   {
+	for (ii = ssc_len - 1;ii >= 0; ii--)   {
 		*(ssc + ii) += 1;
 		if (*(ssc + ii) != 0)
 			break;
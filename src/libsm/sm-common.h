@@ -35,6 +35,25 @@ DES_LONG DES_cbc_cksum_3des(const unsigned char *in, DES_cblock *output, long le
 DES_LONG DES_cbc_cksum_3des_emv96(const unsigned char *in, DES_cblock *output,
 		long length, DES_key_schedule *schedule, DES_key_schedule *schedule2,
 		const_DES_cblock *ivec);
+
+/*
+ * Incremental DES CBC-MAC: header, data and trailer are absorbed in place,
+ * without building a padded copy of the message.
+ * With 'retail' set all blocks but the last are single DES encrypted
+ * (ISO 9797-1 algorithm 3), otherwise every block is 3DES encrypted.
+ */
+struct sm_des_mac {
+	DES_key_schedule ks1, ks2;
+	DES_cblock chain;
+	unsigned char block[8];
+	size_t block_len;
+	int retail;
+};
+
+void sm_des_mac_init(struct sm_des_mac *mac, const unsigned char *key,
+		const_DES_cblock *icv, int retail);
+void sm_des_mac_update(struct sm_des_mac *mac, const unsigned char *in, size_t in_len);
+void sm_des_mac_final(struct sm_des_mac *mac, int force_padding, DES_cblock *out);
 int sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 		unsigned char **out, int *out_len);
 int sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
@@ -132,6 +132,43 @@ struct md_pkcs15_container {
 	unsigned size_key_exchange, size_sign;
 
 	struct sc_pkcs15_object *cert_obj, *prkey_obj, *pubkey_obj;
+
+	/* SubjectPublicKeyInfo of the container key, encoded on first use */
+	struct sc_pkcs15_der pubkey_der;
+};
+
+/*
+ * Answers of CardGetProperty() kept for the card association. A static
+ * property is computed once; a dynamic one is kept as long as the
+ * 'cardcf' freshness counter it depends on has not changed.
+ */
+#define MD_PROPERTY_STATIC		0
+#define MD_PROPERTY_CONTAINERS		1
+
+/* check of the dwVersion the caller puts in the structure to fill */
+#define MD_PROPERTY_VERSION_NONE	0
+#define MD_PROPERTY_VERSION_AT_MOST	1
+#define MD_PROPERTY_VERSION_OR_ZERO	2
+#define MD_PROPERTY_VERSION_EXACT	3
+
+struct md_property_rule {
+	LPCWSTR name;
+	int freshness;
+	/* error when the buffer of the caller is too small */
+	DWORD short_buffer_error;
+	int version_check;
+	DWORD version;
+};
+
+#define MD_PROPERTY_CACHE_SIZE	8
+#define MD_PROPERTY_MAX_LEN	64
+
+struct md_property_cache {
+	const struct md_property_rule *rule;
+	DWORD flags;
+	WORD freshness;
+	DWORD len;
+	BYTE data[MD_PROPERTY_MAX_LEN];
 };
 
 typedef struct _VENDOR_SPECIFIC
@@ -155,6 +192,9 @@ typedef struct _VENDOR_SPECIFIC
 	 */
 	HWND hwndParent;
 	LPWSTR wszPinContext;
+
+	struct md_property_cache properties[MD_PROPERTY_CACHE_SIZE];
+	unsigned nproperties;
 }VENDOR_SPECIFIC;
 
 /*
@@ -202,6 +242,7 @@ static const struct sc_asn1_entry c_asn1_md_container[C_ASN1_MD_CONTAINER_SIZE]
 static int associate_card(PCARD_DATA pCardData);
 static int disassociate_card(PCARD_DATA pCardData);
 static DWORD md_get_cardcf(PCARD_DATA pCardData, CARD_CACHE_FILE_FORMAT **out);
+static DWORD md_fill_cmapfile(PCARD_DATA pCardData, struct md_file *file);
 static DWORD md_pkcs15_delete_object(PCARD_DATA pCardData, struct sc_pkcs15_object *obj);
 static DWORD md_fs_init(PCARD_DATA pCardData);
 
@@ -297,6 +338,45 @@ static void print_werror(PCARD_DATA pCardData, char *str)
 	LocalFree(buf);
 }
 
+/*
+ * Base CSP gave new handles: keep the bound card and the 'soft' file system
+ * if the handles lead to the same card that was not exchanged or reset
+ * since. The 'cardcf' with its freshness counters is then kept as well,
+ * so that the data cached by Base CSP stays valid.
+ */
+static DWORD
+md_reuse_card(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	CARD_CACHE_FILE_FORMAT *cardcf = NULL;
+	int r;
+
+	if (!vs->ctx || !vs->reader || !vs->card || !vs->p15card)
+		return SCARD_E_UNKNOWN_CARD;
+	if (md_static_data.flags & MD_STATIC_FLAG_CONTEXT_DELETED)
+		return SCARD_E_UNKNOWN_CARD;
+	if (md_get_cardcf(pCardData, &cardcf) != SCARD_S_SUCCESS)
+		return SCARD_E_FILE_NOT_FOUND;
+	if (pCardData->cbAtr != vs->card->atr.len
+			|| memcmp(pCardData->pbAtr, vs->card->atr.value, vs->card->atr.len))
+		return SCARD_E_UNKNOWN_CARD;
+
+	vs->hSCardCtx = pCardData->hSCardCtx;
+	vs->hScard = pCardData->hScard;
+
+	/* The reader object is kept, and counts the card exchanges */
+	r = sc_ctx_use_reader(vs->ctx, &vs->hSCardCtx, &vs->hScard);
+	if (r != SC_SUCCESS || sc_ctx_get_reader(vs->ctx, 0) != vs->reader)
+		return SCARD_E_UNKNOWN_CARD;
+	if (!(vs->reader->flags & SC_READER_CARD_PRESENT)
+			|| vs->card->card_generation != vs->reader->card_generation)
+		return SCARD_E_UNKNOWN_CARD;
+
+	logprintf(pCardData, 1, "same card (generation %u), containers/files freshness %u/%u\n",
+			vs->reader->card_generation, cardcf->wContainersFreshness, cardcf->wFilesFreshness);
+	return SCARD_S_SUCCESS;
+}
+
 /*
  * check if the card has been removed, or the
  * caller has changed the handles.
@@ -323,6 +403,11 @@ check_reader_status(PCARD_DATA pCardData)
 	if (pCardData->hSCardCtx != vs->hSCardCtx || pCardData->hScard != vs->hScard) {
 		logprintf (pCardData, 1, "HANDLES CHANGED from 0x%08X 0x%08X\n", vs->hSCardCtx, vs->hScard);
 
+		r = md_reuse_card(pCardData);
+		logprintf(pCardData, 1, "md_reuse_card r = 0x%08X\n", r);
+		if (r == SCARD_S_SUCCESS)
+			return SCARD_S_SUCCESS;
+
 		// Basically a mini AcquireContext
 		r = disassociate_card(pCardData);
 		logprintf(pCardData, 1, "disassociate_card r = 0x%08X\n", r);
@@ -1120,9 +1205,12 @@ md_set_cardid(PCARD_DATA pCardData, struct md_file *file)
 }
 
 /*
- * Return content of the 'soft' file.
+ * Materialize the content of a 'soft' file that is filled on first access:
+ * 'cmapfile' and the certificates of the containers.
+ * The certificate is read from the card, or from the file cache if enabled,
+ * only when Base CSP asks for that particular file.
  */
-static void
+static DWORD
 md_fs_read_content(PCARD_DATA pCardData, char *parent, struct md_file *file)
 {
 	VENDOR_SPECIFIC *vs;
@@ -1130,23 +1218,26 @@ md_fs_read_content(PCARD_DATA pCardData, char *parent, struct md_file *file)
 	DWORD dwret;
 
 	if (!pCardData || !file)
-		return;
+		return SCARD_E_INVALID_PARAMETER;
 
 	vs = pCardData->pvVendorSpecific;
 
 	dwret = md_fs_find_directory(pCardData, NULL, parent, &dir);
 	if (dwret != SCARD_S_SUCCESS)   {
 		logprintf(pCardData, 2, "find directory '%s' error: %X\n", parent ? parent : "<null>", dwret);
-		return;
+		return dwret;
 	}
 	else if (!dir)   {
 		logprintf(pCardData, 2, "directory '%s' not found\n", parent ? parent : "<null>");
-		return;
+		return SCARD_E_DIR_NOT_FOUND;
 	}
 
 	if (!strcmp(dir->name, "mscp"))   {
 		int idx, rv;
 
+		if (!strcmp(file->name, "cmapfile"))
+			return md_fill_cmapfile(pCardData, file);
+
 		if(sscanf(file->name, "ksc%d", &idx) > 0)   {
 		}
 		else if(sscanf(file->name, "kxc%d", &idx) > 0)   {
@@ -1163,19 +1254,37 @@ md_fs_read_content(PCARD_DATA pCardData, char *parent, struct md_file *file)
 			rv = sc_pkcs15_read_certificate(vs->p15card, cert_info, &cert);
 			if(rv)   {
 				logprintf(pCardData, 2, "Cannot read certificate idx:%i: sc-error %d\n", idx, rv);
-				logprintf(pCardData, 2, "set cardcf from 'DATA' pkcs#15 object\n");
-				return;
+				return SCARD_E_FILE_NOT_FOUND;
 			}
 
-			file->size = cert->data.len;
 			file->blob = pCardData->pfnCspAlloc(cert->data.len);
+			if (!file->blob)   {
+				sc_pkcs15_free_certificate(cert);
+				return SCARD_E_NO_MEMORY;
+			}
+			file->size = cert->data.len;
 			CopyMemory(file->blob, cert->data.value, cert->data.len);
 			sc_pkcs15_free_certificate(cert);
 		}
 	}
-	else   {
-		return;
-	}
+
+	return SCARD_S_SUCCESS;
+}
+
+/*
+ * Make sure that the content of 'cmapfile' and of the containers includes
+ * the attributes kept in the 'DATA' objects, before they are used or changed.
+ */
+static DWORD
+md_cmapfile_ready(PCARD_DATA pCardData)
+{
+	struct md_file *file = NULL;
+
+	md_fs_find_file(pCardData, "mscp", "cmapfile", &file);
+	if (!file || file->blob)
+		return SCARD_S_SUCCESS;
+
+	return md_fill_cmapfile(pCardData, file);
 }
 
 /*
@@ -1273,28 +1382,28 @@ md_set_cardapps(PCARD_DATA pCardData, struct md_file *file)
 	return SCARD_S_SUCCESS;
 }
 
+static void
+md_container_release_pubkey(struct md_pkcs15_container *cont)
+{
+	if (cont->pubkey_der.value)
+		free(cont->pubkey_der.value);
+	cont->pubkey_der.value = NULL;
+	cont->pubkey_der.len = 0;
+}
+
 /*
- * Set the content of the 'soft' 'cmapfile':
+ * Prepare the 'soft' 'cmapfile' from the PKCS#15 metadata only:
  * 1. Initialize internal p15_contaniers with the existing private keys PKCS#15 objects;
- * 2. Try to read the content of the PKCS#15 'DATA' object 'CSP':'cmapfile',
- *        If some record from the 'DATA' object references an existing key:
- *    2a. Update the non-pkcs#15 attributes of the corresponding internal p15_container;
- *    2b. Change the index of internal p15_container according to the index from 'DATA' file.
- *        Records from 'DATA' file are ignored is they do not have
- *            the corresponding PKCS#15 private key object.
- * 3. Initalize the content of the 'soft' 'cmapfile' from the inernal p15-containers.
+ * 2. Add the 'kxc' and 'ksc' files of the containers with a certificate,
+ *    their content is read on first access.
+ * The content of 'cmapfile' itself is set by md_fill_cmapfile() on first access.
  */
 static DWORD
 md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 {
 	VENDOR_SPECIFIC *vs;
-	PCONTAINER_MAP_RECORD p;
-	sc_pkcs15_pubkey_t *pubkey = NULL;
-	unsigned char *cmap_buf = NULL;
-	size_t cmap_len;
 	DWORD dwret;
-	int ii, rv, conts_num, found_default = 0;
-	/* struct sc_pkcs15_data *data_object; */
+	int ii, rv, conts_num;
 	struct sc_pkcs15_object *prkey_objs[MD_MAX_KEY_CONTAINERS];
 
 	if (!pCardData || !file)
@@ -1302,11 +1411,6 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 
 	logprintf(pCardData, 0, "set 'cmapfile'\n");
 	vs = pCardData->pvVendorSpecific;
-	cmap_len = MD_MAX_KEY_CONTAINERS*sizeof(CONTAINER_MAP_RECORD);
-	cmap_buf = pCardData->pfnCspAlloc(cmap_len);
-	if(!cmap_buf)
-		return SCARD_E_NO_MEMORY;
-	memset(cmap_buf, 0, cmap_len);
 
 	rv = sc_pkcs15_get_objects(vs->p15card, SC_PKCS15_TYPE_PRKEY_RSA, prkey_objs, MD_MAX_KEY_CONTAINERS);
 	if (rv < 0)   {
@@ -1335,8 +1439,6 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 			cont->size_sign = prkey_info->cmap_record.keysize_sign;
 
 			cont->flags = prkey_info->cmap_record.flags;
-			if (cont->flags & CONTAINER_MAP_DEFAULT_CONTAINER)
-				found_default = 1;
 		}
 		else   {
 			size_t guid_len;
@@ -1370,6 +1472,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 
 		cont->id = prkey_info->id;
 		cont->prkey_obj = prkey_objs[ii];
+		md_container_release_pubkey(cont);
 
 		/* Try to find the friend objects: certficate and public key */
 		if (!sc_pkcs15_find_cert_by_id(vs->p15card, &cont->id, &cont->cert_obj))
@@ -1377,6 +1480,65 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 
 		if (!sc_pkcs15_find_pubkey_by_id(vs->p15card, &cont->id, &cont->pubkey_obj))
 			logprintf(pCardData, 2, "found public key friend '%s'\n", cont->pubkey_obj->label);
+
+		if (cont->cert_obj && (cont->flags & CONTAINER_MAP_VALID_CONTAINER))   {
+			char k_name[6];
+
+			if (cont->size_key_exchange)   {
+				snprintf((char *)k_name, sizeof(k_name), "kxc%02i", ii);
+				dwret = md_fs_add_file(pCardData, &(file->next), k_name, file->acl, NULL, 0, NULL);
+				if (dwret != SCARD_S_SUCCESS)
+					return dwret;
+			}
+
+			if (cont->size_sign)   {
+				snprintf((char *)k_name, sizeof(k_name), "ksc%02i", ii);
+				dwret = md_fs_add_file(pCardData, &(file->next), k_name, file->acl, NULL, 0, NULL);
+				if (dwret != SCARD_S_SUCCESS)
+					return dwret;
+			}
+		}
+	}
+
+	return SCARD_S_SUCCESS;
+}
+
+/*
+ * Set the content of the 'soft' 'cmapfile' prepared by md_set_cmapfile():
+ * 1. Try to read the content of the PKCS#15 'DATA' object 'CSP':'cmapfile',
+ *        If some record from the 'DATA' object references an existing key:
+ *    1a. Update the non-pkcs#15 attributes of the corresponding internal p15_container;
+ *    1b. Change the index of internal p15_container according to the index from 'DATA' file.
+ *        Records from 'DATA' file are ignored is they do not have
+ *            the corresponding PKCS#15 private key object.
+ * 2. Initalize the content of the 'soft' 'cmapfile' from the inernal p15-containers.
+ */
+static DWORD
+md_fill_cmapfile(PCARD_DATA pCardData, struct md_file *file)
+{
+	VENDOR_SPECIFIC *vs;
+	PCONTAINER_MAP_RECORD p;
+	unsigned char *cmap_buf = NULL;
+	size_t cmap_len;
+	DWORD dwret;
+	int ii, rv, conts_num = 0, found_default = 0;
+
+	if (!pCardData || !file)
+		return SCARD_E_INVALID_PARAMETER;
+
+	logprintf(pCardData, 0, "fill 'cmapfile'\n");
+	vs = pCardData->pvVendorSpecific;
+	cmap_len = MD_MAX_KEY_CONTAINERS*sizeof(CONTAINER_MAP_RECORD);
+	cmap_buf = pCardData->pfnCspAlloc(cmap_len);
+	if(!cmap_buf)
+		return SCARD_E_NO_MEMORY;
+	memset(cmap_buf, 0, cmap_len);
+
+	for (ii=0; ii<MD_MAX_KEY_CONTAINERS; ii++)   {
+		if (vs->p15_containers[ii].prkey_obj)
+			conts_num++;
+		if (vs->p15_containers[ii].flags & CONTAINER_MAP_DEFAULT_CONTAINER)
+			found_default = 1;
 	}
 
 	if (conts_num)   {
@@ -1438,24 +1600,6 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 			(p+ii)->wSigKeySizeBits = vs->p15_containers[ii].size_sign;
 			(p+ii)->wKeyExchangeKeySizeBits = vs->p15_containers[ii].size_key_exchange;
 
-			if (vs->p15_containers[ii].cert_obj)   {
-				char k_name[6];
-
-				if (vs->p15_containers[ii].size_key_exchange)   {
-					snprintf((char *)k_name, sizeof(k_name), "kxc%02i", ii);
-					dwret = md_fs_add_file(pCardData, &(file->next), k_name, file->acl, NULL, 0, NULL);
-					if (dwret != SCARD_S_SUCCESS)
-						return dwret;
-				}
-
-				if (vs->p15_containers[ii].size_sign)   {
-					snprintf((char *)k_name, sizeof(k_name), "ksc%02i", ii);
-					dwret = md_fs_add_file(pCardData, &(file->next), k_name, file->acl, NULL, 0, NULL);
-					if (dwret != SCARD_S_SUCCESS)
-						return dwret;
-				}
-			}
-
 			logprintf(pCardData, 7, "cmapfile entry(%d) '%s' ",ii, vs->p15_containers[ii].guid);
 			loghex(pCardData, 7, (PBYTE) (p+ii), sizeof(CONTAINER_MAP_RECORD));
 		}
@@ -1767,6 +1911,7 @@ md_pkcs15_generate_key(PCARD_DATA pCardData, DWORD idx, DWORD key_type, DWORD ke
 	cont->id = ((struct sc_pkcs15_prkey_info *)cont->prkey_obj->data)->id;
 	cont->index = idx;
 	cont->flags = CONTAINER_MAP_VALID_CONTAINER;
+	md_container_release_pubkey(cont);
 
 	logprintf(pCardData, 3, "MdGenerateKey(): generated key(idx:%i,id:%s,guid:%s)\n",
 			idx, sc_pkcs15_print_id(&cont->id),cont->guid);
@@ -1911,6 +2056,7 @@ md_pkcs15_store_key(PCARD_DATA pCardData, DWORD idx, DWORD key_type, BYTE *blob,
 	cont->id = ((struct sc_pkcs15_prkey_info *)cont->prkey_obj->data)->id;
 	cont->index = idx;
 	cont->flags |= CONTAINER_MAP_VALID_CONTAINER;
+	md_container_release_pubkey(cont);
 
 	logprintf(pCardData, 3, "MdStoreKey(): stored key(idx:%i,id:%s,guid:%s)\n", idx, sc_pkcs15_print_id(&cont->id),cont->guid);
 	dwret = SCARD_S_SUCCESS;
@@ -2126,6 +2272,11 @@ DWORD WINAPI CardCreateContainer(__in PCARD_DATA pCardData,
 		return SCARD_E_UNSUPPORTED_FEATURE;
 	}
 
+	/* The GUID of the container may come from its 'DATA' object */
+	dwret = md_cmapfile_ready(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
 	if (dwFlags & CARD_CREATE_CONTAINER_KEY_GEN)   {
 		dwret = md_pkcs15_generate_key(pCardData, bContainerIndex, dwKeySpec, dwKeySize);
 		if (dwret != SCARD_S_SUCCESS)   {
@@ -2156,45 +2307,25 @@ typedef struct {
 	RSAPUBKEY rsapubkey;
 } PUBKEYSTRUCT_BASE;
 
-DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwFlags,
-	__in PCONTAINER_INFO pContainerInfo)
+/*
+ * Get the SubjectPublicKeyInfo of the container key.
+ * It is taken from the private key object, the public key object or the certificate,
+ * whichever comes first, and kept in the container for the following calls.
+ * The returned value belongs to the container.
+ */
+static DWORD
+md_container_get_pubkey(PCARD_DATA pCardData, struct md_pkcs15_container *cont, struct sc_pkcs15_der *out)
 {
-	VENDOR_SPECIFIC *vs = NULL;
-	DWORD sz = 0;
-	DWORD ret = SCARD_F_UNKNOWN_ERROR;
-	struct md_pkcs15_container *cont = NULL;
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
 	struct sc_pkcs15_der pubkey_der;
+	DWORD ret = SCARD_F_UNKNOWN_ERROR;
 	int rv;
 
-	if(!pCardData)
-		return SCARD_E_INVALID_PARAMETER;
-	if (!pContainerInfo)
-		return SCARD_E_INVALID_PARAMETER;
-
-	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
-	logprintf(pCardData, 1, "CardGetContainerInfo bContainerIndex=%u, dwFlags=0x%08X, " \
-		"dwVersion=%u, cbSigPublicKey=%u, cbKeyExPublicKey=%u\n", \
-		bContainerIndex, dwFlags, pContainerInfo->dwVersion, \
-		pContainerInfo->cbSigPublicKey, pContainerInfo->cbKeyExPublicKey);
-
-	if (dwFlags)
-		return SCARD_E_INVALID_PARAMETER;
-	if (bContainerIndex >= MD_MAX_KEY_CONTAINERS)
-		return SCARD_E_NO_KEY_CONTAINER;
-	if (pContainerInfo->dwVersion < 0 || pContainerInfo->dwVersion >  CONTAINER_INFO_CURRENT_VERSION)
-		return ERROR_REVISION_MISMATCH;
-
-	pContainerInfo->dwVersion = CONTAINER_INFO_CURRENT_VERSION;
-
-	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
-	cont = &vs->p15_containers[bContainerIndex];
-
-	if (!cont->prkey_obj)   {
-		logprintf(pCardData, 7, "Container %i is empty\n", bContainerIndex);
-		return SCARD_E_NO_KEY_CONTAINER;
+	if (cont->pubkey_der.value)   {
+		*out = cont->pubkey_der;
+		return SCARD_S_SUCCESS;
 	}
 
-	check_reader_status(pCardData);
 	pubkey_der.value = NULL;
 	pubkey_der.len = 0;
 
@@ -2246,11 +2377,58 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 			sc_pkcs15_free_certificate(cert);
 		}
 		else   {
-			logprintf(pCardData, 1, "certificate '%d' read error %d\n", bContainerIndex, rv);
+			logprintf(pCardData, 1, "certificate '%s' read error %d\n", cont->cert_obj->label, rv);
 			ret = SCARD_E_FILE_NOT_FOUND;
 		}
 	}
 
+	if (pubkey_der.value)
+		cont->pubkey_der = pubkey_der;
+
+	*out = cont->pubkey_der;
+	return ret;
+}
+
+DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwFlags,
+	__in PCONTAINER_INFO pContainerInfo)
+{
+	VENDOR_SPECIFIC *vs = NULL;
+	DWORD sz = 0;
+	DWORD ret = SCARD_F_UNKNOWN_ERROR;
+	struct md_pkcs15_container *cont = NULL;
+	struct sc_pkcs15_der pubkey_der;
+
+	if(!pCardData)
+		return SCARD_E_INVALID_PARAMETER;
+	if (!pContainerInfo)
+		return SCARD_E_INVALID_PARAMETER;
+
+	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
+	logprintf(pCardData, 1, "CardGetContainerInfo bContainerIndex=%u, dwFlags=0x%08X, " \
+		"dwVersion=%u, cbSigPublicKey=%u, cbKeyExPublicKey=%u\n", \
+		bContainerIndex, dwFlags, pContainerInfo->dwVersion, \
+		pContainerInfo->cbSigPublicKey, pContainerInfo->cbKeyExPublicKey);
+
+	if (dwFlags)
+		return SCARD_E_INVALID_PARAMETER;
+	if (bContainerIndex >= MD_MAX_KEY_CONTAINERS)
+		return SCARD_E_NO_KEY_CONTAINER;
+	if (pContainerInfo->dwVersion < 0 || pContainerInfo->dwVersion >  CONTAINER_INFO_CURRENT_VERSION)
+		return ERROR_REVISION_MISMATCH;
+
+	pContainerInfo->dwVersion = CONTAINER_INFO_CURRENT_VERSION;
+
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	cont = &vs->p15_containers[bContainerIndex];
+
+	if (!cont->prkey_obj)   {
+		logprintf(pCardData, 7, "Container %i is empty\n", bContainerIndex);
+		return SCARD_E_NO_KEY_CONTAINER;
+	}
+
+	check_reader_status(pCardData);
+
+	ret = md_container_get_pubkey(pCardData, cont, &pubkey_der);
 	if (!pubkey_der.value && (cont->size_sign || cont->size_key_exchange)) {
 		logprintf(pCardData, 2, "cannot find public key\n");
 		return SCARD_F_INTERNAL_ERROR;
@@ -2705,8 +2883,11 @@ DWORD WINAPI CardReadFile(__in PCARD_DATA pCardData,
 		return SCARD_E_FILE_NOT_FOUND;
 	}
 
-	if (!file->blob)
-		md_fs_read_content(pCardData, pszDirectoryName, file);
+	if (!file->blob)   {
+		DWORD dwret = md_fs_read_content(pCardData, pszDirectoryName, file);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
 
 	*ppbData = pCardData->pfnCspAlloc(file->size);
 	if(!*ppbData)
@@ -2749,6 +2930,10 @@ DWORD WINAPI CardWriteFile(__in PCARD_DATA pCardData,
 		return SCARD_E_FILE_NOT_FOUND;
 	}
 
+	dwret = md_cmapfile_ready(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
 	logprintf(pCardData, 7, "set content of '%s' to:\n",  NULLSTR(pszFileName));
 	loghex(pCardData, 7, pbData, cbData);
 
@@ -2873,6 +3058,13 @@ DWORD WINAPI CardGetFileInfo(__in PCARD_DATA pCardData,
 		return SCARD_E_FILE_NOT_FOUND;
 	}
 
+	/* The size is only known once the content is there */
+	if (!file->blob)   {
+		DWORD dwret = md_fs_read_content(pCardData, pszDirectoryName, file);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
+
 	pCardFileInfo->dwVersion = CARD_FILE_INFO_CURRENT_VERSION;
 	pCardFileInfo->cbFileSize = file->size;
 	pCardFileInfo->AccessCondition = file->acl;
@@ -2963,6 +3155,9 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	if (pInfo->dwVersion >= CARD_RSA_KEY_DECRYPT_INFO_VERSION_TWO)
 		logprintf(pCardData, 2, "  pPaddingInfo=%p dwPaddingType=0x%08X\n", pInfo->pPaddingInfo, pInfo->dwPaddingType);
 
+	if (pInfo->bContainerIndex >= MD_MAX_KEY_CONTAINERS)
+		return SCARD_E_NO_KEY_CONTAINER;
+
 	pkey = vs->p15_containers[pInfo->bContainerIndex].prkey_obj;
 	if (!pkey)   {
 		logprintf(pCardData, 2, "CardRSADecrypt prkey not found\n");
@@ -3098,13 +3293,14 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pIn
 	if (pInfo->bContainerIndex >= MD_MAX_KEY_CONTAINERS)
 		return SCARD_E_NO_KEY_CONTAINER;
 
+	/* The container array can be rebuilt by a re-association */
+	check_reader_status(pCardData);
+
 	pkey = vs->p15_containers[pInfo->bContainerIndex].prkey_obj;
 	if (!pkey)
 		return SCARD_E_NO_KEY_CONTAINER;
 	prkey_info = (struct sc_pkcs15_prkey_info *)(pkey->data);
 
-	check_reader_status(pCardData);
-
 	logprintf(pCardData, 2, "pInfo->dwVersion = %d\n", pInfo->dwVersion);
 
 	if (dataToSignLen < pInfo->cbData)
@@ -3479,6 +3675,127 @@ DWORD WINAPI CardSetContainerProperty(__in PCARD_DATA pCardData,
 }
 
 
+static const struct md_property_rule md_property_rules[] = {
+	{ CP_CARD_FREE_SPACE, MD_PROPERTY_CONTAINERS, SCARD_E_NO_MEMORY,
+		MD_PROPERTY_VERSION_AT_MOST, CARD_FREE_SPACE_INFO_CURRENT_VERSION },
+	{ CP_CARD_CAPABILITIES, MD_PROPERTY_STATIC, ERROR_INSUFFICIENT_BUFFER,
+		MD_PROPERTY_VERSION_OR_ZERO, CARD_CAPABILITIES_CURRENT_VERSION },
+	{ CP_CARD_KEYSIZES, MD_PROPERTY_STATIC, ERROR_INSUFFICIENT_BUFFER,
+		MD_PROPERTY_VERSION_OR_ZERO, CARD_KEY_SIZES_CURRENT_VERSION },
+	{ CP_CARD_GUID, MD_PROPERTY_STATIC, ERROR_INSUFFICIENT_BUFFER,
+		MD_PROPERTY_VERSION_NONE, 0 },
+	{ CP_CARD_SERIAL_NO, MD_PROPERTY_STATIC, ERROR_INSUFFICIENT_BUFFER,
+		MD_PROPERTY_VERSION_NONE, 0 },
+	{ CP_CARD_PIN_INFO, MD_PROPERTY_STATIC, ERROR_INSUFFICIENT_BUFFER,
+		MD_PROPERTY_VERSION_EXACT, PIN_INFO_CURRENT_VERSION },
+	{ NULL, 0, 0, 0, 0 }
+};
+
+static const struct md_property_rule *
+md_property_rule(LPCWSTR wszProperty)
+{
+	const struct md_property_rule *rule;
+
+	for (rule = md_property_rules; rule->name; rule++)
+		if (wcscmp(rule->name, wszProperty) == 0)
+			return rule;
+	return NULL;
+}
+
+/* Freshness counter of the 'cardcf' the property depends on */
+static BOOL
+md_property_freshness(PCARD_DATA pCardData, const struct md_property_rule *rule, WORD *freshness)
+{
+	CARD_CACHE_FILE_FORMAT *cardcf = NULL;
+
+	*freshness = 0;
+	if (rule->freshness == MD_PROPERTY_STATIC)
+		return TRUE;
+	if (md_get_cardcf(pCardData, &cardcf) != SCARD_S_SUCCESS)
+		return FALSE;
+	*freshness = cardcf->wContainersFreshness;
+	return TRUE;
+}
+
+static struct md_property_cache *
+md_property_find(VENDOR_SPECIFIC *vs, const struct md_property_rule *rule, DWORD dwFlags)
+{
+	unsigned ii;
+
+	for (ii = 0; ii < vs->nproperties; ii++)
+		if (vs->properties[ii].rule == rule && vs->properties[ii].flags == dwFlags)
+			return &vs->properties[ii];
+	return NULL;
+}
+
+/*
+ * Answers from the cache, with the checks of the buffer of the caller
+ * done in the same order as when computing the property.
+ * Returns FALSE if the property is to be computed.
+ */
+static BOOL
+md_property_from_cache(PCARD_DATA pCardData, LPCWSTR wszProperty, PBYTE pbData, DWORD cbData,
+		PDWORD pdwDataLen, DWORD dwFlags, DWORD *dwret)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	const struct md_property_rule *rule;
+	struct md_property_cache *entry;
+	WORD freshness;
+	DWORD version;
+
+	if (!vs || !vs->p15card || !(rule = md_property_rule(wszProperty)))
+		return FALSE;
+	entry = md_property_find(vs, rule, dwFlags);
+	if (!entry || !md_property_freshness(pCardData, rule, &freshness) || entry->freshness != freshness)
+		return FALSE;
+
+	*pdwDataLen = entry->len;
+	if (cbData < entry->len)   {
+		*dwret = rule->short_buffer_error;
+		return TRUE;
+	}
+	version = rule->version_check != MD_PROPERTY_VERSION_NONE ? *(DWORD *)pbData : 0;
+	if ((rule->version_check == MD_PROPERTY_VERSION_AT_MOST && version > rule->version)
+			|| (rule->version_check == MD_PROPERTY_VERSION_OR_ZERO && version != rule->version && version != 0)
+			|| (rule->version_check == MD_PROPERTY_VERSION_EXACT && version != rule->version))   {
+		*dwret = ERROR_REVISION_MISMATCH;
+		return TRUE;
+	}
+
+	CopyMemory(pbData, entry->data, entry->len);
+	logprintf(pCardData, 7, "returns cached '%S' ", wszProperty);
+	loghex(pCardData, 7, pbData, *pdwDataLen);
+	*dwret = SCARD_S_SUCCESS;
+	return TRUE;
+}
+
+static void
+md_property_store(PCARD_DATA pCardData, LPCWSTR wszProperty, const BYTE *pbData, DWORD len, DWORD dwFlags)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	const struct md_property_rule *rule;
+	struct md_property_cache *entry;
+	WORD freshness;
+
+	if (!vs || !vs->p15card || len > MD_PROPERTY_MAX_LEN || !(rule = md_property_rule(wszProperty)))
+		return;
+	if (!md_property_freshness(pCardData, rule, &freshness))
+		return;
+
+	entry = md_property_find(vs, rule, dwFlags);
+	if (!entry)   {
+		if (vs->nproperties == MD_PROPERTY_CACHE_SIZE)
+			return;
+		entry = &vs->properties[vs->nproperties++];
+	}
+	entry->rule = rule;
+	entry->flags = dwFlags;
+	entry->freshness = freshness;
+	entry->len = len;
+	CopyMemory(entry->data, pbData, len);
+}
+
+
 DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 	__in LPCWSTR wszProperty,
 	__out_bcount_part_opt(cbData, *pdwDataLen) PBYTE pbData,
@@ -3501,6 +3818,9 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 
 	check_reader_status(pCardData);
 
+	if (md_property_from_cache(pCardData, wszProperty, pbData, cbData, pdwDataLen, dwFlags, &dwret))
+		return dwret;
+
 	if (wcscmp(CP_CARD_FREE_SPACE,wszProperty) == 0)   {
 		PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo = (PCARD_FREE_SPACE_INFO )pbData;
 		if (pdwDataLen)
@@ -3670,6 +3990,8 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 
 	}
 
+	md_property_store(pCardData, wszProperty, pbData, *pdwDataLen, dwFlags);
+
 	logprintf(pCardData, 7, "returns '%S' ", wszProperty);
 	loghex(pCardData, 7, pbData, *pdwDataLen);
 	return SCARD_S_SUCCESS;
@@ -3921,6 +4243,7 @@ static int associate_card(PCARD_DATA pCardData)
 static int disassociate_card(PCARD_DATA pCardData)
 {
 	VENDOR_SPECIFIC *vs;
+	int ii;
 
 	logprintf(pCardData, 1, "disassociate_card\n");
 	if (!pCardData)
@@ -3930,6 +4253,10 @@ static int disassociate_card(PCARD_DATA pCardData)
 
 	vs->obj_user_pin = NULL;
 	vs->obj_sopin = NULL;
+	vs->nproperties = 0;
+
+	for (ii = 0; ii < MD_MAX_KEY_CONTAINERS; ii++)
+		md_container_release_pubkey(&vs->p15_containers[ii]);
 
 	if(vs->p15card)   {
 		logprintf(pCardData, 6, "sc_pkcs15_unbind\n");
@@ -6,7 +6,7 @@ TARGET3			= pkcs11-spy.dll
 
 OBJECTS			= pkcs11-global.obj pkcs11-session.obj pkcs11-object.obj misc.obj slot.obj \
 			  mechanism.obj openssl.obj framework-pkcs15.obj framework-pkcs15init.obj \
-			  debug.obj pkcs11-display.obj versioninfo-pkcs11.res
+			  debug.obj pkcs11-display.obj pkcs11-async.obj versioninfo-pkcs11.res
 OBJECTS3		= pkcs11-spy.obj pkcs11-display.obj versioninfo-pkcs11-spy.res
 
 all: versioninfo-pkcs11.res $(TARGET1) $(TARGET2) $(TARGET3) versioninfo-pkcs11-spy.res
@@ -168,6 +168,10 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line,
 			const char *info,
 			CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
+	/* formatting the values is the expensive part */
+	if (context != NULL && context->debug < level)
+		return;
+
 	if (ulCount == 0) {
 		sc_do_log(context, level,
 			file, line, function,
@@ -27,6 +27,7 @@
 
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
+#include <openssl/sha.h>
 #endif
 
 #include "sc-pkcs11.h"
@@ -36,6 +37,13 @@
 
 struct pkcs15_slot_data {
 	struct sc_pkcs15_object *auth_obj;
+	/* PIN status of auth_obj read from the card, see pin_info_cached() */
+	sc_timestamp_t pin_info_expires;
+	unsigned int pin_info_epoch;
+	unsigned int pin_info_generation;
+	/* generation of the card shared with other processes, see
+	 * sc_card_shared_generation() */
+	unsigned int pin_info_shared;
 };
 #define slot_data(p)		((struct pkcs15_slot_data *) (p))
 #define slot_data_auth(p)	(((p) && slot_data(p)) ? slot_data(p)->auth_obj : NULL)
@@ -53,14 +61,33 @@ struct pkcs15_slot_data {
 	}                                       \
 	attr->ulValueLen = size;
 
-#define MAX_OBJECTS	64
+/* Label of the spare key pairs of the key pool, see pkcs15_refill_key_pool() */
+#define KEY_POOL_LABEL	"OpenSC key pool"
+#define KEY_POOL_USAGE	(SC_PKCS15INIT_X509_DIGITAL_SIGNATURE \
+			| SC_PKCS15INIT_X509_KEY_ENCIPHERMENT | SC_PKCS15INIT_X509_DATA_ENCIPHERMENT)
+#define MAX_FW_SLOTS	16
 struct pkcs15_fw_data {
 	struct sc_pkcs15_card *		p15_card;
-	struct pkcs15_any_object *	objects[MAX_OBJECTS];
+	struct pkcs15_any_object **	objects;
 	unsigned int			num_objects;
+	unsigned int			max_objects;
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
+
+	/* Data objects not created yet, see pkcs15_load_objects() */
+	unsigned int			data_objects_pending;
+	/* Slots created for this framework data and the one holding the public objects */
+	struct sc_pkcs11_slot *		slots[MAX_FW_SLOTS];
+	unsigned int			num_slots;
+	struct sc_pkcs11_slot *		public_slot;
+
+	/* Incremented whenever the PIN status on the card may have changed */
+	unsigned int			pin_info_epoch;
+
+	/* Random bytes not handed out yet, see pkcs15_get_random() */
+	unsigned char *			random_pool;
+	size_t				random_pool_len;
 };
 
 struct pkcs15_any_object {
@@ -101,6 +128,11 @@ struct pkcs15_pubkey_object {
 
 	struct sc_pkcs15_pubkey_info *	pub_info;	/* NULL for key extracted from cert */
 	struct sc_pkcs15_pubkey *	pub_data;
+
+	/* CKA_EC_POINT encoded from pub_data */
+	const struct sc_pkcs15_pubkey *	ec_point_key;
+	u8 *				ec_point;
+	size_t				ec_point_len;
 };
 #define pub_flags		base.base.flags
 #define pub_p15obj		base.p15_object
@@ -161,7 +193,7 @@ static CK_RV	get_modulus_bits(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
 static CK_RV	get_usage_bit(unsigned int usage, CK_ATTRIBUTE_PTR attr);
 static CK_RV	get_gostr3410_params(const u8 *, size_t, CK_ATTRIBUTE_PTR);
-static CK_RV	get_ec_pubkey_point(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
+static CK_RV	get_ec_pubkey_point(struct pkcs15_pubkey_object *, CK_ATTRIBUTE_PTR);
 static CK_RV	get_ec_pubkey_params(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
 static int	lock_card(struct pkcs15_fw_data *);
 static int	unlock_card(struct pkcs15_fw_data *);
@@ -319,6 +351,12 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 			rv = sc_pkcs15_unbind(fw_data->p15_card);
 		fw_data->p15_card = NULL;
 
+		if (fw_data->random_pool) {
+			sc_mem_clear(fw_data->random_pool, sc_pkcs11_conf.random_pool_size);
+			free(fw_data->random_pool);
+		}
+
+		free(fw_data->objects);
 		free(fw_data);
 		p11card->fws_data[idx] = NULL;
 	}
@@ -398,6 +436,150 @@ set_cka_label(CK_ATTRIBUTE_PTR attr, char *label)
 }
 #endif
 
+/*
+ * Released object wrappers are kept on a free list per wrapper type
+ * (certificate, keys, data objects all differ in size) and handed out
+ * again when the next card is bound, up to object_pool_size per type.
+ */
+#define OBJECT_POOL_TYPES	8
+
+struct pool_entry {
+	struct pool_entry *next;
+};
+
+struct object_pool {
+	size_t size;
+	struct pool_entry *free_list;
+	unsigned int retained;
+	/* statistics, logged by sc_pkcs11_object_pool_free() */
+	unsigned long allocated, reused, dropped;
+};
+
+static struct object_pool object_pools[OBJECT_POOL_TYPES];
+
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+/* card_detect() may bind several cards in parallel, see bind_workers */
+static pthread_mutex_t object_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define object_pools_lock()	pthread_mutex_lock(&object_pools_mutex)
+#define object_pools_unlock()	pthread_mutex_unlock(&object_pools_mutex)
+#else
+#define object_pools_lock()
+#define object_pools_unlock()
+#endif
+
+static struct object_pool *
+object_pool_get(size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < OBJECT_POOL_TYPES; i++) {
+		if (object_pools[i].size == size)
+			return &object_pools[i];
+		if (object_pools[i].size == 0) {
+			object_pools[i].size = size;
+			return &object_pools[i];
+		}
+	}
+	return NULL;
+}
+
+static void *
+object_pool_alloc(size_t size)
+{
+	struct object_pool *pool;
+	struct pool_entry *entry = NULL;
+
+	object_pools_lock();
+	pool = object_pool_get(size);
+	if (pool && pool->free_list) {
+		entry = pool->free_list;
+		pool->free_list = entry->next;
+		pool->retained--;
+		pool->reused++;
+	} else if (pool) {
+		pool->allocated++;
+	}
+	object_pools_unlock();
+
+	if (entry == NULL) {
+		/* pooled objects stay accounted until they are freed */
+		entry = calloc(1, size);
+		if (entry)
+			sc_mem_account_alloc(SC_MEM_PKCS11_OBJECTS, size);
+		return entry;
+	}
+	memset(entry, 0, size);
+	return entry;
+}
+
+/* The caller has cleared the object */
+static void
+object_pool_release(void *obj, size_t size)
+{
+	struct object_pool *pool;
+	struct pool_entry *entry = (struct pool_entry *) obj;
+
+	object_pools_lock();
+	pool = object_pool_get(size);
+	if (pool && pool->retained < sc_pkcs11_conf.object_pool_size) {
+		entry->next = pool->free_list;
+		pool->free_list = entry;
+		pool->retained++;
+		entry = NULL;
+	} else if (pool) {
+		pool->dropped++;
+	}
+	object_pools_unlock();
+
+	if (entry)
+		sc_mem_account_free(SC_MEM_PKCS11_OBJECTS, size);
+	free(entry);
+}
+
+void
+sc_pkcs11_object_pool_free(void)
+{
+	unsigned int i;
+
+	object_pools_lock();
+	for (i = 0; i < OBJECT_POOL_TYPES && object_pools[i].size; i++) {
+		struct object_pool *pool = &object_pools[i];
+
+		sc_log(context, "object pool of %lu byte objects: %lu allocated, %lu reused, "
+				"%lu dropped, %u retained", (unsigned long) pool->size,
+				pool->allocated, pool->reused, pool->dropped, pool->retained);
+		while (pool->free_list) {
+			struct pool_entry *entry = pool->free_list;
+
+			pool->free_list = entry->next;
+			sc_mem_account_free(SC_MEM_PKCS11_OBJECTS, pool->size);
+			free(entry);
+		}
+	}
+	memset(object_pools, 0, sizeof(object_pools));
+	object_pools_unlock();
+}
+
+/* Append obj to the objects of fw_data, growing the array as needed */
+static int
+pkcs15_fw_append_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	struct pkcs15_any_object **objects;
+	unsigned int max_objects;
+
+	if (fw_data->num_objects >= fw_data->max_objects) {
+		max_objects = fw_data->max_objects ? 2 * fw_data->max_objects : 32;
+		objects = realloc(fw_data->objects, max_objects * sizeof(*objects));
+		if (objects == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		fw_data->objects = objects;
+		fw_data->max_objects = max_objects;
+	}
+	fw_data->objects[fw_data->num_objects++] = obj;
+	return SC_SUCCESS;
+}
+
 static int
 __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 		       struct pkcs15_any_object **result,
@@ -407,13 +589,13 @@ __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 {
 	struct pkcs15_any_object *obj;
 
-	if (fw_data->num_objects >= MAX_OBJECTS)
-		return SC_ERROR_TOO_MANY_OBJECTS;
-
-	if (!(obj = calloc(1, size)))
+	if (!(obj = object_pool_alloc(size)))
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	fw_data->objects[fw_data->num_objects++] = obj;
+	if (pkcs15_fw_append_object(fw_data, obj) != SC_SUCCESS) {
+		object_pool_release(obj, size);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
 
 	obj->base.ops = ops;
 	obj->p15_object = p15_object;
@@ -427,11 +609,17 @@ __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 static int
 __pkcs15_release_object(struct pkcs15_any_object *obj)
 {
+	size_t size;
+
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
-	sc_mem_clear(obj, obj->size);
-	free(obj);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_verify_key(&obj->base);
+#endif
+	size = obj->size;
+	sc_mem_clear(obj, size);
+	object_pool_release(obj, size);
 
 	return 0;
 }
@@ -457,6 +645,42 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 }
 #endif
 
+/* Returns 1 if the PIN status of the slot was read recently enough
+ * (pin_info_cache_time) and nothing has happened to it since */
+static int
+pin_info_cached(struct sc_pkcs11_slot *slot)
+{
+	struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) slot->card->fws_data[slot->fw_data_idx];
+	struct pkcs15_slot_data *data = slot_data(slot->fw_data);
+	unsigned int shared;
+
+	if (!sc_pkcs11_conf.pin_info_cache_time || !fw_data || !data)
+		return 0;
+	/* a PIN command of another process */
+	if (sc_card_shared_generation(slot->card->card, &shared) == SC_SUCCESS
+			&& shared != data->pin_info_shared)
+		return 0;
+	return data->pin_info_epoch == fw_data->pin_info_epoch
+		&& data->pin_info_generation == slot->reader->card_generation
+		&& get_current_time() < data->pin_info_expires;
+}
+
+
+static void
+pin_info_update(struct sc_pkcs11_slot *slot)
+{
+	struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) slot->card->fws_data[slot->fw_data_idx];
+	struct pkcs15_slot_data *data = slot_data(slot->fw_data);
+
+	if (!sc_pkcs11_conf.pin_info_cache_time || !fw_data || !data)
+		return;
+	data->pin_info_epoch = fw_data->pin_info_epoch;
+	data->pin_info_generation = slot->reader->card_generation;
+	sc_card_shared_generation(slot->card->card, &data->pin_info_shared);
+	data->pin_info_expires = get_current_time() + sc_pkcs11_conf.pin_info_cache_time;
+}
+
+
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	struct sc_pkcs11_slot *slot;
@@ -480,6 +704,9 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
+	/* Don't query the PIN while another call is using the card */
+	sc_pkcs11_lock_slot(slot);
+
 	/* User PIN flags are cleared before re-calculation */
 	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
 	auth = slot_data_auth(slot->fw_data);
@@ -489,21 +716,24 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 
 		if (pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)   {
 			rv = CKR_FUNCTION_REJECTED;
-			goto out;
+			goto unlock;
 		}
 
 		/* Try to update PIN info from card */
-		memset(&data, 0, sizeof(data));
-		data.cmd = SC_PIN_CMD_GET_INFO;
-		data.pin_type = SC_AC_CHV;
-		data.pin_reference = pin_info->attrs.pin.reference;
-
-		r = sc_pin_cmd(slot->card->card, &data, NULL);
-		if (r == SC_SUCCESS) {
-			if (data.pin1.max_tries > 0)
-				pin_info->max_tries = data.pin1.max_tries;
-			/* tries_left must be supported or sc_pin_cmd should not return SC_SUCCESS */
-			pin_info->tries_left = data.pin1.tries_left;
+		if (!pin_info_cached(slot)) {
+			memset(&data, 0, sizeof(data));
+			data.cmd = SC_PIN_CMD_GET_INFO;
+			data.pin_type = SC_AC_CHV;
+			data.pin_reference = pin_info->attrs.pin.reference;
+
+			r = sc_pin_cmd(slot->card->card, &data, NULL);
+			if (r == SC_SUCCESS) {
+				if (data.pin1.max_tries > 0)
+					pin_info->max_tries = data.pin1.max_tries;
+				/* tries_left must be supported or sc_pin_cmd should not return SC_SUCCESS */
+				pin_info->tries_left = data.pin1.tries_left;
+				pin_info_update(slot);
+			}
 		}
 
 		if (pin_info->tries_left >= 0) {
@@ -516,6 +746,8 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		}
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
+unlock:
+	sc_pkcs11_unlock_slot(slot);
 out:
 	sc_pkcs11_unlock();
 	sc_log(context, "C_GetTokenInfo(%lx) returns 0x%lX", slotID, rv);
@@ -550,32 +782,75 @@ public_key_created(struct pkcs15_fw_data *fw_data, const struct sc_pkcs15_id *id
 }
 
 
+/* The key of a certificate is also the key of the public key object with
+ * the same ID, saving a read of the public key file, unless the key types
+ * differ */
 static int
-__pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *cert,
-		struct pkcs15_any_object **cert_object)
+pkcs15_pubkey_from_cert_data(struct pkcs15_pubkey_object *pubkey, struct sc_pkcs15_cert *cert)
+{
+	struct sc_pkcs15_pubkey *key = NULL;
+	int algorithm, rv;
+
+	if (pubkey->pub_data)
+		return 0;
+
+	/* the certificate was parsed when read */
+	if (cert->key)
+		rv = sc_pkcs15_dup_pubkey(context, cert->key, &key);
+	else
+		rv = sc_pkcs15_pubkey_from_cert(context, &cert->data, &key);
+	if (rv < 0)
+		return rv;
+
+	if (pubkey->pub_p15obj) {
+		switch (pubkey->pub_p15obj->type) {
+		case SC_PKCS15_TYPE_PUBKEY_RSA:
+			algorithm = SC_ALGORITHM_RSA;
+			break;
+		case SC_PKCS15_TYPE_PUBKEY_EC:
+			algorithm = SC_ALGORITHM_EC;
+			break;
+		case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
+			algorithm = SC_ALGORITHM_GOSTR3410;
+			break;
+		default:
+			algorithm = key->algorithm;
+			break;
+		}
+		if (algorithm != key->algorithm) {
+			sc_log(context, "Certificate key does not match the public key object");
+			sc_pkcs15_free_pubkey(key);
+			return 0;
+		}
+	}
+
+	pubkey->pub_data = key;
+	if (pubkey->pub_info && pubkey->pub_info->modulus_length == 0 && key->algorithm == SC_ALGORITHM_RSA)
+		pubkey->pub_info->modulus_length = 8 * key->u.rsa.modulus.len;
+	return 0;
+}
+
+
+/* p15_cert is NULL for a private certificate, read when needed */
+static int
+__pkcs15_add_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *cert,
+		struct sc_pkcs15_cert *p15_cert, struct pkcs15_any_object **cert_object)
 {
 	struct sc_pkcs15_cert_info *p15_info = NULL;
-	struct sc_pkcs15_cert *p15_cert = NULL;
 	struct pkcs15_cert_object *object = NULL;
 	struct pkcs15_pubkey_object *obj2 = NULL;
 	int rv;
 
 	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
 
-	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)  {	/* is the cert private? */
-		p15_cert = NULL;			/* will read cert when needed */
-	}
-	else    {
-		rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert);
-		if (rv < 0)
-			return rv;
-	}
-
 	/* Certificate object */
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 			cert, &pkcs15_cert_ops, sizeof(struct pkcs15_cert_object));
-	if (rv < 0)
+	if (rv < 0) {
+		if (p15_cert)
+			sc_pkcs15_free_certificate(p15_cert);
 		return rv;
+	}
 
 	object->cert_info = p15_info;
 	object->cert_data = p15_cert;
@@ -590,8 +865,7 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 
 	if (p15_cert) {
 		 /* make a copy of public key from the cert */
-		if (!obj2->pub_data)
-			rv = sc_pkcs15_pubkey_from_cert(context, &p15_cert->data, &obj2->pub_data);
+		rv = pkcs15_pubkey_from_cert_data(obj2, p15_cert);
 		if (rv < 0)
 			return rv;
 	}
@@ -606,19 +880,37 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 }
 
 
+static int
+__pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *cert,
+		struct pkcs15_any_object **cert_object)
+{
+	struct sc_pkcs15_cert *p15_cert = NULL;
+	int rv;
+
+	if (!(cert->flags & SC_PKCS15_CO_FLAG_PRIVATE))   {
+		rv = sc_pkcs15_read_certificate(fw_data->p15_card,
+				(struct sc_pkcs15_cert_info *) cert->data, &p15_cert);
+		if (rv < 0)
+			return rv;
+	}
+
+	return __pkcs15_add_cert_object(fw_data, cert, p15_cert, cert_object);
+}
+
+
 static int
 __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *pubkey, struct pkcs15_any_object **pubkey_object)
 {
 	struct pkcs15_pubkey_object *object = NULL;
 	struct sc_pkcs15_pubkey *p15_key = NULL;
+	struct sc_pkcs15_pubkey_info *info = (struct sc_pkcs15_pubkey_info *) pubkey->data;
 	int rv;
 
 	sc_log(context, "__pkcs15_create_pubkey_object() called, pubkey %p, data %p", pubkey, pubkey->data);
-	/* Read public key from card */
-	/* Attempt to read pubkey from card or file.
-	 * During initialization process, the key may have been created
-	 * and saved as a file before the certificate has been created.
+	/* The key is decoded now only if that needs no card access. Otherwise
+	 * a certificate with the same ID may supply it, or it is read from
+	 * the card when first needed, see check_pubkey_data_read().
 	 */
 	if (pubkey->flags & SC_PKCS15_CO_FLAG_PRIVATE)   {	/* is the key private? */
 		sc_log(context, "No pubkey");
@@ -630,7 +922,7 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 			sc_log(context, "Use emulated pubkey");
 			p15_key = (struct sc_pkcs15_pubkey *) pubkey->emulated;
 		}
-		else {
+		else if (info->direct.spki.len || info->direct.raw.len || pubkey->content.len) {
 			sc_log(context, "Get pubkey from PKCS#15 object");
 			rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey, &p15_key);
 			if (rv < 0)
@@ -715,25 +1007,104 @@ __pkcs15_create_secret_key_object(struct pkcs15_fw_data *fw_data,
 }
 
 
+/* Spare keys of the key pool are not shown until C_GenerateKeyPair takes them */
+static int
+pkcs15_is_pool_key(struct sc_pkcs15_object *p15_object)
+{
+	int class = p15_object->type & SC_PKCS15_TYPE_CLASS_MASK;
+
+	return (class == SC_PKCS15_TYPE_PRKEY || class == SC_PKCS15_TYPE_PUBKEY)
+		&& strcmp(p15_object->label, KEY_POOL_LABEL) == 0;
+}
+
+
 static int
 pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const char *name,
 		int (*create)(struct pkcs15_fw_data *, struct sc_pkcs15_object *,
 			struct pkcs15_any_object **any_object))
 {
-	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
-	int i, count, rv;
-
-	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, MAX_OBJECTS);
-	if (rv >= 0)
-		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
+	struct sc_pkcs15_object *p15_object;
+	int count = 0, rv = 0;
 
-	for (i = 0; rv >= 0 && i < count; i++)
-		rv = create(fw_data, p15_object[i], NULL);
+	for (p15_object = sc_pkcs15_first_object(fw_data->p15_card, p15_type); p15_object != NULL;
+			p15_object = sc_pkcs15_next_object(fw_data->p15_card, p15_object, p15_type)) {
+		count++;
+		if (rv >= 0 && !pkcs15_is_pool_key(p15_object))
+			rv = create(fw_data, p15_object, NULL);
+	}
+	sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
 	return count;
 }
 
 
+/* As pkcs15_create_pkcs11_objects() with __pkcs15_create_cert_object(),
+ * but the public certificates are read in one go: the card sends one
+ * while the previous one is parsed */
+static int
+pkcs15_create_cert_objects(struct pkcs15_fw_data *fw_data)
+{
+	struct sc_pkcs15_card *p15card = fw_data->p15_card;
+	struct sc_pkcs15_object *p15_object, **objects = NULL;
+	const struct sc_pkcs15_cert_info **infos = NULL;
+	struct sc_pkcs15_cert **certs = NULL;
+	int *results = NULL;
+	size_t count = 0, nread = 0, ii;
+	int rv = 0;
+
+	for (p15_object = sc_pkcs15_first_object(p15card, SC_PKCS15_TYPE_CERT_X509); p15_object != NULL;
+			p15_object = sc_pkcs15_next_object(p15card, p15_object, SC_PKCS15_TYPE_CERT_X509))
+		count++;
+	if (count < 2)
+		return pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
+				__pkcs15_create_cert_object);
+	sc_log(context, "Found %d certificates", (int)count);
+
+	objects = calloc(count, sizeof(*objects));
+	infos = calloc(count, sizeof(*infos));
+	certs = calloc(count, sizeof(*certs));
+	results = calloc(count, sizeof(*results));
+	if (!objects || !infos || !certs || !results) {
+		rv = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	/* private certificates are read when needed */
+	for (ii = 0, p15_object = sc_pkcs15_first_object(p15card, SC_PKCS15_TYPE_CERT_X509); p15_object != NULL;
+			p15_object = sc_pkcs15_next_object(p15card, p15_object, SC_PKCS15_TYPE_CERT_X509), ii++) {
+		objects[ii] = p15_object;
+		if (!(p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+			infos[nread++] = (struct sc_pkcs15_cert_info *) p15_object->data;
+	}
+	rv = sc_pkcs15_read_certificates(p15card, infos, nread, certs, results);
+	if (rv < 0)
+		goto out;
+
+	for (ii = 0, nread = 0; ii < count; ii++) {
+		struct sc_pkcs15_cert *p15_cert = NULL;
+
+		if (!(objects[ii]->flags & SC_PKCS15_CO_FLAG_PRIVATE)) {
+			p15_cert = certs[nread];
+			certs[nread] = NULL;
+			if (rv >= 0)
+				rv = results[nread];
+			nread++;
+		}
+		if (rv >= 0)
+			rv = __pkcs15_add_cert_object(fw_data, objects[ii], p15_cert, NULL);
+		else if (p15_cert)
+			sc_pkcs15_free_certificate(p15_cert);
+	}
+	rv = (int)count;
+out:
+	free(objects);
+	free(infos);
+	free(certs);
+	free(results);
+	return rv;
+}
+
+
 static void
 __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *pk)
 {
@@ -767,7 +1138,9 @@ __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_
 			if (sc_pkcs15_compare_id(&pubkey->pub_info->id, id)) {
 				sc_log(context, "Associating object %d as public key", i);
 				pk->prv_pubkey = pubkey;
-				sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
+				/* a key without certificate is read when asked for */
+				if (pubkey->pub_data)
+					sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
 				if (pk->prv_info->modulus_length == 0)
 					pk->prv_info->modulus_length = pubkey->pub_info->modulus_length;
 			}
@@ -860,9 +1233,8 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 		return rv;
 
 	obj2 = cert->cert_pubkey;
-	/* make a copy of public key from the cert data */
-	if (!obj2->pub_data)
-		rv = sc_pkcs15_pubkey_from_cert(context, &cert->cert_data->data, &obj2->pub_data);
+	/* make a copy of public key from the cert data, the key is already parsed */
+	pkcs15_pubkey_from_cert_data(obj2, cert->cert_data);
 
 	/* now that we have the cert and pub key, lets see if we can bind anything else */
 	pkcs15_bind_related_objects(fw_data);
@@ -871,6 +1243,62 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 }
 
 
+/* The public key of a PuKDF entry is taken from its certificate when
+ * there is one, or read from the card on first use and kept */
+static int
+check_pubkey_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_pubkey_object *pubkey)
+{
+	int rv;
+
+	if (!pubkey)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	if (pubkey->pub_data)
+		return 0;
+
+	if (pubkey->pub_genfrom && check_cert_data_read(fw_data, pubkey->pub_genfrom) == 0
+			&& pubkey->pub_data)
+		return 0;
+
+	if (!pubkey->pub_p15obj)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey->pub_p15obj, &pubkey->pub_data);
+	if (rv < 0)
+		return rv;
+	if (pubkey->pub_info->modulus_length == 0 && pubkey->pub_data->algorithm == SC_ALGORITHM_RSA)
+		pubkey->pub_info->modulus_length = 8 * pubkey->pub_data->u.rsa.modulus.len;
+	return 0;
+}
+
+
+/* Read the contents of all the public certificates within one card lock,
+ * so that the first enumeration of the certificates does not lock the card,
+ * select and read once per certificate */
+static void
+pkcs15_prefetch_certificates(struct pkcs15_fw_data *fw_data)
+{
+	struct sc_card *card = fw_data->p15_card->card;
+	unsigned int i;
+	int rv;
+
+	rv = sc_lock(card);
+	if (rv < 0) {
+		sc_log(context, "Cannot lock card to prefetch certificates: %s", sc_strerror(rv));
+		return;
+	}
+	for (i = 0; i < fw_data->num_objects; i++) {
+		struct pkcs15_any_object *obj = fw_data->objects[i];
+
+		if (!is_cert(obj) || (obj->p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+			continue;
+		rv = check_cert_data_read(fw_data, (struct pkcs15_cert_object *) obj);
+		if (rv < 0)
+			sc_log(context, "Cannot prefetch certificate '%s': %s",
+					obj->p15_object->label, sc_strerror(rv));
+	}
+	sc_unlock(card);
+}
+
+
 static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
@@ -883,15 +1311,15 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_has_object(slot, &obj->base))
 		return;
 
+	if (slot_add_object(slot, &obj->base) != CKR_OK)
+		return;
 	if (pHandle != NULL)
-		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+		*pHandle = obj->base.handle;
 
-	list_append(&slot->objects, obj);
-	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
-	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	sc_log(context, "Slot:%X Object handle 0x%lx", slot->id, obj->base.handle);
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -1005,8 +1433,12 @@ pkcs15_create_slot(struct sc_pkcs11_card *p11card, struct pkcs15_fw_data *fw_dat
 	slot->slot_info.flags |= CKF_TOKEN_PRESENT;
 
 	/* Fill in the slot/token info from pkcs15 data */
-	if (fw_data)
+	if (fw_data)   {
 		pkcs15_init_slot(fw_data->p15_card, slot, auth, app_info);
+		if (fw_data->num_slots < MAX_FW_SLOTS)
+			fw_data->slots[fw_data->num_slots] = slot;
+		fw_data->num_slots++;
+	}
 
 	*out = slot;
 	return CKR_OK;
@@ -1048,15 +1480,16 @@ _pkcs15_create_typed_objects(struct pkcs15_fw_data *fw_data)
 	if (rv < 0)
 		return rv;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
-			__pkcs15_create_cert_object);
+	rv = pkcs15_create_cert_objects(fw_data);
 	if (rv < 0)
 		return rv;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
-			__pkcs15_create_data_object);
-	if (rv < 0)
-		return rv;
+	if (!fw_data->data_objects_pending)   {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
+				__pkcs15_create_data_object);
+		if (rv < 0)
+			return rv;
+	}
 
 	/* Match up related keys and certificates */
 	pkcs15_bind_related_objects(fw_data);
@@ -1186,10 +1619,10 @@ _add_pin_related_objects(struct sc_pkcs11_slot *slot, struct sc_pkcs15_object *p
 			continue;
 		}
 
-		if (move_to_fw && move_to_fw != fw_data && move_to_fw->num_objects < MAX_OBJECTS)   {
+		if (move_to_fw && move_to_fw != fw_data
+				&& pkcs15_fw_append_object(move_to_fw, obj) == SC_SUCCESS)   {
 			int tail = fw_data->num_objects - i - 1;
 
-			move_to_fw->objects[move_to_fw->num_objects++] = obj;
 			if (tail)
 				memcpy(&fw_data->objects[i], &fw_data->objects[i + 1], sizeof(fw_data->objects[0]) * tail);
 			i--;
@@ -1231,11 +1664,11 @@ _add_public_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data,
 		sc_log(context, "Add public object(%p,%s,%x)", obj, obj->p15_object->label, obj->p15_object->type);
 		pkcs15_add_object(slot, obj, NULL);
 
-		if (move_to_fw && move_to_fw != fw_data && move_to_fw->num_objects < MAX_OBJECTS)   {
+		if (move_to_fw && move_to_fw != fw_data
+				&& pkcs15_fw_append_object(move_to_fw, obj) == SC_SUCCESS)   {
 			int tail = fw_data->num_objects - i - 1;
 
 			sc_log(context, "Move public object(%p) from %p to %p", obj, fw_data, move_to_fw);
-			move_to_fw->objects[move_to_fw->num_objects++] = obj;
 			if (tail)
 				memcpy(&fw_data->objects[i], &fw_data->objects[i + 1], sizeof(fw_data->objects[0]) * tail);
 			i--;
@@ -1245,6 +1678,93 @@ _add_public_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data,
 }
 
 
+/*
+ * Create the data objects that were left out by pkcs15_create_tokens()
+ * in 'lazy_data_objects' mode, once a search could match one of them.
+ * The DODF is parsed only now.
+ */
+static CK_RV
+pkcs15_load_objects(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct pkcs15_fw_data *fw_data = NULL;
+	CK_OBJECT_CLASS *obj_class;
+	unsigned int i;
+	int rv;
+
+	if (!slot->card)
+		return CKR_OK;
+	fw_data = (struct pkcs15_fw_data *) slot->card->fws_data[slot->fw_data_idx];
+	if (!fw_data || !fw_data->data_objects_pending)
+		return CKR_OK;
+
+	/* Searches restricted to another class do not need the data objects */
+	for (i = 0; i < ulCount; i++)   {
+		if (pTemplate[i].type != CKA_CLASS || pTemplate[i].ulValueLen != sizeof(CK_OBJECT_CLASS))
+			continue;
+		obj_class = (CK_OBJECT_CLASS *) pTemplate[i].pValue;
+		if (obj_class && *obj_class != CKO_DATA)
+			return CKR_OK;
+	}
+
+	fw_data->data_objects_pending = 0;
+	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
+			__pkcs15_create_data_object);
+	if (rv < 0)
+		return sc_to_cryptoki_error(rv, NULL);
+
+	/* Distribute them as pkcs15_create_tokens() would have done */
+	for (i = 0; i < fw_data->num_slots && i < MAX_FW_SLOTS; i++)   {
+		struct sc_pkcs15_object *auth = slot_data_auth(fw_data->slots[i]->fw_data);
+
+		if (auth)
+			_add_pin_related_objects(fw_data->slots[i], auth, fw_data, NULL);
+	}
+	_add_public_objects(fw_data->public_slot, fw_data, NULL);
+
+	return CKR_OK;
+}
+
+
+/* Revalidate the files the PKCS#15 layer served from its file cache */
+static CK_RV
+pkcs15_revalidate(struct sc_pkcs11_card *p11card, int *changed)
+{
+	struct pkcs15_fw_data *fw_data;
+	int idx, rv;
+
+	*changed = 0;
+	for (idx = 0; idx < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; idx++)   {
+		fw_data = (struct pkcs15_fw_data *) p11card->fws_data[idx];
+		if (!fw_data || !fw_data->p15_card)
+			continue;
+		rv = sc_pkcs15_revalidate_file_cache(fw_data->p15_card);
+		if (rv < 0)
+			return sc_to_cryptoki_error(rv, NULL);
+		if (rv > 0)
+			*changed = 1;
+	}
+	return CKR_OK;
+}
+
+
+static CK_RV
+pkcs15_reload_config(struct sc_pkcs11_card *p11card)
+{
+	struct pkcs15_fw_data *fw_data;
+	int idx, rv;
+
+	for (idx = 0; idx < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; idx++)   {
+		fw_data = (struct pkcs15_fw_data *) p11card->fws_data[idx];
+		if (!fw_data || !fw_data->p15_card)
+			continue;
+		rv = sc_pkcs15_reload_options(fw_data->p15_card);
+		if (rv < 0)
+			return sc_to_cryptoki_error(rv, NULL);
+	}
+	return CKR_OK;
+}
+
+
 static CK_RV
 pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info,
 		struct sc_pkcs11_slot **first_slot)
@@ -1252,7 +1772,7 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 	struct pkcs15_fw_data *fw_data = NULL, *ffda = NULL;
 	struct sc_pkcs15_object *auth_user_pin = NULL, *auth_sign_pin = NULL, *fauo = NULL;
 	struct sc_pkcs11_slot *slot = NULL;
-	int i, rv, idx;
+	int rv, idx;
 
 	sc_log(context, "create PKCS#15 tokens; fws:%p,%p,%p", p11card->fws_data[0], p11card->fws_data[1], p11card->fws_data[2]);
 	sc_log(context, "create slots flags 0x%X", sc_pkcs11_conf.create_slots_flags);
@@ -1272,47 +1792,47 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		auth_sign_pin = _get_auth_object_by_name(fw_data->p15_card, "SignPIN");
 	sc_log(context, "Flags:0x%X; Auth User/Sign PINs %p/%p", sc_pkcs11_conf.create_slots_flags, auth_user_pin, auth_sign_pin);
 
+	/* Only the first application can delay its data objects: the objects of the
+	 * following ones may be merged into the framework data of the first slot */
+	fw_data->data_objects_pending = sc_pkcs11_conf.lazy_data_objects && (!first_slot || !*first_slot);
+
 	/* Add PKCS#15 objects of the known types to the framework data */
 	rv = _pkcs15_create_typed_objects(fw_data);
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, NULL);
 	sc_log(context, "Found %d FW objects objects", fw_data->num_objects);
 
+	if (sc_pkcs11_conf.prefetch_certificates)
+		pkcs15_prefetch_certificates(fw_data);
+
 	/* Create slots for all non-unblock, non-so PINs if:
 	 *  - 'UserPIN' cannot be identified (VT: for some cards with incomplete PIN flags);
 	 *  - configuration impose to create slot for all PINs.
 	 */
 	if (!auth_user_pin || sc_pkcs11_conf.create_slots_flags & SC_PKCS11_SLOT_CREATE_ALL)   {
-		struct sc_pkcs15_object *auths[MAX_OBJECTS];
-		int auth_count;
+		struct sc_pkcs15_object *auth;
 
-		memset(auths, 0, sizeof(auths));
 		/* Get authentication PKCS#15 objects present in the associated on-card application */
-		rv = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, SC_PKCS15_MAX_PINS);
-		if (rv < 0)
-			return sc_to_cryptoki_error(rv, NULL);
-		auth_count = rv;
-		sc_log(context, "Found %d authentication objects", auth_count);
-
-		for (i = 0; i < auth_count; i++) {
-			struct sc_pkcs15_auth_info *pin_info = (struct sc_pkcs15_auth_info*)auths[i]->data;
+		for (auth = sc_pkcs15_first_object(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN); auth != NULL;
+				auth = sc_pkcs15_next_object(fw_data->p15_card, auth, SC_PKCS15_TYPE_AUTH_PIN)) {
+			struct sc_pkcs15_auth_info *pin_info = (struct sc_pkcs15_auth_info*)auth->data;
 			struct sc_pkcs11_slot *islot = NULL;
 
 			/* Check if a slot could be created with this PIN */
 			if (!_is_slot_auth_object(pin_info))
 				continue;
-			sc_log(context, "Found authentication object '%s'", auths[i]->label);
+			sc_log(context, "Found authentication object '%s'", auth->label);
 
-			rv = pkcs15_create_slot(p11card, fw_data, auths[i], app_info, &islot);
+			rv = pkcs15_create_slot(p11card, fw_data, auth, app_info, &islot);
 			if (rv != CKR_OK)
 				return CKR_OK; /* no more slots available for this card */
 			islot->fw_data_idx = idx;
-			_add_pin_related_objects(islot, auths[i], fw_data, NULL);
+			_add_pin_related_objects(islot, auth, fw_data, NULL);
 
 			/* Get slot to which the public objects will be associated */
 			if (!slot && !auth_user_pin)
 				slot = islot;
-			else if (!slot && auth_user_pin && auth_user_pin == auths[i])
+			else if (!slot && auth_user_pin && auth_user_pin == auth)
 				slot = islot;
 		}
 	}
@@ -1373,8 +1893,13 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 	if (slot)   {
 		sc_log(context, "Add public objects to slot %p", slot);
 		_add_public_objects(slot, fw_data, ffda);
+		fw_data->public_slot = slot;
 	}
 
+	/* Too many slots to keep track of, create the data objects now */
+	if (slot && fw_data->data_objects_pending && fw_data->num_slots > MAX_FW_SLOTS)
+		pkcs15_load_objects(slot, NULL, 0);
+
 	if (ffda)
 		sc_log(context, "Finaly there are %i objects in first slot", ffda->num_objects);
 	sc_log(context, "All tokens created");
@@ -1390,6 +1915,59 @@ pkcs15_release_token(struct sc_pkcs11_card *p11card, void *fw_token)
 }
 
 
+/* Some cards only list the private objects once the user PIN is verified */
+static void
+pkcs15_login_add_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data,
+		struct sc_pkcs15_auth_info *pin_info)
+{
+	struct sc_pkcs15_card *p15card = fw_data->p15_card;
+	sc_pkcs15_object_t *p15_obj = p15card->obj_list;
+	sc_pkcs15_search_key_t sk;
+
+	sc_log(context, "Check if pkcs15 object list can be completed.");
+
+	/* Ensure non empty list */
+	if (p15_obj == NULL)
+		return;
+
+	/* Select last object in list */
+	while(p15_obj->next)
+		p15_obj = p15_obj->next;
+
+	/* Trigger enumeration of EF.XXX files */
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY |
+			SC_PKCS15_SEARCH_CLASS_CERT  | SC_PKCS15_SEARCH_CLASS_DATA;
+	sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+
+	/* Iterate over newly discovered objects */
+	while(p15_obj->next) {
+		struct pkcs15_any_object *fw_obj;
+
+		p15_obj = p15_obj->next;
+
+		if (!sc_pkcs15_compare_id(&pin_info->auth_id, &p15_obj->auth_id)
+				|| pkcs15_is_pool_key(p15_obj))
+			continue;
+
+		switch (p15_obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+		case SC_PKCS15_TYPE_PRKEY:
+			__pkcs15_create_prkey_object(fw_data, p15_obj, &fw_obj); break;
+		case SC_PKCS15_TYPE_PUBKEY:
+			__pkcs15_create_pubkey_object(fw_data, p15_obj, &fw_obj); break;
+		case SC_PKCS15_TYPE_CERT:
+			__pkcs15_create_cert_object(fw_data, p15_obj, &fw_obj); break;
+		case SC_PKCS15_TYPE_DATA_OBJECT:
+			__pkcs15_create_data_object(fw_data, p15_obj, &fw_obj); break;
+		default: continue;
+		}
+
+		sc_log(context, "new object found: type=0x%03X", p15_obj->type);
+		pkcs15_add_object(slot, fw_obj, NULL);
+	}
+}
+
+
 static CK_RV
 pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 		CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
@@ -1405,6 +1983,8 @@ pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Login");
 	p15card = fw_data->p15_card;
+	/* a failed login changes the tries left, a PUK login may unblock */
+	fw_data->pin_info_epoch++;
 
 	sc_log(context, "pkcs15-login: userType 0x%lX, PIN length %li", userType, ulPinLen);
 	switch (userType) {
@@ -1515,52 +2095,67 @@ pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 	if (rc != SC_SUCCESS)
 		return sc_to_cryptoki_error(rc, "C_Login");
 
-	if (userType == CKU_USER)   {
-		sc_pkcs15_object_t *p15_obj = p15card->obj_list;
-		sc_pkcs15_search_key_t sk;
+	if (userType == CKU_USER)
+		pkcs15_login_add_objects(slot, fw_data, pin_info);
 
-		sc_log(context, "Check if pkcs15 object list can be completed.");
+	return CKR_OK;
+}
 
-		/* Ensure non empty list */
-		if (p15_obj == NULL)
-			return CKR_OK;
 
-		/* Select last object in list */
-		while(p15_obj->next)
-			p15_obj = p15_obj->next;
+/* The user PINs of two slots of a card are the same PIN on the card */
+static int
+pkcs15_same_user_pin(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *peer)
+{
+	struct sc_pkcs15_object *auth = slot_data_auth(slot->fw_data);
+	struct sc_pkcs15_object *peer_auth = slot_data_auth(peer->fw_data);
+	struct sc_pkcs15_auth_info *pin_info, *peer_pin_info;
 
-		/* Trigger enumeration of EF.XXX files */
-		memset(&sk, 0, sizeof(sk));
-		sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY |
-				SC_PKCS15_SEARCH_CLASS_CERT  | SC_PKCS15_SEARCH_CLASS_DATA;
-		sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+	if (slot->card != peer->card || auth == NULL || peer_auth == NULL)
+		return 0;
+	if (auth == peer_auth)
+		return 1;
+
+	pin_info = (struct sc_pkcs15_auth_info *) auth->data;
+	peer_pin_info = (struct sc_pkcs15_auth_info *) peer_auth->data;
+	if (pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN
+			|| peer_pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN
+			|| pin_info->auth_method != peer_pin_info->auth_method
+			|| pin_info->attrs.pin.reference != peer_pin_info->attrs.pin.reference)
+		return 0;
+	/* A local PIN (ISO 7816-4: bit 8 of the reference) is only the
+	 * same PIN in the same DF */
+	if ((pin_info->attrs.pin.reference & 0x80)
+			&& !sc_compare_path(&pin_info->path, &peer_pin_info->path))
+		return 0;
+	return 1;
+}
 
-		/* Iterate over newly discovered objects */
-		while(p15_obj->next) {
-			struct pkcs15_any_object *fw_obj;
 
-			p15_obj = p15_obj->next;
+/* The user PIN of slot was verified through another slot, see
+ * slot_share_login(): do what pkcs15_login() does after the VERIFY */
+static CK_RV
+pkcs15_share_login(struct sc_pkcs11_slot *slot, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	struct pkcs15_fw_data *fw_data = NULL;
+	struct sc_pkcs15_object *auth_object = slot_data_auth(slot->fw_data);
+	int rc;
 
-			if (!sc_pkcs15_compare_id(&pin_info->auth_id, &p15_obj->auth_id))
-				continue;
+	fw_data = (struct pkcs15_fw_data *) slot->card->fws_data[slot->fw_data_idx];
+	if (!fw_data)
+		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Login");
+	if (auth_object == NULL)
+		return CKR_USER_PIN_NOT_INITIALIZED;
+	fw_data->pin_info_epoch++;
 
-			switch (p15_obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
-			case SC_PKCS15_TYPE_PRKEY:
-				__pkcs15_create_prkey_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_PUBKEY:
-				__pkcs15_create_pubkey_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_CERT:
-				__pkcs15_create_cert_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_DATA_OBJECT:
-				__pkcs15_create_data_object(fw_data, p15_obj, &fw_obj); break;
-			default: continue;
-			}
+	if (sc_pkcs11_conf.lock_login && (rc = lock_card(fw_data)) < 0)
+		return sc_to_cryptoki_error(rc, "C_Login");
 
-			sc_log(context, "new object found: type=0x%03X", p15_obj->type);
-			pkcs15_add_object(slot, fw_obj, NULL);
-		}
-	}
+	/* The card cached the PIN of the other application only, this one
+	 * may have to revalidate it after a reset */
+	if (pPin != NULL && ulPinLen > 0)
+		sc_pkcs15_pincache_add(fw_data->p15_card, auth_object, pPin, ulPinLen);
 
+	pkcs15_login_add_objects(slot, fw_data, (struct sc_pkcs15_auth_info *) auth_object->data);
 	return CKR_OK;
 }
 
@@ -1576,6 +2171,7 @@ pkcs15_logout(struct sc_pkcs11_slot *slot)
 	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Logout");
+	fw_data->pin_info_epoch++;
 
 	memset(fw_data->user_puk, 0, sizeof(fw_data->user_puk));
 	fw_data->user_puk_len = 0;
@@ -1619,6 +2215,7 @@ pkcs15_change_pin(struct sc_pkcs11_slot *slot,
 	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_SetPin");
+	fw_data->pin_info_epoch++;
 
 	p15card = fw_data->p15_card;
 
@@ -1820,6 +2417,10 @@ pkcs15_init_pin(struct sc_pkcs11_slot *slot, CK_CHAR_PTR pPin, CK_ULONG ulPinLen
 	struct sc_cardctl_pkcs11_init_pin p11args;
 	int rc;
 
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
+	if (fw_data)
+		fw_data->pin_info_epoch++;
+
 	memset(&p11args, 0, sizeof(p11args));
 	p11args.pin = pPin;
 	p11args.pin_len = ulPinLen;
@@ -2097,6 +2698,9 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 			return CKR_ATTRIBUTE_VALUE_INVALID;
 	}
 
+	/* CKA_EXTRACTABLE defaults to true, CKA_SENSITIVE to false */
+	args.access_flags = SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE;
+
 	while (ulCount--) {
 		CK_ATTRIBUTE_PTR attr = pTemplate++;
 
@@ -2116,6 +2720,13 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 			if (rv != CKR_OK)
 				goto out;
 			break;
+		case CKA_SENSITIVE:
+			args.access_flags |= pkcs15_check_bool_cka(attr, SC_PKCS15_PRKEY_ACCESS_SENSITIVE);
+			break;
+		case CKA_EXTRACTABLE:
+			if (!pkcs15_check_bool_cka(attr, 1))
+				args.access_flags &= ~SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE;
+			break;
 		case CKA_VALUE_LEN:
 			attr_extract(attr, &args.value_len, NULL);
 			break;
@@ -2175,7 +2786,7 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 	    key_obj->data = skey_info;
 	    skey_info->usage = args.usage;
 	    skey_info->native = 0; /* card can not use this */
-	    skey_info->access_flags = 0; /* looks like not needed */
+	    skey_info->access_flags = args.access_flags; /* checked by C_WrapKey() */
 	    skey_info->key_type = key_type; /* PKCS#11 CKK_* */
 	    skey_info->data.value = args.data_value.value;
 	    skey_info->data.len = args.data_value.len;
@@ -2489,6 +3100,11 @@ pkcs15_create_object(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_CreateObject");
 
+	/* The new object must not be created a second time from the DODF */
+	rv = pkcs15_load_objects(slot, NULL, 0);
+	if (rv != CKR_OK)
+		return rv;
+
 	rv = attr_find(pTemplate, ulCount, CKA_CLASS, &_class, NULL);
 	if (rv != CKR_OK)
 		return rv;
@@ -2536,6 +3152,7 @@ pkcs15_create_object(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK
 		}
 
 		sc_pkcs15init_set_p15card(profile, fw_data->p15_card);
+		sc_pkcs15init_begin_batch(profile);
 	}
 	switch (_class) {
 	case CKO_PRIVATE_KEY:
@@ -2558,6 +3175,9 @@ pkcs15_create_object(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK
 	}
 
 	if (_token == TRUE) {
+		rc = sc_pkcs15init_commit_batch(fw_data->p15_card, profile);
+		if (rc < 0 && rv == CKR_OK)
+			rv = sc_to_cryptoki_error(rc, "C_CreateObject");
 		sc_pkcs15init_unbind(profile);
 		sc_unlock(p11card->card);
 	}
@@ -2657,6 +3277,92 @@ set_gost_params(struct sc_pkcs15init_keyarg_gost_params *first_params,
 	return CKR_OK;
 }
 
+/*
+ * Key pool: spare RSA key pairs generated ahead of time, while the token
+ * is idle, and labelled KEY_POOL_LABEL. Returns the number of spare keys
+ * of auth_id with the given size; *prkey_obj is set to one of them.
+ */
+static int
+pkcs15_key_pool_find(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_id *auth_id,
+		unsigned int keybits, struct sc_pkcs15_object **prkey_obj)
+{
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_prkey_info *info;
+	int count = 0;
+
+	for (obj = sc_pkcs15_first_object(fw_data->p15_card, SC_PKCS15_TYPE_PRKEY_RSA); obj != NULL;
+			obj = sc_pkcs15_next_object(fw_data->p15_card, obj, SC_PKCS15_TYPE_PRKEY_RSA)) {
+		info = (struct sc_pkcs15_prkey_info *) obj->data;
+		if (!pkcs15_is_pool_key(obj) || info->modulus_length != keybits
+				|| !sc_pkcs15_compare_id(auth_id, &obj->auth_id))
+			continue;
+		if (prkey_obj && count == 0)
+			*prkey_obj = obj;
+		count++;
+	}
+	return count;
+}
+
+
+/* Whether the public exponent of the template, if any, is the one of the key */
+static int
+pkcs15_key_pool_exponent_ok(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *pubkey_obj,
+		CK_ATTRIBUTE_PTR pPubTpl, CK_ULONG ulPubCnt)
+{
+	struct sc_pkcs15_pubkey *pubkey = NULL;
+	CK_BYTE_PTR exp = NULL;
+	size_t exp_len = 0, key_exp_len;
+	const u8 *key_exp;
+	int ok;
+
+	if (attr_find_ptr(pPubTpl, ulPubCnt, CKA_PUBLIC_EXPONENT, (void **) &exp, &exp_len) != CKR_OK)
+		return 1;
+	if (sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey_obj, &pubkey) != SC_SUCCESS)
+		return 0;
+
+	key_exp = pubkey->u.rsa.exponent.data;
+	key_exp_len = pubkey->u.rsa.exponent.len;
+	while (exp_len > 0 && *exp == 0)
+		exp++, exp_len--;
+	while (key_exp_len > 0 && *key_exp == 0)
+		key_exp++, key_exp_len--;
+	ok = exp_len == key_exp_len && memcmp(exp, key_exp, exp_len) == 0;
+	sc_pkcs15_free_pubkey(pubkey);
+	return ok;
+}
+
+
+/*
+ * Hand a spare key of the pool to C_GenerateKeyPair. The pool keys can
+ * sign and decrypt, so they are only taken for requests of that usage,
+ * and of the public exponent they were generated with.
+ */
+static int
+pkcs15_key_pool_take(struct pkcs15_fw_data *fw_data, struct sc_profile *profile,
+		struct sc_pkcs15init_keygen_args *keygen_args, unsigned int keybits,
+		CK_ATTRIBUTE_PTR pPubTpl, CK_ULONG ulPubCnt,
+		struct sc_pkcs15_object **prkey_obj, struct sc_pkcs15_object **pubkey_obj)
+{
+	struct sc_pkcs15_prkey_info *info;
+	int rc;
+
+	if (sc_pkcs11_conf.key_pool_size == 0 || keygen_args->prkey_args.x509_usage != KEY_POOL_USAGE
+			|| pkcs15_key_pool_find(fw_data, &keygen_args->prkey_args.auth_id, keybits, prkey_obj) == 0)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	info = (struct sc_pkcs15_prkey_info *) (*prkey_obj)->data;
+	rc = sc_pkcs15_find_pubkey_by_id(fw_data->p15_card, &info->id, pubkey_obj);
+	if (rc == SC_SUCCESS && !pkcs15_key_pool_exponent_ok(fw_data, *pubkey_obj, pPubTpl, ulPubCnt)) {
+		sc_log(context, "The public exponent of the key pool does not match the template");
+		rc = SC_ERROR_OBJECT_NOT_FOUND;
+	}
+	if (rc == SC_SUCCESS)
+		rc = sc_pkcs15init_claim_key(fw_data->p15_card, profile, keygen_args, *prkey_obj, *pubkey_obj);
+	if (rc == SC_SUCCESS)
+		sc_log(context, "Took a %u bit key pair of the key pool", keybits);
+	return rc;
+}
+
+
 /* FIXME: check for the public exponent in public key template and use this value */
 static CK_RV
 pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
@@ -2793,10 +3499,15 @@ pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
 		goto kpgen_done;
 	pub_args.x509_usage = keygen_args.prkey_args.x509_usage;
 
-	/* 3.a Try on-card key pair generation */
-
 	sc_pkcs15init_set_p15card(profile, fw_data->p15_card);
 
+	/* 3.a Take a key pair of the key pool, if there is one */
+	if (keytype == CKK_RSA && pkcs15_key_pool_take(fw_data, profile, &keygen_args, keybits,
+				pPubTpl, ulPubCnt, &priv_key_obj, &pub_key_obj) == SC_SUCCESS)
+		goto kpgen_create;
+
+	/* 3.b Try on-card key pair generation */
+
 	sc_log(context, "Try on-card key pair generation");
 	rc = sc_pkcs15init_generate_key(fw_data->p15_card, profile, &keygen_args, keybits, &priv_key_obj);
 	if (rc >= 0) {
@@ -2815,7 +3526,7 @@ pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
 	}
 
 	/* 4. Create new pkcs11 public and private key object */
-
+kpgen_create:
 	rc = __pkcs15_create_prkey_object(fw_data, priv_key_obj, &priv_any_obj);
 	if (rc == 0)
 		rc = __pkcs15_create_pubkey_object(fw_data, pub_key_obj, &pub_any_obj);
@@ -2832,7 +3543,9 @@ pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
 	priv_prk_obj->prv_pubkey = (struct pkcs15_pubkey_object *)pub_any_obj;
 
 	/* Duplicate public key so that parameters can be retrieved even if public key object is deleted */
-	rv = sc_pkcs15_dup_pubkey(context, ((struct pkcs15_pubkey_object *)pub_any_obj)->pub_data, &priv_prk_obj->pub_data);
+	rc = check_pubkey_data_read(fw_data, (struct pkcs15_pubkey_object *) pub_any_obj);
+	if (rc == 0)
+		rv = sc_pkcs15_dup_pubkey(context, ((struct pkcs15_pubkey_object *)pub_any_obj)->pub_data, &priv_prk_obj->pub_data);
 
 kpgen_done:
 	sc_pkcs15init_unbind(profile);
@@ -2864,7 +3577,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcont */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, &any_obj->base);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -2920,7 +3633,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		struct pkcs15_pubkey_object *pubkey = any_obj->related_pubkey;
 
 		/* Check if key is not removed in between */
-		if (list_locate(&session->slot->objects, ao_pubkey) > 0) {
+		if (slot_has_object(session->slot, &ao_pubkey->base)) {
 			sc_log(context, "Found related pubkey %p", any_obj->related_pubkey);
 
 			/* Delete reference to related certificate of the public key PKCS#11 object */
@@ -2930,7 +3643,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				slot_remove_object(session->slot, &ao_pubkey->base);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -2948,7 +3661,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, &any_obj->base);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -2964,6 +3677,61 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 }
 
 
+/* Refill the random pool with random_pool_size bytes. With a
+ * random_pool_ratio above one only every ratio-th byte is read from the
+ * card and the pool is derived from it with SHA-256 in counter mode. */
+static int
+pkcs15_fill_random_pool(struct pkcs15_fw_data *fw_data)
+{
+	struct sc_card *card = fw_data->p15_card->card;
+	size_t size = sc_pkcs11_conf.random_pool_size;
+	int rc = SC_SUCCESS;
+
+	if (fw_data->random_pool == NULL) {
+		fw_data->random_pool = malloc(size);
+		if (fw_data->random_pool == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+#ifdef ENABLE_OPENSSL
+	if (sc_pkcs11_conf.random_pool_ratio > 1) {
+		unsigned char seed[SHA256_DIGEST_LENGTH + 4], md[SHA256_DIGEST_LENGTH];
+		size_t offs, n, seed_len = SHA256_DIGEST_LENGTH;
+		unsigned int counter = 0;
+
+		for (offs = 0; offs < size; counter++) {
+			/* fresh card entropy for every 'ratio' blocks */
+			if (counter % sc_pkcs11_conf.random_pool_ratio == 0) {
+				rc = sc_get_challenge(card, seed, seed_len);
+				if (rc < 0)
+					break;
+			}
+			seed[seed_len + 0] = (counter >> 24) & 0xFF;
+			seed[seed_len + 1] = (counter >> 16) & 0xFF;
+			seed[seed_len + 2] = (counter >> 8) & 0xFF;
+			seed[seed_len + 3] = counter & 0xFF;
+			SHA256(seed, sizeof(seed), md);
+
+			n = size - offs < sizeof(md) ? size - offs : sizeof(md);
+			memcpy(fw_data->random_pool + offs, md, n);
+			offs += n;
+		}
+		sc_mem_clear(seed, sizeof(seed));
+		sc_mem_clear(md, sizeof(md));
+	}
+	else
+#endif
+	{
+		rc = sc_get_challenge(card, fw_data->random_pool, size);
+	}
+	if (rc < 0)
+		return rc;
+
+	fw_data->random_pool_len = size;
+	return SC_SUCCESS;
+}
+
+
 static CK_RV
 pkcs15_get_random(struct sc_pkcs11_slot *slot, CK_BYTE_PTR p, CK_ULONG len)
 {
@@ -2975,9 +3743,98 @@ pkcs15_get_random(struct sc_pkcs11_slot *slot, CK_BYTE_PTR p, CK_ULONG len)
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GenerateRandom");
 
-	rc = sc_get_challenge(fw_data->p15_card->card, p, (size_t)len);
-	return sc_to_cryptoki_error(rc, "C_GenerateRandom");
+	if (!sc_pkcs11_conf.random_pool_size) {
+		rc = sc_get_challenge(fw_data->p15_card->card, p, (size_t)len);
+		return sc_to_cryptoki_error(rc, "C_GenerateRandom");
+	}
+
+	/* serve from the pool, every byte is handed out only once */
+	while (len > 0) {
+		unsigned char *src;
+		size_t n;
+
+		if (fw_data->random_pool_len == 0) {
+			rc = pkcs15_fill_random_pool(fw_data);
+			if (rc < 0)
+				return sc_to_cryptoki_error(rc, "C_GenerateRandom");
+		}
+
+		n = len < fw_data->random_pool_len ? len : fw_data->random_pool_len;
+		src = fw_data->random_pool + sc_pkcs11_conf.random_pool_size - fw_data->random_pool_len;
+		memcpy(p, src, n);
+		sc_mem_clear(src, n);
+		fw_data->random_pool_len -= n;
+		p += n;
+		len -= n;
+	}
+	return CKR_OK;
+}
+
+
+#ifdef USE_PKCS15_INIT
+/*
+ * Generate one spare key pair for the key pool of the slot, of the first
+ * size in key_pool_bits the pool is short of. Called by the slot event
+ * monitor while the token is idle. Keys are generated for the user PIN,
+ * so only while the user is logged in.
+ */
+static CK_RV
+pkcs15_refill_key_pool(struct sc_pkcs11_slot *slot, int *generated)
+{
+	struct sc_pkcs11_card *p11card = slot->card;
+	struct pkcs15_fw_data *fw_data;
+	struct sc_pkcs15_auth_info *pin;
+	struct sc_profile *profile = NULL;
+	struct sc_pkcs15init_keygen_args keygen_args;
+	struct sc_pkcs15_object *priv_key_obj = NULL;
+	unsigned int i, keybits = 0;
+	int rc;
+
+	*generated = 0;
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
+	if (!fw_data || !fw_data->p15_card || slot->login_user != CKU_USER
+			|| (pin = slot_data_auth_info(slot->fw_data)) == NULL)
+		return CKR_OK;
+
+	for (i = 0; i < sc_pkcs11_conf.key_pool_sizes && keybits == 0; i++)
+		if (pkcs15_key_pool_find(fw_data, &pin->auth_id, sc_pkcs11_conf.key_pool_bits[i], NULL)
+				< (int)sc_pkcs11_conf.key_pool_size)
+			keybits = sc_pkcs11_conf.key_pool_bits[i];
+	if (keybits == 0)
+		return CKR_OK;
+
+	rc = sc_lock(p11card->card);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, NULL);
+	rc = sc_pkcs15init_bind(p11card->card, "pkcs15", NULL, slot->app_info, &profile);
+	if (rc < 0) {
+		sc_unlock(p11card->card);
+		return sc_to_cryptoki_error(rc, NULL);
+	}
+	rc = sc_pkcs15init_finalize_profile(p11card->card, profile,
+			slot->app_info ? &slot->app_info->aid : NULL);
+	if (rc == SC_SUCCESS) {
+		memset(&keygen_args, 0, sizeof(keygen_args));
+		keygen_args.prkey_args.auth_id = pin->auth_id;
+		keygen_args.prkey_args.key.algorithm = SC_ALGORITHM_RSA;
+		keygen_args.prkey_args.label = KEY_POOL_LABEL;
+		keygen_args.pubkey_label = KEY_POOL_LABEL;
+		/* only handed out to requests of the same usage */
+		keygen_args.prkey_args.x509_usage = KEY_POOL_USAGE;
+
+		sc_pkcs15init_set_p15card(profile, fw_data->p15_card);
+		sc_log(context, "Generating a %u bit key pair for the key pool", keybits);
+		rc = sc_pkcs15init_generate_key(fw_data->p15_card, profile, &keygen_args, keybits, &priv_key_obj);
+	}
+	sc_pkcs15init_unbind(profile);
+	sc_unlock(p11card->card);
+
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, NULL);
+	*generated = 1;
+	return CKR_OK;
 }
+#endif
 
 
 struct sc_pkcs11_framework_ops framework_pkcs15 = {
@@ -2999,7 +3856,17 @@ struct sc_pkcs11_framework_ops framework_pkcs15 = {
 	NULL,
 	NULL,
 #endif
-	pkcs15_get_random
+	pkcs15_get_random,
+	pkcs15_load_objects,
+	pkcs15_revalidate,
+#ifdef USE_PKCS15_INIT
+	pkcs15_refill_key_pool,
+#else
+	NULL,
+#endif
+	pkcs15_reload_config,
+	pkcs15_same_user_pin,
+	pkcs15_share_login
 };
 
 
@@ -3267,7 +4134,8 @@ struct sc_pkcs11_object_ops pkcs15_cert_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	NULL	/* sign_batch */
 };
 
 /*
@@ -3349,14 +4217,14 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 				else if (is_pubkey(obj)) {
 					struct pkcs15_pubkey_object *pubkey = (struct pkcs15_pubkey_object *) obj;
 
-					if (!pubkey->pub_data)
+					if (!pubkey->pub_info
+							|| !sc_pkcs15_compare_id(&pubkey->pub_info->id, &prkey->prv_info->id)
+							|| check_pubkey_data_read(fw_data, pubkey) != 0)
 						continue;
 
-					if (sc_pkcs15_compare_id(&pubkey->pub_info->id, &prkey->prv_info->id))   {
-						prkey->prv_pubkey = pubkey;
-						key = pubkey->pub_data;
-						sc_log(context, "found friend public key %p", key);
-					}
+					prkey->prv_pubkey = pubkey;
+					key = pubkey->pub_data;
+					sc_log(context, "found friend public key %p", key);
 				}
 			}
 		}
@@ -3477,6 +4345,85 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 }
 
 
+/* Hash and MGF1 algorithms of the RSA-PSS and RSA-OAEP mechanisms */
+static const struct pkcs15_rsa_hash {
+	CK_MECHANISM_TYPE	hash_mech;
+	CK_MECHANISM_TYPE	pss_mech;
+	CK_ULONG		mgf;
+	int			hash_flag;
+	int			mgf_flag;
+	CK_ULONG		hash_len;
+} pkcs15_rsa_hashes[] = {
+	{ CKM_SHA_1,  CKM_SHA1_RSA_PKCS_PSS,   CKG_MGF1_SHA1,   SC_ALGORITHM_RSA_HASH_SHA1,   SC_ALGORITHM_MGF1_SHA1,   20 },
+	{ CKM_SHA256, CKM_SHA256_RSA_PKCS_PSS, CKG_MGF1_SHA256, SC_ALGORITHM_RSA_HASH_SHA256, SC_ALGORITHM_MGF1_SHA256, 32 },
+	{ CKM_SHA384, CKM_SHA384_RSA_PKCS_PSS, CKG_MGF1_SHA384, SC_ALGORITHM_RSA_HASH_SHA384, SC_ALGORITHM_MGF1_SHA384, 48 },
+	{ CKM_SHA512, CKM_SHA512_RSA_PKCS_PSS, CKG_MGF1_SHA512, SC_ALGORITHM_RSA_HASH_SHA512, SC_ALGORITHM_MGF1_SHA512, 64 },
+	{ 0, 0, 0, 0, 0, 0 }
+};
+
+/*
+ * Translate the parameters of CKM_RSA_PKCS_OAEP and the PSS mechanisms
+ * to algorithm flags. The PSS salt must be as long as the hash, the OAEP
+ * label must be empty. For PSS, *hash_len is set to the digest length.
+ */
+static CK_RV
+pkcs15_rsa_pkcs1_v2_flags(CK_MECHANISM_PTR pMechanism, int *flags, CK_ULONG *hash_len)
+{
+	const struct pkcs15_rsa_hash *hash = NULL, *mgf = NULL;
+	CK_MECHANISM_TYPE hash_mech;
+	CK_ULONG mgf_type;
+	int ii;
+
+	if (pMechanism->mechanism == CKM_RSA_PKCS_OAEP) {
+		CK_RSA_PKCS_OAEP_PARAMS *oaep = (CK_RSA_PKCS_OAEP_PARAMS *) pMechanism->pParameter;
+
+		if (oaep == NULL || pMechanism->ulParameterLen != sizeof(*oaep))
+			return CKR_MECHANISM_PARAM_INVALID;
+		if (oaep->source && oaep->source != CKZ_DATA_SPECIFIED)
+			return CKR_MECHANISM_PARAM_INVALID;
+		if (oaep->ulSourceDataLen != 0)
+			return CKR_MECHANISM_PARAM_INVALID;
+		hash_mech = oaep->hashAlg;
+		mgf_type = oaep->mgf;
+		*flags = SC_ALGORITHM_RSA_PAD_OAEP;
+	}
+	else {
+		CK_RSA_PKCS_PSS_PARAMS *pss = (CK_RSA_PKCS_PSS_PARAMS *) pMechanism->pParameter;
+
+		if (pss == NULL || pMechanism->ulParameterLen != sizeof(*pss))
+			return CKR_MECHANISM_PARAM_INVALID;
+		hash_mech = pss->hashAlg;
+		mgf_type = pss->mgf;
+		*flags = SC_ALGORITHM_RSA_PAD_PSS;
+	}
+
+	for (ii = 0; pkcs15_rsa_hashes[ii].hash_mech; ii++) {
+		if (pkcs15_rsa_hashes[ii].hash_mech == hash_mech)
+			hash = &pkcs15_rsa_hashes[ii];
+		if (pkcs15_rsa_hashes[ii].mgf == mgf_type)
+			mgf = &pkcs15_rsa_hashes[ii];
+	}
+	if (hash == NULL || mgf == NULL)
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	if (*flags == SC_ALGORITHM_RSA_PAD_PSS) {
+		CK_RSA_PKCS_PSS_PARAMS *pss = (CK_RSA_PKCS_PSS_PARAMS *) pMechanism->pParameter;
+
+		if (pss->sLen != hash->hash_len)
+			return CKR_MECHANISM_PARAM_INVALID;
+		/* the hash of the hash-and-sign mechanism must be the PSS hash */
+		if (pMechanism->mechanism != CKM_RSA_PKCS_PSS
+				&& pMechanism->mechanism != hash->pss_mech)
+			return CKR_MECHANISM_PARAM_INVALID;
+	}
+
+	*flags |= hash->hash_flag | mgf->mgf_flag;
+	if (hash_len)
+		*hash_len = hash->hash_len;
+	return CKR_OK;
+}
+
+
 static CK_RV
 pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pData,
@@ -3487,6 +4434,7 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	struct sc_pkcs11_card *p11card = session->slot->card;
 	struct pkcs15_fw_data *fw_data = NULL;
 	int rv, flags = 0, prkey_has_path = 0;
+	CK_ULONG hash_len;
 	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
 			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
 
@@ -3527,6 +4475,18 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	case CKM_RIPEMD160_RSA_PKCS:
 		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_RIPEMD160;
 		break;
+	case CKM_RSA_PKCS_PSS:
+	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		rv = pkcs15_rsa_pkcs1_v2_flags(pMechanism, &flags, &hash_len);
+		if (rv != CKR_OK)
+			return rv;
+		/* the input is the message hash */
+		if (ulDataLen != hash_len)
+			return CKR_DATA_LEN_RANGE;
+		break;
 	case CKM_RSA_X_509:
 		flags = SC_ALGORITHM_RSA_RAW;
 		break;
@@ -3542,6 +4502,18 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	case CKM_ECDSA_SHA1:
 		flags = SC_ALGORITHM_ECDSA_HASH_SHA1;
 		break;
+	case CKM_ECDSA_SHA224:
+		flags = SC_ALGORITHM_ECDSA_HASH_SHA224;
+		break;
+	case CKM_ECDSA_SHA256:
+		flags = SC_ALGORITHM_ECDSA_HASH_SHA256;
+		break;
+	case CKM_ECDSA_SHA384:
+		flags = SC_ALGORITHM_ECDSA_HASH_SHA384;
+		break;
+	case CKM_ECDSA_SHA512:
+		flags = SC_ALGORITHM_ECDSA_HASH_SHA512;
+		break;
 	default:
 		sc_log(context, "DEE - need EC for %d",pMechanism->mechanism);
 		return CKR_MECHANISM_INVALID;
@@ -3579,6 +4551,81 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 }
 
 
+static CK_RV
+pkcs15_prkey_sign_batch(struct sc_pkcs11_session *session, void *obj,
+			CK_MECHANISM_PTR pMechanism,
+			CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_ULONG ulCount,
+			CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+			CK_ULONG_PTR pulSignatureLen)
+{
+	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
+	struct sc_pkcs11_card *p11card = session->slot->card;
+	struct pkcs15_fw_data *fw_data = NULL;
+	const u8 **in = NULL;
+	size_t *inlen = NULL, *siglen = NULL;
+	CK_ULONG i;
+	int rv, flags = 0;
+	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
+			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
+
+	sc_log(context, "Batch signing of %lu inputs, mechanism 0x%lx.", ulCount, pMechanism->mechanism);
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	if (!fw_data)
+		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_OpenSC_SignBatch");
+
+	while (prkey && !(prkey->prv_info->usage & sign_flags))
+		prkey = prkey->prv_next;
+	if (prkey == NULL)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	/* The inputs are digests, the card does no hashing here */
+	switch (pMechanism->mechanism) {
+	case CKM_RSA_PKCS:
+		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+		break;
+	case CKM_RSA_X_509:
+		flags = SC_ALGORITHM_RSA_RAW;
+		break;
+	case CKM_GOSTR3410:
+		flags = SC_ALGORITHM_GOSTR3410_HASH_NONE;
+		break;
+	case CKM_ECDSA:
+		flags = SC_ALGORITHM_ECDSA_HASH_NONE;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (ulCount == 0)
+		return CKR_OK;
+
+	in = calloc(ulCount, sizeof(*in));
+	inlen = calloc(ulCount, sizeof(*inlen));
+	siglen = calloc(ulCount, sizeof(*siglen));
+	if (in == NULL || inlen == NULL || siglen == NULL) {
+		rv = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < ulCount; i++) {
+		in[i] = pData + i * ulDataLen;
+		inlen[i] = ulDataLen;
+	}
+
+	rv = sc_pkcs15_compute_signatures(fw_data->p15_card, prkey->prv_p15obj, flags,
+			in, inlen, ulCount, pSignature, ulSignatureLen, siglen);
+	if (rv == SC_SUCCESS)
+		for (i = 0; i < ulCount; i++)
+			pulSignatureLen[i] = siglen[i];
+
+out:
+	free(in);
+	free(inlen);
+	free(siglen);
+	sc_log(context, "Batch signing complete. Result %d.", rv);
+	return sc_to_cryptoki_error(rv, "C_OpenSC_SignBatch");
+}
+
+
 static CK_RV
 pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 		CK_MECHANISM_PTR pMechanism,
@@ -3615,6 +4662,11 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 	case CKM_RSA_X_509:
 		flags |= SC_ALGORITHM_RSA_RAW;
 		break;
+	case CKM_RSA_PKCS_OAEP:
+		rv = pkcs15_rsa_pkcs1_v2_flags(pMechanism, &flags, NULL);
+		if (rv != CKR_OK)
+			return rv;
+		break;
 	default:
 		return CKR_MECHANISM_INVALID;
 	}
@@ -3784,7 +4836,8 @@ struct sc_pkcs11_object_ops pkcs15_prkey_ops = {
 	NULL,	/* unwrap */
 	pkcs15_prkey_decrypt,
         pkcs15_prkey_derive,
-        pkcs15_prkey_can_do
+        pkcs15_prkey_can_do,
+	pkcs15_prkey_sign_batch
 };
 
 /*
@@ -3795,10 +4848,13 @@ pkcs15_pubkey_release(void *object)
 {
 	struct pkcs15_pubkey_object *pubkey = (struct pkcs15_pubkey_object*) object;
 	struct sc_pkcs15_pubkey *key_data = pubkey->pub_data;
+	u8 *ec_point = pubkey->ec_point;
 
-	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0)
+	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0) {
 		if (key_data)
 			sc_pkcs15_free_pubkey(key_data);
+		free(ec_point);
+	}
 }
 
 
@@ -3838,7 +4894,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 		case CKA_EC_POINT:
 			if (pubkey->pub_data == NULL)
 				/* FIXME: check the return value? */
-				check_cert_data_read(fw_data, cert);
+				check_pubkey_data_read(fw_data, pubkey);
 			break;
 	}
 
@@ -3892,6 +4948,13 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
 		else if (pubkey->pub_data && pubkey->pub_data->algorithm == SC_ALGORITHM_EC)
 			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
+		/* a key not read yet has the type of its PKCS#15 object */
+		else if (!pubkey->pub_data && pubkey->pub_p15obj
+				&& pubkey->pub_p15obj->type == SC_PKCS15_TYPE_PUBKEY_GOSTR3410)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
+		else if (!pubkey->pub_data && pubkey->pub_p15obj
+				&& pubkey->pub_p15obj->type == SC_PKCS15_TYPE_PUBKEY_EC)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
 		else
 			*(CK_KEY_TYPE*)attr->pValue = CKK_RSA;
 		break;
@@ -3973,7 +5036,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 	case CKA_EC_PARAMS:
 		return get_ec_pubkey_params(pubkey->pub_data, attr);
 	case CKA_EC_POINT:
-		return get_ec_pubkey_point(pubkey->pub_data, attr);
+		return get_ec_pubkey_point(pubkey, attr);
 
 	default:
 		return CKR_ATTRIBUTE_TYPE_INVALID;
@@ -3993,7 +5056,8 @@ struct sc_pkcs11_object_ops pkcs15_pubkey_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	NULL	/* sign_batch */
 };
 
 
@@ -4154,7 +5218,8 @@ struct sc_pkcs11_object_ops pkcs15_dobj_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	NULL	/* sign_batch */
 };
 
 
@@ -4222,6 +5287,18 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 		*(CK_BBOOL*)attr->pValue = (skey->base.p15_object->flags & 0x02) != 0;
 		/*TODO Why no definition of the flag */
 		break;
+	case CKA_SENSITIVE:
+		if (!skey->info)
+			return CKR_ATTRIBUTE_TYPE_INVALID;
+		check_attribute_buffer(attr, sizeof(CK_BBOOL));
+		*(CK_BBOOL*)attr->pValue = (skey->info->access_flags & SC_PKCS15_PRKEY_ACCESS_SENSITIVE) != 0;
+		break;
+	case CKA_EXTRACTABLE:
+		if (!skey->info)
+			return CKR_ATTRIBUTE_TYPE_INVALID;
+		check_attribute_buffer(attr, sizeof(CK_BBOOL));
+		*(CK_BBOOL*)attr->pValue = (skey->info->access_flags & SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE) != 0;
+		break;
 	case CKA_LABEL:
 		len = strlen(skey->base.p15_object->label);
 		check_attribute_buffer(attr, len);
@@ -4270,7 +5347,8 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 
 
 /*
- *  Secret key objects, currently used only to retrieve derived session key
+ *  Secret key objects, currently only session keys held by the module.
+ *  Encryption and decryption with them run on the host (openssl.c).
  */
 struct sc_pkcs11_object_ops pkcs15_skey_ops = {
 	pkcs15_skey_release,
@@ -4283,7 +5361,8 @@ struct sc_pkcs11_object_ops pkcs15_skey_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	NULL	/* sign_batch */
 };
 
 /*
@@ -4384,8 +5463,9 @@ get_ec_pubkey_params(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
 }
 
 static CK_RV
-get_ec_pubkey_point(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
+get_ec_pubkey_point(struct pkcs15_pubkey_object *pubkey, CK_ATTRIBUTE_PTR attr)
 {
+	struct sc_pkcs15_pubkey *key = pubkey->pub_data;
 	unsigned char *value = NULL;
 	size_t value_len = 0;
 	int rc;
@@ -4395,13 +5475,20 @@ get_ec_pubkey_point(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
 
 	switch (key->algorithm) {
 	case SC_ALGORITHM_EC:
-		rc = sc_pkcs15_encode_pubkey_ec(context, &key->u.ec, &value, &value_len);
-		if (rc != SC_SUCCESS)
-			return sc_to_cryptoki_error(rc, NULL);
+		/* clients ask for the point (often twice, for the length first),
+		 * encode it once per key */
+		if (pubkey->ec_point == NULL || pubkey->ec_point_key != key) {
+			rc = sc_pkcs15_encode_pubkey_ec(context, &key->u.ec, &value, &value_len);
+			if (rc != SC_SUCCESS)
+				return sc_to_cryptoki_error(rc, NULL);
+			free(pubkey->ec_point);
+			pubkey->ec_point = value;
+			pubkey->ec_point_len = value_len;
+			pubkey->ec_point_key = key;
+		}
 
-		check_attribute_buffer(attr, value_len);
-		memcpy(attr->pValue, value, value_len);
-		free(value);
+		check_attribute_buffer(attr, pubkey->ec_point_len);
+		memcpy(attr->pValue, pubkey->ec_point, pubkey->ec_point_len);
 		return CKR_OK;
 	}
 
@@ -4550,13 +5637,27 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 		return rc;
 
 #if ENABLE_OPENSSL
-	mt = sc_pkcs11_new_fw_mechanism(CKM_ECDSA_SHA1,
-		&mech_info, CKK_EC, NULL);
-	if (!mt)
-		return CKR_HOST_MEMORY;
-	rc = sc_pkcs11_register_mechanism(p11card, mt);
-	if (rc != CKR_OK)
-		return rc;
+	/* The message is hashed in software and the digest is signed with CKM_ECDSA,
+	 * so that C_SignUpdate is not limited by the size of the signature buffer. */
+	{
+		static const CK_MECHANISM_TYPE ecdsa_hashes[][2] = {
+			{ CKM_ECDSA_SHA1, CKM_SHA_1 },
+			{ CKM_ECDSA_SHA224, CKM_SHA224 },
+			{ CKM_ECDSA_SHA256, CKM_SHA256 },
+			{ CKM_ECDSA_SHA384, CKM_SHA384 },
+			{ CKM_ECDSA_SHA512, CKM_SHA512 }
+		};
+		unsigned int ii;
+
+		for (ii = 0; ii < sizeof(ecdsa_hashes) / sizeof(ecdsa_hashes[0]); ii++)   {
+			rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, ecdsa_hashes[ii][0], ecdsa_hashes[ii][1], mt);
+			/* software hash is not available in this OpenSSL */
+			if (rc == CKR_MECHANISM_INVALID)
+				continue;
+			if (rc != CKR_OK)
+				return rc;
+		}
+	}
 #endif
 
 	/* ADD ECDH mechanisms */
@@ -4616,6 +5717,8 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 #ifdef ENABLE_OPENSSL
 	/* That practise definitely conflicts with CKF_HW -- andre 2010-11-28 */
 	mech_info.flags |= CKF_VERIFY;
+	/* Public key encryption and wrapping are done on the host */
+	mech_info.flags |= CKF_ENCRYPT | CKF_WRAP;
 #endif
 	mech_info.ulMinKeySize = ~0;
 	mech_info.ulMaxKeySize = 0;
@@ -4745,6 +5848,40 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 #endif /* ENABLE_OPENSSL */
 	}
 
+#ifdef ENABLE_OPENSSL
+	/* PSS and OAEP are padded on the host if the card does raw RSA */
+	if (flags & (SC_ALGORITHM_RSA_RAW | SC_ALGORITHM_RSA_PAD_PSS)) {
+		CK_MECHANISM_INFO pss_info = mech_info;
+		int ii;
+
+		pss_info.flags = CKF_HW | CKF_SIGN;
+		mt = sc_pkcs11_new_fw_mechanism(CKM_RSA_PKCS_PSS, &pss_info, CKK_RSA, NULL);
+		rc = sc_pkcs11_register_mechanism(p11card, mt);
+		if (rc != CKR_OK)
+			return rc;
+
+		for (ii = 0; pkcs15_rsa_hashes[ii].hash_mech; ii++) {
+			rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card,
+					pkcs15_rsa_hashes[ii].pss_mech, pkcs15_rsa_hashes[ii].hash_mech, mt);
+			if (rc != CKR_OK)
+				return rc;
+		}
+	}
+
+	/* Encryption and wrapping with OAEP are public key operations */
+	{
+		CK_MECHANISM_INFO oaep_info = mech_info;
+
+		oaep_info.flags = CKF_ENCRYPT | CKF_WRAP;
+		if (flags & (SC_ALGORITHM_RSA_RAW | SC_ALGORITHM_RSA_PAD_OAEP))
+			oaep_info.flags |= CKF_HW | CKF_DECRYPT;
+		mt = sc_pkcs11_new_fw_mechanism(CKM_RSA_PKCS_OAEP, &oaep_info, CKK_RSA, NULL);
+		rc = sc_pkcs11_register_mechanism(p11card, mt);
+		if (rc != CKR_OK)
+			return rc;
+	}
+#endif
+
 	/* TODO support other padding mechanisms */
 
 		if (flags & SC_ALGORITHM_ONBOARD_KEY_GEN) {
@@ -181,7 +181,13 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL, /* init_pin */
 	NULL, /* create_object */
 	NULL, /* gen_keypair */
-	NULL  /* get_random */
+	NULL, /* get_random */
+	NULL, /* load_objects */
+	NULL, /* revalidate */
+	NULL, /* refill_key_pool */
+	NULL, /* reload_config */
+	NULL, /* same_user_pin */
+	NULL  /* share_login */
 };
 
 #else /* ifdef USE_PKCS15_INIT */
@@ -198,7 +204,13 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL,	/* init_pin */
 	NULL,	/* create_object */
 	NULL,	/* gen_keypair */
-	NULL	/* get_random */
+	NULL,	/* get_random */
+	NULL,	/* load_objects */
+	NULL,	/* revalidate */
+	NULL,	/* refill_key_pool */
+	NULL,	/* reload_config */
+	NULL,	/* same_user_pin */
+	NULL	/* share_login */
 };
 
 #endif
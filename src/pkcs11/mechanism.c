@@ -27,8 +27,40 @@ struct signature_data {
 	sc_pkcs11_operation_t *	md;
 	CK_BYTE			buffer[4096/8];
 	unsigned int		buffer_len;
+	/* Digest operation of the previous use, kept for the next one */
+	sc_pkcs11_operation_t *	idle_md;
+	unsigned int		idle_md_size;
 };
 
+/*
+ * Keep the mechanism of an operation. The parameter of the application
+ * needs not stay valid after the Init call, so small ones are copied.
+ */
+static void
+copy_mechanism(sc_pkcs11_operation_t *operation, CK_MECHANISM_PTR pMechanism)
+{
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	if (pMechanism->pParameter != NULL
+			&& pMechanism->ulParameterLen <= sizeof(operation->mechanism_params)) {
+		memcpy(&operation->mechanism_params, pMechanism->pParameter,
+				pMechanism->ulParameterLen);
+		operation->mechanism.pParameter = &operation->mechanism_params;
+	}
+}
+
+#define MECHANISM_INDEX_BUCKET(mech)	((mech) % SC_PKCS11_MECHANISM_INDEX_SIZE)
+
+static struct sc_pkcs11_mechanism_entry *
+mechanism_index_get(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech)
+{
+	struct sc_pkcs11_mechanism_entry *entry;
+
+	for (entry = p11card->mechanism_index[MECHANISM_INDEX_BUCKET(mech)]; entry; entry = entry->next)
+		if (entry->mech == mech)
+			return entry;
+	return NULL;
+}
+
 /*
  * Register a mechanism
  */
@@ -36,6 +68,7 @@ CK_RV
 sc_pkcs11_register_mechanism(struct sc_pkcs11_card *p11card,
 				sc_pkcs11_mechanism_type_t *mt)
 {
+	struct sc_pkcs11_mechanism_entry *entry;
 	sc_pkcs11_mechanism_type_t **p;
 
 	if (mt == NULL)
@@ -46,20 +79,55 @@ sc_pkcs11_register_mechanism(struct sc_pkcs11_card *p11card,
 	if (p == NULL)
 		return CKR_HOST_MEMORY;
 	p11card->mechanisms = p;
+
+	entry = mechanism_index_get(p11card, mt->mech);
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(struct sc_pkcs11_mechanism_entry));
+		if (entry == NULL)
+			return CKR_HOST_MEMORY;
+		entry->mech = mt->mech;
+		entry->mt = mt;
+		entry->next = p11card->mechanism_index[MECHANISM_INDEX_BUCKET(mt->mech)];
+		p11card->mechanism_index[MECHANISM_INDEX_BUCKET(mt->mech)] = entry;
+	}
+
 	p[p11card->nmechanisms++] = mt;
 	p[p11card->nmechanisms] = NULL;
+	entry->flags |= mt->mech_info.flags;
 	return CKR_OK;
 }
 
+void
+sc_pkcs11_free_mechanism_index(struct sc_pkcs11_card *p11card)
+{
+	struct sc_pkcs11_mechanism_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_MECHANISM_INDEX_SIZE; i++) {
+		while ((entry = p11card->mechanism_index[i]) != NULL) {
+			p11card->mechanism_index[i] = entry->next;
+			free(entry);
+		}
+	}
+}
+
 /*
  * Look up a mechanism
  */
 sc_pkcs11_mechanism_type_t *
 sc_pkcs11_find_mechanism(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech, unsigned int flags)
 {
+	struct sc_pkcs11_mechanism_entry *entry;
 	sc_pkcs11_mechanism_type_t *mt;
 	unsigned int n;
 
+	entry = mechanism_index_get(p11card, mech);
+	if (entry == NULL || (entry->flags & flags) != flags)
+		return NULL;
+	if ((entry->mt->mech_info.flags & flags) == flags)
+		return entry->mt;
+
+	/* Several types are registered for mech, the first one cannot do it */
 	for (n = 0; n < p11card->nmechanisms; n++) {
 		mt = p11card->mechanisms[n];
 		if (mt && mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
@@ -122,6 +190,7 @@ sc_pkcs11_new_operation(sc_pkcs11_session_t *session,
 
 	res = calloc(1, type->obj_size);
 	if (res) {
+		sc_mem_account_alloc(SC_MEM_PKCS11_SESSIONS, type->obj_size);
 		res->session = session;
 		res->type = type;
 	}
@@ -135,6 +204,8 @@ sc_pkcs11_release_operation(sc_pkcs11_operation_t **ptr)
 
 	if (!operation)
 		return;
+	if (operation->type)
+		sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, operation->type->obj_size);
 	if (operation->type && operation->type->release)
 		operation->type->release(operation);
 	memset(operation, 0, sizeof(*operation));
@@ -142,6 +213,99 @@ sc_pkcs11_release_operation(sc_pkcs11_operation_t **ptr)
 	*ptr = NULL;
 }
 
+/*
+ * The private data of the sign, verify and decrypt operations, and the
+ * digest operation within, stay with the session between two uses.
+ */
+static struct signature_data *
+signature_data_get(struct sc_pkcs11_session *session, struct sc_pkcs11_object *key)
+{
+	struct signature_data *data = session->idle_signature_data;
+
+	if (data)
+		session->idle_signature_data = NULL;
+	else if (!(data = calloc(1, sizeof(*data))))
+		return NULL;
+	else
+		sc_mem_account_alloc(SC_MEM_PKCS11_SESSIONS, sizeof(*data));
+	data->key = key;
+	return data;
+}
+
+static CK_RV
+signature_data_md_init(struct signature_data *data, sc_pkcs11_operation_t *operation,
+		struct hash_signature_info *info)
+{
+	sc_pkcs11_operation_t *md = data->idle_md;
+
+	if (md && data->idle_md_size == info->hash_type->obj_size)   {
+		data->idle_md = NULL;
+		md->session = operation->session;
+		md->type = info->hash_type;
+	}
+	else if (!(md = sc_pkcs11_new_operation(operation->session, info->hash_type)))   {
+		return CKR_HOST_MEMORY;
+	}
+	data->md = md;
+	return info->hash_type->md_init(md);
+}
+
+static void
+signature_data_free(struct signature_data *data)
+{
+	sc_pkcs11_release_operation(&data->md);
+	if (data->idle_md)
+		sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, data->idle_md_size);
+	free(data->idle_md);
+	memset(data, 0, sizeof(*data));
+	sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, sizeof(*data));
+	free(data);
+}
+
+static void
+signature_data_put(struct sc_pkcs11_session *session, struct signature_data *data)
+{
+	sc_pkcs11_operation_t *md = data->md;
+
+	if (md && !data->idle_md)   {
+		if (md->type->release)
+			md->type->release(md);
+		data->idle_md_size = md->type->obj_size;
+		memset(md, 0, data->idle_md_size);
+		data->idle_md = md;
+		data->md = NULL;
+	}
+	if (session->idle_signature_data)   {
+		signature_data_free(data);
+		return;
+	}
+
+	sc_pkcs11_release_operation(&data->md);
+	data->key = NULL;
+	data->info = NULL;
+	/* the buffer held the data to sign */
+	memset(data->buffer, 0, sizeof(data->buffer));
+	data->buffer_len = 0;
+	session->idle_signature_data = data;
+}
+
+void
+sc_pkcs11_free_idle_operations(struct sc_pkcs11_session *session)
+{
+	int type;
+
+	for (type = 0; type < SC_PKCS11_OPERATION_MAX; type++)   {
+		if (session->idle[type])
+			sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, session->idle_size[type]);
+		free(session->idle[type]);
+		session->idle[type] = NULL;
+	}
+	if (session->idle_signature_data)   {
+		signature_data_free(session->idle_signature_data);
+		session->idle_signature_data = NULL;
+	}
+}
+
 CK_RV
 sc_pkcs11_md_init(struct sc_pkcs11_session *session,
 			CK_MECHANISM_PTR pMechanism)
@@ -217,6 +381,42 @@ sc_pkcs11_md_final(struct sc_pkcs11_session *session,
 	LOG_FUNC_RETURN(context, rv);
 }
 
+/*
+ * Single-part digest: the length query and a too small buffer leave
+ * the operation active, as the data is not hashed yet.
+ */
+CK_RV
+sc_pkcs11_md_digest(struct sc_pkcs11_session *session,
+			CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+			CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_ULONG len = 0;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DIGEST, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+
+	rv = op->type->md_final(op, NULL, &len);
+	if (rv != CKR_BUFFER_TOO_SMALL)
+		goto done;
+
+	if (pDigest == NULL || *pulDigestLen < len)   {
+		rv = pDigest == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+		*pulDigestLen = len;
+		LOG_FUNC_RETURN(context, rv);
+	}
+
+	rv = op->type->md_update(op, pData, ulDataLen);
+	if (rv == CKR_OK)
+		rv = op->type->md_final(op, pDigest, pulDigestLen);
+
+done:
+	session_stop_operation(session, SC_PKCS11_OPERATION_DIGEST);
+	LOG_FUNC_RETURN(context, rv);
+}
+
 /*
  * Initialize a signing context. When we get here, we know
  * the key object is capable of signing _something_
@@ -248,7 +448,7 @@ sc_pkcs11_sign_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechani
 	if (rv != CKR_OK)
 		LOG_FUNC_RETURN(context, rv);
 
-	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	copy_mechanism(operation, pMechanism);
 	rv = mt->sign_init(operation, key);
 	if (rv != CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
@@ -347,10 +547,8 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 	int can_do_it = 0;
 
 	LOG_FUNC_CALLED(context);
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = signature_data_get(operation->session, key)))
 		LOG_FUNC_RETURN(context, CKR_HOST_MEMORY);
-	data->info = NULL;
-	data->key = key;
 
 	if (key->ops->can_do)   {
 		rv = key->ops->can_do(operation->session, key, operation->type->mech, CKF_SIGN);
@@ -364,7 +562,7 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 		}
 		else  {
 			/* Mechanism recognised but cannot be performed by pkcs#15 card, or some general error. */
-			free(data);
+			signature_data_put(operation->session, data);
 			LOG_FUNC_RETURN(context, rv);
 		}
 	}
@@ -376,14 +574,9 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 	if (info != NULL && !can_do_it) {
 		/* Initialize hash operation */
 
-		data->md = sc_pkcs11_new_operation(operation->session, info->hash_type);
-		if (data->md == NULL)
-			rv = CKR_HOST_MEMORY;
-		else
-			rv = info->hash_type->md_init(data->md);
+		rv = signature_data_md_init(data, operation, info);
 		if (rv != CKR_OK) {
-			sc_pkcs11_release_operation(&data->md);
-			free(data);
+			signature_data_put(operation->session, data);
 			LOG_FUNC_RETURN(context, rv);
 		}
 		data->info = info;
@@ -421,11 +614,13 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	struct signature_data *data;
+	CK_MECHANISM mechanism;
 	CK_RV rv;
 
 	LOG_FUNC_CALLED(context);
 	data = (struct signature_data *) operation->priv_data;
 	sc_log(context, "data length %li", data->buffer_len);
+	memcpy(&mechanism, &operation->mechanism, sizeof(mechanism));
 	if (data->md) {
 		sc_pkcs11_operation_t	*md = data->md;
 		CK_ULONG len = sizeof(data->buffer);
@@ -436,10 +631,14 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		if (rv != CKR_OK)
 			LOG_FUNC_RETURN(context, rv);
 		data->buffer_len = len;
+
+		/* ECDSA signs the digest as it is: ask the card for the plain mechanism */
+		if (data->info->sign_type->key_type == CKK_EC)
+			mechanism.mechanism = data->info->sign_mech;
 	}
 
 	sc_log(context, "%li bytes to sign", data->buffer_len);
-	rv = data->key->ops->sign(operation->session, data->key, &operation->mechanism,
+	rv = data->key->ops->sign(operation->session, data->key, &mechanism,
 			data->buffer, data->buffer_len, pSignature, pulSignatureLen);
 	LOG_FUNC_RETURN(context, rv);
 }
@@ -495,9 +694,8 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	data = (struct signature_data *) operation->priv_data;
 	if (!data)
 	    return;
-	sc_pkcs11_release_operation(&data->md);
-	memset(data, 0, sizeof(*data));
-	free(data);
+	operation->priv_data = NULL;
+	signature_data_put(operation->session, data);
 }
 
 #ifdef ENABLE_OPENSSL
@@ -531,7 +729,7 @@ sc_pkcs11_verif_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechan
 	if (rv != CKR_OK)
 		return rv;
 
-	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	copy_mechanism(operation, pMechanism);
 	rv = mt->verif_init(operation, key);
 
 	if (rv != CKR_OK)
@@ -600,26 +798,17 @@ sc_pkcs11_verify_init(sc_pkcs11_operation_t *operation,
 	struct signature_data *data;
 	int rv;
 
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = signature_data_get(operation->session, key)))
 		return CKR_HOST_MEMORY;
 
-	data->info = NULL;
-	data->key = key;
-
 	/* If this is a verify with hash operation, set up the
 	 * hash operation */
 	info = (struct hash_signature_info *) operation->type->mech_data;
 	if (info != NULL) {
 		/* Initialize hash operation */
-		data->md = sc_pkcs11_new_operation(operation->session,
-						   info->hash_type);
-		if (data->md == NULL)
-			rv = CKR_HOST_MEMORY;
-		else
-			rv = info->hash_type->md_init(data->md);
+		rv = signature_data_md_init(data, operation, info);
 		if (rv != CKR_OK) {
-			sc_pkcs11_release_operation(&data->md);
-			free(data);
+			signature_data_put(operation->session, data);
 			return rv;
 		}
 		data->info = info;
@@ -656,7 +845,7 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 {
 	struct signature_data *data;
 	struct sc_pkcs11_object *key;
-	unsigned char *pubkey_value;
+	unsigned char *pubkey_value = NULL;
 	CK_KEY_TYPE key_type;
 	CK_BYTE params[9 /* GOST_PARAMS_OID_SIZE */] = { 0 };
 	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
@@ -670,24 +859,29 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 		return CKR_ARGUMENTS_BAD;
 
 	key = data->key;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		return rv;
-	pubkey_value = calloc(1, attr.ulValueLen);
-	attr.pValue = pubkey_value;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		goto done;
-
-	rv = key->ops->get_attribute(operation->session, key, &attr_key_type);
-	if (rv == CKR_OK && key_type == CKK_GOSTR3410) {
-		rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
+	/* the key value is only needed until the key has been parsed once */
+	if (key->verify_key == NULL) {
+		rv = key->ops->get_attribute(operation->session, key, &attr);
+		if (rv != CKR_OK)
+			return rv;
+		pubkey_value = calloc(1, attr.ulValueLen);
+		if (pubkey_value == NULL)
+			return CKR_HOST_MEMORY;
+		attr.pValue = pubkey_value;
+		rv = key->ops->get_attribute(operation->session, key, &attr);
 		if (rv != CKR_OK)
 			goto done;
+
+		rv = key->ops->get_attribute(operation->session, key, &attr_key_type);
+		if (rv == CKR_OK && key_type == CKK_GOSTR3410) {
+			rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
+			if (rv != CKR_OK)
+				goto done;
+		}
 	}
 
 	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
-		params, sizeof(params),
+		params, sizeof(params), &key->verify_key,
 		operation->mechanism.mechanism, data->md,
 		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
 
@@ -696,6 +890,202 @@ done:
 
 	return rv;
 }
+
+/*
+ * Public key encryption runs in software with the key value, so it
+ * needs no card access once the key has been parsed.
+ */
+static CK_RV
+sc_pkcs11_encrypt_with_key(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
+	unsigned char *pubkey_value = NULL;
+	CK_RV rv;
+
+	if (key->verify_key == NULL) {
+		rv = key->ops->get_attribute(session, key, &attr);
+		if (rv != CKR_OK)
+			return rv;
+		pubkey_value = calloc(1, attr.ulValueLen);
+		if (pubkey_value == NULL)
+			return CKR_HOST_MEMORY;
+		attr.pValue = pubkey_value;
+		rv = key->ops->get_attribute(session, key, &attr);
+		if (rv != CKR_OK)
+			goto done;
+	}
+
+	rv = sc_pkcs11_encrypt_data(pubkey_value, attr.ulValueLen, &key->verify_key,
+			pMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+
+done:
+	free(pubkey_value);
+	return rv;
+}
+
+/*
+ * Initialize an encryption context. When we get here, we know
+ * the key object is capable of encrypting _something_
+ */
+CK_RV
+sc_pkcs11_encr_init(struct sc_pkcs11_session *session,
+			CK_MECHANISM_PTR pMechanism,
+			struct sc_pkcs11_object *key,
+			CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_ENCRYPT);
+	if (mt == NULL || mt->encrypt_init == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_ENCRYPT, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	copy_mechanism(operation, pMechanism);
+	rv = mt->encrypt_init(operation, key);
+
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = op->type->encrypt(op, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pEncryptedData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr_update(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->encrypt_update == NULL)
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	else
+		rv = op->type->encrypt_update(op, pPart, ulPartLen,
+				pEncryptedPart, pulEncryptedPartLen);
+
+	if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr_final(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->encrypt_final == NULL)
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	else
+		rv = op->type->encrypt_final(op, pLastEncryptedPart,
+				pulLastEncryptedPartLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pLastEncryptedPart != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+/* Wrap the value of a secret key with a public key */
+CK_RV
+sc_pkcs11_wrap(struct sc_pkcs11_session *session,
+		CK_MECHANISM_PTR pMechanism,
+		struct sc_pkcs11_object *wrapping_key,
+		CK_MECHANISM_TYPE key_type,
+		CK_BYTE_PTR pKeyValue, CK_ULONG ulKeyValueLen,
+		CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_mechanism_type_t *mt;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->card))
+		return CKR_ARGUMENTS_BAD;
+
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_WRAP);
+	if (mt == NULL || mt->encrypt == NULL)
+		return CKR_MECHANISM_INVALID;
+	if (mt->key_type != key_type)
+		return CKR_WRAPPING_KEY_TYPE_INCONSISTENT;
+
+	return sc_pkcs11_encrypt_with_key(session, wrapping_key, pMechanism,
+			pKeyValue, ulKeyValueLen, pWrappedKey, pulWrappedKeyLen);
+}
+
+static CK_RV
+sc_pkcs11_encrypt_init(sc_pkcs11_operation_t *operation,
+			struct sc_pkcs11_object *key)
+{
+	struct signature_data *data;
+
+	if (!(data = signature_data_get(operation->session, key)))
+		return CKR_HOST_MEMORY;
+
+	operation->priv_data = data;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_encrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data*) operation->priv_data;
+	return sc_pkcs11_encrypt_with_key(operation->session, data->key,
+			&operation->mechanism, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+}
 #endif
 
 /*
@@ -730,7 +1120,7 @@ sc_pkcs11_decr_init(struct sc_pkcs11_session *session,
 	if (rv != CKR_OK)
 		return rv;
 
-	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	copy_mechanism(operation, pMechanism);
 	rv = mt->decrypt_init(operation, key);
 
 	if (rv != CKR_OK)
@@ -760,6 +1150,52 @@ sc_pkcs11_decr(struct sc_pkcs11_session *session,
 	return rv;
 }
 
+CK_RV
+sc_pkcs11_decr_update(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->decrypt_update == NULL)
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	else
+		rv = op->type->decrypt_update(op, pEncryptedPart, ulEncryptedPartLen,
+				pPart, pulPartLen);
+
+	if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_DECRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_decr_final(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->decrypt_final == NULL)
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	else
+		rv = op->type->decrypt_final(op, pLastPart, pulLastPartLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pLastPart != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_DECRYPT);
+
+	return rv;
+}
+
 /* Derive one key from another, and return results in created object */
 CK_RV
 sc_pkcs11_deri(struct sc_pkcs11_session *session,
@@ -867,10 +1303,11 @@ sc_pkcs11_decrypt_init(sc_pkcs11_operation_t *operation,
 {
 	struct signature_data *data;
 
-	if (!(data = calloc(1, sizeof(*data))))
-		return CKR_HOST_MEMORY;
+	if (key->ops->decrypt == NULL)
+		return CKR_KEY_TYPE_INCONSISTENT;
 
-	data->key = key;
+	if (!(data = signature_data_get(operation->session, key)))
+		return CKR_HOST_MEMORY;
 
 	operation->priv_data = data;
 	return CKR_OK;
@@ -950,6 +1387,12 @@ sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE mech,
 		mt->decrypt_init = sc_pkcs11_decrypt_init;
 		mt->decrypt = sc_pkcs11_decrypt;
 	}
+#ifdef ENABLE_OPENSSL
+	if (pInfo->flags & (CKF_ENCRYPT | CKF_WRAP)) {
+		mt->encrypt_init = sc_pkcs11_encrypt_init;
+		mt->encrypt = sc_pkcs11_encrypt;
+	}
+#endif
 
 	return mt;
 }
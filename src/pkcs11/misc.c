@@ -25,6 +25,10 @@
 
 #include "sc-pkcs11.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 #define DUMP_TEMPLATE_MAX	32
 
 struct sc_to_cryptoki_error_conversion  {
@@ -144,8 +148,16 @@ CK_RV session_start_operation(struct sc_pkcs11_session * session,
 	if (session->operation[type] != NULL)
 		return CKR_OPERATION_ACTIVE;
 
-	if (!(op = sc_pkcs11_new_operation(session, mech)))
+	op = session->idle[type];
+	if (op && session->idle_size[type] == mech->obj_size)   {
+		/* reuse the operation of the previous Init, reset on stop */
+		session->idle[type] = NULL;
+		op->session = session;
+		op->type = mech;
+	}
+	else if (!(op = sc_pkcs11_new_operation(session, mech)))   {
 		return CKR_HOST_MEMORY;
+	}
 
 	session->operation[type] = op;
 	if (operation)
@@ -180,10 +192,204 @@ CK_RV session_stop_operation(struct sc_pkcs11_session * session, int type)
 	if (session->operation[type] == NULL)
 		return CKR_OPERATION_NOT_INITIALIZED;
 
+	if (!session->idle[type])   {
+		sc_pkcs11_operation_t *op = session->operation[type];
+		sc_pkcs11_mechanism_type_t *mech = op->type;
+
+		/* keep the operation for the next Init of this type */
+		if (mech->release)
+			mech->release(op);
+		memset(op, 0, mech->obj_size);
+		session->idle[type] = op;
+		session->idle_size[type] = mech->obj_size;
+		session->operation[type] = NULL;
+		return CKR_OK;
+	}
+
 	sc_pkcs11_release_operation(&session->operation[type]);
 	return CKR_OK;
 }
 
+/* Release the active operations and the cached resources of a session */
+void session_release_operations(struct sc_pkcs11_session * session)
+{
+	int type;
+
+	for (type = 0; type < SC_PKCS11_OPERATION_MAX; type++)
+		sc_pkcs11_release_operation(&session->operation[type]);
+	sc_pkcs11_free_idle_operations(session);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_openssl_md_pool_free(session);
+#endif
+}
+
+/*
+ * Handle tables: a handle is the index of its entry (plus one, so that 0
+ * stays CK_INVALID_HANDLE) tagged with the generation of the entry. The
+ * generation is bumped whenever an entry is freed, so a stale handle
+ * does not find a later occupant of the same entry.
+ */
+#define HANDLE_INDEX_BITS	20
+#define HANDLE_INDEX_MASK	((1UL << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_MAX_ENTRIES	HANDLE_INDEX_MASK
+
+/*
+ * The card detection threads of card_detect_all() add and remove handles
+ * next to each other, and the tables are read under the reader locks.
+ */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+static pthread_mutex_t handle_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define handle_tables_lock()	pthread_mutex_lock(&handle_tables_mutex)
+#define handle_tables_unlock()	pthread_mutex_unlock(&handle_tables_mutex)
+#else
+#define handle_tables_lock()
+#define handle_tables_unlock()
+#endif
+
+static CK_RV __handle_table_add(struct sc_pkcs11_handle_table *table, void *ptr, void *owner,
+		CK_ULONG *handle)
+{
+	struct sc_pkcs11_handle_entry *entry;
+	unsigned int idx;
+
+	if (table->free_list) {
+		idx = table->free_list - 1;
+		table->free_list = table->entries[idx].next_free;
+	}
+	else {
+		if (table->used == table->allocated) {
+			unsigned int allocated = table->allocated ? table->allocated * 2 : 64;
+
+			if (allocated > HANDLE_MAX_ENTRIES)
+				allocated = HANDLE_MAX_ENTRIES;
+			if (allocated <= table->used)
+				return CKR_HOST_MEMORY;
+			entry = realloc(table->entries, allocated * sizeof(*entry));
+			if (entry == NULL)
+				return CKR_HOST_MEMORY;
+			table->entries = entry;
+			table->allocated = allocated;
+		}
+		idx = table->used++;
+		table->entries[idx].generation = 0;
+	}
+
+	entry = &table->entries[idx];
+	entry->ptr = ptr;
+	entry->owner = owner;
+	entry->next_free = 0;
+	entry->handle = ((CK_ULONG) entry->generation << HANDLE_INDEX_BITS) | (idx + 1);
+	*handle = entry->handle;
+	return CKR_OK;
+}
+
+CK_RV handle_table_add(struct sc_pkcs11_handle_table *table, void *ptr, void *owner,
+		CK_ULONG *handle)
+{
+	CK_RV rv;
+
+	handle_tables_lock();
+	rv = __handle_table_add(table, ptr, owner, handle);
+	handle_tables_unlock();
+	return rv;
+}
+
+void *handle_table_get(const struct sc_pkcs11_handle_table *table, CK_ULONG handle,
+		void **owner)
+{
+	const struct sc_pkcs11_handle_entry *entry;
+	CK_ULONG idx = handle & HANDLE_INDEX_MASK;
+	void *ptr = NULL;
+
+	handle_tables_lock();
+	if (idx != 0 && idx <= table->used) {
+		entry = &table->entries[idx - 1];
+		if (entry->ptr != NULL && entry->handle == handle) {
+			if (owner)
+				*owner = entry->owner;
+			ptr = entry->ptr;
+		}
+	}
+	handle_tables_unlock();
+	return ptr;
+}
+
+static void __handle_table_remove(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	struct sc_pkcs11_handle_entry *entry;
+	CK_ULONG idx = handle & HANDLE_INDEX_MASK;
+
+	if (idx == 0 || idx > table->used)
+		return;
+	entry = &table->entries[idx - 1];
+	if (entry->ptr == NULL || entry->handle != handle)
+		return;
+	entry->ptr = NULL;
+	entry->owner = NULL;
+	entry->handle = 0;
+	/* wraps harmlessly where CK_ULONG has no room for more */
+	entry->generation = (entry->generation + 1) & (~0UL >> HANDLE_INDEX_BITS);
+	entry->next_free = table->free_list;
+	table->free_list = idx;
+}
+
+void handle_table_remove(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	handle_tables_lock();
+	__handle_table_remove(table, handle);
+	handle_tables_unlock();
+}
+
+void handle_table_free(struct sc_pkcs11_handle_table *table)
+{
+	free(table->entries);
+	memset(table, 0, sizeof(*table));
+}
+
+CK_RV vector_append(struct sc_pkcs11_vector *v, void *item)
+{
+	if (v->count == v->allocated) {
+		unsigned int allocated = v->allocated ? v->allocated * 2 : 16;
+		void **items = realloc(v->items, allocated * sizeof(*items));
+
+		if (items == NULL)
+			return CKR_HOST_MEMORY;
+		v->items = items;
+		v->allocated = allocated;
+	}
+	v->items[v->count++] = item;
+	return CKR_OK;
+}
+
+/* Returns the index of the item or -1 */
+int vector_locate(const struct sc_pkcs11_vector *v, const void *item)
+{
+	unsigned int i;
+
+	for (i = 0; i < v->count; i++)
+		if (v->items[i] == item)
+			return (int) i;
+	return -1;
+}
+
+/* Removes the item keeping the order of the others, returns -1 if absent */
+int vector_delete(struct sc_pkcs11_vector *v, const void *item)
+{
+	int i = vector_locate(v, item);
+
+	if (i < 0)
+		return -1;
+	v->count--;
+	memmove(&v->items[i], &v->items[i + 1], (v->count - i) * sizeof(*v->items));
+	return 0;
+}
+
+void vector_free(struct sc_pkcs11_vector *v)
+{
+	free(v->items);
+	memset(v, 0, sizeof(*v));
+}
+
 CK_RV attr_extract(CK_ATTRIBUTE_PTR pAttr, void *ptr, size_t * sizep)
 {
 	unsigned int size;
@@ -289,6 +495,8 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	scconf_block *conf_block = NULL;
 	char *unblock_style = NULL;
 	char *create_slots_for_pins = NULL, *op, *tmp;
+	const char *key_pool_bits;
+	int ratio;
 
 	/* Set defaults */
 	conf->plug_and_play = 1;
@@ -304,6 +512,18 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->create_puk_slot = 0;
 	conf->zero_ckaid_for_ca_certs = 0;
 	conf->create_slots_flags = SC_PKCS11_SLOT_CREATE_ALL;
+	conf->lazy_data_objects = 0;
+	conf->prefetch_certificates = 0;
+	conf->pin_info_cache_time = 0;
+	conf->random_pool_size = 0;
+	conf->random_pool_ratio = 1;
+	conf->slot_event_monitor = 0;
+	conf->bind_workers = 1;
+	conf->object_pool_size = 32;
+	conf->load_balance_label = NULL;
+	conf->key_pool_size = 0;
+	conf->key_pool_bits[0] = 2048;
+	conf->key_pool_sizes = 1;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -326,6 +546,35 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	conf->create_puk_slot = scconf_get_bool(conf_block, "create_puk_slot", conf->create_puk_slot);
 	conf->zero_ckaid_for_ca_certs = scconf_get_bool(conf_block, "zero_ckaid_for_ca_certs", conf->zero_ckaid_for_ca_certs);
+	conf->lazy_data_objects = scconf_get_bool(conf_block, "lazy_data_objects", conf->lazy_data_objects);
+	conf->prefetch_certificates = scconf_get_bool(conf_block, "prefetch_certificates", conf->prefetch_certificates);
+	conf->pin_info_cache_time = scconf_get_int(conf_block, "pin_info_cache_time", conf->pin_info_cache_time);
+	conf->random_pool_size = scconf_get_int(conf_block, "random_pool_size", conf->random_pool_size);
+	/* checked before it is stored unsigned */
+	ratio = scconf_get_int(conf_block, "random_pool_ratio", (int) conf->random_pool_ratio);
+	conf->random_pool_ratio = ratio < 1 ? 1 : (unsigned int) ratio;
+	conf->slot_event_monitor = scconf_get_bool(conf_block, "slot_event_monitor", conf->slot_event_monitor);
+	conf->bind_workers = scconf_get_int(conf_block, "bind_workers", conf->bind_workers);
+	if (conf->bind_workers < 1)
+		conf->bind_workers = 1;
+	conf->object_pool_size = scconf_get_int(conf_block, "object_pool_size", conf->object_pool_size);
+	conf->load_balance_label = scconf_get_str(conf_block, "load_balance_label", NULL);
+	if (conf->load_balance_label && (!*conf->load_balance_label
+			|| strlen(conf->load_balance_label) > 32))
+		conf->load_balance_label = NULL;
+	conf->key_pool_size = scconf_get_int(conf_block, "key_pool_size", conf->key_pool_size);
+	key_pool_bits = scconf_get_str(conf_block, "key_pool_rsa_bits", NULL);
+	if (key_pool_bits) {
+		conf->key_pool_sizes = 0;
+		tmp = strdup(key_pool_bits);
+		op = tmp ? strtok(tmp, " ,") : NULL;
+		while (op && conf->key_pool_sizes < SC_PKCS11_KEY_POOL_SIZES) {
+			if (atoi(op) > 0)
+				conf->key_pool_bits[conf->key_pool_sizes++] = atoi(op);
+			op = strtok(NULL, " ,");
+		}
+		free(tmp);
+	}
 
 	create_slots_for_pins = (char *)scconf_get_str(conf_block, "create_slots_for_pins", "all");
 	conf->create_slots_flags = 0;
@@ -346,8 +595,17 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	sc_log(ctx, "PKCS#11 options: plug_and_play=%d max_virtual_slots=%d slots_per_card=%d "
 		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d "
-		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X",
+		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X lazy_data_objects=%d "
+		 "prefetch_certificates=%d "
+		 "pin_info_cache_time=%u random_pool_size=%u random_pool_ratio=%u "
+		 "slot_event_monitor=%u bind_workers=%u object_pool_size=%u load_balance_label=%s "
+		 "key_pool_size=%u",
 		 conf->plug_and_play, conf->max_virtual_slots, conf->slots_per_card,
 		 conf->hide_empty_tokens, conf->lock_login, conf->pin_unblock_style,
-		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags);
+		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags, conf->lazy_data_objects,
+		 conf->prefetch_certificates,
+		 conf->pin_info_cache_time, conf->random_pool_size, conf->random_pool_ratio,
+		 conf->slot_event_monitor, conf->bind_workers, conf->object_pool_size,
+		 conf->load_balance_label ? conf->load_balance_label : "<none>",
+		 conf->key_pool_size);
 }
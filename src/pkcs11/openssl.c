@@ -8,10 +8,13 @@
 #include "config.h"
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
+#include <openssl/x509.h>
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
 #include <openssl/conf.h>
@@ -34,6 +37,19 @@ static CK_RV	sc_pkcs11_openssl_md_update(sc_pkcs11_operation_t *,
 static CK_RV	sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG_PTR);
 static void	sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *);
+static CK_RV	sc_pkcs11_openssl_encrypt_init(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+static CK_RV	sc_pkcs11_openssl_decrypt_init(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+static CK_RV	sc_pkcs11_openssl_cipher(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+static CK_RV	sc_pkcs11_openssl_cipher_update(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+static CK_RV	sc_pkcs11_openssl_cipher_final(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+static void	sc_pkcs11_openssl_cipher_release(sc_pkcs11_operation_t *);
 
 static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	CKM_SHA_1,
@@ -48,10 +64,32 @@ static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
 };
 
 #if OPENSSL_VERSION_NUMBER >= 0x00908000L
+static sc_pkcs11_mechanism_type_t openssl_sha224_mech = {
+	CKM_SHA224,
+	{ 0, 0, CKF_DIGEST },
+	0,
+	sizeof(struct sc_pkcs11_operation),
+	sc_pkcs11_openssl_md_release,
+	sc_pkcs11_openssl_md_init,
+	sc_pkcs11_openssl_md_update,
+	sc_pkcs11_openssl_md_final,
+	NULL, NULL, NULL, NULL,	/* sign_* */
+	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* decrypt_* */
+	NULL,			/* derive */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
+};
+
 static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	CKM_SHA256,
 	{ 0, 0, CKF_DIGEST },
@@ -65,7 +103,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
 };
 
 static sc_pkcs11_mechanism_type_t openssl_sha384_mech = {
@@ -81,7 +122,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha384_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
 };
 
 static sc_pkcs11_mechanism_type_t openssl_sha512_mech = {
@@ -97,7 +141,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha512_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
 };
 #endif
 
@@ -115,7 +162,10 @@ static sc_pkcs11_mechanism_type_t openssl_gostr3411_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
 };
 #endif
 
@@ -132,7 +182,10 @@ static sc_pkcs11_mechanism_type_t openssl_md5_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
 };
 
 static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
@@ -148,12 +201,74 @@ static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
-	NULL			/* mech_data */
+	NULL, NULL,		/* encrypt_* */
+	NULL,			/* mech_data */
+	NULL, NULL,		/* encrypt_update, encrypt_final */
+	NULL, NULL		/* decrypt_update, decrypt_final */
+};
+
+/*
+ * Symmetric ciphers run on the host, for secret keys whose value is held
+ * by the module (session keys from C_UnwrapKey, C_DeriveKey or
+ * C_CreateObject). The card is not used.
+ */
+#define SC_PKCS11_CIPHER_ECB	1
+#define SC_PKCS11_CIPHER_CBC	2
+#define SC_PKCS11_CIPHER_CTR	3
+#define SC_PKCS11_CIPHER_GCM	4
+
+struct sc_pkcs11_cipher_info {
+	int		mode;
+	int		padding;
+};
+
+static const struct sc_pkcs11_cipher_info cipher_ecb = { SC_PKCS11_CIPHER_ECB, 0 };
+static const struct sc_pkcs11_cipher_info cipher_cbc = { SC_PKCS11_CIPHER_CBC, 0 };
+static const struct sc_pkcs11_cipher_info cipher_cbc_pad = { SC_PKCS11_CIPHER_CBC, 1 };
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+static const struct sc_pkcs11_cipher_info cipher_ctr = { SC_PKCS11_CIPHER_CTR, 0 };
+static const struct sc_pkcs11_cipher_info cipher_gcm = { SC_PKCS11_CIPHER_GCM, 0 };
+#endif
+
+#define OPENSSL_CIPHER_MECH(mech, key_type, min_size, max_size, info) { \
+	mech, \
+	{ min_size, max_size, CKF_ENCRYPT | CKF_DECRYPT }, \
+	key_type, \
+	sizeof(struct sc_pkcs11_operation), \
+	sc_pkcs11_openssl_cipher_release, \
+	NULL, NULL, NULL,	/* md_* */ \
+	NULL, NULL, NULL, NULL,	/* sign_* */ \
+	NULL, NULL, NULL,	/* verif_* */ \
+	sc_pkcs11_openssl_decrypt_init, \
+	sc_pkcs11_openssl_cipher, \
+	NULL,			/* derive */ \
+	sc_pkcs11_openssl_encrypt_init, \
+	sc_pkcs11_openssl_cipher, \
+	info, \
+	sc_pkcs11_openssl_cipher_update, \
+	sc_pkcs11_openssl_cipher_final, \
+	sc_pkcs11_openssl_cipher_update, \
+	sc_pkcs11_openssl_cipher_final \
+}
+
+static sc_pkcs11_mechanism_type_t openssl_cipher_mechs[] = {
+	OPENSSL_CIPHER_MECH(CKM_AES_ECB, CKK_AES, 16, 32, &cipher_ecb),
+	OPENSSL_CIPHER_MECH(CKM_AES_CBC, CKK_AES, 16, 32, &cipher_cbc),
+	OPENSSL_CIPHER_MECH(CKM_AES_CBC_PAD, CKK_AES, 16, 32, &cipher_cbc_pad),
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	OPENSSL_CIPHER_MECH(CKM_AES_CTR, CKK_AES, 16, 32, &cipher_ctr),
+	OPENSSL_CIPHER_MECH(CKM_AES_GCM, CKK_AES, 16, 32, &cipher_gcm),
+#endif
+	OPENSSL_CIPHER_MECH(CKM_DES3_ECB, CKK_DES3, 16, 24, &cipher_ecb),
+	OPENSSL_CIPHER_MECH(CKM_DES3_CBC, CKK_DES3, 16, 24, &cipher_cbc),
+	OPENSSL_CIPHER_MECH(CKM_DES3_CBC_PAD, CKK_DES3, 16, 24, &cipher_cbc_pad)
 };
 
 void
 sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
 {
+	unsigned int i;
+
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE)
 	void (*locking_cb)(int, int, const char *, int);
 	ENGINE *e;
@@ -194,6 +309,8 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
 	openssl_sha1_mech.mech_data = EVP_sha1();
 	sc_pkcs11_register_mechanism(card, &openssl_sha1_mech);
 #if OPENSSL_VERSION_NUMBER >= 0x00908000L
+	openssl_sha224_mech.mech_data = EVP_sha224();
+	sc_pkcs11_register_mechanism(card, &openssl_sha224_mech);
 	openssl_sha256_mech.mech_data = EVP_sha256();
 	sc_pkcs11_register_mechanism(card, &openssl_sha256_mech);
 	openssl_sha384_mech.mech_data = EVP_sha384();
@@ -209,28 +326,108 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
 	openssl_gostr3411_mech.mech_data = EVP_get_digestbynid(NID_id_GostR3411_94);
 	sc_pkcs11_register_mechanism(card, &openssl_gostr3411_mech);
 #endif
+
+	for (i = 0; i < sizeof(openssl_cipher_mechs) / sizeof(openssl_cipher_mechs[0]); i++)
+		sc_pkcs11_register_mechanism(card, &openssl_cipher_mechs[i]);
 }
 
 
 /*
  * Handle OpenSSL digest functions
+ *
+ * The digest contexts are kept in a per-session pool: for each digest a
+ * template is initialized once and the working context is re-initialized
+ * by copying it. The contexts are released when the session is closed.
  */
+struct sc_pkcs11_md_entry {
+	EVP_MD_CTX	ctx;		/* must be first, see DIGEST_CTX() */
+	EVP_MD_CTX	tmpl;
+	const EVP_MD	*md;
+	int		busy;
+	int		pooled;
+	struct sc_pkcs11_md_entry *next;
+};
+
 #define DIGEST_CTX(op) \
 	((EVP_MD_CTX *) (op)->priv_data)
 
+static struct sc_pkcs11_md_entry *
+sc_pkcs11_openssl_md_get(struct sc_pkcs11_session *session, const EVP_MD *md)
+{
+	struct sc_pkcs11_md_entry *entry = NULL;
+
+	if (session)
+		for (entry = session->md_pool; entry; entry = entry->next)
+			if (entry->md == md && !entry->busy)
+				break;
+
+	if (!entry)   {
+		if (!(entry = calloc(1, sizeof(*entry))))
+			return NULL;
+		EVP_MD_CTX_init(&entry->ctx);
+		EVP_MD_CTX_init(&entry->tmpl);
+		if (!EVP_DigestInit_ex(&entry->tmpl, md, NULL))   {
+			EVP_MD_CTX_cleanup(&entry->tmpl);
+			free(entry);
+			return NULL;
+		}
+		entry->md = md;
+		if (session)   {
+			entry->pooled = 1;
+			entry->next = session->md_pool;
+			session->md_pool = entry;
+		}
+	}
+
+	if (!EVP_MD_CTX_copy_ex(&entry->ctx, &entry->tmpl))   {
+		if (!entry->pooled)   {
+			EVP_MD_CTX_cleanup(&entry->tmpl);
+			free(entry);
+		}
+		return NULL;
+	}
+
+	entry->busy = 1;
+	return entry;
+}
+
+static void
+sc_pkcs11_openssl_md_put(struct sc_pkcs11_md_entry *entry)
+{
+	entry->busy = 0;
+	if (entry->pooled)
+		return;
+	EVP_MD_CTX_cleanup(&entry->ctx);
+	EVP_MD_CTX_cleanup(&entry->tmpl);
+	free(entry);
+}
+
+void
+sc_pkcs11_openssl_md_pool_free(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_md_entry *entry, *next;
+
+	for (entry = session->md_pool; entry; entry = next)   {
+		next = entry->next;
+		EVP_MD_CTX_cleanup(&entry->ctx);
+		EVP_MD_CTX_cleanup(&entry->tmpl);
+		free(entry);
+	}
+	session->md_pool = NULL;
+}
+
 static CK_RV sc_pkcs11_openssl_md_init(sc_pkcs11_operation_t *op)
 {
 	sc_pkcs11_mechanism_type_t *mt;
-	EVP_MD_CTX	*md_ctx;
+	struct sc_pkcs11_md_entry *entry;
 	EVP_MD		*md;
 
 	if (!op || !(mt = op->type) || !(md = (EVP_MD *) mt->mech_data))
 		return CKR_ARGUMENTS_BAD;
 
-	if (!(md_ctx = calloc(1, sizeof(*md_ctx))))
+	if (!(entry = sc_pkcs11_openssl_md_get(op->session, md)))
 		return CKR_HOST_MEMORY;
-	EVP_DigestInit(md_ctx, md);
-	op->priv_data = md_ctx;
+	op->priv_data = &entry->ctx;
 	return CKR_OK;
 }
 
@@ -245,6 +442,7 @@ static CK_RV sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *op,
 				CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
 {
 	EVP_MD_CTX *md_ctx = DIGEST_CTX(op);
+	unsigned int len;
 
 	if (*pulDigestLen < (unsigned) EVP_MD_CTX_size(md_ctx)) {
 		sc_log(context, "Provided buffer too small: %ul < %d",
@@ -253,7 +451,8 @@ static CK_RV sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *op,
 		return CKR_BUFFER_TOO_SMALL;
 	}
 
-	EVP_DigestFinal(md_ctx, pDigest, (unsigned *) pulDigestLen);
+	EVP_DigestFinal_ex(md_ctx, pDigest, &len);
+	*pulDigestLen = len;
 
 	return CKR_OK;
 }
@@ -263,7 +462,370 @@ static void sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *op)
 	EVP_MD_CTX	*md_ctx = DIGEST_CTX(op);
 
 	if (md_ctx)
-		free(md_ctx);
+		sc_pkcs11_openssl_md_put((struct sc_pkcs11_md_entry *) md_ctx);
+	op->priv_data = NULL;
+}
+
+/*
+ * Handle OpenSSL symmetric ciphers
+ *
+ * Block modes keep the usual OpenSSL buffering, so an update may return
+ * less than it was given. GCM decryption releases no plaintext before the
+ * tag has been checked: the ciphertext is collected by the updates and
+ * decrypted by the final call.
+ */
+struct sc_pkcs11_cipher_data {
+	EVP_CIPHER_CTX	*ctx;
+	const struct sc_pkcs11_cipher_info *info;
+	int		encrypt;
+	CK_ULONG	block_size;
+	CK_ULONG	buffered;	/* input held back by OpenSSL */
+	CK_ULONG	tag_len;	/* GCM only */
+	CK_BYTE_PTR	aead_buf;	/* GCM ciphertext to decrypt */
+	CK_ULONG	aead_len;
+	CK_ULONG	aead_size;
+	int		ctr_limited;
+	CK_ULONG	ctr_left;	/* bytes until the CTR counter wraps */
+};
+
+#define CIPHER_DATA(op) \
+	((struct sc_pkcs11_cipher_data *) (op)->priv_data)
+
+static const EVP_CIPHER *
+sc_pkcs11_openssl_get_cipher(CK_KEY_TYPE key_type, int mode, CK_ULONG key_len)
+{
+	if (key_type == CKK_DES3) {
+		if (key_len == 16)
+			return mode == SC_PKCS11_CIPHER_ECB ? EVP_des_ede_ecb()
+				: mode == SC_PKCS11_CIPHER_CBC ? EVP_des_ede_cbc() : NULL;
+		if (key_len == 24)
+			return mode == SC_PKCS11_CIPHER_ECB ? EVP_des_ede3_ecb()
+				: mode == SC_PKCS11_CIPHER_CBC ? EVP_des_ede3_cbc() : NULL;
+		return NULL;
+	}
+	if (key_type != CKK_AES)
+		return NULL;
+
+	switch (mode) {
+	case SC_PKCS11_CIPHER_ECB:
+		return key_len == 16 ? EVP_aes_128_ecb() : key_len == 24 ? EVP_aes_192_ecb()
+			: key_len == 32 ? EVP_aes_256_ecb() : NULL;
+	case SC_PKCS11_CIPHER_CBC:
+		return key_len == 16 ? EVP_aes_128_cbc() : key_len == 24 ? EVP_aes_192_cbc()
+			: key_len == 32 ? EVP_aes_256_cbc() : NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	case SC_PKCS11_CIPHER_CTR:
+		return key_len == 16 ? EVP_aes_128_ctr() : key_len == 24 ? EVP_aes_192_ctr()
+			: key_len == 32 ? EVP_aes_256_ctr() : NULL;
+	case SC_PKCS11_CIPHER_GCM:
+		return key_len == 16 ? EVP_aes_128_gcm() : key_len == 24 ? EVP_aes_192_gcm()
+			: key_len == 32 ? EVP_aes_256_gcm() : NULL;
+#endif
+	}
+	return NULL;
+}
+
+static CK_RV
+sc_pkcs11_openssl_cipher_init(sc_pkcs11_operation_t *op,
+		struct sc_pkcs11_object *key, int encrypt)
+{
+	const struct sc_pkcs11_cipher_info *info = op->type->mech_data;
+	CK_MECHANISM_PTR mech = &op->mechanism;
+	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
+	struct sc_pkcs11_cipher_data *data = NULL;
+	const EVP_CIPHER *cipher;
+	const unsigned char *iv = NULL;
+	unsigned char *value = NULL;
+	CK_GCM_PARAMS *gcm = NULL;
+	int len;
+	CK_RV rv;
+
+	/* Only keys with a value known to the module */
+	rv = key->ops->get_attribute(op->session, key, &attr);
+	if (rv != CKR_OK || attr.ulValueLen == 0)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+	value = malloc(attr.ulValueLen);
+	if (value == NULL)
+		return CKR_HOST_MEMORY;
+	attr.pValue = value;
+	rv = key->ops->get_attribute(op->session, key, &attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+		goto done;
+	}
+
+	cipher = sc_pkcs11_openssl_get_cipher(op->type->key_type, info->mode, attr.ulValueLen);
+	if (cipher == NULL) {
+		rv = CKR_KEY_SIZE_RANGE;
+		goto done;
+	}
+
+	data = calloc(1, sizeof(*data));
+	if (data == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto done;
+	}
+	data->info = info;
+	data->encrypt = encrypt;
+	data->block_size = EVP_CIPHER_block_size(cipher);
+
+	rv = CKR_MECHANISM_PARAM_INVALID;
+	switch (info->mode) {
+	case SC_PKCS11_CIPHER_CBC:
+		if (mech->pParameter == NULL
+				|| mech->ulParameterLen != (CK_ULONG) EVP_CIPHER_iv_length(cipher))
+			goto done;
+		iv = mech->pParameter;
+		break;
+	case SC_PKCS11_CIPHER_CTR:
+		{
+			CK_AES_CTR_PARAMS *ctr = (CK_AES_CTR_PARAMS *) mech->pParameter;
+			CK_ULONG counter = 0;
+			int i;
+
+			if (ctr == NULL || mech->ulParameterLen != sizeof(*ctr)
+					|| ctr->ulCounterBits == 0 || ctr->ulCounterBits > 128)
+				goto done;
+			iv = ctr->cb;
+			/* OpenSSL increments the whole block. A counter field
+			 * narrow enough to wrap within an operation is
+			 * enforced here, wider ones are not checked. */
+			if (ctr->ulCounterBits < 28) {
+				for (i = 12; i < 16; i++)
+					counter = counter << 8 | ctr->cb[i];
+				counter &= (1UL << ctr->ulCounterBits) - 1;
+				data->ctr_limited = 1;
+				data->ctr_left = ((1UL << ctr->ulCounterBits) - counter) * 16;
+			}
+		}
+		break;
+	case SC_PKCS11_CIPHER_GCM:
+		gcm = (CK_GCM_PARAMS *) mech->pParameter;
+		if (gcm == NULL || mech->ulParameterLen != sizeof(*gcm)
+				|| gcm->pIv == NULL || gcm->ulIvLen == 0 || gcm->ulIvLen > INT_MAX
+				|| (gcm->pAAD == NULL && gcm->ulAADLen != 0) || gcm->ulAADLen > INT_MAX
+				|| gcm->ulTagBits % 8 || gcm->ulTagBits < 32 || gcm->ulTagBits > 128)
+			goto done;
+		iv = gcm->pIv;
+		data->tag_len = gcm->ulTagBits / 8;
+		break;
+	}
+
+	rv = CKR_GENERAL_ERROR;
+	data->ctx = EVP_CIPHER_CTX_new();
+	if (data->ctx == NULL
+			|| !EVP_CipherInit_ex(data->ctx, cipher, NULL, NULL, NULL, encrypt))
+		goto done;
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	if (gcm && !EVP_CIPHER_CTX_ctrl(data->ctx, EVP_CTRL_GCM_SET_IVLEN, (int) gcm->ulIvLen, NULL))
+		goto done;
+#endif
+	if (!EVP_CipherInit_ex(data->ctx, NULL, NULL, value, iv, encrypt))
+		goto done;
+	EVP_CIPHER_CTX_set_padding(data->ctx, info->padding);
+	if (gcm && gcm->ulAADLen
+			&& !EVP_CipherUpdate(data->ctx, NULL, &len, gcm->pAAD, (int) gcm->ulAADLen))
+		goto done;
+
+	op->priv_data = data;
+	data = NULL;
+	rv = CKR_OK;
+
+done:
+	if (data) {
+		if (data->ctx)
+			EVP_CIPHER_CTX_free(data->ctx);
+		free(data);
+	}
+	OPENSSL_cleanse(value, attr.ulValueLen);
+	free(value);
+	return rv;
+}
+
+static CK_RV
+sc_pkcs11_openssl_encrypt_init(sc_pkcs11_operation_t *op,
+		struct sc_pkcs11_object *key)
+{
+	return sc_pkcs11_openssl_cipher_init(op, key, 1);
+}
+
+static CK_RV
+sc_pkcs11_openssl_decrypt_init(sc_pkcs11_operation_t *op,
+		struct sc_pkcs11_object *key)
+{
+	return sc_pkcs11_openssl_cipher_init(op, key, 0);
+}
+
+/*
+ * Output size for inlen more bytes of input, exact for the final call
+ * and an upper bound otherwise.
+ */
+static CK_RV
+sc_pkcs11_openssl_cipher_size(struct sc_pkcs11_cipher_data *data,
+		CK_ULONG inlen, int final, CK_ULONG_PTR size)
+{
+	CK_ULONG total = data->buffered + inlen;
+
+	if (inlen > INT_MAX)
+		return data->encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+	if (data->ctr_limited && inlen > data->ctr_left)
+		return CKR_DATA_LEN_RANGE;
+
+	if (data->tag_len) {
+		if (data->encrypt)
+			*size = inlen + (final ? data->tag_len : 0);
+		else if (data->aead_len + inlen > INT_MAX)
+			return CKR_ENCRYPTED_DATA_LEN_RANGE;
+		else if (!final)
+			*size = 0;
+		else if (data->aead_len + inlen < data->tag_len)
+			return CKR_ENCRYPTED_DATA_LEN_RANGE;
+		else
+			*size = data->aead_len + inlen - data->tag_len;
+		return CKR_OK;
+	}
+
+	*size = total;
+	if (!final || data->block_size == 1)
+		return CKR_OK;
+	if (data->info->padding && data->encrypt)
+		*size = total - total % data->block_size + data->block_size;
+	else if (total % data->block_size || (data->info->padding && total == 0))
+		return data->encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_openssl_cipher_update(sc_pkcs11_operation_t *op,
+		CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct sc_pkcs11_cipher_data *data = CIPHER_DATA(op);
+	CK_ULONG size;
+	CK_RV rv;
+	int len;
+
+	rv = sc_pkcs11_openssl_cipher_size(data, ulInLen, 0, &size);
+	if (rv != CKR_OK)
+		return rv;
+	if (pOut == NULL || *pulOutLen < size) {
+		*pulOutLen = size;
+		return pOut == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+	}
+
+	if (data->tag_len && !data->encrypt) {
+		if (data->aead_len + ulInLen > data->aead_size) {
+			CK_ULONG new_size = data->aead_size ? data->aead_size : 4096;
+			CK_BYTE_PTR p;
+
+			while (new_size < data->aead_len + ulInLen)
+				new_size *= 2;
+			p = realloc(data->aead_buf, new_size);
+			if (p == NULL)
+				return CKR_HOST_MEMORY;
+			data->aead_buf = p;
+			data->aead_size = new_size;
+		}
+		memcpy(data->aead_buf + data->aead_len, pIn, ulInLen);
+		data->aead_len += ulInLen;
+		*pulOutLen = 0;
+		return CKR_OK;
+	}
+
+	if (!EVP_CipherUpdate(data->ctx, pOut, &len, pIn, (int) ulInLen))
+		return CKR_GENERAL_ERROR;
+	data->buffered = data->buffered + ulInLen - len;
+	if (data->ctr_limited)
+		data->ctr_left -= ulInLen;
+	*pulOutLen = len;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_openssl_cipher_final(sc_pkcs11_operation_t *op,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct sc_pkcs11_cipher_data *data = CIPHER_DATA(op);
+	CK_ULONG size;
+	CK_RV rv;
+	int len, last;
+
+	rv = sc_pkcs11_openssl_cipher_size(data, 0, 1, &size);
+	if (rv != CKR_OK)
+		return rv;
+	if (pOut == NULL || *pulOutLen < size) {
+		*pulOutLen = size;
+		return pOut == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	if (data->tag_len && !data->encrypt) {
+		if (!EVP_CIPHER_CTX_ctrl(data->ctx, EVP_CTRL_GCM_SET_TAG, (int) data->tag_len,
+					data->aead_buf + size)
+				|| !EVP_DecryptUpdate(data->ctx, pOut, &len, data->aead_buf, (int) size))
+			return CKR_GENERAL_ERROR;
+		if (!EVP_DecryptFinal_ex(data->ctx, pOut + len, &last)) {
+			OPENSSL_cleanse(pOut, size);
+			return CKR_ENCRYPTED_DATA_INVALID;
+		}
+		*pulOutLen = len + last;
+		return CKR_OK;
+	}
+#endif
+
+	if (!EVP_CipherFinal_ex(data->ctx, pOut, &len))
+		return data->encrypt ? CKR_GENERAL_ERROR : CKR_ENCRYPTED_DATA_INVALID;
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	if (data->tag_len) {
+		if (!EVP_CIPHER_CTX_ctrl(data->ctx, EVP_CTRL_GCM_GET_TAG, (int) data->tag_len, pOut + len))
+			return CKR_GENERAL_ERROR;
+		len += data->tag_len;
+	}
+#endif
+	*pulOutLen = len;
+	return CKR_OK;
+}
+
+/* Single-part C_Encrypt() and C_Decrypt() */
+static CK_RV
+sc_pkcs11_openssl_cipher(sc_pkcs11_operation_t *op,
+		CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	CK_ULONG size, part, rest;
+	CK_RV rv;
+
+	rv = sc_pkcs11_openssl_cipher_size(CIPHER_DATA(op), ulInLen, 1, &size);
+	if (rv != CKR_OK)
+		return rv;
+	if (pOut == NULL || *pulOutLen < size) {
+		*pulOutLen = size;
+		return pOut == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+	}
+
+	part = *pulOutLen;
+	rv = sc_pkcs11_openssl_cipher_update(op, pIn, ulInLen, pOut, &part);
+	if (rv != CKR_OK)
+		return rv;
+	rest = *pulOutLen - part;
+	rv = sc_pkcs11_openssl_cipher_final(op, pOut + part, &rest);
+	if (rv != CKR_OK)
+		return rv;
+	*pulOutLen = part + rest;
+	return CKR_OK;
+}
+
+static void
+sc_pkcs11_openssl_cipher_release(sc_pkcs11_operation_t *op)
+{
+	struct sc_pkcs11_cipher_data *data = CIPHER_DATA(op);
+
+	if (data == NULL)
+		return;
+	if (data->ctx)
+		EVP_CIPHER_CTX_free(data->ctx);
+	free(data->aead_buf);
+	free(data);
 	op->priv_data = NULL;
 }
 
@@ -281,29 +843,27 @@ static void reverse(unsigned char *buf, size_t len)
 	}
 }
 
-static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
-		const unsigned char *params, int params_len,
-		unsigned char *data, int data_len,
-		unsigned char *signat, int signat_len)
+static EVP_PKEY *gostr3410_load_pubkey(const unsigned char *pubkey, int pubkey_len,
+		const unsigned char *params, int params_len)
 {
 	EVP_PKEY *pkey;
 	EVP_PKEY_CTX *pkey_ctx = NULL;
 	EC_POINT *P;
 	BIGNUM *X, *Y;
-	ASN1_OCTET_STRING *octet;
+	ASN1_OCTET_STRING *octet = NULL;
 	const EC_GROUP *group = NULL;
 	char paramset[2] = "A";
-	int r = -1, ret_vrf = 0;
+	int r = -1;
 
 	pkey = EVP_PKEY_new();
 	if (!pkey)
-		return CKR_HOST_MEMORY;
+		return NULL;
 	r = EVP_PKEY_set_type(pkey, NID_id_GostR3410_2001);
 	if (r == 1) {
 		pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
 		if (!pkey_ctx) {
 			EVP_PKEY_free(pkey);
-			return CKR_HOST_MEMORY;
+			return NULL;
 		}
 		/* FIXME: fully check params[] */
 		if (params_len > 0 && params[params_len - 1] >= 1 &&
@@ -338,16 +898,31 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
 				r = EC_KEY_set_public_key(EVP_PKEY_get0(pkey), P);
 			EC_POINT_free(P);
 		}
-		if (r == 1) {
-			r = EVP_PKEY_verify_init(pkey_ctx);
-			reverse(data, data_len);
-			if (r == 1)
-				ret_vrf = EVP_PKEY_verify(pkey_ctx, signat, signat_len,
-						data, data_len);
-		}
 	}
 	EVP_PKEY_CTX_free(pkey_ctx);
-	EVP_PKEY_free(pkey);
+	if (r != 1) {
+		EVP_PKEY_free(pkey);
+		return NULL;
+	}
+	return pkey;
+}
+
+static CK_RV gostr3410_verify_data(EVP_PKEY *pkey,
+		unsigned char *data, int data_len,
+		unsigned char *signat, int signat_len)
+{
+	EVP_PKEY_CTX *pkey_ctx;
+	int r, ret_vrf = 0;
+
+	pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pkey_ctx)
+		return CKR_HOST_MEMORY;
+	r = EVP_PKEY_verify_init(pkey_ctx);
+	reverse(data, data_len);
+	if (r == 1)
+		ret_vrf = EVP_PKEY_verify(pkey_ctx, signat, signat_len,
+				data, data_len);
+	EVP_PKEY_CTX_free(pkey_ctx);
 	if (r != 1)
 		return CKR_GENERAL_ERROR;
 	return ret_vrf == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
@@ -357,38 +932,55 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
 /* If no hash function was used, finish with RSA_public_decrypt().
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
+ * The parsed public key is kept in '*pkey_cache' for the next
+ * verification with the same key; 'pubkey' is not used then.
  */
 CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 			const unsigned char *pubkey_params, int pubkey_params_len,
+			void **pkey_cache,
 			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, int data_len,
 			unsigned char *signat, int signat_len)
 {
 	int res;
 	CK_RV rv = CKR_GENERAL_ERROR;
-	EVP_PKEY *pkey;
+	EVP_PKEY *pkey = pkey_cache ? (EVP_PKEY *) *pkey_cache : NULL;
 
 	if (mech == CKM_GOSTR3410)
 	{
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
-		return gostr3410_verify_data(pubkey, pubkey_len,
-				pubkey_params, pubkey_params_len,
-				data, data_len, signat, signat_len);
+		if (pkey == NULL) {
+			pkey = gostr3410_load_pubkey(pubkey, pubkey_len,
+					pubkey_params, pubkey_params_len);
+			if (pkey == NULL)
+				return CKR_GENERAL_ERROR;
+		}
+		rv = gostr3410_verify_data(pkey, data, data_len, signat, signat_len);
+		if (pkey_cache)
+			*pkey_cache = pkey;
+		else
+			EVP_PKEY_free(pkey);
+		return rv;
 #else
 		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
 		return CKR_FUNCTION_NOT_SUPPORTED;
 #endif
 	}
 
-	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+	if (pkey == NULL) {
+		pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
+		if (pkey == NULL)
+			return CKR_GENERAL_ERROR;
+		if (pkey_cache)
+			*pkey_cache = pkey;
+	}
 
 	if (md != NULL) {
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
 		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
+		if (!pkey_cache)
+			EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0)
@@ -411,12 +1003,14 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		 	pad = RSA_NO_PADDING;
 		 	break;
 		 default:
-			EVP_PKEY_free(pkey);
+			if (!pkey_cache)
+				EVP_PKEY_free(pkey);
 		 	return CKR_ARGUMENTS_BAD;
 		 }
 
 		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
+		if (!pkey_cache)
+			EVP_PKEY_free(pkey);
 		if (rsa == NULL)
 			return CKR_DEVICE_MEMORY;
 
@@ -444,4 +1038,106 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 
 	return rv;
 }
+
+/*
+ * Encrypt with an RSA public key on the host, the card is not used.
+ * CKA_VALUE of the key may be a PKCS#1 RSAPublicKey or a
+ * SubjectPublicKeyInfo. OAEP is limited to what RSA_public_encrypt()
+ * offers: SHA-1 with MGF1-SHA1 and an empty label.
+ */
+CK_RV sc_pkcs11_encrypt_data(const unsigned char *pubkey, int pubkey_len,
+			void **pkey_cache, CK_MECHANISM_PTR mech,
+			CK_BYTE_PTR in, CK_ULONG inlen,
+			CK_BYTE_PTR out, CK_ULONG_PTR outlen)
+{
+	EVP_PKEY *pkey = (EVP_PKEY *) *pkey_cache;
+	CK_RSA_PKCS_OAEP_PARAMS *oaep;
+	unsigned char *buf = NULL;
+	CK_ULONG size;
+	RSA *rsa;
+	int pad, r;
+	CK_RV rv;
+
+	switch (mech->mechanism) {
+	case CKM_RSA_PKCS:
+		pad = RSA_PKCS1_PADDING;
+		break;
+	case CKM_RSA_X_509:
+		pad = RSA_NO_PADDING;
+		break;
+	case CKM_RSA_PKCS_OAEP:
+		oaep = (CK_RSA_PKCS_OAEP_PARAMS *) mech->pParameter;
+		if (oaep == NULL || mech->ulParameterLen != sizeof(*oaep))
+			return CKR_MECHANISM_PARAM_INVALID;
+		if (oaep->hashAlg != CKM_SHA_1 || oaep->mgf != CKG_MGF1_SHA1
+				|| (oaep->source && oaep->source != CKZ_DATA_SPECIFIED)
+				|| oaep->ulSourceDataLen != 0)
+			return CKR_MECHANISM_PARAM_INVALID;
+		pad = RSA_PKCS1_OAEP_PADDING;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (pkey == NULL) {
+		const unsigned char *p = pubkey;
+
+		pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &p, pubkey_len);
+		if (pkey == NULL) {
+			p = pubkey;
+			pkey = d2i_PUBKEY(NULL, &p, pubkey_len);
+		}
+		if (pkey == NULL)
+			return CKR_GENERAL_ERROR;
+		*pkey_cache = pkey;
+	}
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return CKR_KEY_TYPE_INCONSISTENT;
+	size = RSA_size(rsa);
+
+	if (out == NULL || *outlen < size) {
+		rv = out ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+		*outlen = size;
+		goto done;
+	}
+
+	/* Raw RSA takes a block of the modulus size */
+	if (pad == RSA_NO_PADDING && inlen != size) {
+		if (inlen > size) {
+			rv = CKR_DATA_LEN_RANGE;
+			goto done;
+		}
+		buf = calloc(1, size);
+		if (buf == NULL) {
+			rv = CKR_HOST_MEMORY;
+			goto done;
+		}
+		memcpy(buf + size - inlen, in, inlen);
+		in = buf;
+		inlen = size;
+	}
+
+	r = RSA_public_encrypt(inlen, in, out, rsa, pad);
+	if (r <= 0) {
+		sc_log(context, "RSA_public_encrypt() returned %d", r);
+		rv = CKR_DATA_LEN_RANGE;
+		goto done;
+	}
+	*outlen = r;
+	rv = CKR_OK;
+
+done:
+	free(buf);
+	RSA_free(rsa);
+	return rv;
+}
+
+void sc_pkcs11_free_verify_key(struct sc_pkcs11_object *obj)
+{
+	if (obj->verify_key)
+		EVP_PKEY_free((EVP_PKEY *) obj->verify_key);
+	obj->verify_key = NULL;
+}
 #endif
@@ -0,0 +1,383 @@
+/*
+ * pkcs11-async.c: asynchronous operations (OpenSC vendor extension)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sc-pkcs11.h"
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+struct async_entry {
+	CK_SESSION_HANDLE hSession;
+	CK_OPENSC_ASYNC_OPERATION_PTR op;
+	struct async_entry *next;
+};
+
+/*
+ * The operation queue of a reader. Its worker runs the operations with
+ * the ordinary PKCS#11 calls, so that they take the reader lock like any
+ * other caller: a card is kept busy by its worker, while the callers of
+ * other cards and the other workers go on.
+ */
+struct async_queue {
+	sc_reader_t *reader;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct async_entry *head, *tail;
+	struct async_queue *next;
+};
+
+/* async_mutex protects everything below */
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct async_queue *async_queues = NULL;
+static int async_stop = 0;
+/* completed operations without notify, for C_OpenSC_ReapOperations() */
+static struct async_entry *async_done_head = NULL, *async_done_tail = NULL;
+/* holds one byte as long as async_done_head is not empty */
+static int async_pipe[2] = { -1, -1 };
+
+static void async_complete(struct async_entry *entry, CK_RV rv)
+{
+	CK_OPENSC_ASYNC_OPERATION_PTR op = entry->op;
+	char c = 0;
+
+	op->rv = rv;
+	if (op->notify != NULL) {
+		free(entry);
+		op->notify(op);
+		return;
+	}
+
+	pthread_mutex_lock(&async_mutex);
+	entry->next = NULL;
+	if (async_done_tail)
+		async_done_tail->next = entry;
+	else {
+		async_done_head = entry;
+		if (async_pipe[1] >= 0 && write(async_pipe[1], &c, 1) != 1)
+			sc_log(context, "Cannot signal the completion descriptor: %d", errno);
+	}
+	async_done_tail = entry;
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static CK_RV async_run(struct async_entry *entry)
+{
+	CK_OPENSC_ASYNC_OPERATION_PTR op = entry->op;
+	CK_ULONG len = op->ulOutputLen;
+	CK_RV rv;
+
+	switch (op->type) {
+	case CK_OPENSC_ASYNC_SIGN:
+		rv = C_SignInit(entry->hSession, op->pMechanism, op->hKey);
+		if (rv == CKR_OK)
+			rv = C_Sign(entry->hSession, op->pInput, op->ulInputLen, op->pOutput, &len);
+		break;
+	case CK_OPENSC_ASYNC_DECRYPT:
+		rv = C_DecryptInit(entry->hSession, op->pMechanism, op->hKey);
+		if (rv == CKR_OK)
+			rv = C_Decrypt(entry->hSession, op->pInput, op->ulInputLen, op->pOutput, &len);
+		break;
+	case CK_OPENSC_ASYNC_DERIVE:
+		rv = C_DeriveKey(entry->hSession, op->pMechanism, op->hKey,
+				op->pTemplate, op->ulAttributeCount, &op->hDerivedKey);
+		break;
+	default:
+		rv = CKR_ARGUMENTS_BAD;
+		break;
+	}
+	op->ulOutputLen = len;
+	return rv;
+}
+
+static void *async_worker(void *arg)
+{
+	struct async_queue *queue = (struct async_queue *)arg;
+	struct async_entry *entry;
+
+	pthread_mutex_lock(&async_mutex);
+	while (!async_stop) {
+		if ((entry = queue->head) == NULL) {
+			pthread_cond_wait(&queue->cond, &async_mutex);
+			continue;
+		}
+		queue->head = entry->next;
+		if (queue->head == NULL)
+			queue->tail = NULL;
+		pthread_mutex_unlock(&async_mutex);
+
+		async_complete(entry, async_run(entry));
+
+		pthread_mutex_lock(&async_mutex);
+	}
+	pthread_mutex_unlock(&async_mutex);
+	return NULL;
+}
+
+/* Called with async_mutex held */
+static CK_RV async_get_queue(sc_reader_t *reader, struct async_queue **out)
+{
+	struct async_queue *queue;
+
+	for (queue = async_queues; queue; queue = queue->next) {
+		if (queue->reader == reader) {
+			*out = queue;
+			return CKR_OK;
+		}
+	}
+
+	queue = calloc(1, sizeof(struct async_queue));
+	if (queue == NULL)
+		return CKR_HOST_MEMORY;
+	queue->reader = reader;
+	pthread_cond_init(&queue->cond, NULL);
+	if (pthread_create(&queue->thread, NULL, async_worker, queue) != 0) {
+		sc_log(context, "Cannot start the operation queue of reader %s", reader->name);
+		pthread_cond_destroy(&queue->cond);
+		free(queue);
+		return CKR_GENERAL_ERROR;
+	}
+	queue->next = async_queues;
+	async_queues = queue;
+	*out = queue;
+	return CKR_OK;
+}
+
+CK_RV C_OpenSC_SubmitOperation(CK_SESSION_HANDLE hSession,
+		CK_OPENSC_ASYNC_OPERATION_PTR pOperation)
+{
+	struct sc_pkcs11_session *session;
+	struct async_queue *queue;
+	struct async_entry *entry;
+	sc_reader_t *reader;
+	CK_RV rv;
+
+	if (pOperation == NULL_PTR || pOperation->pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+	switch (pOperation->type) {
+	case CK_OPENSC_ASYNC_SIGN:
+	case CK_OPENSC_ASYNC_DECRYPT:
+		/* a size query would leave the operation active */
+		if (pOperation->pOutput == NULL_PTR)
+			return CKR_ARGUMENTS_BAD;
+		break;
+	case CK_OPENSC_ASYNC_DERIVE:
+		break;
+	default:
+		return CKR_ARGUMENTS_BAD;
+	}
+	if (!sc_pkcs11_threads_allowed())
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	rv = get_session(hSession, &session);
+	reader = rv == CKR_OK ? session->slot->reader : NULL;
+	sc_pkcs11_unlock();
+	if (rv != CKR_OK)
+		return rv;
+	if (reader == NULL)
+		return CKR_DEVICE_REMOVED;
+
+	entry = calloc(1, sizeof(struct async_entry));
+	if (entry == NULL)
+		return CKR_HOST_MEMORY;
+	entry->hSession = hSession;
+	entry->op = pOperation;
+
+	pthread_mutex_lock(&async_mutex);
+	if (async_stop)
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+	else
+		rv = async_get_queue(reader, &queue);
+	if (rv == CKR_OK) {
+		if (queue->tail)
+			queue->tail->next = entry;
+		else
+			queue->head = entry;
+		queue->tail = entry;
+		pthread_cond_signal(&queue->cond);
+	}
+	pthread_mutex_unlock(&async_mutex);
+
+	if (rv != CKR_OK)
+		free(entry);
+	sc_log(context, "C_OpenSC_SubmitOperation(%lu) = %s", pOperation->type, lookup_enum(RV_T, rv));
+	return rv;
+}
+
+CK_RV C_OpenSC_GetCompletionFd(int *pFd)
+{
+	CK_RV rv = CKR_OK;
+	char c = 0;
+	int flags, i;
+
+	if (pFd == NULL)
+		return CKR_ARGUMENTS_BAD;
+	if (context == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	pthread_mutex_lock(&async_mutex);
+	if (async_pipe[0] < 0) {
+		if (pipe(async_pipe) != 0)
+			rv = CKR_GENERAL_ERROR;
+		for (i = 0; rv == CKR_OK && i < 2; i++) {
+			flags = fcntl(async_pipe[i], F_GETFL);
+			fcntl(async_pipe[i], F_SETFL, flags | O_NONBLOCK);
+			fcntl(async_pipe[i], F_SETFD, FD_CLOEXEC);
+		}
+		/* operations completed before anybody asked */
+		if (rv == CKR_OK && async_done_head != NULL && write(async_pipe[1], &c, 1) != 1)
+			rv = CKR_GENERAL_ERROR;
+	}
+	*pFd = async_pipe[0];
+	pthread_mutex_unlock(&async_mutex);
+	return rv;
+}
+
+CK_RV C_OpenSC_ReapOperations(CK_OPENSC_ASYNC_OPERATION_PTR *ppOperations,
+		CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount)
+{
+	struct async_entry *entry;
+	CK_ULONG count = 0;
+	char c;
+
+	if (pulCount == NULL_PTR || (ulMaxCount && ppOperations == NULL_PTR))
+		return CKR_ARGUMENTS_BAD;
+
+	pthread_mutex_lock(&async_mutex);
+	while (count < ulMaxCount && (entry = async_done_head) != NULL) {
+		async_done_head = entry->next;
+		ppOperations[count++] = entry->op;
+		free(entry);
+	}
+	if (async_done_head == NULL) {
+		async_done_tail = NULL;
+		if (count > 0 && async_pipe[0] >= 0 && read(async_pipe[0], &c, 1) != 1)
+			sc_log(context, "Cannot clear the completion descriptor: %d", errno);
+	}
+	pthread_mutex_unlock(&async_mutex);
+
+	*pulCount = count;
+	return CKR_OK;
+}
+
+/* Stops the workers at C_Finalize(), the operations still queued are canceled */
+void sc_pkcs11_async_end(void)
+{
+	struct async_queue *queue, *next;
+	struct async_entry *entry;
+
+	pthread_mutex_lock(&async_mutex);
+	async_stop = 1;
+	for (queue = async_queues; queue; queue = queue->next)
+		pthread_cond_signal(&queue->cond);
+	queue = async_queues;
+	async_queues = NULL;
+	pthread_mutex_unlock(&async_mutex);
+
+	/* a worker finishes the operation it is running */
+	for (; queue; queue = next) {
+		next = queue->next;
+		pthread_join(queue->thread, NULL);
+		while ((entry = queue->head) != NULL) {
+			queue->head = entry->next;
+			async_complete(entry, CKR_FUNCTION_CANCELED);
+		}
+		pthread_cond_destroy(&queue->cond);
+		free(queue);
+	}
+
+	pthread_mutex_lock(&async_mutex);
+	while ((entry = async_done_head) != NULL) {
+		async_done_head = entry->next;
+		free(entry);
+	}
+	async_done_tail = NULL;
+	if (async_pipe[0] >= 0) {
+		close(async_pipe[0]);
+		close(async_pipe[1]);
+		async_pipe[0] = async_pipe[1] = -1;
+	}
+	async_stop = 0;
+	pthread_mutex_unlock(&async_mutex);
+}
+
+/* In a child after fork(): the workers and their operations stayed with
+ * the parent, only the memory and the descriptors came along */
+void sc_pkcs11_async_forget(void)
+{
+	struct async_queue *queue, *next;
+	struct async_entry *entry;
+
+	pthread_mutex_init(&async_mutex, NULL);
+	for (queue = async_queues; queue; queue = next) {
+		next = queue->next;
+		while ((entry = queue->head) != NULL) {
+			queue->head = entry->next;
+			free(entry);
+		}
+		free(queue);
+	}
+	async_queues = NULL;
+	while ((entry = async_done_head) != NULL) {
+		async_done_head = entry->next;
+		free(entry);
+	}
+	async_done_tail = NULL;
+	if (async_pipe[0] >= 0) {
+		close(async_pipe[0]);
+		close(async_pipe[1]);
+		async_pipe[0] = async_pipe[1] = -1;
+	}
+	async_stop = 0;
+}
+#else
+CK_RV C_OpenSC_SubmitOperation(CK_SESSION_HANDLE hSession,
+		CK_OPENSC_ASYNC_OPERATION_PTR pOperation)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_OpenSC_GetCompletionFd(int *pFd)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_OpenSC_ReapOperations(CK_OPENSC_ASYNC_OPERATION_PTR *ppOperations,
+		CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+void sc_pkcs11_async_end(void)
+{
+}
+
+void sc_pkcs11_async_forget(void)
+{
+}
+#endif
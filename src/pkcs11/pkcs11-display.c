@@ -103,14 +103,12 @@ void
 print_enum(FILE *f, CK_LONG type, CK_VOID_PTR value, CK_ULONG size, CK_VOID_PTR arg)
 {
 	enum_spec *spec = (enum_spec*)arg;
-	CK_ULONG i;
 	CK_ULONG ctype = *((CK_ULONG_PTR)value);
+	const char *name = lookup_enum_spec(spec, ctype);
 
-	for(i = 0; i < spec->size; i++) {
-		if(spec->specs[i].type == ctype) {
-			fprintf(f, "%s\n", spec->specs[i].name);
-			return;
-		}
+	if (name) {
+		fprintf(f, "%s\n", name);
+		return;
 	}
 	fprintf(f, "Value %lX not found for type %s\n", ctype, spec->name);
 }
@@ -233,6 +231,10 @@ print_print(FILE *f, CK_LONG type, CK_VOID_PTR value, CK_ULONG size, CK_VOID_PTR
 	fprintf(f, "\n");
 }
 
+/*
+ * The tables below are sorted by value, the lookups are binary searches.
+ * Of several names for one value, the first one is displayed.
+ */
 static enum_specs ck_cls_s[] = {
   { CKO_DATA             , "CKO_DATA             " },
   { CKO_CERTIFICATE      , "CKO_CERTIFICATE      " },
@@ -241,11 +243,11 @@ static enum_specs ck_cls_s[] = {
   { CKO_SECRET_KEY       , "CKO_SECRET_KEY       " },
   { CKO_HW_FEATURE       , "CKO_HW_FEATURE       " },
   { CKO_DOMAIN_PARAMETERS, "CKO_DOMAIN_PARAMETERS" },
+  { CKO_VENDOR_DEFINED   , "CKO_VENDOR_DEFINED   " },
   { CKO_NETSCAPE_CRL,              "CKO_NETSCAPE_CRL               " },
   { CKO_NETSCAPE_SMIME ,           "CKO_NETSCAPE_SMIME             " },
   { CKO_NETSCAPE_TRUST,            "CKO_NETSCAPE_TRUST             " },
-  { CKO_NETSCAPE_BUILTIN_ROOT_LIST, "CKO_NETSCAPE_BUILTIN_ROOT_LIST" },
-  { CKO_VENDOR_DEFINED   , "CKO_VENDOR_DEFINED   " }
+  { CKO_NETSCAPE_BUILTIN_ROOT_LIST, "CKO_NETSCAPE_BUILTIN_ROOT_LIST" }
 };
 
 static enum_specs ck_crt_s[] = {
@@ -286,9 +288,6 @@ static enum_specs ck_mec_s[] = {
   { CKM_MD2_RSA_PKCS             , "CKM_MD2_RSA_PKCS             " },
   { CKM_MD5_RSA_PKCS             , "CKM_MD5_RSA_PKCS             " },
   { CKM_SHA1_RSA_PKCS            , "CKM_SHA1_RSA_PKCS            " },
-  { CKM_SHA256_RSA_PKCS          , "CKM_SHA256_RSA_PKCS          " },
-  { CKM_SHA384_RSA_PKCS          , "CKM_SHA384_RSA_PKCS          " },
-  { CKM_SHA512_RSA_PKCS          , "CKM_SHA512_RSA_PKCS          " },
   { CKM_RIPEMD128_RSA_PKCS       , "CKM_RIPEMD128_RSA_PKCS       " },
   { CKM_RIPEMD160_RSA_PKCS       , "CKM_RIPEMD160_RSA_PKCS       " },
   { CKM_RSA_PKCS_OAEP            , "CKM_RSA_PKCS_OAEP            " },
@@ -297,9 +296,6 @@ static enum_specs ck_mec_s[] = {
   { CKM_SHA1_RSA_X9_31           , "CKM_SHA1_RSA_X9_31           " },
   { CKM_RSA_PKCS_PSS             , "CKM_RSA_PKCS_PSS             " },
   { CKM_SHA1_RSA_PKCS_PSS        , "CKM_SHA1_RSA_PKCS_PSS        " },
-  { CKM_SHA256_RSA_PKCS_PSS      , "CKM_SHA256_RSA_PKCS_PSS      " },
-  { CKM_SHA384_RSA_PKCS_PSS      , "CKM_SHA384_RSA_PKCS_PSS      " },
-  { CKM_SHA512_RSA_PKCS_PSS      , "CKM_SHA512_RSA_PKCS_PSS      " },
   { CKM_DSA_KEY_PAIR_GEN         , "CKM_DSA_KEY_PAIR_GEN         " },
   { CKM_DSA                      , "CKM_DSA                      " },
   { CKM_DSA_SHA1                 , "CKM_DSA_SHA1                 " },
@@ -309,6 +305,12 @@ static enum_specs ck_mec_s[] = {
   { CKM_X9_42_DH_DERIVE          , "CKM_X9_42_DH_DERIVE          " },
   { CKM_X9_42_DH_HYBRID_DERIVE   , "CKM_X9_42_DH_HYBRID_DERIVE   " },
   { CKM_X9_42_MQV_DERIVE         , "CKM_X9_42_MQV_DERIVE         " },
+  { CKM_SHA256_RSA_PKCS          , "CKM_SHA256_RSA_PKCS          " },
+  { CKM_SHA384_RSA_PKCS          , "CKM_SHA384_RSA_PKCS          " },
+  { CKM_SHA512_RSA_PKCS          , "CKM_SHA512_RSA_PKCS          " },
+  { CKM_SHA256_RSA_PKCS_PSS      , "CKM_SHA256_RSA_PKCS_PSS      " },
+  { CKM_SHA384_RSA_PKCS_PSS      , "CKM_SHA384_RSA_PKCS_PSS      " },
+  { CKM_SHA512_RSA_PKCS_PSS      , "CKM_SHA512_RSA_PKCS_PSS      " },
   { CKM_RC2_KEY_GEN              , "CKM_RC2_KEY_GEN              " },
   { CKM_RC2_ECB                  , "CKM_RC2_ECB                  " },
   { CKM_RC2_CBC                  , "CKM_RC2_CBC                  " },
@@ -345,15 +347,6 @@ static enum_specs ck_mec_s[] = {
   { CKM_SHA_1                    , "CKM_SHA_1                    " },
   { CKM_SHA_1_HMAC               , "CKM_SHA_1_HMAC               " },
   { CKM_SHA_1_HMAC_GENERAL       , "CKM_SHA_1_HMAC_GENERAL       " },
-  { CKM_SHA256                   , "CKM_SHA256                   " },
-  { CKM_SHA256_HMAC              , "CKM_SHA256_HMAC              " },
-  { CKM_SHA256_HMAC_GENERAL      , "CKM_SHA256_HMAC_GENERAL      " },
-  { CKM_SHA384                   , "CKM_SHA384                   " },
-  { CKM_SHA384_HMAC              , "CKM_SHA384_HMAC              " },
-  { CKM_SHA384_HMAC_GENERAL      , "CKM_SHA384_HMAC_GENERAL      " },
-  { CKM_SHA512                   , "CKM_SHA512                   " },
-  { CKM_SHA512_HMAC              , "CKM_SHA512_HMAC              " },
-  { CKM_SHA512_HMAC_GENERAL      , "CKM_SHA512_HMAC_GENERAL      " },
   { CKM_RIPEMD128                , "CKM_RIPEMD128                " },
   { CKM_RIPEMD128_HMAC           , "CKM_RIPEMD128_HMAC           " },
   { CKM_RIPEMD128_HMAC_GENERAL   , "CKM_RIPEMD128_HMAC_GENERAL   " },
@@ -363,9 +356,13 @@ static enum_specs ck_mec_s[] = {
   { CKM_SHA256                   , "CKM_SHA256                   " },
   { CKM_SHA256_HMAC              , "CKM_SHA256_HMAC              " },
   { CKM_SHA256_HMAC_GENERAL      , "CKM_SHA256_HMAC_GENERAL      " },
+  { CKM_SHA224                   , "CKM_SHA224                   " },
   { CKM_SHA384                   , "CKM_SHA384                   " },
   { CKM_SHA384_HMAC              , "CKM_SHA384_HMAC              " },
   { CKM_SHA384_HMAC_GENERAL      , "CKM_SHA384_HMAC_GENERAL      " },
+  { CKM_SHA512                   , "CKM_SHA512                   " },
+  { CKM_SHA512_HMAC              , "CKM_SHA512_HMAC              " },
+  { CKM_SHA512_HMAC_GENERAL      , "CKM_SHA512_HMAC_GENERAL      " },
   { CKM_CAST_KEY_GEN             , "CKM_CAST_KEY_GEN             " },
   { CKM_CAST_ECB                 , "CKM_CAST_ECB                 " },
   { CKM_CAST_CBC                 , "CKM_CAST_CBC                 " },
@@ -463,6 +460,10 @@ static enum_specs ck_mec_s[] = {
   { CKM_EC_KEY_PAIR_GEN          , "CKM_EC_KEY_PAIR_GEN          " },
   { CKM_ECDSA                    , "CKM_ECDSA                    " },
   { CKM_ECDSA_SHA1               , "CKM_ECDSA_SHA1               " },
+  { CKM_ECDSA_SHA224             , "CKM_ECDSA_SHA224             " },
+  { CKM_ECDSA_SHA256             , "CKM_ECDSA_SHA256             " },
+  { CKM_ECDSA_SHA384             , "CKM_ECDSA_SHA384             " },
+  { CKM_ECDSA_SHA512             , "CKM_ECDSA_SHA512             " },
   { CKM_ECDH1_DERIVE             , "CKM_ECDH1_DERIVE             " },
   { CKM_ECDH1_COFACTOR_DERIVE    , "CKM_ECDH1_COFACTOR_DERIVE    " },
   { CKM_ECMQV_DERIVE             , "CKM_ECMQV_DERIVE             " },
@@ -479,6 +480,8 @@ static enum_specs ck_mec_s[] = {
   { CKM_AES_MAC                  , "CKM_AES_MAC                  " },
   { CKM_AES_MAC_GENERAL          , "CKM_AES_MAC_GENERAL          " },
   { CKM_AES_CBC_PAD              , "CKM_AES_CBC_PAD              " },
+  { CKM_AES_CTR                  , "CKM_AES_CTR                  " },
+  { CKM_AES_GCM                  , "CKM_AES_GCM                  " },
   { CKM_DSA_PARAMETER_GEN        , "CKM_DSA_PARAMETER_GEN        " },
   { CKM_DH_PKCS_PARAMETER_GEN    , "CKM_DH_PKCS_PARAMETER_GEN    " },
   { CKM_X9_42_DH_PARAMETER_GEN   , "CKM_X9_42_DH_PARAMETER_GEN   " },
@@ -680,8 +683,6 @@ type_spec ck_attribute_specs[] = {
   { CKA_AUTH_PIN_FLAGS    , "CKA_AUTH_PIN_FLAGS   ", print_generic, NULL },
   { CKA_ALWAYS_AUTHENTICATE, "CKA_ALWAYS_AUTHENTICATE ", print_boolean, NULL },
   { CKA_WRAP_WITH_TRUSTED , "CKA_WRAP_WITH_TRUSTED ", print_generic, NULL },
-  { CKA_WRAP_TEMPLATE     , "CKA_WRAP_TEMPLATE    ", print_generic, NULL },
-  { CKA_UNWRAP_TEMPLATE   , "CKA_UNWRAP_TEMPLATE  ", print_generic, NULL },
   { CKA_HW_FEATURE_TYPE   , "CKA_HW_FEATURE_TYPE  ", print_generic, NULL },
   { CKA_RESET_ON_INIT     , "CKA_RESET_ON_INIT    ", print_generic, NULL },
   { CKA_HAS_RESET         , "CKA_HAS_RESET        ", print_generic, NULL },
@@ -699,6 +700,8 @@ type_spec ck_attribute_specs[] = {
   { CKA_REQUIRED_CMS_ATTRIBUTES, "CKA_REQUIRED_CMS_ATTRIBUTES ", print_generic, NULL },
   { CKA_DEFAULT_CMS_ATTRIBUTES, "CKA_DEFAULT_CMS_ATTRIBUTES ", print_generic, NULL },
   { CKA_SUPPORTED_CMS_ATTRIBUTES, "CKA_SUPPORTED_CMS_ATTRIBUTES ", print_generic, NULL },
+  { CKA_WRAP_TEMPLATE     , "CKA_WRAP_TEMPLATE    ", print_generic, NULL },
+  { CKA_UNWRAP_TEMPLATE   , "CKA_UNWRAP_TEMPLATE  ", print_generic, NULL },
   { CKA_ALLOWED_MECHANISMS, "CKA_ALLOWED_MECHANISMS ", print_generic, NULL },
   { CKA_NETSCAPE_URL, "CKA_NETSCAPE_URL(Netsc)                         ", print_generic, NULL },
   { CKA_NETSCAPE_EMAIL, "CKA_NETSCAPE_EMAIL(Netsc)                     ", print_generic, NULL },
@@ -737,8 +740,20 @@ CK_ULONG ck_attribute_num = sizeof(ck_attribute_specs)/sizeof(type_spec);
 const char *
 lookup_enum_spec(enum_spec *spec, CK_ULONG value)
 {
-	CK_ULONG i;
+	CK_ULONG lo = 0, hi = spec->size, mid, i;
 
+	/* the first entry not below value */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (spec->specs[mid].type < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < spec->size && spec->specs[lo].type == value)
+		return spec->specs[lo].name;
+
+	/* an entry added out of order is still found */
 	for(i = 0; i < spec->size; i++)
 		if(spec->specs[i].type == value)
 			return spec->specs[i].name;
@@ -751,13 +766,39 @@ lookup_enum(CK_ULONG type, CK_ULONG value)
 {
 	CK_ULONG i;
 
-	for(i = 0; ck_types[i].type < ( sizeof(ck_types) / sizeof(enum_spec) ) ; i++)
+	/* ck_types is indexed by enum ck_type */
+	if (type < sizeof(ck_types) / sizeof(enum_spec) && ck_types[type].type == type)
+		return lookup_enum_spec(&(ck_types[type]), value);
+
+	for(i = 0; i < sizeof(ck_types) / sizeof(enum_spec); i++)
 		if(ck_types[i].type == type)
 			return lookup_enum_spec(&(ck_types[i]), value);
 	return NULL;
 }
 
 
+static type_spec *
+lookup_attribute_spec(CK_ATTRIBUTE_TYPE type)
+{
+	CK_ULONG lo = 0, hi = ck_attribute_num, mid, i;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ck_attribute_specs[mid].type < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < ck_attribute_num && ck_attribute_specs[lo].type == type)
+		return &ck_attribute_specs[lo];
+
+	for(i = 0; i < ck_attribute_num; i++)
+		if(ck_attribute_specs[i].type == type)
+			return &ck_attribute_specs[i];
+	return NULL;
+}
+
+
 void
 show_error( FILE *f, char *str, CK_RV rc )
 {
@@ -922,27 +963,21 @@ print_mech_info(FILE *f, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR minfo)
 void
 print_attribute_list(FILE *f, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG  ulCount)
 {
-	CK_ULONG j, k;
-	int found;
+	CK_ULONG j;
+	type_spec *spec;
 
 	for(j = 0; j < ulCount ; j++) {
-		found = 0;
-		for(k = 0; k < ck_attribute_num; k++) {
-			if(ck_attribute_specs[k].type == pTemplate[j].type) {
-				found = 1;
-				fprintf(f, "    %s ", ck_attribute_specs[k].name);
-				if(pTemplate[j].pValue && ((CK_LONG) pTemplate[j].ulValueLen) > 0) {
-					ck_attribute_specs[k].display
-					(f, pTemplate[j].type, pTemplate[j].pValue,
-						pTemplate[j].ulValueLen,
-					ck_attribute_specs[k].arg);
-				} else {
-					fprintf(f, "%s\n", buf_spec(pTemplate[j].pValue, pTemplate[j].ulValueLen));
-				}
-				k = ck_attribute_num;
+		spec = lookup_attribute_spec(pTemplate[j].type);
+		if (spec) {
+			fprintf(f, "    %s ", spec->name);
+			if(pTemplate[j].pValue && ((CK_LONG) pTemplate[j].ulValueLen) > 0) {
+				spec->display(f, pTemplate[j].type, pTemplate[j].pValue,
+						pTemplate[j].ulValueLen, spec->arg);
+			} else {
+				fprintf(f, "%s\n", buf_spec(pTemplate[j].pValue, pTemplate[j].ulValueLen));
 			}
 		}
-		if (!found) {
+		else {
 			fprintf(f, "    CKA_? (0x%08lx)    ", pTemplate[j].type);
 			fprintf(f, "%s\n", buf_spec(pTemplate[j].pValue, pTemplate[j].ulValueLen));
 		}
@@ -953,21 +988,16 @@ print_attribute_list(FILE *f, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG  ulCount)
 void
 print_attribute_list_req(FILE *f, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG  ulCount)
 {
-	CK_ULONG j, k;
-	int found;
+	CK_ULONG j;
+	type_spec *spec;
 
 	for(j = 0; j < ulCount ; j++) {
-		found = 0;
-		for(k = 0; k < ck_attribute_num; k++) {
-			if(ck_attribute_specs[k].type == pTemplate[j].type) {
-				found = 1;
-				fprintf(f, "    %s ", ck_attribute_specs[k].name);
-				fprintf(f, "%s\n", buf_spec(pTemplate[j].pValue, pTemplate[j].ulValueLen));
-				k = ck_attribute_num;
-			}
+		spec = lookup_attribute_spec(pTemplate[j].type);
+		if (spec) {
+			fprintf(f, "    %s ", spec->name);
+			fprintf(f, "%s\n", buf_spec(pTemplate[j].pValue, pTemplate[j].ulValueLen));
 		}
-
-		if (!found) {
+		else {
 			fprintf(f, "    CKA_? (0x%08lx)    ", pTemplate[j].type);
 			fprintf(f, "%s\n", buf_spec(pTemplate[j].pValue, pTemplate[j].ulValueLen));
 		}
@@ -25,8 +25,12 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "sc-pkcs11.h"
+#include "libopensc/probes.h"
 
 #ifndef MODULE_APP_NAME
 #define MODULE_APP_NAME "opensc-pkcs11"
@@ -34,12 +38,16 @@
 
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
-list_t sessions;
-list_t virtual_slots;
+struct sc_pkcs11_session_list sessions;
+struct sc_pkcs11_handle_table session_handles;
+struct sc_pkcs11_handle_table object_handles;
+struct sc_pkcs11_vector virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
 #endif
 static int in_finalize = 0;
+/* The application allows us to start threads of our own */
+static int threads_allowed = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
 #if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
@@ -118,6 +126,15 @@ static CK_C_INITIALIZE_ARGS _def_locks = {
 
 static CK_C_INITIALIZE_ARGS_PTR	global_locking;
 static void *			global_lock = NULL;
+/* wait and hold times of global_lock, see C_OpenSC_GetLockStats() */
+static struct sc_lock_stats	global_lock_stats;
+static unsigned long long	global_lock_acquired;
+static const char *		global_lock_holder;
+static struct {
+	const char *function;
+	unsigned long waits;
+	unsigned long long wait_usec;
+} global_lock_holders[CK_OPENSC_LOCK_HOLDERS];
 #if (defined(HAVE_PTHREAD) || defined(_WIN32)) && defined(PKCS11_THREAD_LOCKING)
 #define HAVE_OS_LOCKING
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
@@ -172,25 +189,266 @@ static sc_thread_context_t sc_thread_ctx = {
 	sc_unlock_mutex, sc_destroy_mutex, NULL
 };
 
-/* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
+/*
+ * Slot event monitor: a thread that waits for card and reader events
+ * on all readers with a single blocking sc_wait_for_event() and updates
+ * the slots as they happen, so that C_GetSlotList() and
+ * C_WaitForSlotEvent() do not have to probe every reader on each call.
+ */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+
+/* Upper bound for one wait, C_Finalize() normally wakes us with sc_cancel() */
+#define SLOT_MONITOR_TIMEOUT	1000
+
+static pthread_t slot_monitor_thread;
+static pid_t slot_monitor_pid = (pid_t)-1;
+static volatile int slot_monitor_running = 0;
+static volatile int slot_monitor_synced = 0;
+static volatile int slot_monitor_stop = 0;
+
+static void *slot_monitor_main(void *arg)
+{
+	void *reader_states = NULL;
+	sc_reader_t *reader;
+	unsigned int mask, events, i;
+	int r;
+
+	mask = SC_EVENT_CARD_EVENTS;
+	if (sc_pkcs11_conf.plug_and_play)
+		mask |= SC_EVENT_READER_EVENTS;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return NULL;
+	card_detect_all();
+	slot_monitor_synced = 1;
+	sc_pkcs11_unlock();
+
+	while (!slot_monitor_stop) {
+		reader = NULL;
+		events = 0;
+		r = sc_wait_for_event(context, mask, &reader, &events, SLOT_MONITOR_TIMEOUT, &reader_states);
+		if (slot_monitor_stop)
+			break;
+		if (r == SC_ERROR_EVENT_TIMEOUT) {
+			/* Idle: check what the cards served from the file cache,
+			 * and top up the key pools */
+			if (sc_pkcs11_lock() != CKR_OK)
+				break;
+			for (i = 0; i < sc_ctx_get_reader_count(context) && !slot_monitor_stop; i++)
+				card_revalidate(sc_ctx_get_reader(context, i));
+			sc_pkcs11_unlock();
+			/* Key generation takes long, it holds only the reader lock */
+			for (i = 0; !slot_monitor_stop; i++) {
+				if (sc_pkcs11_lock() != CKR_OK)
+					break;
+				reader = i < sc_ctx_get_reader_count(context) ? sc_ctx_get_reader(context, i) : NULL;
+				sc_pkcs11_unlock();
+				if (reader == NULL)
+					break;
+				card_refill_key_pool(reader);
+			}
+			continue;
+		}
+
+		if (sc_pkcs11_lock() != CKR_OK)
+			break;
+		if (r != SC_SUCCESS) {
+			/* Let the callers poll the readers again */
+			sc_log(context, "slot monitor: sc_wait_for_event() failed: %d", r);
+			slot_monitor_synced = 0;
+			sc_pkcs11_unlock();
+			break;
+		}
+		if ((events & (SC_EVENT_READER_ATTACHED | SC_EVENT_READER_DETACHED)) || reader == NULL) {
+			if (events & (SC_EVENT_READER_ATTACHED | SC_EVENT_READER_DETACHED))
+				sc_ctx_detect_readers(context);
+			card_detect_all();
+			/* The reader list may have changed, restart with fresh states */
+			sc_wait_for_event(context, 0, NULL, NULL, 0, &reader_states);
+		} else {
+			/* New readers arrive as reader events, see above */
+			card_detect(reader);
+		}
+		sc_pkcs11_unlock();
+	}
+
+	if (reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, 0, &reader_states);
+	return NULL;
 }
-static int slot_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (slot->id == *(CK_SLOT_ID *)key)
-		return 1;
+
+static void slot_monitor_start(void)
+{
+	if (!sc_pkcs11_conf.slot_event_monitor || !sc_pkcs11_threads_allowed())
+		return;
+
+	slot_monitor_stop = 0;
+	slot_monitor_synced = 0;
+	if (pthread_create(&slot_monitor_thread, NULL, slot_monitor_main, NULL) != 0) {
+		sc_log(context, "Cannot start the slot event monitor");
+		return;
+	}
+	slot_monitor_pid = getpid();
+	slot_monitor_running = 1;
+}
+
+static void slot_monitor_end(void)
+{
+	if (!slot_monitor_running)
+		return;
+	slot_monitor_running = 0;
+	slot_monitor_synced = 0;
+	/* The thread did not survive fork() */
+	if (slot_monitor_pid != getpid())
+		return;
+
+	slot_monitor_stop = 1;
+	sc_cancel(context);
+	pthread_join(slot_monitor_thread, NULL);
+}
+
+int slot_monitor_active(void)
+{
+	return slot_monitor_running && slot_monitor_synced;
+}
+#else
+static void slot_monitor_start(void)
+{
+}
+
+static void slot_monitor_end(void)
+{
+}
+
+int slot_monitor_active(void)
+{
 	return 0;
 }
+#endif
+
+/*
+ * Reader states of finished blocking C_WaitForSlotEvent() calls. The next
+ * wait continues from them, so events that were already reported do not
+ * wake it up again.
+ */
+#define SC_PKCS11_IDLE_WAIT_STATES	4
+
+static struct {
+	void *states;
+	unsigned int num_readers;
+} idle_wait_states[SC_PKCS11_IDLE_WAIT_STATES];
+/* number of threads blocked in C_WaitForSlotEvent() */
+static unsigned int slot_waiters = 0;
+
+static void *wait_states_get(void)
+{
+	unsigned int i, num_readers = sc_ctx_get_reader_count(context);
+	void *states = NULL;
+
+	for (i = 0; i < SC_PKCS11_IDLE_WAIT_STATES; i++) {
+		if (!idle_wait_states[i].states)
+			continue;
+		/* States from before a reader was added miss that reader */
+		if (idle_wait_states[i].num_readers != num_readers) {
+			sc_wait_for_event(context, 0, NULL, NULL, 0, &idle_wait_states[i].states);
+			continue;
+		}
+		if (!states) {
+			states = idle_wait_states[i].states;
+			idle_wait_states[i].states = NULL;
+		}
+	}
+	return states;
+}
 
+static void wait_states_put(void *states)
+{
+	unsigned int i;
 
+	for (i = 0; i < SC_PKCS11_IDLE_WAIT_STATES; i++) {
+		if (!idle_wait_states[i].states) {
+			idle_wait_states[i].states = states;
+			idle_wait_states[i].num_readers = sc_ctx_get_reader_count(context);
+			return;
+		}
+	}
+	sc_wait_for_event(context, 0, NULL, NULL, 0, &states);
+}
+
+static void wait_states_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_IDLE_WAIT_STATES; i++)
+		if (idle_wait_states[i].states)
+			sc_wait_for_event(context, 0, NULL, NULL, 0, &idle_wait_states[i].states);
+}
+
+/* Drops the tokens, sessions and slots, with the global lock held */
+static void release_slots(void)
+{
+	unsigned int i;
+	struct sc_pkcs11_session *session;
+	sc_pkcs11_slot_t *slot;
+
+	/* remove all cards from readers */
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++)
+		card_removed(sc_ctx_get_reader(context, i));
+
+	while ((session = sessions.first) != NULL) {
+		sessions.first = session->next;
+		sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, sizeof(*session));
+		free(session);
+	}
+	sessions.count = 0;
+	handle_table_free(&session_handles);
+
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		slot = (sc_pkcs11_slot_t *) vector_get(&virtual_slots, i);
+		vector_free(&slot->objects);
+		slot_drop_object_index(slot);
+		sc_pkcs11_free_slot_lock(slot);
+		free(slot);
+	}
+	vector_free(&virtual_slots);
+	slot_list_free();
+	slot_reader_index_free();
+	handle_table_free(&object_handles);
+}
+
+#if !defined(_WIN32)
+/*
+ * In a child of the process that called C_Initialize() the context is
+ * kept: the configuration, the card drivers and the readers are the
+ * same, only the PC/SC handles are replaced. The slots are set up
+ * again, the cards of the parent are dropped without talking to them
+ * through its handles. Returns 0 if the context had to go as well.
+ */
+static int reinit_after_fork(void)
+{
+	unsigned int i;
+
+	slot_monitor_end();
+	sc_pkcs11_async_forget();
+	/* Threads of the parent did not come along, nor did their PC/SC
+	 * contexts: leave the reader states of the waiters alone */
+	slot_waiters = 0;
+	for (i = 0; i < SC_PKCS11_IDLE_WAIT_STATES; i++)
+		idle_wait_states[i].states = NULL;
+
+	if (sc_ctx_reinit_after_fork(context) != SC_SUCCESS)
+		return 0;
+	sc_log(context, "C_Initialize() after fork(), keeping the context");
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return 0;
+	release_slots();
+	sc_pkcs11_unlock();
+	sc_pkcs11_free_lock();
+	return 1;
+}
+#endif
 
 CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 {
@@ -198,50 +456,65 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 #if !defined(_WIN32)
 	pid_t current_pid = getpid();
 #endif
-	int rc;
-	unsigned int i;
+	int rc, forked = 0;
 	sc_context_param_t ctx_opts;
+	unsigned long long start, step;
 
+	SC_PROBE1(pkcs11__entry, "C_Initialize");
 	/* Handle fork() exception */
 #if !defined(_WIN32)
-	if (current_pid != initialized_pid) {
-		C_Finalize(NULL_PTR);
+	if (current_pid != initialized_pid && context != NULL) {
+		forked = reinit_after_fork();
+		if (!forked) {
+			/* Threads of the parent did not come along */
+			slot_waiters = 0;
+			C_Finalize(NULL_PTR);
+		}
 	}
 	initialized_pid = current_pid;
 	in_finalize = 0;
 #endif
 
-	if (context != NULL) {
+	if (context != NULL && !forked) {
 		sc_log(context, "C_Initialize(): Cryptoki already initialized\n");
+		SC_PROBE2(pkcs11__return, "C_Initialize", CKR_CRYPTOKI_ALREADY_INITIALIZED);
 		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
 	}
 
 	rv = sc_pkcs11_init_lock((CK_C_INITIALIZE_ARGS_PTR) pInitArgs);
 	if (rv != CKR_OK)
 		goto out;
-
-	/* set context options */
-	memset(&ctx_opts, 0, sizeof(sc_context_param_t));
-	ctx_opts.ver        = 0;
-	ctx_opts.app_name   = MODULE_APP_NAME;
-	ctx_opts.thread_ctx = &sc_thread_ctx;
-
-	rc = sc_context_create(&context, &ctx_opts);
-	if (rc != SC_SUCCESS) {
-		rv = CKR_GENERAL_ERROR;
-		goto out;
+	/* Without locking our threads would race with the application */
+	threads_allowed = global_lock != NULL && !(pInitArgs
+		&& (((CK_C_INITIALIZE_ARGS_PTR) pInitArgs)->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS));
+
+	if (!forked) {
+		/* set context options */
+		memset(&ctx_opts, 0, sizeof(sc_context_param_t));
+		ctx_opts.ver        = 0;
+		ctx_opts.app_name   = MODULE_APP_NAME;
+		ctx_opts.thread_ctx = &sc_thread_ctx;
+		/* other copies of the module in the process use the same cards */
+		ctx_opts.flags      = SC_CTX_FLAG_SHARED;
+
+		rc = sc_context_create(&context, &ctx_opts);
+		if (rc != SC_SUCCESS) {
+			rv = CKR_GENERAL_ERROR;
+			goto out;
+		}
 	}
+	/* the context was created at the start of the call */
+	start = sc_startup_trace_begin(context);
 
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
 	/* List of sessions */
-	list_init(&sessions);
-	list_attributes_seeker(&sessions, session_list_seeker);
+	memset(&sessions, 0, sizeof(sessions));
 
 	/* List of slots */
-	list_init(&virtual_slots);
-	list_attributes_seeker(&virtual_slots, slot_list_seeker);
+	memset(&virtual_slots, 0, sizeof(virtual_slots));
+	slot_reader_index_free();
 
 	/* Create a slot for a future "PnP" stuff. */
 	if (sc_pkcs11_conf.plug_and_play) {
@@ -250,9 +523,15 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 
 	/* Create slots for readers found on initialization, only if in 2.11 mode */
 	if (!sc_pkcs11_conf.plug_and_play) {
-		for (i=0; i<sc_ctx_get_reader_count(context); i++) {
-			initialize_reader(sc_ctx_get_reader(context, i));
-		}
+		step = sc_startup_trace_begin(context);
+		card_detect_all();
+		sc_startup_trace_end(context, step, "pkcs11", "card_detect_all");
+	}
+
+	slot_monitor_start();
+	if (start != 0) {
+		sc_startup_trace_end(context, start, "pkcs11", "C_Initialize after sc_context_create");
+		sc_startup_trace_write(context, NULL);
 	}
 
 out:
@@ -268,14 +547,12 @@ out:
 		sc_pkcs11_free_lock();
 	}
 
+	SC_PROBE2(pkcs11__return, "C_Initialize", rv);
 	return rv;
 }
 
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
-	int i;
-	void *p;
-	sc_pkcs11_slot_t *slot;
 	CK_RV rv;
 
 	if (pReserved != NULL_PTR)
@@ -284,28 +561,38 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	SC_PROBE1(pkcs11__entry, "C_Finalize");
+	/* The monitor and the operation queues take the global lock, stop them first */
+	slot_monitor_end();
+	sc_pkcs11_async_end();
+
 	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
+	if (rv != CKR_OK) {
+		SC_PROBE2(pkcs11__return, "C_Finalize", rv);
 		return rv;
+	}
 
 	sc_log(context, "C_Finalize()");
 
 	/* cancel pending calls */
 	in_finalize = 1;
 	sc_cancel(context);
-	/* remove all cards from readers */
-	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
-		card_removed(sc_ctx_get_reader(context, i));
-
-	while ((p = list_fetch(&sessions)))
-		free(p);
-	list_destroy(&sessions);
-
-	while ((slot = list_fetch(&virtual_slots))) {
-		list_destroy(&slot->objects);
-		free(slot);
+	/* Blocked C_WaitForSlotEvent() calls still use the context, let them
+	 * leave. Cancel again in case one had not started waiting yet. */
+	while (slot_waiters > 0) {
+		sc_pkcs11_unlock();
+#ifdef _WIN32
+		Sleep(10);
+#else
+		usleep(10000);
+#endif
+		sc_pkcs11_lock();
+		if (slot_waiters > 0)
+			sc_cancel(context);
 	}
-	list_destroy(&virtual_slots);
+	wait_states_free();
+	release_slots();
+	sc_pkcs11_object_pool_free();
 
 	sc_release_context(context);
 	context = NULL;
@@ -313,6 +600,7 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	/* Release and destroy the mutex */
 	sc_pkcs11_free_lock();
 
+	SC_PROBE2(pkcs11__return, "C_Finalize", rv);
 	return rv;
 }
 
@@ -358,23 +646,169 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 	return CKR_OK;
 }
 
+CK_RV C_OpenSC_GetOperationStats(CK_SLOT_ID slotID, CK_SESSION_HANDLE hSession,
+		CK_OPENSC_OPERATION_STATS_PTR pStats, CK_ULONG ulCount, CK_BBOOL reset)
+{
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
+	CK_OPENSC_OPERATION_STATS *stats = NULL;
+	CK_RV rv;
+
+	if (pStats == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+	if (ulCount > CK_OPENSC_OP_COUNT)
+		ulCount = CK_OPENSC_OP_COUNT;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	if (hSession != CK_INVALID_HANDLE) {
+		rv = get_session(hSession, &session);
+		if (rv == CKR_OK) {
+			slot = session->slot;
+			stats = session->stats;
+		}
+	}
+	else {
+		rv = slot_get_slot(slotID, &slot);
+		if (rv == CKR_OK)
+			stats = slot->stats;
+	}
+	if (rv == CKR_OK) {
+		/* the counters are updated under the reader lock */
+		sc_pkcs11_lock_slot(slot);
+		memcpy(pStats, stats, ulCount * sizeof(*stats));
+		if (reset)
+			memset(stats, 0, CK_OPENSC_OP_COUNT * sizeof(*stats));
+		sc_pkcs11_unlock_slot(slot);
+	}
+
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+CK_RV C_OpenSC_GetLockStats(CK_OPENSC_LOCK_STATS_PTR pStats, CK_BBOOL reset)
+{
+	CK_RV rv;
+	int i;
+
+	if (pStats == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	memset(pStats, 0, sizeof(*pStats));
+	pStats->acquired = global_lock_stats.acquired;
+	pStats->contended = global_lock_stats.contended;
+	pStats->wait_usec = (CK_ULONG) global_lock_stats.wait_usec;
+	pStats->max_wait_usec = global_lock_stats.max_wait_usec;
+	pStats->hold_usec = (CK_ULONG) global_lock_stats.hold_usec;
+	pStats->max_hold_usec = global_lock_stats.max_hold_usec;
+	for (i = 0; i < CK_OPENSC_LOCK_BUCKETS && i < SC_LATENCY_BUCKETS; i++) {
+		pStats->wait_histogram[i] = global_lock_stats.wait_histogram[i];
+		pStats->hold_histogram[i] = global_lock_stats.hold_histogram[i];
+	}
+	for (i = 0; i < CK_OPENSC_LOCK_HOLDERS && global_lock_holders[i].function; i++) {
+		/* zeroed above, the last byte stays NUL */
+		strncpy((char *) pStats->holders[i].function, global_lock_holders[i].function,
+				sizeof(pStats->holders[i].function) - 1);
+		pStats->holders[i].waits = global_lock_holders[i].waits;
+		pStats->holders[i].wait_usec = (CK_ULONG) global_lock_holders[i].wait_usec;
+	}
+	if (reset) {
+		memset(&global_lock_stats, 0, sizeof(global_lock_stats));
+		memset(global_lock_holders, 0, sizeof(global_lock_holders));
+	}
+
+	sc_pkcs11_unlock();
+	return CKR_OK;
+}
+
+CK_RV C_OpenSC_GetMemoryStats(CK_OPENSC_MEMORY_STATS_PTR pStats, CK_ULONG ulCount,
+		CK_BBOOL reset)
+{
+	struct sc_mem_stats stats;
+	CK_ULONG i;
+
+	if (pStats == NULL_PTR && ulCount)
+		return CKR_ARGUMENTS_BAD;
+
+	/* the counters are atomic, no need for the global lock */
+	for (i = 0; i < ulCount; i++) {
+		memset(&pStats[i], 0, sizeof(pStats[i]));
+		if (i >= SC_MEM_SUBSYSTEMS || sc_mem_get_stats((int) i, &stats, reset) != SC_SUCCESS)
+			continue;
+		pStats[i].live = stats.live;
+		pStats[i].peak = stats.peak;
+		pStats[i].allocs = (CK_ULONG) stats.allocs;
+		pStats[i].frees = (CK_ULONG) stats.frees;
+		pStats[i].bytes = (CK_ULONG) stats.bytes;
+		pStats[i].usec = (CK_ULONG) stats.usec;
+	}
+	return CKR_OK;
+}
+
+CK_RV C_OpenSC_ReloadConfig(void)
+{
+	CK_RV rv;
+	unsigned int i, j;
+	int r;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	r = sc_ctx_reload_config(context);
+	if (r != SC_SUCCESS) {
+		rv = sc_to_cryptoki_error(r, NULL);
+		goto out;
+	}
+
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) vector_get(&virtual_slots, i);
+		struct sc_pkcs11_card *p11card = slot->card;
+
+		if (p11card == NULL || p11card->framework == NULL
+				|| p11card->framework->reload_config == NULL)
+			continue;
+		/* the virtual slots of a card share it, apply once */
+		for (j = 0; j < i; j++)
+			if (((sc_pkcs11_slot_t *) vector_get(&virtual_slots, j))->card == p11card)
+				break;
+		if (j < i)
+			continue;
+
+		sc_pkcs11_lock_slot(slot);
+		rv = p11card->framework->reload_config(p11card);
+		sc_pkcs11_unlock_slot(slot);
+		if (rv != CKR_OK)
+			break;
+	}
+
+out:
+	sc_log(context, "C_OpenSC_ReloadConfig() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock();
+	return rv;
+}
+
 CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token present */
 		    CK_SLOT_ID_PTR pSlotList,     /* receives the array of slot IDs */
 		    CK_ULONG_PTR   pulCount)      /* receives the number of slots */
 {
-	CK_SLOT_ID_PTR found = NULL;
-	unsigned int i;
+	const CK_SLOT_ID *found = NULL;
 	CK_ULONG numMatches;
-	sc_pkcs11_slot_t *slot;
-	sc_reader_t *prev_reader = NULL;
 	CK_RV rv;
 
 	if (pulCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
+	SC_PROBE1(pkcs11__entry, "C_GetSlotList");
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		goto done;
 
 	sc_log(context, "C_GetSlotList(token=%d, %s)", tokenPresent,
 		 (pSlotList==NULL_PTR && sc_pkcs11_conf.plug_and_play)? "plug-n-play":"refresh");
@@ -382,35 +816,18 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	/* Slot list can only change in v2.20 */
 	if (pSlotList == NULL_PTR && sc_pkcs11_conf.plug_and_play) {
 		/* Trick NSS into updating the slot list by changing the hotplug slot ID */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+		sc_pkcs11_slot_t *hotplug_slot = vector_get(&virtual_slots, 0);
 		hotplug_slot->id--;
+		slot_list_changed();
 		sc_ctx_detect_readers(context);
 	}
 
-	card_detect_all();
+	if (!slot_monitor_active())
+		card_detect_all();
 
-	found = calloc(list_size(&virtual_slots), sizeof(CK_SLOT_ID));
-
-	if (found == NULL) {
-		rv = CKR_HOST_MEMORY;
+	rv = slot_list_get(tokenPresent, &found, &numMatches);
+	if (rv != CKR_OK)
 		goto out;
-	}
-
-	prev_reader = NULL;
-	numMatches = 0;
-	for (i=0; i<list_size(&virtual_slots); i++) {
-	        slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		/* the list of available slots contains:
-		 * - if present, virtual hotplug slot;
-		 * - any slot with token;
-		 * - without token(s), one empty slot per reader;
-		 */
-	        if ((!tokenPresent && !slot->reader)
-				|| (!tokenPresent && slot->reader != prev_reader)
-				|| (slot->slot_info.flags & CKF_TOKEN_PRESENT))
-			found[numMatches++] = slot->id;
-		prev_reader = slot->reader;
-	}
 
 	if (pSlotList == NULL_PTR) {
 		sc_log(context, "was only a size inquiry (%d)\n", numMatches);
@@ -433,15 +850,13 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	sc_log(context, "returned %d slots\n", numMatches);
 
 out:
-	if (found != NULL) {
-		free (found);
-		found = NULL;
-	}
 	sc_pkcs11_unlock();
+done:
+	SC_PROBE2(pkcs11__return, "C_GetSlotList", rv);
 	return rv;
 }
 
-static sc_timestamp_t get_current_time(void)
+sc_timestamp_t get_current_time(void)
 {
 #if HAVE_GETTIMEOFDAY
 	struct timeval tv;
@@ -477,9 +892,12 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
+	SC_PROBE1(pkcs11__entry, "C_GetSlotInfo");
 	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
+	if (rv != CKR_OK) {
+		SC_PROBE2(pkcs11__return, "C_GetSlotInfo", rv);
 		return rv;
+	}
 
 	sc_log(context, "C_GetSlotInfo(0x%lx)", slotID);
 
@@ -496,8 +914,11 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 				rv = card_detect(slot->reader);
 				sc_log(context, "C_GetSlotInfo() card detect rv 0x%X", rv);
 
-				if (rv == CKR_TOKEN_NOT_RECOGNIZED || rv == CKR_OK)
+				if ((rv == CKR_TOKEN_NOT_RECOGNIZED || rv == CKR_OK)
+						&& !(slot->slot_info.flags & CKF_TOKEN_PRESENT)) {
 					slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+					slot_list_changed();
+				}
 
 				/* Don't ask again within the next second */
 				slot->slot_state_expires = now + 1000;
@@ -514,6 +935,7 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	sc_log(context, "C_GetSlotInfo() flags 0x%X", pInfo->flags);
 	sc_log(context, "C_GetSlotInfo(0x%lx) = %s", slotID, lookup_enum( RV_T, rv));
 	sc_pkcs11_unlock();
+	SC_PROBE2(pkcs11__return, "C_GetSlotInfo", rv);
 	return rv;
 }
 
@@ -569,12 +991,14 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 	CK_RV rv;
-	unsigned int i;
 
 	sc_log(context, "C_InitToken(pLabel='%s') called", pLabel);
+	SC_PROBE1(pkcs11__entry, "C_InitToken");
 	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
+	if (rv != CKR_OK) {
+		SC_PROBE2(pkcs11__return, "C_InitToken", rv);
 		return rv;
+	}
 
 	rv = slot_get_token(slotID, &slot);
 	if (rv != CKR_OK)   {
@@ -589,15 +1013,16 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	}
 
 	/* Make sure there's no open session for this token */
-	for (i=0; i<list_size(&sessions); i++) {
-		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
+	for (session = sessions.first; session != NULL; session = session->next) {
 		if (session->slot == slot) {
 			rv = CKR_SESSION_EXISTS;
 			goto out;
 		}
 	}
 
+	sc_pkcs11_lock_slot(slot);
 	rv = slot->card->framework->init_token(slot,slot->fw_data, pPin, ulPinLen, pLabel);
+	sc_pkcs11_unlock_slot(slot);
 	if (rv == CKR_OK) {
 		/* Now we should re-bind all tokens so they get the
 		 * corresponding function vector and flags */
@@ -606,6 +1031,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 out:
 	sc_pkcs11_unlock();
 	sc_log(context, "C_InitToken(pLabel='%s') returns 0x%lX", pLabel, rv);
+	SC_PROBE2(pkcs11__return, "C_InitToken", rv);
 	return rv;
 }
 
@@ -614,23 +1040,22 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 			 CK_VOID_PTR pReserved) /* reserved.  Should be NULL_PTR */
 {
 	sc_reader_t *found;
-	unsigned int mask, events;
+	unsigned int mask, events = 0;
 	void *reader_states = NULL;
-	CK_SLOT_ID slot_id;
+	CK_SLOT_ID slot_id = 0;
 	CK_RV rv;
-	int r;
+	int r, waiting = 0;
 
 	if (pReserved != NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
 	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
-		return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PROBE1(pkcs11__entry, "C_WaitForSlotEvent");
 	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
+	if (rv != CKR_OK) {
+		SC_PROBE2(pkcs11__return, "C_WaitForSlotEvent", rv);
 		return rv;
+	}
 
 	mask = SC_EVENT_CARD_EVENTS;
 
@@ -643,28 +1068,33 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
 		goto out;
 
+	/* Continue from the reader states of an earlier wait, so that only
+	 * changes since then wake us up */
+	reader_states = wait_states_get();
+	slot_waiters++;
+	waiting = 1;
+
 again:
 	sc_log(context, "C_WaitForSlotEvent() reader_states:%p", reader_states);
 	sc_pkcs11_unlock();
 	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
-		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
-		   Change the first hotplug slot id on every call to make this happen. */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
-		*pSlot= hotplug_slot->id -1;
-
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
-			return rv;
+	/* C_Finalize() waits for us to leave, the lock is still there */
+	sc_pkcs11_lock();
 
+	/* Was C_Finalize called ? */
+	if (in_finalize == 1) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
 		goto out;
 	}
-	/* Was C_Finalize called ? */
-	if (in_finalize == 1)
-		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	if ((rv = sc_pkcs11_lock()) != CKR_OK)
-		return rv;
+	if (sc_pkcs11_conf.plug_and_play && r == SC_SUCCESS && (events & SC_EVENT_READER_ATTACHED)) {
+		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+		   Change the first hotplug slot id on every call to make this happen. */
+		sc_pkcs11_slot_t *hotplug_slot = vector_get(&virtual_slots, 0);
+		slot_id = hotplug_slot->id - 1;
+		rv = CKR_OK;
+		goto out;
+	}
 
 	if (r != SC_SUCCESS) {
 		sc_log(context, "sc_wait_for_event() returned %d\n",  r);
@@ -679,17 +1109,24 @@ again:
 		goto again;
 
 out:
-	if (pSlot)
+	if (pSlot && rv == CKR_OK)
 		*pSlot = slot_id;
 
-	/* Free allocated readers states holder */
-	if (reader_states)   {
-		sc_log(context, "free reader states");
-		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+	if (reader_states) {
+		/* The reader list changed or is going away, start afresh next time */
+		if (in_finalize || (events & SC_EVENT_READER_ATTACHED)) {
+			sc_log(context, "free reader states");
+			sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+		} else {
+			wait_states_put(reader_states);
+		}
 	}
+	if (waiting)
+		slot_waiters--;
 
-	sc_log(context, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), *pSlot);
+	sc_log(context, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), slot_id);
 	sc_pkcs11_unlock();
+	SC_PROBE2(pkcs11__return, "C_WaitForSlotEvent", rv);
 	return rv;
 }
 
@@ -744,21 +1181,56 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if (global_locking != NULL) {
 		/* create mutex */
 		rv = global_locking->CreateMutex(&global_lock);
+		memset(&global_lock_stats, 0, sizeof(global_lock_stats));
+		memset(global_lock_holders, 0, sizeof(global_lock_holders));
 	}
 
 	return rv;
 }
 
-CK_RV sc_pkcs11_lock(void)
+int sc_pkcs11_threads_allowed(void)
+{
+	return threads_allowed;
+}
+
+static void
+sc_pkcs11_lock_contention(const char *holder, unsigned long long usec)
 {
+	int i;
+
+	for (i = 0; i < CK_OPENSC_LOCK_HOLDERS; i++) {
+		if (global_lock_holders[i].function == NULL)
+			global_lock_holders[i].function = holder;
+		if (global_lock_holders[i].function == holder) {
+			global_lock_holders[i].waits++;
+			global_lock_holders[i].wait_usec += usec;
+			return;
+		}
+	}
+	/* the table is full, the wait only shows in the totals */
+}
+
+CK_RV sc_pkcs11_lock_from(const char *function)
+{
+	const char *holder;
+	unsigned long long start, waited;
+
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	if (!global_lock)
 		return CKR_OK;
 	if (global_locking)  {
+		/* read without the lock, it only names whom we waited for */
+		holder = global_lock_holder;
+		start = sc_lock_stats_begin();
 		while (global_locking->LockMutex(global_lock) != CKR_OK)
 			;
+		global_lock_acquired = sc_lock_stats_wait(&global_lock_stats, start);
+		waited = global_lock_acquired - start;
+		if (waited >= SC_LOCK_CONTENDED_USEC && holder != NULL)
+			sc_pkcs11_lock_contention(holder, waited);
+		global_lock_holder = function;
 	}
 
 	return CKR_OK;
@@ -777,9 +1249,245 @@ __sc_pkcs11_unlock(void *lock)
 
 void sc_pkcs11_unlock(void)
 {
+	if (global_lock && global_locking) {
+		sc_lock_stats_release(&global_lock_stats, global_lock_acquired);
+		global_lock_holder = NULL;
+	}
 	__sc_pkcs11_unlock(global_lock);
 }
 
+/*
+ * Reader locks serialize the operations on the tokens of one reader,
+ * so that the global lock does not have to be held during card I/O.
+ * The global lock is always taken before a reader lock, never after.
+ */
+CK_RV sc_pkcs11_init_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	CK_RV rv;
+
+	if (slot->lock_owner != slot || !global_lock || !global_locking)
+		return CKR_OK;
+
+	rv = global_locking->CreateMutex(&slot->lock);
+	if (rv != CKR_OK)
+		return rv;
+	/* without it bulk operations are not held back */
+	if (global_locking->CreateMutex(&slot->bulk_lock) != CKR_OK)
+		slot->bulk_lock = NULL;
+	return CKR_OK;
+}
+
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	if (slot->lock && global_locking)
+		global_locking->DestroyMutex(slot->lock);
+	if (slot->bulk_lock && global_locking)
+		global_locking->DestroyMutex(slot->bulk_lock);
+	slot->lock = NULL;
+	slot->bulk_lock = NULL;
+}
+
+/*
+ * Take the reader lock of a slot from a path that holds the global lock.
+ * The lock nests, as card_removed() and card_detect() call each other.
+ */
+void sc_pkcs11_lock_slot(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_slot *owner;
+
+	if (!slot)
+		return;
+
+	owner = slot->lock_owner;
+	if (owner->lock_depth++ == 0 && owner->lock) {
+		while (global_locking->LockMutex(owner->lock) != CKR_OK)
+			;
+		/* Sessions and objects may go away, make waiters look them up again */
+		owner->lock_epoch++;
+	}
+}
+
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_slot *owner;
+
+	if (!slot)
+		return;
+
+	owner = slot->lock_owner;
+	if (--owner->lock_depth == 0)
+		__sc_pkcs11_unlock(owner->lock);
+}
+
+/*
+ * Trade the global lock for the reader lock of a slot, for card work that
+ * takes too long to hold up the other readers. Returns 0 with no lock held
+ * if the reader was locked from a global path in between: the slot may
+ * have changed and has to be looked up again.
+ */
+int sc_pkcs11_swap_to_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_slot *owner = slot->lock_owner;
+	unsigned int epoch;
+
+	/* Without reader locks keep the global lock */
+	if (!owner->lock)
+		return 1;
+
+	epoch = owner->lock_epoch;
+	sc_pkcs11_unlock();
+	while (global_locking->LockMutex(owner->lock) != CKR_OK)
+		;
+	if (owner->lock_epoch == epoch)
+		return 1;
+	__sc_pkcs11_unlock(owner->lock);
+	return 0;
+}
+
+void sc_pkcs11_unlock_swapped_slot(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_slot *owner = slot->lock_owner;
+
+	if (owner->lock)
+		__sc_pkcs11_unlock(owner->lock);
+	else
+		sc_pkcs11_unlock();
+}
+
+static void
+sc_pkcs11_stats_snapshot(const sc_reader_t *reader, CK_OPENSC_OPERATION_STATS *s)
+{
+	s->apdus = reader->stats->apdus;
+	s->bytes_sent = (CK_ULONG) reader->stats->bytes_sent;
+	s->bytes_received = (CK_ULONG) reader->stats->bytes_received;
+	s->card_usec = (CK_ULONG) reader->stats->total_usec;
+	s->selects = reader->stats->ins[0xA4].count;
+	s->get_responses = reader->stats->ins[0xC0].count;
+}
+
+static void
+sc_pkcs11_stats_begin(struct sc_pkcs11_session *session, int op)
+{
+	session->stats_op = op;
+	session->stats_reader = session->slot->reader;
+	if (session->stats_reader)
+		sc_pkcs11_stats_snapshot(session->stats_reader, &session->stats_start);
+}
+
+/* Charge the reader traffic since sc_pkcs11_stats_begin() to the call */
+static void
+sc_pkcs11_stats_end(struct sc_pkcs11_session *session)
+{
+	CK_OPENSC_OPERATION_STATS now, *s = &session->stats[session->stats_op];
+	CK_OPENSC_OPERATION_STATS *t = &session->slot->stats[session->stats_op];
+
+	s->calls++;
+	t->calls++;
+	/* the reader may have gone away during the call */
+	if (session->stats_reader == NULL || session->stats_reader != session->slot->reader)
+		return;
+	sc_pkcs11_stats_snapshot(session->stats_reader, &now);
+#define STATS_DELTA(f) do { \
+		CK_ULONG d = now.f - session->stats_start.f; \
+		s->f += d; \
+		t->f += d; \
+	} while (0)
+	STATS_DELTA(apdus);
+	STATS_DELTA(bytes_sent);
+	STATS_DELTA(bytes_received);
+	STATS_DELTA(card_usec);
+	STATS_DELTA(selects);
+	STATS_DELTA(get_responses);
+#undef STATS_DELTA
+}
+
+/*
+ * Operations that may keep the card busy for long: reading many objects
+ * or attributes, writing objects and generating keys. Of them, only one
+ * at a time waits for the reader lock, behind the bulk lock of the reader;
+ * the short ones (login, sign, decrypt, ...) wait for the reader lock
+ * directly. A C_Sign thus waits for the operation on the card to finish,
+ * but not for all bulk operations of the other sessions queued up.
+ */
+static int sc_pkcs11_is_bulk_op(int op)
+{
+	return op == CK_OPENSC_OP_OBJECT || op == CK_OPENSC_OP_ATTRIBUTE
+		|| op == CK_OPENSC_OP_FIND || op == CK_OPENSC_OP_GENERATE;
+}
+
+/*
+ * Look up a session and take the lock of its reader.
+ * The global lock is only held for the lookup. The card traffic of the
+ * call is charged to op until sc_pkcs11_unlock_session().
+ */
+CK_RV sc_pkcs11_lock_session_from(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+		int op, const char *function)
+{
+	struct sc_pkcs11_slot *owner;
+	void *bulk_lock;
+	unsigned int epoch;
+	CK_RV rv;
+
+	for (;;) {
+		rv = sc_pkcs11_lock_from(function);
+		if (rv != CKR_OK)
+			return rv;
+
+		rv = get_session(hSession, session);
+		if (rv != CKR_OK) {
+			sc_pkcs11_unlock();
+			return rv;
+		}
+
+		/* An APDU is stuck in the reader, see transmit_timeout */
+		if ((*session)->slot->reader && (*session)->slot->reader->degraded) {
+			sc_pkcs11_unlock();
+			return CKR_DEVICE_ERROR;
+		}
+
+		/* Without reader locks keep the global lock for the call */
+		owner = (*session)->slot->lock_owner;
+		if (!owner->lock) {
+			sc_pkcs11_stats_begin(*session, op);
+			return CKR_OK;
+		}
+
+		epoch = owner->lock_epoch;
+		bulk_lock = sc_pkcs11_is_bulk_op(op) ? owner->bulk_lock : NULL;
+		sc_pkcs11_unlock();
+
+		if (bulk_lock) {
+			while (global_locking->LockMutex(bulk_lock) != CKR_OK)
+				;
+		}
+		while (global_locking->LockMutex(owner->lock) != CKR_OK)
+			;
+		if (owner->lock_epoch == epoch) {
+			sc_pkcs11_stats_begin(*session, op);
+			return CKR_OK;
+		}
+
+		/* The reader was locked from a global path in between */
+		__sc_pkcs11_unlock(owner->lock);
+		__sc_pkcs11_unlock(bulk_lock);
+	}
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *owner = session->slot->lock_owner;
+
+	sc_pkcs11_stats_end(session);
+	if (owner->lock) {
+		__sc_pkcs11_unlock(owner->lock);
+		if (sc_pkcs11_is_bulk_op(session->stats_op))
+			__sc_pkcs11_unlock(owner->bulk_lock);
+	}
+	else {
+		sc_pkcs11_unlock();
+	}
+}
+
 /*
  * Free the lock - note the lock must be held when
  * you come here
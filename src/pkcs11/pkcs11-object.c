@@ -47,7 +47,13 @@ static sc_pkcs11_mechanism_type_t find_mechanism = {
 	NULL,		/* decrypt_init */
 	NULL,		/* decrypt */
 	NULL,		/* derive */
-	NULL		/* mech_data */
+	NULL,		/* encrypt_init */
+	NULL,		/* encrypt */
+	NULL,		/* mech_data */
+	NULL,		/* encrypt_update */
+	NULL,		/* encrypt_final */
+	NULL,		/* decrypt_update */
+	NULL		/* decrypt_final */
 };
 
 static void
@@ -60,68 +66,41 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 		free(fop->handles);
 		fop->handles = NULL;
 	}
+	if (fop->template) {
+		free(fop->template);
+		fop->template = NULL;
+	}
 }
 
 
 static CK_RV
-get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
+get_object_from_session(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject,
+		struct sc_pkcs11_object **object)
 {
-	struct sc_pkcs11_session *sess;
-	CK_RV rv;
-
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
-	if (!*object)
-		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
-	return CKR_OK;
+	return slot_get_object(session->slot, hObject, object);
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
- * So dont get the lock again. */
+ * which is already holding the session lock,
+ * so the caller takes care of the locking. */
 static
-CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
+CK_RV sc_create_object_int(struct sc_pkcs11_session *session,	/* the locked session */
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
 		CK_ULONG ulCount,			/* attributes in template */
-		CK_OBJECT_HANDLE_PTR phObject,		/* receives new object's handle. */
-		int use_lock)
+		CK_OBJECT_HANDLE_PTR phObject)		/* receives new object's handle. */
 {
 	CK_RV rv = CKR_OK;
-	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
 
 	LOG_FUNC_CALLED(context);
-	if (pTemplate == NULL_PTR || ulCount == 0)
-		return CKR_ARGUMENTS_BAD;
-
-	if (use_lock) {
-	    rv = sc_pkcs11_lock();
-	    if (rv != CKR_OK)
-		return rv;
-	}
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	card = session->slot->card;
 	if (card->framework->create_object == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
-out:
-	if (use_lock)
-		sc_pkcs11_unlock();
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -132,7 +111,20 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
-	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pTemplate == NULL_PTR || ulCount == 0)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_OBJECT);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_create_object_int(session, pTemplate, ulCount, phObject);
+
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 
@@ -157,12 +149,12 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribure = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_OBJECT);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -178,7 +170,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -216,11 +208,11 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_ATTRIBUTE);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -256,7 +248,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -275,13 +267,13 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_OBJECT);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -298,40 +290,143 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		for (i = 0; i < ulCount; i++)
+			if (slot_is_indexed_attribute(pTemplate[i].type))
+				slot_drop_object_index(session->slot);
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
 
+/* Returns 1 if the object matches the template of the find operation */
+static int
+find_match_object(struct sc_pkcs11_session *session, struct sc_pkcs11_find_operation *operation,
+		struct sc_pkcs11_object *object)
+{
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	struct sc_pkcs11_slot *slot = session->slot;
+	unsigned int j;
+
+	sc_log(context, "Object with handle 0x%lx", object->handle);
+
+	/* User not logged in and private object? */
+	if (operation->hide_private) {
+		if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			return 0;
+		if (is_private) {
+			sc_log(context, "Object %d/%d: Private object and not logged in.",
+				 slot->id, object->handle);
+			return 0;
+		}
+	}
+
+	/* Try to match every attribute */
+	for (j = 0; j < operation->template_len; j++) {
+		if (object->ops->cmp_attribute(session, object, &operation->template[j]) == 0) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
+				 slot->id, object->handle, operation->template[j].type);
+			return 0;
+		}
+
+		if (context->debug >= 4) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
+				 slot->id, object->handle, operation->template[j].type);
+		}
+	}
+
+	sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
+	return 1;
+}
+
+
+/* Keeps a copy of the template: the objects are matched by C_FindObjects() */
+static CK_RV
+find_copy_template(struct sc_pkcs11_find_operation *operation,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	CK_ULONG i;
+	size_t size = ulCount * sizeof(CK_ATTRIBUTE);
+	unsigned char *p;
+
+	for (i = 0; i < ulCount; i++) {
+		if (pTemplate[i].pValue == NULL && pTemplate[i].ulValueLen > 0)
+			return CKR_ATTRIBUTE_VALUE_INVALID;
+		size += pTemplate[i].ulValueLen;
+	}
+	if (ulCount == 0)
+		return CKR_OK;
+
+	operation->template = malloc(size);
+	if (operation->template == NULL)
+		return CKR_HOST_MEMORY;
+	operation->template_len = ulCount;
+	p = (unsigned char *) (operation->template + ulCount);
+	for (i = 0; i < ulCount; i++) {
+		operation->template[i].type = pTemplate[i].type;
+		operation->template[i].ulValueLen = pTemplate[i].ulValueLen;
+		operation->template[i].pValue = pTemplate[i].ulValueLen ? p : NULL;
+		if (pTemplate[i].ulValueLen)
+			memcpy(p, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+		p += pTemplate[i].ulValueLen;
+	}
+	return CKR_OK;
+}
+
+
+/* Remembers an object the index found for the attribute, to be matched later */
+static CK_RV
+find_add_candidate(struct sc_pkcs11_find_operation *operation, struct sc_pkcs11_object *object)
+{
+	/* Realloc handles - remove restriction on only 32 matching objects -dee */
+	if (operation->num_handles >= operation->allocated_handles) {
+		CK_OBJECT_HANDLE *handles;
+
+		operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
+		sc_log(context, "realloc for %d handles", operation->allocated_handles);
+		handles = realloc(operation->handles,
+			sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
+		if (handles == NULL)
+			return CKR_HOST_MEMORY;
+		operation->handles = handles;
+	}
+	operation->handles[operation->num_handles++] = object->handle;
+	return CKR_OK;
+}
+
+
+/*
+ * The search only picks the candidates here: the objects indexed with the
+ * value of the most selective attribute of the template, or else all
+ * objects of the slot. They are matched against the whole template by
+ * C_FindObjects(), as many as the caller asked for, so that attribute
+ * compares needing the card (certificates read on demand, for instance)
+ * are only done for the objects actually returned.
+ */
 CK_RV
 C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	unsigned int j;
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_object_index_entry *entry;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
+	CK_ATTRIBUTE_PTR index_attr = NULL;
+	unsigned long hash;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_FIND);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	sc_log(context, "C_FindObjectsInit(slot = %d)\n", session->slot->id);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
 
@@ -344,68 +439,59 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	operation->num_handles = 0;
 	operation->allocated_handles = 0;
 	operation->handles = NULL;
+	operation->template = NULL;
+	operation->template_len = 0;
+	operation->use_index = 0;
+	operation->next_object = 0;
 	slot = session->slot;
 
+	rv = find_copy_template(operation, pTemplate, ulCount);
+	if (rv != CKR_OK)
+		goto fail;
+
 	/* Check whether we should hide private objects */
-	hide_private = 0;
+	operation->hide_private = 0;
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
-		hide_private = 1;
-
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_log(context, "Object %d/%d: Private object and not logged in.",
-					 slot->id, object->handle);
-				continue;
-			}
-		}
+		operation->hide_private = 1;
 
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
-					 slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
+	/* Let the framework create the objects it delayed and that could match */
+	if (slot->card->framework->load_objects != NULL) {
+		rv = slot->card->framework->load_objects(slot, pTemplate, ulCount);
+		if (rv != CKR_OK)
+			goto fail;
+	}
 
-			if (context->debug >= 4) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
-					 slot->id, object->handle, pTemplate[j].type);
-			}
-		}
+	/* Use the most selective indexed attribute of the template */
+	for (j = 0; j < ulCount; j++) {
+		if (!slot_is_indexed_attribute(pTemplate[j].type))
+			continue;
+		if (index_attr == NULL || slot_is_indexed_attribute(pTemplate[j].type)
+				> slot_is_indexed_attribute(index_attr->type))
+			index_attr = &pTemplate[j];
+	}
 
-		if (match) {
-			sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					break;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
+	if (index_attr != NULL && slot_index_objects(session, index_attr->type) == CKR_OK) {
+		/* Only the objects of the slot indexed with the same value are candidates */
+		operation->use_index = 1;
+		hash = slot_attribute_hash(index_attr);
+		entry = slot->card->object_index[slot->fw_data_idx]->buckets[hash % SC_PKCS11_OBJECT_INDEX_SIZE];
+		for (; entry != NULL; entry = entry->next) {
+			if (entry->type != index_attr->type || entry->hash != hash)
+				continue;
+			if (!slot_has_object(slot, entry->object))
+				continue;
+			rv = find_add_candidate(operation, entry->object);
+			if (rv != CKR_OK)
+				goto fail;
 		}
+		sc_log(context, "%d candidate objects\n", operation->num_handles);
 	}
-	rv = CKR_OK;
-
-	sc_log(context, "%d matching objects\n", operation->num_handles);
+	goto out;
 
+fail:
+	session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -417,36 +503,45 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulObjectCount)	/* actual number returned */
 {
 	CK_RV rv;
-	CK_ULONG to_return;
+	CK_ULONG found = 0;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_find_operation *operation;
+	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_slot *slot;
 
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_FIND);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, (sc_pkcs11_operation_t **) & operation);
 	if (rv != CKR_OK)
 		goto out;
+	slot = session->slot;
 
-	to_return = (CK_ULONG) operation->num_handles - operation->current_handle;
-	if (to_return > ulMaxObjectCount)
-		to_return = ulMaxObjectCount;
-
-	*pulObjectCount = to_return;
-
-	memcpy(phObject, &operation->handles[operation->current_handle], to_return * sizeof(CK_OBJECT_HANDLE));
+	/* Match the candidates left until the caller has what it asked for.
+	 * Objects destroyed since C_FindObjectsInit() are skipped. */
+	while (found < ulMaxObjectCount) {
+		if (operation->use_index) {
+			if (operation->current_handle >= operation->num_handles)
+				break;
+			if (slot_get_object(slot, operation->handles[operation->current_handle++], &object) != CKR_OK)
+				continue;
+		}
+		else {
+			if (operation->next_object >= vector_size(&slot->objects))
+				break;
+			object = (struct sc_pkcs11_object *) vector_get(&slot->objects, operation->next_object++);
+		}
+		if (find_match_object(session, operation, object))
+			phObject[found++] = object->handle;
+	}
 
-	operation->current_handle += to_return;
+	*pulObjectCount = found;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -457,19 +552,15 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_FIND);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, NULL);
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -487,17 +578,15 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DIGEST);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_init(session, pMechanism);
+	rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -512,21 +601,16 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DIGEST);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
 
-	rv = sc_pkcs11_md_update(session, pData, ulDataLen);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_digest(session, pData, ulDataLen, pDigest, pulDigestLen);
 
-out:	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -539,16 +623,14 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DIGEST);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -569,16 +651,14 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DIGEST);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -599,11 +679,11 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SIGN);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -630,7 +710,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -646,14 +726,10 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SIGN);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -674,7 +750,65 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
+	return rv;
+}
+
+
+CK_RV
+C_OpenSC_SignBatch(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
+		CK_OBJECT_HANDLE hKey,		/* handle of the signature key */
+		CK_BYTE_PTR pData,		/* the digests to be signed */
+		CK_ULONG ulDataLen,		/* length of each digest */
+		CK_ULONG ulCount,		/* number of digests */
+		CK_BYTE_PTR pSignature,		/* receives the signatures */
+		CK_ULONG ulSignatureLen,	/* room for each signature */
+		CK_ULONG_PTR pulSignatureLen)	/* receives the signature lengths */
+{
+	CK_BBOOL can_sign;
+	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+
+	if (pMechanism == NULL_PTR || (ulCount
+			&& (pData == NULL_PTR || pSignature == NULL_PTR || pulSignatureLen == NULL_PTR)))
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SIGN);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (session_get_operation(session, SC_PKCS11_OPERATION_SIGN, NULL) == CKR_OK) {
+		rv = CKR_OPERATION_ACTIVE;
+		goto out;
+	}
+
+	rv = get_object_from_session(session, hKey, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	if (object->ops->sign_batch == NULL_PTR) {
+		rv = object->ops->sign ? CKR_FUNCTION_NOT_SUPPORTED : CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = object->ops->get_attribute(session, object, &sign_attribute);
+	if (rv != CKR_OK || !can_sign) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = object->ops->sign_batch(session, object, pMechanism, pData, ulDataLen, ulCount,
+			pSignature, ulSignatureLen, pulSignatureLen);
+
+out:
+	sc_log(context, "C_OpenSC_SignBatch(%lu) = %s", ulCount, lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -687,16 +821,14 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SIGN);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -710,14 +842,10 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SIGN);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -735,7 +863,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -759,11 +887,11 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SIGN);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -794,7 +922,7 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_SignRecoverInit() = %sn", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -815,7 +943,49 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of encryption key */
 {
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_BBOOL can_encrypt;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE encrypt_attribute = { CKA_ENCRYPT, &can_encrypt, sizeof(can_encrypt) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(session, hKey, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	rv = object->ops->get_attribute(session, object, &encrypt_attribute);
+	if (rv != CKR_OK || !can_encrypt) {
+		rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
+
+out:
+	sc_log(context, "C_EncryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 
@@ -825,7 +995,25 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
 		CK_ULONG_PTR pulEncryptedDataLen)
 {				/* receives encrypted byte count */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	if (pulEncryptedDataLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_encr(session, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+
+	sc_log(context, "C_Encrypt() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -834,14 +1022,51 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 		      CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	if (pulEncryptedPartLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_encr_update(session, pPart, ulPartLen,
+			pEncryptedPart, pulEncryptedPartLen);
+
+	sc_log(context, "C_EncryptUpdate() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastEncryptedPart,	/* receives encrypted last part */
 		     CK_ULONG_PTR pulLastEncryptedPartLen)
 {				/* receives byte count */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	if (pulLastEncryptedPartLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_encr_final(session, pLastEncryptedPart, pulLastEncryptedPartLen);
+
+	sc_log(context, "C_EncryptFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -860,22 +1085,17 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DECRYPT);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
 		goto out;
 	}
 
-	if (object->ops->decrypt == NULL_PTR) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto out;
-	}
-
 	rv = object->ops->get_attribute(session, object, &decrypt_attribute);
 	if (rv != CKR_OK || !can_decrypt) {
 		/* Also accept UNWRAP - apps call Decrypt when they mean Unwrap */
@@ -894,7 +1114,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -907,17 +1127,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DECRYPT);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
-				pData, pulDataLen);
+	rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -927,14 +1145,43 @@ CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pPart,	/* receives decrypted output */
 		      CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	if (pulPartLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DECRYPT);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_decr_update(session, pEncryptedPart, ulEncryptedPartLen,
+			pPart, pulPartLen);
+
+	sc_log(context, "C_DecryptUpdate() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastPart,	/* receives decrypted output */
 		     CK_ULONG_PTR pulLastPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	if (pulLastPartLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DECRYPT);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_decr_final(session, pLastPart, pulLastPartLen);
+
+	sc_log(context, "C_DecryptFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1000,16 +1247,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_GENERATE);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
 
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
@@ -1026,7 +1270,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 				phPublicKey, phPrivateKey);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1038,7 +1282,94 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pWrappedKey,	/* receives the wrapped key */
 		CK_ULONG_PTR pulWrappedKeyLen)
 {				/* receives byte size of wrapped key */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_BBOOL can_wrap, extractable, sensitive, trusted;
+	CK_KEY_TYPE key_type;
+	CK_OBJECT_CLASS key_class;
+	CK_ATTRIBUTE wrap_attribute = { CKA_WRAP, &can_wrap, sizeof(can_wrap) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	CK_ATTRIBUTE class_attr = { CKA_CLASS, &key_class, sizeof(key_class) };
+	CK_ATTRIBUTE extractable_attr = { CKA_EXTRACTABLE, &extractable, sizeof(extractable) };
+	CK_ATTRIBUTE sensitive_attr = { CKA_SENSITIVE, &sensitive, sizeof(sensitive) };
+	CK_ATTRIBUTE trusted_attr = { CKA_TRUSTED, &trusted, sizeof(trusted) };
+	CK_ATTRIBUTE value_attr = { CKA_VALUE, NULL, 0 };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *wrapping_key, *key;
+	CK_RV rv;
+
+	if (pMechanism == NULL_PTR || pulWrappedKeyLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(session, hWrappingKey, &wrapping_key);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_WRAPPING_KEY_HANDLE_INVALID;
+		goto out;
+	}
+	rv = wrapping_key->ops->get_attribute(session, wrapping_key, &wrap_attribute);
+	if (rv != CKR_OK || !can_wrap) {
+		rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+		goto out;
+	}
+	rv = wrapping_key->ops->get_attribute(session, wrapping_key, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_WRAPPING_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	/* Only the value of an extractable secret key can be wrapped, of a
+	 * sensitive one only with a trusted wrapping key. What cannot be
+	 * read counts as the restrictive value. */
+	rv = get_object_from_session(session, hKey, &key);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+	rv = key->ops->get_attribute(session, key, &class_attr);
+	if (rv != CKR_OK || key_class != CKO_SECRET_KEY) {
+		rv = CKR_KEY_NOT_WRAPPABLE;
+		goto out;
+	}
+	if (key->ops->get_attribute(session, key, &extractable_attr) != CKR_OK || !extractable) {
+		rv = CKR_KEY_UNEXTRACTABLE;
+		goto out;
+	}
+	if ((key->ops->get_attribute(session, key, &sensitive_attr) != CKR_OK || sensitive)
+			&& (wrapping_key->ops->get_attribute(session, wrapping_key, &trusted_attr) != CKR_OK
+				|| !trusted)) {
+		rv = CKR_KEY_NOT_WRAPPABLE;
+		goto out;
+	}
+	rv = key->ops->get_attribute(session, key, &value_attr);
+	if (rv != CKR_OK || value_attr.ulValueLen == 0) {
+		rv = CKR_KEY_NOT_WRAPPABLE;
+		goto out;
+	}
+	value_attr.pValue = calloc(1, value_attr.ulValueLen);
+	if (value_attr.pValue == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	rv = key->ops->get_attribute(session, key, &value_attr);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_wrap(session, pMechanism, wrapping_key, key_type,
+				value_attr.pValue, value_attr.ulValueLen,
+				pWrappedKey, pulWrappedKeyLen);
+	sc_mem_clear(value_attr.pValue, value_attr.ulValueLen);
+	free(value_attr.pValue);
+
+out:
+	sc_log(context, "C_WrapKey() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1074,11 +1405,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_DERIVE);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(session, hBaseKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1107,11 +1438,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	switch(key_type) {
 	    case CKK_EC:
 
-		rv = sc_create_object_int(hSession, pTemplate, ulAttributeCount, phKey, 0);
+		rv = sc_create_object_int(session, pTemplate, ulAttributeCount, phKey);
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+		rv = get_object_from_session(session, *phKey, &key_object);
 		if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1128,7 +1459,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1147,20 +1478,17 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_GENERATE);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		slot = session->slot;
-		if (slot->card->framework->get_random == NULL)
-			rv = CKR_RANDOM_NO_RNG;
-		else
-			rv = slot->card->framework->get_random(slot, RandomData, ulRandomLen);
-	}
+	slot = session->slot;
+	if (slot->card->framework->get_random == NULL)
+		rv = CKR_RANDOM_NO_RNG;
+	else
+		rv = slot->card->framework->get_random(slot, RandomData, ulRandomLen);
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1190,12 +1518,11 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
 	if (rv != CKR_OK)
 		return rv;
 
-
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1210,7 +1537,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1227,20 +1554,16 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
-out:	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1255,16 +1578,14 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1279,16 +1600,14 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_VERIFY);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
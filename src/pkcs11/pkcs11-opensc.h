@@ -9,4 +9,189 @@
  */
 #define CKA_OPENSC_NON_REPUDIATION      (CKA_VENDOR_DEFINED | 1UL)
 
+/*
+ * Card traffic caused by the PKCS#11 calls of a session or a slot,
+ * by kind of call, as returned by C_OpenSC_GetOperationStats().
+ */
+#define CK_OPENSC_OP_SESSION		0	/* C_GetSessionInfo */
+#define CK_OPENSC_OP_LOGIN		1	/* C_Login, C_Logout, C_InitPIN, C_SetPIN */
+#define CK_OPENSC_OP_OBJECT		2	/* C_CreateObject, C_DestroyObject, C_SetAttributeValue */
+#define CK_OPENSC_OP_ATTRIBUTE		3	/* C_GetAttributeValue */
+#define CK_OPENSC_OP_FIND		4	/* C_FindObjects* */
+#define CK_OPENSC_OP_DIGEST		5	/* C_Digest* */
+#define CK_OPENSC_OP_SIGN		6	/* C_Sign* */
+#define CK_OPENSC_OP_VERIFY		7	/* C_Verify*, C_Encrypt*, C_WrapKey */
+#define CK_OPENSC_OP_DECRYPT		8	/* C_Decrypt* */
+#define CK_OPENSC_OP_GENERATE		9	/* C_GenerateKeyPair, C_GenerateRandom */
+#define CK_OPENSC_OP_DERIVE		10	/* C_DeriveKey */
+#define CK_OPENSC_OP_COUNT		11
+
+typedef struct CK_OPENSC_OPERATION_STATS {
+	CK_ULONG calls;
+	CK_ULONG apdus;
+	CK_ULONG bytes_sent;
+	CK_ULONG bytes_received;
+	CK_ULONG card_usec;		/* time spent in the reader driver */
+	CK_ULONG selects;		/* SELECT FILE commands */
+	CK_ULONG get_responses;		/* GET RESPONSE commands */
+} CK_OPENSC_OPERATION_STATS;
+
+typedef CK_OPENSC_OPERATION_STATS * CK_OPENSC_OPERATION_STATS_PTR;
+
+/*
+ * Returns the statistics of the session hSession, or of the slot slotID
+ * when hSession is CK_INVALID_HANDLE, into pStats[0..ulCount-1], indexed
+ * by CK_OPENSC_OP_*. With reset set, the counters are zeroed afterwards.
+ */
+typedef CK_RV (*CK_C_OpenSC_GetOperationStats)(CK_SLOT_ID slotID,
+		CK_SESSION_HANDLE hSession, CK_OPENSC_OPERATION_STATS_PTR pStats,
+		CK_ULONG ulCount, CK_BBOOL reset);
+
+/*
+ * Contention on the global lock of the module, as returned by
+ * C_OpenSC_GetLockStats(). Waits of at least 1 ms count as contended and
+ * are charged to the function that held the lock, up to
+ * CK_OPENSC_LOCK_HOLDERS distinct functions. Bucket i of the histograms
+ * counts the waits or holds shorter than 2^(i+7) microseconds, the last
+ * bucket the longer ones.
+ */
+#define CK_OPENSC_LOCK_BUCKETS		16
+#define CK_OPENSC_LOCK_HOLDERS		16
+
+typedef struct CK_OPENSC_LOCK_HOLDER {
+	CK_UTF8CHAR function[32];	/* NUL terminated, e.g. "C_Login" */
+	CK_ULONG waits;			/* contended waits behind it */
+	CK_ULONG wait_usec;
+} CK_OPENSC_LOCK_HOLDER;
+
+typedef struct CK_OPENSC_LOCK_STATS {
+	CK_ULONG acquired;
+	CK_ULONG contended;
+	CK_ULONG wait_usec;
+	CK_ULONG max_wait_usec;
+	CK_ULONG hold_usec;
+	CK_ULONG max_hold_usec;
+	CK_ULONG wait_histogram[CK_OPENSC_LOCK_BUCKETS];
+	CK_ULONG hold_histogram[CK_OPENSC_LOCK_BUCKETS];
+	CK_OPENSC_LOCK_HOLDER holders[CK_OPENSC_LOCK_HOLDERS];
+} CK_OPENSC_LOCK_STATS;
+
+typedef CK_OPENSC_LOCK_STATS * CK_OPENSC_LOCK_STATS_PTR;
+
+/*
+ * Returns the statistics of the global lock. With reset set, the
+ * counters are zeroed afterwards. The wait and hold times of the card
+ * and of the PC/SC transactions are in the reader statistics of
+ * libopensc, see sc_ctx_get_reader_stats().
+ */
+typedef CK_RV (*CK_C_OpenSC_GetLockStats)(CK_OPENSC_LOCK_STATS_PTR pStats,
+		CK_BBOOL reset);
+
+/*
+ * Heap use of the module and of libopensc, as returned by
+ * C_OpenSC_GetMemoryStats() and indexed by CK_OPENSC_MEM_*. The counters
+ * are per process; live and peak are in bytes, allocs, frees and bytes
+ * count since the first allocation or the last reset, usec microseconds.
+ */
+#define CK_OPENSC_MEM_ASN1		0
+#define CK_OPENSC_MEM_PKCS15		1
+#define CK_OPENSC_MEM_PKCS11_OBJECTS	2
+#define CK_OPENSC_MEM_PKCS11_SESSIONS	3
+#define CK_OPENSC_MEM_READER		4
+#define CK_OPENSC_MEM_SM		5
+#define CK_OPENSC_MEM_CACHE		6
+#define CK_OPENSC_MEM_COUNT		7
+
+typedef struct CK_OPENSC_MEMORY_STATS {
+	CK_ULONG live;
+	CK_ULONG peak;
+	CK_ULONG allocs;
+	CK_ULONG frees;
+	CK_ULONG bytes;
+	CK_ULONG usec;
+} CK_OPENSC_MEMORY_STATS;
+
+typedef CK_OPENSC_MEMORY_STATS * CK_OPENSC_MEMORY_STATS_PTR;
+
+/*
+ * Returns the memory statistics into pStats[0..ulCount-1]. With reset
+ * set, the counters restart from the memory in use.
+ */
+typedef CK_RV (*CK_C_OpenSC_GetMemoryStats)(CK_OPENSC_MEMORY_STATS_PTR pStats,
+		CK_ULONG ulCount, CK_BBOOL reset);
+
+/*
+ * Reads opensc.conf again and applies it without C_Finalize(): the
+ * debug level, module levels and file (see sc_ctx_reload_config()),
+ * the card and reader driver options and the PKCS#15 cache and PIN
+ * cache options of the tokens present. Sessions
+ * and logins are kept. Reader transfer sizes apply from the next
+ * connect; the options of the pkcs11 framework block and use_file_cache
+ * need the module to be initialized again.
+ */
+typedef CK_RV (*CK_C_OpenSC_ReloadConfig)(void);
+
+/*
+ * Signs ulCount inputs of ulDataLen bytes each, stored back to back in
+ * pData, with the key hKey. The token is kept locked and the security
+ * environment is set once for the whole batch. Signature i is written
+ * to pSignature + i * ulSignatureLen and its length to pulSignatureLen[i].
+ * Only mechanisms that sign an already computed digest are accepted
+ * (CKM_RSA_PKCS, CKM_RSA_X_509, CKM_ECDSA, CKM_GOSTR3410). No sign
+ * operation may be active in the session.
+ */
+typedef CK_RV (*CK_C_OpenSC_SignBatch)(CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_ULONG ulCount,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+		CK_ULONG_PTR pulSignatureLen);
+
+/*
+ * Asynchronous operations. C_OpenSC_SubmitOperation() queues a sign,
+ * decrypt or derive operation on a session and returns at once. The
+ * operations on one card run one after the other in submission order,
+ * those on different cards in parallel, each card by a worker thread of
+ * the module. The operation structure must stay valid until completion.
+ *
+ * On completion rv, ulOutputLen and, for CK_OPENSC_ASYNC_DERIVE,
+ * hDerivedKey are filled in. If notify is set, it is called from the
+ * worker thread. Otherwise the operation is handed out again by
+ * C_OpenSC_ReapOperations(); the descriptor from
+ * C_OpenSC_GetCompletionFd() is readable as long as there are
+ * operations to reap. Operations still queued at C_Finalize() complete
+ * with CKR_FUNCTION_CANCELED.
+ */
+#define CK_OPENSC_ASYNC_SIGN		1	/* C_SignInit + C_Sign */
+#define CK_OPENSC_ASYNC_DECRYPT		2	/* C_DecryptInit + C_Decrypt */
+#define CK_OPENSC_ASYNC_DERIVE		3	/* C_DeriveKey */
+
+struct CK_OPENSC_ASYNC_OPERATION;
+
+typedef void (*CK_OPENSC_ASYNC_NOTIFY)(struct CK_OPENSC_ASYNC_OPERATION *pOperation);
+
+typedef struct CK_OPENSC_ASYNC_OPERATION {
+	CK_ULONG type;			/* CK_OPENSC_ASYNC_* */
+	CK_MECHANISM_PTR pMechanism;
+	CK_OBJECT_HANDLE hKey;
+	CK_BYTE_PTR pInput;		/* sign, decrypt */
+	CK_ULONG ulInputLen;
+	CK_BYTE_PTR pOutput;		/* sign, decrypt: must not be NULL */
+	CK_ULONG ulOutputLen;		/* room in pOutput, then the length */
+	CK_ATTRIBUTE_PTR pTemplate;	/* derive */
+	CK_ULONG ulAttributeCount;
+	CK_OBJECT_HANDLE hDerivedKey;
+	CK_RV rv;
+	CK_OPENSC_ASYNC_NOTIFY notify;
+	CK_VOID_PTR pApplication;	/* for the caller, left alone */
+} CK_OPENSC_ASYNC_OPERATION;
+
+typedef CK_OPENSC_ASYNC_OPERATION * CK_OPENSC_ASYNC_OPERATION_PTR;
+
+typedef CK_RV (*CK_C_OpenSC_SubmitOperation)(CK_SESSION_HANDLE hSession,
+		CK_OPENSC_ASYNC_OPERATION_PTR pOperation);
+typedef CK_RV (*CK_C_OpenSC_GetCompletionFd)(int *pFd);
+/* Hands out up to ulMaxCount completed operations, *pulCount of them */
+typedef CK_RV (*CK_C_OpenSC_ReapOperations)(CK_OPENSC_ASYNC_OPERATION_PTR *ppOperations,
+		CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount);
+
 #endif
@@ -26,9 +26,21 @@
 
 #include "sc-pkcs11.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+
+/* card_detect_all() may close the sessions of several readers at once */
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define sessions_lock()		pthread_mutex_lock(&sessions_mutex)
+#define sessions_unlock()	pthread_mutex_unlock(&sessions_mutex)
+#else
+#define sessions_lock()
+#define sessions_unlock()
+#endif
+
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = handle_table_get(&session_handles, hSession, NULL);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -71,14 +83,27 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
+	sc_mem_account_alloc(SC_MEM_PKCS11_SESSIONS, sizeof(struct sc_pkcs11_session));
 
 	session->slot = slot;
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
+	session->balanced = (slotID == SC_PKCS11_BALANCE_SLOT_ID && sc_pkcs11_conf.load_balance_label);
+	rv = handle_table_add(&session_handles, session, NULL, &session->handle);
+	if (rv != CKR_OK) {
+		sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, sizeof(struct sc_pkcs11_session));
+		free(session);
+		goto out;
+	}
 	slot->nsessions++;
-	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
-	list_append(&sessions, session);
+	sessions_lock();
+	session->next = sessions.first;
+	if (sessions.first)
+		sessions.first->prev = session;
+	sessions.first = session;
+	sessions.count++;
+	sessions_unlock();
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
 
@@ -97,22 +122,40 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session)
+	/* Take the session off the list first, so that it is closed once */
+	sessions_lock();
+	session = handle_table_get(&session_handles, hSession, NULL);
+	if (!session) {
+		sessions_unlock();
 		return CKR_SESSION_HANDLE_INVALID;
+	}
+	if (session->prev)
+		session->prev->next = session->next;
+	else
+		sessions.first = session->next;
+	if (session->next)
+		session->next->prev = session->prev;
+	sessions.count--;
+	handle_table_remove(&session_handles, hSession);
+	sessions_unlock();
+
+	/* Wait for a call in progress on the session's token */
+	slot = session->slot;
+	sc_pkcs11_lock_slot(slot);
 
 	/* If we're the last session using this slot, make sure
 	 * we log out */
-	slot = session->slot;
 	slot->nsessions--;
-	if (slot->nsessions == 0 && slot->login_user >= 0) {
+	if (slot->nsessions == 0 && slot->login_user >= 0 && !slot_keep_shared_login(slot)) {
 		slot->login_user = -1;
 		slot->card->framework->logout(slot);
 	}
 
-	if (list_delete(&sessions, session) != 0)
-		sc_log(context, "Could not delete session from list!");
+	session_release_operations(session);
+	sc_mem_account_free(SC_MEM_PKCS11_SESSIONS, sizeof(struct sc_pkcs11_session));
 	free(session);
+
+	sc_pkcs11_unlock_slot(slot);
 	return CKR_OK;
 }
 
@@ -120,15 +163,28 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
  * the global lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
-	CK_RV rv = CKR_OK;
+	CK_RV rv;
 	struct sc_pkcs11_session *session;
-	unsigned int i;
-	sc_log(context, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
-		session = list_get_at(&sessions, i);
-		if (session->slot->id == slotID)
-			if ((rv = sc_pkcs11_close_session(session->handle)) != CKR_OK)
-				return rv;
+	CK_SESSION_HANDLE hSession;
+
+	sc_log(context, "real C_CloseAllSessions(0x%lx) %u", slotID, sessions.count);
+	for (;;) {
+		/* Other readers' sessions may be closed meanwhile, look again each time */
+		hSession = CK_INVALID_HANDLE;
+		sessions_lock();
+		for (session = sessions.first; session != NULL; session = session->next) {
+			if (session->slot->id == slotID || (session->balanced && slotID == SC_PKCS11_BALANCE_SLOT_ID)) {
+				hSession = session->handle;
+				break;
+			}
+		}
+		sessions_unlock();
+		if (hSession == CK_INVALID_HANDLE)
+			break;
+		/* Another thread may have closed it since */
+		rv = sc_pkcs11_close_session(hSession);
+		if (rv != CKR_OK && rv != CKR_SESSION_HANDLE_INVALID)
+			return rv;
 	}
 	return CKR_OK;
 }
@@ -180,20 +236,14 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_SESSION);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
-	pInfo->slotID = session->slot->id;
+	pInfo->slotID = session->balanced ? SC_PKCS11_BALANCE_SLOT_ID : session->slot->id;
 	pInfo->flags = session->flags;
 	pInfo->ulDeviceError = 0;
 
@@ -208,9 +258,8 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
 	}
 
-out:
 	sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -238,11 +287,12 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	int balanced = 0, shared = 0;
 
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_LOGIN);
 	if (rv != CKR_OK)
 		return rv;
 
@@ -250,11 +300,6 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
 
 	sc_log(context, "C_Login(0x%lx, %d)", hSession, userType);
 
@@ -288,12 +333,21 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		sc_log(context, "C_Login() userType %li", userType);
 		rv = slot->card->framework->login(slot, userType, pPin, ulPinLen);
 		sc_log(context, "fLogin() rv %li", rv);
-		if (rv == CKR_OK)
+		if (rv == CKR_OK) {
 			slot->login_user = userType;
+			balanced = session->balanced;
+			shared = userType == CKU_USER;
+		}
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
+	/* One VERIFY serves the slots with the same user PIN */
+	if (shared)
+		slot_share_login(slot, pPin, ulPinLen);
+	/* The next sessions on the balance slot may land on any member */
+	if (balanced)
+		slot_balance_login(slot, userType, pPin, ulPinLen);
 	return rv;
 }
 
@@ -302,28 +356,30 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	int balanced, shared = 0;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_LOGIN);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
 	slot = session->slot;
+	balanced = session->balanced;
 
 	if (slot->login_user >= 0) {
+		shared = slot->login_user == CKU_USER;
 		slot->login_user = -1;
 		rv = slot->card->framework->logout(slot);
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
+	/* The card forgot the PIN for all the slots using it */
+	if (shared)
+		slot_share_logout(slot);
+	if (balanced)
+		slot_balance_logout(slot);
 	return rv;
 }
 
@@ -337,16 +393,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_LOGIN);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -363,7 +413,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -377,16 +427,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session, CK_OPENSC_OP_LOGIN);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
@@ -397,6 +441,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 
 	rv = slot->card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
@@ -49,6 +49,13 @@ static CK_FUNCTION_LIST_PTR po = NULL;
 static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
+/* Only collect statistics, see init_spy_stats() */
+static int spy_stats_enabled = 0;
+/* Log buffers and attributes by address and length, without formatting
+ * their values */
+static int spy_brief = 0;
+
+static void init_spy_stats(void);
 
 /* Inits the spy. If successfull, po != NULL */
 static CK_RV
@@ -224,6 +231,12 @@ init_spy(void)
 	modhandle = C_LoadModule(module, &po);
 	if (modhandle && po) {
 		fprintf(spy_output, "Loaded: \"%s\"\n", module);
+		if (getenv("PKCS11SPY_STATS") && atoi(getenv("PKCS11SPY_STATS"))) {
+			spy_stats_enabled = 1;
+			init_spy_stats();
+		}
+		if (getenv("PKCS11SPY_BRIEF") && atoi(getenv("PKCS11SPY_BRIEF")))
+			spy_brief = 1;
 	}
 	else {
 		po = NULL;
@@ -270,18 +283,27 @@ retne(CK_RV rv)
 }
 
 
+static void
+spy_dump_string(CK_VOID_PTR data, CK_ULONG size)
+{
+	if (spy_brief)
+		fprintf(spy_output, "%p / %ld\n", data, (CK_LONG) size);
+	else
+		print_generic(spy_output, 0, data, size, NULL);
+}
+
 static void
 spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
 	fprintf(spy_output, "[in] %s ", name);
-	print_generic(spy_output, 0, data, size, NULL);
+	spy_dump_string(data, size);
 }
 
 static void
 spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
 	fprintf(spy_output, "[out] %s ", name);
-	print_generic(spy_output, 0, data, size, NULL);
+	spy_dump_string(data, size);
 }
 
 static void
@@ -321,7 +343,10 @@ spy_attribute_list_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
-	print_attribute_list(spy_output, pTemplate, ulCount);
+	if (spy_brief)
+		print_attribute_list_req(spy_output, pTemplate, ulCount);
+	else
+		print_attribute_list(spy_output, pTemplate, ulCount);
 }
 
 static void
@@ -329,7 +354,10 @@ spy_attribute_list_out(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, ulCount);
-	print_attribute_list(spy_output, pTemplate, ulCount);
+	if (spy_brief)
+		print_attribute_list_req(spy_output, pTemplate, ulCount);
+	else
+		print_attribute_list(spy_output, pTemplate, ulCount);
 }
 
 static void
@@ -338,6 +366,404 @@ print_ptr_in(const char *name, CK_VOID_PTR ptr)
  	fprintf(spy_output, "[in] %s = %p\n", name, ptr);
 }
 
+/*
+ * Statistics mode, enabled with PKCS11SPY_STATS=1: instead of logging
+ * each call, C_GetFunctionList() hands out thin wrappers that count the
+ * calls, errors and latency of each function. The summary is written at
+ * C_Finalize(), and every PKCS11SPY_STATS_INTERVAL seconds if set.
+ */
+#define SPY_FUNCTIONS \
+	SPY_FUNCTION(C_Initialize, (CK_VOID_PTR pInitArgs), \
+		(pInitArgs)) \
+	SPY_FUNCTION(C_Finalize, (CK_VOID_PTR pReserved), \
+		(pReserved)) \
+	SPY_FUNCTION(C_GetInfo, (CK_INFO_PTR pInfo), \
+		(pInfo)) \
+	SPY_FUNCTION(C_GetSlotList, (CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, \
+		CK_ULONG_PTR pulCount), \
+		(tokenPresent, pSlotList, pulCount)) \
+	SPY_FUNCTION(C_GetSlotInfo, (CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo), \
+		(slotID, pInfo)) \
+	SPY_FUNCTION(C_GetTokenInfo, (CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo), \
+		(slotID, pInfo)) \
+	SPY_FUNCTION(C_GetMechanismList, (CK_SLOT_ID slotID, \
+		CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount), \
+		(slotID, pMechanismList, pulCount)) \
+	SPY_FUNCTION(C_GetMechanismInfo, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, \
+		CK_MECHANISM_INFO_PTR pInfo), \
+		(slotID, type, pInfo)) \
+	SPY_FUNCTION(C_InitToken, (CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, \
+		CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel), \
+		(slotID, pPin, ulPinLen, pLabel)) \
+	SPY_FUNCTION(C_InitPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, \
+		CK_ULONG ulPinLen), \
+		(hSession, pPin, ulPinLen)) \
+	SPY_FUNCTION(C_SetPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, \
+		CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen), \
+		(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen)) \
+	SPY_FUNCTION(C_OpenSession, (CK_SLOT_ID slotID, CK_FLAGS flags, \
+		CK_VOID_PTR pApplication, CK_NOTIFY Notify, \
+		CK_SESSION_HANDLE_PTR phSession), \
+		(slotID, flags, pApplication, Notify, phSession)) \
+	SPY_FUNCTION(C_CloseSession, (CK_SESSION_HANDLE hSession), \
+		(hSession)) \
+	SPY_FUNCTION(C_CloseAllSessions, (CK_SLOT_ID slotID), \
+		(slotID)) \
+	SPY_FUNCTION(C_GetSessionInfo, (CK_SESSION_HANDLE hSession, \
+		CK_SESSION_INFO_PTR pInfo), \
+		(hSession, pInfo)) \
+	SPY_FUNCTION(C_GetOperationState, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen), \
+		(hSession, pOperationState, pulOperationStateLen)) \
+	SPY_FUNCTION(C_SetOperationState, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, \
+		CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey), \
+		(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey)) \
+	SPY_FUNCTION(C_Login, (CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, \
+		CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen), \
+		(hSession, userType, pPin, ulPinLen)) \
+	SPY_FUNCTION(C_Logout, (CK_SESSION_HANDLE hSession), \
+		(hSession)) \
+	SPY_FUNCTION(C_CreateObject, (CK_SESSION_HANDLE hSession, \
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, \
+		CK_OBJECT_HANDLE_PTR phObject), \
+		(hSession, pTemplate, ulCount, phObject)) \
+	SPY_FUNCTION(C_CopyObject, (CK_SESSION_HANDLE hSession, \
+		CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, \
+		CK_OBJECT_HANDLE_PTR phNewObject), \
+		(hSession, hObject, pTemplate, ulCount, phNewObject)) \
+	SPY_FUNCTION(C_DestroyObject, (CK_SESSION_HANDLE hSession, \
+		CK_OBJECT_HANDLE hObject), \
+		(hSession, hObject)) \
+	SPY_FUNCTION(C_GetObjectSize, (CK_SESSION_HANDLE hSession, \
+		CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize), \
+		(hSession, hObject, pulSize)) \
+	SPY_FUNCTION(C_GetAttributeValue, (CK_SESSION_HANDLE hSession, \
+		CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount), \
+		(hSession, hObject, pTemplate, ulCount)) \
+	SPY_FUNCTION(C_SetAttributeValue, (CK_SESSION_HANDLE hSession, \
+		CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount), \
+		(hSession, hObject, pTemplate, ulCount)) \
+	SPY_FUNCTION(C_FindObjectsInit, (CK_SESSION_HANDLE hSession, \
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount), \
+		(hSession, pTemplate, ulCount)) \
+	SPY_FUNCTION(C_FindObjects, (CK_SESSION_HANDLE hSession, \
+		CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, \
+		CK_ULONG_PTR pulObjectCount), \
+		(hSession, phObject, ulMaxObjectCount, pulObjectCount)) \
+	SPY_FUNCTION(C_FindObjectsFinal, (CK_SESSION_HANDLE hSession), \
+		(hSession)) \
+	SPY_FUNCTION(C_EncryptInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), \
+		(hSession, pMechanism, hKey)) \
+	SPY_FUNCTION(C_Encrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, \
+		CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, \
+		CK_ULONG_PTR pulEncryptedDataLen), \
+		(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen)) \
+	SPY_FUNCTION(C_EncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, \
+		CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, \
+		CK_ULONG_PTR pulEncryptedPartLen), \
+		(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen)) \
+	SPY_FUNCTION(C_EncryptFinal, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen), \
+		(hSession, pLastEncryptedPart, pulLastEncryptedPartLen)) \
+	SPY_FUNCTION(C_DecryptInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), \
+		(hSession, pMechanism, hKey)) \
+	SPY_FUNCTION(C_Decrypt, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, \
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen), \
+		(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen)) \
+	SPY_FUNCTION(C_DecryptUpdate, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, \
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen), \
+		(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen)) \
+	SPY_FUNCTION(C_DecryptFinal, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen), \
+		(hSession, pLastPart, pulLastPartLen)) \
+	SPY_FUNCTION(C_DigestInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism), \
+		(hSession, pMechanism)) \
+	SPY_FUNCTION(C_Digest, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, \
+		CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen), \
+		(hSession, pData, ulDataLen, pDigest, pulDigestLen)) \
+	SPY_FUNCTION(C_DigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, \
+		CK_ULONG ulPartLen), \
+		(hSession, pPart, ulPartLen)) \
+	SPY_FUNCTION(C_DigestKey, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey), \
+		(hSession, hKey)) \
+	SPY_FUNCTION(C_DigestFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, \
+		CK_ULONG_PTR pulDigestLen), \
+		(hSession, pDigest, pulDigestLen)) \
+	SPY_FUNCTION(C_SignInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), \
+		(hSession, pMechanism, hKey)) \
+	SPY_FUNCTION(C_Sign, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, \
+		CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, \
+		CK_ULONG_PTR pulSignatureLen), \
+		(hSession, pData, ulDataLen, pSignature, pulSignatureLen)) \
+	SPY_FUNCTION(C_SignUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, \
+		CK_ULONG ulPartLen), \
+		(hSession, pPart, ulPartLen)) \
+	SPY_FUNCTION(C_SignFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, \
+		CK_ULONG_PTR pulSignatureLen), \
+		(hSession, pSignature, pulSignatureLen)) \
+	SPY_FUNCTION(C_SignRecoverInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), \
+		(hSession, pMechanism, hKey)) \
+	SPY_FUNCTION(C_SignRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, \
+		CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, \
+		CK_ULONG_PTR pulSignatureLen), \
+		(hSession, pData, ulDataLen, pSignature, pulSignatureLen)) \
+	SPY_FUNCTION(C_VerifyInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), \
+		(hSession, pMechanism, hKey)) \
+	SPY_FUNCTION(C_Verify, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, \
+		CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen), \
+		(hSession, pData, ulDataLen, pSignature, ulSignatureLen)) \
+	SPY_FUNCTION(C_VerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, \
+		CK_ULONG ulPartLen), \
+		(hSession, pPart, ulPartLen)) \
+	SPY_FUNCTION(C_VerifyFinal, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen), \
+		(hSession, pSignature, ulSignatureLen)) \
+	SPY_FUNCTION(C_VerifyRecoverInit, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), \
+		(hSession, pMechanism, hKey)) \
+	SPY_FUNCTION(C_VerifyRecover, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, \
+		CK_ULONG_PTR pulDataLen), \
+		(hSession, pSignature, ulSignatureLen, pData, pulDataLen)) \
+	SPY_FUNCTION(C_DigestEncryptUpdate, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, \
+		CK_ULONG_PTR pulEncryptedPartLen), \
+		(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen)) \
+	SPY_FUNCTION(C_DecryptDigestUpdate, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, \
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen), \
+		(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen)) \
+	SPY_FUNCTION(C_SignEncryptUpdate, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, \
+		CK_ULONG_PTR pulEncryptedPartLen), \
+		(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen)) \
+	SPY_FUNCTION(C_DecryptVerifyUpdate, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, \
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen), \
+		(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen)) \
+	SPY_FUNCTION(C_GenerateKey, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, \
+		CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey), \
+		(hSession, pMechanism, pTemplate, ulCount, phKey)) \
+	SPY_FUNCTION(C_GenerateKeyPair, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, \
+		CK_ULONG ulPublicKeyAttributeCount, \
+		CK_ATTRIBUTE_PTR pPrivateKeyTemplate, \
+		CK_ULONG ulPrivateKeyAttributeCount, CK_OBJECT_HANDLE_PTR phPublicKey, \
+		CK_OBJECT_HANDLE_PTR phPrivateKey), \
+		(hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, \
+		pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey)) \
+	SPY_FUNCTION(C_WrapKey, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hWrappingKey, \
+		CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey, \
+		CK_ULONG_PTR pulWrappedKeyLen), \
+		(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen)) \
+	SPY_FUNCTION(C_UnwrapKey, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hUnwrappingKey, \
+		CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen, \
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, \
+		CK_OBJECT_HANDLE_PTR phKey), \
+		(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, \
+		pTemplate, ulAttributeCount, phKey)) \
+	SPY_FUNCTION(C_DeriveKey, (CK_SESSION_HANDLE hSession, \
+		CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey, \
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, \
+		CK_OBJECT_HANDLE_PTR phKey), \
+		(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey)) \
+	SPY_FUNCTION(C_SeedRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, \
+		CK_ULONG ulSeedLen), \
+		(hSession, pSeed, ulSeedLen)) \
+	SPY_FUNCTION(C_GenerateRandom, (CK_SESSION_HANDLE hSession, \
+		CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen), \
+		(hSession, RandomData, ulRandomLen)) \
+	SPY_FUNCTION(C_GetFunctionStatus, (CK_SESSION_HANDLE hSession), \
+		(hSession)) \
+	SPY_FUNCTION(C_CancelFunction, (CK_SESSION_HANDLE hSession), \
+		(hSession)) \
+	SPY_FUNCTION(C_WaitForSlotEvent, (CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, \
+		CK_VOID_PTR pRserved), \
+		(flags, pSlot, pRserved))
+
+#define SPY_LATENCY_BUCKETS	20	/* < 1us, < 2us, ..., >= 2^18us */
+#define SPY_ERROR_CODES		4	/* distinct error codes kept per function */
+
+#ifdef __GNUC__
+#define SPY_ADD(var, n)		__sync_fetch_and_add(&(var), (n))
+#else
+#define SPY_ADD(var, n)		((var) += (n))
+#endif
+
+enum {
+#define SPY_FUNCTION(name, params, args) SPY_##name,
+	SPY_FUNCTIONS
+#undef SPY_FUNCTION
+	SPY_FUNCTION_COUNT
+};
+
+static const char *spy_function_names[SPY_FUNCTION_COUNT] = {
+#define SPY_FUNCTION(name, params, args) #name,
+	SPY_FUNCTIONS
+#undef SPY_FUNCTION
+};
+
+struct spy_function_stats {
+	unsigned long calls;
+	unsigned long long total_usec;
+	unsigned long max_usec;
+	unsigned long histogram[SPY_LATENCY_BUCKETS];
+	struct {
+		CK_RV rv;
+		unsigned long count;
+	} errors[SPY_ERROR_CODES];
+	unsigned long other_errors;
+};
+
+static struct spy_function_stats spy_stats[SPY_FUNCTION_COUNT];
+static unsigned long spy_stats_interval = 0;	/* seconds, 0: at C_Finalize only */
+static unsigned long long spy_stats_next = 0;
+
+static unsigned long long
+spy_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long long) (now.QuadPart / (freq.QuadPart / 1000000));
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void
+spy_stats_report(void)
+{
+	int i, j;
+
+	fprintf(spy_output, "\n*************** PKCS#11 spy statistics *****************\n");
+	fprintf(spy_output, "%-24s %10s %10s %10s %10s\n", "Function", "Calls", "Errors", "Avg(us)", "Max(us)");
+	for (i = 0; i < SPY_FUNCTION_COUNT; i++) {
+		struct spy_function_stats *st = &spy_stats[i];
+		unsigned long errors = st->other_errors;
+
+		if (st->calls == 0)
+			continue;
+		for (j = 0; j < SPY_ERROR_CODES; j++)
+			errors += st->errors[j].count;
+		fprintf(spy_output, "%-24s %10lu %10lu %10llu %10lu\n", spy_function_names[i],
+			st->calls, errors, st->total_usec / st->calls, st->max_usec);
+		for (j = 0; j < SPY_ERROR_CODES; j++)
+			if (st->errors[j].count)
+				fprintf(spy_output, "    %s: %lu\n",
+					lookup_enum(RV_T, st->errors[j].rv), st->errors[j].count);
+		if (st->other_errors)
+			fprintf(spy_output, "    other errors: %lu\n", st->other_errors);
+		fprintf(spy_output, "    latency:");
+		for (j = 0; j < SPY_LATENCY_BUCKETS; j++) {
+			if (st->histogram[j] == 0)
+				continue;
+			if (j < SPY_LATENCY_BUCKETS - 1)
+				fprintf(spy_output, " <%luus:%lu", 1UL << j, st->histogram[j]);
+			else
+				fprintf(spy_output, " >=%luus:%lu", 1UL << (j - 1), st->histogram[j]);
+		}
+		fprintf(spy_output, "\n");
+	}
+	fflush(spy_output);
+}
+
+static void
+spy_stats_account(int fn, CK_RV rv, unsigned long long start)
+{
+	struct spy_function_stats *st = &spy_stats[fn];
+	unsigned long long end = spy_now();
+	unsigned long usec = (unsigned long) (end - start);
+	int i;
+
+	SPY_ADD(st->calls, 1);
+	SPY_ADD(st->total_usec, usec);
+	if (usec > st->max_usec)
+		st->max_usec = usec;
+	for (i = 0; i < SPY_LATENCY_BUCKETS - 1 && usec >= (1UL << i); i++)
+		;
+	SPY_ADD(st->histogram[i], 1);
+
+	if (rv != CKR_OK) {
+		for (i = 0; i < SPY_ERROR_CODES; i++) {
+			if (st->errors[i].rv == CKR_OK) {
+#ifdef __GNUC__
+				__sync_bool_compare_and_swap(&st->errors[i].rv, CKR_OK, rv);
+#else
+				st->errors[i].rv = rv;
+#endif
+			}
+			if (st->errors[i].rv == rv) {
+				SPY_ADD(st->errors[i].count, 1);
+				break;
+			}
+		}
+		if (i == SPY_ERROR_CODES)
+			SPY_ADD(st->other_errors, 1);
+	}
+
+	if (fn == SPY_C_Finalize) {
+		spy_stats_report();
+	}
+	else if (spy_stats_interval && end >= spy_stats_next) {
+		spy_stats_next = end + spy_stats_interval * 1000000ULL;
+		spy_stats_report();
+	}
+}
+
+#define SPY_FUNCTION(name, params, args) \
+static CK_RV stats_##name params \
+{ \
+	unsigned long long start = spy_now(); \
+	CK_RV rv = po->name args; \
+	spy_stats_account(SPY_##name, rv, start); \
+	return rv; \
+}
+SPY_FUNCTIONS
+#undef SPY_FUNCTION
+
+static CK_FUNCTION_LIST spy_stats_list;
+
+static void
+init_spy_stats(void)
+{
+	const char *interval = getenv("PKCS11SPY_STATS_INTERVAL");
+
+	spy_stats_list.version = pkcs11_spy->version;
+	spy_stats_list.C_GetFunctionList = C_GetFunctionList;
+#define SPY_FUNCTION(name, params, args) spy_stats_list.name = stats_##name;
+	SPY_FUNCTIONS
+#undef SPY_FUNCTION
+
+	if (interval)
+		spy_stats_interval = strtoul(interval, NULL, 10);
+	spy_stats_next = spy_now() + spy_stats_interval * 1000000ULL;
+}
+
 CK_RV C_GetFunctionList
 (CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 {
@@ -347,6 +773,11 @@ CK_RV C_GetFunctionList
 			return rv;
 	}
 
+	if (spy_stats_enabled) {
+		*ppFunctionList = &spy_stats_list;
+		return CKR_OK;
+	}
+
 	enter("C_GetFunctionList");
 	*ppFunctionList = pkcs11_spy;
 	return retne(CKR_OK);
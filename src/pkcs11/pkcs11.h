@@ -551,6 +551,7 @@ typedef unsigned long ck_mechanism_type_t;
 #define CKM_SHA256			(0x250UL)
 #define CKM_SHA256_HMAC			(0x251UL)
 #define CKM_SHA256_HMAC_GENERAL		(0x252UL)
+#define CKM_SHA224			(0x255UL)
 #define CKM_SHA384			(0x260UL)
 #define CKM_SHA384_HMAC			(0x261UL)
 #define CKM_SHA384_HMAC_GENERAL		(0x262UL)
@@ -655,6 +656,10 @@ typedef unsigned long ck_mechanism_type_t;
 #define CKM_EC_KEY_PAIR_GEN		(0x1040UL)
 #define CKM_ECDSA			(0x1041UL)
 #define CKM_ECDSA_SHA1			(0x1042UL)
+#define CKM_ECDSA_SHA224		(0x1043UL)
+#define CKM_ECDSA_SHA256		(0x1044UL)
+#define CKM_ECDSA_SHA384		(0x1045UL)
+#define CKM_ECDSA_SHA512		(0x1046UL)
 #define CKM_ECDH1_DERIVE		(0x1050UL)
 #define CKM_ECDH1_COFACTOR_DERIVE	(0x1051UL)
 #define CKM_ECMQV_DERIVE		(0x1052UL)
@@ -671,6 +676,8 @@ typedef unsigned long ck_mechanism_type_t;
 #define CKM_AES_MAC			(0x1083UL)
 #define CKM_AES_MAC_GENERAL		(0x1084UL)
 #define CKM_AES_CBC_PAD			(0x1085UL)
+#define CKM_AES_CTR			(0x1086UL)
+#define CKM_AES_GCM			(0x1087UL)
 #define CKM_GOSTR3410_KEY_PAIR_GEN	(0x1200UL)
 #define CKM_GOSTR3410			(0x1201UL)
 #define CKM_GOSTR3410_WITH_GOSTR3411	(0x1202UL)
@@ -732,6 +739,43 @@ typedef struct CK_ECDH1_DERIVE_PARAMS {
 	unsigned char *  pPublicData;
 } CK_ECDH1_DERIVE_PARAMS;
 
+/* Mask generation functions of CKM_RSA_PKCS_OAEP and CKM_RSA_PKCS_PSS */
+#define CKG_MGF1_SHA1			(0x1UL)
+#define CKG_MGF1_SHA256			(0x2UL)
+#define CKG_MGF1_SHA384			(0x3UL)
+#define CKG_MGF1_SHA512			(0x4UL)
+#define CKG_MGF1_SHA224			(0x5UL)
+
+#define CKZ_DATA_SPECIFIED		(0x1UL)
+
+typedef struct CK_RSA_PKCS_OAEP_PARAMS {
+	unsigned long  hashAlg;
+	unsigned long  mgf;
+	unsigned long  source;
+	void *  pSourceData;
+	unsigned long  ulSourceDataLen;
+} CK_RSA_PKCS_OAEP_PARAMS;
+
+typedef struct CK_RSA_PKCS_PSS_PARAMS {
+	unsigned long  hashAlg;
+	unsigned long  mgf;
+	unsigned long  sLen;
+} CK_RSA_PKCS_PSS_PARAMS;
+
+typedef struct CK_AES_CTR_PARAMS {
+	unsigned long  ulCounterBits;
+	unsigned char  cb[16];
+} CK_AES_CTR_PARAMS;
+
+typedef struct CK_GCM_PARAMS {
+	unsigned char *  pIv;
+	unsigned long  ulIvLen;
+	unsigned long  ulIvBits;
+	unsigned char *  pAAD;
+	unsigned long  ulAADLen;
+	unsigned long  ulTagBits;
+} CK_GCM_PARAMS;
+
 
 typedef unsigned long ck_rv_t;
 
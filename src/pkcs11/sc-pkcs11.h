@@ -72,6 +72,8 @@ struct sc_pkcs11_session;
 struct sc_pkcs11_slot;
 struct sc_pkcs11_card;
 
+#define SC_PKCS11_KEY_POOL_SIZES	4
+
 struct sc_pkcs11_config {
 	unsigned int plug_and_play;
 	unsigned int max_virtual_slots;
@@ -83,8 +85,25 @@ struct sc_pkcs11_config {
 	unsigned int zero_ckaid_for_ca_certs;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	unsigned int lazy_data_objects;
+	unsigned int prefetch_certificates;
+	unsigned int pin_info_cache_time;
+	unsigned int random_pool_size;
+	unsigned int random_pool_ratio;
+	unsigned int slot_event_monitor;
+	unsigned int bind_workers;
+	unsigned int object_pool_size;
+	const char *load_balance_label;
+	/* spare RSA key pairs of each size in key_pool_bits kept on a token */
+	unsigned int key_pool_size;
+	unsigned int key_pool_bits[SC_PKCS11_KEY_POOL_SIZES];
+	unsigned int key_pool_sizes;
 };
 
+/* ID of the slot that spreads sessions over the tokens labelled
+ * load_balance_label, away from the IDs of the reader slots */
+#define SC_PKCS11_BALANCE_SLOT_ID	((CK_SLOT_ID) 0x7FFF0000UL)
+
 /*
  * PKCS#11 Object abstraction layer
  */
@@ -124,6 +143,13 @@ struct sc_pkcs11_object_ops {
 	/* Check compatibility of PKCS#15 object usage and an asked PKCS#11 mechanism. */
 	CK_RV (*can_do)(struct sc_pkcs11_session *, void *, CK_MECHANISM_TYPE, unsigned int);
 
+	/* Sign ulCount inputs of ulDataLen bytes, see C_OpenSC_SignBatch() */
+	CK_RV (*sign_batch)(struct sc_pkcs11_session *, void *,
+			CK_MECHANISM_PTR,
+			CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_ULONG ulCount,
+			CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+			CK_ULONG_PTR pulSignatureLen);
+
 	/* Others to be added when implemented */
 };
 
@@ -131,10 +157,15 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	/* View bits of the slots the object was added to, see slot_has_object() */
+	unsigned int views;
+	/* public key parsed for the software verification and encryption (openssl.c) */
+	void *verify_key;
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
+#define SC_PKCS11_OBJECT_INDEXED	0x0004
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
 
@@ -178,6 +209,24 @@ struct sc_pkcs11_framework_ops {
 				CK_OBJECT_HANDLE_PTR, CK_OBJECT_HANDLE_PTR);
 	CK_RV (*get_random)(struct sc_pkcs11_slot *,
 				CK_BYTE_PTR, CK_ULONG);
+	/* Create the objects a search template could match,
+	 * if the framework has not done so yet */
+	CK_RV (*load_objects)(struct sc_pkcs11_slot *,
+				CK_ATTRIBUTE_PTR, CK_ULONG);
+	/* Check the data served from caches against the card,
+	 * *changed is set if the tokens must be created again */
+	CK_RV (*revalidate)(struct sc_pkcs11_card *, int *changed);
+	/* Generate a spare key pair for C_GenerateKeyPair, if the pool
+	 * of the slot is short of one; *generated is set if so */
+	CK_RV (*refill_key_pool)(struct sc_pkcs11_slot *, int *generated);
+	/* Apply the reloaded configuration to the bound card */
+	CK_RV (*reload_config)(struct sc_pkcs11_card *);
+	/* Nonzero if the user PINs of two slots of the card are the same
+	 * PIN on the card, see slot_share_login() */
+	int (*same_user_pin)(struct sc_pkcs11_slot *, struct sc_pkcs11_slot *);
+	/* Log the user in as login() does, the PIN having been verified
+	 * on a slot with the same user PIN */
+	CK_RV (*share_login)(struct sc_pkcs11_slot *, CK_CHAR_PTR, CK_ULONG);
 };
 
 /*
@@ -190,6 +239,16 @@ typedef unsigned long long sc_timestamp_t;
 typedef unsigned __int64   sc_timestamp_t;
 #endif
 
+/* Mechanisms of a card by type, see sc_pkcs11_find_mechanism() */
+#define SC_PKCS11_MECHANISM_INDEX_SIZE	64
+
+struct sc_pkcs11_mechanism_entry {
+	CK_MECHANISM_TYPE mech;
+	CK_FLAGS flags;				/* flags of all types registered for mech */
+	struct sc_pkcs11_mechanism_type *mt;	/* first type registered for mech */
+	struct sc_pkcs11_mechanism_entry *next;
+};
+
 #define SC_PKCS11_FRAMEWORK_DATA_MAX_NUM	4
 struct sc_pkcs11_card {
 	sc_reader_t *reader;
@@ -200,8 +259,40 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+	struct sc_pkcs11_mechanism_entry *mechanism_index[SC_PKCS11_MECHANISM_INDEX_SIZE];
+
+	/* Objects of the slots using each framework data by CKA_CLASS, CKA_ID,
+	 * CKA_LABEL, CKA_SUBJECT and CKA_SERIAL_NUMBER, built on demand, see
+	 * slot_index_objects() */
+	struct sc_pkcs11_object_index *object_index[SC_PKCS11_FRAMEWORK_DATA_MAX_NUM];
+};
+
+/* Index of the objects of a slot by the value of an attribute.
+ * Only a hash of the value is kept, candidates still have to be
+ * compared with cmp_attribute(). */
+#define SC_PKCS11_OBJECT_INDEX_SIZE	128
+
+struct sc_pkcs11_object_index_entry {
+	CK_ATTRIBUTE_TYPE type;
+	unsigned long hash;
+	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_object_index_entry *next;
 };
 
+struct sc_pkcs11_object_index {
+	unsigned int types;	/* Attributes indexed so far, by selectivity */
+	struct sc_pkcs11_object_index_entry *buckets[SC_PKCS11_OBJECT_INDEX_SIZE];
+};
+
+/* Array of pointers, iterated in place, see vector_append() */
+struct sc_pkcs11_vector {
+	void **items;
+	unsigned int count;
+	unsigned int allocated;
+};
+#define vector_size(v)		((v)->count)
+#define vector_get(v, i)	((v)->items[i])
+
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id;			/* ID of the slot */
 	int login_user;			/* Currently logged in user */
@@ -211,16 +302,43 @@ struct sc_pkcs11_slot {
 	struct sc_pkcs11_card *card;	/* The card associated with this slot */
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
-	list_t objects;			/* Objects in this slot */
+	struct sc_pkcs11_vector objects;	/* Objects in this slot */
+	unsigned int view;		/* Bit of the slot in the views of the objects, 0 if the card has too many slots */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 
 	int fw_data_idx;		/* Index of framework data */
 	struct sc_app_info *app_info;	/* Application assosiated to slot */
+
+	struct sc_pkcs11_slot *lock_owner;	/* First slot of the reader, holds the reader lock */
+	void *lock;			/* Reader lock, only allocated in the lock owner */
+	unsigned int lock_depth;	/* Nesting of the reader lock under the global lock */
+	unsigned int lock_epoch;	/* Bumped each time the reader lock is taken under the global lock */
+	void *bulk_lock;		/* Queue of the bulk operations for the reader lock, see sc_pkcs11_lock_session() */
+
+	/* Card traffic of the sessions of this slot, by CK_OPENSC_OP_* */
+	CK_OPENSC_OPERATION_STATS stats[CK_OPENSC_OP_COUNT];
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
 
+/* Maps the session and object handles handed out to applications to
+ * their structures in O(1), see handle_table_add() */
+struct sc_pkcs11_handle_entry {
+	void *ptr;			/* NULL if the entry is free */
+	void *owner;
+	CK_ULONG handle;
+	unsigned long generation;
+	unsigned int next_free;		/* index+1 of the next free entry */
+};
+
+struct sc_pkcs11_handle_table {
+	struct sc_pkcs11_handle_entry *entries;
+	unsigned int allocated;
+	unsigned int used;		/* entries handed out at least once */
+	unsigned int free_list;		/* index+1 of the first free entry */
+};
+
 /* Forward decl */
 typedef struct sc_pkcs11_operation sc_pkcs11_operation_t;
 
@@ -231,6 +349,7 @@ enum {
 	SC_PKCS11_OPERATION_DIGEST,
 	SC_PKCS11_OPERATION_DECRYPT,
 	SC_PKCS11_OPERATION_DERIVE,
+	SC_PKCS11_OPERATION_ENCRYPT,
 	SC_PKCS11_OPERATION_MAX
 };
 
@@ -274,8 +393,24 @@ struct sc_pkcs11_mechanism_type {
 					struct sc_pkcs11_object *,
 					CK_BYTE_PTR, CK_ULONG,
 					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_init)(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+	CK_RV		  (*encrypt)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 	/* mechanism specific data */
 	const void *		  mech_data;
+	/* Multi-part encryption/decryption, NULL if only single-part */
+	CK_RV		  (*encrypt_update)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_final)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*decrypt_update)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*decrypt_final)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 };
 typedef struct sc_pkcs11_mechanism_type sc_pkcs11_mechanism_type_t;
 
@@ -285,6 +420,14 @@ typedef struct sc_pkcs11_mechanism_type sc_pkcs11_mechanism_type_t;
 struct sc_pkcs11_operation {
 	sc_pkcs11_mechanism_type_t *type;
 	CK_MECHANISM	  mechanism;
+	/* copy of the mechanism parameter, mechanism.pParameter points here */
+	union {
+		CK_RSA_PKCS_PSS_PARAMS pss;
+		CK_RSA_PKCS_OAEP_PARAMS oaep;
+		CK_AES_CTR_PARAMS ctr;
+		CK_GCM_PARAMS gcm;
+		CK_BYTE iv[16];
+	} mechanism_params;
 	struct sc_pkcs11_session *session;
 	void *		  priv_data;
 };
@@ -293,8 +436,16 @@ struct sc_pkcs11_operation {
 #define SC_PKCS11_FIND_INC_HANDLES	32
 struct sc_pkcs11_find_operation {
 	struct sc_pkcs11_operation operation;
+	/* Copy of the search template, matched by C_FindObjects() */
+	CK_ATTRIBUTE_PTR template;
+	CK_ULONG template_len;
+	int hide_private;
+	/* Candidates picked from the object index, if use_index */
+	int use_index;
 	int num_handles, current_handle, allocated_handles;
 	CK_OBJECT_HANDLE *handles;
+	/* Otherwise the next object of the slot to match */
+	unsigned int next_object;
 };
 
 /*
@@ -311,20 +462,47 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Finished operations kept for the next Init of the same type */
+	struct sc_pkcs11_operation *idle[SC_PKCS11_OPERATION_MAX];
+	unsigned int idle_size[SC_PKCS11_OPERATION_MAX];
+	/* Private data of a finished sign/verify/decrypt (mechanism.c) */
+	void *idle_signature_data;
+	/* Digest contexts kept for reuse (openssl.c) */
+	void *md_pool;
+	/* Card traffic of this session, by CK_OPENSC_OP_* */
+	CK_OPENSC_OPERATION_STATS stats[CK_OPENSC_OP_COUNT];
+	/* Reader counters when the current call took the lock */
+	int stats_op;
+	sc_reader_t *stats_reader;
+	CK_OPENSC_OPERATION_STATS stats_start;
+	/* Opened on SC_PKCS11_BALANCE_SLOT_ID */
+	int balanced;
+	/* Neighbours in the list of all sessions */
+	struct sc_pkcs11_session *prev, *next;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
+struct sc_pkcs11_session_list {
+	struct sc_pkcs11_session *first;
+	unsigned int count;
+};
+
 /* Module variables */
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
-extern list_t sessions;
-extern list_t virtual_slots;
+extern struct sc_pkcs11_session_list sessions;
+extern struct sc_pkcs11_handle_table session_handles;
+extern struct sc_pkcs11_handle_table object_handles;
+extern struct sc_pkcs11_vector virtual_slots;
 extern list_t cards;
 
 /* Framework definitions */
 extern struct sc_pkcs11_framework_ops framework_pkcs15;
 extern struct sc_pkcs11_framework_ops framework_pkcs15init;
 
+/* Frees the object wrappers kept for reuse by framework-pkcs15.c */
+void sc_pkcs11_object_pool_free(void);
+
 void strcpy_bp(u8 *dst, const char *src, size_t dstsize);
 CK_RV sc_to_cryptoki_error(int rc, const char *ctx);
 void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const char *function,
@@ -336,14 +514,52 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
+int slot_monitor_active(void);
 CK_RV create_slot(sc_reader_t *reader);
 CK_RV initialize_reader(sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
+CK_RV card_revalidate(sc_reader_t *reader);
+CK_RV card_refill_key_pool(sc_reader_t *reader);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+void slot_list_changed(void);
+CK_RV slot_list_get(int token_present, const CK_SLOT_ID **ids, CK_ULONG *count);
+void slot_list_free(void);
+void slot_reader_index_free(void);
+int slot_is_balance_member(const struct sc_pkcs11_slot *slot);
+void slot_balance_login(struct sc_pkcs11_slot *done, CK_USER_TYPE userType,
+		CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
+void slot_balance_logout(struct sc_pkcs11_slot *done);
+void slot_share_login(struct sc_pkcs11_slot *done, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
+void slot_share_logout(struct sc_pkcs11_slot *done);
+int slot_keep_shared_login(struct sc_pkcs11_slot *slot);
+int slot_is_indexed_attribute(CK_ATTRIBUTE_TYPE type);
+unsigned long slot_attribute_hash(CK_ATTRIBUTE_PTR attr);
+CK_RV slot_index_objects(struct sc_pkcs11_session *session, CK_ATTRIBUTE_TYPE type);
+void slot_drop_object_index(struct sc_pkcs11_slot *slot);
+void slot_free_object_indexes(struct sc_pkcs11_card *card);
+int slot_has_object(const struct sc_pkcs11_slot *slot, const struct sc_pkcs11_object *object);
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+CK_RV slot_register_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+void slot_unregister_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+CK_RV slot_get_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle,
+		struct sc_pkcs11_object **object);
+
+/* Handle tables (misc.c) */
+CK_RV handle_table_add(struct sc_pkcs11_handle_table *, void *ptr, void *owner, CK_ULONG *handle);
+void *handle_table_get(const struct sc_pkcs11_handle_table *, CK_ULONG handle, void **owner);
+void handle_table_remove(struct sc_pkcs11_handle_table *, CK_ULONG handle);
+void handle_table_free(struct sc_pkcs11_handle_table *);
+
+/* Pointer vectors (misc.c) */
+CK_RV vector_append(struct sc_pkcs11_vector *, void *item);
+int vector_locate(const struct sc_pkcs11_vector *, const void *item);
+int vector_delete(struct sc_pkcs11_vector *, const void *item);
+void vector_free(struct sc_pkcs11_vector *);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
@@ -353,6 +569,7 @@ CK_RV session_start_operation(struct sc_pkcs11_session *,
 CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
+void session_release_operations(struct sc_pkcs11_session *);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
 
 /* Generic secret key stuff */
@@ -375,6 +592,7 @@ CK_RV attr_extract(CK_ATTRIBUTE_PTR, void *, size_t *);
 /* Generic Mechanism functions */
 CK_RV sc_pkcs11_register_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
+void sc_pkcs11_free_mechanism_index(struct sc_pkcs11_card *);
 CK_RV sc_pkcs11_get_mechanism_list(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_get_mechanism_info(struct sc_pkcs11_card *, CK_MECHANISM_TYPE,
@@ -382,6 +600,8 @@ CK_RV sc_pkcs11_get_mechanism_info(struct sc_pkcs11_card *, CK_MECHANISM_TYPE,
 CK_RV sc_pkcs11_md_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR);
 CK_RV sc_pkcs11_md_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_md_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_md_digest(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+				CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
@@ -392,9 +612,17 @@ CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_verif_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
+CK_RV sc_pkcs11_encr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_encr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_wrap(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *,
+				CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
 #endif
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_decr_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_decr_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_deri(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_KEY_TYPE,
 				CK_SESSION_HANDLE, CK_OBJECT_HANDLE, struct sc_pkcs11_object *);
@@ -406,9 +634,11 @@ sc_pkcs11_mechanism_type_t *sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE,
 sc_pkcs11_operation_t *sc_pkcs11_new_operation(sc_pkcs11_session_t *,
 				sc_pkcs11_mechanism_type_t *);
 void sc_pkcs11_release_operation(sc_pkcs11_operation_t **);
+void sc_pkcs11_free_idle_operations(sc_pkcs11_session_t *);
 CK_RV sc_pkcs11_register_generic_mechanisms(struct sc_pkcs11_card *);
 #ifdef ENABLE_OPENSSL
 void sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *);
+void sc_pkcs11_openssl_md_pool_free(struct sc_pkcs11_session *);
 #endif
 CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE, CK_MECHANISM_TYPE,
@@ -417,20 +647,62 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	const unsigned char *pubkey_params, int pubkey_params_len,
+	void **pkey_cache,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+CK_RV sc_pkcs11_encrypt_data(const unsigned char *pubkey, int pubkey_len,
+			void **pkey_cache, CK_MECHANISM_PTR mech,
+			CK_BYTE_PTR in, CK_ULONG inlen,
+			CK_BYTE_PTR out, CK_ULONG_PTR outlen);
+void sc_pkcs11_free_verify_key(struct sc_pkcs11_object *);
 #endif
 
 /* Load configuration defaults */
 void load_pkcs11_parameters(struct sc_pkcs11_config *, struct sc_context *);
 
-/* Locking primitives at the pkcs11 level */
+/* Current time in milliseconds */
+sc_timestamp_t get_current_time(void);
+
+/* Locking primitives at the pkcs11 level, the callers are named in the
+ * lock statistics */
 CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
-CK_RV sc_pkcs11_lock(void);
+CK_RV sc_pkcs11_lock_from(const char *function);
+#define sc_pkcs11_lock()	sc_pkcs11_lock_from(__FUNCTION__)
+int sc_pkcs11_threads_allowed(void);
 void sc_pkcs11_unlock(void);
+CK_RV sc_pkcs11_init_slot_lock(struct sc_pkcs11_slot *slot);
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_slot *slot);
+void sc_pkcs11_lock_slot(struct sc_pkcs11_slot *slot);
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *slot);
+int sc_pkcs11_swap_to_slot_lock(struct sc_pkcs11_slot *slot);
+void sc_pkcs11_unlock_swapped_slot(struct sc_pkcs11_slot *slot);
+CK_RV sc_pkcs11_lock_session_from(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+		int op, const char *function);
+#define sc_pkcs11_lock_session(hSession, session, op) \
+	sc_pkcs11_lock_session_from((hSession), (session), (op), __FUNCTION__)
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session);
 void sc_pkcs11_free_lock(void);
 
+/* OpenSC vendor extension, see pkcs11-opensc.h */
+CK_RV C_OpenSC_GetOperationStats(CK_SLOT_ID slotID, CK_SESSION_HANDLE hSession,
+		CK_OPENSC_OPERATION_STATS_PTR pStats, CK_ULONG ulCount, CK_BBOOL reset);
+CK_RV C_OpenSC_GetLockStats(CK_OPENSC_LOCK_STATS_PTR pStats, CK_BBOOL reset);
+CK_RV C_OpenSC_GetMemoryStats(CK_OPENSC_MEMORY_STATS_PTR pStats, CK_ULONG ulCount,
+		CK_BBOOL reset);
+CK_RV C_OpenSC_ReloadConfig(void);
+CK_RV C_OpenSC_SignBatch(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_ULONG ulCount,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_ULONG_PTR pulSignatureLen);
+CK_RV C_OpenSC_SubmitOperation(CK_SESSION_HANDLE hSession, CK_OPENSC_ASYNC_OPERATION_PTR pOperation);
+CK_RV C_OpenSC_GetCompletionFd(int *pFd);
+CK_RV C_OpenSC_ReapOperations(CK_OPENSC_ASYNC_OPERATION_PTR *ppOperations,
+		CK_ULONG ulMaxCount, CK_ULONG_PTR pulCount);
+
+/* in pkcs11-async.c */
+void sc_pkcs11_async_end(void);
+void sc_pkcs11_async_forget(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,9 +23,15 @@
 
 #include <string.h>
 #include <stdlib.h>
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #include "sc-pkcs11.h"
 
+/* Upper limit for the bind_workers option */
+#define SC_PKCS11_MAX_BIND_WORKERS	32
+
 static struct sc_pkcs11_framework_ops *frameworks[] = {
 	&framework_pkcs15,
 #ifdef USE_PKCS15_INIT
@@ -36,19 +42,101 @@ static struct sc_pkcs11_framework_ops *frameworks[] = {
 	NULL
 };
 
-static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
+/*
+ * The slots of each reader, by reader address. initialize_reader()
+ * creates them in a row, so they are a range of virtual_slots. Slots
+ * are never deleted before C_Finalize(), neither are the entries.
+ */
+struct reader_slots {
+	const sc_reader_t *reader;
+	unsigned int first;		/* index of the first slot in virtual_slots */
+	unsigned int count;
+};
+
+static struct reader_slots *reader_index = NULL;
+static unsigned int reader_index_size = 0;	/* power of 2 */
+static unsigned int reader_index_used = 0;
+
+static unsigned int reader_hash(const sc_reader_t *reader)
 {
-	unsigned int i;
+	return (unsigned int)(((size_t)reader >> 4) * 2654435761U);
+}
 
-	/* Locate a slot related to the reader */
-	for (i = 0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader)
-			return slot;
-	}
+static struct reader_slots *reader_index_find(const sc_reader_t *reader)
+{
+	unsigned int i, mask = reader_index_size - 1;
+
+	if (reader == NULL || reader_index_size == 0)
+		return NULL;
+	for (i = reader_hash(reader) & mask; reader_index[i].reader != NULL; i = (i + 1) & mask)
+		if (reader_index[i].reader == reader)
+			return &reader_index[i];
 	return NULL;
 }
 
+static CK_RV reader_index_add(const sc_reader_t *reader, unsigned int idx)
+{
+	struct reader_slots *entry = reader_index_find(reader), *table;
+	unsigned int i, j, size;
+
+	if (entry != NULL) {
+		if (idx == entry->first + entry->count)
+			entry->count++;
+		return CKR_OK;
+	}
+
+	/* kept at most half full */
+	if (2 * (reader_index_used + 1) > reader_index_size) {
+		size = reader_index_size ? 2 * reader_index_size : 16;
+		table = calloc(size, sizeof(struct reader_slots));
+		if (table == NULL)
+			return CKR_HOST_MEMORY;
+		for (i = 0; i < reader_index_size; i++) {
+			if (reader_index[i].reader == NULL)
+				continue;
+			for (j = reader_hash(reader_index[i].reader) & (size - 1); table[j].reader != NULL; j = (j + 1) & (size - 1))
+				;
+			table[j] = reader_index[i];
+		}
+		free(reader_index);
+		reader_index = table;
+		reader_index_size = size;
+	}
+
+	for (i = reader_hash(reader) & (reader_index_size - 1); reader_index[i].reader != NULL;
+			i = (i + 1) & (reader_index_size - 1))
+		;
+	reader_index[i].reader = reader;
+	reader_index[i].first = idx;
+	reader_index[i].count = 1;
+	reader_index_used++;
+	return CKR_OK;
+}
+
+/* Returns the number of slots of the reader, the first at *first */
+static unsigned int reader_slots(const sc_reader_t *reader, unsigned int *first)
+{
+	struct reader_slots *entry = reader_index_find(reader);
+
+	*first = entry != NULL ? entry->first : 0;
+	return entry != NULL ? entry->count : 0;
+}
+
+static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
+{
+	struct reader_slots *entry = reader_index_find(reader);
+
+	return entry != NULL ? (sc_pkcs11_slot_t *) vector_get(&virtual_slots, entry->first) : NULL;
+}
+
+void slot_reader_index_free(void)
+{
+	free(reader_index);
+	reader_index = NULL;
+	reader_index_size = 0;
+	reader_index_used = 0;
+}
+
 static void init_slot_info(CK_SLOT_INFO_PTR pInfo)
 {
 	strcpy_bp(pInfo->slotDescription, "Virtual hotplug slot", 64);
@@ -60,37 +148,44 @@ static void init_slot_info(CK_SLOT_INFO_PTR pInfo)
 	pInfo->firmwareVersion.minor = 0;
 }
 
-/* simclist helpers to locate interesting objects by ID */
-static int object_list_seeker(const void *el, const void *key)
-{
-	const struct sc_pkcs11_object *object = (struct sc_pkcs11_object *)el;
-
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (object->handle == *(CK_OBJECT_HANDLE*)key)
-		return 1;
-	return 0;
-}
-
 CK_RV create_slot(sc_reader_t *reader)
 {
 	struct sc_pkcs11_slot *slot;
+	CK_RV rv;
 
-	if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
+	if (vector_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 		return CKR_FUNCTION_FAILED;
 
 	slot = (struct sc_pkcs11_slot *)calloc(1, sizeof(struct sc_pkcs11_slot));
 	if (!slot)
 		return CKR_HOST_MEMORY;
 
-	list_append(&virtual_slots, slot);
+	/* All slots of a reader share the lock of the first one */
+	slot->lock_owner = reader ? reader_get_slot(reader) : NULL;
+	if (slot->lock_owner == NULL)
+		slot->lock_owner = slot;
+	rv = sc_pkcs11_init_slot_lock(slot);
+	if (rv != CKR_OK) {
+		free(slot);
+		return rv;
+	}
+
+	rv = vector_append(&virtual_slots, slot);
+	if (rv == CKR_OK && reader != NULL) {
+		rv = reader_index_add(reader, vector_size(&virtual_slots) - 1);
+		if (rv != CKR_OK)
+			virtual_slots.count--;
+	}
+	if (rv != CKR_OK) {
+		sc_pkcs11_free_slot_lock(slot);
+		free(slot);
+		return rv;
+	}
 	slot->login_user = -1;
-	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
+	slot->id = (CK_SLOT_ID) (vector_size(&virtual_slots) - 1);
+	slot_list_changed();
 	sc_log(context, "Creating slot with id 0x%lx", slot->id);
 
-	list_init(&slot->objects);
-	list_attributes_seeker(&slot->objects, object_list_seeker);
-
 	init_slot_info(&slot->slot_info);
 	if (reader != NULL) {
 		slot->reader = reader;
@@ -101,7 +196,8 @@ CK_RV create_slot(sc_reader_t *reader)
 }
 
 
-/* create slots associated with a reader, called whenever a reader is seen. */
+/* create slots associated with a reader, called whenever a reader is seen.
+ * The card in the reader is detected by the caller. */
 CK_RV initialize_reader(sc_reader_t *reader)
 {
 	unsigned int i;
@@ -128,12 +224,6 @@ CK_RV initialize_reader(sc_reader_t *reader)
 			return rv;
 	}
 
-	sc_log(context, "Initialize reader '%s': detect SC card presence", reader->name);
-	if (sc_detect_card_presence(reader))   {
-		sc_log(context, "Initialize reader '%s': detect PKCS11 card presence", reader->name);
-		card_detect(reader);
-	}
-
 	sc_log(context, "Reader '%s' initialized", reader->name);
 	return CKR_OK;
 }
@@ -141,20 +231,21 @@ CK_RV initialize_reader(sc_reader_t *reader)
 
 CK_RV card_removed(sc_reader_t * reader)
 {
-	unsigned int i;
+	unsigned int i, first, count;
 	struct sc_pkcs11_card *card = NULL;
+	struct sc_pkcs11_slot *lock_slot = reader_get_slot(reader);
 	/* Mark all slots as "token not present" */
 	sc_log(context, "%s: card removed", reader->name);
 
+	sc_pkcs11_lock_slot(lock_slot);
 
-	for (i=0; i < list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			/* Save the "card" object */
-			if (slot->card)
-				card = slot->card;
-			slot_token_removed(slot->id);
-		}
+	count = reader_slots(reader, &first);
+	for (i = first; i < first + count; i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) vector_get(&virtual_slots, i);
+		/* Save the "card" object */
+		if (slot->card)
+			card = slot->card;
+		slot_token_removed(slot->id);
 	}
 
 	if (card) {
@@ -173,20 +264,95 @@ CK_RV card_removed(sc_reader_t * reader)
 		}
 		*/
 		free(card->mechanisms);
+		sc_pkcs11_free_mechanism_index(card);
+		slot_free_object_indexes(card);
 		free(card);
 	}
 
+	sc_pkcs11_unlock_slot(lock_slot);
 	return CKR_OK;
 }
 
 
-CK_RV card_detect(sc_reader_t *reader)
+/*
+ * Let the framework check what it served from its caches against the
+ * card; if the content differs, the card is bound again and the slots
+ * report it as removed and inserted.
+ */
+CK_RV card_revalidate(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *lock_slot = reader_get_slot(reader);
+	struct sc_pkcs11_card *p11card = NULL;
+	unsigned int i, first, count;
+	int changed = 0;
+	CK_RV rv;
+
+	count = reader_slots(reader, &first);
+	for (i = first; i < first + count && p11card == NULL; i++)
+		p11card = ((sc_pkcs11_slot_t *) vector_get(&virtual_slots, i))->card;
+	if (p11card == NULL || p11card->framework == NULL || p11card->framework->revalidate == NULL)
+		return CKR_OK;
+
+	sc_pkcs11_lock_slot(lock_slot);
+	rv = p11card->framework->revalidate(p11card, &changed);
+	sc_pkcs11_unlock_slot(lock_slot);
+	if (rv != CKR_OK || !changed)
+		return rv;
+
+	sc_log(context, "%s: cached token content changed", reader->name);
+	card_removed(reader);
+	return card_detect(reader);
+}
+
+/*
+ * Add at most one key pair to the key pool of one of the slots of the
+ * reader. Generation takes long, so it is done one key at a time between
+ * the events of the monitor, holding the reader lock but not the global
+ * lock. Called without the global lock.
+ */
+CK_RV card_refill_key_pool(sc_reader_t *reader)
+{
+	sc_pkcs11_slot_t *slot;
+	unsigned int i, first, count;
+	int generated = 0;
+	CK_RV rv = CKR_OK;
+
+	if (sc_pkcs11_conf.key_pool_size == 0)
+		return CKR_OK;
+
+	for (i = 0; !generated && rv == CKR_OK; i++) {
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK)
+			return rv;
+		count = reader_slots(reader, &first);
+		for (slot = NULL; i < count; i++) {
+			slot = (sc_pkcs11_slot_t *) vector_get(&virtual_slots, first + i);
+			if (slot->card != NULL && slot->card->framework != NULL
+					&& slot->card->framework->refill_key_pool != NULL)
+				break;
+		}
+		if (i >= count) {
+			sc_pkcs11_unlock();
+			break;
+		}
+		/* The token changed meanwhile, try again when idle next time */
+		if (!sc_pkcs11_swap_to_slot_lock(slot))
+			break;
+		rv = slot->card->framework->refill_key_pool(slot, &generated);
+		sc_pkcs11_unlock_swapped_slot(slot);
+	}
+	return rv;
+}
+
+
+static CK_RV __card_detect(sc_reader_t *reader)
 {
 	struct sc_pkcs11_card *p11card = NULL;
 	int rc;
 	CK_RV rv;
 	unsigned int i;
 	int j;
+	unsigned long long start;
 
 	rv = CKR_OK;
 
@@ -217,12 +383,16 @@ again:
 	}
 
 	/* Locate a slot related to the reader */
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			p11card = slot->card;
-			break;
-		}
+	if (reader_get_slot(reader) != NULL)
+		p11card = reader_get_slot(reader)->card;
+
+	/* The change may have been reported to another caller of
+	 * sc_detect_card_presence(), the generation does not get lost */
+	if (p11card && p11card->card && p11card->card->card_generation != reader->card_generation) {
+		sc_log(context, "%s: Card changed (generation %u/%u)", reader->name,
+				p11card->card->card_generation, reader->card_generation);
+		card_removed(reader);
+		goto again;
 	}
 
 	/* Detect the card if it's not known already */
@@ -274,7 +444,9 @@ again:
 				enable_InitToken = scconf_get_bool(atrblock, "pkcs11_enable_InitToken", 0);
 
 			sc_log(context, "%s: Try to bind 'generic' token.", reader->name);
+			start = sc_startup_trace_begin(context);
 			rv = frameworks[i]->bind(p11card, app_generic);
+			sc_startup_trace_end(context, start, "pkcs11", "bind 'generic' token");
 			if (rv == CKR_TOKEN_NOT_RECOGNIZED && enable_InitToken)   {
 				sc_log(context, "%s: 'InitToken' enabled -- accept non-binded card", reader->name);
 				rv = CKR_OK;
@@ -301,7 +473,9 @@ again:
 				continue;
 
 			sc_log(context, "%s: Binding %s token.", reader->name, app_name);
+			start = sc_startup_trace_begin(context);
 			rv = frameworks[i]->bind(p11card, app_info);
+			sc_startup_trace_end(context, start, "pkcs11", "bind %s token", app_name);
 			if (rv != CKR_OK)   {
 				sc_log(context, "%s: bind %s token error Ox%X", reader->name, app_name, rv);
 				continue;
@@ -321,53 +495,446 @@ again:
 }
 
 
+CK_RV card_detect(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *lock_slot = reader_get_slot(reader);
+	unsigned long long start;
+	CK_RV rv;
+
+	sc_pkcs11_lock_slot(lock_slot);
+	start = sc_startup_trace_begin(context);
+	rv = __card_detect(reader);
+	sc_startup_trace_end(context, start, "pkcs11", "card_detect %s", reader->name);
+	sc_pkcs11_unlock_slot(lock_slot);
+	return rv;
+}
+
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+/*
+ * Connecting and binding a card mostly waits on its reader, so the cards
+ * of different readers are detected by a few threads at once. A thread
+ * changes the slots of its reader under the reader lock, but removing a
+ * card closes sessions and binding one adds object handles: the session
+ * list and the handle tables have locks of their own for that.
+ * The caller keeps the global lock until all threads are done, so the
+ * slots are seen by the application together, not one by one.
+ */
+struct card_detect_queue {
+	pthread_mutex_t mutex;
+	sc_reader_t **readers;
+	unsigned int count;
+	unsigned int next;
+};
+
+static void *card_detect_worker(void *arg)
+{
+	struct card_detect_queue *queue = (struct card_detect_queue *)arg;
+
+	for (;;) {
+		sc_reader_t *reader = NULL;
+
+		pthread_mutex_lock(&queue->mutex);
+		if (queue->next < queue->count)
+			reader = queue->readers[queue->next++];
+		pthread_mutex_unlock(&queue->mutex);
+
+		if (reader == NULL)
+			return NULL;
+		card_detect(reader);
+	}
+}
+
+static int card_detect_parallel(sc_reader_t **readers, unsigned int count)
+{
+	struct card_detect_queue queue;
+	pthread_t threads[SC_PKCS11_MAX_BIND_WORKERS];
+	unsigned int i, nthreads = 0, workers = sc_pkcs11_conf.bind_workers;
+
+	if (workers > SC_PKCS11_MAX_BIND_WORKERS)
+		workers = SC_PKCS11_MAX_BIND_WORKERS;
+	if (workers > count)
+		workers = count;
+
+	queue.readers = readers;
+	queue.count = count;
+	queue.next = 0;
+	if (pthread_mutex_init(&queue.mutex, NULL) != 0)
+		return -1;
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < workers; i++) {
+		if (pthread_create(&threads[nthreads], NULL, card_detect_worker, &queue) != 0)
+			break;
+		nthreads++;
+	}
+	sc_log(context, "Detecting cards in %u readers with %u threads", count, nthreads + 1);
+	card_detect_worker(&queue);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&queue.mutex);
+	return 0;
+}
+#endif
+
 CK_RV
 card_detect_all(void)
 {
-	unsigned int i;
+	sc_reader_t **readers;
+	unsigned int i, count = 0, num = sc_ctx_get_reader_count(context);
 
 	sc_log(context, "Detect all cards");
-	/* Detect cards in all initialized readers */
-	for (i=0; i< sc_ctx_get_reader_count(context); i++) {
+	/* Query all readers at once, card_detect() then uses that state */
+	sc_refresh_readers(context);
+
+	readers = calloc(num + 1, sizeof(sc_reader_t *));
+	if (!readers)
+		return CKR_HOST_MEMORY;
+
+	/* Create the slots of new readers first, the slot list is shared */
+	for (i=0; i< num; i++) {
 		sc_reader_t *reader = sc_ctx_get_reader(context, i);
 		if (!reader_get_slot(reader))
 			initialize_reader(reader);
-		card_detect(sc_ctx_get_reader(context, i));
+		/* Ignored readers have no slots */
+		if (reader_get_slot(reader))
+			readers[count++] = reader;
 	}
+
+	/* Detect cards in all initialized readers */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (count > 1 && sc_pkcs11_conf.bind_workers > 1 && sc_pkcs11_threads_allowed()
+			&& card_detect_parallel(readers, count) == 0)
+		count = 0;
+#endif
+	for (i=0; i< count; i++)
+		card_detect(readers[i]);
+
+	free(readers);
 	sc_log(context, "All cards detected");
 	return CKR_OK;
 }
 
+/*
+ * Answers of C_GetSlotList(), with and without tokenPresent. They are
+ * built again only after slot_list_changed() was called, which is done
+ * whenever a slot is created, gets or loses its token, or changes ID.
+ */
+struct slot_id_list {
+	unsigned int version;
+	CK_SLOT_ID *ids;
+	CK_ULONG count;
+};
+
+static unsigned int slot_list_version = 1;
+static struct slot_id_list slot_id_lists[2];
+
+void slot_list_changed(void)
+{
+	slot_list_version++;
+}
+
+static CK_RV slot_list_build(struct slot_id_list *list, int token_present)
+{
+	sc_reader_t *prev_reader = NULL;
+	unsigned int i;
+	int balance = 0;
+	CK_SLOT_ID *ids;
+
+	ids = realloc(list->ids, (vector_size(&virtual_slots) + 2) * sizeof(CK_SLOT_ID));
+	if (ids == NULL)
+		return CKR_HOST_MEMORY;
+	list->ids = ids;
+	list->count = 0;
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) vector_get(&virtual_slots, i);
+
+		/* the list of available slots contains:
+		 * - if present, virtual hotplug slot;
+		 * - any slot with token;
+		 * - without token(s), one empty slot per reader;
+		 */
+		if ((!token_present && !slot->reader)
+				|| (!token_present && slot->reader != prev_reader)
+				|| (slot->slot_info.flags & CKF_TOKEN_PRESENT))
+			list->ids[list->count++] = slot->id;
+		prev_reader = slot->reader;
+		if (slot_is_balance_member(slot))
+			balance = 1;
+	}
+	if (balance)
+		list->ids[list->count++] = SC_PKCS11_BALANCE_SLOT_ID;
+	list->version = slot_list_version;
+	sc_log(context, "slot list (token=%d) rebuilt, %lu slots", token_present, list->count);
+	return CKR_OK;
+}
+
+/* Called with the global lock held, the array stays valid until the
+ * lock is released */
+CK_RV slot_list_get(int token_present, const CK_SLOT_ID **ids, CK_ULONG *count)
+{
+	struct slot_id_list *list = &slot_id_lists[token_present ? 1 : 0];
+
+	if (list->version != slot_list_version) {
+		CK_RV rv = slot_list_build(list, token_present);
+		if (rv != CKR_OK)
+			return rv;
+	}
+	*ids = list->ids;
+	*count = list->count;
+	return CKR_OK;
+}
+
+void slot_list_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(slot_id_lists)/sizeof(slot_id_lists[0]); i++)
+		free(slot_id_lists[i].ids);
+	memset(slot_id_lists, 0, sizeof(slot_id_lists));
+	slot_list_version++;
+}
+
 /* Allocates an existing slot to a card */
 CK_RV slot_allocate(struct sc_pkcs11_slot ** slot, struct sc_pkcs11_card * card)
 {
-	unsigned int i;
+	unsigned int i, n, first, count;
 	struct sc_pkcs11_slot *tmp_slot = NULL;
 
 	/* Locate a free slot for this reader */
-	for (i=0; i< list_size(&virtual_slots); i++) {
-		tmp_slot = (struct sc_pkcs11_slot *)list_get_at(&virtual_slots, i);
-		if (tmp_slot->reader == card->reader && tmp_slot->card == NULL)
+	count = reader_slots(card->reader, &first);
+	for (i = first; i < first + count; i++) {
+		tmp_slot = (struct sc_pkcs11_slot *)vector_get(&virtual_slots, i);
+		if (tmp_slot->card == NULL)
 			break;
 	}
-	if (!tmp_slot || (i == list_size(&virtual_slots)))
+	if (i == first + count)
 		return CKR_FUNCTION_FAILED;
 	sc_log(context, "Allocated slot 0x%lx for card in reader %s", tmp_slot->id, card->reader->name);
+
+	/* The slots of a card share its objects, each sees those with its bit */
+	for (i = first, n = 0; i < first + count; i++)
+		if (((struct sc_pkcs11_slot *) vector_get(&virtual_slots, i))->card == card)
+			n++;
+	tmp_slot->view = n < sizeof(tmp_slot->view) * 8 ? 1U << n : 0;
 	tmp_slot->card = card;
 	tmp_slot->events = SC_EVENT_CARD_INSERTED;
+	/* the framework marks the token present */
+	slot_list_changed();
 	*slot = tmp_slot;
 	return CKR_OK;
 }
 
+/*
+ * Members of the balance slot are the slots whose token carries the
+ * configured load_balance_label. The tokens are meant to be copies of
+ * each other, so any of them can serve a session opened on
+ * SC_PKCS11_BALANCE_SLOT_ID.
+ */
+int slot_is_balance_member(const struct sc_pkcs11_slot *slot)
+{
+	const char *label = sc_pkcs11_conf.load_balance_label;
+	size_t len, i;
+
+	if (label == NULL || !(slot->slot_info.flags & CKF_TOKEN_PRESENT))
+		return 0;
+	len = strlen(label);
+	if (len > sizeof(slot->token_info.label)
+			|| memcmp(slot->token_info.label, label, len))
+		return 0;
+	for (i = len; i < sizeof(slot->token_info.label); i++)
+		if (slot->token_info.label[i] != ' ')
+			return 0;
+	return 1;
+}
+
+/* Pick the member with the fewest sessions. Once the user is logged in
+ * somewhere, members that are not logged in yet (a token that was just
+ * inserted) are only used when no other member is left. */
+static struct sc_pkcs11_slot *slot_balance_pick(void)
+{
+	struct sc_pkcs11_slot *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (!slot_is_balance_member(slot))
+			continue;
+		if (best != NULL) {
+			if (best->login_user >= 0 && slot->login_user < 0)
+				continue;
+			if ((best->login_user >= 0) == (slot->login_user >= 0)
+					&& best->nsessions <= slot->nsessions)
+				continue;
+		}
+		best = slot;
+	}
+	return best;
+}
+
+void slot_balance_login(struct sc_pkcs11_slot *done, CK_USER_TYPE userType,
+		CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (slot == done || slot->login_user >= 0 || !slot_is_balance_member(slot))
+			continue;
+		sc_pkcs11_lock_slot(slot);
+		rv = slot->card->framework->login(slot, userType, pPin, ulPinLen);
+		if (rv == CKR_OK)
+			slot->login_user = userType;
+		else
+			sc_log(context, "Slot(id=0x%lX): balance login failed: %s",
+				slot->id, lookup_enum(RV_T, rv));
+		sc_pkcs11_unlock_slot(slot);
+	}
+	sc_pkcs11_unlock();
+}
+
+void slot_balance_logout(struct sc_pkcs11_slot *done)
+{
+	unsigned int i;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (slot == done || slot->login_user < 0 || !slot_is_balance_member(slot))
+			continue;
+		sc_pkcs11_lock_slot(slot);
+		slot->login_user = -1;
+		slot->card->framework->logout(slot);
+		sc_pkcs11_unlock_slot(slot);
+	}
+	sc_pkcs11_unlock();
+}
+
+/*
+ * The user PIN of a slot may be the PIN of other slots of the card too,
+ * e.g. when its applications share a global PIN. The card keeps one
+ * security status for it, so do the slots: a login on one logs in the
+ * others without another VERIFY, a logout logs them all out, and the
+ * login lasts until the last session of all of them is closed.
+ */
+static int slot_shares_login(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *peer)
+{
+	return peer != slot && slot->card != NULL && peer->card == slot->card
+		&& slot->card->framework->same_user_pin != NULL
+		&& slot->card->framework->same_user_pin(slot, peer);
+}
+
+void slot_share_login(struct sc_pkcs11_slot *done, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	for (i = 0; done->card != NULL && done->card->framework->share_login != NULL
+			&& i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (slot->login_user >= 0 || !slot_shares_login(done, slot))
+			continue;
+		sc_pkcs11_lock_slot(slot);
+		rv = slot->card->framework->share_login(slot, pPin, ulPinLen);
+		if (rv == CKR_OK) {
+			slot->login_user = CKU_USER;
+			sc_log(context, "Slot(id=0x%lX): logged in through slot 0x%lX",
+				slot->id, done->id);
+		}
+		else {
+			sc_log(context, "Slot(id=0x%lX): shared login failed: %s",
+				slot->id, lookup_enum(RV_T, rv));
+		}
+		sc_pkcs11_unlock_slot(slot);
+	}
+	sc_pkcs11_unlock();
+}
+
+void slot_share_logout(struct sc_pkcs11_slot *done)
+{
+	unsigned int i;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (slot->login_user != CKU_USER || !slot_shares_login(done, slot))
+			continue;
+		sc_pkcs11_lock_slot(slot);
+		slot->login_user = -1;
+		slot->card->framework->logout(slot);
+		sc_pkcs11_unlock_slot(slot);
+	}
+	sc_pkcs11_unlock();
+}
+
+/* The last session of slot was closed, with the global lock and the
+ * reader lock held: keep the login while a slot sharing it still has
+ * sessions, otherwise log out those that kept it for slot. */
+int slot_keep_shared_login(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	if (slot->login_user != CKU_USER)
+		return 0;
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *peer = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (peer->nsessions > 0 && peer->login_user == CKU_USER
+				&& slot_shares_login(slot, peer))
+			return 1;
+	}
+	for (i = 0; i < vector_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *peer = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, i);
+
+		if (peer->login_user != CKU_USER || !slot_shares_login(slot, peer))
+			continue;
+		/* the slots of a card share the reader lock */
+		peer->login_user = -1;
+		peer->card->framework->logout(peer);
+	}
+	return 0;
+}
+
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 {
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
-	if (!*slot)
-		return CKR_SLOT_ID_INVALID;
-	return CKR_OK;
+	if (id == SC_PKCS11_BALANCE_SLOT_ID && sc_pkcs11_conf.load_balance_label) {
+		*slot = slot_balance_pick();
+		if (*slot == NULL)
+			return CKR_SLOT_ID_INVALID;
+		sc_log(context, "Slot(id=0x%lX): balanced to slot 0x%lX", id, (*slot)->id);
+		return CKR_OK;
+	}
+
+	/* Slot IDs are their index in virtual_slots, but for the hotplug
+	 * slot whose ID moves, see C_GetSlotList() */
+	if (id < vector_size(&virtual_slots)) {
+		*slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, id);
+		if ((*slot)->id == id)
+			return CKR_OK;
+	}
+	if (vector_size(&virtual_slots) > 0) {
+		*slot = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, 0);
+		if ((*slot)->id == id)
+			return CKR_OK;
+	}
+	*slot = NULL;
+	return CKR_SLOT_ID_INVALID;
 }
 
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
@@ -401,6 +968,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	int rv, token_was_present;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_object *object;
+	unsigned int i;
 
 	sc_log(context, "slot_token_removed(0x%lx)", id);
 	rv = slot_get_slot(id, &slot);
@@ -412,10 +980,15 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
-	while ((object = list_fetch(&slot->objects))) {
+	slot_drop_object_index(slot);
+	for (i = 0; i < vector_size(&slot->objects); i++) {
+		object = (struct sc_pkcs11_object *) vector_get(&slot->objects, i);
+		slot_unregister_object(slot, object);
+		object->views &= ~slot->view;
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	slot->objects.count = 0;
 
 	/* Release framework stuff */
 	if (slot->card != NULL) {
@@ -426,8 +999,10 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 
 	/* Reset relevant slot properties */
 	slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+	slot_list_changed();
 	slot->login_user = -1;
 	slot->card = NULL;
+	slot->view = 0;
 
 	if (token_was_present)
 		slot->events = SC_EVENT_CARD_REMOVED;
@@ -441,9 +1016,11 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	unsigned int i;
 	LOG_FUNC_CALLED(context);
 
-	card_detect_all();
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	/* The event monitor keeps the slots current */
+	if (!slot_monitor_active())
+		card_detect_all();
+	for (i=0; i<vector_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) vector_get(&virtual_slots, i);
 		sc_log(context, "slot 0x%lx token: %d events: 0x%02X",slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT), slot->events);
 		if ((slot->events & SC_EVENT_CARD_INSERTED)
 		    && !(slot->slot_info.flags & CKF_TOKEN_PRESENT)) {
@@ -460,3 +1037,297 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	LOG_FUNC_RETURN(context, CKR_NO_EVENT);
 }
+
+/*
+ * Object index: speeds up C_FindObjectsInit() on tokens with many objects.
+ * The slots created for the PINs of one application share their objects,
+ * so there is one index for all of them, kept with the card. It is built
+ * on the first search that uses an indexed attribute and dropped whenever
+ * the object list of one of these slots changes; searches skip the objects
+ * the slot does not see.
+ */
+
+/* Indexed attributes, from the least to the most selective. Chain builders
+ * look issuer certificates up by CKA_SUBJECT or by CKA_ISSUER and
+ * CKA_SERIAL_NUMBER, the serial number alone is selective enough. */
+static const CK_ATTRIBUTE_TYPE slot_indexed_types[] = {
+	CKA_CLASS, CKA_LABEL, CKA_SUBJECT, CKA_ID, CKA_SERIAL_NUMBER
+};
+#define SLOT_INDEXED_TYPES	(sizeof(slot_indexed_types)/sizeof(slot_indexed_types[0]))
+
+/* Returns 0 if the attribute is not indexed, its selectivity otherwise */
+int slot_is_indexed_attribute(CK_ATTRIBUTE_TYPE type)
+{
+	unsigned int i;
+
+	for (i = 0; i < SLOT_INDEXED_TYPES; i++)
+		if (slot_indexed_types[i] == type)
+			return i + 1;
+	return 0;
+}
+
+unsigned long slot_attribute_hash(CK_ATTRIBUTE_PTR attr)
+{
+	/* FNV-1a over the attribute type and value */
+	unsigned long hash = 2166136261UL;
+	const unsigned char *p = (const unsigned char *) attr->pValue;
+	CK_ULONG i, len = attr->ulValueLen;
+
+	/* Names match with and without their SEQUENCE, see pkcs15_cert_cmp_attribute() */
+	if ((attr->type == CKA_SUBJECT || attr->type == CKA_ISSUER) && len >= 2 && p[0] == 0x30) {
+		CK_ULONG hdr = (p[1] & 0x80) ? 2 + (p[1] & 0x7F) : 2;
+
+		if (hdr <= len) {
+			p += hdr;
+			len -= hdr;
+		}
+	}
+
+	hash = (hash ^ (attr->type & 0xFF)) * 16777619UL;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619UL;
+	return hash;
+}
+
+static CK_RV slot_index_attribute(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object_index *index, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_TYPE type)
+{
+	struct sc_pkcs11_object_index_entry *entry;
+	CK_ATTRIBUTE attr;
+	u8 buf[256];
+	u8 *value = NULL;
+	CK_RV rv;
+
+	attr.type = type;
+	attr.pValue = NULL;
+	attr.ulValueLen = 0;
+
+	/* Objects without the attribute cannot match it */
+	if (object->ops->get_attribute(session, object, &attr) != CKR_OK)
+		return CKR_OK;
+
+	if (attr.ulValueLen > sizeof(buf)) {
+		value = malloc(attr.ulValueLen);
+		if (value == NULL)
+			return CKR_HOST_MEMORY;
+		attr.pValue = value;
+	}
+	else {
+		attr.pValue = buf;
+	}
+
+	rv = object->ops->get_attribute(session, object, &attr);
+	if (rv != CKR_OK) {
+		rv = CKR_OK;
+		goto out;
+	}
+
+	entry = calloc(1, sizeof(struct sc_pkcs11_object_index_entry));
+	if (entry == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	entry->type = type;
+	entry->hash = slot_attribute_hash(&attr);
+	entry->object = object;
+	entry->next = index->buckets[entry->hash % SC_PKCS11_OBJECT_INDEX_SIZE];
+	index->buckets[entry->hash % SC_PKCS11_OBJECT_INDEX_SIZE] = entry;
+
+out:
+	if (value != NULL)
+		free(value);
+	return rv;
+}
+
+/* Slots sharing the index of the slot, including itself */
+static int slot_shares_index(const struct sc_pkcs11_slot *slot, const struct sc_pkcs11_slot *other)
+{
+	return other->card == slot->card && other->fw_data_idx == slot->fw_data_idx;
+}
+
+static struct sc_pkcs11_object_index **slot_object_index(struct sc_pkcs11_slot *slot)
+{
+	if (slot->card == NULL || slot->fw_data_idx < 0
+			|| slot->fw_data_idx >= SC_PKCS11_FRAMEWORK_DATA_MAX_NUM)
+		return NULL;
+	return &slot->card->object_index[slot->fw_data_idx];
+}
+
+static void slot_set_indexed(struct sc_pkcs11_slot *slot, int indexed)
+{
+	unsigned int i, k;
+
+	for (k = 0; k < vector_size(&virtual_slots); k++) {
+		struct sc_pkcs11_slot *other = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, k);
+
+		if (!slot_shares_index(slot, other))
+			continue;
+		for (i = 0; i < vector_size(&other->objects); i++) {
+			struct sc_pkcs11_object *object = (struct sc_pkcs11_object *) vector_get(&other->objects, i);
+
+			if (indexed)
+				object->flags |= SC_PKCS11_OBJECT_INDEXED;
+			else
+				object->flags &= ~SC_PKCS11_OBJECT_INDEXED;
+		}
+	}
+}
+
+/* Indexes the objects by one attribute, the first time it is searched for:
+ * the names and serial numbers of certificates are only known once they
+ * are read, searches by ID or label should not have to read them. */
+CK_RV slot_index_objects(struct sc_pkcs11_session *session, CK_ATTRIBUTE_TYPE type)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object_index *index, **pindex = slot_object_index(slot);
+	unsigned int i, k, count = 0, bit;
+	CK_RV rv = CKR_OK;
+
+	bit = slot_is_indexed_attribute(type);
+	if (pindex == NULL || bit == 0)
+		return CKR_FUNCTION_FAILED;
+	bit = 1U << (bit - 1);
+	if (*pindex != NULL && ((*pindex)->types & bit))
+		return CKR_OK;
+
+	index = *pindex;
+	if (index == NULL) {
+		index = calloc(1, sizeof(struct sc_pkcs11_object_index));
+		if (index == NULL)
+			return CKR_HOST_MEMORY;
+		*pindex = index;
+	}
+	index->types |= bit;
+
+	/* Walk the slots and their lists backwards, so that the buckets keep
+	 * the list order. Objects seen by several slots are indexed once. */
+	slot_set_indexed(slot, 0);
+	for (k = vector_size(&virtual_slots); k > 0 && rv == CKR_OK; k--) {
+		struct sc_pkcs11_slot *other = (struct sc_pkcs11_slot *) vector_get(&virtual_slots, k - 1);
+
+		if (!slot_shares_index(slot, other))
+			continue;
+		for (i = vector_size(&other->objects); i > 0 && rv == CKR_OK; i--) {
+			struct sc_pkcs11_object *object = (struct sc_pkcs11_object *) vector_get(&other->objects, i - 1);
+
+			if (object->flags & SC_PKCS11_OBJECT_INDEXED)
+				continue;
+			object->flags |= SC_PKCS11_OBJECT_INDEXED;
+			rv = slot_index_attribute(session, index, object, type);
+			count++;
+		}
+	}
+	slot_set_indexed(slot, 0);
+
+	if (rv != CKR_OK)
+		slot_drop_object_index(slot);
+	else
+		sc_log(context, "Slot 0x%lx: indexed %u objects of the card by 0x%lx", slot->id, count, type);
+	return rv;
+}
+
+int slot_has_object(const struct sc_pkcs11_slot *slot, const struct sc_pkcs11_object *object)
+{
+	if (slot->view != 0)
+		return (object->views & slot->view) != 0;
+	return vector_locate(&slot->objects, object) >= 0;
+}
+
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	CK_RV rv;
+
+	rv = slot_register_object(slot, object);
+	if (rv != CKR_OK)
+		return rv;
+	rv = vector_append(&slot->objects, object);
+	if (rv != CKR_OK) {
+		slot_unregister_object(slot, object);
+		return rv;
+	}
+	object->views |= slot->view;
+	slot_drop_object_index(slot);
+	return CKR_OK;
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	vector_delete(&slot->objects, object);
+	object->views &= ~slot->view;
+	slot_unregister_object(slot, object);
+	slot_drop_object_index(slot);
+}
+
+/*
+ * An object keeps the handle it got when it was first added to a slot.
+ * Its entry in the handle table records that slot, lookups through any
+ * other slot the object was added to fall back to the slot's list.
+ */
+CK_RV slot_register_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	if (object->handle != CK_INVALID_HANDLE)
+		return CKR_OK;
+	return handle_table_add(&object_handles, object, slot, &object->handle);
+}
+
+void slot_unregister_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	void *owner = NULL;
+
+	if (handle_table_get(&object_handles, object->handle, &owner) == object && owner == slot)
+		handle_table_remove(&object_handles, object->handle);
+}
+
+CK_RV slot_get_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle,
+		struct sc_pkcs11_object **object)
+{
+	void *owner = NULL;
+
+	unsigned int i;
+
+	*object = handle_table_get(&object_handles, handle, &owner);
+	if (*object != NULL && (owner == slot || slot_has_object(slot, *object)))
+		return CKR_OK;
+	for (i = 0; i < vector_size(&slot->objects); i++) {
+		*object = (struct sc_pkcs11_object *) vector_get(&slot->objects, i);
+		if ((*object)->handle == handle)
+			return CKR_OK;
+	}
+	*object = NULL;
+	return CKR_OBJECT_HANDLE_INVALID;
+}
+
+static void slot_free_object_index(struct sc_pkcs11_object_index **pindex)
+{
+	struct sc_pkcs11_object_index_entry *entry;
+	unsigned int i;
+
+	if (*pindex == NULL)
+		return;
+
+	for (i = 0; i < SC_PKCS11_OBJECT_INDEX_SIZE; i++) {
+		while ((entry = (*pindex)->buckets[i]) != NULL) {
+			(*pindex)->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(*pindex);
+	*pindex = NULL;
+}
+
+void slot_drop_object_index(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_object_index **pindex = slot_object_index(slot);
+
+	if (pindex != NULL)
+		slot_free_object_index(pindex);
+}
+
+void slot_free_object_indexes(struct sc_pkcs11_card *card)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; i++)
+		slot_free_object_index(&card->object_index[i]);
+}
@@ -377,6 +377,9 @@ authentic_pkcs15_add_access_rule(struct sc_pkcs15_object *object, unsigned acces
 {
 	int ii;
 
+	if (sc_pkcs15_object_access_rules(object) == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
 	for (ii=0;ii<SC_PKCS15_MAX_ACCESS_RULES;ii++)   {
 		if (!object->access_rules[ii].access_mode)   {
 			object->access_rules[ii].access_mode = access_mode;
@@ -454,7 +457,8 @@ authentic_pkcs15_fix_access(struct sc_pkcs15_card *p15card, struct sc_file *file
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "authID %s", sc_pkcs15_print_id(&object->auth_id));
 
-	memset(object->access_rules, 0, sizeof(object->access_rules));
+	if (object->access_rules)
+		memset(object->access_rules, 0, SC_PKCS15_MAX_ACCESS_RULES * sizeof(*object->access_rules));
 
 	for (ii=0; authentic_v3_rsa_map_attributes[ii].access_rule; ii++)   {
 		rv = authentic_pkcs15_fix_file_access_rule(p15card, file,
@@ -479,7 +483,7 @@ authentic_pkcs15_fix_usage(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 		struct sc_pkcs15_prkey_info *prkey_info = (struct sc_pkcs15_prkey_info *) object->data;
 
 		sc_log(ctx, "fix private key usage 0x%X", prkey_info->usage);
-        	for (ii=0;ii<SC_PKCS15_MAX_ACCESS_RULES;ii++)   {
+        	for (ii=0;object->access_rules && ii<SC_PKCS15_MAX_ACCESS_RULES;ii++)   {
 			if (!object->access_rules[ii].access_mode)
 				break;
 
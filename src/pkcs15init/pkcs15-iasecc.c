@@ -614,6 +614,9 @@ iasecc_pkcs15_add_access_rule(struct sc_pkcs15_object *object, unsigned access_m
 {
 	int ii;
 
+	if (sc_pkcs15_object_access_rules(object) == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
 	for (ii=0;ii<SC_PKCS15_MAX_ACCESS_RULES;ii++)   {
 		if (!object->access_rules[ii].access_mode)   {
 			object->access_rules[ii].access_mode = access_mode;
@@ -738,7 +741,8 @@ iasecc_pkcs15_fix_file_access(struct sc_pkcs15_card *p15card, struct sc_file *fi
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "authID %s", sc_pkcs15_print_id(&object->auth_id));
 
-	memset(object->access_rules, 0, sizeof(object->access_rules));
+	if (object->access_rules)
+		memset(object->access_rules, 0, SC_PKCS15_MAX_ACCESS_RULES * sizeof(*object->access_rules));
 
 	rv = iasecc_pkcs15_fix_file_access_rule(p15card, file, SC_AC_OP_READ, SC_PKCS15_ACCESS_RULE_MODE_READ, object);
 	LOG_TEST_RET(ctx, rv, "Fix file READ access error");
@@ -1698,7 +1702,9 @@ iasecc_store_data_object(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	do  {
 		const struct sc_acl_entry *acl;
 
-		memset(object->access_rules, 0, sizeof(object->access_rules));
+		if (sc_pkcs15_object_access_rules(object) == NULL)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		memset(object->access_rules, 0, SC_PKCS15_MAX_ACCESS_RULES * sizeof(*object->access_rules));
 
 		object->access_rules[0].access_mode = SC_PKCS15_ACCESS_RULE_MODE_READ;
 		acl = sc_file_get_acl_entry(file, SC_AC_OP_READ);
@@ -227,6 +227,9 @@ struct sc_pkcs15init_keygen_args {
 	const char *                   pubkey_label;
 };
 
+/* Running key generation, see sc_pkcs15init_generate_key_start() */
+struct sc_pkcs15init_keygen_job;
+
 struct sc_pkcs15init_pubkeyargs {
 	struct sc_pkcs15_id	id;
 	struct sc_pkcs15_id	auth_id;
@@ -283,6 +286,9 @@ extern void	sc_pkcs15init_set_callbacks(struct sc_pkcs15init_callbacks *);
 extern int	sc_pkcs15init_bind(struct sc_card *, const char *, const char *,
 				struct sc_app_info *app_info, struct sc_profile **);
 extern void	sc_pkcs15init_unbind(struct sc_profile *);
+extern void	sc_pkcs15init_begin_batch(struct sc_profile *);
+extern int	sc_pkcs15init_commit_batch(struct sc_pkcs15_card *,
+				struct sc_profile *);
 extern void	sc_pkcs15init_set_p15card(struct sc_profile *,
 				struct sc_pkcs15_card *);
 extern int	sc_pkcs15init_set_lifecycle(struct sc_card *, int);
@@ -302,6 +308,20 @@ extern int	sc_pkcs15init_generate_key(struct sc_pkcs15_card *,
 				struct sc_pkcs15init_keygen_args *,
 				unsigned int keybits,
 				struct sc_pkcs15_object **);
+extern int	sc_pkcs15init_update_unusedspace(struct sc_pkcs15_card *,
+				struct sc_profile *);
+extern int	sc_pkcs15init_generate_key_start(struct sc_pkcs15_card *,
+				struct sc_profile *,
+				struct sc_pkcs15init_keygen_args *,
+				unsigned int keybits,
+				struct sc_pkcs15init_keygen_job **);
+extern int	sc_pkcs15init_generate_key_finish(struct sc_pkcs15init_keygen_job *,
+				struct sc_pkcs15_object **);
+extern int	sc_pkcs15init_claim_key(struct sc_pkcs15_card *,
+				struct sc_profile *,
+				struct sc_pkcs15init_keygen_args *,
+				struct sc_pkcs15_object *prkey,
+				struct sc_pkcs15_object *pubkey);
 extern int	sc_pkcs15init_store_private_key(struct sc_pkcs15_card *,
 				struct sc_profile *,
 				struct sc_pkcs15init_prkeyargs *,
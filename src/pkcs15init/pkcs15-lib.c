@@ -45,6 +45,9 @@
 #include <strings.h>
 #endif
 #include <assert.h>
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/bn.h>
 #include <openssl/evp.h>
@@ -133,29 +136,69 @@ static struct profile_operations {
 	const char *name;
 	void *func;
 } profile_operations[] = {
+#ifndef DISABLE_DRIVER_RUTOKEN
 	{ "rutoken", (void *) sc_pkcs15init_get_rutoken_ops },
+#endif
+#ifndef DISABLE_DRIVER_GPK
 	{ "gpk", (void *) sc_pkcs15init_get_gpk_ops },
+#endif
+#ifndef DISABLE_DRIVER_MIOCOS
 	{ "miocos", (void *) sc_pkcs15init_get_miocos_ops },
+#endif
+#ifndef DISABLE_DRIVER_FLEX
 	{ "flex", (void *) sc_pkcs15init_get_cryptoflex_ops },
+#endif
+#ifndef DISABLE_DRIVER_CYBERFLEX
 	{ "cyberflex", (void *) sc_pkcs15init_get_cyberflex_ops },
+#endif
+#ifndef DISABLE_DRIVER_CARDOS
 	{ "cardos", (void *) sc_pkcs15init_get_cardos_ops },
 	{ "etoken", (void *) sc_pkcs15init_get_cardos_ops }, /* legacy */
+#endif
+#ifndef DISABLE_DRIVER_JCOP
 	{ "jcop", (void *) sc_pkcs15init_get_jcop_ops },
+#endif
+#ifndef DISABLE_DRIVER_STARCOS
 	{ "starcos", (void *) sc_pkcs15init_get_starcos_ops },
+#endif
+#ifndef DISABLE_DRIVER_OBERTHUR
 	{ "oberthur", (void *) sc_pkcs15init_get_oberthur_ops },
+#endif
+#ifndef DISABLE_DRIVER_OPENPGP
 	{ "openpgp", (void *) sc_pkcs15init_get_openpgp_ops },
+#endif
+#ifndef DISABLE_DRIVER_SETCOS
 	{ "setcos", (void *) sc_pkcs15init_get_setcos_ops },
+#endif
+#ifndef DISABLE_DRIVER_INCRYPTO34
 	{ "incrypto34", (void *) sc_pkcs15init_get_incrypto34_ops },
+#endif
 	{ "muscle", (void*) sc_pkcs15init_get_muscle_ops },
+#ifndef DISABLE_DRIVER_ASEPCOS
 	{ "asepcos", (void*) sc_pkcs15init_get_asepcos_ops },
+#endif
+#ifndef DISABLE_DRIVER_ENTERSAFE
 	{ "entersafe",(void*) sc_pkcs15init_get_entersafe_ops },
+#endif
+#ifndef DISABLE_DRIVER_EPASS2003
 	{ "epass2003",(void*) sc_pkcs15init_get_epass2003_ops },
+#endif
+#ifndef DISABLE_DRIVER_RUTOKEN_ECP
 	{ "rutoken_ecp", (void *) sc_pkcs15init_get_rtecp_ops },
+#endif
+#ifndef DISABLE_DRIVER_WESTCOS
 	{ "westcos", (void *) sc_pkcs15init_get_westcos_ops },
+#endif
+#ifndef DISABLE_DRIVER_MYEID
 	{ "myeid", (void *) sc_pkcs15init_get_myeid_ops },
+#endif
+#ifndef DISABLE_DRIVER_SC_HSM
 	{ "sc-hsm", (void *) sc_pkcs15init_get_sc_hsm_ops },
+#endif
 #ifdef ENABLE_OPENSSL
+#ifndef DISABLE_DRIVER_AUTHENTIC
 	{ "authentic", (void *) sc_pkcs15init_get_authentic_ops },
+#endif
 	{ "iasecc", (void *) sc_pkcs15init_get_iasecc_ops },
 #endif
 	{ NULL, NULL },
@@ -414,6 +457,12 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 	struct sc_context *ctx = profile->card->ctx;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.depth > 0 && profile->p15_data != NULL) {
+		profile->batch.depth = 1;
+		r = sc_pkcs15init_commit_batch(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to write pending DFs: %s", sc_strerror(r));
+	}
 	sc_log(ctx, "Pksc15init Unbind: %i:%p:%i", profile->dirty, profile->p15_data, profile->pkcs15.do_last_update);
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
@@ -510,6 +559,212 @@ sc_pkcs15init_erase_card(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 }
 
 
+/*
+ * Bulk erase of a file tree. The whole tree is listed first, and then
+ * deleted children first. The access conditions satisfied once are
+ * remembered, so that each PIN or key is presented once and not for
+ * every file; should the card still refuse a DELETE for its security
+ * status, they are forgotten and presented again. With the profile
+ * option delete-df-contents a DF is deleted at once, the card deleting
+ * its contents; file by file only if the card refuses that.
+ */
+#define ERASE_MAX_AUTH	8
+
+struct erase_plan {
+	struct sc_file **files;
+	size_t nfiles, size;
+	struct {
+		unsigned int method;
+		unsigned int key_ref;
+	} auth[ERASE_MAX_AUTH];
+	size_t nauth;
+	int lifecycle_set;
+};
+
+static int
+erase_auth_known(struct erase_plan *plan, const struct sc_acl_entry *acl)
+{
+	size_t i;
+
+	for (i = 0; i < plan->nauth; i++)
+		if (plan->auth[i].method == acl->method && plan->auth[i].key_ref == acl->key_ref)
+			return 1;
+	return 0;
+}
+
+static int
+erase_authenticate(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct erase_plan *plan, struct sc_file *file, int op)
+{
+	const struct sc_acl_entry *acl, *first = sc_file_get_acl_entry(file, op);
+	int r;
+
+	/* the ACLs of the file are read again by sc_pkcs15init_authenticate() */
+	if (!(p15card->card->caps & SC_CARD_CAP_USE_FCI_AC)) {
+		for (acl = first; acl; acl = acl->next) {
+			if (acl->method == SC_AC_NONE || acl->method == SC_AC_UNKNOWN)
+				return SC_SUCCESS;
+			if (!erase_auth_known(plan, acl))
+				break;
+		}
+		if (acl == NULL)
+			return SC_SUCCESS;
+	}
+
+	r = sc_pkcs15init_authenticate(profile, p15card, file, op);
+	if (r < 0 || (p15card->card->caps & SC_CARD_CAP_USE_FCI_AC))
+		return r;
+
+	for (acl = first; acl; acl = acl->next) {
+		if (acl->method == SC_AC_NONE || acl->method == SC_AC_UNKNOWN)
+			break;
+		if (!erase_auth_known(plan, acl) && plan->nauth < ERASE_MAX_AUTH) {
+			plan->auth[plan->nauth].method = acl->method;
+			plan->auth[plan->nauth].key_ref = acl->key_ref;
+			plan->nauth++;
+		}
+	}
+	return r;
+}
+
+static int
+erase_plan_add(struct erase_plan *plan, struct sc_file *file)
+{
+	if (plan->nfiles == plan->size) {
+		struct sc_file **tmp = realloc(plan->files, (plan->size + 32) * sizeof(*tmp));
+
+		if (tmp == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		plan->files = tmp;
+		plan->size += 32;
+	}
+	plan->files[plan->nfiles++] = file;
+	return SC_SUCCESS;
+}
+
+/* Adds the files below 'df' and then 'df' itself, which the plan owns then */
+static int
+erase_plan_build(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct erase_plan *plan, struct sc_file *df)
+{
+	unsigned char buffer[1024];
+	struct sc_path path;
+	struct sc_file *file;
+	int r, nfids;
+
+	if (df->type == SC_FILE_TYPE_DF && !profile->pkcs15.delete_df_contents) {
+		r = erase_authenticate(p15card, profile, plan, df, SC_AC_OP_LIST_FILES);
+		if (r >= 0)
+			r = sc_list_files(p15card->card, buffer, sizeof(buffer));
+		if (r < 0) {
+			sc_file_free(df);
+			return r;
+		}
+
+		path = df->path;
+		path.len += 2;
+
+		/* in reverse order, some cards want files deleted that way */
+		nfids = r / 2;
+		r = SC_SUCCESS;
+		while (r >= 0 && nfids--) {
+			path.value[path.len-2] = buffer[2*nfids];
+			path.value[path.len-1] = buffer[2*nfids+1];
+			r = sc_select_file(p15card->card, &path, &file);
+			if (r == SC_ERROR_FILE_NOT_FOUND) {
+				r = SC_SUCCESS;
+				continue;
+			}
+			if (r >= 0)
+				r = erase_plan_build(p15card, profile, plan, file);
+		}
+		if (r < 0) {
+			sc_file_free(df);
+			return r;
+		}
+	}
+
+	r = erase_plan_add(plan, df);
+	if (r < 0)
+		sc_file_free(df);
+	return r;
+}
+
+static int
+erase_delete(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct erase_plan *plan, struct sc_file *file)
+{
+	struct sc_path	path;
+	struct sc_file	*parent = NULL;
+	int		r;
+
+	path = file->path;
+	path.len -= 2;
+	r = sc_select_file(p15card->card, &path, &parent);
+	if (r < 0)
+		return r;
+
+	r = erase_authenticate(p15card, profile, plan, file, SC_AC_OP_DELETE);
+	if (r >= 0)
+		r = erase_authenticate(p15card, profile, plan, parent, SC_AC_OP_DELETE);
+	sc_file_free(parent);
+	if (r < 0)
+		return r;
+
+	memset(&path, 0, sizeof(path));
+	path.type = SC_PATH_TYPE_FILE_ID;
+	path.value[0] = file->id >> 8;
+	path.value[1] = file->id & 0xFF;
+	path.len = 2;
+
+	return sc_delete_file(p15card->card, &path);
+}
+
+static int
+sc_pkcs15init_erase_tree(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_file *top)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct erase_plan plan;
+	size_t	i;
+	int	r;
+
+	LOG_FUNC_CALLED(ctx);
+	memset(&plan, 0, sizeof(plan));
+
+	r = erase_plan_build(p15card, profile, &plan, top);
+	if (r >= 0) {
+		sc_log(ctx, "deleting %lu files below %s", (unsigned long) plan.nfiles,
+				sc_print_path(&plan.files[plan.nfiles - 1]->path));
+		/* ensure that the card is in the correct lifecycle */
+		r = sc_pkcs15init_set_lifecycle(p15card->card, SC_CARDCTRL_LIFECYCLE_ADMIN);
+		if (r == SC_ERROR_NOT_SUPPORTED)
+			r = SC_SUCCESS;
+	}
+
+	for (i = 0; r >= 0 && i < plan.nfiles; i++) {
+		struct sc_file *file = plan.files[i];
+
+		r = erase_delete(p15card, profile, &plan, file);
+		if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED && plan.nauth) {
+			/* the card may have lost what was presented, e.g. in another DF */
+			plan.nauth = 0;
+			r = erase_delete(p15card, profile, &plan, file);
+		}
+		if (r < 0 && r != SC_ERROR_SECURITY_STATUS_NOT_SATISFIED
+				&& file->type == SC_FILE_TYPE_DF && profile->pkcs15.delete_df_contents) {
+			sc_log(ctx, "cannot delete %s at once, deleting its files", sc_print_path(&file->path));
+			r = sc_pkcs15init_rmdir(p15card, profile, file);
+		}
+	}
+
+	for (i = 0; i < plan.nfiles; i++)
+		sc_file_free(plan.files[i]);
+	free(plan.files);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 int
 sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *p15card,
 		struct sc_profile *profile)
@@ -534,10 +789,8 @@ sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *p15card,
 	}
 
 	r = sc_select_file(p15card->card, &df->path, &df);
-	if (r >= 0) {
-		r = sc_pkcs15init_rmdir(p15card, profile, df);
-		sc_file_free(df);
-	}
+	if (r >= 0)
+		r = sc_pkcs15init_erase_tree(p15card, profile, df);
 	if (r == SC_ERROR_FILE_NOT_FOUND)
 		r = 0;
 
@@ -1378,6 +1631,165 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 }
 
 
+/*
+ * Key generation as a job: on-card generation of a large RSA key takes
+ * seconds to a minute, during which the application can prepare other
+ * cards or requests. Until sc_pkcs15init_generate_key_finish() returns,
+ * the job owns p15card, profile and keygen_args; they must be neither used
+ * nor freed by the caller. Other cards of the same context may be used
+ * meanwhile, as with the bind_workers option of the PKCS#11 module.
+ * Without threads the key is generated by ..._start() itself.
+ */
+struct sc_pkcs15init_keygen_job {
+	struct sc_pkcs15_card *p15card;
+	struct sc_profile *profile;
+	struct sc_pkcs15init_keygen_args keygen_args;
+	unsigned int keybits;
+	struct sc_pkcs15_object *object;
+	int result;
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	pthread_t thread;
+	int threaded;
+#endif
+};
+
+static void *
+sc_pkcs15init_keygen_main(void *arg)
+{
+	struct sc_pkcs15init_keygen_job *job = (struct sc_pkcs15init_keygen_job *)arg;
+
+	job->result = sc_pkcs15init_generate_key(job->p15card, job->profile,
+			&job->keygen_args, job->keybits, &job->object);
+	return NULL;
+}
+
+
+int
+sc_pkcs15init_generate_key_start(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15init_keygen_args *keygen_args, unsigned int keybits,
+		struct sc_pkcs15init_keygen_job **out)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15init_keygen_job *job;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!out)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	job->p15card = p15card;
+	job->profile = profile;
+	job->keygen_args = *keygen_args;
+	job->keybits = keybits;
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (pthread_create(&job->thread, NULL, sc_pkcs15init_keygen_main, job) == 0)
+		job->threaded = 1;
+	else
+		sc_log(ctx, "Cannot start key generation thread, generating in place");
+	if (!job->threaded)
+#endif
+		sc_pkcs15init_keygen_main(job);
+
+	*out = job;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Wait for the key generation job, return its result and free the job.
+ * On success *res_obj (when not NULL) is the new private key object,
+ * as returned by sc_pkcs15init_generate_key().
+ */
+int
+sc_pkcs15init_generate_key_finish(struct sc_pkcs15init_keygen_job *job,
+		struct sc_pkcs15_object **res_obj)
+{
+	int r;
+
+	if (!job)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (job->threaded)
+		pthread_join(job->thread, NULL);
+#endif
+	r = job->result;
+	if (r == SC_SUCCESS && res_obj)
+		*res_obj = job->object;
+	free(job);
+	return r;
+}
+
+
+/*
+ * Give a key pair generated earlier, e.g. into a pool of spare keys, the
+ * ID, labels and usage keygen_args ask for, as if it had been generated
+ * with them. The key material and the key file stay as they are.
+ */
+int
+sc_pkcs15init_claim_key(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15init_keygen_args *keygen_args,
+		struct sc_pkcs15_object *prkey_obj, struct sc_pkcs15_object *pubkey_obj)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15init_prkeyargs *keyargs = &keygen_args->prkey_args;
+	struct sc_pkcs15_prkey_info *prkey_info;
+	struct sc_pkcs15_pubkey_info *pubkey_info;
+	struct sc_pkcs15_object *other = NULL;
+	const char *label;
+	unsigned int usage;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!prkey_obj || !pubkey_obj || !prkey_obj->df || !pubkey_obj->df)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+	prkey_info = (struct sc_pkcs15_prkey_info *) prkey_obj->data;
+	pubkey_info = (struct sc_pkcs15_pubkey_info *) pubkey_obj->data;
+
+	if (keyargs->id.len) {
+		r = sc_pkcs15_find_prkey_by_id(p15card, &keyargs->id, &other);
+		if (r == SC_SUCCESS && other != prkey_obj)
+			LOG_TEST_RET(ctx, SC_ERROR_NON_UNIQUE_ID, "Non unique ID of the private key object");
+		prkey_info->id = keyargs->id;
+		pubkey_info->id = keyargs->id;
+		sc_pkcs15_clear_object_index(p15card);
+	}
+
+	if ((usage = keyargs->usage) == 0) {
+		usage = SC_PKCS15_PRKEY_USAGE_SIGN;
+		if (keyargs->x509_usage)
+			usage = sc_pkcs15init_map_usage(keyargs->x509_usage, 1);
+	}
+	prkey_info->usage = usage;
+	pubkey_info->usage = keyargs->x509_usage ? sc_pkcs15init_map_usage(keyargs->x509_usage, 0)
+		: SC_PKCS15_PRKEY_USAGE_VERIFY;
+
+	if ((label = keyargs->label) == NULL)
+		label = DEFAULT_PRIVATE_KEY_LABEL;
+	strlcpy(prkey_obj->label, label, sizeof(prkey_obj->label));
+	label = keygen_args->pubkey_label ? keygen_args->pubkey_label : prkey_obj->label;
+	strlcpy(pubkey_obj->label, label, sizeof(pubkey_obj->label));
+
+	if (profile->ops->emu_update_any_df) {
+		r = profile->ops->emu_update_any_df(profile, p15card, SC_AC_OP_CREATE, prkey_obj);
+		if (r >= 0)
+			r = profile->ops->emu_update_any_df(profile, p15card, SC_AC_OP_CREATE, pubkey_obj);
+		LOG_TEST_RET(ctx, r, "Card specific DF update failed");
+	}
+	else {
+		r = sc_pkcs15init_update_any_df(p15card, profile, prkey_obj->df, 0);
+		if (r >= 0 && pubkey_obj->df != prkey_obj->df)
+			r = sc_pkcs15init_update_any_df(p15card, profile, pubkey_obj->df, 0);
+		LOG_TEST_RET(ctx, r, "Failed to update the key DFs");
+	}
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
 /*
  * Store private key
  */
@@ -2590,6 +3002,33 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 }
 
 
+/*
+ * Write the free blocks of p15card->unusedspace_list back to the card
+ */
+int
+sc_pkcs15init_update_unusedspace(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned char	*buf = NULL;
+	size_t		size;
+	int		rv;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!p15card->file_unusedspace)   {
+		sc_log(ctx, "No UnusedSpace to update");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	rv = sc_pkcs15_encode_unusedspace(ctx, p15card, &buf, &size);
+	if (rv >= 0)
+		rv = sc_pkcs15init_update_file(profile, p15card, p15card->file_unusedspace, buf, size);
+	if (buf)
+		free(buf);
+
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+
 static int
 sc_pkcs15init_update_lastupdate(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
 {
@@ -2656,20 +3095,124 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 }
 
 /*
- * Update any PKCS15 DF file (except ODF and DIR)
+ * Write only the parts of an xDF that differ from what the card is known
+ * to hold: the last encoding written, or the entries read and parsed from
+ * the start of the file. Runs of changed bytes closer than DF_UPDATE_GAP
+ * are written together, as an APDU costs more than a few extra bytes.
+ * Returns SC_ERROR_NOT_SUPPORTED when the whole file has to be written.
  */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
+#define DF_UPDATE_GAP	8
+
+static int
+sc_pkcs15init_update_df_changes(struct sc_profile *profile,
+		struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		struct sc_file *file, const unsigned char *buf, size_t len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_card *card = p15card->card;
+	struct sc_file *selected = NULL;
+	const unsigned char *old;
+	unsigned char *zero = NULL;
+	size_t old_len, off, end, done = 0;
+	int r;
+
+	if (df->written) {
+		old = df->written;
+		old_len = df->written_len;
+	}
+	else if (df->data && df->enumerated && df->path.index == 0) {
+		old = df->data;
+		old_len = df->parsed;
+	}
+	else {
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	r = sc_select_file(card, &file->path, &selected);
+	if (r < 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (selected->ef_structure != SC_FILE_EF_TRANSPARENT || selected->size < len
+			|| selected->size < old_len) {
+		sc_file_free(selected);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+	if (r < 0)
+		goto out;
+
+	for (off = 0; off < len; off = end) {
+		size_t same;
+
+		if (off < old_len && buf[off] == old[off]) {
+			end = off + 1;
+			continue;
+		}
+		/* extend the run over short stretches of unchanged bytes */
+		for (end = off + 1, same = 0; end < len && same < DF_UPDATE_GAP; end++) {
+			if (end < old_len && buf[end] == old[end])
+				same++;
+			else
+				same = 0;
+		}
+		end -= same;
+		r = sc_update_binary(card, off, buf + off, end - off, 0);
+		if (r < 0)
+			goto out;
+		done += end - off;
+	}
+
+	if (len < old_len) {
+		/* clear the entries that were removed */
+		zero = calloc(1, old_len - len);
+		if (!zero) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		r = sc_update_binary(card, len, zero, old_len - len, 0);
+		if (r < 0)
+			goto out;
+		done += old_len - len;
+	}
+	else if (len < selected->size && (len > old_len
+			|| (!df->written && df->parsed == df->data_len))) {
+		/* what follows the known entries may not be zero */
+		static const unsigned char end_of_df = 0x00;
+
+		r = sc_update_binary(card, len, &end_of_df, 1, 0);
+		if (r < 0)
+			goto out;
+		done++;
+	}
+	/* the runs may have been held back (coalesce_writes) */
+	r = sc_flush_writes(card);
+	if (r < 0)
+		goto out;
+
+	sc_log(ctx, "DF %s: wrote %lu of %lu bytes", sc_print_path(&df->path),
+			(unsigned long) done, (unsigned long) len);
+	r = SC_SUCCESS;
+out:
+	free(zero);
+	sc_file_free(selected);
+	return r;
+}
+
+/*
+ * Encode and write one xDF; sets *update_odf if its ODF entry changed
+ */
+static int
+sc_pkcs15init_write_df(struct sc_pkcs15_card *p15card,
 		struct sc_profile *profile,
 		struct sc_pkcs15_df *df,
-		int is_new)
+		int *update_odf)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
 	struct sc_file	*file = NULL;
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
-	int		update_odf = is_new, r = 0;
+	int		r = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_profile_get_file_by_path(profile, &df->path, &file);
@@ -2678,7 +3221,21 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		r = SC_ERROR_NOT_SUPPORTED;
+		if (file)
+			r = sc_pkcs15init_update_df_changes(profile, p15card, df, file, buf, bufsize);
+		if (r == SC_ERROR_NOT_SUPPORTED)
+			r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+
+		/* Remember what the card holds now, for the next update */
+		free(df->written);
+		df->written = NULL;
+		df->written_len = 0;
+		if (r >= 0) {
+			df->written = buf;
+			df->written_len = bufsize;
+			buf = NULL;
+		}
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -2692,13 +3249,45 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 		if (profile->pkcs15.encode_df_length) {
 			df->path.count = bufsize;
 			df->path.index = 0;
-			update_odf = 1;
+			*update_odf = 1;
 		}
 		free(buf);
 	}
 	if (file)
 		sc_file_free(file);
 
+	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
+}
+
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	struct sc_context	*ctx = p15card->card->ctx;
+	int		update_odf = is_new, r = 0, i;
+
+	LOG_FUNC_CALLED(ctx);
+
+	/* Within a batch, just note what has to be written */
+	if (profile->batch.depth > 0) {
+		for (i = 0; i < profile->batch.ndfs; i++)
+			if (profile->batch.dfs[i] == df)
+				break;
+		if (i < profile->batch.ndfs || i < SC_PKCS15INIT_BATCH_MAX_DF) {
+			if (i == profile->batch.ndfs)
+				profile->batch.dfs[profile->batch.ndfs++] = df;
+			profile->batch.update_odf |= is_new;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* too many DFs to remember, write this one now */
+	}
+
+	r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
 	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
 
 	/* Now update the ODF if we have to */
@@ -2709,6 +3298,52 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
 }
 
+/*
+ * Batch session: between begin and commit, storing objects only
+ * updates the in-memory xDFs. Commit writes each touched xDF, then
+ * the ODF and the TokenInfo/lastUpdate a single time. Sessions nest;
+ * the outermost commit writes.
+ */
+void
+sc_pkcs15init_begin_batch(struct sc_profile *profile)
+{
+	if (profile->batch.depth++ == 0) {
+		profile->batch.ndfs = 0;
+		profile->batch.update_odf = 0;
+	}
+}
+
+int
+sc_pkcs15init_commit_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int i, r = SC_SUCCESS, update_odf;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.depth == 0 || --profile->batch.depth > 0)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	update_odf = profile->batch.update_odf;
+	sc_log(ctx, "commit %i DF(s)%s", profile->batch.ndfs, update_odf ? " and ODF" : "");
+	for (i = 0; r >= 0 && i < profile->batch.ndfs; i++)
+		r = sc_pkcs15init_write_df(p15card, profile, profile->batch.dfs[i], &update_odf);
+	profile->batch.ndfs = 0;
+	profile->batch.update_odf = 0;
+	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
+
+	if (update_odf) {
+		r = sc_pkcs15init_update_odf(p15card, profile);
+		LOG_TEST_RET(ctx, r, "Failed to encode or update ODF");
+	}
+
+	if (profile->dirty != 0 && profile->pkcs15.do_last_update) {
+		r = sc_pkcs15init_update_lastupdate(p15card, profile);
+		LOG_TEST_RET(ctx, r, "Failed to update TokenInfo");
+		profile->dirty = 0;
+	}
+	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
+}
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -2865,6 +3500,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 		default:
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot change ID attribute");
 		}
+		sc_pkcs15_clear_object_index(p15card);
 		break;
 	default:
 		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Only 'LABEL' or 'ID' attributes can be changed");
@@ -2941,6 +3577,18 @@ sc_pkcs15init_delete_object(struct sc_pkcs15_card *p15card, struct sc_profile *p
 			sc_file_free(file);
 		}
 
+		/* An object stored in a part of a shared EF only gives that part
+		 * back to UnusedSpace. */
+		if (r == SC_SUCCESS && stored_in_ef && path.count > 0 && p15card->file_unusedspace) {
+			r = sc_pkcs15_read_unusedspace(p15card);
+			LOG_TEST_RET(ctx, r, "Failed to read UnusedSpace");
+			r = sc_pkcs15_add_unusedspace(p15card, &path, &obj->auth_id);
+			LOG_TEST_RET(ctx, r, "Failed to release object space");
+			r = sc_pkcs15init_update_unusedspace(p15card, profile);
+			LOG_TEST_RET(ctx, r, "Failed to update UnusedSpace");
+			stored_in_ef = 0;
+		}
+
 		/* If the object is stored in a normal EF, try to delete the EF. */
 		if (r == SC_SUCCESS && stored_in_ef) {
 			r = sc_pkcs15init_delete_by_path(profile, p15card, &path);
@@ -3066,6 +3714,8 @@ sc_pkcs15init_update_certificate(struct sc_pkcs15_card *p15card,
 		if (r < 0)
 			sc_log(ctx, "Update cert file error");
 	}
+	if (r >= 0)
+		r = sc_flush_writes(p15card->card);
 
 	if (r >= 0) {
 		/* Update the CDF entry */
@@ -3534,6 +4184,12 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
 	if (r >= 0 && datalen)
 		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	/* report the error of a held back update here, not at sc_unlock() */
+	if (r >= 0) {
+		int rflush = sc_flush_writes(p15card->card);
+		if (rflush < 0)
+			r = rflush;
+	}
 
 	if (copy)
 		free(copy);
@@ -22,6 +22,9 @@ pkcs15 {
     encode-df-length	= no;
     # Have a lastUpdate field in the EF(TokenInfo)?
     do-last-update	= yes;
+    # Does DELETE FILE of a DF also delete the files in it? If so, erasing
+    # the card deletes the application DF at once instead of file by file.
+    delete-df-contents	= no;
     # Method to calculate ID of the crypto objects
     #     native: 'E' + number_of_present_objects_of_the_same_type
     #     mozilla: SHA1(modulus) for RSA, SHA1(pub) for DSA
@@ -28,6 +28,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
@@ -320,6 +321,46 @@ sc_profile_new(void)
 	return pro;
 }
 
+/*
+ * Parse a profile file, or load the snapshot of an earlier parse
+ * kept in the cache directory while the file is unchanged.
+ */
+static int
+sc_profile_parse(struct sc_context *ctx, scconf_context *conf, const char *filename)
+{
+	char dir[PATH_MAX], snapshot[PATH_MAX] = "", *p;
+	int use_cache = 0, i, res;
+
+	for (i = 0; ctx->conf_blocks[i]; i++)
+		use_cache = scconf_get_bool(ctx->conf_blocks[i], "profile_cache", use_cache);
+
+	if (use_cache && sc_get_cache_dir(ctx, dir, sizeof(dir)) == SC_SUCCESS) {
+		res = snprintf(snapshot, sizeof(snapshot), "%s/profile_%s.snapshot", dir, filename);
+		if (res < 0 || (size_t)res >= sizeof(snapshot))
+			snapshot[0] = '\0';
+		/* the profile name is not meant to be a path */
+		for (p = snapshot + strlen(dir) + 1; *p; p++)
+			if (*p == '/' || *p == '\\')
+				*p = '_';
+	}
+
+	if (snapshot[0] && scconf_read_snapshot(conf, snapshot) == 1) {
+		sc_log(ctx, "profile loaded from snapshot %s", snapshot);
+		return 1;
+	}
+
+	res = scconf_parse(conf);
+	if (res == 1 && snapshot[0]) {
+		int r = scconf_write_snapshot(conf, snapshot);
+
+		if (r == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+			r = scconf_write_snapshot(conf, snapshot);
+		if (r != 0)
+			sc_log(ctx, "cannot write profile snapshot %s", snapshot);
+	}
+	return res;
+}
+
 int
 sc_profile_load(struct sc_profile *profile, const char *filename)
 {
@@ -376,7 +417,7 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 	sc_log(ctx, "Trying profile file %s", path);
 
 	conf = scconf_new(path);
-	res = scconf_parse(conf);
+	res = sc_profile_parse(ctx, conf, filename);
 
 	sc_log(ctx, "profile %s loaded ok", path);
 
@@ -462,6 +503,8 @@ sc_profile_free(struct sc_profile *profile)
 		free(profile->name);
 
 	free_file_list(&profile->ef_list);
+	profile->ef_tail = NULL;
+	memset(profile->instances, 0, sizeof(profile->instances));
 
 	while ((ai = profile->auth_list) != NULL) {
 		profile->auth_list = ai->next;
@@ -664,6 +707,25 @@ sc_profile_add_file(sc_profile_t *profile, const char *name, sc_file_t *file)
 /*
  * Instantiate template
  */
+/*
+ * Issuing many cards or objects instantiates the same templates over and
+ * over; the instances are found by hashing what identifies them, rather
+ * than by walking the ever growing list of files.
+ */
+static unsigned int
+instance_hash(const struct sc_profile *tmpl, unsigned int idx,
+		const sc_path_t *base_path, const char *name)
+{
+	unsigned int h = (unsigned int) ((size_t) tmpl >> 4) ^ (idx * 31);
+	size_t i;
+
+	for (i = 0; i < base_path->len; i++)
+		h = h * 31 + base_path->value[i];
+	while (*name)
+		h = h * 31 + (unsigned char) *name++;
+	return h % SC_PKCS15INIT_INSTANCE_HASH;
+}
+
 int
 sc_profile_instantiate_template(sc_profile_t *profile,
 		const char *template_name, const sc_path_t *base_path,
@@ -673,7 +735,7 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 	struct sc_context *ctx = profile->card->ctx;
 	struct sc_profile	*tmpl;
 	struct sc_template	*info;
-	unsigned int	idx;
+	unsigned int	idx, hash;
 	struct file_info *fi, *base_file, *match = NULL;
 
 #ifdef DEBUG_PROFILE
@@ -690,7 +752,8 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 
 	tmpl = info->data;
 	idx = id->value[id->len-1];
-	for (fi = profile->ef_list; fi; fi = fi->next) {
+	hash = instance_hash(tmpl, idx, base_path, file_name);
+	for (fi = profile->instances[hash]; fi; fi = fi->inst_next) {
 		if (fi->base_template == tmpl
 		 && fi->inst_index == idx
 		 && sc_compare_path(&fi->inst_path, base_path)
@@ -732,6 +795,10 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 		instance->inst_index = idx;
 		instance->inst_path = *base_path;
 
+		hash = instance_hash(tmpl, idx, base_path, instance->ident);
+		instance->inst_next = profile->instances[hash];
+		profile->instances[hash] = instance;
+
 		if (!strcmp(instance->ident, file_name))
 			match = instance;
 	}
@@ -907,6 +974,12 @@ do_encode_update_field(struct state *cur, int argc, char **argv)
 	return get_bool(cur, argv[0], &cur->profile->pkcs15.do_last_update);
 }
 
+static int
+do_delete_df_contents(struct state *cur, int argc, char **argv)
+{
+	return get_bool(cur, argv[0], &cur->profile->pkcs15.delete_df_contents);
+}
+
 static int
 do_pkcs15_id_style(struct state *cur, int argc, char **argv)
 {
@@ -1148,10 +1221,11 @@ static void append_file(sc_profile_t *profile, struct file_info *nfile)
 {
 	struct file_info	**list, *fi;
 
-	list = &profile->ef_list;
+	list = profile->ef_tail ? &profile->ef_tail->next : &profile->ef_list;
 	while ((fi = *list) != NULL)
 		list = &fi->next;
 	*list = nfile;
+	profile->ef_tail = nfile;
 }
 
 /*
@@ -1847,6 +1921,7 @@ static struct command	p15_commands[] = {
  { "direct-certificates",	1,	1,	do_direct_certificates },
  { "encode-df-length",		1,	1,	do_encode_df_length },
  { "do-last-update",		1,	1,	do_encode_update_field },
+ { "delete-df-contents",	1,	1,	do_delete_df_contents },
  { "pkcs15-id-style",		1,	1,	do_pkcs15_id_style },
  { "minidriver-support-style",	1,	1,	do_minidriver_support_style },
  { NULL, 0, 0, NULL }
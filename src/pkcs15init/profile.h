@@ -38,6 +38,7 @@ struct file_info {
 	struct sc_profile *	base_template;
 	unsigned int		inst_index;
 	sc_path_t		inst_path;
+	struct file_info *	inst_next;	/* in sc_profile.instances */
 
         /* Profile extension dependent on the application ID (sub-profile).
 	 * Sub-profile is loaded when binding to the particular application
@@ -79,6 +80,8 @@ typedef struct sc_template {
 } sc_template_t;
 
 #define SC_PKCS15INIT_MAX_OPTIONS 16
+#define SC_PKCS15INIT_BATCH_MAX_DF 16
+#define SC_PKCS15INIT_INSTANCE_HASH 64
 struct sc_profile {
 	char *			name;
 	char *			options[SC_PKCS15INIT_MAX_OPTIONS];
@@ -91,6 +94,9 @@ struct sc_profile {
 	struct file_info *	mf_info;
 	struct file_info *	df_info;
 	struct file_info *	ef_list;
+	struct file_info *	ef_tail;
+	/* template instances by template, index, base path and name */
+	struct file_info *	instances[SC_PKCS15INIT_INSTANCE_HASH];
 	struct sc_file *	df[SC_PKCS15_DF_TYPE_COUNT];
 
 	struct pin_info *	pin_list;
@@ -112,6 +118,7 @@ struct sc_profile {
 		unsigned int	direct_certificates;
 		unsigned int	encode_df_length;
 		unsigned int	do_last_update;
+		unsigned int	delete_df_contents;
 	} pkcs15;
 
 	/* PKCS15 information */
@@ -122,6 +129,15 @@ struct sc_profile {
 	 * has been changed) */
 	int			dirty;
 
+	/* batch session (sc_pkcs15init_begin_batch): the xDFs and the
+	 * ODF are only written by sc_pkcs15init_commit_batch */
+	struct {
+		int		depth;
+		int		update_odf;
+		int		ndfs;
+		struct sc_pkcs15_df *dfs[SC_PKCS15INIT_BATCH_MAX_DF];
+	} batch;
+
 	/* PKCS15 object ID style */
 	unsigned int id_style;
 
@@ -49,6 +49,10 @@ typedef struct _scconf_parser {
 	char emesg[256];
 } scconf_parser;
 
+/* Hashed lookup of the items of block and its sub blocks by key */
+extern void scconf_index_build(scconf_block * block);
+extern void scconf_index_drop(scconf_block * block);
+
 extern int scconf_lex_parse(scconf_parser * parser, const char *filename);
 extern int scconf_lex_parse_string(scconf_parser * parser,
 				   const char *config_string);
@@ -115,6 +115,7 @@ static scconf_item *scconf_item_add_internal(scconf_parser * parser, int type)
 
 	item->key = parser->key;
 	parser->key = NULL;
+	scconf_index_drop(parser->block);
 
 	if (parser->last_item) {
 		parser->last_item->next = item;
@@ -388,6 +389,8 @@ int scconf_parse(scconf_context * config)
 
 	if (r <= 0)
 		config->errmsg = buffer;
+	else
+		scconf_index_build(config->root);
 	return r;
 }
 
@@ -415,5 +418,7 @@ int scconf_parse_string(scconf_context * config, const char *string)
 
 	if (r <= 0)
 		config->errmsg = buffer;
+	else
+		scconf_index_build(config->root);
 	return r;
 }
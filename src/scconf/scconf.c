@@ -30,6 +30,87 @@
 #include <ctype.h>
 
 #include "scconf.h"
+#include "internal.h"
+
+/* Blocks with fewer items are searched linearly */
+#define SCCONF_INDEX_MIN_ITEMS	8
+
+static unsigned int scconf_key_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (unsigned int) tolower((unsigned char) *key++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Each bucket chains its items in block order through 'key_next' */
+void scconf_index_build(scconf_block * block)
+{
+	scconf_item *item, **tails;
+	unsigned int count = 0, size, bucket;
+
+	if (!block) {
+		return;
+	}
+	scconf_index_drop(block);
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK) {
+			scconf_index_build(item->value.block);
+		}
+		if (item->key) {
+			count++;
+		}
+	}
+	if (count < SCCONF_INDEX_MIN_ITEMS) {
+		return;
+	}
+
+	for (size = SCCONF_INDEX_MIN_ITEMS; size < count; size <<= 1)
+		;
+	block->index = calloc(size, sizeof(scconf_item *));
+	tails = calloc(size, sizeof(scconf_item *));
+	if (!block->index || !tails) {
+		free(block->index);
+		free(tails);
+		block->index = NULL;
+		return;
+	}
+	block->index_mask = size - 1;
+	for (item = block->items; item; item = item->next) {
+		item->key_next = NULL;
+		if (!item->key) {
+			continue;
+		}
+		bucket = scconf_key_hash(item->key) & block->index_mask;
+		if (tails[bucket]) {
+			tails[bucket]->key_next = item;
+		} else {
+			block->index[bucket] = item;
+		}
+		tails[bucket] = item;
+	}
+	free(tails);
+}
+
+void scconf_index_drop(scconf_block * block)
+{
+	if (block && block->index) {
+		free(block->index);
+		block->index = NULL;
+		block->index_mask = 0;
+	}
+}
+
+/* The items that may have the given key, in block order */
+static scconf_item *scconf_first_item(const scconf_block * block, const char *key)
+{
+	return block->index ? block->index[scconf_key_hash(key) & block->index_mask] : block->items;
+}
+
+#define scconf_next_item(block, item)	((block)->index ? (item)->key_next : (item)->next)
 
 scconf_context *scconf_new(const char *filename)
 {
@@ -74,7 +155,7 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	if (!item_name) {
 		return NULL;
 	}
-	for (item = block->items; item; item = item->next) {
+	for (item = scconf_first_item(block, item_name); item; item = scconf_next_item(block, item)) {
 		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
 		    strcasecmp(item_name, item->key) == 0) {
 			return item->value.block;
@@ -83,6 +164,28 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	return NULL;
 }
 
+scconf_block *scconf_find_first_block(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
+{
+	scconf_item *item;
+
+	if (!block) {
+		block = config->root;
+	}
+	if (!item_name) {
+		return NULL;
+	}
+	for (item = scconf_first_item(block, item_name); item; item = scconf_next_item(block, item)) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
+		    strcasecmp(item_name, item->key) == 0) {
+			if (key && strcasecmp(key, item->value.block->name->data)) {
+				continue;
+			}
+			return item->value.block;
+		}
+	}
+	return NULL;
+}
+
 scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
 {
 	scconf_block **blocks = NULL, **tmp;
@@ -104,7 +207,7 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	}
 	blocks = tmp;
 
-	for (item = block->items; item; item = item->next) {
+	for (item = scconf_first_item(block, item_name); item; item = scconf_next_item(block, item)) {
 		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
 		    strcasecmp(item_name, item->key) == 0) {
 			if (key && strcasecmp(key, item->value.block->name->data)) {
@@ -133,7 +236,7 @@ const scconf_list *scconf_find_list(const scconf_block * block, const char *opti
 	if (!block)
 		return NULL;
 
-	for (item = block->items; item; item = item->next)
+	for (item = scconf_first_item(block, option); item; item = scconf_next_item(block, item))
 		if (item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, item->key) == 0)
 			return item->value.list;
 	return NULL;
@@ -303,6 +406,7 @@ void scconf_block_destroy(scconf_block * block)
 	if (block) {
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
+		free(block->index);
 		free(block);
 	}
 }
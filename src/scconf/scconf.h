@@ -65,6 +65,8 @@ typedef struct _scconf_list {
 
 typedef struct _scconf_item {
 	struct _scconf_item *next;
+	/* next item of the block in the same index bucket, used only internally */
+	struct _scconf_item *key_next;
 	int type;
 	char *key;
 	union {
@@ -78,6 +80,10 @@ struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	/* items by key, built once the configuration has been parsed and
+	 * dropped when an item is added, see scconf.c */
+	scconf_item **index;
+	unsigned int index_mask;
 };
 
 typedef struct {
@@ -116,6 +122,18 @@ extern int scconf_parse_entries(const scconf_context * config, const scconf_bloc
  */
 extern int scconf_write(scconf_context * config, const char *filename);
 
+/* Load the items of config->filename from a snapshot written by
+ * scconf_write_snapshot(), instead of parsing the file. The snapshot is
+ * only used if the file still has the recorded name, size and mtime.
+ * Returns 1 = ok, 0 = no usable snapshot (config is left empty)
+ */
+extern int scconf_read_snapshot(scconf_context * config, const char *snapshot);
+
+/* Write a binary snapshot of the parsed config->filename
+ * Returns 0 = ok, else = errno
+ */
+extern int scconf_write_snapshot(const scconf_context * config, const char *snapshot);
+
 /* Write configuration entries to block
  */
 extern int scconf_write_entries(scconf_context * config, scconf_block * block, scconf_entry * entry);
@@ -131,6 +149,12 @@ extern const scconf_block *scconf_find_block(const scconf_context * config, cons
  */
 extern scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key);
 
+/* Find the first block by the item_name whose first name is key
+ * Like scconf_find_blocks(), without allocating the result
+ * If the block is NULL, the root block is used
+ */
+extern scconf_block *scconf_find_first_block(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key);
+
 /* Get a list of values for option
  */
 extern const scconf_list *scconf_find_list(const scconf_block * block, const char *option);
@@ -0,0 +1,471 @@
+/*
+ * snapshot.c: binary snapshot of a parsed configuration
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The snapshot stores the item tree produced by scconf_parse() so that
+ * short lived processes can rebuild it without running the lexer. It is
+ * only used while the configuration file has the same name, size and
+ * modification time as when the snapshot was written.
+ *
+ * Layout, all integers in host byte order:
+ *	magic[8]	"SCCSNAP1"
+ *	u32		byte order mark 0x01020304
+ *	u32		checksum of everything after the header
+ *	u64		size of the snapshot body
+ *	u64		size of the configuration file
+ *	u64		modification time of the configuration file
+ *	string		name of the configuration file
+ *	items		items of the root block
+ *
+ * A string is a u32 length followed by the bytes, 0xFFFFFFFF is NULL.
+ * Items are a u32 count followed by, per item, a u8 type, the key and
+ * then either the comment, the value list or the block name list and
+ * items. A list is a u32 count followed by the strings.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_INTTYPES_H)
+#include <inttypes.h>
+#elif defined(HAVE_STDINT_H)
+#include <stdint.h>
+#elif defined(_MSC_VER)
+typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
+#endif
+
+#include "scconf.h"
+#include "internal.h"
+
+#define SNAPSHOT_MAGIC		"SCCSNAP1"
+#define SNAPSHOT_BOM		0x01020304U
+#define SNAPSHOT_HEADER_SIZE	(8 + 4 + 4 + 8)
+#define SNAPSHOT_NULL		0xFFFFFFFFU
+#define SNAPSHOT_MAX_DEPTH	32
+
+typedef struct {
+	unsigned char *data;
+	size_t len, alloc_len;
+	int error;
+} snapshot_writer;
+
+typedef struct {
+	const unsigned char *data;
+	size_t len, pos;
+} snapshot_reader;
+
+static unsigned int snapshot_checksum(const unsigned char *data, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--) {
+		h = (h ^ *data++) * 16777619U;
+	}
+	return h;
+}
+
+static void put_bytes(snapshot_writer * w, const void *data, size_t len)
+{
+	unsigned char *tmp;
+	size_t alloc_len;
+
+	if (w->error) {
+		return;
+	}
+	if (w->len + len > w->alloc_len) {
+		alloc_len = w->alloc_len ? w->alloc_len : 4096;
+		while (alloc_len < w->len + len) {
+			alloc_len *= 2;
+		}
+		tmp = realloc(w->data, alloc_len);
+		if (!tmp) {
+			w->error = ENOMEM;
+			return;
+		}
+		w->data = tmp;
+		w->alloc_len = alloc_len;
+	}
+	memcpy(w->data + w->len, data, len);
+	w->len += len;
+}
+
+static void put_u32(snapshot_writer * w, uint32_t value)
+{
+	put_bytes(w, &value, sizeof(value));
+}
+
+static void put_u64(snapshot_writer * w, uint64_t value)
+{
+	put_bytes(w, &value, sizeof(value));
+}
+
+static void put_string(snapshot_writer * w, const char *str)
+{
+	size_t len;
+
+	if (!str) {
+		put_u32(w, SNAPSHOT_NULL);
+		return;
+	}
+	len = strlen(str);
+	put_u32(w, (uint32_t) len);
+	put_bytes(w, str, len);
+}
+
+static void put_list(snapshot_writer * w, const scconf_list * list)
+{
+	put_u32(w, (uint32_t) scconf_list_array_length(list));
+	for (; list; list = list->next) {
+		put_string(w, list->data);
+	}
+}
+
+static void put_items(snapshot_writer * w, const scconf_item * items)
+{
+	const scconf_item *item;
+	uint32_t count = 0;
+	unsigned char type;
+
+	for (item = items; item; item = item->next) {
+		count++;
+	}
+	put_u32(w, count);
+	for (item = items; item; item = item->next) {
+		type = (unsigned char) item->type;
+		put_bytes(w, &type, 1);
+		put_string(w, item->key);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			put_string(w, item->value.comment);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			put_list(w, item->value.block ? item->value.block->name : NULL);
+			put_items(w, item->value.block ? item->value.block->items : NULL);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			put_list(w, item->value.list);
+			break;
+		default:
+			w->error = EINVAL;
+			break;
+		}
+	}
+}
+
+static int get_bytes(snapshot_reader * r, void *data, size_t len)
+{
+	if (r->len - r->pos < len) {
+		return 0;
+	}
+	memcpy(data, r->data + r->pos, len);
+	r->pos += len;
+	return 1;
+}
+
+static int get_u32(snapshot_reader * r, uint32_t * value)
+{
+	return get_bytes(r, value, sizeof(*value));
+}
+
+static int get_u64(snapshot_reader * r, uint64_t * value)
+{
+	return get_bytes(r, value, sizeof(*value));
+}
+
+/* Returns 1 and a malloc'ed string or NULL in 'str', or 0 on bad data */
+static int get_string(snapshot_reader * r, char **str)
+{
+	uint32_t len;
+
+	*str = NULL;
+	if (!get_u32(r, &len)) {
+		return 0;
+	}
+	if (len == SNAPSHOT_NULL) {
+		return 1;
+	}
+	if (r->len - r->pos < len) {
+		return 0;
+	}
+	*str = malloc((size_t) len + 1);
+	if (!*str) {
+		return 0;
+	}
+	memcpy(*str, r->data + r->pos, len);
+	(*str)[len] = '\0';
+	r->pos += len;
+	return 1;
+}
+
+static int get_list(snapshot_reader * r, scconf_list ** list)
+{
+	scconf_list *rec, **tail = list;
+	uint32_t count;
+
+	if (!get_u32(r, &count)) {
+		return 0;
+	}
+	while (count--) {
+		rec = malloc(sizeof(scconf_list));
+		if (!rec) {
+			return 0;
+		}
+		memset(rec, 0, sizeof(scconf_list));
+		*tail = rec;
+		tail = &rec->next;
+		if (!get_string(r, &rec->data)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int get_items(snapshot_reader * r, scconf_block * block, int depth)
+{
+	scconf_item *item, **tail = &block->items;
+	scconf_block *sub;
+	uint32_t count;
+	unsigned char type;
+
+	if (depth > SNAPSHOT_MAX_DEPTH || !get_u32(r, &count)) {
+		return 0;
+	}
+	while (count--) {
+		if (!get_bytes(r, &type, 1)) {
+			return 0;
+		}
+		item = malloc(sizeof(scconf_item));
+		if (!item) {
+			return 0;
+		}
+		memset(item, 0, sizeof(scconf_item));
+		item->type = type;
+		*tail = item;
+		tail = &item->next;
+		if (!get_string(r, &item->key)) {
+			return 0;
+		}
+		switch (type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			if (!get_string(r, &item->value.comment)) {
+				return 0;
+			}
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			sub = malloc(sizeof(scconf_block));
+			if (!sub) {
+				return 0;
+			}
+			memset(sub, 0, sizeof(scconf_block));
+			sub->parent = block;
+			item->value.block = sub;
+			if (!get_list(r, &sub->name) || !get_items(r, sub, depth + 1)) {
+				return 0;
+			}
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			if (!get_list(r, &item->value.list)) {
+				return 0;
+			}
+			break;
+		default:
+			/* not an item type scconf_item_destroy() would know */
+			item->type = SCCONF_ITEM_TYPE_COMMENT;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int read_file(const char *filename, unsigned char **data, size_t * len)
+{
+	FILE *f;
+	struct stat st;
+	unsigned char *buf;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		return 0;
+	}
+	if (fstat(fileno(f), &st) != 0 || st.st_size < SNAPSHOT_HEADER_SIZE) {
+		fclose(f);
+		return 0;
+	}
+	buf = malloc((size_t) st.st_size);
+	if (!buf) {
+		fclose(f);
+		return 0;
+	}
+	if (fread(buf, 1, (size_t) st.st_size, f) != (size_t) st.st_size) {
+		free(buf);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	*data = buf;
+	*len = (size_t) st.st_size;
+	return 1;
+}
+
+int scconf_read_snapshot(scconf_context * config, const char *snapshot)
+{
+	snapshot_reader r;
+	unsigned char *data = NULL;
+	size_t len = 0;
+	struct stat st;
+	uint32_t bom, checksum;
+	uint64_t body_len, size, mtime;
+	char *filename = NULL;
+	int ok;
+
+	if (!config || !config->filename || !snapshot || config->root->items) {
+		return 0;
+	}
+	if (stat(config->filename, &st) != 0) {
+		return 0;
+	}
+	if (!read_file(snapshot, &data, &len)) {
+		return 0;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.data = data;
+	r.len = len;
+	ok = memcmp(data, SNAPSHOT_MAGIC, 8) == 0;
+	r.pos = 8;
+	ok = ok && get_u32(&r, &bom) && bom == SNAPSHOT_BOM;
+	ok = ok && get_u32(&r, &checksum) && get_u64(&r, &body_len);
+	ok = ok && body_len == len - SNAPSHOT_HEADER_SIZE
+		&& checksum == snapshot_checksum(data + SNAPSHOT_HEADER_SIZE, len - SNAPSHOT_HEADER_SIZE);
+	ok = ok && get_u64(&r, &size) && get_u64(&r, &mtime);
+	ok = ok && size == (uint64_t) st.st_size && mtime == (uint64_t) st.st_mtime;
+	ok = ok && get_string(&r, &filename) && filename
+		&& strcmp(filename, config->filename) == 0;
+	ok = ok && get_items(&r, config->root, 0) && r.pos == r.len;
+
+	if (!ok) {
+		scconf_item_destroy(config->root->items);
+		config->root->items = NULL;
+	} else {
+		scconf_index_build(config->root);
+	}
+	free(filename);
+	free(data);
+	return ok ? 1 : 0;
+}
+
+int scconf_write_snapshot(const scconf_context * config, const char *snapshot)
+{
+	snapshot_writer w;
+	struct stat st;
+	uint32_t bom = SNAPSHOT_BOM, checksum;
+	uint64_t body_len;
+	char *tmpname;
+	size_t tmpname_len;
+	FILE *f;
+	int r = 0;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	if (!config || !config->filename || !snapshot) {
+		return EINVAL;
+	}
+	if (stat(config->filename, &st) != 0) {
+		return errno;
+	}
+
+	memset(&w, 0, sizeof(w));
+	put_bytes(&w, SNAPSHOT_MAGIC, 8);
+	put_u32(&w, bom);
+	put_u32(&w, 0);
+	put_u64(&w, 0);
+	put_u64(&w, (uint64_t) st.st_size);
+	put_u64(&w, (uint64_t) st.st_mtime);
+	put_string(&w, config->filename);
+	put_items(&w, config->root->items);
+	if (w.error) {
+		free(w.data);
+		return w.error;
+	}
+	body_len = w.len - SNAPSHOT_HEADER_SIZE;
+	checksum = snapshot_checksum(w.data + SNAPSHOT_HEADER_SIZE, body_len);
+	memcpy(w.data + 12, &checksum, sizeof(checksum));
+	memcpy(w.data + 16, &body_len, sizeof(body_len));
+
+	/* write aside and rename, readers never see a partial snapshot;
+	 * the name is unique, processes may write it at the same time */
+	tmpname_len = strlen(snapshot) + 8;
+	tmpname = malloc(tmpname_len);
+	if (!tmpname) {
+		free(w.data);
+		return ENOMEM;
+	}
+#ifdef _WIN32
+	snprintf(tmpname, tmpname_len, "%s.tmp", snapshot);
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		r = errno;
+	}
+#else
+	snprintf(tmpname, tmpname_len, "%s.XXXXXX", snapshot);
+	f = NULL;
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		r = errno;
+	} else {
+		f = fdopen(fd, "wb");
+		if (!f) {
+			r = errno;
+			close(fd);
+			remove(tmpname);
+		}
+	}
+#endif
+	if (f) {
+		if (fwrite(w.data, 1, w.len, f) != w.len) {
+			r = errno ? errno : EIO;
+		}
+		if (fclose(f) != 0 && !r) {
+			r = errno;
+		}
+#ifdef _WIN32
+		if (!r) {
+			remove(snapshot);
+		}
+#endif
+		if (!r && rename(tmpname, snapshot) != 0) {
+			r = errno;
+		}
+		if (r) {
+			remove(tmpname);
+		}
+	}
+	free(tmpname);
+	free(w.data);
+	return r;
+}
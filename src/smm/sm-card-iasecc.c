@@ -52,6 +52,57 @@ static const struct sc_asn1_entry c_asn1_iasecc_sm_data_object[4] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
+/*
+ * Secures the command 'ins p1 p2' with 'data' in chunks of 'max_data' bytes,
+ * all but the last one flagged as chained. The whole chain is secured in
+ * one pass, the SSC progressing from one chunk to the next as the card
+ * expects it.
+ */
+static int
+sm_iasecc_get_apdu_chain(struct sc_context *ctx, struct sm_info *sm_info, struct sc_remote_data *rdata,
+		unsigned ins, unsigned p1, unsigned p2, const unsigned char *data, size_t data_len,
+		size_t max_data, size_t le)
+{
+	size_t offs = 0;
+	int rv = SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!max_data)
+		max_data = SM_MAX_DATA_SIZE;
+	if (max_data > SM_MAX_EXT_DATA_SIZE)
+		max_data = SM_MAX_EXT_DATA_SIZE;
+
+	while (offs < data_len)   {
+		size_t len = (data_len - offs) > max_data ? max_data : (data_len - offs);
+		struct sc_remote_apdu *rapdu = NULL;
+
+		rv = rdata->alloc(rdata, &rapdu);
+		LOG_TEST_RET(ctx, rv, "SM get chained APDUs: cannot allocate remote APDU");
+
+		rapdu->apdu.cse = SC_APDU_CASE_3_SHORT;
+		rapdu->apdu.cla = len + offs < data_len ? 0x10 : 0x00;
+		rapdu->apdu.ins = ins;
+		rapdu->apdu.p1 = p1;
+		rapdu->apdu.p2 = p2;
+		memcpy((unsigned char *)rapdu->apdu.data, data + offs, len);
+		rapdu->apdu.datalen = len;
+		rapdu->apdu.lc = len;
+
+		/** 99 02 SW   8E 08 MAC **/
+		rapdu->apdu.le = len + offs < data_len ? 0x0E : le;
+
+		rv = sm_cwa_securize_apdu(ctx, sm_info, rapdu);
+		LOG_TEST_RET(ctx, rv, "SM get chained APDUs: securize APDU error");
+
+		rapdu->flags |= SC_REMOTE_APDU_FLAG_RETURN_ANSWER;
+
+		offs += len;
+	}
+
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+
 static int
 sm_iasecc_get_apdu_read_binary(struct sc_context *ctx, struct sm_info *sm_info, struct sc_remote_data *rdata)
 {
@@ -327,39 +378,18 @@ sm_iasecc_get_apdu_sdo_update(struct sc_context *ctx, struct sm_info *sm_info, s
 	sc_log(ctx, "SM get 'SDO UPDATE' APDU, SDO(class:0x%X,ref:%i)", update->sdo_class, update->sdo_ref);
 	for (ii=0; update->fields[ii].tag && ii < IASECC_SDO_TAGS_UPDATE_MAX; ii++)   {
 		unsigned char *encoded = NULL;
-		size_t encoded_len, offs;
+		size_t encoded_len;
 
 		encoded_len = iasecc_sdo_encode_update_field(ctx, update->sdo_class, update->sdo_ref, &update->fields[ii], &encoded);
 		LOG_TEST_RET(ctx, encoded_len, "SM get 'SDO UPDATE' APDU: encode component error");
 
 		sc_log(ctx, "SM IAS/ECC get APDUs: encoded component '%s'", sc_dump_hex(encoded, encoded_len));
 
-		for (offs = 0; offs < encoded_len; )   {
-			int len = (encoded_len - offs) > SM_MAX_DATA_SIZE ? SM_MAX_DATA_SIZE : (encoded_len - offs);
-			struct sc_remote_apdu *rapdu = NULL;
-
-		 	rv = rdata->alloc(rdata, &rapdu);
-	        	LOG_TEST_RET(ctx, rv, "SM get 'SDO UPDATE' APDUs: cannot allocate remote APDU");
-
-			rapdu->apdu.cse = SC_APDU_CASE_3_SHORT;
-			rapdu->apdu.cla = len + offs < encoded_len ? SC_APDU_FLAGS_CHAINING : 0x00;
-			rapdu->apdu.ins = 0xDB;
-			rapdu->apdu.p1 = 0x3F;
-			rapdu->apdu.p2 = 0xFF;
-			memcpy((unsigned char *)rapdu->apdu.data, encoded + offs, len);
-			rapdu->apdu.datalen = len;
-			rapdu->apdu.lc = len;
-
-			/** 99 02 SW   8E 08 MAC **/
-			rapdu->apdu.le = 0x0E;
-
-			rv = sm_cwa_securize_apdu(ctx, sm_info, rapdu);
-			LOG_TEST_RET(ctx, rv, "SM get 'SDO UPDATE' APDUs: securize APDU error");
-
-			rapdu->flags |= SC_REMOTE_APDU_FLAG_RETURN_ANSWER;
-
-			offs += len;
-		}
+		rv = sm_iasecc_get_apdu_chain(ctx, sm_info, rdata, 0xDB, 0x3F, 0xFF, encoded, encoded_len,
+				SM_MAX_DATA_SIZE, 0x0E);
+		if (rv < 0)
+			free(encoded);
+		LOG_TEST_RET(ctx, rv, "SM get 'SDO UPDATE' APDUs: cannot secure component");
 		free(encoded);
 	}
 	LOG_FUNC_RETURN(ctx, rv);
@@ -454,7 +484,7 @@ sm_iasecc_get_apdu_update_rsa(struct sc_context *ctx, struct sm_info *sm_info, s
 	for (jj=0;jj<2 && to_update[jj];jj++)   {
 		for (ii=0; to_update[jj]->fields[ii].tag && ii < IASECC_SDO_TAGS_UPDATE_MAX; ii++)   {
 			unsigned char *encoded = NULL;
-			size_t encoded_len, offs;
+			size_t encoded_len;
 
 			sc_log(ctx, "SM IAS/ECC get APDUs: component(num %i:%i) class:%X, ref:%X", jj, ii,
 					to_update[jj]->sdo_class, to_update[jj]->sdo_ref);
@@ -465,37 +495,75 @@ sm_iasecc_get_apdu_update_rsa(struct sc_context *ctx, struct sm_info *sm_info, s
 
 			sc_log(ctx, "SM IAS/ECC get APDUs: component encoded %s", sc_dump_hex(encoded, encoded_len));
 
-			for (offs = 0; offs < encoded_len; )   {
-				int len = (encoded_len - offs) > SM_MAX_DATA_SIZE ? SM_MAX_DATA_SIZE : (encoded_len - offs);
-				struct sc_remote_apdu *rapdu = NULL;
+			rv = sm_iasecc_get_apdu_chain(ctx, sm_info, rdata, 0xDB, 0x3F, 0xFF, encoded, encoded_len,
+					SM_MAX_DATA_SIZE, 0x0E);
+			if (rv < 0)
+				free(encoded);
+			LOG_TEST_RET(ctx, rv, "SM get 'UPDATE RSA' APDUs: cannot secure key component");
+			free(encoded);
+		}
+	}
 
-		 		rv = rdata->alloc(rdata, &rapdu);
-	        		LOG_TEST_RET(ctx, rv, "SM get 'UPDATE RSA' APDUs: cannot allocate remote APDU");
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
 
-				rapdu->apdu.cse = SC_APDU_CASE_3_SHORT;
-				rapdu->apdu.cla = len + offs < encoded_len ? 0x10 : 0x00;
-				rapdu->apdu.ins = 0xDB;
-				rapdu->apdu.p1 = 0x3F;
-				rapdu->apdu.p2 = 0xFF;
-				memcpy((unsigned char *)rapdu->apdu.data, encoded + offs, len);
-				rapdu->apdu.datalen = len;
-				rapdu->apdu.lc = len;
 
-				/** 99 02 SW   8E 08 MAC **/
-				rapdu->apdu.le = 0x0E;
+static int
+sm_iasecc_get_apdu_decipher(struct sc_context *ctx, struct sm_info *sm_info, struct sc_remote_data *rdata)
+{
+	struct iasecc_sm_cmd_pso *cmd_data = (struct iasecc_sm_cmd_pso *)sm_info->cmd_data;
+	int rv;
 
-				rv = sm_cwa_securize_apdu(ctx, sm_info, rapdu);
-		                LOG_TEST_RET(ctx, rv, "SM get 'UPDATE RSA' APDUs: securize APDU error");
+	LOG_FUNC_CALLED(ctx);
+	if (!cmd_data || !cmd_data->data || !cmd_data->data_len)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+	if (!rdata || !rdata->alloc)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
-				rapdu->flags |= SC_REMOTE_APDU_FLAG_RETURN_ANSWER;
+	sc_log(ctx, "SM get 'PSO DECIPHER' APDUs: data %i, chunk %i", cmd_data->data_len, cmd_data->max_data);
+	rv = sm_iasecc_get_apdu_chain(ctx, sm_info, rdata, 0x2A, 0x80, 0x86, cmd_data->data, cmd_data->data_len,
+			cmd_data->max_data, cmd_data->resp_len);
+	LOG_TEST_RET(ctx, rv, "SM get 'PSO DECIPHER' APDUs: cannot secure cryptogram");
 
-				offs += len;
-			}
-			free(encoded);
-		}
-	}
+	LOG_FUNC_RETURN(ctx, rv);
+}
 
-	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+static int
+sm_iasecc_get_apdu_sign_dst(struct sc_context *ctx, struct sm_info *sm_info, struct sc_remote_data *rdata)
+{
+	struct iasecc_sm_cmd_pso *cmd_data = (struct iasecc_sm_cmd_pso *)sm_info->cmd_data;
+	struct sc_remote_apdu *rapdu = NULL;
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!cmd_data || !cmd_data->data || !cmd_data->data_len)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+	if (!rdata || !rdata->alloc)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	sc_log(ctx, "SM get 'PSO DST' APDUs: data %i, signature %i", cmd_data->data_len, cmd_data->resp_len);
+	/* PSO HASH with the partial hash, then PSO COMPUTE SIGNATURE */
+	rv = sm_iasecc_get_apdu_chain(ctx, sm_info, rdata, 0x2A, 0x90, 0xA0, cmd_data->data, cmd_data->data_len,
+			cmd_data->max_data, 0x0E);
+	LOG_TEST_RET(ctx, rv, "SM get 'PSO DST' APDUs: cannot secure hash data");
+
+	rv = rdata->alloc(rdata, &rapdu);
+	LOG_TEST_RET(ctx, rv, "SM get 'PSO DST' APDUs: cannot allocate remote APDU");
+
+	rapdu->apdu.cse = SC_APDU_CASE_2_SHORT;
+	rapdu->apdu.cla = 0x00;
+	rapdu->apdu.ins = 0x2A;
+	rapdu->apdu.p1 = 0x9E;
+	rapdu->apdu.p2 = 0x9A;
+	rapdu->apdu.le = cmd_data->resp_len;
+
+	rv = sm_cwa_securize_apdu(ctx, sm_info, rapdu);
+	LOG_TEST_RET(ctx, rv, "SM get 'PSO DST' APDUs: securize APDU error");
+
+	rapdu->flags |= SC_REMOTE_APDU_FLAG_RETURN_ANSWER;
+
+	LOG_FUNC_RETURN(ctx, rv);
 }
 
 
@@ -558,6 +626,14 @@ sm_iasecc_get_apdus(struct sc_context *ctx, struct sm_info *sm_info,
 		rv = sm_iasecc_get_apdu_sdo_update(ctx, sm_info, rdata);
 		LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: 'SDO UPDATE' failed");
 		break;
+	case SM_CMD_PSO_DECIPHER:
+		rv = sm_iasecc_get_apdu_decipher(ctx, sm_info, rdata);
+		LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: 'PSO DECIPHER' failed");
+		break;
+	case SM_CMD_PSO_DST:
+		rv = sm_iasecc_get_apdu_sign_dst(ctx, sm_info, rdata);
+		LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: 'PSO DST' failed");
+		break;
 	case SM_CMD_PIN_VERIFY:
 		rv = sm_iasecc_get_apdu_verify_pin(ctx, sm_info, rdata);
 		LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: 'RAW APDU' failed");
@@ -589,7 +665,7 @@ sm_iasecc_decode_card_data(struct sc_context *ctx, struct sm_info *sm_info, stru
         for (rapdu = rdata->data; rapdu; rapdu = rapdu->next)   {
                 unsigned char *decrypted;
                 size_t decrypted_len;
-		unsigned char resp_data[SC_MAX_APDU_BUFFER_SIZE];
+		unsigned char resp_data[2*SC_MAX_APDU_BUFFER_SIZE];
 		size_t resp_len = sizeof(resp_data);
 		unsigned char status[2] = {0, 0};
 		size_t status_len = sizeof(status);
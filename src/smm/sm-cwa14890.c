@@ -60,37 +60,16 @@ int
 sm_cwa_get_mac(struct sc_context *ctx, unsigned char *key, DES_cblock *icv,
 			unsigned char *in, int in_len, DES_cblock *out, int force_padding)
 {
-	DES_cblock kk, k2;
-	DES_key_schedule ks,ks2;
-	unsigned char padding[8] = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char *buf;
+	struct sm_des_mac mac;
 
 	LOG_FUNC_CALLED(ctx);
-	sc_log(ctx, "sm_cwa_get_mac() data length %i", in_len);
-
-	buf = malloc(in_len + 8);
-	if (!buf)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-
 	sc_log(ctx, "sm_cwa_get_mac() in_data(%i) %s", in_len, sc_dump_hex(in, in_len));
-	memcpy(buf, in, in_len);
-	memcpy(buf + in_len, padding, 8);
-
-	if (force_padding)
-		in_len = ((in_len + 8) / 8) * 8;
-	else
-		in_len = ((in_len + 7) / 8) * 8;
-
-	sc_log(ctx, "sm_cwa_get_mac() data to MAC(%i) %s", in_len, sc_dump_hex(buf, in_len));
 	sc_log(ctx, "sm_cwa_get_mac() ICV %s", sc_dump_hex((unsigned char *)icv, 8));
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-	DES_cbc_cksum_3des_emv96(buf, out, in_len ,&ks, &ks2, icv);
+	sm_des_mac_init(&mac, key, (const_DES_cblock *)icv, 1);
+	sm_des_mac_update(&mac, in, in_len);
+	sm_des_mac_final(&mac, force_padding, out);
 
-	free(buf);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -308,8 +287,9 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 	struct sc_apdu *apdu = &rapdu->apdu;
 	unsigned char sbuf[0x400];
 	DES_cblock cblock, icv;
-	unsigned char *encrypted = NULL, edfb_data[0x200], mac_data[0x200];
-	size_t encrypted_len, edfb_len = 0, mac_len = 0, offs;
+	unsigned char *encrypted = NULL, edfb_data[0x200], header[8], tle[3];
+	struct sm_des_mac mac;
+	size_t encrypted_len, edfb_len = 0, do_len, offs;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -322,20 +302,25 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 	LOG_TEST_RET(ctx, rv, "securize APDU: DES CBC3 encryption failed");
 	sc_log(ctx, "encrypted data (len:%i, %s)", encrypted_len, sc_dump_hex(encrypted, encrypted_len));
 
+	if (encrypted_len + 5 > sizeof(edfb_data))   {
+		free(encrypted);
+		LOG_TEST_RET(ctx, SC_ERROR_BUFFER_TOO_SMALL, "securize APDU: too much data to secure");
+	}
+
 	offs = 0;
-	if (apdu->ins & 0x01)   {
-		edfb_data[offs++] = IASECC_SM_DO_TAG_TCG_ODD_INS;
-		if (encrypted_len + 1 > 0x7F)
-			edfb_data[offs++] = 0x81;
-		edfb_data[offs++] = encrypted_len;
+	do_len = (apdu->ins & 0x01) ? encrypted_len : encrypted_len + 1;
+	edfb_data[offs++] = (apdu->ins & 0x01) ? IASECC_SM_DO_TAG_TCG_ODD_INS : IASECC_SM_DO_TAG_TCG_EVEN_INS;
+	if (do_len > 0xFF)   {
+		/* data of an extended length command */
+		edfb_data[offs++] = 0x82;
+		edfb_data[offs++] = (do_len >> 8) & 0xFF;
 	}
-	else   {
-		edfb_data[offs++] = IASECC_SM_DO_TAG_TCG_EVEN_INS;
-		if (encrypted_len + 1 > 0x7F)
-			edfb_data[offs++] = 0x81;
-		edfb_data[offs++] = encrypted_len + 1;
-		edfb_data[offs++] = 0x01;
+	else if (encrypted_len + 1 > 0x7F)   {
+		edfb_data[offs++] = 0x81;
 	}
+	edfb_data[offs++] = do_len & 0xFF;
+	if (!(apdu->ins & 0x01))
+		edfb_data[offs++] = 0x01;
 	memcpy(edfb_data + offs, encrypted, encrypted_len);
 	offs += encrypted_len;
 	edfb_len = offs;
@@ -344,33 +329,27 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 	free(encrypted);
 	encrypted = NULL;
 
-	offs = 0;
-	memcpy(mac_data + offs, session_data->ssc, 8);
-	offs += 8;
-	mac_data[offs++] = apdu->cla | 0x0C;
-	mac_data[offs++] = apdu->ins;
-	mac_data[offs++] = apdu->p1;
-	mac_data[offs++] = apdu->p2;
-	mac_data[offs++] = 0x80;
-	mac_data[offs++] = 0x00;
-	mac_data[offs++] = 0x00;
-	mac_data[offs++] = 0x00;
-
-	memcpy(mac_data + offs, edfb_data, edfb_len);
-	offs += edfb_len;
+	/* MAC over SSC, padded header, EDFB and Le, absorbed in place */
+	header[0] = apdu->cla | 0x0C;
+	header[1] = apdu->ins;
+	header[2] = apdu->p1;
+	header[3] = apdu->p2;
+	header[4] = 0x80;
+	header[5] = header[6] = header[7] = 0x00;
 
 	/* if (apdu->le)   { */
-		mac_data[offs++] = IASECC_SM_DO_TAG_TLE;
-		mac_data[offs++] = 1;
-		mac_data[offs++] = apdu->le;
+		tle[0] = IASECC_SM_DO_TAG_TLE;
+		tle[1] = 1;
+		tle[2] = apdu->le;
 	/* } */
 
-	mac_len = offs;
-	sc_log(ctx, "securize APDU: MAC data(len:%i,%s)", mac_len, sc_dump_hex(mac_data, mac_len));
-
 	memset(icv, 0, sizeof(icv));
-	rv = sm_cwa_get_mac(ctx, session_data->session_mac, &icv, mac_data, mac_len, &cblock, 0);
-	LOG_TEST_RET(ctx, rv, "securize APDU: MAC calculation error");
+	sm_des_mac_init(&mac, session_data->session_mac, (const_DES_cblock *)&icv, 1);
+	sm_des_mac_update(&mac, session_data->ssc, 8);
+	sm_des_mac_update(&mac, header, sizeof(header));
+	sm_des_mac_update(&mac, edfb_data, edfb_len);
+	sm_des_mac_update(&mac, tle, sizeof(tle));
+	sm_des_mac_final(&mac, 0, &cblock);
 	sc_log(ctx, "securize APDU: MAC:%s", sc_dump_hex(cblock, sizeof(cblock)));
 
 	offs = 0;
@@ -394,7 +373,14 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 	if (offs > sizeof(rapdu->sbuf))
 		LOG_TEST_RET(ctx, SC_ERROR_BUFFER_TOO_SMALL, "securize APDU: buffer too small for encrypted data");
 
-	apdu->cse = SC_APDU_CASE_4_SHORT;
+	if (offs > 0xFF)   {
+		/* the secured answer may be longer than 256 bytes as well */
+		apdu->cse = SC_APDU_CASE_4_EXT;
+		apdu->le = apdu->resplen;
+	}
+	else   {
+		apdu->cse = SC_APDU_CASE_4_SHORT;
+	}
 	apdu->cla |= 0x0C;
 	apdu->lc = offs;
 	apdu->datalen = offs;
@@ -108,7 +108,7 @@ sc_gp_get_session_key(struct sc_context *ctx, struct sm_gp_session *gp_session,
 		unsigned char *key)
 {
 	int out_len;
-	unsigned char *out;
+	unsigned char *out, *session_key;
 	unsigned char deriv[16];
 
 	memcpy(deriv,		gp_session->card_challenge + 4,	4);
@@ -130,7 +130,13 @@ sc_gp_get_session_key(struct sc_context *ctx, struct sm_gp_session *gp_session,
 		return NULL;
 	}
 
-	return out;
+	session_key = sc_mem_alloc_secure(ctx, 16);
+	if (session_key)
+		memcpy(session_key, out, 16);
+	sc_mem_clear(out, 16);
+	free(out);
+
+	return session_key;
 }
 
 
@@ -167,28 +173,12 @@ int
 sm_gp_get_mac(unsigned char *key, DES_cblock *icv,
 		unsigned char *in, int in_len, DES_cblock *out)
 {
-	int len;
-	unsigned char *block;
-	DES_cblock kk, k2;
-	DES_key_schedule ks,ks2;
-
-	block = malloc(in_len + 8);
-	if (!block)
-		return SC_ERROR_OUT_OF_MEMORY;
-
-	memcpy(block, in, in_len);
-	memcpy(block + in_len, "\x80\0\0\0\0\0\0\0", 8);
-	len = in_len + 8;
-	len -= (len%8);
+	struct sm_des_mac mac;
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	DES_cbc_cksum_3des(block, out, len ,&ks, &ks2, icv);
+	sm_des_mac_init(&mac, key, (const_DES_cblock *)icv, 0);
+	sm_des_mac_update(&mac, in, in_len);
+	sm_des_mac_final(&mac, 1, out);
 
-	free(block);
 	return 0;
 }
 
@@ -251,9 +241,9 @@ sm_gp_init_session(struct sc_context *ctx, struct sm_gp_session *gp_session,
 void
 sm_gp_close_session(struct sc_context *ctx, struct sm_gp_session *gp_session)
 {
-	free(gp_session->session_enc);
-	free(gp_session->session_mac);
-	free(gp_session->session_kek);
+	sc_mem_free_secure(gp_session->session_enc, 16);
+	sc_mem_free_secure(gp_session->session_mac, 16);
+	sc_mem_free_secure(gp_session->session_kek, 16);
 }
 
 
@@ -361,7 +351,8 @@ int
 sm_gp_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info,
 		char *init_data, struct sc_apdu *apdu)
 {
-	unsigned char  buff[SC_MAX_APDU_BUFFER_SIZE + 24];
+	unsigned char  header[5];
+	struct sm_des_mac mac_ctx;
 	unsigned char *apdu_data = NULL;
 	struct sm_gp_session *gp_session = &sm_info->session.gp;
 	unsigned gp_level = sm_info->session.gp.params.level;
@@ -369,7 +360,6 @@ sm_gp_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info,
 	DES_cblock mac;
 	unsigned char *encrypted = NULL;
 	size_t encrypted_len = 0;
-	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 
@@ -401,16 +391,17 @@ sm_gp_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info,
 		LOG_TEST_RET(ctx, SC_ERROR_SM_INVALID_LEVEL, "SM GP securize APDU: invalid SM level");
 	}
 
-	buff[0] = apdu->cla | 0x04;
-	buff[1] = apdu->ins;
-	buff[2] = apdu->p1;
-	buff[3] = apdu->p2;
-	buff[4] = apdu->lc + 8;
-
-	memcpy(buff + 5, apdu_data, apdu->datalen);
+	header[0] = apdu->cla | 0x04;
+	header[1] = apdu->ins;
+	header[2] = apdu->p1;
+	header[3] = apdu->p2;
+	header[4] = apdu->lc + 8;
 
-	rv = sm_gp_get_mac(gp_session->session_mac, &gp_session->mac_icv, buff, 5 + apdu->datalen, &mac);
-	LOG_TEST_RET(ctx, rv, "SM GP securize APDU: get MAC error");
+	/* MAC the header and the plain data where they are */
+	sm_des_mac_init(&mac_ctx, gp_session->session_mac, (const_DES_cblock *)&gp_session->mac_icv, 0);
+	sm_des_mac_update(&mac_ctx, header, sizeof(header));
+	sm_des_mac_update(&mac_ctx, apdu_data, apdu->datalen);
+	sm_des_mac_final(&mac_ctx, 1, &mac);
 
 	if (gp_level == SM_GP_SECURITY_MAC)   {
 		memcpy(apdu_data + apdu->datalen, mac, 8);
@@ -442,7 +433,7 @@ sm_gp_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info,
 
 	memcpy(sm_info->session.gp.mac_icv, mac, 8);
 
-	LOG_FUNC_RETURN(ctx, rv);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
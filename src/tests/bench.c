@@ -0,0 +1,549 @@
+/*
+ * Microbenchmarks of host side libopensc primitives
+ *
+ * Each benchmark is run with a doubling number of iterations until a
+ * round takes at least the minimum time, then measured over several
+ * rounds; the fastest round is reported, which is the least disturbed
+ * by the rest of the system. The inputs are built in memory (or are
+ * embedded below), so results are comparable between runs and builds.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "common/compat_getopt.h"
+#include "libopensc/opensc.h"
+#include "libopensc/internal.h"
+#include "libopensc/asn1.h"
+#include "libopensc/pkcs15.h"
+#include "libopensc/compression.h"
+#include "scconf/scconf.h"
+
+#define BENCH_DF_ENTRIES	8
+
+/* self-signed RSA 2048 certificate, CN=OpenSC benchmark */
+static const u8 bench_cert[] = {
+	0x30, 0x82, 0x03, 0x39, 0x30, 0x82, 0x02, 0x21, 0xa0, 0x03, 0x02, 0x01,
+	0x02, 0x02, 0x14, 0x7a, 0x3a, 0x78, 0x32, 0x4b, 0xed, 0x03, 0x81, 0xb6,
+	0x05, 0x41, 0x7b, 0x41, 0x5d, 0x35, 0x15, 0x80, 0xa4, 0xfb, 0x24, 0x30,
+	0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b,
+	0x05, 0x00, 0x30, 0x2c, 0x31, 0x19, 0x30, 0x17, 0x06, 0x03, 0x55, 0x04,
+	0x03, 0x0c, 0x10, 0x4f, 0x70, 0x65, 0x6e, 0x53, 0x43, 0x20, 0x62, 0x65,
+	0x6e, 0x63, 0x68, 0x6d, 0x61, 0x72, 0x6b, 0x31, 0x0f, 0x30, 0x0d, 0x06,
+	0x03, 0x55, 0x04, 0x0a, 0x0c, 0x06, 0x4f, 0x70, 0x65, 0x6e, 0x53, 0x43,
+	0x30, 0x1e, 0x17, 0x0d, 0x32, 0x36, 0x31, 0x30, 0x31, 0x34, 0x31, 0x37,
+	0x33, 0x32, 0x32, 0x30, 0x5a, 0x17, 0x0d, 0x33, 0x36, 0x31, 0x30, 0x31,
+	0x31, 0x31, 0x37, 0x33, 0x32, 0x32, 0x30, 0x5a, 0x30, 0x2c, 0x31, 0x19,
+	0x30, 0x17, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0c, 0x10, 0x4f, 0x70, 0x65,
+	0x6e, 0x53, 0x43, 0x20, 0x62, 0x65, 0x6e, 0x63, 0x68, 0x6d, 0x61, 0x72,
+	0x6b, 0x31, 0x0f, 0x30, 0x0d, 0x06, 0x03, 0x55, 0x04, 0x0a, 0x0c, 0x06,
+	0x4f, 0x70, 0x65, 0x6e, 0x53, 0x43, 0x30, 0x82, 0x01, 0x22, 0x30, 0x0d,
+	0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01, 0x05,
+	0x00, 0x03, 0x82, 0x01, 0x0f, 0x00, 0x30, 0x82, 0x01, 0x0a, 0x02, 0x82,
+	0x01, 0x01, 0x00, 0xb9, 0x18, 0xe5, 0x22, 0xc2, 0x9e, 0x0d, 0xc5, 0xbe,
+	0x62, 0xb5, 0x4e, 0xf3, 0xcf, 0x2a, 0xcf, 0xdf, 0x41, 0x3b, 0x49, 0x8d,
+	0x49, 0x2a, 0x1e, 0x56, 0x40, 0xb5, 0x1d, 0xf1, 0x29, 0xf4, 0x03, 0xbb,
+	0x21, 0x2a, 0x13, 0xf6, 0x66, 0xdb, 0xca, 0x7a, 0xda, 0xf1, 0x3d, 0x58,
+	0x27, 0xaa, 0xac, 0xaa, 0xed, 0x14, 0xd4, 0xab, 0xe3, 0x19, 0xdd, 0x8a,
+	0xc2, 0xcc, 0xa5, 0xd1, 0xf1, 0xb4, 0x0f, 0x8e, 0x00, 0x25, 0x70, 0xca,
+	0x85, 0x4c, 0x1b, 0xb9, 0x9b, 0x0c, 0x00, 0x9d, 0x18, 0x52, 0xd5, 0x9f,
+	0x0b, 0x67, 0x94, 0x2a, 0xfe, 0xab, 0x6c, 0x44, 0x12, 0xe3, 0x8e, 0x15,
+	0x75, 0xbe, 0xf6, 0xe6, 0xe6, 0xd3, 0x79, 0x77, 0x39, 0xf6, 0xd4, 0xa6,
+	0x9c, 0xed, 0xaf, 0xde, 0xc5, 0x13, 0x76, 0xda, 0x4a, 0x33, 0xd7, 0xea,
+	0xee, 0x11, 0x59, 0xd2, 0x7b, 0x42, 0x6e, 0x1c, 0x62, 0x90, 0xb8, 0x41,
+	0x48, 0x27, 0xa7, 0xb5, 0xd9, 0xa4, 0xdd, 0xa2, 0x9b, 0xae, 0x62, 0xac,
+	0x70, 0x6c, 0x1e, 0x8f, 0x1a, 0x2b, 0xea, 0x83, 0x5a, 0x04, 0xc4, 0xe1,
+	0x77, 0x36, 0xc0, 0x32, 0x56, 0x23, 0x3f, 0xc9, 0x58, 0xef, 0x32, 0x2c,
+	0x15, 0x7c, 0xcd, 0xf8, 0xc7, 0xca, 0xb2, 0x8d, 0x21, 0x13, 0x0b, 0x67,
+	0x25, 0x46, 0x7b, 0x02, 0x6c, 0xb9, 0x73, 0x90, 0x41, 0x16, 0x7d, 0xff,
+	0x0a, 0xa7, 0xcb, 0x19, 0xca, 0x0a, 0x6b, 0xcf, 0x22, 0x04, 0xe5, 0x82,
+	0xb6, 0xaa, 0x01, 0x2b, 0xda, 0x1f, 0x41, 0x1f, 0xb0, 0x7c, 0xa3, 0x91,
+	0x12, 0x13, 0x28, 0xed, 0x25, 0xe3, 0x82, 0x4e, 0x40, 0x65, 0x1c, 0x94,
+	0xd1, 0x14, 0xc1, 0x6d, 0x75, 0x0d, 0x19, 0xfd, 0x3f, 0xe3, 0x5e, 0x60,
+	0xd6, 0x43, 0x25, 0xf1, 0xe7, 0x0c, 0x66, 0x3b, 0x73, 0xf7, 0xbc, 0xc5,
+	0xf3, 0xec, 0xa2, 0xfa, 0x6c, 0x68, 0xb3, 0x02, 0x03, 0x01, 0x00, 0x01,
+	0xa3, 0x53, 0x30, 0x51, 0x30, 0x1d, 0x06, 0x03, 0x55, 0x1d, 0x0e, 0x04,
+	0x16, 0x04, 0x14, 0x25, 0xea, 0x28, 0xe4, 0x00, 0xf4, 0x80, 0xf3, 0x72,
+	0x8d, 0xa8, 0xb4, 0x5e, 0x3c, 0x10, 0xee, 0xf0, 0x31, 0xfe, 0x41, 0x30,
+	0x1f, 0x06, 0x03, 0x55, 0x1d, 0x23, 0x04, 0x18, 0x30, 0x16, 0x80, 0x14,
+	0x25, 0xea, 0x28, 0xe4, 0x00, 0xf4, 0x80, 0xf3, 0x72, 0x8d, 0xa8, 0xb4,
+	0x5e, 0x3c, 0x10, 0xee, 0xf0, 0x31, 0xfe, 0x41, 0x30, 0x0f, 0x06, 0x03,
+	0x55, 0x1d, 0x13, 0x01, 0x01, 0xff, 0x04, 0x05, 0x30, 0x03, 0x01, 0x01,
+	0xff, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+	0x01, 0x0b, 0x05, 0x00, 0x03, 0x82, 0x01, 0x01, 0x00, 0x6c, 0xe2, 0x5b,
+	0x7f, 0x2e, 0xd4, 0xf8, 0x59, 0x74, 0xa2, 0x88, 0xda, 0xd5, 0xaf, 0xa3,
+	0x87, 0x76, 0x27, 0x58, 0x43, 0xac, 0xdb, 0x5c, 0x29, 0xe2, 0xd0, 0xad,
+	0xd2, 0x9d, 0xea, 0x8a, 0x2d, 0x55, 0x96, 0x0d, 0x17, 0x08, 0xe3, 0x20,
+	0xe8, 0x41, 0x49, 0x94, 0xe2, 0xed, 0x20, 0x39, 0xbb, 0x98, 0xab, 0x7d,
+	0xd7, 0x62, 0xa7, 0xad, 0x1c, 0x0c, 0xc4, 0x96, 0x81, 0x2f, 0x55, 0xf9,
+	0x05, 0x6b, 0xf9, 0x1a, 0x83, 0xd0, 0xcd, 0x22, 0xe1, 0x8e, 0xe5, 0xd8,
+	0x98, 0x43, 0x98, 0x9e, 0xbf, 0x9c, 0xd2, 0xa7, 0x17, 0xf3, 0x1e, 0xc4,
+	0x23, 0x02, 0x4a, 0x06, 0x3b, 0xca, 0xc8, 0xa2, 0xe5, 0x68, 0x48, 0xe5,
+	0xb5, 0x8b, 0x06, 0xfb, 0xd8, 0xd5, 0x27, 0x0f, 0x8a, 0xef, 0x76, 0x38,
+	0x84, 0x07, 0x92, 0x3f, 0xcd, 0x3d, 0xca, 0xc3, 0xd8, 0x8b, 0x4b, 0x1d,
+	0x7b, 0xef, 0x52, 0xa4, 0x4d, 0x4f, 0x9c, 0x16, 0xb7, 0xe0, 0xd3, 0x62,
+	0x80, 0x62, 0x4a, 0xc7, 0x50, 0xae, 0x24, 0x15, 0x3b, 0xae, 0x82, 0xac,
+	0x30, 0xfb, 0x32, 0x61, 0x86, 0x75, 0xf9, 0x66, 0xbe, 0xa3, 0x5f, 0x8a,
+	0x0a, 0x2a, 0x59, 0xa5, 0x68, 0x90, 0x41, 0x6c, 0xb2, 0x71, 0x68, 0x2a,
+	0x26, 0x27, 0xc3, 0x9d, 0x52, 0x77, 0x8a, 0x1b, 0xef, 0x39, 0xd2, 0x1f,
+	0x2a, 0xfd, 0x5b, 0xd7, 0x5f, 0x92, 0xb8, 0x51, 0x29, 0x64, 0x5d, 0x88,
+	0x17, 0x13, 0xbf, 0x17, 0x6b, 0xcd, 0x90, 0x99, 0xb2, 0xb3, 0x01, 0x11,
+	0xda, 0xf5, 0x98, 0x44, 0x52, 0x65, 0x24, 0xc2, 0xdf, 0xf9, 0x27, 0xca,
+	0x64, 0x41, 0xa5, 0x33, 0x7b, 0x54, 0xbe, 0xb7, 0xc6, 0xfb, 0x9c, 0xa2,
+	0x8c, 0x91, 0xa0, 0x4e, 0x44, 0xb9, 0x3f, 0xb8, 0x7f, 0x7d, 0xcf, 0x45,
+	0x9d, 0x84, 0x94, 0x81, 0x9e, 0x4e, 0x87, 0xec, 0x44, 0x11, 0xf5, 0x99,
+	0x6a,
+};
+
+static sc_context_t *ctx;
+static struct sc_pkcs15_card *p15card;
+static const char *opt_conf = NULL;
+
+static u8 *prkdf, *cdf;
+static size_t prkdf_len, cdf_len;
+static char cert_b64[2 * sizeof(bench_cert)];
+static char cert_hex[3 * sizeof(bench_cert) + 4];
+static u8 digest[32], pkcs1_01[256], pkcs1_02[256];
+#ifdef ENABLE_ZLIB
+static u8 zdata[4 * sizeof(bench_cert)];
+static size_t zdata_len;
+#endif
+
+static unsigned long long bench_now(void)
+{
+#if defined(_WIN32)
+	return (unsigned long long) GetTickCount() * 1000000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+static int append_entry(u8 **df, size_t *df_len, const u8 *buf, size_t len)
+{
+	u8 *p = realloc(*df, *df_len + len);
+
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(p + *df_len, buf, len);
+	*df = p;
+	*df_len += len;
+	return SC_SUCCESS;
+}
+
+static int setup(void)
+{
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_cert_info cert;
+	u8 *buf;
+	size_t len;
+	int i, r;
+
+	for (i = 0; i < BENCH_DF_ENTRIES; i++) {
+		memset(&obj, 0, sizeof(obj));
+		memset(&prkey, 0, sizeof(prkey));
+		obj.type = SC_PKCS15_TYPE_PRKEY_RSA;
+		obj.flags = SC_PKCS15_CO_FLAG_PRIVATE;
+		snprintf(obj.label, sizeof(obj.label), "Private key %d", i);
+		obj.auth_id.len = 1;
+		obj.auth_id.value[0] = 0x01;
+		obj.data = &prkey;
+		prkey.id.len = 20;
+		memset(prkey.id.value, 0x40 + i, prkey.id.len);
+		prkey.usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_DECRYPT;
+		prkey.access_flags = SC_PKCS15_PRKEY_ACCESS_SENSITIVE | SC_PKCS15_PRKEY_ACCESS_LOCAL;
+		prkey.native = 1;
+		prkey.key_reference = i;
+		prkey.modulus_length = 2048;
+		sc_format_path("3F0050154B01", &prkey.path);
+		prkey.path.value[prkey.path.len - 1] += i;
+		r = sc_pkcs15_encode_prkdf_entry(ctx, &obj, &buf, &len);
+		if (r == SC_SUCCESS)
+			r = append_entry(&prkdf, &prkdf_len, buf, len);
+		free(buf);
+		if (r != SC_SUCCESS)
+			return r;
+
+		memset(&obj, 0, sizeof(obj));
+		memset(&cert, 0, sizeof(cert));
+		obj.type = SC_PKCS15_TYPE_CERT_X509;
+		snprintf(obj.label, sizeof(obj.label), "Certificate %d", i);
+		obj.data = &cert;
+		cert.id = prkey.id;
+		sc_format_path("3F0050154301", &cert.path);
+		cert.path.value[cert.path.len - 1] += i;
+		r = sc_pkcs15_encode_cdf_entry(ctx, &obj, &buf, &len);
+		if (r == SC_SUCCESS)
+			r = append_entry(&cdf, &cdf_len, buf, len);
+		free(buf);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+
+	r = sc_base64_encode(bench_cert, sizeof(bench_cert), (u8 *) cert_b64, sizeof(cert_b64), 64);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_bin_to_hex(bench_cert, sizeof(bench_cert), cert_hex, sizeof(cert_hex), ':');
+	if (r != SC_SUCCESS)
+		return r;
+
+	memset(digest, 0x5A, sizeof(digest));
+	len = sizeof(pkcs1_01);
+	r = sc_pkcs1_encode(ctx, SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256,
+			digest, sizeof(digest), pkcs1_01, &len, sizeof(pkcs1_01));
+	if (r != SC_SUCCESS)
+		return r;
+	/* type 2 block: 00 02 <nonzero padding> 00 <digest> */
+	pkcs1_02[0] = 0x00;
+	pkcs1_02[1] = 0x02;
+	for (i = 2; i < (int) (sizeof(pkcs1_02) - sizeof(digest) - 1); i++)
+		pkcs1_02[i] = 0x01 + i % 0xFF;
+	pkcs1_02[i++] = 0x00;
+	memcpy(pkcs1_02 + i, digest, sizeof(digest));
+
+#ifdef ENABLE_ZLIB
+	{
+		u8 plain[sizeof(bench_cert) + 512];
+		uLongf zlen = sizeof(zdata);
+
+		memcpy(plain, bench_cert, sizeof(bench_cert));
+		memset(plain + sizeof(bench_cert), 0, 512);
+		if (compress(zdata, &zlen, plain, sizeof(plain)) != Z_OK)
+			return SC_ERROR_INTERNAL;
+		zdata_len = zlen;
+	}
+#endif
+	return SC_SUCCESS;
+}
+
+static int run_decode_df(const u8 *df, size_t df_len,
+		int (*func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *, const u8 **, size_t *),
+		int add)
+{
+	const u8 *p = df;
+	size_t left = df_len;
+	struct sc_pkcs15_object *obj;
+	int r;
+
+	while (left && *p != 0x00) {
+		obj = calloc(1, sizeof(*obj));
+		if (obj == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = func(p15card, obj, &p, &left);
+		if (r != SC_SUCCESS) {
+			free(obj);
+			return r == SC_ERROR_ASN1_END_OF_CONTENTS ? SC_SUCCESS : r;
+		}
+		if (add && sc_pkcs15_add_object(p15card, obj) == SC_SUCCESS)
+			continue;
+		sc_pkcs15_free_object(obj);
+	}
+	while ((obj = p15card->obj_list) != NULL) {
+		sc_pkcs15_remove_object(p15card, obj);
+		sc_pkcs15_free_object(obj);
+	}
+	return SC_SUCCESS;
+}
+
+static int bench_asn1_prkdf(void)
+{
+	return run_decode_df(prkdf, prkdf_len, sc_pkcs15_decode_prkdf_entry, 0);
+}
+
+static int bench_asn1_cdf(void)
+{
+	return run_decode_df(cdf, cdf_len, sc_pkcs15_decode_cdf_entry, 0);
+}
+
+/* what sc_pkcs15_parse_df() does once the DF is read */
+static int bench_parse_df(void)
+{
+	int r = run_decode_df(prkdf, prkdf_len, sc_pkcs15_decode_prkdf_entry, 1);
+
+	if (r == SC_SUCCESS)
+		r = run_decode_df(cdf, cdf_len, sc_pkcs15_decode_cdf_entry, 1);
+	return r;
+}
+
+static int bench_x509(void)
+{
+	struct sc_pkcs15_der der;
+	struct sc_pkcs15_pubkey *key = NULL;
+	int r;
+
+	der.value = (u8 *) bench_cert;
+	der.len = sizeof(bench_cert);
+	r = sc_pkcs15_pubkey_from_cert(ctx, &der, &key);
+	sc_pkcs15_free_pubkey(key);
+	return r;
+}
+
+static int bench_base64_encode(void)
+{
+	char out[sizeof(cert_b64)];
+
+	return sc_base64_encode(bench_cert, sizeof(bench_cert), (u8 *) out, sizeof(out), 64);
+}
+
+static int bench_base64_decode(void)
+{
+	u8 out[sizeof(bench_cert) + 4];
+	int r = sc_base64_decode(cert_b64, out, sizeof(out));
+
+	return r < 0 ? r : SC_SUCCESS;
+}
+
+static int bench_hex_to_bin(void)
+{
+	u8 out[sizeof(bench_cert)];
+	size_t len = sizeof(out);
+
+	return sc_hex_to_bin(cert_hex, out, &len);
+}
+
+#ifdef ENABLE_ZLIB
+static int bench_decompress(void)
+{
+	u8 *out = NULL;
+	size_t len = 0;
+	int r = sc_decompress_alloc(&out, &len, zdata, zdata_len, COMPRESSION_ZLIB);
+
+	free(out);
+	return r;
+}
+#endif
+
+static int bench_pkcs1_encode(void)
+{
+	u8 out[256];
+	size_t len = sizeof(out);
+
+	return sc_pkcs1_encode(ctx, SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256,
+			digest, sizeof(digest), out, &len, sizeof(out));
+}
+
+static int bench_pkcs1_strip_01(void)
+{
+	u8 out[256];
+	size_t len = sizeof(out);
+
+	return sc_pkcs1_strip_01_padding(ctx, pkcs1_01, sizeof(pkcs1_01), out, &len);
+}
+
+static int bench_pkcs1_strip_02(void)
+{
+	u8 out[256];
+	size_t len = sizeof(out);
+	int r = sc_pkcs1_strip_02_padding(ctx, pkcs1_02, sizeof(pkcs1_02), out, &len);
+
+	return r < 0 ? r : SC_SUCCESS;
+}
+
+static int bench_scconf(void)
+{
+	scconf_context *conf = scconf_new(opt_conf);
+	int r;
+
+	if (conf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	switch (scconf_parse(conf)) {
+	case 1:
+		r = SC_SUCCESS;
+		break;
+	case -1:
+		r = SC_ERROR_FILE_NOT_FOUND;
+		break;
+	default:
+		r = SC_ERROR_SYNTAX_ERROR;
+	}
+	scconf_free(conf);
+	return r;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} benchmarks[] = {
+	{ "asn1_decode_prkdf",	bench_asn1_prkdf },
+	{ "asn1_decode_cdf",	bench_asn1_cdf },
+	{ "pkcs15_parse_df",	bench_parse_df },
+	{ "parse_x509_cert",	bench_x509 },
+	{ "base64_encode",	bench_base64_encode },
+	{ "base64_decode",	bench_base64_decode },
+	{ "hex_to_bin",		bench_hex_to_bin },
+#ifdef ENABLE_ZLIB
+	{ "decompress_zlib",	bench_decompress },
+#endif
+	{ "pkcs1_encode",	bench_pkcs1_encode },
+	{ "pkcs1_strip_01",	bench_pkcs1_strip_01 },
+	{ "pkcs1_strip_02",	bench_pkcs1_strip_02 },
+	{ "scconf_parse",	bench_scconf },
+	{ NULL, NULL }
+};
+
+static const struct option options[] = {
+	{ "json",	0, NULL, 'j' },
+	{ "config",	1, NULL, 'c' },
+	{ "time",	1, NULL, 't' },
+	{ "rounds",	1, NULL, 'n' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void usage(void)
+{
+	int i;
+
+	fprintf(stderr, "Usage: bench [-j] [-c opensc.conf] [-t ms] [-n rounds] [benchmark...]\n"
+		"  -j, --json    print one JSON object per benchmark\n"
+		"  -c, --config  configuration file parsed by scconf_parse [%s]\n"
+		"  -t, --time    minimum duration of a round in ms [100]\n"
+		"  -n, --rounds  number of measured rounds [5]\n"
+		"Benchmarks:", OPENSC_CONF_PATH);
+	for (i = 0; benchmarks[i].name; i++)
+		fprintf(stderr, " %s", benchmarks[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_param_t ctx_param;
+	sc_card_t fake_card;
+	int opt_json = 0, opt_rounds = 5, c, i, j, r, err = 0;
+	unsigned long long opt_time = 100;
+
+	while ((c = getopt_long(argc, argv, "jc:t:n:", options, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			opt_json = 1;
+			break;
+		case 'c':
+			opt_conf = optarg;
+			break;
+		case 't':
+			opt_time = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			opt_rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (opt_conf == NULL)
+		opt_conf = OPENSC_CONF_PATH;
+	if (opt_rounds < 1)
+		opt_rounds = 1;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver = 0;
+	ctx_param.app_name = "bench";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to create context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	/* the decoders only need the context of the card and the application path */
+	memset(&fake_card, 0, sizeof(fake_card));
+	fake_card.ctx = ctx;
+	p15card = sc_pkcs15_card_new();
+	if (p15card == NULL) {
+		sc_release_context(ctx);
+		return 1;
+	}
+	p15card->card = &fake_card;
+	p15card->file_app = sc_file_new();
+	if (p15card->file_app == NULL) {
+		sc_pkcs15_card_free(p15card);
+		sc_release_context(ctx);
+		return 1;
+	}
+	sc_format_path("3F005015", &p15card->file_app->path);
+
+	r = setup();
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to build the benchmark input: %s\n", sc_strerror(r));
+		err = 1;
+		goto out;
+	}
+
+	for (i = 0; benchmarks[i].name; i++) {
+		unsigned long iterations, k;
+		unsigned long long start, elapsed, best = 0;
+
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], benchmarks[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+
+		r = benchmarks[i].run();
+		if (r == SC_ERROR_FILE_NOT_FOUND) {
+			/* input not available here, e.g. no configuration file */
+			fprintf(stderr, "%s: skipped\n", benchmarks[i].name);
+			continue;
+		}
+		if (r != SC_SUCCESS) {
+			fprintf(stderr, "%s: %s\n", benchmarks[i].name, sc_strerror(r));
+			err = 1;
+			continue;
+		}
+
+		/* calibrate */
+		for (iterations = 1; ; iterations *= 2) {
+			start = bench_now();
+			for (k = 0; k < iterations; k++)
+				benchmarks[i].run();
+			elapsed = bench_now() - start;
+			if (elapsed >= opt_time * 1000000 || iterations >= (1UL << 30))
+				break;
+		}
+
+		for (j = 0; j < opt_rounds; j++) {
+			start = bench_now();
+			for (k = 0; k < iterations; k++)
+				benchmarks[i].run();
+			elapsed = bench_now() - start;
+			if (best == 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		if (opt_json)
+			printf("{\"name\":\"%s\",\"iterations\":%lu,\"rounds\":%d,\"ns_per_op\":%.1f}\n",
+				benchmarks[i].name, iterations, opt_rounds, (double) best / iterations);
+		else
+			printf("%-20s %10lu %12.1f ns/op\n",
+				benchmarks[i].name, iterations, (double) best / iterations);
+		fflush(stdout);
+	}
+
+out:
+	free(prkdf);
+	free(cdf);
+	p15card->card = NULL;
+	sc_pkcs15_card_free(p15card);
+	sc_release_context(ctx);
+	return err;
+}
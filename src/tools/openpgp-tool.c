@@ -40,6 +40,7 @@
 #define	OPT_PRETTY	257
 #define	OPT_VERIFY	258
 #define	OPT_PIN	    259
+#define	OPT_EXPORT	260
 
 /* define structures */
 struct ef_name_map {
@@ -57,6 +58,7 @@ static char *prettify_gender(char *str);
 static void display_data(const struct ef_name_map *mapping, char *value);
 static int decode_options(int argc, char **argv);
 static int do_userinfo(sc_card_t *card);
+static int do_export(sc_card_t *card);
 
 /* define global variables */
 static int actions = 0;
@@ -66,6 +68,7 @@ static int opt_raw = 0;
 static int verbose = 0;
 static int opt_userinfo = 0;
 static int opt_cardinfo = 0;
+static int opt_export = 0;
 static char *exec_program = NULL;
 static int opt_genkey = 0;
 static int opt_keylen = 0;
@@ -96,6 +99,7 @@ static const struct option options[] = {
 	{ "verify",    required_argument, NULL, OPT_VERIFY },
 	{ "pin",       required_argument, NULL, OPT_PIN },
 	{ "do",        required_argument, NULL, 'd' },
+	{ "export",    no_argument,       NULL, OPT_EXPORT },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -114,7 +118,8 @@ static const char *option_help[] = {
 /* V */	"Show version number",
 	"Verify PIN (CHV1, CHV2, CHV3...)",
 	"PIN string",
-/* d */ "Dump private data object number <arg> (i.e. PRIVATE-DO-<arg>)"
+/* d */ "Dump private data object number <arg> (i.e. PRIVATE-DO-<arg>)",
+	"Export the card and card holder data as one line of JSON"
 };
 
 static const struct ef_name_map openpgp_data[] = {
@@ -296,6 +301,10 @@ static int decode_options(int argc, char **argv)
 			opt_dump_do++;
 			actions++;
 			break;
+		case OPT_EXPORT:
+			opt_export++;
+			actions++;
+			break;
 		default:
 			util_print_usage_and_die(app_name, options, option_help, NULL);
 		}
@@ -351,6 +360,199 @@ static int do_userinfo(sc_card_t *card)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Find the DO tag in the BER-TLV encoded buf, descending into the
+ * constructed DOs, e.g. to C5 in 6E / 73.
+ */
+static const u8 *find_do(const u8 *buf, size_t len, unsigned int tag, size_t *do_len)
+{
+	const u8 *end = buf + len;
+
+	while (buf < end && *buf != 0x00 && *buf != 0xFF) {
+		unsigned int t;
+		int constructed = *buf & 0x20;
+		size_t l;
+
+		t = *buf++;
+		if ((t & 0x1F) == 0x1F) {
+			do {
+				if (buf >= end)
+					return NULL;
+				t = (t << 8) | *buf;
+			} while (*buf++ & 0x80);
+		}
+		if (buf >= end)
+			return NULL;
+		l = *buf++;
+		if (l == 0x81 || l == 0x82) {
+			size_t n = l & 0x7F;
+
+			if ((size_t)(end - buf) < n)
+				return NULL;
+			for (l = 0; n > 0; n--)
+				l = (l << 8) | *buf++;
+		} else if (l > 0x7F) {
+			return NULL;
+		}
+		if ((size_t)(end - buf) < l)
+			return NULL;
+
+		if (t == tag) {
+			*do_len = l;
+			return buf;
+		}
+		if (constructed) {
+			const u8 *p = find_do(buf, l, tag, do_len);
+			if (p != NULL)
+				return p;
+		}
+		buf += l;
+	}
+	return NULL;
+}
+
+
+static void json_value(const u8 *value, size_t len)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		if (value[i] == '"' || value[i] == '\\')
+			printf("\\%c", value[i]);
+		else if (value[i] < 0x20)
+			printf("\\u%04x", value[i]);
+		else
+			putchar(value[i]);
+	}
+	putchar('"');
+}
+
+
+static void json_string(const char *name, const u8 *value, size_t len)
+{
+	printf(",\"%s\":", name);
+	json_value(value, len);
+}
+
+
+static void json_hex(const char *name, const u8 *value, size_t len)
+{
+	size_t i;
+
+	printf(",\"%s\":\"", name);
+	for (i = 0; i < len; i++)
+		printf("%02X", value[i]);
+	putchar('"');
+}
+
+
+/* A card holder DO, prettified as by --user-info unless --raw */
+static void json_holder_data(const char *name, const u8 *value, size_t len,
+		char *(*prettify_value)(char *))
+{
+	/* prettify_language() inserts up to three commas */
+	char str[256 + 4];
+	char *pretty;
+
+	if (value == NULL)
+		return;
+	if (len > sizeof(str) - 4)
+		len = sizeof(str) - 4;
+	memcpy(str, value, len);
+	str[len] = '\0';
+
+	pretty = str;
+	if (prettify_value != NULL && !opt_raw)
+		pretty = prettify_value(str);
+	if (pretty != NULL)
+		json_string(name, (const u8 *) pretty, strlen(pretty));
+}
+
+
+/*
+ * Print the Application Related Data (6E) and the Cardholder Related
+ * Data (65), plus the URL and login data, as one JSON object. Four
+ * GET DATA commands are all it takes, for audits of many cards.
+ */
+static int do_export(sc_card_t *card)
+{
+	static const char *key_names[3] = { "sig", "dec", "aut" };
+	u8 app_data[2048], holder_data[512], url[256], login[256];
+	int app_len, holder_len, url_len, login_len;
+	const u8 *p, *fpr, *ca_fpr, *time;
+	size_t len, fpr_len = 0, ca_fpr_len = 0, time_len = 0;
+	int i;
+
+	app_len = sc_get_data(card, 0x006E, app_data, sizeof(app_data));
+	if (app_len < 0) {
+		fprintf(stderr, "Failed to get the application related data: %s\n", sc_strerror(app_len));
+		return EXIT_FAILURE;
+	}
+	holder_len = sc_get_data(card, 0x0065, holder_data, sizeof(holder_data));
+	if (holder_len < 0) {
+		fprintf(stderr, "Failed to get the cardholder related data: %s\n", sc_strerror(holder_len));
+		return EXIT_FAILURE;
+	}
+	/* optional DOs, left out of the output if they cannot be read */
+	url_len = sc_get_data(card, 0x5F50, url, sizeof(url));
+	login_len = sc_get_data(card, 0x005E, login, sizeof(login));
+
+	printf("{\"reader\":");
+	json_value((const u8 *) card->reader->name, strlen(card->reader->name));
+
+	p = find_do(app_data, app_len, 0x4F, &len);
+	if (p != NULL && len >= 14) {
+		json_hex("aid", p, len);
+		printf(",\"version\":\"%d.%d\"", p[6], p[7]);
+		json_hex("manufacturer", p + 8, 2);
+		json_hex("serial", p + 10, 4);
+	}
+	p = find_do(app_data, app_len, 0x5F52, &len);
+	if (p != NULL)
+		json_hex("historical_bytes", p, len);
+	p = find_do(app_data, app_len, 0xC0, &len);
+	if (p != NULL)
+		json_hex("extended_capabilities", p, len);
+	p = find_do(app_data, app_len, 0xC4, &len);
+	if (p != NULL)
+		json_hex("pw_status", p, len);
+
+	fpr = find_do(app_data, app_len, 0xC5, &fpr_len);
+	ca_fpr = find_do(app_data, app_len, 0xC6, &ca_fpr_len);
+	time = find_do(app_data, app_len, 0xCD, &time_len);
+	for (i = 0; i < 3; i++) {
+		p = find_do(app_data, app_len, 0xC1 + i, &len);
+		printf(",\"key_%s\":{\"ref\":%d", key_names[i], i + 1);
+		if (p != NULL)
+			json_hex("algorithm", p, len);
+		if (fpr != NULL && fpr_len >= (size_t)(i + 1) * 20)
+			json_hex("fingerprint", fpr + i * 20, 20);
+		if (ca_fpr != NULL && ca_fpr_len >= (size_t)(i + 1) * 20)
+			json_hex("ca_fingerprint", ca_fpr + i * 20, 20);
+		if (time != NULL && time_len >= (size_t)(i + 1) * 4) {
+			const u8 *t = time + i * 4;
+			printf(",\"generated\":%lu", ((unsigned long) t[0] << 24) | (t[1] << 16) | (t[2] << 8) | t[3]);
+		}
+		putchar('}');
+	}
+
+	p = find_do(holder_data, holder_len, 0x5B, &len);
+	json_holder_data("name", p, len, prettify_name);
+	p = find_do(holder_data, holder_len, 0x5F2D, &len);
+	json_holder_data("language", p, len, prettify_language);
+	p = find_do(holder_data, holder_len, 0x5F35, &len);
+	json_holder_data("gender", p, len, prettify_gender);
+	if (url_len > 0)
+		json_string("url", url, url_len);
+	if (login_len > 0)
+		json_string("login", login, login_len);
+
+	printf("}\n");
+	return EXIT_SUCCESS;
+}
+
+
 static int do_dump_do(sc_card_t *card, unsigned int tag)
 {
 	int r, tmp;
@@ -504,6 +706,9 @@ int main(int argc, char **argv)
 	if (opt_userinfo)
 		exit_status |= do_userinfo(card);
 
+	if (opt_export)
+		exit_status |= do_export(card);
+
 	if (opt_verify && opt_pin) {
 		exit_status |= do_verify(card, verifytype, pin);
 	}
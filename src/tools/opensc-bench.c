@@ -0,0 +1,614 @@
+/*
+ * opensc-bench.c: Card and reader throughput benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every benchmark is run in each mode the card offers: with and without
+ * secure messaging, with and without the card layer caches (select
+ * cache, read-ahead, kept security environment) and, where the APDU
+ * size matters, with extended and with short APDUs. Each operation is
+ * timed on its own after a warm-up run; the average and the fastest
+ * run are reported.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "util.h"
+
+static const char *app_name = "opensc-bench";
+
+#define BENCH_MAX_CHUNKS	16
+
+static const char *opt_reader = NULL;
+static int opt_wait = 0;
+static int verbose = 0;
+static int opt_json = 0;
+static int opt_count = 10;
+static const char *opt_path = "3F002F00";
+static const char *opt_apdu = "0084000008";
+static const char *opt_chunks = "32,64,128,255,256,1024";
+static size_t opt_length = 0;
+static const char *opt_pin = NULL;
+static const char *opt_key_id = NULL;
+
+enum {
+	OPT_PATH = 0x100,
+	OPT_APDU,
+	OPT_CHUNKS,
+	OPT_LENGTH,
+	OPT_PIN,
+	OPT_KEY
+};
+
+static const struct option options[] = {
+	{ "reader",	required_argument, NULL, 'r' },
+	{ "count",	required_argument, NULL, 'n' },
+	{ "json",	no_argument, NULL, 'j' },
+	{ "path",	required_argument, NULL, OPT_PATH },
+	{ "apdu",	required_argument, NULL, OPT_APDU },
+	{ "chunks",	required_argument, NULL, OPT_CHUNKS },
+	{ "length",	required_argument, NULL, OPT_LENGTH },
+	{ "pin",	required_argument, NULL, OPT_PIN },
+	{ "key",	required_argument, NULL, OPT_KEY },
+	{ "wait",	no_argument, NULL, 'w' },
+	{ "verbose",	no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Uses reader number <arg>",
+	"Number of timed operations per benchmark [10]",
+	"Print one JSON object per result",
+	"Transparent EF to SELECT and READ BINARY [3F002F00]",
+	"APDU in hex used for the round-trip benchmark [0084000008]",
+	"Comma separated READ BINARY chunk sizes",
+	"Number of bytes to read [size of the EF]",
+	"PIN for the VERIFY, sign and decipher benchmarks",
+	"ID of the private key to use [first suitable key]",
+	"Wait for card insertion",
+	"Verbose operation. Use several times to enable debug output.",
+	NULL
+};
+
+/* applies to the benchmark, the mode is varied */
+#define BENCH_CACHE	0x01
+#define BENCH_EXT	0x02
+#define BENCH_CHUNKS	0x04
+#define BENCH_PKCS15	0x08
+
+static sc_context_t *ctx = NULL;
+static sc_card_t *card = NULL;
+static struct sc_pkcs15_card *p15card = NULL;
+
+static sc_path_t path;
+static size_t read_len;
+static size_t chunks[BENCH_MAX_CHUNKS];
+static int chunk_count;
+static u8 apdu_buf[SC_MAX_APDU_BUFFER_SIZE];
+static size_t apdu_len;
+static struct sc_pkcs15_object *sign_key, *decipher_key, *pin_obj;
+static int need_login;
+
+/* card state found after connecting, restored afterwards */
+static unsigned long orig_caps;
+static int orig_read_ahead;
+#ifdef ENABLE_SM
+static unsigned orig_sm_mode;
+#endif
+
+static unsigned long long bench_now(void)
+{
+#if defined(_WIN32)
+	return (unsigned long long) GetTickCount() * 1000000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+static int login(void)
+{
+	if (pin_obj == NULL || opt_pin == NULL)
+		return SC_SUCCESS;
+	return sc_pkcs15_verify_pin(p15card, pin_obj, (const u8 *) opt_pin, strlen(opt_pin));
+}
+
+static int bench_apdu(size_t chunk, size_t *bytes)
+{
+	sc_apdu_t apdu;
+	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	int r;
+
+	r = sc_bytes2apdu(ctx, apdu_buf, apdu_len, &apdu);
+	if (r < 0)
+		return r;
+	apdu.resp = rbuf;
+	apdu.resplen = sizeof(rbuf);
+	r = sc_transmit_apdu(card, &apdu);
+	if (r < 0)
+		return r;
+	*bytes = apdu.resplen;
+	return sc_check_sw(card, apdu.sw1, apdu.sw2);
+}
+
+static int bench_select(size_t chunk, size_t *bytes)
+{
+	return sc_select_file(card, &path, NULL);
+}
+
+static int bench_read(size_t chunk, size_t *bytes)
+{
+	u8 *buf;
+	size_t idx, count;
+	int r = SC_SUCCESS;
+
+	buf = malloc(chunk);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_select_file(card, &path, NULL);
+	for (idx = 0; r >= 0 && idx < read_len; idx += r) {
+		count = read_len - idx < chunk ? read_len - idx : chunk;
+		r = sc_read_binary(card, idx, buf, count, 0);
+		if (r == 0)
+			r = SC_ERROR_FILE_END_REACHED;
+	}
+	free(buf);
+	if (r < 0)
+		return r;
+	*bytes = read_len;
+	return SC_SUCCESS;
+}
+
+static int bench_verify(size_t chunk, size_t *bytes)
+{
+	return sc_pkcs15_verify_pin(p15card, pin_obj, (const u8 *) opt_pin, strlen(opt_pin));
+}
+
+static int bench_sign(size_t chunk, size_t *bytes)
+{
+	struct sc_pkcs15_prkey_info *info;
+	u8 in[32], out[1024];
+	size_t inlen;
+	unsigned long flags;
+	int r;
+
+	if (sign_key == NULL)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	info = (struct sc_pkcs15_prkey_info *) sign_key->data;
+	if (sign_key->type == SC_PKCS15_TYPE_PRKEY_RSA) {
+		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA1;
+		inlen = 20;
+	} else {
+		flags = SC_ALGORITHM_ECDSA_HASH_NONE;
+		inlen = (info->field_length + 7) / 8 < sizeof(in)
+			? (info->field_length + 7) / 8 : sizeof(in);
+	}
+	memset(in, 0x5a, sizeof(in));
+	if (need_login && sign_key->user_consent) {
+		r = login();
+		if (r < 0)
+			return r;
+	}
+	r = sc_pkcs15_compute_signature(p15card, sign_key, flags, in, inlen, out, sizeof(out));
+	if (r < 0)
+		return r;
+	*bytes = r;
+	return SC_SUCCESS;
+}
+
+static int bench_decipher(size_t chunk, size_t *bytes)
+{
+	struct sc_pkcs15_prkey_info *info;
+	u8 in[512], out[512];
+	size_t inlen;
+	int r;
+
+	if (decipher_key == NULL)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	info = (struct sc_pkcs15_prkey_info *) decipher_key->data;
+	inlen = info->modulus_length / 8;
+	if (inlen == 0 || inlen > sizeof(in))
+		return SC_ERROR_NOT_SUPPORTED;
+	/* any value below the modulus does for a raw RSA decryption */
+	memset(in, 0x5a, inlen);
+	in[0] = 0x00;
+	if (need_login && decipher_key->user_consent) {
+		r = login();
+		if (r < 0)
+			return r;
+	}
+	r = sc_pkcs15_decipher(p15card, decipher_key, 0, in, inlen, out, sizeof(out));
+	if (r < 0)
+		return r;
+	*bytes = r;
+	return SC_SUCCESS;
+}
+
+static const struct {
+	const char *name;
+	unsigned int flags;
+	int (*run)(size_t chunk, size_t *bytes);
+} benchmarks[] = {
+	{ "apdu",	0,					bench_apdu },
+	{ "select",	BENCH_CACHE,				bench_select },
+	{ "read",	BENCH_CACHE | BENCH_EXT | BENCH_CHUNKS,	bench_read },
+	{ "verify",	BENCH_PKCS15,				bench_verify },
+	{ "sign",	BENCH_CACHE | BENCH_EXT | BENCH_PKCS15,	bench_sign },
+	{ "decipher",	BENCH_CACHE | BENCH_EXT | BENCH_PKCS15,	bench_decipher },
+	{ NULL, 0, NULL }
+};
+
+struct bench_mode {
+	int sm, cache, ext;
+};
+
+static void set_mode(const struct bench_mode *mode)
+{
+#ifdef ENABLE_SM
+	if (orig_sm_mode == SM_MODE_TRANSMIT)
+		card->sm_ctx.sm_mode = mode->sm ? SM_MODE_TRANSMIT : SM_MODE_NONE;
+#endif
+	card->caps = orig_caps;
+	if (!mode->ext)
+		card->caps &= ~SC_CARD_CAP_APDU_EXT;
+	if (mode->cache) {
+		ctx->read_ahead = 1;
+	} else {
+		card->caps &= ~SC_CARD_CAP_SELECT_CACHE;
+		ctx->read_ahead = 0;
+	}
+	sc_invalidate_cache(card);
+}
+
+static void restore_mode(void)
+{
+#ifdef ENABLE_SM
+	card->sm_ctx.sm_mode = orig_sm_mode;
+#endif
+	card->caps = orig_caps;
+	ctx->read_ahead = orig_read_ahead;
+	sc_invalidate_cache(card);
+}
+
+static void print_result(const char *name, const struct bench_mode *mode, size_t chunk,
+		int r, int ops, unsigned long long total, unsigned long long best, size_t bytes)
+{
+	const char *sm = mode->sm ? "sm" : "plain";
+	const char *cache = mode->cache ? "cache" : "nocache";
+	const char *apdu = mode->ext ? "ext" : "short";
+	double avg_ms = ops ? (double) total / ops / 1000000 : 0;
+	double kbps = total ? (double) bytes * ops / 1024 / ((double) total / 1000000000) : 0;
+
+	if (opt_json) {
+		printf("{\"name\":\"%s\",\"sm\":%d,\"cache\":%d,\"ext\":%d,\"chunk\":%lu",
+			name, mode->sm, mode->cache, mode->ext, (unsigned long) chunk);
+		if (r < 0)
+			printf(",\"error\":\"%s\"}\n", sc_strerror(r));
+		else
+			printf(",\"ops\":%d,\"ms_per_op\":%.3f,\"min_ms\":%.3f,\"kb_per_s\":%.1f}\n",
+				ops, avg_ms, (double) best / 1000000, kbps);
+	} else {
+		printf("%-9s %-5s %-7s %-5s %5lu ", name, sm, cache, apdu, (unsigned long) chunk);
+		if (r < 0)
+			printf("%s\n", sc_strerror(r));
+		else
+			printf("%5d %10.2f %10.2f %10.1f\n", ops, avg_ms, (double) best / 1000000, kbps);
+	}
+	fflush(stdout);
+}
+
+static int run_one(int i, const struct bench_mode *mode, size_t chunk)
+{
+	unsigned long long start, elapsed, total = 0, best = 0;
+	size_t bytes = 0;
+	int k, r;
+
+	set_mode(mode);
+	/* warm-up, also checks that the operation works in this mode */
+	r = benchmarks[i].run(chunk, &bytes);
+	if (r >= 0) {
+		for (k = 0; k < opt_count; k++) {
+			if (!mode->cache)
+				sc_invalidate_cache(card);
+			start = bench_now();
+			r = benchmarks[i].run(chunk, &bytes);
+			elapsed = bench_now() - start;
+			if (r < 0)
+				break;
+			total += elapsed;
+			if (best == 0 || elapsed < best)
+				best = elapsed;
+		}
+	}
+	print_result(benchmarks[i].name, mode, chunk, r, opt_count, total, best, bytes);
+	return r < 0;
+}
+
+static int run_benchmark(int i)
+{
+	struct bench_mode mode;
+	int sm[2], cache[2], ext[2];
+	int sm_n = 1, cache_n = 1, ext_n = 1, s, m, e, c, err = 0;
+
+	/* modes to try, the card's own setting first */
+	sm[0] = 0;
+#ifdef ENABLE_SM
+	if (orig_sm_mode == SM_MODE_TRANSMIT) {
+		sm[0] = 1;
+		sm[1] = 0;
+		sm_n = 2;
+	}
+#endif
+	cache[0] = 1;
+	cache[1] = 0;
+	if (benchmarks[i].flags & BENCH_CACHE)
+		cache_n = 2;
+	ext[0] = (orig_caps & SC_CARD_CAP_APDU_EXT) != 0;
+	ext[1] = 0;
+	if ((benchmarks[i].flags & BENCH_EXT) && ext[0])
+		ext_n = 2;
+
+	for (s = 0; s < sm_n; s++)
+		for (m = 0; m < cache_n; m++)
+			for (e = 0; e < ext_n; e++) {
+				mode.sm = sm[s];
+				mode.cache = cache[m];
+				mode.ext = ext[e];
+				if (!(benchmarks[i].flags & BENCH_CHUNKS)) {
+					err |= run_one(i, &mode, 0);
+					continue;
+				}
+				for (c = 0; c < chunk_count; c++)
+					err |= run_one(i, &mode, chunks[c]);
+			}
+	restore_mode();
+	return err;
+}
+
+static int parse_chunks(void)
+{
+	const char *p = opt_chunks;
+	char *end;
+
+	for (chunk_count = 0; *p && chunk_count < BENCH_MAX_CHUNKS; chunk_count++) {
+		chunks[chunk_count] = strtoul(p, &end, 10);
+		if (end == p || chunks[chunk_count] == 0)
+			return SC_ERROR_INVALID_ARGUMENTS;
+		p = *end == ',' ? end + 1 : end;
+	}
+	return chunk_count ? SC_SUCCESS : SC_ERROR_INVALID_ARGUMENTS;
+}
+
+static int prepare_file(void)
+{
+	sc_file_t *file = NULL;
+	int r;
+
+	sc_format_path(opt_path, &path);
+	r = sc_select_file(card, &path, &file);
+	if (r < 0)
+		return r;
+	read_len = opt_length ? opt_length : file->size;
+	sc_file_free(file);
+	if (read_len == 0)
+		return SC_ERROR_FILE_END_REACHED;
+	return SC_SUCCESS;
+}
+
+static int prepare_pkcs15(void)
+{
+	struct sc_pkcs15_object *key = NULL;
+	sc_pkcs15_id_t id;
+	int r;
+
+	r = sc_pkcs15_bind(card, NULL, &p15card);
+	if (r < 0)
+		return r;
+
+	if (opt_key_id != NULL)
+		sc_pkcs15_hex_string_to_id(opt_key_id, &id);
+	if (sc_pkcs15_find_prkey_by_id_usage(p15card, opt_key_id ? &id : NULL,
+				SC_PKCS15_PRKEY_USAGE_SIGN, &sign_key) < 0)
+		sign_key = NULL;
+	if (sc_pkcs15_find_prkey_by_id_usage(p15card, opt_key_id ? &id : NULL,
+				SC_PKCS15_PRKEY_USAGE_DECRYPT, &decipher_key) < 0
+			|| decipher_key->type != SC_PKCS15_TYPE_PRKEY_RSA)
+		decipher_key = NULL;
+
+	key = sign_key ? sign_key : decipher_key;
+	if (key != NULL && key->auth_id.len) {
+		if (sc_pkcs15_find_pin_by_auth_id(p15card, &key->auth_id, &pin_obj) < 0)
+			pin_obj = NULL;
+	} else if (sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_AUTH_PIN, &pin_obj, 1) != 1) {
+		pin_obj = NULL;
+	}
+	if (pin_obj == NULL || opt_pin == NULL)
+		return SC_SUCCESS;
+
+	/* a wrong PIN would be presented opt_count times: check it once first */
+	r = login();
+	if (r < 0)
+		util_fatal("PIN verification failed: %s", sc_strerror(r));
+	need_login = 1;
+	return SC_SUCCESS;
+}
+
+static int selected(int i, int argc, char * const argv[])
+{
+	int j;
+
+	if (optind >= argc)
+		return 1;
+	for (j = optind; j < argc; j++)
+		if (!strcmp(argv[j], benchmarks[i].name))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char * const argv[])
+{
+	int err = 0, r, c, i, long_optind = 0;
+	int have_file = 0, have_p15 = 0, want_p15 = 0;
+	sc_context_param_t ctx_param;
+
+	while (1) {
+		c = getopt_long(argc, argv, "r:n:jwv", options, &long_optind);
+		if (c == -1)
+			break;
+		if (c == '?')
+			util_print_usage_and_die(app_name, options, option_help, "[benchmark...]");
+		switch (c) {
+		case 'r':
+			opt_reader = optarg;
+			break;
+		case 'n':
+			opt_count = atoi(optarg);
+			break;
+		case 'j':
+			opt_json = 1;
+			break;
+		case OPT_PATH:
+			opt_path = optarg;
+			break;
+		case OPT_APDU:
+			opt_apdu = optarg;
+			break;
+		case OPT_CHUNKS:
+			opt_chunks = optarg;
+			break;
+		case OPT_LENGTH:
+			opt_length = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_PIN:
+			opt_pin = optarg;
+			break;
+		case OPT_KEY:
+			opt_key_id = optarg;
+			break;
+		case 'w':
+			opt_wait = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+	if (opt_count < 1)
+		opt_count = 1;
+	if (parse_chunks() < 0)
+		util_fatal("invalid chunk sizes '%s'", opt_chunks);
+	apdu_len = sizeof(apdu_buf);
+	if (sc_hex_to_bin(opt_apdu, apdu_buf, &apdu_len) < 0)
+		util_fatal("invalid APDU '%s'", opt_apdu);
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver      = 0;
+	ctx_param.app_name = app_name;
+
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+
+	if (verbose > 1) {
+		ctx->debug = verbose;
+		sc_ctx_log_to_file(ctx, "stderr");
+	}
+
+	err = util_connect_card(ctx, &card, opt_reader, opt_wait, verbose);
+	if (err)
+		goto end;
+
+	r = sc_lock(card);
+	if (r < 0) {
+		fprintf(stderr, "Unable to lock card: %s\n", sc_strerror(r));
+		err = 1;
+		goto end;
+	}
+
+	orig_caps = card->caps;
+	orig_read_ahead = ctx->read_ahead;
+#ifdef ENABLE_SM
+	orig_sm_mode = card->sm_ctx.sm_mode;
+#endif
+
+	for (i = 0; benchmarks[i].name; i++)
+		if (selected(i, argc, argv) && (benchmarks[i].flags & BENCH_PKCS15))
+			want_p15 = 1;
+	if (want_p15) {
+		r = prepare_pkcs15();
+		if (r < 0)
+			fprintf(stderr, "PKCS#15 benchmarks skipped: %s\n", sc_strerror(r));
+		else
+			have_p15 = 1;
+	}
+	r = prepare_file();
+	if (r < 0)
+		fprintf(stderr, "%s: %s, file benchmarks skipped\n", opt_path, sc_strerror(r));
+	else
+		have_file = 1;
+
+	if (!opt_json)
+		printf("%-9s %-5s %-7s %-5s %5s %5s %10s %10s %10s\n", "benchmark", "sm",
+			"cache", "apdu", "chunk", "ops", "ms/op", "min ms", "kB/s");
+
+	for (i = 0; benchmarks[i].name; i++) {
+		if (!selected(i, argc, argv))
+			continue;
+		if ((benchmarks[i].flags & BENCH_PKCS15) && !have_p15)
+			continue;
+		if (!strcmp(benchmarks[i].name, "verify") && (pin_obj == NULL || opt_pin == NULL)) {
+			fprintf(stderr, "verify: skipped, no PIN given\n");
+			continue;
+		}
+		if ((benchmarks[i].flags & BENCH_CACHE) && !(benchmarks[i].flags & BENCH_PKCS15)
+				&& !have_file)
+			continue;
+		err |= run_benchmark(i);
+	}
+
+	sc_unlock(card);
+end:
+	if (p15card)
+		sc_pkcs15_unbind(p15card);
+	if (card) {
+		sc_disconnect_card(card);
+	}
+	if (ctx)
+		sc_release_context(ctx);
+	return err;
+}
@@ -24,6 +24,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
 #ifdef ENABLE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -54,7 +60,7 @@ typedef struct _id2str {
 
 static const char *app_name = "opensc-explorer";
 
-static int opt_wait = 0, verbose = 0;
+static int opt_wait = 0, verbose = 0, opt_batch = 0;
 static const char *opt_driver = NULL;
 static const char *opt_reader = NULL;
 static const char *opt_startfile = NULL;
@@ -70,6 +76,7 @@ static const struct option options[] = {
 	{ "mf",			1, NULL, 'm' },
 	{ "wait",		0, NULL, 'w' },
 	{ "verbose",		0, NULL, 'v' },
+	{ "batch",		0, NULL, 'b' },
 	{ NULL, 0, NULL, 0 }
 };
 static const char *option_help[] = {
@@ -78,6 +85,7 @@ static const char *option_help[] = {
 	"Selects path <arg> on start-up, or none if empty [3F00]",
 	"Wait for card insertion",
 	"Verbose operation. Use several times to enable debug output.",
+	"Run the script with the card locked, send consecutive apdu commands together and time each command",
 };
 
 
@@ -267,6 +275,33 @@ static void die(int ret)
 	exit(ret);
 }
 
+static unsigned long long now_usec(void)
+{
+#if defined(_WIN32)
+	return (unsigned long long) GetTickCount() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* command timings of batch mode go to stderr, apart from the output */
+static void report_time(const char *name, size_t apdus, unsigned long long usec)
+{
+	fflush(stdout);
+	fprintf(stderr, "# %s", name);
+	if (apdus > 1)
+		fprintf(stderr, " (%lu APDUs)", (unsigned long) apdus);
+	fprintf(stderr, ": %llu.%03llu ms\n", usec / 1000, usec % 1000);
+}
+
 static void select_current_path_or_die(void)
 {
 	if (current_path.type || current_path.len) {
@@ -1546,54 +1581,126 @@ static int do_put_data(int argc, char **argv)
 	return 0;
 }
 
-static int do_apdu(int argc, char **argv)
+struct apdu_buffers {
+	u8 cmd[SC_MAX_APDU_BUFFER_SIZE * 2];
+	size_t cmd_len;
+	u8 resp[SC_MAX_APDU_BUFFER_SIZE * 2];
+};
+
+/* APDUs of consecutive 'apdu' commands in batch mode, sent together
+ * with sc_transmit_apdus() before the next other command */
+static sc_apdu_t apdu_queue[SC_MAX_APDU_BATCH];
+static struct apdu_buffers apdu_queue_buffers[SC_MAX_APDU_BATCH];
+static size_t apdu_queue_len = 0;
+
+static int parse_apdu(int argc, char **argv, sc_apdu_t *apdu, struct apdu_buffers *bufs)
 {
-	sc_apdu_t apdu;
-	u8 buf[SC_MAX_APDU_BUFFER_SIZE * 2];
-	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE * 2];
 	size_t len, i;
 	int r;
 
-	if (argc < 1)
-		return usage(do_apdu);
-
 	for (i = 0, len = 0; i < (unsigned) argc; i++)   {
 		size_t len0 = strlen(argv[i]);
 
-		if ((r = parse_string_or_hexdata(argv[i], buf + len, &len0)) < 0) {
+		if ((r = parse_string_or_hexdata(argv[i], bufs->cmd + len, &len0)) < 0) {
 			fprintf(stderr, "error parsing %s: %s\n", argv[i], sc_strerror(r));
 			return r;
 		};
 		len += len0;
 	}
+	bufs->cmd_len = len;
 
-	r = sc_bytes2apdu(card->ctx, buf, len, &apdu);
+	r = sc_bytes2apdu(card->ctx, bufs->cmd, len, apdu);
 	if (r) {
 		fprintf(stderr, "Invalid APDU: %s\n", sc_strerror(r));
 		return 2;
 	}
 
-	apdu.resp = rbuf;
-	apdu.resplen = sizeof(rbuf);
+	apdu->resp = bufs->resp;
+	apdu->resplen = sizeof(bufs->resp);
+	return 0;
+}
 
+static void print_apdu_sending(const struct apdu_buffers *bufs)
+{
 	printf("Sending: ");
-	util_hex_dump(stdout, buf, len, " ");
+	util_hex_dump(stdout, bufs->cmd, bufs->cmd_len, " ");
 	printf("\n");
+}
+
+static void print_apdu_response(const sc_apdu_t *apdu)
+{
+	int r;
+
+	printf("Received (SW1=0x%02X, SW2=0x%02X)%s\n", apdu->sw1, apdu->sw2,
+	       apdu->resplen ? ":" : "");
+	if (apdu->resplen)
+		util_hex_dump_asc(stdout, apdu->resp, apdu->resplen, -1);
+
+	r = sc_check_sw(card, apdu->sw1, apdu->sw2);
+	if (r)
+		printf("Failure: %s\n", sc_strerror(r));
+	else
+		printf("Success!\n");
+}
+
+static int do_apdu(int argc, char **argv)
+{
+	sc_apdu_t apdu;
+	struct apdu_buffers bufs;
+	int r;
+
+	if (argc < 1)
+		return usage(do_apdu);
+
+	if ((r = parse_apdu(argc, argv, &apdu, &bufs)) != 0)
+		return r;
+
+	print_apdu_sending(&bufs);
 	r = sc_transmit_apdu(card, &apdu);
 	if (r) {
 		fprintf(stderr, "APDU transmit failed: %s\n", sc_strerror(r));
 		return 1;
 	}
-	printf("Received (SW1=0x%02X, SW2=0x%02X)%s\n", apdu.sw1, apdu.sw2,
-	       apdu.resplen ? ":" : "");
-	if (apdu.resplen)
-		util_hex_dump_asc(stdout, apdu.resp, apdu.resplen, -1);
+	print_apdu_response(&apdu);
 
-	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
-	if (r)
-		printf("Failure: %s\n", sc_strerror(r));
-	else
-		printf("Success!\n");
+	return 0;
+}
+
+static int queue_apdu(int argc, char **argv)
+{
+	int r;
+
+	if (argc < 1)
+		return usage(do_apdu);
+
+	r = parse_apdu(argc, argv, &apdu_queue[apdu_queue_len], &apdu_queue_buffers[apdu_queue_len]);
+	if (r == 0)
+		apdu_queue_len++;
+	return r;
+}
+
+/* Sends the queued APDUs in one batch and reports the time taken */
+static int run_apdu_queue(void)
+{
+	size_t i, count = apdu_queue_len;
+	unsigned long long start;
+	int r;
+
+	if (count == 0)
+		return 0;
+	apdu_queue_len = 0;
+
+	for (i = 0; i < count; i++)
+		print_apdu_sending(&apdu_queue_buffers[i]);
+	start = now_usec();
+	r = sc_transmit_apdus(card, apdu_queue, count);
+	report_time("apdu", count, now_usec() - start);
+	if (r) {
+		fprintf(stderr, "APDU transmit failed: %s\n", sc_strerror(r));
+		return 1;
+	}
+	for (i = 0; i < count; i++)
+		print_apdu_response(&apdu_queue[i]);
 
 	return 0;
 }
@@ -1800,7 +1907,7 @@ int main(int argc, char * const argv[])
 	printf("OpenSC Explorer version %s\n", sc_get_version());
 
 	while (1) {
-		c = getopt_long(argc, argv, "r:c:vwm:", options, &long_optind);
+		c = getopt_long(argc, argv, "r:c:vwm:b", options, &long_optind);
 		if (c == -1)
 			break;
 		if (c == '?')
@@ -1821,6 +1928,9 @@ int main(int argc, char * const argv[])
 		case 'm':
 			opt_startfile = optarg;
 			break;
+		case 'b':
+			opt_batch = 1;
+			break;
 		}
 	}
 
@@ -1854,6 +1964,17 @@ int main(int argc, char * const argv[])
 	if (err)
 		goto end;
 
+	/* Keep the card to this process for the whole script: the SELECT cache,
+	 * if enabled for the driver, then stays valid between the commands */
+	if (opt_batch) {
+		r = sc_lock(card);
+		if (r) {
+			fprintf(stderr, "Unable to lock the card: %s\n", sc_strerror(r));
+			err = 1;
+			goto end;
+		}
+	}
+
 	if (opt_startfile) {
 		if(*opt_startfile) {
 			char startpath[1024];
@@ -1913,10 +2034,28 @@ int main(int argc, char * const argv[])
 		cmd = ambiguous_match(cmds, cargv[0]);
 		if (cmd == NULL) {
 			do_help(0, NULL);
-		} else {
+			if (opt_batch)
+				err = 1;
+		} else if (!opt_batch) {
 			cmd->func(cargc-1, cargv+1);
+		} else if (cmd->func == do_apdu) {
+			if (apdu_queue_len == DIM(apdu_queue) && run_apdu_queue())
+				err = 1;
+			if (queue_apdu(cargc-1, cargv+1))
+				err = 1;
+		} else {
+			unsigned long long start;
+
+			if (run_apdu_queue())
+				err = 1;
+			start = now_usec();
+			if (cmd->func(cargc-1, cargv+1))
+				err = 1;
+			report_time(cmd->name, 0, now_usec() - start);
 		}
 	}
+	if (opt_batch && run_apdu_queue())
+		err = 1;
 end:
 	die(err);
 
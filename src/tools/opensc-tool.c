@@ -29,6 +29,11 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
 
 #include "libopensc/opensc.h"
 #include "libopensc/cardctl.h"
@@ -43,14 +48,20 @@ typedef struct _id2str {
 static const char *app_name = "opensc-tool";
 
 static int	opt_wait = 0;
+static int	opt_stats = 0;
 static char **	opt_apdus;
 static char	*opt_reader;
 static int	opt_apdu_count = 0;
 static int	verbose = 0;
+static int	opt_workers = 8;
 
 enum {
 	OPT_SERIAL = 0x100,
-	OPT_LIST_ALG
+	OPT_LIST_ALG,
+	OPT_STATS,
+	OPT_DECODE_TRACE,
+	OPT_ALL_READERS,
+	OPT_WORKERS
 };
 
 static const struct option options[] = {
@@ -68,6 +79,10 @@ static const struct option options[] = {
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
 	{ "wait",		0, NULL,		'w' },
+	{ "stats",		0, NULL,	OPT_STATS },
+	{ "decode-trace",	1, NULL,	OPT_DECODE_TRACE },
+	{ "all-readers",	0, NULL,	OPT_ALL_READERS },
+	{ "workers",		1, NULL,	OPT_WORKERS },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
 };
@@ -87,6 +102,10 @@ static const char *option_help[] = {
 	"Forces the use of driver <arg> [auto-detect]",
 	"Lists algorithms supported by card",
 	"Wait for a card to be inserted",
+	"Prints APDU statistics of the readers when done",
+	"Prints an APDU trace file written by the apdu_trace option",
+	"With --atr, --serial and --name: query the cards of all readers in parallel, one JSON line per reader",
+	"Number of parallel workers of --all-readers [8]",
 	"Verbose operation. Use several times to enable debug output.",
 };
 
@@ -267,6 +286,7 @@ static int list_readers(void)
 	}
 	printf("# Detected readers (%s)\n", ctx->reader_driver->short_name);
 	printf("Nr.  Card  Features  Name\n");
+	sc_refresh_readers(ctx);
 	for (i = 0; i < rcount; i++) {
 		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
 		int state = sc_detect_card_presence(reader);
@@ -294,6 +314,159 @@ static int list_readers(void)
 	return 0;
 }
 
+static void print_lock_stats(const char *name, const struct sc_lock_stats *lock)
+{
+	if (lock->acquired == 0)
+		return;
+	printf("%s: %lu acquired, %lu contended\n", name, lock->acquired, lock->contended);
+	printf("  wait: avg %llu us, max %lu us\n", lock->wait_usec / lock->acquired,
+		lock->max_wait_usec);
+	printf("  hold: avg %llu us, max %lu us\n", lock->hold_usec / lock->acquired,
+		lock->max_hold_usec);
+}
+
+static void print_stats(void)
+{
+	unsigned int i, rcount = sc_ctx_get_reader_count(ctx);
+	struct sc_reader_stats stats;
+	int j;
+
+	for (i = 0; i < rcount; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (sc_ctx_get_reader_stats(ctx, i, &stats, 0) != SC_SUCCESS
+				|| stats.apdus == 0)
+			continue;
+		printf("# APDU statistics of reader %d (%s)\n", i, reader->name);
+		printf("APDUs: %lu, errors: %lu, sent: %llu bytes, received: %llu bytes\n",
+			stats.apdus, stats.errors, stats.bytes_sent, stats.bytes_received);
+		printf("SELECT: %lu, GET RESPONSE: %lu\n",
+			stats.ins[0xA4].count, stats.ins[0xC0].count);
+		printf("Average latency: %llu us\n", stats.total_usec / stats.apdus);
+		printf("Latency histogram:\n");
+		for (j = 0; j < SC_LATENCY_BUCKETS; j++) {
+			if (stats.histogram[j] == 0)
+				continue;
+			if (j < SC_LATENCY_BUCKETS - 1)
+				printf("  < %8lu us: %lu\n", SC_LATENCY_BUCKET_LIMIT(j), stats.histogram[j]);
+			else
+				printf("  >= %7lu us: %lu\n", SC_LATENCY_BUCKET_LIMIT(j - 1), stats.histogram[j]);
+		}
+		printf("INS  Count     Avg(us)   Max(us)\n");
+		for (j = 0; j < 256; j++) {
+			struct sc_ins_stats *ins = &stats.ins[j];
+
+			if (ins->count == 0)
+				continue;
+			printf("%02X   %-10lu%-10llu%lu\n", j, ins->count,
+				ins->total_usec / ins->count, ins->max_usec);
+		}
+		print_lock_stats("Card lock", &stats.card_lock);
+		print_lock_stats("Reader transaction", &stats.transaction);
+	}
+}
+
+static unsigned long trace_u32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+		| ((unsigned long)p[2] << 8) | p[3];
+}
+
+static int decode_trace(const char *filename)
+{
+	FILE *f;
+	unsigned char buf[SC_APDU_TRACE_DATA_LEN + 20];
+	char **readers = NULL;
+	unsigned long i, version, rcount = 0, count;
+	int err = 1;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open '%s': %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (fread(buf, 1, 16, f) != 16 || memcmp(buf, SC_APDU_TRACE_MAGIC, 8) != 0) {
+		fprintf(stderr, "'%s' is not an APDU trace\n", filename);
+		goto out;
+	}
+	version = trace_u32(buf + 8);
+	if (version != SC_APDU_TRACE_VERSION) {
+		fprintf(stderr, "Unsupported APDU trace version %lu\n", version);
+		goto out;
+	}
+	rcount = trace_u32(buf + 12);
+	readers = calloc(rcount + 1, sizeof(char *));
+	if (readers == NULL)
+		goto out;
+	for (i = 0; i < rcount; i++) {
+		size_t len;
+
+		if (fread(buf, 1, 2, f) != 2)
+			goto truncated;
+		len = (buf[0] << 8) | buf[1];
+		readers[i] = malloc(len + 1);
+		if (readers[i] == NULL || fread(readers[i], 1, len, f) != len)
+			goto truncated;
+		readers[i][len] = '\0';
+	}
+	if (fread(buf, 1, 4, f) != 4)
+		goto truncated;
+	count = trace_u32(buf);
+	printf("# APDU trace %s, %lu records\n", filename, count);
+
+	for (i = 0; i < count; i++) {
+		char tstr[32], hex[SC_APDU_TRACE_DATA_LEN * 3 + 1];
+		unsigned int reader, direction, flags, stored, sw, len;
+		time_t sec;
+		struct tm *tm;
+
+		if (fread(buf, 1, 20, f) != 20)
+			goto truncated;
+		sec = (time_t) trace_u32(buf);
+		reader = buf[12];
+		direction = buf[13];
+		flags = buf[14];
+		stored = buf[15];
+		sw = (buf[16] << 8) | buf[17];
+		len = (buf[18] << 8) | buf[19];
+		tm = localtime(&sec);
+		if (tm == NULL || strftime(tstr, sizeof(tstr), "%Y-%m-%d %H:%M:%S", tm) == 0)
+			strcpy(tstr, "?");
+		printf("%s.%06lu #%lu %s %s", tstr, trace_u32(buf + 4), trace_u32(buf + 8),
+			reader < rcount ? readers[reader] : "?",
+			direction == SC_APDU_TRACE_COMMAND ? ">" : "<");
+		if (stored > SC_APDU_TRACE_DATA_LEN || fread(buf, 1, stored, f) != stored)
+			goto truncated;
+
+		if (direction != SC_APDU_TRACE_COMMAND && !(flags & SC_APDU_TRACE_FLAG_ERROR))
+			printf(" %02X %02X", sw >> 8, sw & 0xFF);
+		if (stored > 0) {
+			sc_bin_to_hex(buf, stored, hex, sizeof(hex), ' ');
+			printf("%s%s", direction == SC_APDU_TRACE_COMMAND ? " " : ": ", hex);
+		}
+		if (flags & SC_APDU_TRACE_FLAG_REDACTED)
+			printf(" [%u bytes redacted]", len - stored);
+		if (flags & SC_APDU_TRACE_FLAG_TRUNCATED)
+			printf(" [+%u bytes]", len - stored);
+		if (flags & SC_APDU_TRACE_FLAG_ERROR)
+			printf(" [transmit failed]");
+		printf("\n");
+	}
+	err = 0;
+	goto out;
+
+truncated:
+	fprintf(stderr, "APDU trace '%s' is truncated\n", filename);
+out:
+	if (readers != NULL) {
+		for (i = 0; i < rcount; i++)
+			free(readers[i]);
+		free(readers);
+	}
+	fclose(f);
+	return err;
+}
+
 static int list_drivers(void)
 {
 	int i;
@@ -304,6 +477,7 @@ static int list_drivers(void)
 	}
 	printf("Configured card drivers:\n");
 	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		sc_ctx_load_card_driver(ctx, ctx->card_drivers[i]);
 		printf("  %-16s %s\n", ctx->card_drivers[i]->short_name,
 		      ctx->card_drivers[i]->name);
 	}
@@ -539,6 +713,176 @@ static void print_serial(sc_card_t *in_card)
 		util_hex_dump_asc(stdout, serial.value, serial.len, -1);
 }
 
+#ifndef _WIN32
+/* Appends a JSON member to 'buf', escaping the string value */
+static void json_append(char *buf, size_t size, const char *name, const char *value)
+{
+	size_t len = strlen(buf);
+	const unsigned char *p;
+
+	len += snprintf(buf + len, len < size ? size - len : 0, "%s\"%s\":\"",
+			buf[1] == '\0' ? "" : ",", name);
+	for (p = (const unsigned char *) value; *p && len + 8 < size; p++) {
+		if (*p == '"' || *p == '\\')
+			len += sprintf(buf + len, "\\%c", *p);
+		else if (*p < 0x20)
+			len += sprintf(buf + len, "\\u%04x", *p);
+		else
+			buf[len++] = *p;
+	}
+	if (len + 2 < size) {
+		buf[len++] = '"';
+		buf[len] = '\0';
+	}
+}
+
+/* Connects to the card in one reader and writes its JSON line to 'fd'
+ * with a single write, so that the lines of the workers do not mix */
+static int inventory_reader(sc_context_t *wctx, const char *name, int fd,
+		int want_atr, int want_serial, int want_name)
+{
+	char line[2048], tmp[SC_MAX_ATR_SIZE * 3];
+	sc_reader_t *reader;
+	sc_card_t *wcard = NULL;
+	sc_serial_number_t serial;
+	size_t len;
+	int r;
+
+	strcpy(line, "{");
+	json_append(line, sizeof(line) - 2, "reader", name);
+
+	reader = sc_ctx_get_reader_by_name(wctx, name);
+	if (reader == NULL)
+		r = SC_ERROR_NO_READERS_FOUND;
+	else
+		r = sc_connect_card(reader, &wcard);
+	if (r == SC_SUCCESS) {
+		if (want_atr) {
+			sc_bin_to_hex(wcard->atr.value, wcard->atr.len, tmp, sizeof(tmp) - 1, ':');
+			json_append(line, sizeof(line) - 2, "atr", tmp);
+		}
+		if (want_name) {
+			json_append(line, sizeof(line) - 2, "name", wcard->name ? wcard->name : "");
+			json_append(line, sizeof(line) - 2, "driver", wcard->driver->short_name);
+		}
+		if (want_serial) {
+			r = sc_card_ctl(wcard, SC_CARDCTL_GET_SERIALNR, &serial);
+			if (r == SC_SUCCESS) {
+				sc_bin_to_hex(serial.value, serial.len, tmp, sizeof(tmp) - 1, 0);
+				json_append(line, sizeof(line) - 2, "serial", tmp);
+			}
+		}
+		sc_disconnect_card(wcard);
+	}
+	if (r != SC_SUCCESS)
+		json_append(line, sizeof(line) - 2, "error", sc_strerror(r));
+
+	len = strlen(line);
+	line[len++] = '}';
+	line[len++] = '\n';
+	if (write(fd, line, len) != (ssize_t) len)
+		return SC_ERROR_INTERNAL;
+	return r;
+}
+
+/* A worker has its own context, and so its own PC/SC connection: it must
+ * not use the one of the parent. It handles every n-th reader. */
+static void inventory_worker(char **names, size_t count, size_t first, size_t step, int fd,
+		const char *driver, int want_atr, int want_serial, int want_name)
+{
+	sc_context_param_t ctx_param;
+	sc_context_t *wctx = NULL;
+	size_t i;
+	int failed = 0;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver      = 0;
+	ctx_param.app_name = app_name;
+	if (sc_context_create(&wctx, &ctx_param) != SC_SUCCESS)
+		_exit(2);
+	wctx->enable_default_driver = 1;
+	if (driver != NULL && sc_set_card_driver(wctx, driver) != SC_SUCCESS)
+		_exit(2);
+
+	for (i = first; i < count; i += step)
+		if (inventory_reader(wctx, names[i], fd, want_atr, want_serial, want_name))
+			failed = 1;
+
+	sc_release_context(wctx);
+	_exit(failed);
+}
+
+/*
+ * The readers with a card are found with one status refresh of all readers,
+ * then their cards are queried by up to opt_workers processes at a time
+ */
+static int inventory_all_readers(const char *driver, int want_atr, int want_serial, int want_name)
+{
+	unsigned int i, rcount = sc_ctx_get_reader_count(ctx);
+	char **names, buf[4096];
+	size_t count = 0, workers, w;
+	pid_t *pids;
+	int fds[2], status, err = 0;
+	ssize_t n;
+
+	names = calloc(rcount + 1, sizeof(char *));
+	pids = calloc(opt_workers, sizeof(pid_t));
+	if (names == NULL || pids == NULL) {
+		free(names);
+		free(pids);
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+
+	sc_refresh_readers(ctx);
+	for (i = 0; i < rcount; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (reader != NULL && (sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			names[count++] = reader->name;
+	}
+	if (verbose)
+		fprintf(stderr, "%lu of %u readers have a card\n", (unsigned long) count, rcount);
+
+	if (count && pipe(fds) == 0) {
+		fflush(stdout);
+		fflush(stderr);
+		workers = count < (size_t) opt_workers ? count : (size_t) opt_workers;
+		for (w = 0; w < workers; w++) {
+			pids[w] = fork();
+			if (pids[w] == 0) {
+				close(fds[0]);
+				inventory_worker(names, count, w, workers, fds[1],
+						driver, want_atr, want_serial, want_name);
+			}
+			if (pids[w] < 0) {
+				perror("fork");
+				err = 1;
+				break;
+			}
+		}
+		close(fds[1]);
+
+		while ((n = read(fds[0], buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+			if (n > 0)
+				fwrite(buf, 1, n, stdout);
+		close(fds[0]);
+
+		while (w-- > 0)
+			if (waitpid(pids[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+				err = 1;
+	}
+	else if (count) {
+		perror("pipe");
+		err = 1;
+	}
+
+	free(names);
+	free(pids);
+	return err;
+}
+#endif
+
 static int list_algorithms(void)
 {
 	int i;
@@ -568,6 +912,8 @@ static int list_algorithms(void)
 		{ SC_ALGORITHM_RSA_PAD_PKCS1,      "pkcs1"     },
 		{ SC_ALGORITHM_RSA_PAD_ANSI,       "ansi"      },
 		{ SC_ALGORITHM_RSA_PAD_ISO9796,    "iso9796"   },
+		{ SC_ALGORITHM_RSA_PAD_PSS,        "pss"       },
+		{ SC_ALGORITHM_RSA_PAD_OAEP,       "oaep"      },
 		{ SC_ALGORITHM_RSA_HASH_SHA1,      "sha1"      },
 		{ SC_ALGORITHM_RSA_HASH_MD5,       "MD5"       },
 		{ SC_ALGORITHM_RSA_HASH_MD5_SHA1,  "md5-sha1"  },
@@ -653,7 +999,9 @@ int main(int argc, char * const argv[])
 	int do_print_serial = 0;
 	int do_print_name = 0;
 	int do_list_algorithms = 0;
+	int do_all_readers = 0;
 	int action_count = 0;
+	const char *opt_trace_file = NULL;
 	const char *opt_driver = NULL;
 	const char *opt_conf_entry = NULL;
 	char **p;
@@ -730,6 +1078,13 @@ int main(int argc, char * const argv[])
 		case 'w':
 			opt_wait = 1;
 			break;
+		case OPT_STATS:
+			opt_stats = 1;
+			break;
+		case OPT_DECODE_TRACE:
+			opt_trace_file = optarg;
+			action_count++;
+			break;
 		case OPT_SERIAL:
 			do_print_serial = 1;
 			action_count++;
@@ -738,15 +1093,31 @@ int main(int argc, char * const argv[])
 			do_list_algorithms = 1;
 			action_count++;
 			break;
+		case OPT_ALL_READERS:
+			do_all_readers = 1;
+			break;
+		case OPT_WORKERS:
+			opt_workers = atoi(optarg);
+			if (opt_workers < 1)
+				util_print_usage_and_die(app_name, options, option_help, NULL);
+			break;
 		}
 	}
-	if (action_count == 0)
+	if (action_count == 0 && !do_all_readers)
+		util_print_usage_and_die(app_name, options, option_help, NULL);
+	if (do_all_readers && action_count != do_print_atr + do_print_serial + do_print_name)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 
 	if (do_info) {
 		opensc_info();
 		action_count--;
 	}
+	if (opt_trace_file) {
+		if ((err = decode_trace(opt_trace_file)))
+			return err;
+		if (--action_count <= 0)
+			return 0;
+	}
 
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
@@ -785,6 +1156,18 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+	if (do_all_readers) {
+#ifndef _WIN32
+		/* without a choice, all of ATR, serial number and name */
+		if (action_count == 0)
+			do_print_atr = do_print_serial = do_print_name = 1;
+		err = inventory_all_readers(opt_driver, do_print_atr, do_print_serial, do_print_name);
+#else
+		fprintf(stderr, "--all-readers is not supported on this platform\n");
+		err = 1;
+#endif
+		goto end;
+	}
 	if (action_count <= 0)
 		goto end;
 
@@ -842,6 +1225,8 @@ int main(int argc, char * const argv[])
 		action_count--;
 	}
 end:
+	if (ctx && opt_stats)
+		print_stats();
 	if (card) {
 		sc_unlock(card);
 		sc_disconnect_card(card);
@@ -48,6 +48,7 @@
 #include "libopensc/opensc.h"
 #include "libopensc/cardctl.h"
 #include "libopensc/asn1.h"
+#include "libopensc/compression.h"
 #include "util.h"
 
 static const char *app_name = "piv-tool";
@@ -86,7 +87,7 @@ static const char *option_help[] = {
 	"authenticate using default 3des key",
 	"Generate key <ref>:<alg> 9A:06 on card, and output pubkey",
 	"Load an object <containerID> containerID as defined in 800-73 without leading 0x",
-	"Load a cert <ref> where <ref> is 9A,9C,9D or 9E",
+	"Load a cert <ref> where <ref> is 9A,9C,9D or 9E, gziped if smaller",
 	"Load a cert that has been gziped <ref>",
 	"Output file for cert or key",
 	"Inout file for cert",
@@ -197,6 +198,27 @@ static int load_cert(const char * cert_id, const char * cert_file,
 		der = malloc(derlen);
 		p = der;
 		i2d_X509(cert, &p);
+#ifdef ENABLE_ZLIB
+		{
+			/* the card-piv.c reads it back through the CertInfo flag:
+			 * fewer bytes to write now and to read on every bind */
+			u8 *packed = NULL;
+			size_t packedlen = 0;
+
+			if (sc_compress_alloc(&packed, &packedlen, der, derlen, COMPRESSION_GZIP) == SC_SUCCESS
+					&& packedlen < derlen) {
+				if (verbose)
+					printf("certificate gziped from %lu to %lu bytes\n",
+						(unsigned long)derlen, (unsigned long)packedlen);
+				free(der);
+				der = packed;
+				derlen = packedlen;
+				compress = 1;
+			} else {
+				free(packed);
+			}
+		}
+#endif
 	}
     fclose(fp);
 	sc_hex_to_bin(cert_id, buf,&buflen);
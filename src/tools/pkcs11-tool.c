@@ -24,6 +24,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#define BENCHMARK_THREADS
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
@@ -102,7 +112,16 @@ enum {
 	OPT_NEW_PIN,
 	OPT_LOGIN_TYPE,
 	OPT_TEST_EC,
-	OPT_DERIVE
+	OPT_DERIVE,
+	OPT_BENCHMARK,
+	OPT_BENCHMARK_THREADS,
+	OPT_BENCHMARK_SESSIONS,
+	OPT_BENCHMARK_DURATION,
+	OPT_BENCHMARK_COUNT,
+	OPT_BENCHMARK_WARMUP,
+	OPT_BENCHMARK_JSON,
+	OPT_HOTPLUG_CYCLES,
+	OPT_TEST_ALL_SLOTS
 };
 
 static const struct option options[] = {
@@ -158,6 +177,15 @@ static const struct option options[] = {
 	{ "verbose",		0, NULL,		'v' },
 	{ "private",		0, NULL,		OPT_PRIVATE },
 	{ "test-ec",		0, NULL,		OPT_TEST_EC },
+	{ "benchmark",		1, NULL,		OPT_BENCHMARK },
+	{ "benchmark-threads",	1, NULL,		OPT_BENCHMARK_THREADS },
+	{ "benchmark-sessions",	1, NULL,		OPT_BENCHMARK_SESSIONS },
+	{ "benchmark-duration",	1, NULL,		OPT_BENCHMARK_DURATION },
+	{ "benchmark-count",	1, NULL,		OPT_BENCHMARK_COUNT },
+	{ "benchmark-warmup",	1, NULL,		OPT_BENCHMARK_WARMUP },
+	{ "benchmark-json",	0, NULL,		OPT_BENCHMARK_JSON },
+	{ "hotplug-cycles",	1, NULL,		OPT_HOTPLUG_CYCLES },
+	{ "test-all-slots",	0, NULL,		OPT_TEST_ALL_SLOTS },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -214,7 +242,16 @@ static const char *option_help[] = {
 	"Test Mozilla-like keypair gen and cert req, <arg>=certfile",
 	"Verbose operation. (Set OPENSC_DEBUG to enable OpenSC specific debugging)",
 	"Set the CKA_PRIVATE attribute (object is only viewable after a login)",
-	"Test EC (best used with the --login or --pin option)"
+	"Test EC (best used with the --login or --pin option)",
+	"Measure throughput of 'sign' or 'decrypt' with the key selected by --id (use with --login)",
+	"Number of benchmark threads [1]",
+	"Number of benchmark sessions, shared by the threads [number of threads]",
+	"Run the benchmark for <arg> seconds [10]",
+	"Run the benchmark for <arg> operations instead of a fixed time",
+	"Number of untimed operations before the benchmark [1]",
+	"Print the benchmark results as JSON",
+	"With --test-hotplug, measure insert-to-ready latency over <arg> card insertions",
+	"Test all tokens concurrently, one thread and session per slot (best used with the --login and --pin options)"
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -249,11 +286,19 @@ static char *		opt_subject = NULL;
 static char *		opt_key_type = NULL;
 static int		opt_is_private = 0;
 static int		opt_test_hotplug = 0;
+static int		opt_hotplug_cycles = 0;
 static int		opt_login_type = -1;
 static int		opt_key_usage_sign = 0;
 static int		opt_key_usage_decrypt = 0;
 static int		opt_key_usage_derive = 0;
 static int		opt_key_usage_default = 1; /* uses defaults if no opt_key_usage options */
+static const char *	opt_benchmark = NULL;
+static int		opt_benchmark_threads = 1;
+static int		opt_benchmark_sessions = 0;
+static int		opt_benchmark_duration = 10;
+static unsigned long	opt_benchmark_count = 0;
+static int		opt_benchmark_warmup = 1;
+static int		opt_benchmark_json = 0;
 
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
@@ -346,13 +391,16 @@ static CK_MECHANISM_TYPE p11_name_to_mechanism(const char *);
 static void		p11_perror(const char *, CK_RV);
 static const char *	CKR2Str(CK_ULONG res);
 static int		p11_test(CK_SESSION_HANDLE session);
+static int		p11_test_all_slots(int do_login);
 static int test_card_detection(int);
+static int test_hotplug_latency(int);
 static int		hex_to_bin(const char *in, CK_BYTE *out, size_t *outlen);
 static void		test_kpgen_certwrite(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
 static void		test_ec(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
 static CK_RV		find_object_with_attributes(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE *out,
 				CK_ATTRIBUTE *attrs, CK_ULONG attrsLen, CK_ULONG obj_index);
 static CK_ULONG		get_private_key_length(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE prkey);
+static int		benchmark(CK_SLOT_ID slot, CK_OBJECT_HANDLE key);
 
 /* win32 needs this in open(2) */
 #ifndef O_BINARY
@@ -378,6 +426,7 @@ int main(int argc, char * argv[])
 	int do_delete_object = 0;
 	int do_set_id = 0;
 	int do_test = 0;
+	int do_test_all_slots = 0;
 	int do_test_kpgen_certwrite = 0;
 	int do_test_ec = 0;
 	int need_session = 0;
@@ -387,6 +436,7 @@ int main(int argc, char * argv[])
 	int do_change_pin = 0;
 	int do_unlock_pin = 0;
 	int action_count = 0;
+	CK_C_INITIALIZE_ARGS init_args;
 	CK_RV rv;
 
 #ifdef _WIN32
@@ -645,6 +695,40 @@ int main(int argc, char * argv[])
 			do_derive = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			if (strcmp(optarg, "sign") && strcmp(optarg, "decrypt")) {
+				printf("Unsupported benchmark operation \"%s\"\n", optarg);
+				util_print_usage_and_die(app_name, options, option_help, NULL);
+			}
+			need_session |= NEED_SESSION_RO;
+			opt_benchmark = optarg;
+			action_count++;
+			break;
+		case OPT_BENCHMARK_THREADS:
+			opt_benchmark_threads = atoi(optarg);
+			break;
+		case OPT_BENCHMARK_SESSIONS:
+			opt_benchmark_sessions = atoi(optarg);
+			break;
+		case OPT_BENCHMARK_DURATION:
+			opt_benchmark_duration = atoi(optarg);
+			break;
+		case OPT_BENCHMARK_COUNT:
+			opt_benchmark_count = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BENCHMARK_WARMUP:
+			opt_benchmark_warmup = atoi(optarg);
+			break;
+		case OPT_BENCHMARK_JSON:
+			opt_benchmark_json = 1;
+			break;
+		case OPT_HOTPLUG_CYCLES:
+			opt_hotplug_cycles = atoi(optarg);
+			break;
+		case OPT_TEST_ALL_SLOTS:
+			do_test_all_slots = 1;
+			action_count++;
+			break;
 		default:
 			util_print_usage_and_die(app_name, options, option_help, NULL);
 		}
@@ -656,11 +740,21 @@ int main(int argc, char * argv[])
 	if (action_count == 0)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 
+	if (do_test_all_slots && action_count > 1 + do_show_info + do_list_slots) {
+		fprintf(stderr, "Error: --test-all-slots can only be combined with --show-info and --list-slots\n");
+		util_print_usage_and_die(app_name, options, option_help, NULL);
+	}
+
 	module = C_LoadModule(opt_module, &p11);
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
-	rv = p11->C_Initialize(NULL);
+	/* the benchmark threads and the per-slot tests call the module
+	 * at the same time */
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+	rv = p11->C_Initialize((opt_benchmark && opt_benchmark_threads > 1) || do_test_all_slots
+			? &init_args : NULL);
 	if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED)
 		printf("\n*** Cryptoki library has already been initialized ***\n");
 	else if (rv != CKR_OK)
@@ -671,7 +765,11 @@ int main(int argc, char * argv[])
 
 	list_slots(list_token_slots, 1, do_list_slots);
 
-	if (opt_test_hotplug) {
+	if (opt_test_hotplug && opt_hotplug_cycles > 0) {
+		if (test_hotplug_latency(opt_hotplug_cycles))
+			err = 1;
+	}
+	else if (opt_test_hotplug) {
 		test_card_detection(0);
 		test_card_detection(1);
 	}
@@ -682,6 +780,11 @@ int main(int argc, char * argv[])
 		goto end;
 	}
 
+	if (do_test_all_slots) {
+		err = p11_test_all_slots(opt_login);
+		goto end;
+	}
+
 	if (!opt_slot_set && (action_count > do_list_slots)) {
 		if (opt_slot_description) {
 			if (!find_slot_by_description(opt_slot_description, &opt_slot)) {
@@ -736,7 +839,7 @@ int main(int argc, char * argv[])
 	if (do_list_mechs)
 		list_mechs(opt_slot);
 
-	if (do_sign) {
+	if (do_sign || opt_benchmark) {
 		CK_TOKEN_INFO	info;
 
 		get_token_info(opt_slot, &info);
@@ -793,7 +896,7 @@ int main(int argc, char * argv[])
 		goto end;
 	}
 
-	if (do_sign || do_derive) {
+	if (do_sign || do_derive || opt_benchmark) {
 		if (!find_object(session, CKO_PRIVATE_KEY, &object,
 					opt_object_id_len ? opt_object_id : NULL,
 					opt_object_id_len, 0))
@@ -861,6 +964,9 @@ int main(int argc, char * argv[])
 
 	if (do_test_ec)
 		test_ec(opt_slot, session);
+
+	if (opt_benchmark)
+		err = benchmark(opt_slot, object);
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -1077,10 +1183,15 @@ static int login(CK_SESSION_HANDLE session, int login_type)
 	char		*pin = NULL;
 	size_t		len = 0;
 	int		pin_allocated = 0, r;
+	CK_SESSION_INFO	session_info;
 	CK_TOKEN_INFO	info;
 	CK_RV		rv;
 
-	get_token_info(opt_slot, &info);
+	/* not opt_slot: the tests log in on the sessions of all slots */
+	rv = p11->C_GetSessionInfo(session, &session_info);
+	if (rv != CKR_OK)
+		p11_fatal("C_GetSessionInfo", rv);
+	get_token_info(session_info.slotID, &info);
 
 	/* Identify which pin to enter */
 
@@ -1442,6 +1553,273 @@ static void sign_data(CK_SLOT_ID slot, CK_SESSION_HANDLE session,
 		close(fd);
 }
 
+struct bench_session {
+	CK_SESSION_HANDLE	handle;
+#ifdef BENCHMARK_THREADS
+	pthread_mutex_t		lock;
+#endif
+};
+
+struct bench_thread {
+	struct bench_session	*session;
+	int			shared;
+	unsigned long		quota;		/* 0: run until the deadline */
+	unsigned long		ops, errors;
+	CK_RV			first_error;
+	unsigned long		*latency;	/* usec per successful operation */
+	size_t			latency_size;
+#ifdef BENCHMARK_THREADS
+	pthread_t		thread;
+#endif
+};
+
+static int			bench_decrypt;
+static CK_OBJECT_HANDLE		bench_key;
+static unsigned char		bench_in[1024];
+static CK_ULONG			bench_in_len;
+static unsigned long long	bench_deadline;
+
+static unsigned long long bench_now(void)
+{
+#if defined(_WIN32)
+	return (unsigned long long) GetTickCount() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static CK_RV bench_op(CK_SESSION_HANDLE session)
+{
+	unsigned char	out[1024];
+	CK_ULONG	out_len = sizeof(out);
+	CK_MECHANISM	mech;
+	CK_RV		rv;
+
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = opt_mechanism;
+
+	if (bench_decrypt) {
+		rv = p11->C_DecryptInit(session, &mech, bench_key);
+		if (rv == CKR_OK)
+			rv = p11->C_Decrypt(session, bench_in, bench_in_len, out, &out_len);
+	}
+	else {
+		rv = p11->C_SignInit(session, &mech, bench_key);
+		if (rv == CKR_OK)
+			rv = p11->C_Sign(session, bench_in, bench_in_len, out, &out_len);
+	}
+	return rv;
+}
+
+static void *bench_run(void *arg)
+{
+	struct bench_thread *t = arg;
+	unsigned long long start, end = bench_now();
+	CK_RV rv;
+
+	for (;;) {
+		if (t->quota ? t->ops + t->errors >= t->quota : end >= bench_deadline)
+			break;
+#ifdef BENCHMARK_THREADS
+		if (t->shared)
+			pthread_mutex_lock(&t->session->lock);
+#endif
+		start = bench_now();
+		rv = bench_op(t->session->handle);
+		end = bench_now();
+#ifdef BENCHMARK_THREADS
+		if (t->shared)
+			pthread_mutex_unlock(&t->session->lock);
+#endif
+		if (rv != CKR_OK) {
+			if (t->errors++ == 0)
+				t->first_error = rv;
+			continue;
+		}
+		if (t->ops == t->latency_size) {
+			size_t size = t->latency_size ? 2 * t->latency_size : 1024;
+			unsigned long *p = realloc(t->latency, size * sizeof(*p));
+
+			if (p == NULL)
+				util_fatal("out of memory");
+			t->latency = p;
+			t->latency_size = size;
+		}
+		t->latency[t->ops++] = (unsigned long) (end - start);
+	}
+	return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of a sorted array, in milliseconds */
+static double bench_percentile(const unsigned long *lat, size_t n, int p)
+{
+	size_t i = (p * n + 99) / 100;
+
+	if (n == 0)
+		return 0;
+	return lat[i ? i - 1 : 0] / 1000.0;
+}
+
+static int benchmark(CK_SLOT_ID slot, CK_OBJECT_HANDLE key)
+{
+	struct bench_session *sessions;
+	struct bench_thread *threads;
+	unsigned long	*lat, ops = 0, errors = 0;
+	unsigned long long start, elapsed;
+	CK_RV		rv, first_error = CKR_OK;
+	int		nthreads = opt_benchmark_threads, nsessions, i;
+	double		seconds, rate;
+
+	if (nthreads < 1)
+		util_fatal("Invalid number of benchmark threads\n");
+#ifndef BENCHMARK_THREADS
+	if (nthreads > 1)
+		util_fatal("This build of %s does not support benchmark threads\n", app_name);
+#endif
+	nsessions = opt_benchmark_sessions > 0 ? opt_benchmark_sessions : nthreads;
+	if (nsessions > nthreads)
+		nsessions = nthreads;
+	if (opt_benchmark_count == 0 && opt_benchmark_duration < 1)
+		util_fatal("Invalid benchmark duration\n");
+
+	bench_decrypt = !strcmp(opt_benchmark, "decrypt");
+	bench_key = key;
+	if (!opt_mechanism_used)
+		if (!find_mechanism(slot, (bench_decrypt ? CKF_DECRYPT : CKF_SIGN) | CKF_HW,
+					NULL, 0, &opt_mechanism))
+			util_fatal("%s mechanism not supported\n", bench_decrypt ? "Decrypt" : "Sign");
+
+	if (opt_input != NULL) {
+		int fd, r;
+
+		if ((fd = open(opt_input, O_RDONLY|O_BINARY)) < 0)
+			util_fatal("Cannot open %s: %m", opt_input);
+		r = read(fd, bench_in, sizeof(bench_in));
+		if (r < 0)
+			util_fatal("Cannot read from %s: %m", opt_input);
+		close(fd);
+		bench_in_len = r;
+	}
+	else if (bench_decrypt) {
+		util_fatal("The decrypt benchmark needs a ciphertext given with --input-file\n");
+	}
+	else {
+		/* the size of a SHA-256 digest fits every signature mechanism */
+		memset(bench_in, 0x5A, 32);
+		bench_in_len = 32;
+	}
+
+	sessions = calloc(nsessions, sizeof(*sessions));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (sessions == NULL || threads == NULL)
+		util_fatal("out of memory");
+
+	/* The login state is shared by all sessions of the application,
+	 * so the new sessions need no login of their own. */
+	for (i = 0; i < nsessions; i++) {
+		rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &sessions[i].handle);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+#ifdef BENCHMARK_THREADS
+		pthread_mutex_init(&sessions[i].lock, NULL);
+#endif
+	}
+
+	for (i = 0; i < opt_benchmark_warmup; i++) {
+		rv = bench_op(sessions[i % nsessions].handle);
+		if (rv != CKR_OK)
+			p11_fatal(bench_decrypt ? "C_Decrypt" : "C_Sign", rv);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].session = &sessions[i % nsessions];
+		threads[i].shared = nthreads > nsessions;
+		if (opt_benchmark_count)
+			threads[i].quota = opt_benchmark_count / nthreads
+				+ ((unsigned long) i < opt_benchmark_count % nthreads);
+	}
+
+	start = bench_now();
+	bench_deadline = start + (unsigned long long) opt_benchmark_duration * 1000000;
+#ifdef BENCHMARK_THREADS
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]))
+			util_fatal("Cannot create benchmark thread: %m");
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].thread, NULL);
+#else
+	bench_run(&threads[0]);
+#endif
+	elapsed = bench_now() - start;
+
+	for (i = 0; i < nthreads; i++) {
+		ops += threads[i].ops;
+		errors += threads[i].errors;
+		if (first_error == CKR_OK)
+			first_error = threads[i].first_error;
+	}
+	lat = malloc((ops ? ops : 1) * sizeof(*lat));
+	if (lat == NULL)
+		util_fatal("out of memory");
+	for (ops = 0, i = 0; i < nthreads; i++) {
+		memcpy(lat + ops, threads[i].latency, threads[i].ops * sizeof(*lat));
+		ops += threads[i].ops;
+		free(threads[i].latency);
+	}
+	qsort(lat, ops, sizeof(*lat), bench_cmp);
+
+	seconds = elapsed / 1000000.0;
+	rate = seconds > 0 ? ops / seconds : 0;
+	if (opt_benchmark_json) {
+		printf("{\"operation\":\"%s\",\"mechanism\":\"%s\",\"threads\":%d,\"sessions\":%d,"
+			"\"operations\":%lu,\"errors\":%lu,\"seconds\":%.3f,\"ops_per_sec\":%.2f,"
+			"\"latency_ms\":{\"min\":%.3f,\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f}}\n",
+			opt_benchmark, p11_mechanism_to_name(opt_mechanism), nthreads, nsessions,
+			ops, errors, seconds, rate,
+			bench_percentile(lat, ops, 0), bench_percentile(lat, ops, 50),
+			bench_percentile(lat, ops, 95), bench_percentile(lat, ops, 99),
+			bench_percentile(lat, ops, 100));
+	}
+	else {
+		printf("Benchmark %s using %s, %d thread(s), %d session(s)\n",
+			opt_benchmark, p11_mechanism_to_name(opt_mechanism), nthreads, nsessions);
+		printf("  Operations: %lu in %.3f s, %lu failed", ops, seconds, errors);
+		if (errors)
+			printf(" (first error %s)", CKR2Str(first_error));
+		printf("\n  Throughput: %.2f ops/s\n", rate);
+		printf("  Latency:    min %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			bench_percentile(lat, ops, 0), bench_percentile(lat, ops, 50),
+			bench_percentile(lat, ops, 95), bench_percentile(lat, ops, 99),
+			bench_percentile(lat, ops, 100));
+	}
+
+	for (i = 0; i < nsessions; i++) {
+		p11->C_CloseSession(sessions[i].handle);
+#ifdef BENCHMARK_THREADS
+		pthread_mutex_destroy(&sessions[i].lock);
+#endif
+	}
+	free(lat);
+	free(threads);
+	free(sessions);
+	return errors ? 1 : 0;
+}
+
 static void hash_data(CK_SLOT_ID slot, CK_SESSION_HANDLE session)
 {
 	unsigned char	buffer[64];
@@ -4139,21 +4517,179 @@ static int test_card_detection(int wait_for_event)
 	return 0;
 }
 
-static int p11_test(CK_SESSION_HANDLE session)
+/* time allowed for the token to become usable after its event */
+#define HOTPLUG_READY_TIMEOUT	(10 * 1000000ULL)
+
+/* Waits for slot events until the token of a slot is present, or the
+ * token of slot '*slot' is gone */
+static CK_RV hotplug_wait(CK_SLOT_ID *slot, int present)
 {
-	int errors = 0;
+	CK_SLOT_ID	event_slot;
+	CK_SLOT_INFO	info;
+	CK_RV		rv;
+
+	for (;;) {
+		rv = p11->C_WaitForSlotEvent(0, &event_slot, NULL);
+		if (rv != CKR_OK)
+			return rv;
+		if (!present && event_slot != *slot)
+			continue;
+		rv = p11->C_GetSlotInfo(event_slot, &info);
+		if (!present && (rv == CKR_SLOT_ID_INVALID || (rv == CKR_OK && !(info.flags & CKF_TOKEN_PRESENT))))
+			return CKR_OK;
+		if (present && rv == CKR_OK && (info.flags & CKF_TOKEN_PRESENT)) {
+			*slot = event_slot;
+			return CKR_OK;
+		}
+	}
+}
+
+/* Polls the token until C_GetTokenInfo succeeds, or fails with
+ * CKR_TOKEN_NOT_PRESENT if 'present' is not set */
+static CK_RV hotplug_poll_token(CK_SLOT_ID slot, int present)
+{
+	unsigned long long deadline = bench_now() + HOTPLUG_READY_TIMEOUT;
+	CK_TOKEN_INFO	info;
+	CK_RV		rv;
+
+	do {
+		rv = p11->C_GetTokenInfo(slot, &info);
+		if (present ? rv == CKR_OK : (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_SLOT_ID_INVALID))
+			return CKR_OK;
+	} while (bench_now() < deadline);
+	return present ? rv : CKR_FUNCTION_FAILED;
+}
+
+static CK_RV hotplug_find_object(CK_SLOT_ID slot)
+{
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ULONG	count = 0;
+	CK_RV		rv;
+
+	rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rv != CKR_OK)
+		return rv;
+	rv = p11->C_FindObjectsInit(session, NULL, 0);
+	if (rv == CKR_OK) {
+		rv = p11->C_FindObjects(session, &object, 1, &count);
+		p11->C_FindObjectsFinal(session);
+	}
+	p11->C_CloseSession(session);
+	return rv;
+}
+
+static void hotplug_report(const char *name, unsigned long *lat, size_t n)
+{
+	qsort(lat, n, sizeof(*lat), bench_cmp);
+	printf("  %-24s %4lu  min %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		name, (unsigned long) n,
+		bench_percentile(lat, n, 0), bench_percentile(lat, n, 50),
+		bench_percentile(lat, n, 95), bench_percentile(lat, n, 99),
+		bench_percentile(lat, n, 100));
+}
+
+/*
+ * Measures, over 'cycles' insertions and removals, the delay from the prompt
+ * to the slot event, then from the event to C_GetTokenInfo succeeding and to
+ * the first C_FindObjects of a new session. The prompts are meant for a
+ * test rig that switches the card as soon as it reads them: with a person
+ * at the reader, the event delays include the reaction time.
+ */
+static int test_hotplug_latency(int cycles)
+{
+	enum { INS_EVENT, INS_READY, INS_FIND, REM_EVENT, REM_GONE, HOTPLUG_METRICS };
+	static const char *names[HOTPLUG_METRICS] = {
+		"insert: event", "insert: token info", "insert: find objects",
+		"remove: event", "remove: token absent"
+	};
+	unsigned long	*lat[HOTPLUG_METRICS];
+	size_t		n[HOTPLUG_METRICS];
+	unsigned long long start, event;
+	CK_SLOT_ID	slot = 0;
+	CK_RV		rv;
+	int		i, failures = 0;
+
+	for (i = 0; i < HOTPLUG_METRICS; i++) {
+		lat[i] = calloc(cycles, sizeof(unsigned long));
+		if (lat[i] == NULL)
+			util_fatal("Not enough memory");
+		n[i] = 0;
+	}
+
+	printf("Measuring hotplug latency over %d cycle(s)\n", cycles);
+	for (i = 0; i < cycles; i++) {
+		printf("Insert card (%d/%d)\n", i + 1, cycles);
+		fflush(stdout);
+		start = bench_now();
+		rv = hotplug_wait(&slot, 1);
+		if (rv != CKR_OK) {
+			p11_perror("C_WaitForSlotEvent", rv);
+			break;
+		}
+		event = bench_now();
+		lat[INS_EVENT][n[INS_EVENT]++] = event - start;
+
+		rv = hotplug_poll_token(slot, 1);
+		if (rv == CKR_OK) {
+			lat[INS_READY][n[INS_READY]++] = bench_now() - event;
+			rv = hotplug_find_object(slot);
+			if (rv == CKR_OK)
+				lat[INS_FIND][n[INS_FIND]++] = bench_now() - event;
+		}
+		if (rv != CKR_OK) {
+			fprintf(stderr, "Token in slot 0x%lx not usable: %s\n", slot, CKR2Str(rv));
+			failures++;
+		}
 
-	errors += test_random(session);
+		printf("Remove card (%d/%d)\n", i + 1, cycles);
+		fflush(stdout);
+		start = bench_now();
+		rv = hotplug_wait(&slot, 0);
+		if (rv != CKR_OK) {
+			p11_perror("C_WaitForSlotEvent", rv);
+			break;
+		}
+		event = bench_now();
+		lat[REM_EVENT][n[REM_EVENT]++] = event - start;
 
-	errors += test_digest(session);
+		if (hotplug_poll_token(slot, 0) == CKR_OK) {
+			lat[REM_GONE][n[REM_GONE]++] = bench_now() - event;
+		} else {
+			fprintf(stderr, "Token in slot 0x%lx still reported after removal\n", slot);
+			failures++;
+		}
+	}
 
-	errors += test_signature(session);
+	printf("Hotplug latency, %d failure(s); ready and removal times are counted from the event\n", failures);
+	for (i = 0; i < HOTPLUG_METRICS; i++) {
+		hotplug_report(names[i], lat[i], n[i]);
+		free(lat[i]);
+	}
 
-	errors += test_verify(session);
+	return failures || rv != CKR_OK;
+}
 
-	errors += test_unwrap(session);
+static const struct {
+	const char	*name;
+	int		(*run)(CK_SESSION_HANDLE);
+} p11_tests[] = {
+	{ "random",	test_random },
+	{ "digest",	test_digest },
+	{ "signature",	test_signature },
+	{ "verify",	test_verify },
+	{ "unwrap",	test_unwrap },
+	{ "decrypt",	test_decrypt }
+};
+#define P11_TESTS	(sizeof(p11_tests) / sizeof(p11_tests[0]))
 
-	errors += test_decrypt(session);
+static int p11_test(CK_SESSION_HANDLE session)
+{
+	int errors = 0;
+	size_t i;
+
+	for (i = 0; i < P11_TESTS; i++)
+		errors += p11_tests[i].run(session);
 
 	if (errors == 0)
 		printf("No errors\n");
@@ -4163,6 +4699,117 @@ static int p11_test(CK_SESSION_HANDLE session)
 	return errors;
 }
 
+/*
+ * --test-all-slots runs the tests of p11_test() on every token at once,
+ * each in a thread and session of its own. The output of the tests
+ * interleaves, so the errors and times are summed up per slot at the end.
+ */
+struct test_slot {
+	CK_SLOT_ID		slot;
+	char			label[33];
+	CK_SESSION_HANDLE	session;
+	int			errors[P11_TESTS];
+	unsigned long long	usec[P11_TESTS];
+#ifdef BENCHMARK_THREADS
+	pthread_t		thread;
+#endif
+};
+
+static void *test_slot_run(void *arg)
+{
+	struct test_slot *t = arg;
+	unsigned long long start;
+	size_t i;
+
+	for (i = 0; i < P11_TESTS; i++) {
+		start = bench_now();
+		t->errors[i] = p11_tests[i].run(t->session);
+		t->usec[i] = bench_now() - start;
+	}
+	return NULL;
+}
+
+static int p11_test_all_slots(int do_login)
+{
+	struct test_slot *slots;
+	unsigned long long start, elapsed, usec;
+	size_t	n = 0, i, j;
+	int	errors = 0, slot_errors;
+	CK_RV	rv;
+
+	slots = calloc(p11_num_slots, sizeof(*slots));
+	if (slots == NULL)
+		util_fatal("out of memory");
+
+	/* Log in before starting the threads, the PIN may have to be
+	 * entered for each token. */
+	for (i = 0; i < p11_num_slots; i++) {
+		struct test_slot *t = &slots[n];
+		CK_SLOT_INFO	info;
+		CK_TOKEN_INFO	token;
+		CK_FLAGS	flags = CKF_SERIAL_SESSION;
+
+		rv = p11->C_GetSlotInfo(p11_slots[i], &info);
+		if (rv != CKR_OK)
+			p11_fatal("C_GetSlotInfo", rv);
+		if (!(info.flags & CKF_TOKEN_PRESENT))
+			continue;
+		get_token_info(p11_slots[i], &token);
+		t->slot = p11_slots[i];
+		snprintf(t->label, sizeof(t->label), "%.32s",
+				p11_utf8_to_local(token.label, sizeof(token.label)));
+
+		if (do_login)
+			flags |= CKF_RW_SESSION;
+		rv = p11->C_OpenSession(t->slot, flags, NULL, NULL, &t->session);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+		if (do_login && login(t->session, opt_login_type == -1 ? (int) CKU_USER : opt_login_type))
+			util_fatal("No PIN entered for the token in slot 0x%lx\n", t->slot);
+		n++;
+	}
+	if (n == 0) {
+		fprintf(stderr, "No slot with a token was found.\n");
+		free(slots);
+		return 1;
+	}
+
+	printf("Testing %lu token(s)\n", (unsigned long) n);
+	fflush(stdout);
+	start = bench_now();
+#ifdef BENCHMARK_THREADS
+	for (i = 0; i < n; i++)
+		if (pthread_create(&slots[i].thread, NULL, test_slot_run, &slots[i]))
+			util_fatal("Cannot create test thread: %m");
+	for (i = 0; i < n; i++)
+		pthread_join(slots[i].thread, NULL);
+#else
+	for (i = 0; i < n; i++)
+		test_slot_run(&slots[i]);
+#endif
+	elapsed = bench_now() - start;
+
+	printf("\nTested %lu token(s) in %.3f s\n", (unsigned long) n, elapsed / 1000000.0);
+	for (i = 0; i < n; i++) {
+		struct test_slot *t = &slots[i];
+
+		for (usec = 0, slot_errors = 0, j = 0; j < P11_TESTS; j++) {
+			usec += t->usec[j];
+			slot_errors += t->errors[j];
+		}
+		printf("Slot 0x%lx \"%s\": %d error(s) in %.3f s\n",
+				t->slot, t->label, slot_errors, usec / 1000000.0);
+		for (j = 0; j < P11_TESTS; j++)
+			printf("  %-10s %d error(s) in %.3f s\n", p11_tests[j].name,
+					t->errors[j], t->usec[j] / 1000000.0);
+		errors += slot_errors;
+		p11->C_CloseSession(t->session);
+	}
+
+	free(slots);
+	return errors ? 1 : 0;
+}
+
 /* Does about the same as Mozilla does when you go to an on-line CA
  * for obtaining a certificate: key pair generation, signing the
  * cert request + some other tests, writing certs and changing
@@ -4751,6 +5398,8 @@ static struct mech_info	p11_mechanisms[] = {
       { CKM_AES_MAC,		"AES-MAC", NULL },
       { CKM_AES_MAC_GENERAL,	"AES-MAC-GENERAL", NULL },
       { CKM_AES_CBC_PAD,	"AES-CBC-PAD", NULL },
+      { CKM_AES_CTR,		"AES-CTR", NULL },
+      { CKM_AES_GCM,		"AES-GCM", NULL },
       { CKM_GOSTR3410_KEY_PAIR_GEN,"GOSTR3410-KEY-PAIR-GEN", NULL },
       { CKM_GOSTR3410,		"GOSTR3410", NULL },
       { CKM_GOSTR3410_WITH_GOSTR3411,"GOSTR3410-WITH-GOSTR3411", NULL },
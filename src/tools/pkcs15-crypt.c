@@ -27,6 +27,15 @@
 #endif
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
@@ -46,6 +55,7 @@ static char * opt_pincode = NULL, * opt_key_id = NULL;
 static char * opt_input = NULL, * opt_output = NULL;
 static char * opt_bind_to_aid = NULL;
 static int opt_crypt_flags = 0;
+static int opt_batch = 0;
 
 enum {
 	OPT_SHA1 = 	0x100,
@@ -56,6 +66,7 @@ enum {
 	OPT_MD5,
 	OPT_PKCS1,
 	OPT_BIND_TO_AID,
+	OPT_BATCH,
 };
 
 static const struct option options[] = {
@@ -75,6 +86,7 @@ static const struct option options[] = {
 	{ "pkcs1",		0, NULL,		OPT_PKCS1 },
 	{ "pin",		1, NULL,		'p' },
 	{ "aid",		1, NULL,		OPT_BIND_TO_AID },
+	{ "batch",		0, NULL,		OPT_BATCH },
 	{ "wait",		0, NULL,		'w' },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
@@ -97,6 +109,7 @@ static const char *option_help[] = {
 	"Use PKCS #1 v1.5 padding",
 	"Uses password (PIN) <arg> (use - for reading PIN from STDIN)",
 	"Specify AID of the on-card PKCS#15 application to be binded to (in hexadecimal form)",
+	"Process many inputs: length-prefixed records from the input file or STDIN, or all files of the input directory",
 	"Wait for card insertion",
 	"Verbose operation. Use several times to enable debug output.",
 };
@@ -190,11 +203,50 @@ static int write_output(const u8 *buf, int len)
 	return 0;
 }
 
+/* Signs one input, returns the length of the signature or an error */
+static int sign_buffer(struct sc_pkcs15_object *obj, const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	struct sc_pkcs15_prkey_info *key = (struct sc_pkcs15_prkey_info *) obj->data;
+	int r;
+
+	if (obj->type == SC_PKCS15_TYPE_PRKEY_RSA
+			&& !(opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1)
+			&& inlen != key->modulus_length/8) {
+		fprintf(stderr, "Input has to be exactly %lu bytes, when using no padding.\n",
+			(unsigned long) key->modulus_length/8);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	r = sc_pkcs15_compute_signature(p15card, obj, opt_crypt_flags, in, inlen, out, outlen);
+	if (r < 0)
+		fprintf(stderr, "Compute signature failed: %s\n", sc_strerror(r));
+	return r;
+}
+
+/* Deciphers one input, returns the length of the plain text or an error */
+static int decipher_buffer(struct sc_pkcs15_object *obj, const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	int r;
+
+	r = sc_pkcs15_decipher(p15card, obj, opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1, in, inlen, out, outlen);
+	if (r < 0)
+		fprintf(stderr, "Decrypt failed: %s\n", sc_strerror(r));
+	return r;
+}
+
+static int check_native_key(struct sc_pkcs15_object *obj)
+{
+	if (!((struct sc_pkcs15_prkey_info *) obj->data)->native) {
+		fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	return 0;
+}
+
 static int sign(struct sc_pkcs15_object *obj)
 {
 	u8 buf[1024], out[1024];
-	struct sc_pkcs15_prkey_info *key = (struct sc_pkcs15_prkey_info *) obj->data;
-	int r, c, len;
+	int r, c;
 
 	if (opt_input == NULL) {
 		fprintf(stderr, "No input file specified.\n");
@@ -204,24 +256,14 @@ static int sign(struct sc_pkcs15_object *obj)
 	c = read_input(buf, sizeof(buf));
 	if (c < 0)
 		return 2;
-	len = sizeof(out);
-	if (obj->type == SC_PKCS15_TYPE_PRKEY_RSA
-			&& !(opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1)
-			&& (size_t)c != key->modulus_length/8) {
-		fprintf(stderr, "Input has to be exactly %lu bytes, when using no padding.\n",
-			(unsigned long) key->modulus_length/8);
-		return 2;
-	}
-	if (!key->native) {
-		fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
-		return SC_ERROR_NOT_SUPPORTED;
-	}
+	if ((r = check_native_key(obj)))
+		return r;
 
-	r = sc_pkcs15_compute_signature(p15card, obj, opt_crypt_flags, buf, c, out, len);
-	if (r < 0) {
-		fprintf(stderr, "Compute signature failed: %s\n", sc_strerror(r));
+	r = sign_buffer(obj, buf, c, out, sizeof(out));
+	if (r == SC_ERROR_INVALID_ARGUMENTS)
+		return 2;
+	if (r < 0)
 		return 1;
-	}
 
 	r = write_output(out, r);
 
@@ -231,7 +273,7 @@ static int sign(struct sc_pkcs15_object *obj)
 static int decipher(struct sc_pkcs15_object *obj)
 {
 	u8 buf[1024], out[1024];
-	int r, c, len;
+	int r, c;
 
 	if (opt_input == NULL) {
 		fprintf(stderr, "No input file specified.\n");
@@ -241,20 +283,277 @@ static int decipher(struct sc_pkcs15_object *obj)
 	if (c < 0)
 		return 2;
 
-	len = sizeof(out);
-	if (!((struct sc_pkcs15_prkey_info *) obj->data)->native) {
-                fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
-		return SC_ERROR_NOT_SUPPORTED;
+	if ((r = check_native_key(obj)))
+		return r;
+
+	r = decipher_buffer(obj, buf, c, out, sizeof(out));
+	if (r < 0)
+		return 1;
+	r = write_output(out, r);
+
+	return 0;
+}
+
+/*
+ * Batch mode: the card is bound and the PIN verified once, and the card
+ * stays locked while all inputs are processed, so that the security
+ * environment of the key is set only for the first operation.
+ *
+ * A stream of inputs is a sequence of records, each a 4 byte big endian
+ * length followed by that many bytes. The outputs are written as records
+ * of the same format, in the same order; a failed operation gives an
+ * empty record.
+ */
+typedef int (*crypt_func_t)(struct sc_pkcs15_object *, const u8 *, size_t, u8 *, size_t);
+
+struct batch_stats {
+	unsigned int done, failed;
+};
+
+/* Returns 1 if a record was read, 0 at the end of the input, or an error */
+static int read_record(FILE *inf, u8 *buf, size_t buflen, size_t *len)
+{
+	u8 hdr[4], skip[256];
+	size_t n, left;
+
+	n = fread(hdr, 1, sizeof(hdr), inf);
+	if (n == 0 && feof(inf))
+		return 0;
+	if (n != sizeof(hdr))
+		return SC_ERROR_FILE_END_REACHED;
+
+	*len = (size_t) hdr[0] << 24 | (size_t) hdr[1] << 16 | (size_t) hdr[2] << 8 | hdr[3];
+	if (*len <= buflen) {
+		if (fread(buf, 1, *len, inf) != *len)
+			return SC_ERROR_FILE_END_REACHED;
+		return 1;
+	}
+
+	/* too long for any key: skip it, the next records are still fine */
+	for (left = *len; left > 0; left -= n) {
+		n = fread(skip, 1, left < sizeof(skip) ? left : sizeof(skip), inf);
+		if (n == 0)
+			return SC_ERROR_FILE_END_REACHED;
+	}
+	return SC_ERROR_BUFFER_TOO_SMALL;
+}
+
+static int write_record(FILE *outf, const u8 *buf, size_t len)
+{
+	u8 hdr[4];
+
+	hdr[0] = (u8) (len >> 24);
+	hdr[1] = (u8) (len >> 16);
+	hdr[2] = (u8) (len >> 8);
+	hdr[3] = (u8) len;
+	if (fwrite(hdr, 1, sizeof(hdr), outf) != sizeof(hdr)
+			|| (len && fwrite(buf, 1, len, outf) != len)) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+static int batch_stream(struct sc_pkcs15_object *obj, crypt_func_t func, struct batch_stats *stats)
+{
+	FILE *inf = stdin, *outf = stdout;
+	u8 buf[1024], out[1024];
+	size_t len;
+	int r, ret = 0;
+
+	if (opt_input != NULL && strcmp(opt_input, "-") != 0) {
+		inf = fopen(opt_input, "rb");
+		if (inf == NULL) {
+			fprintf(stderr, "Unable to open '%s' for reading.\n", opt_input);
+			return 2;
+		}
+	}
+	if (opt_output != NULL && strcmp(opt_output, "-") != 0) {
+		outf = fopen(opt_output, "wb");
+		if (outf == NULL) {
+			fprintf(stderr, "Unable to open '%s' for writing.\n", opt_output);
+			if (inf != stdin)
+				fclose(inf);
+			return 2;
+		}
 	}
+#ifdef _WIN32
+	_setmode(_fileno(inf), _O_BINARY);
+	_setmode(_fileno(outf), _O_BINARY);
+#endif
+
+	while (1) {
+		r = read_record(inf, buf, sizeof(buf), &len);
+		if (r == 0)
+			break;
+		if (r == SC_ERROR_FILE_END_REACHED) {
+			fprintf(stderr, "Truncated input record %u.\n", stats->done + 1);
+			ret = 2;
+			break;
+		}
+		if (r == SC_ERROR_BUFFER_TOO_SMALL) {
+			fprintf(stderr, "Input record %u is too long (%lu bytes).\n",
+				stats->done + 1, (unsigned long) len);
+		}
+		else {
+			r = func(obj, buf, len, out, sizeof(out));
+		}
 
-	r = sc_pkcs15_decipher(p15card, obj, opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1, buf, c, out, len);
+		stats->done++;
+		if (r < 0) {
+			stats->failed++;
+			r = 0;
+		}
+		if (write_record(outf, out, r)) {
+			ret = 1;
+			break;
+		}
+	}
+
+	if (inf != stdin)
+		fclose(inf);
+	if (outf != stdout)
+		fclose(outf);
+	else
+		fflush(stdout);
+	return ret;
+}
+
+#ifndef _WIN32
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Every regular file of the input directory is one input; the output goes
+ * to the file of the same name in the output directory */
+static int batch_directory(struct sc_pkcs15_object *obj, crypt_func_t func, struct batch_stats *stats)
+{
+	char **names = NULL, path[PATH_MAX];
+	size_t i, count = 0, size = 0;
+	u8 buf[1024], out[1024];
+	struct dirent *de;
+	struct stat st;
+	FILE *f;
+	DIR *dir;
+	int r, c, ret = 0;
+
+	if (opt_output == NULL || stat(opt_output, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "With an input directory, the output has to be a directory.\n");
+		return 2;
+	}
+
+	dir = opendir(opt_input);
+	if (dir == NULL) {
+		fprintf(stderr, "Cannot open directory %s: %s\n", opt_input, strerror(errno));
+		return 2;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (count == size) {
+			char **tmp = realloc(names, (size + 32) * sizeof(char *));
+
+			if (tmp == NULL)
+				break;
+			names = tmp;
+			size += 32;
+		}
+		names[count] = strdup(de->d_name);
+		if (names[count] == NULL)
+			break;
+		count++;
+	}
+	closedir(dir);
+	if (count)
+		qsort(names, count, sizeof(char *), compare_names);
+
+	for (i = 0; i < count; i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", opt_input, names[i]) >= (int) sizeof(path)
+				|| stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (st.st_size > (off_t) sizeof(buf)) {
+			fprintf(stderr, "Input file '%s' is too long.\n", path);
+			stats->done++;
+			stats->failed++;
+			continue;
+		}
+		f = fopen(path, "rb");
+		if (f == NULL) {
+			fprintf(stderr, "Unable to open '%s' for reading.\n", path);
+			stats->done++;
+			stats->failed++;
+			continue;
+		}
+		c = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+
+		stats->done++;
+		r = func(obj, buf, c, out, sizeof(out));
+		if (r < 0) {
+			fprintf(stderr, "Operation on '%s' failed.\n", path);
+			stats->failed++;
+			continue;
+		}
+
+		if (snprintf(path, sizeof(path), "%s/%s", opt_output, names[i]) >= (int) sizeof(path)
+				|| (f = fopen(path, "wb")) == NULL) {
+			fprintf(stderr, "Unable to open '%s' for writing.\n", path);
+			ret = 1;
+			break;
+		}
+		if (fwrite(out, 1, r, f) != (size_t) r) {
+			fprintf(stderr, "Unable to write '%s'.\n", path);
+			ret = 1;
+		}
+		fclose(f);
+		if (ret)
+			break;
+	}
+
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	return ret;
+}
+#endif
+
+static int batch(struct sc_pkcs15_object *obj, crypt_func_t func)
+{
+	struct batch_stats stats;
+	struct stat st;
+	int r;
+
+	if ((r = check_native_key(obj)))
+		return r;
+
+	r = sc_lock(card);
 	if (r < 0) {
-		fprintf(stderr, "Decrypt failed: %s\n", sc_strerror(r));
+		fprintf(stderr, "Unable to lock the card: %s\n", sc_strerror(r));
 		return 1;
 	}
-	r = write_output(out, r);
 
-	return 0;
+	memset(&stats, 0, sizeof(stats));
+	if (opt_input != NULL && strcmp(opt_input, "-") != 0
+			&& stat(opt_input, &st) == 0 && S_ISDIR(st.st_mode)) {
+#ifndef _WIN32
+		r = batch_directory(obj, func, &stats);
+#else
+		fprintf(stderr, "Input directories are not supported on this platform.\n");
+		r = 2;
+#endif
+	}
+	else {
+		r = batch_stream(obj, func, &stats);
+	}
+	sc_unlock(card);
+
+	if (verbose)
+		fprintf(stderr, "%u input(s) processed, %u failed.\n", stats.done, stats.failed);
+	if (r == 0 && stats.failed)
+		r = 1;
+	return r;
 }
 
 static int get_key(unsigned int usage, sc_pkcs15_object_t **result)
@@ -389,6 +688,9 @@ int main(int argc, char * const argv[])
 		case OPT_BIND_TO_AID:
 			opt_bind_to_aid = optarg;
 			break;
+		case OPT_BATCH:
+			opt_batch = 1;
+			break;
 		case 'w':
 			opt_wait = 1;
 			break;
@@ -445,7 +747,7 @@ int main(int argc, char * const argv[])
 
 	if (do_decipher) {
 		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_DECRYPT, &key))
-		 || (err = decipher(key)))
+		 || (err = opt_batch ? batch(key, decipher_buffer) : decipher(key)))
 			goto end;
 		action_count--;
 	}
@@ -454,7 +756,7 @@ int main(int argc, char * const argv[])
 		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_SIGN|
 				   SC_PKCS15_PRKEY_USAGE_SIGNRECOVER|
 				   SC_PKCS15_PRKEY_USAGE_NONREPUDIATION, &key))
-		 || (err = sign(key)))
+		 || (err = opt_batch ? batch(key, sign_buffer) : sign(key)))
 			goto end;
 		action_count--;
 	}
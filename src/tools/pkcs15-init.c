@@ -33,11 +33,21 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <assert.h>
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
 #include <openssl/conf.h>
@@ -96,6 +106,7 @@ static int	do_finalize_card(sc_card_t *, struct sc_profile *);
 
 static int	do_read_data_object(const char *name, u8 **out, size_t *outlen);
 static int	do_store_data_object(struct sc_profile *profile);
+static int	do_import_directory(struct sc_profile *profile, const char *dirname);
 static int	do_sanity_check(struct sc_profile *profile);
 
 static int	init_keyargs(struct sc_pkcs15init_prkeyargs *);
@@ -114,6 +125,8 @@ static int	do_read_certificate(const char *, const char *, X509 **);
 static char *	cert_common_name(X509 *x509);
 static void	parse_commandline(int argc, char **argv);
 static void	read_options_file(const char *);
+static int	personalize_card(void);
+static int	do_batch(const char *);
 static void	ossl_print_errors(void);
 static int	verify_pin(struct sc_pkcs15_card *, char *);
 
@@ -138,6 +151,8 @@ enum {
 	OPT_UPDATE_LAST_UPDATE,
 	OPT_ERASE_APPLICATION,
 	OPT_IGNORE_CA_CERTIFICATES,
+	OPT_BATCH,
+	OPT_IMPORT_DIR,
 
 	OPT_PIN1     = 0x10000,	/* don't touch these values */
 	OPT_PUK1     = 0x10001,
@@ -158,6 +173,7 @@ const struct option	options[] = {
 	{ "store-certificate",	required_argument, NULL,	'X' },
 	{ "update-certificate",	required_argument, NULL,	'U' },
 	{ "store-data",		required_argument, NULL,	'W' },
+	{ "import-directory",	required_argument, NULL,	OPT_IMPORT_DIR },
 	{ "delete-objects",	required_argument, NULL,	'D' },
 	{ "change-attributes",	required_argument, NULL,	'A' },
 	{ "sanity-check",	no_argument, NULL,		OPT_SANITY_CHECK},
@@ -199,6 +215,7 @@ const struct option	options[] = {
 	{ "profile",		required_argument, NULL,	'p' },
 	{ "card-profile",	required_argument, NULL,	'c' },
 	{ "options-file",	required_argument, NULL,	OPT_OPTIONS },
+	{ "batch",		required_argument, NULL,	OPT_BATCH },
 	{ "wait",		no_argument, NULL,		'w' },
 	{ "help",		no_argument, NULL,		'h' },
 	{ "verbose",		no_argument, NULL,		'v' },
@@ -218,6 +235,7 @@ static const char *		option_help[] = {
 	"Store an X.509 certificate",
 	"Update an X.509 certificate (carefull with mail decryption certs!!)",
 	"Store a data object",
+	"Store all PKCS #12 files and certificates of a directory",
 	"Delete object(s) (use \"help\" for more information)",
 	"Change attribute(s) (use \"help\" for more information)",
 	"Card specific sanity check and possibly update procedure",
@@ -258,6 +276,7 @@ static const char *		option_help[] = {
 	"Specify the general profile to use",
 	"Specify the card profile to use",
 	"Read additional command line options from file",
+	"Personalize the cards in several readers at once, as listed in file",
 	"Wait for card insertion",
 	"Display this message",
 	"Verbose operation. Use several times to enable debug output.",
@@ -279,6 +298,7 @@ enum {
 	ACTION_STORE_CERT,
 	ACTION_UPDATE_CERT,
 	ACTION_STORE_DATA,
+	ACTION_IMPORT_DIR,
 	ACTION_FINALIZE_CARD,
 	ACTION_CHANGE_ATTRIBUTES,
 	ACTION_SANITY_CHECK,
@@ -300,6 +320,7 @@ static const char *action_names[] = {
 	"store certificate",
 	"update certificate",
 	"store data object",
+	"import directory",
 	"finalizing card",
 	"change attribute(s)",
 	"check card's sanity",
@@ -328,6 +349,8 @@ static sc_context_t *	ctx = NULL;
 static sc_card_t *		card = NULL;
 static struct sc_pkcs15_card *	p15card = NULL;
 static char *			opt_reader = NULL;
+static char *			opt_batch = NULL;
+static char *			opt_import_dir = NULL;
 static unsigned int		opt_actions;
 static int			opt_extractable = 0,
 				opt_insecure = 0,
@@ -417,10 +440,6 @@ static int	get_new_pin(sc_ui_hints_t *, const char *, const char *,
 int
 main(int argc, char **argv)
 {
-	struct sc_profile	*profile = NULL;
-	unsigned int		n;
-	int			r = 0;
-
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
 	OPENSSL_config(NULL);
 #endif
@@ -436,6 +455,21 @@ main(int argc, char **argv)
 
 	if (optind != argc)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
+	if (opt_batch)
+		return do_batch(opt_batch);
+	return personalize_card();
+}
+
+/*
+ * Run the requested actions on the card in opt_reader
+ */
+static int
+personalize_card(void)
+{
+	struct sc_profile	*profile = NULL;
+	unsigned int		n;
+	int			r = 0;
+
 	if (opt_actions == 0) {
 		fprintf(stderr, "No action specified.\n");
 		util_print_usage_and_die(app_name, options, option_help, NULL);
@@ -515,6 +549,13 @@ main(int argc, char **argv)
 		if (verbose && action != ACTION_ASSERT_PRISTINE)
 			printf("About to %s.\n", action_names[action]);
 
+		/* a key comes with its public key and certificate chain;
+		 * write each directory file once for all of them */
+		if (p15card && (action == ACTION_STORE_PRIVKEY || action == ACTION_STORE_PUBKEY
+				|| action == ACTION_STORE_CERT || action == ACTION_STORE_DATA
+				|| action == ACTION_IMPORT_DIR))
+			sc_pkcs15init_begin_batch(profile);
+
 		switch (action) {
 		case ACTION_ASSERT_PRISTINE:
 			/* skip printing error message */
@@ -545,6 +586,9 @@ main(int argc, char **argv)
 		case ACTION_STORE_DATA:
 			r = do_store_data_object(profile);
 			break;
+		case ACTION_IMPORT_DIR:
+			r = do_import_directory(profile, opt_import_dir);
+			break;
 		case ACTION_DELETE_OBJECTS:
 			r = do_delete_objects(profile, opt_delete_flags);
 			break;
@@ -570,6 +614,12 @@ main(int argc, char **argv)
 			util_fatal("Action not yet implemented\n");
 		}
 
+		if (profile->batch.depth > 0) {
+			int rc = sc_pkcs15init_commit_batch(p15card, profile);
+			if (r >= 0)
+				r = rc;
+		}
+
 		if (r < 0) {
 			fprintf(stderr, "Failed to %s: %s\n",
 				action_names[action], sc_strerror(r));
@@ -592,6 +642,108 @@ out:
 	return r < 0? 1 : 0;
 }
 
+/*
+ * Personalize several cards concurrently, one process per reader.
+ *
+ * Each line of the batch file names a reader and an options file with
+ * the options for the card in it (PINs, labels, key and certificate
+ * files), e.g.
+ *	0	alice.opts
+ *	1	bob.opts
+ * The options given on the command line apply to every card.
+ */
+#define MAX_BATCH_CARDS	64
+static int
+do_batch(const char *filename)
+{
+#ifdef _WIN32
+	util_error("--batch is not supported on this platform\n");
+	return 1;
+#else
+	struct {
+		char	*reader;
+		char	*options;
+		pid_t	pid;
+		int	status;
+	} cards[MAX_BATCH_CARDS];
+	char	buffer[1024], *reader, *options;
+	int	count = 0, failed = 0, i, j;
+	FILE	*fp;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		util_fatal("Unable to open %s: %m", filename);
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		buffer[strcspn(buffer, "\n")] = '\0';
+		reader = strtok(buffer, " \t");
+		if (reader == NULL || *reader == '#')
+			continue;
+		options = strtok(NULL, " \t");
+		if (options == NULL)
+			util_fatal("%s: no options file for reader %s", filename, reader);
+		if (count == MAX_BATCH_CARDS)
+			util_fatal("%s: more than %d cards", filename, MAX_BATCH_CARDS);
+		for (i = 0; i < count; i++)
+			if (!strcmp(cards[i].reader, reader))
+				util_fatal("%s: reader %s listed twice", filename, reader);
+		cards[count].reader = strdup(reader);
+		cards[count].options = strdup(options);
+		cards[count].status = -1;
+		if (!cards[count].reader || !cards[count].options)
+			util_fatal("Out of memory");
+		count++;
+	}
+	fclose(fp);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < count; i++) {
+		cards[i].pid = fork();
+		if (cards[i].pid == 0) {
+			int fd;
+
+			/* nobody to answer prompts of concurrent cards */
+			fd = open("/dev/null", O_RDONLY);
+			if (fd >= 0) {
+				dup2(fd, 0);
+				close(fd);
+			}
+			opt_reader = cards[i].reader;
+			read_options_file(cards[i].options);
+			exit(personalize_card());
+		}
+		if (cards[i].pid < 0)
+			util_error("Cannot start reader %s: %m\n", cards[i].reader);
+	}
+
+	for (i = 0; i < count; i++) {
+		pid_t pid;
+		int status;
+
+		if (cards[i].pid <= 0)
+			continue;
+		pid = wait(&status);
+		if (pid < 0)
+			break;
+		for (j = 0; j < count; j++)
+			if (cards[j].pid == pid)
+				cards[j].status = status;
+	}
+
+	for (i = 0; i < count; i++) {
+		int ok = cards[i].pid > 0 && WIFEXITED(cards[i].status)
+			&& WEXITSTATUS(cards[i].status) == 0;
+
+		printf("%s\t%s\t%s\n", cards[i].reader, cards[i].options,
+			ok ? "done" : "FAILED");
+		if (!ok)
+			failed++;
+		free(cards[i].reader);
+		free(cards[i].options);
+	}
+	return failed ? 1 : 0;
+#endif
+}
+
 static int
 open_reader_and_card(char *reader)
 {
@@ -1079,6 +1231,151 @@ do_store_certificate(struct sc_profile *profile)
 	return r;
 }
 
+#ifndef _WIN32
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Store a certificate read from an import directory; it is labeled with
+ * its common name, and a CA certificate is skipped if it is on the card
+ */
+static int
+import_certificate(struct sc_profile *profile, const char *filename, const char *format)
+{
+	struct sc_pkcs15init_certargs args;
+	char	namebuf[SC_PKCS15_MAX_LABEL_SIZE-1];
+	X509	*cert = NULL;
+	int	r;
+
+	memset(&args, 0, sizeof(args));
+	args.authority = opt_authority;
+
+	r = do_read_certificate(filename, format, &cert);
+	if (r >= 0)
+		r = do_convert_cert(&args.der_encoded, cert);
+	if (r >= 0) {
+		args.label = cert_common_name(cert);
+		if (!args.label)
+			args.label = X509_NAME_oneline(cert->cert_info->subject, namebuf, sizeof(namebuf));
+
+		if (args.authority && is_cacert_already_present(&args))
+			printf("  already present, not stored\n");
+		else
+			r = sc_pkcs15init_store_certificate(p15card, profile, &args, NULL);
+	}
+
+	if (args.der_encoded.value)
+		free(args.der_encoded.value);
+	if (cert)
+		X509_free(cert);
+
+	return r;
+}
+
+/*
+ * Store the keys and certificates of all PKCS #12 (.p12, .pfx) and
+ * certificate (.pem, .crt, .cer, .der) files of a directory, in the order
+ * of their names. They are all written within one pkcs15init batch and
+ * under the card lock taken when connecting, so that the PINs are asked
+ * for once and each directory file is written once at the end.
+ */
+static int
+do_import_directory(struct sc_profile *profile, const char *dirname)
+{
+	char	*saved_infile = opt_infile, *saved_format = opt_format;
+	char	*saved_objectid = opt_objectid, *saved_cert_label = opt_cert_label;
+	char	**names = NULL, path[PATH_MAX];
+	size_t	i, count = 0, size = 0;
+	unsigned int stored = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR	*dir;
+	int	r = 0;
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		fprintf(stderr, "Cannot open directory %s: %s\n", dirname, strerror(errno));
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (count == size) {
+			char **tmp = realloc(names, (size + 32) * sizeof(char *));
+
+			if (tmp == NULL)
+				break;
+			names = tmp;
+			size += 32;
+		}
+		names[count] = strdup(de->d_name);
+		if (names[count] == NULL)
+			break;
+		count++;
+	}
+	closedir(dir);
+	if (count)
+		qsort(names, count, sizeof(char *), compare_names);
+
+	/* one ID and label cannot be given to several objects */
+	opt_objectid = NULL;
+	opt_cert_label = NULL;
+
+	for (i = 0; i < count && r >= 0; i++) {
+		const char *ext = strrchr(names[i], '.');
+
+		if (snprintf(path, sizeof(path), "%s/%s", dirname, names[i]) >= (int) sizeof(path)
+				|| stat(path, &st) != 0 || !S_ISREG(st.st_mode) || ext == NULL)
+			continue;
+
+		if (!strcasecmp(ext, ".p12") || !strcasecmp(ext, ".pfx")) {
+			printf("Importing key %s\n", names[i]);
+			opt_infile = path;
+			opt_format = "pkcs12";
+			r = do_store_private_key(profile);
+		}
+		else if (!strcasecmp(ext, ".pem") || !strcasecmp(ext, ".crt") || !strcasecmp(ext, ".cer")) {
+			printf("Importing certificate %s\n", names[i]);
+			r = import_certificate(profile, path, "pem");
+		}
+		else if (!strcasecmp(ext, ".der")) {
+			printf("Importing certificate %s\n", names[i]);
+			r = import_certificate(profile, path, "der");
+		}
+		else {
+			if (verbose)
+				printf("Skipping %s\n", names[i]);
+			continue;
+		}
+		if (r < 0)
+			fprintf(stderr, "Failed to import %s: %s\n", names[i], sc_strerror(r));
+		else
+			stored++;
+	}
+
+	opt_infile = saved_infile;
+	opt_format = saved_format;
+	opt_objectid = saved_objectid;
+	opt_cert_label = saved_cert_label;
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+
+	printf("%u files imported from %s\n", stored, dirname);
+	return r;
+}
+#else
+static int
+do_import_directory(struct sc_profile *profile, const char *dirname)
+{
+	fprintf(stderr, "Importing a directory is not supported on this platform\n");
+	return SC_ERROR_NOT_SUPPORTED;
+}
+#endif
+
 static int
 do_read_check_certificate(sc_pkcs15_cert_t *sc_oldcert,
 	const char *filename, const char *format, sc_pkcs15_der_t *newcert_raw)
@@ -2444,6 +2741,13 @@ handle_option(const struct option *opt)
 	case OPT_OPTIONS:
 		read_options_file(optarg);
 		break;
+	case OPT_BATCH:
+		opt_batch = optarg;
+		break;
+	case OPT_IMPORT_DIR:
+		this_action = ACTION_IMPORT_DIR;
+		opt_import_dir = optarg;
+		break;
 	case OPT_PIN1: case OPT_PUK1:
 	case OPT_PIN2: case OPT_PUK2:
 		opt_pins[opt->val & 3] = optarg;
@@ -57,6 +57,9 @@ static u8 * opt_pin = NULL;
 static u8 * opt_puk = NULL;
 static int	verbose = 0;
 static int opt_no_prompt = 0;
+static int opt_watch = 0;
+static int opt_watch_interval = 0;
+static int opt_json_certs = 0;
 
 enum {
 	OPT_CHANGE_PIN = 0x100,
@@ -76,7 +79,11 @@ enum {
 	OPT_BIND_TO_AID,
 	OPT_LIST_APPLICATIONS,
 	OPT_LIST_SKEYS,
-	OPT_NO_PROMPT
+	OPT_NO_PROMPT,
+	OPT_WATCH,
+	OPT_DUMP_JSON,
+	OPT_JSON_CERTS,
+	OPT_WATCH_INTERVAL
 };
 
 #define NELEMENTS(x)	(sizeof(x)/sizeof((x)[0]))
@@ -93,6 +100,8 @@ static const struct option options[] = {
 	{ "list-pins",		no_argument, NULL,		OPT_LIST_PINS },
 	{ "list-secret-keys",	no_argument, NULL,		OPT_LIST_SKEYS },
 	{ "dump",		no_argument, NULL,		'D' },
+	{ "dump-json",		no_argument, NULL,		OPT_DUMP_JSON },
+	{ "json-certificates",	no_argument, NULL,		OPT_JSON_CERTS },
 	{ "unblock-pin",	no_argument, NULL,		'u' },
 	{ "change-pin",		no_argument, NULL,		OPT_CHANGE_PIN },
 	{ "list-keys",          no_argument, NULL,		'k' },
@@ -115,6 +124,8 @@ static const struct option options[] = {
 	{ "wait",		no_argument, NULL,		'w' },
 	{ "verbose",		no_argument, NULL,		'v' },
 	{ "no-prompt",		no_argument, NULL,		OPT_NO_PROMPT },
+	{ "watch",		no_argument, NULL,		OPT_WATCH },
+	{ "watch-interval",	required_argument, NULL,	OPT_WATCH_INTERVAL },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -128,6 +139,8 @@ static const char *option_help[] = {
 	"Lists PIN codes",
 	"Lists secret keys",
 	"Dump card objects",
+	"Dump card objects as JSON, one line per object, while the DFs are read",
+	"With --dump-json, also read the certificates and output them in base64",
 	"Unblock PIN code",
 	"Change PIN or PUK code",
 	"Lists private keys",
@@ -150,6 +163,8 @@ static const char *option_help[] = {
 	"Wait for card insertion",
 	"Verbose operation. Use several times to enable debug output.",
 	"Do not prompt the user; if no PINs supplied, pinpad will be used.",
+	"With --learn-card, keep running and cache every card that is inserted",
+	"With --watch, check the cards in their readers for changes every <arg> seconds",
 };
 
 static sc_context_t *ctx = NULL;
@@ -179,7 +194,7 @@ print_access_rules(const struct sc_pkcs15_accessrule *rules, int num)
 {
 	int i, j;
 
-	if (!rules->access_mode)
+	if (!rules || !rules->access_mode)
 		return;
 
 	printf("\tAccess Rules   :");
@@ -262,47 +277,28 @@ static int
 print_pem_object(const char *kind, const u8*data, size_t data_len)
 {
 	FILE		*outf;
-	unsigned char	*buf = NULL;
-	size_t		buf_len = 1024;
 	int		r;
 
-	/* With base64, every 3 bytes yield 4 characters, and with
-	 * 64 chars per line we know almost exactly how large a buffer we
-	 * will need. */
-	buf_len = (data_len + 2) / 3 * 4;
-	buf_len += 2 * (buf_len / 64 + 2); /* certain platforms use CRLF */
-	buf_len += 64;			   /* slack for checksum etc */
-
-	if (!(buf = malloc(buf_len))) {
-		perror("print_pem_object");
-		return 1;
-	}
-
-	r = sc_base64_encode(data, data_len, buf, buf_len, 64);
-	if (r < 0) {
-		fprintf(stderr, "Base64 encoding failed: %s\n", sc_strerror(r));
-		free(buf);
-		return 1;
-	}
-
 	if (opt_outfile != NULL) {
 		outf = fopen(opt_outfile, "w");
 		if (outf == NULL) {
 			fprintf(stderr, "Error opening file '%s': %s\n",
 				opt_outfile, strerror(errno));
-			free(buf);
 			return 2;
 		}
 	} else
 		outf = stdout;
-	fprintf(outf,
-		"-----BEGIN %s-----\n"
-		"%s"
-		"-----END %s-----\n",
-		kind, buf, kind);
+	fprintf(outf, "-----BEGIN %s-----\n", kind);
+	r = sc_base64_encode_file(outf, data, data_len, 64);
+	if (r < 0) {
+		fprintf(stderr, "Base64 encoding failed: %s\n", sc_strerror(r));
+		if (outf != stdout)
+			fclose(outf);
+		return 1;
+	}
+	fprintf(outf, "-----END %s-----\n", kind);
 	if (outf != stdout)
 		fclose(outf);
-	free(buf);
 	return 0;
 }
 
@@ -356,6 +352,83 @@ print_data_object(const char *kind, const u8*data, size_t data_len)
 	return 0;
 }
 
+/* Where sc_pkcs15_read_file_stream() puts a file read by the tool */
+struct stream_out {
+	FILE *outf;
+	int pem;		/* base64, in lines of 64 characters */
+	u8 carry[48];		/* bytes of a line not complete yet */
+	size_t carry_len;
+	size_t total;
+};
+
+static int
+stream_out_write(void *arg, const u8 *data, size_t len)
+{
+	struct stream_out *s = arg;
+	size_t n;
+
+	s->total += len;
+	if (!s->pem)
+		return fwrite(data, 1, len, s->outf) == len ? 0 : SC_ERROR_INTERNAL;
+
+	/* whole lines only, for the same text as print_pem_object() */
+	if (s->carry_len) {
+		n = sizeof(s->carry) - s->carry_len;
+		if (n > len)
+			n = len;
+		memcpy(s->carry + s->carry_len, data, n);
+		s->carry_len += n;
+		data += n;
+		len -= n;
+		if (s->carry_len < sizeof(s->carry))
+			return 0;
+		if (sc_base64_encode_file(s->outf, s->carry, sizeof(s->carry), 64) < 0)
+			return SC_ERROR_INTERNAL;
+		s->carry_len = 0;
+	}
+	n = len - len % sizeof(s->carry);
+	if (n && sc_base64_encode_file(s->outf, data, n, 64) < 0)
+		return SC_ERROR_INTERNAL;
+	memcpy(s->carry, data + n, len - n);
+	s->carry_len = len - n;
+	return 0;
+}
+
+/* Copies a file from the card to the output file, or to stdout, without
+ * holding all of it in memory; as PEM if 'kind' is given */
+static int
+stream_file(const struct sc_path *path, const char *kind, size_t *total)
+{
+	struct stream_out s;
+	int r;
+
+	memset(&s, 0, sizeof(s));
+	s.pem = kind != NULL;
+	s.outf = stdout;
+	if (opt_outfile != NULL) {
+		s.outf = fopen(opt_outfile, "w");
+		if (s.outf == NULL) {
+			fprintf(stderr, "Error opening file '%s': %s\n",
+				opt_outfile, strerror(errno));
+			return SC_ERROR_INTERNAL;
+		}
+	}
+	if (kind)
+		fprintf(s.outf, "-----BEGIN %s-----\n", kind);
+	r = sc_pkcs15_read_file_stream(p15card, path, stream_out_write, &s);
+	if (r >= 0 && kind) {
+		if (sc_base64_encode_file(s.outf, s.carry, s.carry_len, 64) < 0)
+			r = SC_ERROR_INTERNAL;
+		else
+			fprintf(s.outf, "-----END %s-----\n", kind);
+	}
+	if (s.outf != stdout)
+		fclose(s.outf);
+	if (total)
+		*total = s.total;
+	return r;
+}
+
 static int read_certificate(void)
 {
 	int r, i, count;
@@ -380,6 +453,15 @@ static int read_certificate(void)
 
 		if (verbose)
 			printf("Reading certificate with ID '%s'\n", opt_cert);
+		if (!cinfo->value.len && cinfo->path.len) {
+			/* straight from the card to the output */
+			r = stream_file(&cinfo->path, "CERTIFICATE", NULL);
+			if (r < 0) {
+				fprintf(stderr, "Certificate read failed: %s\n", sc_strerror(r));
+				return 1;
+			}
+			return 0;
+		}
 		r = sc_pkcs15_read_certificate(p15card, cinfo, &cert);
 		if (r) {
 			fprintf(stderr, "Certificate read failed: %s\n", sc_strerror(r));
@@ -422,7 +504,22 @@ static int read_data_object(void)
 		if (verbose)
 			printf("Reading data object with label '%s'\n", opt_data);
 		r = authenticate(objs[i]);
-		if (r >= 0) {
+		if (r >= 0 && opt_outfile != NULL && !cinfo->data.value && cinfo->path.len) {
+			size_t total = 0;
+
+			/* straight from the card to the file */
+			r = stream_file(&cinfo->path, NULL, &total);
+			if (r) {
+				fprintf(stderr, "Data object read failed: %s\n", sc_strerror(r));
+				if (r == SC_ERROR_FILE_NOT_FOUND)
+					continue; /* DEE emulation may say there is a file */
+				return 1;
+			}
+			printf("Dumping (%lu bytes) to file <%s>\n",
+				(unsigned long) total, opt_outfile);
+			return 0;
+		}
+		else if (r >= 0) {
 			r = sc_pkcs15_read_data_object(p15card, cinfo, &data_object);
 			if (r) {
 				fprintf(stderr, "Data object read failed: %s\n", sc_strerror(r));
@@ -1291,6 +1388,285 @@ static int dump(void)
 	return 0;
 }
 
+/*
+ * JSON lines output for --dump-json: one object per line, written as soon
+ * as its DF entry is decoded
+ */
+static int json_fields = 0;
+
+static void json_key(const char *name)
+{
+	printf("%s\"%s\":", json_fields++ ? "," : "", name);
+}
+
+static void json_string(const char *name, const char *value)
+{
+	const unsigned char *p;
+
+	json_key(name);
+	putchar('"');
+	for (p = (const unsigned char *) value; p && *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+static void json_int(const char *name, long value)
+{
+	json_key(name);
+	printf("%ld", value);
+}
+
+static void json_begin(const char *record)
+{
+	json_fields = 0;
+	putchar('{');
+	json_string("record", record);
+}
+
+static void json_end(void)
+{
+	printf("}\n");
+	fflush(stdout);
+}
+
+static const char *json_type_name(unsigned int type)
+{
+	switch (type) {
+	case SC_PKCS15_TYPE_PRKEY_RSA:
+	case SC_PKCS15_TYPE_PUBKEY_RSA:
+		return "rsa";
+	case SC_PKCS15_TYPE_PRKEY_DSA:
+	case SC_PKCS15_TYPE_PUBKEY_DSA:
+		return "dsa";
+	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
+	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
+		return "gostr3410";
+	case SC_PKCS15_TYPE_PRKEY_EC:
+	case SC_PKCS15_TYPE_PUBKEY_EC:
+		return "ec";
+	case SC_PKCS15_TYPE_SKEY_GENERIC:
+		return "generic";
+	case SC_PKCS15_TYPE_SKEY_DES:
+		return "des";
+	case SC_PKCS15_TYPE_SKEY_2DES:
+		return "2des";
+	case SC_PKCS15_TYPE_SKEY_3DES:
+		return "3des";
+	case SC_PKCS15_TYPE_CERT_X509:
+		return "x509";
+	case SC_PKCS15_TYPE_CERT_SPKI:
+		return "spki";
+	case SC_PKCS15_TYPE_AUTH_PIN:
+		return "pin";
+	case SC_PKCS15_TYPE_AUTH_BIO:
+		return "bio";
+	case SC_PKCS15_TYPE_AUTH_AUTHKEY:
+		return "authkey";
+	}
+	return "unknown";
+}
+
+static void json_cert_value(const struct sc_pkcs15_cert_info *cert_info)
+{
+	u8 *buf = NULL;
+	size_t len = 0;
+	int r;
+
+	if (cert_info->value.value && cert_info->value.len) {
+		buf = cert_info->value.value;
+		len = cert_info->value.len;
+	}
+	else {
+		r = sc_pkcs15_read_file(p15card, &cert_info->path, &buf, &len);
+		if (r < 0) {
+			json_string("error", sc_strerror(r));
+			return;
+		}
+	}
+
+	json_key("value");
+	putchar('"');
+	sc_base64_encode_file(stdout, buf, len, 0);
+	putchar('"');
+
+	if (buf != cert_info->value.value)
+		free(buf);
+}
+
+static int json_print_object(struct sc_pkcs15_card *p15, struct sc_pkcs15_object *obj, void *arg)
+{
+	const char *df_path = arg;
+	struct sc_pkcs15_id id;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		json_begin("private-key");
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		json_begin("public-key");
+		break;
+	case SC_PKCS15_TYPE_SKEY:
+		json_begin("secret-key");
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		json_begin("certificate");
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		json_begin("data-object");
+		break;
+	case SC_PKCS15_TYPE_AUTH:
+		json_begin("authentication-object");
+		break;
+	default:
+		json_begin("object");
+		break;
+	}
+	json_string("type", json_type_name(obj->type));
+	if (df_path)
+		json_string("df", df_path);
+	json_string("label", obj->label);
+	json_int("flags", obj->flags);
+	if (obj->auth_id.len)
+		json_string("auth_id", sc_pkcs15_print_id(&obj->auth_id));
+	if (!sc_pkcs15_get_object_id(obj, &id))
+		json_string("id", sc_pkcs15_print_id(&id));
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		struct sc_pkcs15_prkey_info *info = (struct sc_pkcs15_prkey_info *) obj->data;
+
+		json_int("usage", info->usage);
+		json_int("access_flags", info->access_flags);
+		if (info->modulus_length)
+			json_int("modulus_length", (long) info->modulus_length);
+		if (info->field_length)
+			json_int("field_length", (long) info->field_length);
+		json_int("key_reference", info->key_reference);
+		json_int("native", info->native);
+		if (info->path.len || info->path.aid.len)
+			json_string("path", sc_print_path(&info->path));
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		struct sc_pkcs15_pubkey_info *info = (struct sc_pkcs15_pubkey_info *) obj->data;
+
+		json_int("usage", info->usage);
+		json_int("access_flags", info->access_flags);
+		if (info->modulus_length)
+			json_int("modulus_length", (long) info->modulus_length);
+		if (info->field_length)
+			json_int("field_length", (long) info->field_length);
+		json_int("key_reference", info->key_reference);
+		json_int("native", info->native);
+		if (info->path.len || info->path.aid.len)
+			json_string("path", sc_print_path(&info->path));
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		struct sc_pkcs15_skey_info *info = (struct sc_pkcs15_skey_info *) obj->data;
+
+		json_int("usage", info->usage);
+		json_int("access_flags", info->access_flags);
+		json_int("value_len", (long) info->value_len);
+		json_int("key_reference", info->key_reference);
+		if (info->path.len || info->path.aid.len)
+			json_string("path", sc_print_path(&info->path));
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		struct sc_pkcs15_cert_info *info = (struct sc_pkcs15_cert_info *) obj->data;
+
+		json_int("authority", info->authority);
+		if (info->path.len || info->path.aid.len)
+			json_string("path", sc_print_path(&info->path));
+		if (opt_json_certs)
+			json_cert_value(info);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		struct sc_pkcs15_data_info *info = (struct sc_pkcs15_data_info *) obj->data;
+		int idx;
+
+		json_string("application", info->app_label);
+		if (sc_valid_oid(&info->app_oid)) {
+			json_key("application_oid");
+			printf("\"%i", info->app_oid.value[0]);
+			for (idx = 1; idx < SC_MAX_OBJECT_ID_OCTETS && info->app_oid.value[idx] != -1 ; idx++)
+				printf(".%i", info->app_oid.value[idx]);
+			putchar('"');
+		}
+		if (info->path.len || info->path.aid.len)
+			json_string("path", sc_print_path(&info->path));
+		break;
+	}
+	case SC_PKCS15_TYPE_AUTH: {
+		struct sc_pkcs15_auth_info *info = (struct sc_pkcs15_auth_info *) obj->data;
+
+		json_int("auth_method", info->auth_method);
+		if (info->auth_type == SC_PKCS15_PIN_AUTH_TYPE_PIN) {
+			json_int("pin_flags", info->attrs.pin.flags);
+			json_int("pin_type", info->attrs.pin.type);
+			json_int("min_length", (long) info->attrs.pin.min_length);
+			json_int("max_length", (long) info->attrs.pin.max_length);
+			json_int("reference", info->attrs.pin.reference);
+		}
+		json_int("tries_left", info->tries_left);
+		if (info->path.len || info->path.aid.len)
+			json_string("path", sc_print_path(&info->path));
+		break;
+	}
+	}
+
+	json_end();
+	return 0;
+}
+
+/*
+ * Each DF is read entry by entry and every object is printed right after
+ * its entry is decoded. Certificates are only read with --json-certificates.
+ */
+static int dump_json(void)
+{
+	struct sc_pkcs15_df *df;
+	struct sc_pkcs15_object *obj;
+	char *last_update = sc_pkcs15_get_lastupdate(p15card);
+	char df_path[SC_MAX_PATH_STRING_SIZE + SC_MAX_AID_STRING_SIZE];
+	int r, err = 0;
+
+	json_begin("token");
+	json_string("label", p15card->tokeninfo->label);
+	json_int("version", p15card->tokeninfo->version);
+	json_string("serial_number", p15card->tokeninfo->serial_number);
+	json_string("manufacturer_id", p15card->tokeninfo->manufacturer_id);
+	if (last_update)
+		json_string("last_update", last_update);
+	json_int("flags", p15card->tokeninfo->flags);
+	json_end();
+
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (sc_path_print(df_path, sizeof(df_path), &df->path) != SC_SUCCESS)
+			df_path[0] = '\0';
+		r = sc_pkcs15_walk_df(p15card, df, json_print_object, df_path);
+		if (r < 0) {
+			fprintf(stderr, "Failed to read DF %s: %s\n", df_path, sc_strerror(r));
+			err = 1;
+		}
+	}
+
+	/* objects of emulated cards do not come from DFs */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj->df == NULL)
+			json_print_object(p15card, obj, NULL);
+
+	return err;
+}
+
 static int unblock_pin(void)
 {
 	struct sc_pkcs15_auth_info *pinfo = NULL;
@@ -1545,8 +1921,10 @@ static int learn_card(void)
 		return 1;
 	}
 
-	/* Cache all relevant DF files. The cache
+	/* Cache the ODF and all relevant DF files. The cache
 	 * directory is created automatically. */
+	if (p15card->file_odf != NULL)
+		read_and_cache_file(&p15card->file_odf->path);
 	for (df = p15card->df_list; df != NULL; df = df->next)
 		read_and_cache_file(&df->path);
 	printf("Caching %d certificate(s)...\n", cert_count);
@@ -1571,6 +1949,115 @@ static int learn_card(void)
 	return 0;
 }
 
+static int bind_card(void)
+{
+	if (opt_bind_to_aid)   {
+		struct sc_aid aid;
+
+		aid.len = sizeof(aid.value);
+		if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len))   {
+			fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
+			return SC_ERROR_INVALID_ARGUMENTS;
+		}
+		return sc_pkcs15_bind(card, &aid, &p15card);
+	}
+	return sc_pkcs15_bind(card, NULL, &p15card);
+}
+
+/* The name of the cache follows the lastUpdate of the card, so a cache
+ * holding the ODF is current. Without lastUpdate a change of the card can
+ * not be seen, and it is always learned again. */
+static int card_cache_is_current(void)
+{
+	const u8 *buf;
+	size_t len;
+
+	if (p15card->file_odf == NULL || sc_pkcs15_get_lastupdate(p15card) == NULL)
+		return 0;
+	return sc_pkcs15_map_cached_file(p15card, &p15card->file_odf->path, &buf, &len) == SC_SUCCESS;
+}
+
+static void release_card(void)
+{
+	if (p15card) {
+		sc_pkcs15_unbind(p15card);
+		p15card = NULL;
+	}
+	if (card) {
+		sc_unlock(card);
+		sc_disconnect_card(card);
+		card = NULL;
+	}
+}
+
+/* Binds the card in 'reader' and caches it, unless the cache is current */
+static void refresh_card_cache(struct sc_reader *reader)
+{
+	int r;
+
+	r = sc_connect_card(reader, &card);
+	if (r == SC_SUCCESS) {
+		r = sc_lock(card);
+		if (r != SC_SUCCESS) {
+			sc_disconnect_card(card);
+			card = NULL;
+		}
+	}
+	if (r == SC_SUCCESS)
+		r = bind_card();
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Cannot bind card in reader %s: %s\n", reader->name, sc_strerror(r));
+	}
+	else if (card_cache_is_current()) {
+		if (verbose)
+			printf("Cache of the card in reader %s is up to date.\n", reader->name);
+	}
+	else {
+		p15card->opts.use_file_cache = 0;
+		learn_card();
+	}
+	release_card();
+}
+
+/* Keeps the file cache of every inserted card up to date, so that the
+ * processes binding the card afterwards find it there. With an interval,
+ * the cards left in their readers are checked for a new lastUpdate too. */
+static int watch_and_learn(void)
+{
+	struct sc_reader *found, *watched = NULL;
+	unsigned int event, i;
+	int r, timeout = opt_watch_interval > 0 ? opt_watch_interval * 1000 : -1;
+
+	/* --reader selected the reader of the first card */
+	if (opt_reader && card)
+		watched = card->reader;
+	release_card();
+
+	fprintf(stderr, "Waiting for a card to be inserted...\n");
+	for (;;) {
+		r = sc_wait_for_event(ctx, SC_EVENT_CARD_INSERTED, &found, &event, timeout, NULL);
+		if (r == SC_ERROR_EVENT_TIMEOUT) {
+			for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+				found = sc_ctx_get_reader(ctx, i);
+				if (found == NULL || (watched != NULL && found != watched))
+					continue;
+				if (sc_detect_card_presence(found) & SC_READER_CARD_PRESENT)
+					refresh_card_cache(found);
+			}
+			continue;
+		}
+		if (r < 0) {
+			fprintf(stderr, "Error while waiting for a card: %s\n", sc_strerror(r));
+			return 1;
+		}
+		if (watched != NULL && found != watched)
+			continue;
+
+		refresh_card_cache(found);
+		fprintf(stderr, "Waiting for a card to be inserted...\n");
+	}
+}
+
 static int test_update(sc_card_t *in_card)
 {
 	sc_apdu_t apdu;
@@ -1788,6 +2275,7 @@ int main(int argc, char * const argv[])
 	int do_list_skeys = 0;
 	int do_list_apps = 0;
 	int do_dump = 0;
+	int do_dump_json = 0;
 	int do_list_prkeys = 0;
 	int do_list_pubkeys = 0;
 	int do_read_pubkey = 0;
@@ -1854,6 +2342,13 @@ int main(int argc, char * const argv[])
 			do_dump = 1;
 			action_count++;
 			break;
+		case OPT_DUMP_JSON:
+			do_dump_json = 1;
+			action_count++;
+			break;
+		case OPT_JSON_CERTS:
+			opt_json_certs = 1;
+			break;
 		case 'k':
 			do_list_prkeys = 1;
 			action_count++;
@@ -1923,11 +2418,23 @@ int main(int argc, char * const argv[])
 		case OPT_NO_PROMPT:
 			opt_no_prompt = 1;
 			break;
+		case OPT_WATCH:
+			opt_watch = 1;
+			break;
+		case OPT_WATCH_INTERVAL:
+			opt_watch_interval = atoi(optarg);
+			break;
 		}
 	}
 	if (action_count == 0)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 
+	if ((opt_watch && !do_learn_card) || (opt_watch_interval && !opt_watch))
+		util_print_usage_and_die(app_name, options, option_help, NULL);
+
+	if (opt_json_certs && !do_dump_json)
+		util_print_usage_and_die(app_name, options, option_help, NULL);
+
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
 	ctx_param.app_name = app_name;
@@ -1950,21 +2457,7 @@ int main(int argc, char * const argv[])
 	if (verbose)
 		fprintf(stderr, "Trying to find a PKCS#15 compatible card...\n");
 
-        if (opt_bind_to_aid)   {
-		struct sc_aid aid;
-
-		aid.len = sizeof(aid.value);
-		if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len))   {
-			fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
-			return 1;
-		}
-
-		r = sc_pkcs15_bind(card, &aid, &p15card);
-	}
-	else   {
-		r = sc_pkcs15_bind(card, NULL, &p15card);
-	}
-
+	r = bind_card();
 	if (r) {
 		fprintf(stderr, "PKCS#15 binding failed: %s\n", sc_strerror(r));
 		err = 1;
@@ -2046,6 +2539,11 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+	if (do_dump_json) {
+		if ((err = dump_json()))
+			goto end;
+		action_count--;
+	}
 	if (do_change_pin) {
 		if ((err = change_pin()))
 			goto end;
@@ -2056,6 +2554,10 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+	if (opt_watch) {
+		err = watch_and_learn();
+		goto end;
+	}
 	if (do_test_update || do_update) {
  		err = test_update(card);
 		action_count--;
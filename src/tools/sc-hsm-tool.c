@@ -30,6 +30,14 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
 
 /* Requires openssl for dkek import */
 #include <openssl/opensslconf.h>
@@ -55,6 +63,7 @@ static int	opt_wait = 0;
 static char *opt_reader = NULL;
 static char *opt_label = NULL;
 static int	verbose = 0;
+static int	opt_workers = 8;
 
 // Some reasonable maximums
 #define MAX_CERT		4096
@@ -62,13 +71,30 @@ static int	verbose = 0;
 #define MAX_KEY			1024
 #define MAX_WRAPPED_KEY	(MAX_CERT + MAX_PRKD + MAX_KEY)
 
+/*
+ * A key archive starts with this magic, followed by one record per key: the
+ * key reference in one byte, then the key blob as written by --wrap-key,
+ * which is a self-delimiting TLV object
+ */
+static const char archive_magic[] = "SCHSMKA1";
+
+struct key_archive {
+	u8 *data;				/* the records after the magic */
+	size_t len;
+	unsigned int count;
+};
+
 enum {
 	OPT_SO_PIN = 0x100,
 	OPT_PIN,
 	OPT_RETRY,
 	OPT_PASSWORD,
 	OPT_PASSWORD_SHARES_THRESHOLD,
-	OPT_PASSWORD_SHARES_TOTAL
+	OPT_PASSWORD_SHARES_TOTAL,
+	OPT_BACKUP_KEYS,
+	OPT_RESTORE_KEYS,
+	OPT_ALL_READERS,
+	OPT_WORKERS
 };
 
 static const struct option options[] = {
@@ -77,6 +103,10 @@ static const struct option options[] = {
 	{ "import-dkek-share",		1, NULL,		'I' },
 	{ "wrap-key",				1, NULL,		'W' },
 	{ "unwrap-key",				1, NULL,		'U' },
+	{ "backup-keys",			1, NULL,		OPT_BACKUP_KEYS },
+	{ "restore-keys",			1, NULL,		OPT_RESTORE_KEYS },
+	{ "all-readers",			0, NULL,		OPT_ALL_READERS },
+	{ "workers",				1, NULL,		OPT_WORKERS },
 	{ "dkek-shares",			1, NULL,		's' },
 	{ "so-pin",					1, NULL,		OPT_SO_PIN },
 	{ "pin",					1, NULL,		OPT_PIN },
@@ -99,6 +129,10 @@ static const char *option_help[] = {
 	"Import DKEK key share <filename>",
 	"Wrap key and save to <filename>",
 	"Unwrap key read from <filename>",
+	"Wrap all keys and save them to the key archive <filename>",
+	"Unwrap all keys read from the key archive <filename>",
+	"Restore the key archive to the tokens in all readers",
+	"Number of parallel workers of --all-readers [8]",
 	"Number of DKEK shares [No DKEK]",
 	"Define security officer PIN (SO-PIN)",
 	"Define user PIN",
@@ -1052,32 +1086,11 @@ static int wrap_with_tag(u8 tag, u8 *indata, size_t inlen, u8 **outdata, size_t
 
 
 
-static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pin)
+static int verify_user_pin(sc_card_t *card, const char *pin)
 {
-	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
 	struct sc_pin_cmd_data data;
-	sc_path_t path;
-	FILE *out = NULL;
-	u8 fid[2];
-	u8 ef_prkd[MAX_PRKD];
-	u8 ef_cert[MAX_CERT];
-	u8 wrapped_key_buff[MAX_KEY];
-	u8 keyblob[MAX_WRAPPED_KEY];
-	u8 *key;
-	u8 *ptr;
 	char *lpin = NULL;
-	size_t key_len;
-	int r, ef_prkd_len, ef_cert_len;
-
-	if ((keyid < 1) || (keyid > 255)) {
-		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
-		return -1;
-	}
-
-	if (outf == NULL) {
-		fprintf(stderr, "No file name specified for wrapped key\n");
-		return -1;
-	}
+	int r;
 
 	if (pin == NULL) {
 		printf("Enter User PIN : ");
@@ -1096,14 +1109,71 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 
 	r = sc_pin_cmd(card, &data, NULL);
 
+	if (pin == NULL) {
+		free(lpin);
+	}
+
 	if (r < 0) {
 		fprintf(stderr, "PIN verification failed with %s\n", sc_strerror(r));
 		return -1;
 	}
 
-	if (pin == NULL) {
-		free(lpin);
-	}
+	return 0;
+}
+
+
+
+static unsigned long long now_usec(void)
+{
+#if defined(_WIN32)
+	return (unsigned long long) GetTickCount() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+
+static void report_throughput(const char *label, const char *what, unsigned int done, unsigned int total, unsigned long long usec)
+{
+	double secs = usec / 1000000.0;
+
+	fprintf(stderr, "%s: %u of %u keys %s in %.1f s (%.1f keys/s)\n",
+			label, done, total, what, secs, secs > 0 ? done / secs : 0.0);
+}
+
+
+
+/**
+ * Wrap a key and encode it with its PKCS#15 description and certificate,
+ * as written by --wrap-key. The user PIN must have been verified.
+ *
+ * @param card the card
+ * @param keyid the key reference
+ * @param blob pointer to the allocated key blob
+ * @param bloblen the size of the key blob
+ */
+static int wrap_key_blob(sc_card_t *card, int keyid, u8 **blob, size_t *bloblen)
+{
+	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+	sc_path_t path;
+	u8 fid[2];
+	u8 ef_prkd[MAX_PRKD];
+	u8 ef_cert[MAX_CERT];
+	u8 wrapped_key_buff[MAX_KEY];
+	u8 keyblob[MAX_WRAPPED_KEY];
+	u8 *key;
+	u8 *ptr;
+	size_t key_len;
+	int r, ef_prkd_len, ef_cert_len;
 
 	wrapped_key.key_id = keyid;
 	wrapped_key.wrapped_key = wrapped_key_buff;
@@ -1164,8 +1234,11 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 
 	// Encode key in octet string object
 	key_len = 0;
-	wrap_with_tag(0x04, wrapped_key.wrapped_key, wrapped_key.wrapped_key_length,
-						&key, &key_len);
+	if (wrap_with_tag(0x04, wrapped_key.wrapped_key, wrapped_key.wrapped_key_length,
+						&key, &key_len) != SC_SUCCESS) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
 
 	memcpy(ptr, key, key_len);
 	ptr += key_len;
@@ -1184,8 +1257,39 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 	}
 
 	// Encode key, key decription and certificate object in sequence
-	key_len = 0;
-	wrap_with_tag(0x30, keyblob, ptr - keyblob, &key, &key_len);
+	if (wrap_with_tag(0x30, keyblob, ptr - keyblob, blob, bloblen) != SC_SUCCESS) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pin)
+{
+	FILE *out = NULL;
+	u8 *key;
+	size_t key_len;
+
+	if ((keyid < 1) || (keyid > 255)) {
+		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
+		return -1;
+	}
+
+	if (outf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped key\n");
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin)) {
+		return -1;
+	}
+
+	if (wrap_key_blob(card, keyid, &key, &key_len)) {
+		return -1;
+	}
 
 	out = fopen(outf, "wb");
 
@@ -1198,6 +1302,7 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 	if (fwrite(key, 1, key_len, out) != key_len) {
 		perror(outf);
 		free(key);
+		fclose(out);
 		return -1;
 	}
 
@@ -1208,6 +1313,102 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 
 
 
+/**
+ * Wrap all keys of the token into a single key archive
+ *
+ * The card is locked for the whole run, so that the PIN is verified once and
+ * no other application interleaves its commands with the export.
+ */
+static int backup_keys(sc_card_t *card, const char *outf, const char *pin)
+{
+	u8 filelist[4096];
+	u8 *key, keyid;
+	size_t key_len;
+	unsigned int total = 0, done = 0;
+	unsigned long long start;
+	FILE *out = NULL;
+	int r, i, n;
+
+	if (outf == NULL) {
+		fprintf(stderr, "No file name specified for key archive\n");
+		return -1;
+	}
+
+	r = sc_lock(card);
+	if (r < 0) {
+		fprintf(stderr, "Failed to lock card: %s\n", sc_strerror(r));
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin)) {
+		sc_unlock(card);
+		return -1;
+	}
+
+	n = sc_list_files(card, filelist, sizeof(filelist));
+	if (n < 0) {
+		fprintf(stderr, "Listing keys failed with %s\n", sc_strerror(n));
+		sc_unlock(card);
+		return -1;
+	}
+	if (n > (int)sizeof(filelist)) {
+		n = sizeof(filelist);
+	}
+
+	out = fopen(outf, "wb");
+
+	if ((out == NULL) || (fwrite(archive_magic, 1, sizeof(archive_magic) - 1, out) != sizeof(archive_magic) - 1)) {
+		perror(outf);
+		if (out != NULL) {
+			fclose(out);
+		}
+		sc_unlock(card);
+		return -1;
+	}
+
+	start = now_usec();
+
+	// Key reference 0 is the device authentication key, which can not be wrapped
+	for (i = 0; i + 1 < n; i += 2) {
+		if ((filelist[i] != KEY_PREFIX) || (filelist[i + 1] == 0)) {
+			continue;
+		}
+
+		keyid = filelist[i + 1];
+		total++;
+
+		if (wrap_key_blob(card, keyid, &key, &key_len)) {
+			fprintf(stderr, "Key %d not added to archive\n", keyid);
+			continue;
+		}
+
+		if ((fwrite(&keyid, 1, 1, out) != 1) || (fwrite(key, 1, key_len, out) != key_len)) {
+			perror(outf);
+			free(key);
+			break;
+		}
+
+		free(key);
+		done++;
+
+		if (verbose) {
+			fprintf(stderr, "Key %d wrapped (%u so far)\n", keyid, done);
+		}
+	}
+
+	report_throughput(outf, "wrapped", done, total, now_usec() - start);
+
+	if (fclose(out) != 0) {
+		perror(outf);
+		done = 0;
+	}
+
+	sc_unlock(card);
+	return done == total ? 0 : -1;
+}
+
+
+
 static int update_ef(sc_card_t *card, u8 prefix, u8 id, int erase, const u8 *buf, size_t buflen)
 {
 	sc_file_t *file = NULL;
@@ -1247,43 +1448,23 @@ static int update_ef(sc_card_t *card, u8 prefix, u8 id, int erase, const u8 *buf
 
 
 
-static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *pin, int force)
+/**
+ * Decode a key blob as written by --wrap-key
+ *
+ * @param keyblob the key blob
+ * @param keybloblen the size of the key blob
+ * @param wrapped_key the wrapped key, pointing into keyblob
+ * @param prkd the private key description, pointing into keyblob
+ * @param prkd_len the size of the private key description or 0
+ * @param cert the certificate, pointing into keyblob
+ * @param cert_len the size of the certificate or 0
+ */
+static int parse_key_blob(const u8 *keyblob, size_t keybloblen, sc_cardctl_sc_hsm_wrapped_key_t *wrapped_key,
+		const u8 **prkd, size_t *prkd_len, const u8 **cert, size_t *cert_len)
 {
-	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
-	struct sc_pin_cmd_data data;
-	u8 keyblob[MAX_WRAPPED_KEY];
-	const u8 *ptr,*prkd,*cert;
-	FILE *in = NULL;
-	sc_path_t path;
-	u8 fid[2];
-	char *lpin = NULL;
+	const u8 *ptr;
 	unsigned int cla, tag;
-	int r, keybloblen;
-	size_t len, olen, prkd_len, cert_len;
-
-	if ((keyid < 1) || (keyid > 255)) {
-		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
-		return -1;
-	}
-
-	if (inf == NULL) {
-		fprintf(stderr, "No file name specified for wrapped key\n");
-		return -1;
-	}
-
-	in = fopen(inf, "rb");
-
-	if (in == NULL) {
-		perror(inf);
-		return -1;
-	}
-
-	if ((keybloblen = fread(keyblob, 1, sizeof(keyblob), in)) < 0) {
-		perror(inf);
-		return -1;
-	}
-
-	fclose(in);
+	size_t len, olen;
 
 	ptr = keyblob;
 	if ((sc_asn1_read_tag(&ptr, keybloblen, &cla, &tag, &len) != SC_SUCCESS) ||
@@ -1300,27 +1481,29 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		return -1;
 	}
 
-	wrapped_key.wrapped_key = (u8 *)ptr;
-	wrapped_key.wrapped_key_length = olen;
+	wrapped_key->wrapped_key = (u8 *)ptr;
+	wrapped_key->wrapped_key_length = olen;
 
 	ptr += olen;
-	prkd = ptr;
-	prkd_len = determineLength(ptr, keybloblen - (ptr - keyblob));
+	*prkd = ptr;
+	*prkd_len = determineLength(ptr, keybloblen - (ptr - keyblob));
+
+	ptr += *prkd_len;
+	*cert = ptr;
+	*cert_len = determineLength(ptr, keybloblen - (ptr - keyblob));
+
+	return 0;
+}
 
-	ptr += prkd_len;
-	cert = ptr;
-	cert_len = determineLength(ptr, keybloblen - (ptr - keyblob));
 
-	printf("Wrapped key contains:\n");
-	printf("  Key blob\n");
-	if (prkd_len > 0) {
-		printf("  Private Key Description (PRKD)\n");
-	}
-	if (cert_len > 0) {
-		printf("  Certificate\n");
-	}
 
-	if ((prkd_len > 0) && !force) {
+static int check_key_reference_unused(sc_card_t *card, int keyid, size_t prkd_len, size_t cert_len)
+{
+	sc_path_t path;
+	u8 fid[2];
+	int r;
+
+	if (prkd_len > 0) {
 		fid[0] = PRKD_PREFIX;
 		fid[1] = (unsigned char)keyid;
 
@@ -1334,7 +1517,7 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		}
 	}
 
-	if ((cert_len > 0) && !force) {
+	if (cert_len > 0) {
 		fid[0] = EE_CERTIFICATE_PREFIX;
 		fid[1] = (unsigned char)keyid;
 
@@ -1348,31 +1531,21 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		}
 	}
 
-	if (pin == NULL) {
-		printf("Enter User PIN : ");
-		util_getpass(&lpin, NULL, stdin);
-		printf("\n");
-	} else {
-		lpin = (char *)pin;
-	}
-
-	memset(&data, 0, sizeof(data));
-	data.cmd = SC_PIN_CMD_VERIFY;
-	data.pin_type = SC_AC_CHV;
-	data.pin_reference = ID_USER_PIN;
-	data.pin1.data = (u8 *)lpin;
-	data.pin1.len = strlen(lpin);
+	return 0;
+}
 
-	r = sc_pin_cmd(card, &data, NULL);
 
-	if (r < 0) {
-		fprintf(stderr, "PIN verification failed with %s\n", sc_strerror(r));
-		return -1;
-	}
 
-	if (pin == NULL) {
-		free(lpin);
-	}
+/**
+ * Unwrap a decoded key blob and store its PKCS#15 description and certificate.
+ * The user PIN must have been verified.
+ */
+static int import_key_blob(sc_card_t *card, int keyid, sc_cardctl_sc_hsm_wrapped_key_t *wrapped_key,
+		const u8 *prkd, size_t prkd_len, const u8 *cert, size_t cert_len, int force)
+{
+	sc_path_t path;
+	u8 fid[2];
+	int r;
 
 	if (force) {
 		fid[0] = KEY_PREFIX;
@@ -1382,9 +1555,9 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		sc_delete_file(card, &path);
 	}
 
-	wrapped_key.key_id = keyid;
+	wrapped_key->key_id = keyid;
 
-	r = sc_card_ctl(card, SC_CARDCTL_SC_HSM_UNWRAP_KEY, (void *)&wrapped_key);
+	r = sc_card_ctl(card, SC_CARDCTL_SC_HSM_UNWRAP_KEY, (void *)wrapped_key);
 
 	if (r == SC_ERROR_INS_NOT_SUPPORTED) {			// Not supported or not initialized for key shares
 		fprintf(stderr, "Card not initialized for key wrap\n");
@@ -1419,12 +1592,338 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		}
 	}
 
+	return 0;
+}
+
+
+
+static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *pin, int force)
+{
+	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+	u8 keyblob[MAX_WRAPPED_KEY];
+	const u8 *prkd,*cert;
+	FILE *in = NULL;
+	int keybloblen;
+	size_t prkd_len, cert_len;
+
+	if ((keyid < 1) || (keyid > 255)) {
+		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
+		return -1;
+	}
+
+	if (inf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped key\n");
+		return -1;
+	}
+
+	in = fopen(inf, "rb");
+
+	if (in == NULL) {
+		perror(inf);
+		return -1;
+	}
+
+	if ((keybloblen = fread(keyblob, 1, sizeof(keyblob), in)) < 0) {
+		perror(inf);
+		return -1;
+	}
+
+	fclose(in);
+
+	if (parse_key_blob(keyblob, keybloblen, &wrapped_key, &prkd, &prkd_len, &cert, &cert_len)) {
+		return -1;
+	}
+
+	printf("Wrapped key contains:\n");
+	printf("  Key blob\n");
+	if (prkd_len > 0) {
+		printf("  Private Key Description (PRKD)\n");
+	}
+	if (cert_len > 0) {
+		printf("  Certificate\n");
+	}
+
+	if (!force && check_key_reference_unused(card, keyid, prkd_len, cert_len)) {
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin)) {
+		return -1;
+	}
+
+	if (import_key_blob(card, keyid, &wrapped_key, prkd, prkd_len, cert, cert_len, force)) {
+		return -1;
+	}
+
 	printf("Key successfully imported\n");
 	return 0;
 }
 
 
 
+/**
+ * Read a key archive written by --backup-keys and check its records
+ *
+ * @param inf the file name
+ * @param archive the key archive, with the allocated records following the magic
+ */
+static int load_key_archive(const char *inf, struct key_archive *archive)
+{
+	char hdr[sizeof(archive_magic) - 1];
+	FILE *in = NULL;
+	u8 *data = NULL, *tmp;
+	size_t len = 0, size = 0, n, rec;
+
+	memset(archive, 0, sizeof(*archive));
+
+	if (inf == NULL) {
+		fprintf(stderr, "No file name specified for key archive\n");
+		return -1;
+	}
+
+	in = fopen(inf, "rb");
+
+	if (in == NULL) {
+		perror(inf);
+		return -1;
+	}
+
+	if ((fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr)) || memcmp(hdr, archive_magic, sizeof(hdr))) {
+		fprintf(stderr, "%s is not a key archive\n", inf);
+		fclose(in);
+		return -1;
+	}
+
+	do	{
+		if (len == size) {
+			size += 0x10000;
+			tmp = realloc(data, size);
+			if (tmp == NULL) {
+				fprintf(stderr, "Not enough memory\n");
+				free(data);
+				fclose(in);
+				return -1;
+			}
+			data = tmp;
+		}
+		n = fread(data + len, 1, size - len, in);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(in)) {
+		perror(inf);
+		free(data);
+		fclose(in);
+		return -1;
+	}
+
+	fclose(in);
+
+	archive->data = data;
+	archive->len = len;
+
+	// Each record is the key reference followed by a self-delimiting key blob
+	for (n = 0; n < len; n += 1 + rec) {
+		rec = n + 1 < len ? determineLength(data + n + 1, len - n - 1) : 0;
+
+		if ((data[n] == 0) || (rec == 0) || (rec > len - n - 1)) {
+			fprintf(stderr, "Invalid key archive format (Record %u).\n", archive->count + 1);
+			free(data);
+			memset(archive, 0, sizeof(*archive));
+			return -1;
+		}
+
+		archive->count++;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Unwrap all keys of a key archive into the token, holding the card lock for
+ * the whole run. Progress and throughput are reported on stderr, prefixed
+ * with label.
+ */
+static int restore_keys(sc_card_t *card, const char *label, const struct key_archive *archive, const char *pin, int force)
+{
+	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+	const u8 *prkd, *cert;
+	size_t prkd_len, cert_len, rec, n;
+	unsigned int done = 0, seen = 0;
+	unsigned long long start;
+	int r, keyid;
+
+	r = sc_lock(card);
+	if (r < 0) {
+		fprintf(stderr, "%s: Failed to lock card: %s\n", label, sc_strerror(r));
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin)) {
+		sc_unlock(card);
+		return -1;
+	}
+
+	start = now_usec();
+
+	for (n = 0; n < archive->len; n += 1 + rec) {
+		keyid = archive->data[n];
+		rec = determineLength(archive->data + n + 1, archive->len - n - 1);
+		seen++;
+
+		if (parse_key_blob(archive->data + n + 1, rec, &wrapped_key, &prkd, &prkd_len, &cert, &cert_len) ||
+				(!force && check_key_reference_unused(card, keyid, prkd_len, cert_len)) ||
+				import_key_blob(card, keyid, &wrapped_key, prkd, prkd_len, cert, cert_len, force)) {
+			fprintf(stderr, "%s: key %d failed (%u/%u)\n", label, keyid, seen, archive->count);
+			continue;
+		}
+
+		done++;
+
+		if (verbose) {
+			fprintf(stderr, "%s: key %d restored (%u/%u)\n", label, keyid, seen, archive->count);
+		}
+	}
+
+	report_throughput(label, "restored", done, archive->count, now_usec() - start);
+
+	sc_unlock(card);
+	return done == archive->count ? 0 : -1;
+}
+
+
+
+#ifndef _WIN32
+/* A worker has its own context, and so its own PC/SC connection: it must
+ * not use the one of the parent. It handles every n-th reader. */
+static void restore_worker(char **names, size_t count, size_t first, size_t step,
+		const struct key_archive *archive, const char *pin, int force)
+{
+	sc_context_param_t ctx_param;
+	sc_context_t *wctx = NULL;
+	sc_card_t *wcard;
+	sc_reader_t *reader;
+	sc_path_t path;
+	size_t i;
+	int r, failed = 0;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = app_name;
+	if (sc_context_create(&wctx, &ctx_param) != SC_SUCCESS)
+		_exit(2);
+
+	for (i = first; i < count; i += step) {
+		wcard = NULL;
+		reader = sc_ctx_get_reader_by_name(wctx, names[i]);
+		if (reader == NULL)
+			r = SC_ERROR_NO_READERS_FOUND;
+		else
+			r = sc_connect_card(reader, &wcard);
+
+		if (r == SC_SUCCESS) {
+			sc_path_set(&path, SC_PATH_TYPE_DF_NAME, sc_hsm_aid.value, sc_hsm_aid.len, 0, 0);
+			r = sc_select_file(wcard, &path, NULL);
+		}
+
+		if (r != SC_SUCCESS) {
+			fprintf(stderr, "%s: %s\n", names[i], sc_strerror(r));
+			failed = 1;
+		} else if (restore_keys(wcard, names[i], archive, pin, force)) {
+			failed = 1;
+		}
+
+		if (wcard != NULL)
+			sc_disconnect_card(wcard);
+	}
+
+	sc_release_context(wctx);
+	_exit(failed);
+}
+
+
+
+/*
+ * Restore a key archive into the tokens in all readers with a card, using up
+ * to opt_workers processes at a time
+ */
+static int restore_all_readers(const char *inf, const char *pin, int force)
+{
+	struct key_archive archive;
+	unsigned int i, rcount = sc_ctx_get_reader_count(ctx);
+	unsigned long long start;
+	char **names, *lpin = NULL;
+	size_t count = 0, workers, w;
+	pid_t *pids;
+	int status, err = 0;
+
+	if (load_key_archive(inf, &archive)) {
+		return 1;
+	}
+
+	names = calloc(rcount + 1, sizeof(char *));
+	pids = calloc(opt_workers, sizeof(pid_t));
+	if (names == NULL || pids == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		err = 1;
+		goto out;
+	}
+
+	sc_refresh_readers(ctx);
+	for (i = 0; i < rcount; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (reader != NULL && (sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			names[count++] = reader->name;
+	}
+	fprintf(stderr, "Restoring %u keys to %lu tokens\n", archive.count, (unsigned long) count);
+	if (count == 0)
+		goto out;
+
+	// Ask once, as the workers can not share the terminal
+	if (pin == NULL) {
+		printf("Enter User PIN : ");
+		util_getpass(&lpin, NULL, stdin);
+		printf("\n");
+		pin = lpin;
+	}
+
+	start = now_usec();
+	fflush(stdout);
+	workers = count < (size_t) opt_workers ? count : (size_t) opt_workers;
+	for (w = 0; w < workers; w++) {
+		pids[w] = fork();
+		if (pids[w] == 0)
+			restore_worker(names, count, w, workers, &archive, pin, force);
+		if (pids[w] < 0) {
+			perror("fork");
+			err = 1;
+			break;
+		}
+	}
+
+	while (w-- > 0)
+		if (waitpid(pids[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			err = 1;
+
+	fprintf(stderr, "%lu tokens done in %.1f s%s\n", (unsigned long) count,
+			(now_usec() - start) / 1000000.0, err ? ", with errors" : "");
+
+out:
+	if (lpin != NULL) {
+		sc_mem_clear(lpin, strlen(lpin));
+		free(lpin);
+	}
+	free(archive.data);
+	free(names);
+	free(pids);
+	return err;
+}
+#endif
+
+
+
 int main(int argc, char * const argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -1434,6 +1933,9 @@ int main(int argc, char * const argv[])
 	int do_create_dkek_share = 0;
 	int do_wrap_key = 0;
 	int do_unwrap_key = 0;
+	int do_backup_keys = 0;
+	int do_restore_keys = 0;
+	int opt_all_readers = 0;
 	sc_path_t path;
 	sc_file_t *file = NULL;
 	const char *opt_so_pin = NULL;
@@ -1483,6 +1985,24 @@ int main(int argc, char * const argv[])
 			opt_filename = optarg;
 			action_count++;
 			break;
+		case OPT_BACKUP_KEYS:
+			do_backup_keys = 1;
+			opt_filename = optarg;
+			action_count++;
+			break;
+		case OPT_RESTORE_KEYS:
+			do_restore_keys = 1;
+			opt_filename = optarg;
+			action_count++;
+			break;
+		case OPT_ALL_READERS:
+			opt_all_readers = 1;
+			break;
+		case OPT_WORKERS:
+			opt_workers = atoi(optarg);
+			if (opt_workers < 1)
+				opt_workers = 1;
+			break;
 		case OPT_PASSWORD:
 			opt_password = optarg;
 			break;
@@ -1544,6 +2064,21 @@ int main(int argc, char * const argv[])
 		sc_ctx_log_to_file(ctx, "stderr");
 	}
 
+	if (opt_all_readers) {
+		if (!do_restore_keys || action_count != 1) {
+			fprintf(stderr, "--all-readers can only be used with --restore-keys\n");
+			err = 1;
+			goto end;
+		}
+#ifndef _WIN32
+		err = restore_all_readers(opt_filename, opt_pin, opt_force);
+#else
+		fprintf(stderr, "--all-readers is not supported on this platform\n");
+		err = 1;
+#endif
+		goto end;
+	}
+
 	r = util_connect_card(ctx, &card, opt_reader, opt_wait, verbose);
 	if (r != SC_SUCCESS) {
 		if (r < 0) {
@@ -1575,6 +2110,20 @@ int main(int argc, char * const argv[])
 	if (do_unwrap_key && unwrap_key(card, opt_key_reference, opt_filename, opt_pin, opt_force))
 		goto fail;
 
+	if (do_backup_keys && backup_keys(card, opt_filename, opt_pin))
+		goto fail;
+
+	if (do_restore_keys) {
+		struct key_archive archive;
+
+		if (load_key_archive(opt_filename, &archive))
+			goto fail;
+		r = restore_keys(card, card->reader->name, &archive, opt_pin, opt_force);
+		free(archive.data);
+		if (r)
+			goto fail;
+	}
+
 	if (action_count == 0) {
 		print_info(card, file);
 	}